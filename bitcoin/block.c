@@ -1,40 +1,158 @@
 #include "bitcoin/block.h"
 #include "bitcoin/pullpush.h"
 #include "bitcoin/tx.h"
+#include "utils.h"
+#include <assert.h>
 #include <ccan/str/hex/hex.h>
+#include <string.h>
+
+struct bitcoin_block_stream {
+	struct bitcoin_block *b;
+	/* Bytes in b->txs, and how many of those are txs we've checked. */
+	size_t len, checked;
+	varint_t num_checked;
+	bool have_hdr, bad;
+};
+
+struct bitcoin_block_stream *bitcoin_block_stream_new(const tal_t *ctx,
+						      size_t size)
+{
+	struct bitcoin_block_stream *s = tal(ctx, struct bitcoin_block_stream);
+
+	s->b = tal(s, struct bitcoin_block);
+	s->b->num_txs = 0;
+	s->b->txs = tal_arr(s->b, u8, size ? size : 1024);
+	s->len = s->checked = 0;
+	s->num_checked = 0;
+	s->have_hdr = s->bad = false;
+	return s;
+}
+
+/* Encoding is <blockhdr> <varint-num-txs> <tx>...: we check each tx as soon
+ * as it's all there, so nobody else has to. */
+static void parse_more(struct bitcoin_block_stream *s, bool all)
+{
+	struct bitcoin_block *b = s->b;
+	const u8 *p;
+	size_t len;
+
+	if (!s->have_hdr) {
+		/* Enough for any varint, unless that's all there is. */
+		if (!all && s->len < sizeof(b->hdr) + 9)
+			return;
+		p = b->txs;
+		len = s->len;
+		pull(&p, &len, &b->hdr, sizeof(b->hdr));
+		b->num_txs = pull_varint(&p, &len);
+		if (!p) {
+			s->bad = true;
+			return;
+		}
+		/* Keep just the txs: we look at them in place later. */
+		memmove(b->txs, p, len);
+		s->len = len;
+		s->have_hdr = true;
+	}
+
+	while (s->num_checked < b->num_txs) {
+		struct bitcoin_tx_view view;
+
+		p = b->txs + s->checked;
+		len = s->len - s->checked;
+		if (!pull_bitcoin_tx_view(&p, &len, &view)) {
+			/* Maybe the rest of it hasn't arrived yet. */
+			if (all)
+				s->bad = true;
+			return;
+		}
+		s->checked = p - b->txs;
+		s->num_checked++;
+	}
+
+	/* We should end up not overrunning, nor have extra */
+	if (s->len != s->checked)
+		s->bad = true;
+}
+
+bool bitcoin_block_stream_add(struct bitcoin_block_stream *s,
+			      const char *hex, size_t hexlen)
+{
+	size_t len = hex_data_size(hexlen), max = tal_count(s->b->txs);
+
+	assert(hexlen % 2 == 0);
+	if (s->bad)
+		return false;
+
+	if (s->len + len > max) {
+		while (s->len + len > max)
+			max *= 2;
+		tal_resize(&s->b->txs, max);
+	}
+	if (!hex_decode_fast(hex, hexlen, s->b->txs + s->len, len)) {
+		s->bad = true;
+		return false;
+	}
+	s->len += len;
+	parse_more(s, false);
+	return !s->bad;
+}
+
+struct bitcoin_block *bitcoin_block_stream_done(const tal_t *ctx,
+						struct bitcoin_block_stream *s)
+{
+	struct bitcoin_block *b;
+
+	if (!s->bad)
+		parse_more(s, true);
+	if (s->bad)
+		return NULL;
+
+	b = tal_steal(ctx, s->b);
+	tal_resize(&b->txs, s->len);
+	s->b = NULL;
+	s->bad = true;
+	return b;
+}
 
-/* Encoding is <blockhdr> <varint-num-txs> <tx>... */
 struct bitcoin_block *bitcoin_block_from_hex(const tal_t *ctx,
 					     const char *hex, size_t hexlen)
 {
+	struct bitcoin_block_stream *s;
 	struct bitcoin_block *b;
-	u8 *linear_tx;
-	const u8 *p;
-	size_t len, i, num;
 
 	if (hexlen && hex[hexlen-1] == '\n')
 		hexlen--;
 
-	/* Set up the block for success. */
-	b = tal(ctx, struct bitcoin_block);
+	/* Odd lengths aren't hex. */
+	if (hexlen % 2)
+		return NULL;
 
-	/* De-hex the array. */
-	len = hex_data_size(hexlen);
-	p = linear_tx = tal_arr(ctx, u8, len);
-	if (!hex_decode(hex, hexlen, linear_tx, len))
-		return tal_free(b);
+	/* All in one go: it's the same as decoding as it arrives. */
+	s = bitcoin_block_stream_new(ctx, hex_data_size(hexlen));
+	if (bitcoin_block_stream_add(s, hex, hexlen))
+		b = bitcoin_block_stream_done(ctx, s);
+	else
+		b = NULL;
+	tal_free(s);
+	return b;
+}
 
-	pull(&p, &len, &b->hdr, sizeof(b->hdr));
-	num = pull_varint(&p, &len);
-	b->tx = tal_arr(b, struct bitcoin_tx *, num);
-	for (i = 0; i < num; i++)
-		b->tx[i] = pull_bitcoin_tx(b->tx, &p, &len);
+struct bitcoin_block *bitcoin_block_hdr_from_hex(const tal_t *ctx,
+						 const char *hex,
+						 size_t hexlen)
+{
+	struct bitcoin_block *b;
 
-	/* We should end up not overrunning, nor have extra */
-	if (!p || len)
+	if (hexlen && hex[hexlen-1] == '\n')
+		hexlen--;
+
+	b = tal(ctx, struct bitcoin_block);
+	if (hex_data_size(hexlen) != sizeof(b->hdr)
+	    || !hex_decode_fast(hex, hexlen, &b->hdr, sizeof(b->hdr)))
 		return tal_free(b);
 
-	tal_free(linear_tx);
+	b->num_txs = 0;
+	b->txs = tal_arr(b, u8, 0);
 	return b;
 }
 
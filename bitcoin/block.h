@@ -2,6 +2,7 @@
 #define LIGHTNING_BITCOIN_BLOCK_H
 #include "config.h"
 #include "bitcoin/shadouble.h"
+#include "bitcoin/varint.h"
 #include <ccan/endian/endian.h>
 #include <ccan/short_types/short_types.h>
 #include <ccan/tal/tal.h>
@@ -18,13 +19,32 @@ struct bitcoin_block_hdr {
 
 struct bitcoin_block {
 	struct bitcoin_block_hdr hdr;
-	/* tal_count shows now many */
-	struct bitcoin_tx **tx;
+	/* The txs, still linearized (tal array): see pull_bitcoin_tx_view() */
+	varint_t num_txs;
+	u8 *txs;
 };
 
 struct bitcoin_block *bitcoin_block_from_hex(const tal_t *ctx,
 					     const char *hex, size_t hexlen);
 
+/* To decode a block as its hex arrives, rather than all at once: size is
+ * how many bytes to expect (or 0 if you don't know). */
+struct bitcoin_block_stream *bitcoin_block_stream_new(const tal_t *ctx,
+						      size_t size);
+
+/* hexlen must be even.  False if it's not hex, or not a block. */
+bool bitcoin_block_stream_add(struct bitcoin_block_stream *s,
+			      const char *hex, size_t hexlen);
+
+/* The block, if that was all of it: the stream is spent either way. */
+struct bitcoin_block *bitcoin_block_stream_done(const tal_t *ctx,
+						struct bitcoin_block_stream *s);
+
+/* Just the header (as from getblockheader): num_txs is 0. */
+struct bitcoin_block *bitcoin_block_hdr_from_hex(const tal_t *ctx,
+						 const char *hex,
+						 size_t hexlen);
+
 /* Parse hex string to get blockid (reversed, a-la bitcoind). */
 bool bitcoin_blkid_from_hex(const char *hexstr, size_t hexstr_len,
 			    struct sha256_double *blockid);
@@ -5,18 +5,59 @@
 #include <ccan/mem/mem.h>
 #include <ccan/str/hex/hex.h>
 #include <ccan/structeq/structeq.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Parsing means a square root, and we see the same few keys (peers, nodes)
+ * over and over.  Direct-mapped: a clash just costs a parse. */
+#define PUBKEY_CACHE_SIZE 2048
+
+struct pubkey_cache_entry {
+	/* der[0] is 0 if unused: real keys start with 2 or 3. */
+	u8 der[PUBKEY_DER_LEN];
+	struct pubkey key;
+};
+
+/* Each thread gets its own (in practice only the main one parses keys). */
+static __thread struct pubkey_cache_entry *pubkey_cache;
+
+static struct pubkey_cache_entry *pubkey_cache_entry(const u8 *der)
+{
+	size_t idx;
+
+	if (!pubkey_cache) {
+		pubkey_cache = calloc(PUBKEY_CACHE_SIZE, sizeof(*pubkey_cache));
+		if (!pubkey_cache)
+			return NULL;
+	}
+
+	/* der[1] onwards is the x coordinate: as good as random. */
+	idx = ((size_t)der[1] << 8 | der[2]) % PUBKEY_CACHE_SIZE;
+	return &pubkey_cache[idx];
+}
 
 bool pubkey_from_der(secp256k1_context *secpctx,
 		     const u8 *der, size_t len,
 		     struct pubkey *key)
 {
+	struct pubkey_cache_entry *e;
+
 	if (len != PUBKEY_DER_LEN)
 		return false;
 
-	if (!secp256k1_ec_pubkey_parse(secpctx, &key->pubkey,
-				       memcheck(der, len), len))
+	e = pubkey_cache_entry(memcheck(der, len));
+	if (e && memcmp(e->der, der, len) == 0) {
+		*key = e->key;
+		return true;
+	}
+
+	if (!secp256k1_ec_pubkey_parse(secpctx, &key->pubkey, der, len))
 		return false;
 
+	if (e) {
+		memcpy(e->der, der, len);
+		e->key = *key;
+	}
 	return true;
 }
 
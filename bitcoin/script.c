@@ -4,6 +4,7 @@
 #include "signature.h"
 #include "tx.h"
 #include <assert.h>
+#include <ccan/build_assert/build_assert.h>
 #include <ccan/crypto/ripemd160/ripemd160.h>
 #include <ccan/crypto/sha256/sha256.h>
 #include <ccan/endian/endian.h>
@@ -15,6 +16,7 @@
 #define OP_PUSHDATA1	0x4C
 #define OP_PUSHDATA2	0x4D
 #define OP_PUSHDATA4	0x4E
+#define OP_2		0x52
 #define OP_NOP		0x61
 #define OP_IF		0x63
 #define OP_NOTIF	0x64
@@ -48,6 +50,19 @@
 #define OP_CHECKLOCKTIMEVERIFY	0x61
 #endif
 
+/* Scripts are built on the stack, then copied out in one allocation:
+ * tal_resize for every opcode adds up on the commit path. */
+struct script {
+	size_t len;
+	/* Comfortably more than any script we make. */
+	u8 buf[256];
+};
+
+static u8 *script_done(const tal_t *ctx, const struct script *script)
+{
+	return tal_dup_arr(ctx, u8, script->buf, script->len, 0);
+}
+
 /* Bitcoin's OP_HASH160 is RIPEMD(SHA256()) */
 static void hash160(struct ripemd160 *redeemhash, const void *mem, size_t len)
 {
@@ -57,40 +72,40 @@ static void hash160(struct ripemd160 *redeemhash, const void *mem, size_t len)
 	ripemd160(redeemhash, h.u.u8, sizeof(h));
 }
 
-static void add(u8 **scriptp, const void *mem, size_t len)
+static void add(struct script *script, const void *mem, size_t len)
 {
-	size_t oldlen = tal_count(*scriptp);
-	tal_resize(scriptp, oldlen + len);
-	memcpy(*scriptp + oldlen, mem, len);
+	assert(script->len + len <= sizeof(script->buf));
+	memcpy(script->buf + script->len, mem, len);
+	script->len += len;
 }
 
-static void add_op(u8 **scriptp, u8 op)
+static void add_op(struct script *script, u8 op)
 {
-	add(scriptp, &op, 1);
+	add(script, &op, 1);
 }
 
-static void add_push_bytes(u8 **scriptp, const void *mem, size_t len)
+static void add_push_bytes(struct script *script, const void *mem, size_t len)
 {
 	if (len < 76)
-		add_op(scriptp, OP_PUSHBYTES(len));
+		add_op(script, OP_PUSHBYTES(len));
 	else if (len < 256) {
 		char c = len;
-		add_op(scriptp, OP_PUSHDATA1);
-		add(scriptp, &c, 1);
+		add_op(script, OP_PUSHDATA1);
+		add(script, &c, 1);
 	} else if (len < 65536) {
 		le16 v = cpu_to_le16(len);
-		add_op(scriptp, OP_PUSHDATA2);
-		add(scriptp, &v, 2);
+		add_op(script, OP_PUSHDATA2);
+		add(script, &v, 2);
 	} else {
 		le32 v = cpu_to_le32(len);
-		add_op(scriptp, OP_PUSHDATA4);
-		add(scriptp, &v, 4);
+		add_op(script, OP_PUSHDATA4);
+		add(script, &v, 4);
 	}
 
-	add(scriptp, memcheck(mem, len), len);
+	add(script, memcheck(mem, len), len);
 }
 
-static void add_number(u8 **script, u32 num)
+static void add_number(struct script *script, u32 num)
 {
 	if (num == 0)
 		add_op(script, 0);
@@ -110,16 +125,146 @@ static void add_number(u8 **script, u32 num)
 	}
 }
 
-static void add_push_key(u8 **scriptp,
+static void add_push_key(struct script *script,
 			 secp256k1_context *secpctx,
 			 const struct pubkey *key)
 {
 	u8 der[PUBKEY_DER_LEN];
 	pubkey_to_der(secpctx, der, key);
 
-	add_push_bytes(scriptp, der, sizeof(der));
+	add_push_bytes(script, der, sizeof(der));
 }
 
+/* Copy in a template's fixed bytes; the caller fills its holes. */
+static void *add_tmpl(struct script *script, const void *tmpl, size_t len)
+{
+	u8 *p = script->buf + script->len;
+
+	add(script, tmpl, len);
+	return p;
+}
+
+static void fill_key(u8 hole[PUBKEY_DER_LEN],
+		     secp256k1_context *secpctx, const struct pubkey *key)
+{
+	pubkey_to_der(secpctx, hole, key);
+}
+
+static void fill_ripemd(u8 hole[sizeof(struct ripemd160)],
+			const struct sha256 *hash)
+{
+	struct ripemd160 ripemd;
+
+	ripemd160(&ripemd, hash->u.u8, sizeof(hash->u));
+	memcpy(hole, &ripemd, sizeof(ripemd));
+}
+
+/* Each script below is a few fixed runs of bytes, with holes for its keys
+ * and hashes.  Locktimes are minimally-encoded numbers (anything else is
+ * non-standard), so their length varies and a template ends at each one.
+ * All the members are u8 arrays, so there is no padding: offsetof() is
+ * where each hole sits in the script. */
+#define KEY_HOLE	{ 0 }
+#define HASH_HOLE	{ 0 }
+#define PUSH_32		0x01, 32
+
+static const struct tmpl_2of2 {
+	u8 head[2];
+	u8 key1[PUBKEY_DER_LEN];
+	u8 push_key2[1];
+	u8 key2[PUBKEY_DER_LEN];
+	u8 tail[2];
+} tmpl_2of2 = {
+	{ OP_2, OP_PUSHBYTES(PUBKEY_DER_LEN) }, KEY_HOLE,
+	{ OP_PUSHBYTES(PUBKEY_DER_LEN) }, KEY_HOLE,
+	{ OP_2, OP_CHECKMULTISIG }
+};
+
+/* ... OP_ELSE <abstimeout> OP_CHECKLOCKTIMEVERIFY <locktime> ... */
+static const struct tmpl_htlc_send_head {
+	u8 head[7];
+	u8 rhash[sizeof(struct ripemd160)];
+	u8 push_revoke[3];
+	u8 revoke[sizeof(struct ripemd160)];
+	u8 push_theirkey[4];
+	u8 theirkey[PUBKEY_DER_LEN];
+	u8 tail[1];
+} tmpl_htlc_send_head = {
+	{ OP_SIZE, PUSH_32, OP_EQUALVERIFY, OP_HASH160, OP_DUP,
+	  OP_PUSHBYTES(sizeof(struct ripemd160)) }, HASH_HOLE,
+	{ OP_EQUAL, OP_SWAP, OP_PUSHBYTES(sizeof(struct ripemd160)) },
+	HASH_HOLE,
+	{ OP_EQUAL, OP_ADD, OP_IF, OP_PUSHBYTES(PUBKEY_DER_LEN) }, KEY_HOLE,
+	{ OP_ELSE }
+};
+
+static const struct tmpl_htlc_send_tail {
+	u8 head[3];
+	u8 ourkey[PUBKEY_DER_LEN];
+	u8 tail[2];
+} tmpl_htlc_send_tail = {
+	{ OP_CHECKSEQUENCEVERIFY, OP_2DROP, OP_PUSHBYTES(PUBKEY_DER_LEN) },
+	KEY_HOLE,
+	{ OP_ENDIF, OP_CHECKSIG }
+};
+
+/* ... OP_IF <locktime> OP_CHECKSEQUENCEVERIFY ... OP_NOTIF <abstimeout> ... */
+static const struct tmpl_htlc_recv_head {
+	u8 head[7];
+	u8 rhash[sizeof(struct ripemd160)];
+	u8 tail[2];
+} tmpl_htlc_recv_head = {
+	{ OP_SIZE, PUSH_32, OP_EQUALVERIFY, OP_HASH160, OP_DUP,
+	  OP_PUSHBYTES(sizeof(struct ripemd160)) }, HASH_HOLE,
+	{ OP_EQUAL, OP_IF }
+};
+
+static const struct tmpl_htlc_recv_mid {
+	u8 head[3];
+	u8 ourkey[PUBKEY_DER_LEN];
+	u8 push_revoke[2];
+	u8 revoke[sizeof(struct ripemd160)];
+	u8 tail[2];
+} tmpl_htlc_recv_mid = {
+	{ OP_CHECKSEQUENCEVERIFY, OP_2DROP, OP_PUSHBYTES(PUBKEY_DER_LEN) },
+	KEY_HOLE,
+	{ OP_ELSE, OP_PUSHBYTES(sizeof(struct ripemd160)) }, HASH_HOLE,
+	{ OP_EQUAL, OP_NOTIF }
+};
+
+static const struct tmpl_htlc_recv_tail {
+	u8 head[4];
+	u8 theirkey[PUBKEY_DER_LEN];
+	u8 tail[2];
+} tmpl_htlc_recv_tail = {
+	{ OP_CHECKLOCKTIMEVERIFY, OP_DROP, OP_ENDIF,
+	  OP_PUSHBYTES(PUBKEY_DER_LEN) }, KEY_HOLE,
+	{ OP_ENDIF, OP_CHECKSIG }
+};
+
+/* ... OP_ELSE <locktime> OP_CHECKSEQUENCEVERIFY ... */
+static const struct tmpl_secret_or_delay_head {
+	u8 head[2];
+	u8 hash[sizeof(struct ripemd160)];
+	u8 push_key[3];
+	u8 key[PUBKEY_DER_LEN];
+	u8 tail[1];
+} tmpl_secret_or_delay_head = {
+	{ OP_HASH160, OP_PUSHBYTES(sizeof(struct ripemd160)) }, HASH_HOLE,
+	{ OP_EQUAL, OP_IF, OP_PUSHBYTES(PUBKEY_DER_LEN) }, KEY_HOLE,
+	{ OP_ELSE }
+};
+
+static const struct tmpl_secret_or_delay_tail {
+	u8 head[3];
+	u8 delayed_key[PUBKEY_DER_LEN];
+	u8 tail[2];
+} tmpl_secret_or_delay_tail = {
+	{ OP_CHECKSEQUENCEVERIFY, OP_DROP, OP_PUSHBYTES(PUBKEY_DER_LEN) },
+	KEY_HOLE,
+	{ OP_ENDIF, OP_CHECKSIG }
+};
+
 static u8 *stack_key(const tal_t *ctx,
 		     secp256k1_context *secpctx,
 		     const struct pubkey *key)
@@ -178,18 +323,20 @@ u8 *bitcoin_redeem_2of2(const tal_t *ctx,
 			const struct pubkey *key1,
 			const struct pubkey *key2)
 {
-	u8 *script = tal_arr(ctx, u8, 0);
-	add_number(&script, 2);
+	struct script script;
+	struct tmpl_2of2 *t;
+
+	BUILD_ASSERT(sizeof(*t) == 71);
+	script.len = 0;
+	t = add_tmpl(&script, &tmpl_2of2, sizeof(tmpl_2of2));
 	if (key_less(secpctx, key1, key2)) {
-		add_push_key(&script, secpctx, key1);
-		add_push_key(&script, secpctx, key2);
+		fill_key(t->key1, secpctx, key1);
+		fill_key(t->key2, secpctx, key2);
 	} else {
-		add_push_key(&script, secpctx, key2);
-		add_push_key(&script, secpctx, key1);
+		fill_key(t->key1, secpctx, key2);
+		fill_key(t->key2, secpctx, key1);
 	}
-	add_number(&script, 2);
-	add_op(&script, OP_CHECKMULTISIG);
-	return script;
+	return script_done(ctx, &script);
 }
 
 /* tal_count() gives the length of the script. */
@@ -197,23 +344,26 @@ u8 *bitcoin_redeem_single(const tal_t *ctx,
 			  secp256k1_context *secpctx,
 			  const struct pubkey *key)
 {
-	u8 *script = tal_arr(ctx, u8, 0);
+	struct script script;
+
+	script.len = 0;
 	add_push_key(&script, secpctx, key);
 	add_op(&script, OP_CHECKSIG);
-	return script;
+	return script_done(ctx, &script);
 }
 
 /* Create p2sh for this redeem script. */
 u8 *scriptpubkey_p2sh(const tal_t *ctx, const u8 *redeemscript)
 {
 	struct ripemd160 redeemhash;
-	u8 *script = tal_arr(ctx, u8, 0);
+	struct script script;
 
+	script.len = 0;
 	add_op(&script, OP_HASH160);
 	hash160(&redeemhash, redeemscript, tal_count(redeemscript));
 	add_push_bytes(&script, redeemhash.u.u8, sizeof(redeemhash.u.u8));
 	add_op(&script, OP_EQUAL);
-	return script;
+	return script_done(ctx, &script);
 }
 
 /* Create the redeemscript for a P2SH + P2WPKH (for signing tx) */
@@ -223,7 +373,9 @@ u8 *bitcoin_redeem_p2wpkh(const tal_t *ctx,
 {
 	struct ripemd160 keyhash;
 	u8 der[PUBKEY_DER_LEN];
-	u8 *script = tal_arr(ctx, u8, 0);
+	struct script script;
+
+	script.len = 0;
 
 	/* BIP141: BIP16 redeemScript pushed in the scriptSig is exactly a
 	 * push of a version byte plus a push of a witness program. */
@@ -231,7 +383,7 @@ u8 *bitcoin_redeem_p2wpkh(const tal_t *ctx,
 	pubkey_to_der(secpctx, der, key);
 	hash160(&keyhash, der, sizeof(der));
 	add_push_bytes(&script, &keyhash, sizeof(keyhash));
-	return script;
+	return script_done(ctx, &script);
 }
 
 /* Create an input which spends the p2sh-p2wpkh. */
@@ -242,11 +394,13 @@ void bitcoin_witness_p2sh_p2wpkh(const tal_t *ctx,
 				 const struct pubkey *key)
 {
 	u8 *redeemscript = bitcoin_redeem_p2wpkh(ctx, secpctx, key);
+	struct script script;
 
 	/* BIP141: The scriptSig must be exactly a push of the BIP16 redeemScript
 	 * or validation fails. */
-	input->script = tal_arr(ctx, u8, 0);
-	add_push_bytes(&input->script, redeemscript, tal_count(redeemscript));
+	script.len = 0;
+	add_push_bytes(&script, redeemscript, tal_count(redeemscript));
+	input->script = script_done(ctx, &script);
 	input->script_length = tal_count(input->script);
 
 	/* BIP141: The witness must consist of exactly 2 items (≤ 520
@@ -261,12 +415,13 @@ void bitcoin_witness_p2sh_p2wpkh(const tal_t *ctx,
 u8 *scriptpubkey_p2wsh(const tal_t *ctx, const u8 *witnessscript)
 {
 	struct sha256 h;
-	u8 *script = tal_arr(ctx, u8, 0);
-	
+	struct script script;
+
+	script.len = 0;
 	add_op(&script, OP_0);
 	sha256(&h, witnessscript, tal_count(witnessscript));
 	add_push_bytes(&script, h.u.u8, sizeof(h.u.u8));
-	return script;
+	return script_done(ctx, &script);
 }
 
 /* Create an output script for a 20-byte witness. */
@@ -276,13 +431,14 @@ u8 *scriptpubkey_p2wpkh(const tal_t *ctx,
 {
 	struct ripemd160 h;
 	u8 der[PUBKEY_DER_LEN];
-	u8 *script = tal_arr(ctx, u8, 0);
-	
+	struct script script;
+
+	script.len = 0;
 	add_op(&script, OP_0);
 	pubkey_to_der(secpctx, der, key);
 	hash160(&h, der, sizeof(der));
 	add_push_bytes(&script, &h, sizeof(h));
-	return script;
+	return script_done(ctx, &script);
 }
 
 /* Create a witness which spends the 2of2. */
@@ -319,50 +475,40 @@ u8 *bitcoin_redeem_htlc_send(const tal_t *ctx,
 			     const struct abs_locktime *htlc_abstimeout,
 			     const struct rel_locktime *locktime,
 			     const struct sha256 *commit_revoke,
-			     const struct sha256 *rhash)
+			     const struct sha256 *rhash,
+			     size_t *revoke_off)
 {
 	/* R value presented: -> them.
 	 * Commit revocation value presented: -> them.
 	 * HTLC times out -> us. */
-	u8 *script = tal_arr(ctx, u8, 0);
-	struct ripemd160 ripemd;
-
-	/* Must be 32 bytes long. */
-	add_op(&script, OP_SIZE);
-	add_number(&script, 32);
-	add_op(&script, OP_EQUALVERIFY);
-
-	add_op(&script, OP_HASH160);
-	add_op(&script, OP_DUP);
-	/* Did they supply HTLC R value? */
-	ripemd160(&ripemd, rhash->u.u8, sizeof(rhash->u));
-	add_push_bytes(&script, &ripemd, sizeof(ripemd));
-	add_op(&script, OP_EQUAL);
-	add_op(&script, OP_SWAP);
-	/* How about commit revocation value? */
-	ripemd160(&ripemd, commit_revoke->u.u8, sizeof(commit_revoke->u));
-	add_push_bytes(&script, &ripemd, sizeof(ripemd));
-	add_op(&script, OP_EQUAL);
-	add_op(&script, OP_ADD);
-
-	/* If either matched... */
-	add_op(&script, OP_IF);
-	add_push_key(&script, secpctx, theirkey);
-
-	add_op(&script, OP_ELSE);
+	struct script script;
+	struct tmpl_htlc_send_head *head;
+	struct tmpl_htlc_send_tail *tail;
+
+	BUILD_ASSERT(sizeof(*head) == 88);
+	BUILD_ASSERT(sizeof(*tail) == 38);
+	script.len = 0;
+
+	/* Must be 32 bytes long.  Did they supply HTLC R value, or the
+	 * commit revocation value?  If either matched, theirs. */
+	head = add_tmpl(&script, &tmpl_htlc_send_head,
+			sizeof(tmpl_htlc_send_head));
+	fill_ripemd(head->rhash, rhash);
+	fill_ripemd(head->revoke, commit_revoke);
+	if (revoke_off)
+		*revoke_off = offsetof(struct tmpl_htlc_send_head, revoke);
+	fill_key(head->theirkey, secpctx, theirkey);
 
 	/* If HTLC times out, they can collect after a delay. */
 	add_number(&script, htlc_abstimeout->locktime);
 	add_op(&script, OP_CHECKLOCKTIMEVERIFY);
 	add_number(&script, locktime->locktime);
-	add_op(&script, OP_CHECKSEQUENCEVERIFY);
-	add_op(&script, OP_2DROP);
-	add_push_key(&script, secpctx, ourkey);
 
-	add_op(&script, OP_ENDIF);
-	add_op(&script, OP_CHECKSIG);
+	tail = add_tmpl(&script, &tmpl_htlc_send_tail,
+			sizeof(tmpl_htlc_send_tail));
+	fill_key(tail->ourkey, secpctx, ourkey);
 
-	return script;
+	return script_done(ctx, &script);
 }
 
 /* Create a script for our HTLC output: receiving. */
@@ -373,55 +519,45 @@ u8 *bitcoin_redeem_htlc_recv(const tal_t *ctx,
 			     const struct abs_locktime *htlc_abstimeout,
 			     const struct rel_locktime *locktime,
 			     const struct sha256 *commit_revoke,
-			     const struct sha256 *rhash)
+			     const struct sha256 *rhash,
+			     size_t *revoke_off)
 {
 	/* R value presented: -> us.
 	 * Commit revocation value presented: -> them.
 	 * HTLC times out -> them. */
-	u8 *script = tal_arr(ctx, u8, 0);
-	struct ripemd160 ripemd;
-
-	add_op(&script, OP_SIZE);
-	add_number(&script, 32);
-	add_op(&script, OP_EQUALVERIFY);
-
-	add_op(&script, OP_HASH160);
-	add_op(&script, OP_DUP);
-
-	/* Did we supply HTLC R value? */
-	ripemd160(&ripemd, rhash->u.u8, sizeof(rhash->u));
-	add_push_bytes(&script, &ripemd, sizeof(ripemd));
-	add_op(&script, OP_EQUAL);
-	add_op(&script, OP_IF);
-
+	struct script script;
+	struct tmpl_htlc_recv_head *head;
+	struct tmpl_htlc_recv_mid *mid;
+	struct tmpl_htlc_recv_tail *tail;
+
+	BUILD_ASSERT(sizeof(*head) == 29);
+	BUILD_ASSERT(sizeof(*mid) == 60);
+	BUILD_ASSERT(sizeof(*tail) == 39);
+	script.len = 0;
+
+	/* Must be 32 bytes long: did we supply HTLC R value? */
+	head = add_tmpl(&script, &tmpl_htlc_recv_head,
+			sizeof(tmpl_htlc_recv_head));
+	fill_ripemd(head->rhash, rhash);
+
+	/* Ours after a delay (dropping extra hash as well as locktime). */
 	add_number(&script, locktime->locktime);
-	add_op(&script, OP_CHECKSEQUENCEVERIFY);
-	/* Drop extra hash as well as locktime. */
-	add_op(&script, OP_2DROP);
-
-	add_push_key(&script, secpctx, ourkey);
-
-	add_op(&script, OP_ELSE);
+	mid = add_tmpl(&script, &tmpl_htlc_recv_mid,
+		       sizeof(tmpl_htlc_recv_mid));
+	fill_key(mid->ourkey, secpctx, ourkey);
 
 	/* If they provided commit revocation, available immediately. */
-	ripemd160(&ripemd, commit_revoke->u.u8, sizeof(commit_revoke->u));
-	add_push_bytes(&script, &ripemd, sizeof(ripemd));
-	add_op(&script, OP_EQUAL);
-
-	add_op(&script, OP_NOTIF);
+	fill_ripemd(mid->revoke, commit_revoke);
+	if (revoke_off)
+		*revoke_off = (mid->revoke - script.buf);
 
 	/* Otherwise, they must wait for HTLC timeout. */
 	add_number(&script, htlc_abstimeout->locktime);
-	add_op(&script, OP_CHECKLOCKTIMEVERIFY);
-	add_op(&script, OP_DROP);
-	add_op(&script, OP_ENDIF);
-
-	add_push_key(&script, secpctx, theirkey);
-	
-	add_op(&script, OP_ENDIF);
-	add_op(&script, OP_CHECKSIG);
+	tail = add_tmpl(&script, &tmpl_htlc_recv_tail,
+			sizeof(tmpl_htlc_recv_tail));
+	fill_key(tail->theirkey, secpctx, theirkey);
 
-	return script;
+	return script_done(ctx, &script);
 }
 
 /* Create scriptcode (fake witness, basically) for P2WPKH */
@@ -432,8 +568,9 @@ u8 *p2wpkh_scriptcode(const tal_t *ctx,
 	struct sha256 h;
 	struct ripemd160 pkhash;
 	u8 der[PUBKEY_DER_LEN];
-	u8 *script = tal_arr(ctx, u8, 0);
+	struct script script;
 
+	script.len = 0;
 	pubkey_to_der(secpctx, der, key);
 	sha256(&h, der, sizeof(der));
 	ripemd160(&pkhash, h.u.u8, sizeof(h));
@@ -451,7 +588,7 @@ u8 *p2wpkh_scriptcode(const tal_t *ctx,
 	add_op(&script, OP_EQUALVERIFY);
 	add_op(&script, OP_CHECKSIG);
 
-	return script;
+	return script_done(ctx, &script);
 }
 
 bool is_p2pkh(const u8 *script, size_t script_len)
@@ -515,32 +652,38 @@ u8 *bitcoin_redeem_secret_or_delay(const tal_t *ctx,
 				   const struct pubkey *key_if_secret_known,
 				   const struct sha256 *hash_of_secret)
 {
-	struct ripemd160 ripemd;
-	u8 *script = tal_arr(ctx, u8, 0);
+	struct script script;
+	struct tmpl_secret_or_delay_head *head;
+	struct tmpl_secret_or_delay_tail *tail;
 
-	ripemd160(&ripemd, hash_of_secret->u.u8, sizeof(hash_of_secret->u));
-
-	/* If the secret is supplied.... */
-	add_op(&script, OP_HASH160);
-	add_push_bytes(&script, ripemd.u.u8, sizeof(ripemd.u.u8));
-	add_op(&script, OP_EQUAL);
-	add_op(&script, OP_IF);
-	
-	/* They can collect the funds. */
-	add_push_key(&script, secpctx, key_if_secret_known);
+	BUILD_ASSERT(sizeof(*head) == 59);
+	BUILD_ASSERT(sizeof(*tail) == 38);
+	script.len = 0;
 
-	add_op(&script, OP_ELSE);
+	/* If the secret is supplied, they can collect the funds. */
+	head = add_tmpl(&script, &tmpl_secret_or_delay_head,
+			sizeof(tmpl_secret_or_delay_head));
+	fill_ripemd(head->hash, hash_of_secret);
+	fill_key(head->key, secpctx, key_if_secret_known);
 
 	/* Other can collect after a delay. */
 	add_number(&script, locktime->locktime);
-	add_op(&script, OP_CHECKSEQUENCEVERIFY);
-	add_op(&script, OP_DROP);
-	add_push_key(&script, secpctx, delayed_key);
+	tail = add_tmpl(&script, &tmpl_secret_or_delay_tail,
+			sizeof(tmpl_secret_or_delay_tail));
+	fill_key(tail->delayed_key, secpctx, delayed_key);
 
-	add_op(&script, OP_ENDIF);
-	add_op(&script, OP_CHECKSIG);
+	return script_done(ctx, &script);
+}
 
-	return script;
+void bitcoin_redeem_htlc_change_revoke(u8 *script, size_t revoke_off,
+				       const struct sha256 *commit_revoke)
+{
+	struct ripemd160 ripemd;
+
+	assert(revoke_off + sizeof(ripemd) <= tal_count(script));
+	assert(script[revoke_off - 1] == OP_PUSHBYTES(sizeof(ripemd)));
+	ripemd160(&ripemd, commit_revoke->u.u8, sizeof(commit_revoke->u));
+	memcpy(script + revoke_off, &ripemd, sizeof(ripemd));
 }
 
 u8 **bitcoin_witness_secret(const tal_t *ctx,
@@ -67,7 +67,8 @@ u8 *bitcoin_redeem_htlc_send(const tal_t *ctx,
 			     const struct abs_locktime *htlc_abstimeout,
 			     const struct rel_locktime *locktime,
 			     const struct sha256 *commit_revoke,
-			     const struct sha256 *rhash);
+			     const struct sha256 *rhash,
+			     size_t *revoke_off);
 
 /* Create a script for our HTLC output: receiving. */
 u8 *bitcoin_redeem_htlc_recv(const tal_t *ctx,
@@ -77,7 +78,13 @@ u8 *bitcoin_redeem_htlc_recv(const tal_t *ctx,
 			     const struct abs_locktime *htlc_abstimeout,
 			     const struct rel_locktime *locktime,
 			     const struct sha256 *commit_revoke,
-			     const struct sha256 *rhash);
+			     const struct sha256 *rhash,
+			     size_t *revoke_off);
+
+/* The htlc scripts differ between commitments only in commit_revoke: if
+ * revoke_off was non-NULL, this makes the script for another one. */
+void bitcoin_redeem_htlc_change_revoke(u8 *script, size_t revoke_off,
+				       const struct sha256 *commit_revoke);
 
 /* Create an output script for a 32-byte witness program. */
 u8 *scriptpubkey_p2wsh(const tal_t *ctx, const u8 *witnessscript);
@@ -141,6 +141,21 @@ bool check_signed_hash(secp256k1_context *secpctx,
 	return ret == 1;
 }
 
+bool check_signed_hashes(secp256k1_context *secpctx,
+			 struct sig_check *checks, size_t num)
+{
+	size_t i;
+	bool all = true;
+
+	/* libsecp256k1 has no batch verify: threads are the caller's job. */
+	for (i = 0; i < num; i++) {
+		checks[i].ok = check_signed_hash(secpctx, checks[i].hash,
+						 checks[i].sig, checks[i].key);
+		all &= checks[i].ok;
+	}
+	return all;
+}
+
 bool check_tx_sig(secp256k1_context *secpctx,
 		  struct bitcoin_tx *tx, size_t input_num,
 		  const u8 *redeemscript, size_t redeemscript_len,
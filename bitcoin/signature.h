@@ -34,6 +34,18 @@ bool check_signed_hash(secp256k1_context *secpctx,
 		       const struct signature *signature,
 		       const struct pubkey *key);
 
+/* One of a batch for check_signed_hashes. */
+struct sig_check {
+	const struct sha256_double *hash;
+	const struct signature *sig;
+	const struct pubkey *key;
+	bool ok;
+};
+
+/* Sets each checks[i].ok: returns true if they're all good. */
+bool check_signed_hashes(secp256k1_context *secpctx,
+			 struct sig_check *checks, size_t num);
+
 /* All tx input scripts must be set to 0 len. */
 void sign_tx_input(secp256k1_context *secpctx,
 		   struct bitcoin_tx *tx,
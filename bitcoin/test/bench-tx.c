@@ -0,0 +1,238 @@
+#include "bitcoin/base58.c"
+#include "bitcoin/locktime.c"
+#include "bitcoin/pubkey.c"
+#include "bitcoin/pullpush.c"
+#include "bitcoin/script.c"
+#include "bitcoin/shadouble.c"
+#include "bitcoin/signature.c"
+#include "bitcoin/tx.c"
+#include "bitcoin/varint.c"
+#include "permute_tx.c"
+#include "utils.c"
+#include <ccan/opt/opt.h>
+#include <ccan/time/time.h>
+#include <inttypes.h>
+#include <stdio.h>
+
+/* Commitment-sized: the two of us, and this many HTLCs. */
+#define NUM_HTLCS 8
+
+/* Results feed in here, so the compiler can't drop the work. */
+static volatile u8 sink;
+
+/* One line each: "<name> <iterations> <nsec per iteration>". */
+static void report(const char *name, size_t n, struct timeabs start)
+{
+	struct timerel t = time_between(time_now(), start);
+
+	printf("%s %zu %"PRIu64"\n", name, n, time_to_nsec(t) / n);
+}
+
+static void make_key(secp256k1_context *secpctx, struct pubkey *key, u8 seed)
+{
+	struct privkey priv;
+
+	memset(priv.secret, seed, sizeof(priv.secret));
+	if (!pubkey_from_privkey(secpctx, &priv, key))
+		abort();
+}
+
+/* Spends a 2of2, to both of us and NUM_HTLCS HTLCs, as commit_tx does. */
+static struct bitcoin_tx *commit_like_tx(const tal_t *ctx,
+					 secp256k1_context *secpctx,
+					 const struct pubkey *us,
+					 const struct pubkey *them,
+					 u8 **wscript)
+{
+	struct bitcoin_tx *tx = bitcoin_tx(ctx, 1, 2 + NUM_HTLCS);
+	struct abs_locktime timeout;
+	struct rel_locktime delay;
+	struct sha256 rhash, revoke;
+	size_t i;
+
+	blocks_to_abs_locktime(500000, &timeout);
+	blocks_to_rel_locktime(144, &delay);
+	memset(&revoke, 1, sizeof(revoke));
+
+	*wscript = bitcoin_redeem_2of2(ctx, secpctx, us, them);
+	memset(&tx->input[0].txid, 2, sizeof(tx->input[0].txid));
+	tx->input[0].amount = tal(tx, u64);
+	*tx->input[0].amount = 1000000;
+	tx->input[0].witness = tal_arr(tx, u8 *, 4);
+	tx->input[0].witness[0] = tal_arr(tx, u8, 0);
+	tx->input[0].witness[1] = tal_arrz(tx, u8, 72);
+	tx->input[0].witness[2] = tal_arrz(tx, u8, 72);
+	tx->input[0].witness[3] = tal_dup_arr(tx, u8, *wscript,
+					      tal_count(*wscript), 0);
+
+	tx->output[0].amount = 400000;
+	tx->output[0].script = scriptpubkey_p2wsh(tx,
+		bitcoin_redeem_secret_or_delay(tx, secpctx, us, &delay,
+					       them, &revoke));
+	tx->output[1].amount = 500000;
+	tx->output[1].script = scriptpubkey_p2wpkh(tx, secpctx, them);
+	for (i = 2; i < tx->output_count; i++) {
+		memset(&rhash, i, sizeof(rhash));
+		tx->output[i].amount = 10000 - i;
+		tx->output[i].script = scriptpubkey_p2wsh(tx,
+			bitcoin_redeem_htlc_send(tx, secpctx, us, them,
+						 &timeout, &delay, &revoke,
+						 &rhash, NULL));
+	}
+	for (i = 0; i < tx->output_count; i++)
+		tx->output[i].script_length = tal_count(tx->output[i].script);
+	return tx;
+}
+
+int main(int argc, char *argv[])
+{
+	const tal_t *ctx = tal(NULL, char);
+	secp256k1_context *secpctx;
+	struct bitcoin_tx *tx;
+	struct bitcoin_tx_output *outputs;
+	struct pubkey us, them;
+	struct abs_locktime timeout;
+	struct rel_locktime delay;
+	struct sha256 rhash, revoke;
+	struct sha256_double h;
+	struct ripemd160 p2sh;
+	unsigned int n = 10000;
+	struct timeabs start;
+	u8 *wscript, *linear;
+	char *addr;
+	size_t i, len;
+	bool test_net;
+
+	opt_register_noarg("--help|-h", opt_usage_and_exit, "",
+			   "Print this message.");
+	opt_register_arg("--iterations", opt_set_uintval, opt_show_uintval,
+			 &n, "Times to run each");
+	opt_parse(&argc, argv, opt_log_stderr_exit);
+	if (argc != 1)
+		opt_usage_exit_fail("No arguments expected");
+	if (n == 0)
+		opt_usage_exit_fail("Need at least one iteration");
+
+	secpctx = secp256k1_context_create(SECP256K1_CONTEXT_SIGN);
+	make_key(secpctx, &us, 1);
+	make_key(secpctx, &them, 2);
+	tx = commit_like_tx(ctx, secpctx, &us, &them, &wscript);
+	linear = linearize_tx(ctx, tx);
+	len = tal_count(linear);
+
+	start = time_now();
+	for (i = 0; i < n; i++) {
+		const u8 *p = linear;
+		size_t max = len;
+		struct bitcoin_tx *tx2 = pull_bitcoin_tx(ctx, &p, &max);
+		sink ^= tx2->output_count;
+		tal_free(tx2);
+	}
+	report("pull_bitcoin_tx", n, start);
+
+	start = time_now();
+	for (i = 0; i < n; i++) {
+		u8 *lin = linearize_tx(ctx, tx);
+		sink ^= lin[0];
+		tal_free(lin);
+	}
+	report("linearize_tx", n, start);
+
+	start = time_now();
+	for (i = 0; i < n; i++) {
+		bitcoin_tx_changed(tx);
+		bitcoin_txid(tx, &h);
+		sink ^= h.sha.u.u8[0];
+	}
+	report("bitcoin_txid", n, start);
+
+	start = time_now();
+	for (i = 0; i < n; i++) {
+		sha256_tx_for_sig(&h, tx, 0, SIGHASH_ALL, wscript);
+		sink ^= h.sha.u.u8[0];
+	}
+	report("sha256_tx_for_sig", n, start);
+
+	blocks_to_abs_locktime(500000, &timeout);
+	blocks_to_rel_locktime(144, &delay);
+	memset(&rhash, 3, sizeof(rhash));
+	memset(&revoke, 4, sizeof(revoke));
+
+	start = time_now();
+	for (i = 0; i < n; i++) {
+		u8 *s = bitcoin_redeem_htlc_send(ctx, secpctx, &us, &them,
+						 &timeout, &delay, &revoke,
+						 &rhash, NULL);
+		sink ^= s[0];
+		tal_free(s);
+	}
+	report("bitcoin_redeem_htlc_send", n, start);
+
+	start = time_now();
+	for (i = 0; i < n; i++) {
+		u8 *s = bitcoin_redeem_htlc_recv(ctx, secpctx, &us, &them,
+						 &timeout, &delay, &revoke,
+						 &rhash, NULL);
+		sink ^= s[0];
+		tal_free(s);
+	}
+	report("bitcoin_redeem_htlc_recv", n, start);
+
+	start = time_now();
+	for (i = 0; i < n; i++) {
+		u8 *s = bitcoin_redeem_secret_or_delay(ctx, secpctx, &us,
+						       &delay, &them, &revoke);
+		sink ^= s[0];
+		tal_free(s);
+	}
+	report("bitcoin_redeem_secret_or_delay", n, start);
+
+	start = time_now();
+	for (i = 0; i < n; i++) {
+		u8 *s = bitcoin_redeem_2of2(ctx, secpctx, &us, &them);
+		sink ^= s[0];
+		tal_free(s);
+	}
+	report("bitcoin_redeem_2of2", n, start);
+
+	start = time_now();
+	for (i = 0; i < n; i++) {
+		u8 *s = scriptpubkey_p2wsh(ctx, wscript);
+		sink ^= s[0];
+		tal_free(s);
+	}
+	report("scriptpubkey_p2wsh", n, start);
+
+	/* It sorts in place, so each run starts from the original order. */
+	outputs = tal_arr(ctx, struct bitcoin_tx_output, tx->output_count);
+	start = time_now();
+	for (i = 0; i < n; i++) {
+		memcpy(outputs, tx->output, sizeof(*outputs) * tx->output_count);
+		permute_outputs(outputs, tx->output_count, NULL);
+		sink ^= outputs[0].amount;
+	}
+	report("permute_outputs", n, start);
+
+	memset(&p2sh, 5, sizeof(p2sh));
+	start = time_now();
+	for (i = 0; i < n; i++) {
+		addr = p2sh_to_base58(ctx, true, &p2sh);
+		sink ^= addr[0];
+		tal_free(addr);
+	}
+	report("p2sh_to_base58", n, start);
+
+	addr = p2sh_to_base58(ctx, true, &p2sh);
+	start = time_now();
+	for (i = 0; i < n; i++) {
+		if (!p2sh_from_base58(&test_net, &p2sh, addr, strlen(addr)))
+			abort();
+		sink ^= p2sh.u.u8[0];
+	}
+	report("p2sh_from_base58", n, start);
+
+	secp256k1_context_destroy(secpctx);
+	tal_free(ctx);
+	opt_free_table();
+	return 0;
+}
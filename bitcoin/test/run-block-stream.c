@@ -0,0 +1,93 @@
+#include "bitcoin/block.c"
+#include "bitcoin/pullpush.c"
+#include "bitcoin/tx.c"
+#include "bitcoin/shadouble.c"
+#include "bitcoin/varint.c"
+#include "utils.c"
+#include <assert.h>
+#include <ccan/str/hex/hex.h>
+#include <ccan/structeq/structeq.h>
+#include <ccan/take/take.h>
+#include <ccan/tal/str/str.h>
+
+/* Same as run-tx-encode: one segwit input, one output. */
+const char extended_tx[] = "02000000000101b5bef485c41d0d1f58d1e8a561924ece5c476d86cff063ea10c8df06136eb31d00000000171600144aa38e396e1394fb45cbf83f48d1464fbc9f498fffffffff0140330f000000000017a9140580ba016669d3efaf09a0b2ec3954469ea2bf038702483045022100f2abf9e9cf238c66533af93f23937eae8ac01fb6f105a00ab71dbefb9637dc9502205c1ac745829b3f6889607961f5d817dfa0c8f52bdda12e837c4f7b162f6db8a701210204096eb817f7efb414ef4d3d8be39dd04374256d3b054a322d4a6ee22736d03b00000000";
+
+static bool same_block(const struct bitcoin_block *a,
+		       const struct bitcoin_block *b)
+{
+	return structeq(&a->hdr, &b->hdr)
+		&& a->num_txs == b->num_txs
+		&& tal_count(a->txs) == tal_count(b->txs)
+		&& memcmp(a->txs, b->txs, tal_count(a->txs)) == 0;
+}
+
+/* Feed it in pieces of chunk chars, after a first piece of first chars. */
+static struct bitcoin_block *stream_block(const tal_t *ctx, const char *hex,
+					  size_t first, size_t chunk)
+{
+	struct bitcoin_block_stream *s = bitcoin_block_stream_new(ctx, 0);
+	struct bitcoin_block *b;
+	size_t off = 0, len = strlen(hex), n = first;
+
+	while (off < len) {
+		if (n > len - off)
+			n = len - off;
+		if (!bitcoin_block_stream_add(s, hex + off, n)) {
+			tal_free(s);
+			return NULL;
+		}
+		off += n;
+		n = chunk;
+	}
+	b = bitcoin_block_stream_done(ctx, s);
+	tal_free(s);
+	return b;
+}
+
+int main(void)
+{
+	struct bitcoin_block_hdr hdr;
+	struct bitcoin_block *expect, *b;
+	char *hex;
+	size_t i;
+
+	memset(&hdr, 0x42, sizeof(hdr));
+	hex = tal_hexstr(NULL, &hdr, sizeof(hdr));
+	hex = tal_strcat(NULL, take(hex), "02");
+	hex = tal_strcat(NULL, take(hex), extended_tx);
+	hex = tal_strcat(NULL, take(hex), extended_tx);
+
+	expect = bitcoin_block_from_hex(hex, hex, strlen(hex));
+	assert(expect);
+	assert(expect->num_txs == 2);
+	assert(tal_count(expect->txs) == strlen(extended_tx));
+
+	/* However it arrives, it's the same block. */
+	for (i = 2; i < strlen(hex); i += 2) {
+		b = stream_block(hex, hex, i, strlen(hex));
+		assert(b && same_block(b, expect));
+		tal_free(b);
+	}
+	for (i = 2; i < 200; i += 2) {
+		b = stream_block(hex, hex, i, i);
+		assert(b && same_block(b, expect));
+		tal_free(b);
+	}
+
+	/* Not all of it. */
+	for (i = 0; i < strlen(hex); i += 2) {
+		char *part = tal_strndup(hex, hex, i);
+		assert(!stream_block(hex, part, 2, 2));
+		assert(!bitcoin_block_from_hex(hex, part, i));
+	}
+
+	/* Too much, or not hex. */
+	assert(!stream_block(hex, tal_strcat(hex, hex, "00"), 2, 2));
+	assert(!stream_block(hex, tal_strcat(hex, hex, "xx"), 2, 2));
+	assert(!bitcoin_block_from_hex(hex, tal_strcat(hex, hex, "0"),
+				       strlen(hex) + 1));
+
+	tal_free(hex);
+	return 0;
+}
@@ -0,0 +1,89 @@
+#include "bitcoin/pullpush.c"
+#include "bitcoin/tx.c"
+#include "bitcoin/shadouble.c"
+#include "bitcoin/varint.c"
+#include "utils.c"
+#include <assert.h>
+#include <ccan/str/hex/hex.h>
+#include <ccan/structeq/structeq.h>
+
+/* Same as run-tx-encode: one segwit input, one output. */
+const char extended_tx[] = "02000000000101b5bef485c41d0d1f58d1e8a561924ece5c476d86cff063ea10c8df06136eb31d00000000171600144aa38e396e1394fb45cbf83f48d1464fbc9f498fffffffff0140330f000000000017a9140580ba016669d3efaf09a0b2ec3954469ea2bf038702483045022100f2abf9e9cf238c66533af93f23937eae8ac01fb6f105a00ab71dbefb9637dc9502205c1ac745829b3f6889607961f5d817dfa0c8f52bdda12e837c4f7b162f6db8a701210204096eb817f7efb414ef4d3d8be39dd04374256d3b054a322d4a6ee22736d03b00000000";
+
+static void check_view(const u8 *linear, size_t len,
+		       const struct bitcoin_tx *tx)
+{
+	struct bitcoin_tx_view view;
+	struct sha256_double txid, expect;
+	struct bitcoin_tx *tx2;
+	const u8 *p = linear, *in;
+	size_t max = len, inlen, i;
+
+	assert(pull_bitcoin_tx_view(&p, &max, &view));
+	assert(max == 0);
+	assert(view.start == linear && view.len == len);
+	assert(view.input_count == tx->input_count);
+
+	in = view.inputs;
+	inlen = view.inputs_len;
+	for (i = 0; i < view.input_count; i++) {
+		u32 index;
+		pull_bitcoin_tx_view_input(&in, &inlen, &txid, &index);
+		assert(structeq(&txid, &tx->input[i].txid));
+		assert(index == tx->input[i].index);
+	}
+	assert(in && inlen == 0);
+
+	assert(view.output_count == tx->output_count);
+	in = view.outputs;
+	inlen = view.outputs_len;
+	for (i = 0; i < view.output_count; i++) {
+		const u8 *script;
+		size_t script_len;
+		u64 amount;
+		pull_bitcoin_tx_view_output(&in, &inlen, &amount,
+					    &script, &script_len);
+		assert(amount == tx->output[i].amount);
+		assert(script_len == tx->output[i].script_length);
+		assert(memcmp(script, tx->output[i].script, script_len) == 0);
+	}
+	assert(in && inlen == 0);
+
+	bitcoin_txid(tx, &expect);
+	bitcoin_tx_view_txid(&view, &txid);
+	assert(structeq(&txid, &expect));
+
+	tx2 = bitcoin_tx_from_view(NULL, &view);
+	bitcoin_txid(tx2, &txid);
+	assert(structeq(&txid, &expect));
+	tal_free(tx2);
+
+	/* Every truncation fails. */
+	for (i = 0; i < len; i++) {
+		p = linear;
+		max = i;
+		assert(!pull_bitcoin_tx_view(&p, &max, &view));
+	}
+}
+
+int main(void)
+{
+	struct bitcoin_tx *tx;
+	u8 *linear;
+	size_t i;
+
+	tx = bitcoin_tx_from_hex(NULL, extended_tx, strlen(extended_tx));
+	assert(tx);
+
+	linear = linearize_tx(tx, tx);
+	check_view(linear, tal_count(linear), tx);
+
+	/* And without the witness. */
+	for (i = 0; i < tx->input_count; i++)
+		tx->input[i].witness = NULL;
+	linear = linearize_tx(tx, tx);
+	check_view(linear, tal_count(linear), tx);
+
+	tal_free(tx);
+	return 0;
+}
@@ -1,6 +1,7 @@
 #include "bitcoin/block.h"
 #include "bitcoin/pullpush.h"
 #include "bitcoin/tx.h"
+#include "utils.h"
 #include <assert.h>
 #include <ccan/cast/cast.h>
 #include <ccan/crypto/sha256/sha256.h>
@@ -176,12 +177,26 @@ static void hash_outputs(struct sha256_double *h, const struct bitcoin_tx *tx)
 	sha256_double_done(&ctx, h);
 }
 
+void sighash_cache_init(struct sighash_cache *cache,
+			const struct bitcoin_tx *tx)
+{
+	hash_prevouts(&cache->prevouts, tx);
+	hash_sequence(&cache->sequence, tx);
+	hash_outputs(&cache->outputs, tx);
+}
+
 static void hash_for_segwit(struct sha256_ctx *ctx,
 			    const struct bitcoin_tx *tx,
 			    unsigned int input_num,
-			    const u8 *witness_script)
+			    const u8 *witness_script,
+			    const struct sighash_cache *cache)
 {
-	struct sha256_double h;
+	struct sighash_cache fresh;
+
+	if (!cache) {
+		sighash_cache_init(&fresh, tx);
+		cache = &fresh;
+	}
 
 	/* BIP143:
 	 *
@@ -191,12 +206,10 @@ static void hash_for_segwit(struct sha256_ctx *ctx,
 	push_le32(tx->version, push_sha, ctx);
 
 	/*     2. hashPrevouts (32-byte hash) */
-	hash_prevouts(&h, tx);
-	push_sha(&h, sizeof(h), ctx);
+	push_sha(&cache->prevouts, sizeof(cache->prevouts), ctx);
 
 	/*     3. hashSequence (32-byte hash) */
-	hash_sequence(&h, tx);
-	push_sha(&h, sizeof(h), ctx);
+	push_sha(&cache->sequence, sizeof(cache->sequence), ctx);
 
 	/*     4. outpoint (32-byte hash + 4-byte little endian)  */
 	push_sha(&tx->input[input_num].txid, sizeof(tx->input[input_num].txid),
@@ -213,16 +226,17 @@ static void hash_for_segwit(struct sha256_ctx *ctx,
 	push_le32(tx->input[input_num].sequence_number, push_sha, ctx);
 
 	/*     8. hashOutputs (32-byte hash) */
-	hash_outputs(&h, tx);
-	push_sha(&h, sizeof(h), ctx);
+	push_sha(&cache->outputs, sizeof(cache->outputs), ctx);
 
 	/*     9. nLocktime of the transaction (4-byte little endian) */
 	push_le32(tx->lock_time, push_sha, ctx);
 }
 
-void sha256_tx_for_sig(struct sha256_double *h, const struct bitcoin_tx *tx,
-		       unsigned int input_num, enum sighash_type stype,
-		       const u8 *witness_script)
+void sha256_tx_for_sig_cached(struct sha256_double *h,
+			      const struct bitcoin_tx *tx,
+			      unsigned int input_num, enum sighash_type stype,
+			      const u8 *witness_script,
+			      const struct sighash_cache *cache)
 {
 	size_t i;
 	struct sha256_ctx ctx = SHA256_INIT;
@@ -238,7 +252,7 @@ void sha256_tx_for_sig(struct sha256_double *h, const struct bitcoin_tx *tx,
 
 	if (witness_script) {
 		/* BIP143 hashing if OP_CHECKSIG is inside witness. */
-		hash_for_segwit(&ctx, tx, input_num, witness_script);
+		hash_for_segwit(&ctx, tx, input_num, witness_script, cache);
 	} else {
 		/* Otherwise signature hashing never includes witness. */
 		push_tx(tx, push_sha, &ctx, false);
@@ -248,25 +262,37 @@ void sha256_tx_for_sig(struct sha256_double *h, const struct bitcoin_tx *tx,
 	sha256_double_done(&ctx, h);
 }
 
+void sha256_tx_for_sig(struct sha256_double *h, const struct bitcoin_tx *tx,
+		       unsigned int input_num, enum sighash_type stype,
+		       const u8 *witness_script)
+{
+	sha256_tx_for_sig_cached(h, tx, input_num, stype, witness_script, NULL);
+}
+
+static void push_measure(const void *data, size_t len, void *lenp)
+{
+	*(size_t *)lenp += len;
+}
+
 static void push_linearize(const void *data, size_t len, void *pptr_)
 {
 	u8 **pptr = pptr_;
-	size_t oldsize = tal_count(*pptr);
 
-	tal_resize(pptr, oldsize + len);
-	memcpy(*pptr + oldsize, memcheck(data, len), len);
+	memcpy(*pptr, memcheck(data, len), len);
+	*pptr += len;
 }
 
+/* Measure first, so it's one allocation rather than one per field. */
 u8 *linearize_tx(const tal_t *ctx, const struct bitcoin_tx *tx)
 {
-	u8 *arr = tal_arr(ctx, u8, 0);
-	push_tx(tx, push_linearize, &arr, uses_witness(tx));
-	return arr;
-}
+	size_t len = 0;
+	u8 *arr, *p;
 
-static void push_measure(const void *data, size_t len, void *lenp)
-{
-	*(size_t *)lenp += len;
+	push_tx(tx, push_measure, &len, uses_witness(tx));
+	p = arr = tal_arr(ctx, u8, len);
+	push_tx(tx, push_linearize, &p, uses_witness(tx));
+	assert(p == arr + len);
+	return arr;
 }
 
 size_t measure_tx_cost(const struct bitcoin_tx *tx)
@@ -282,11 +308,22 @@ size_t measure_tx_cost(const struct bitcoin_tx *tx)
 
 void bitcoin_txid(const struct bitcoin_tx *tx, struct sha256_double *txid)
 {
-	struct sha256_ctx ctx = SHA256_INIT;
+	struct bitcoin_tx *cache = cast_const(struct bitcoin_tx *, tx);
 
-	/* For TXID, we never use extended form. */
-	push_tx(tx, push_sha, &ctx, false);
-	sha256_double_done(&ctx, txid);
+	if (!tx->txid_valid) {
+		struct sha256_ctx ctx = SHA256_INIT;
+
+		/* For TXID, we never use extended form. */
+		push_tx(tx, push_sha, &ctx, false);
+		sha256_double_done(&ctx, &cache->txid);
+		cache->txid_valid = true;
+	}
+	*txid = tx->txid;
+}
+
+void bitcoin_tx_changed(struct bitcoin_tx *tx)
+{
+	tx->txid_valid = false;
 }
 
 struct bitcoin_tx *bitcoin_tx(const tal_t *ctx, varint_t input_count,
@@ -307,6 +344,7 @@ struct bitcoin_tx *bitcoin_tx(const tal_t *ctx, varint_t input_count,
 		tx->input[i].witness = NULL;
 	}
 	tx->lock_time = 0;
+	tx->txid_valid = false;
 #if HAS_BIP68
 	tx->version = 2;
 #else
@@ -397,6 +435,7 @@ struct bitcoin_tx *pull_bitcoin_tx(const tal_t *ctx,
 	size_t i;
 	u8 flag = 0;
 
+	tx->txid_valid = false;
 	tx->version = pull_le32(cursor, max);
 	tx->input_count = pull_length(cursor, max);
 	/* BIP 144 marker is 0 (impossible to have tx with 0 inputs) */
@@ -431,6 +470,105 @@ struct bitcoin_tx *pull_bitcoin_tx(const tal_t *ctx,
 	return tx;
 }
 
+static void skip_blob(const u8 **cursor, size_t *max)
+{
+	pull(cursor, max, NULL, pull_length(cursor, max));
+}
+
+bool pull_bitcoin_tx_view(const u8 **cursor, size_t *max,
+			  struct bitcoin_tx_view *view)
+{
+	varint_t i, j, num;
+	u8 flag = 0;
+
+	view->start = *cursor;
+	pull_le32(cursor, max);
+	view->body = *cursor;
+	view->input_count = pull_length(cursor, max);
+	/* BIP 144 marker, as in pull_bitcoin_tx. */
+	if (view->input_count == 0) {
+		pull(cursor, max, &flag, 1);
+		if (flag != SEGREGATED_WITNESS_FLAG)
+			return false;
+		view->body = *cursor;
+		view->input_count = pull_length(cursor, max);
+	}
+
+	view->inputs = *cursor;
+	for (i = 0; i < view->input_count; i++) {
+		pull(cursor, max, NULL, sizeof(struct sha256_double) + 4);
+		skip_blob(cursor, max);
+		pull(cursor, max, NULL, 4);
+	}
+	if (!*cursor)
+		return false;
+	view->inputs_len = *cursor - view->inputs;
+
+	view->output_count = pull_length(cursor, max);
+	view->outputs = *cursor;
+	for (i = 0; i < view->output_count; i++) {
+		pull(cursor, max, NULL, 8);
+		skip_blob(cursor, max);
+	}
+	if (!*cursor)
+		return false;
+	view->outputs_len = *cursor - view->outputs;
+	view->body_len = *cursor - view->body;
+
+	if (flag & SEGREGATED_WITNESS_FLAG) {
+		for (i = 0; i < view->input_count; i++) {
+			num = pull_length(cursor, max);
+			for (j = 0; j < num; j++)
+				skip_blob(cursor, max);
+		}
+	}
+	pull_le32(cursor, max);
+	if (!*cursor)
+		return false;
+
+	view->len = *cursor - view->start;
+	return true;
+}
+
+void pull_bitcoin_tx_view_input(const u8 **cursor, size_t *max,
+				struct sha256_double *txid, u32 *index)
+{
+	pull_sha256_double(cursor, max, txid);
+	*index = pull_le32(cursor, max);
+	skip_blob(cursor, max);
+	pull(cursor, max, NULL, 4);
+}
+
+void pull_bitcoin_tx_view_output(const u8 **cursor, size_t *max,
+				 u64 *amount,
+				 const u8 **script, size_t *script_len)
+{
+	*amount = pull_value(cursor, max);
+	*script_len = pull_length(cursor, max);
+	*script = *cursor;
+	pull(cursor, max, NULL, *script_len);
+}
+
+void bitcoin_tx_view_txid(const struct bitcoin_tx_view *view,
+			  struct sha256_double *txid)
+{
+	struct sha256_ctx ctx = SHA256_INIT;
+
+	sha256_update(&ctx, view->start, 4);
+	sha256_update(&ctx, view->body, view->body_len);
+	sha256_update(&ctx, view->start + view->len - 4, 4);
+	sha256_double_done(&ctx, txid);
+}
+
+struct bitcoin_tx *bitcoin_tx_from_view(const tal_t *ctx,
+					const struct bitcoin_tx_view *view)
+{
+	const u8 *p = view->start;
+	size_t len = view->len;
+
+	return pull_bitcoin_tx(ctx, &p, &len);
+}
+
 struct bitcoin_tx *bitcoin_tx_from_hex(const tal_t *ctx, const char *hex,
 				       size_t hexlen)
 {
@@ -446,7 +584,7 @@ struct bitcoin_tx *bitcoin_tx_from_hex(const tal_t *ctx, const char *hex,
 
 	len = hex_data_size(end - hex);
 	p = linear_tx = tal_arr(ctx, u8, len);
-	if (!hex_decode(hex, end - hex, linear_tx, len))
+	if (!hex_decode_fast(hex, end - hex, linear_tx, len))
 		goto fail;
 
 	tx = pull_bitcoin_tx(ctx, &p, &len);
@@ -466,6 +604,22 @@ fail:
 	return NULL;
 }
 
+struct bitcoin_tx *bitcoin_tx_dup(const tal_t *ctx, const struct bitcoin_tx *tx)
+{
+	u8 *linear = linearize_tx(ctx, tx);
+	const u8 *p = linear;
+	size_t i, len = tal_count(linear);
+	struct bitcoin_tx *dup = pull_bitcoin_tx(ctx, &p, &len);
+
+	tal_free(linear);
+	/* Input amounts aren't in the tx itself. */
+	for (i = 0; i < dup->input_count; i++)
+		if (tx->input[i].amount)
+			dup->input[i].amount = tal_dup(dup->input, u64,
+						       tx->input[i].amount);
+	return dup;
+}
+
 /* <sigh>.  Bitcoind represents hashes as little-endian for RPC.  This didn't
  * stick for blockids (everyone else uses big-endian, eg. block explorers),
  * but it did stick for txids. */
@@ -15,6 +15,10 @@ struct bitcoin_tx {
 	varint_t output_count;
 	struct bitcoin_tx_output *output;
 	u32 lock_time;
+
+	/* Set by bitcoin_txid(): see bitcoin_tx_changed(). */
+	bool txid_valid;
+	struct sha256_double txid;
 };
 
 struct bitcoin_tx_output {
@@ -38,14 +42,34 @@ struct bitcoin_tx_input {
 };
 
 
-/* SHA256^2 the tx: simpler than sha256_tx */
+/* SHA256^2 the tx: simpler than sha256_tx.  Remembered after the first
+ * call, so it's cheap to ask again. */
 void bitcoin_txid(const struct bitcoin_tx *tx, struct sha256_double *txid);
 
+/* If you change anything but the witnesses after bitcoin_txid(), call
+ * this so it gets recalculated. */
+void bitcoin_tx_changed(struct bitcoin_tx *tx);
+
 /* Useful for signature code. */
 void sha256_tx_for_sig(struct sha256_double *h, const struct bitcoin_tx *tx,
 		       unsigned int input_num, enum sighash_type stype,
 		       const u8 *witness_script);
 
+/* BIP143 hashes the same over every input: worth keeping for more than
+ * one.  Only valid until you change the tx! */
+struct sighash_cache {
+	struct sha256_double prevouts, sequence, outputs;
+};
+void sighash_cache_init(struct sighash_cache *cache,
+			const struct bitcoin_tx *tx);
+
+/* As above; cache is only used with a witness_script. */
+void sha256_tx_for_sig_cached(struct sha256_double *h,
+			      const struct bitcoin_tx *tx,
+			      unsigned int input_num, enum sighash_type stype,
+			      const u8 *witness_script,
+			      const struct sighash_cache *cache);
+
 /* Linear bytes of tx. */
 u8 *linearize_tx(const tal_t *ctx, const struct bitcoin_tx *tx);
 
@@ -61,6 +85,9 @@ struct bitcoin_tx *bitcoin_tx(const tal_t *ctx, varint_t input_count,
 struct bitcoin_tx *bitcoin_tx_from_hex(const tal_t *ctx, const char *hex,
 				       size_t hexlen);
 
+/* A separate copy of @tx (eg. for another owner to broadcast). */
+struct bitcoin_tx *bitcoin_tx_dup(const tal_t *ctx, const struct bitcoin_tx *tx);
+
 /* Parse hex string to get txid (reversed, a-la bitcoind). */
 bool bitcoin_txid_from_hex(const char *hexstr, size_t hexstr_len,
 			   struct sha256_double *txid);
@@ -73,4 +100,43 @@ bool bitcoin_txid_to_hex(const struct sha256_double *txid,
 struct bitcoin_tx *pull_bitcoin_tx(const tal_t *ctx,
 				   const u8 **cursor, size_t *max);
 
+/* A linearized tx, looked at in place: nothing is copied or allocated. */
+struct bitcoin_tx_view {
+	/* The whole thing, including any witness. */
+	const u8 *start;
+	size_t len;
+	/* Inputs and outputs: the txid is over this, version and locktime. */
+	const u8 *body;
+	size_t body_len;
+	/* The inputs, after their count. */
+	varint_t input_count;
+	const u8 *inputs;
+	size_t inputs_len;
+	/* The outputs, after their count. */
+	varint_t output_count;
+	const u8 *outputs;
+	size_t outputs_len;
+};
+
+/* Step over a tx; false if it doesn't parse. */
+bool pull_bitcoin_tx_view(const u8 **cursor, size_t *max,
+			  struct bitcoin_tx_view *view);
+
+/* Step over an input (start at view->inputs), giving what it spends. */
+void pull_bitcoin_tx_view_input(const u8 **cursor, size_t *max,
+				struct sha256_double *txid, u32 *index);
+
+/* Step over an output (start at view->outputs); @script points into it. */
+void pull_bitcoin_tx_view_output(const u8 **cursor, size_t *max,
+				 u64 *amount,
+				 const u8 **script, size_t *script_len);
+
+/* Same as bitcoin_txid() would give. */
+void bitcoin_tx_view_txid(const struct bitcoin_tx_view *view,
+			  struct sha256_double *txid);
+
+/* When we do want it. */
+struct bitcoin_tx *bitcoin_tx_from_view(const tal_t *ctx,
+					const struct bitcoin_tx_view *view);
+
 #endif /* LIGHTNING_BITCOIN_TX_H */
@@ -54,6 +54,24 @@ int main(int argc, char *argv[])
 	       block.h.u.u8[3], block.h.u.u8[4], block.h.u.u8[5],
 	       (unsigned long long)time_to_nsec(diff));
 
+	/* Hardware, if we have it. */
+	if (have_shani()) {
+		sha256(&block.h, &n, sizeof(n));
+		start = time_now();
+		for (i = 0; i < n; i++) {
+			struct sha256_ctx ctx = SHA256_INIT;
+			size_t j;
+			Transform_shani(ctx.s, block.u32);
+			for (j = 0; j < sizeof(ctx.s) / sizeof(ctx.s[0]); j++)
+				block.h.u.u32[j] = cpu_to_be32(ctx.s[j]);
+		}
+		diff = time_divide(time_between(time_now(), start), n);
+		printf("SHA-NI for %02x%02x%02x%02x%02x%02x... is %llu nsec\n",
+		       block.h.u.u8[0], block.h.u.u8[1], block.h.u.u8[2],
+		       block.h.u.u8[3], block.h.u.u8[4], block.h.u.u8[5],
+		       (unsigned long long)time_to_nsec(diff));
+	}
+
 	/* Now, assembler variants */
 	sha256(&block.h, &n, sizeof(n));
 
@@ -13,6 +13,16 @@
 #include <assert.h>
 #include <string.h>
 
+/* x86-64 with the SHA extensions can do a whole chunk in hardware: we check
+ * at runtime, since we're not built for any particular CPU. */
+#if !defined(CCAN_CRYPTO_SHA256_USE_OPENSSL) && defined(__GNUC__) && defined(__x86_64__)
+#define SHA256_HAVE_SHANI 1
+#include <cpuid.h>
+#include <immintrin.h>
+#else
+#define SHA256_HAVE_SHANI 0
+#endif
+
 static void invalidate_sha256(struct sha256_ctx *ctx)
 {
 #ifdef CCAN_CRYPTO_SHA256_USE_OPENSSL
@@ -167,6 +177,101 @@ static void Transform(uint32_t *s, const uint32_t *chunk)
 	s[7] += h;
 }
 
+#if SHA256_HAVE_SHANI
+static const uint32_t K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+/** Same as Transform(), using the SHA-NI instructions. */
+__attribute__((target("sha,sse4.1")))
+static void Transform_shani(uint32_t *s, const uint32_t *chunk)
+{
+	/* Byte-swaps each 32-bit word. */
+	const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+					     0x0405060700010203ULL);
+	__m128i abef, cdgh, abef_save, cdgh_save, tmp, w[4];
+	int i;
+
+	/* The instructions want the state as ABEF and CDGH. */
+	tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&s[0]), 0xB1);
+	cdgh = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&s[4]), 0x1B);
+	abef = _mm_alignr_epi8(tmp, cdgh, 8);
+	cdgh = _mm_blend_epi16(cdgh, tmp, 0xF0);
+	abef_save = abef;
+	cdgh_save = cdgh;
+
+	for (i = 0; i < 4; i++)
+		w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)
+							 &chunk[i * 4]),
+					bswap);
+
+	/* Four rounds at a time; w[i % 4] holds the next four words. */
+	for (i = 0; i < 16; i++) {
+		tmp = _mm_add_epi32(w[i % 4],
+				    _mm_loadu_si128((const __m128i *)&K[i * 4]));
+		cdgh = _mm_sha256rnds2_epu32(cdgh, abef, tmp);
+		abef = _mm_sha256rnds2_epu32(abef, cdgh,
+					     _mm_shuffle_epi32(tmp, 0x0E));
+		if (i < 12) {
+			tmp = _mm_sha256msg1_epu32(w[i % 4], w[(i + 1) % 4]);
+			tmp = _mm_add_epi32(tmp,
+					    _mm_alignr_epi8(w[(i + 3) % 4],
+							    w[(i + 2) % 4], 4));
+			w[i % 4] = _mm_sha256msg2_epu32(tmp, w[(i + 3) % 4]);
+		}
+	}
+
+	abef = _mm_add_epi32(abef, abef_save);
+	cdgh = _mm_add_epi32(cdgh, cdgh_save);
+
+	/* Back to ABCD and EFGH. */
+	tmp = _mm_shuffle_epi32(abef, 0x1B);
+	cdgh = _mm_shuffle_epi32(cdgh, 0xB1);
+	_mm_storeu_si128((__m128i *)&s[0], _mm_blend_epi16(tmp, cdgh, 0xF0));
+	_mm_storeu_si128((__m128i *)&s[4], _mm_alignr_epi8(cdgh, tmp, 8));
+}
+
+static bool have_shani(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	/* SSSE3 and SSE4.1 for the shuffles, then SHA itself. */
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)
+	    || !(ecx & bit_SSSE3) || !(ecx & bit_SSE4_1))
+		return false;
+	if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+		return false;
+	return ebx & bit_SHA;
+}
+#endif
+
+/* Whichever Transform this CPU does best: we only look once. */
+static void (*transform)(uint32_t *s, const uint32_t *chunk);
+
+static void pick_transform(void)
+{
+	transform = Transform;
+#if SHA256_HAVE_SHANI
+	if (have_shani())
+		transform = Transform_shani;
+#endif
+}
+
 static bool alignment_ok(const void *p UNUSED, size_t n UNUSED)
 {
 #if HAVE_UNALIGNED_ACCESS
@@ -181,23 +286,27 @@ static void add(struct sha256_ctx *ctx, const void *p, size_t len)
 	const unsigned char *data = p;
 	size_t bufsize = ctx->bytes % 64;
 
+	/* Every thread picks the same, so racing here is harmless. */
+	if (!transform)
+		pick_transform();
+
 	if (bufsize + len >= 64) {
 		/* Fill the buffer, and process it. */
 		memcpy(ctx->buf.u8 + bufsize, data, 64 - bufsize);
 		ctx->bytes += 64 - bufsize;
 		data += 64 - bufsize;
 		len -= 64 - bufsize;
-		Transform(ctx->s, ctx->buf.u32);
+		transform(ctx->s, ctx->buf.u32);
 		bufsize = 0;
 	}
 
 	while (len >= 64) {
 		/* Process full chunks directly from the source. */
 		if (alignment_ok(data, sizeof(uint32_t)))
-			Transform(ctx->s, (const uint32_t *)data);
+			transform(ctx->s, (const uint32_t *)data);
 		else {
 			memcpy(ctx->buf.u8, data, sizeof(ctx->buf));
-			Transform(ctx->s, ctx->buf.u32);
+			transform(ctx->s, ctx->buf.u32);
 		}
 		ctx->bytes += 64;
 		data += 64;
@@ -0,0 +1,416 @@
+/* Licensed under LGPLv2.1+ - see LICENSE file for details */
+/* An epoll(7) backend, a drop-in for poll.c: each loop only costs the
+ * fds which are ready, not every fd we have. */
+#include "io.h"
+#include "backend.h"
+#include <assert.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <ccan/time/time.h>
+#include <ccan/timer/timer.h>
+
+/* How many ready fds we handle per epoll_wait(). */
+#define MAX_EVENTS 64
+
+static int epfd = -1;
+/* All fds, so backend_wake() can find the waiters: events is what each is
+ * registered with epoll for (0 means it isn't). */
+static size_t num_fds = 0, max_fds = 0, num_waiting = 0;
+static struct fd **fds = NULL;
+static uint32_t *events = NULL;
+/* epoll refuses regular files (and /dev/null), which poll() says are
+ * always ready: we do the same for those, by hand. */
+static bool *unpollable = NULL;
+static size_t num_unpollable_waiting = 0;
+/* What the last epoll_wait() returned, and how far we are through it. */
+static struct epoll_event ready[MAX_EVENTS];
+static int num_ready, next_ready;
+static LIST_HEAD(closing);
+static LIST_HEAD(always);
+static struct timeabs (*nowfn)(void) = time_now;
+
+struct timeabs (*io_time_override(struct timeabs (*now)(void)))(void)
+{
+	struct timeabs (*old)(void) = nowfn;
+	nowfn = now;
+	return old;
+}
+
+/* Like poll.c, an fd with nothing to do isn't watched at all: epoll
+ * would still tell us about hangups, which poll ignores for those. */
+static bool set_events(struct fd *fd, uint32_t ev)
+{
+	uint32_t *cur = &events[fd->backend_info];
+	struct epoll_event e;
+	int op;
+
+	if (ev == *cur)
+		return true;
+
+	if (!*cur)
+		op = EPOLL_CTL_ADD;
+	else if (!ev)
+		op = EPOLL_CTL_DEL;
+	else
+		op = EPOLL_CTL_MOD;
+
+	if (!unpollable[fd->backend_info]) {
+		e.events = ev;
+		e.data.ptr = fd;
+		if (epoll_ctl(epfd, op, fd->fd, &e) != 0) {
+			if (op != EPOLL_CTL_ADD || errno != EPERM)
+				return false;
+			unpollable[fd->backend_info] = true;
+		}
+	}
+
+	if (*cur) {
+		num_waiting--;
+		if (unpollable[fd->backend_info])
+			num_unpollable_waiting--;
+	}
+	if (ev) {
+		num_waiting++;
+		if (unpollable[fd->backend_info])
+			num_unpollable_waiting++;
+	}
+	*cur = ev;
+	return true;
+}
+
+static bool add_fd(struct fd *fd, uint32_t ev)
+{
+	if (!max_fds) {
+		assert(num_fds == 0);
+		if (epfd < 0) {
+			epfd = epoll_create1(EPOLL_CLOEXEC);
+			if (epfd < 0)
+				return false;
+		}
+		fds = tal_arr(NULL, struct fd *, 8);
+		if (!fds)
+			return false;
+		events = tal_arr(fds, uint32_t, 8);
+		if (!events)
+			return false;
+		unpollable = tal_arr(fds, bool, 8);
+		if (!unpollable)
+			return false;
+		max_fds = 8;
+	}
+
+	if (num_fds + 1 > max_fds) {
+		size_t num = max_fds * 2;
+
+		if (!tal_resize(&fds, num))
+			return false;
+		if (!tal_resize(&events, num))
+			return false;
+		if (!tal_resize(&unpollable, num))
+			return false;
+		max_fds = num;
+	}
+
+	fds[num_fds] = fd;
+	events[num_fds] = 0;
+	unpollable[num_fds] = false;
+	fd->backend_info = num_fds;
+	if (!set_events(fd, ev))
+		return false;
+	num_fds++;
+
+	return true;
+}
+
+static void del_fd(struct fd *fd)
+{
+	size_t n = fd->backend_info;
+	int i;
+
+	assert(n != -1);
+	assert(n < num_fds);
+	/* It may already be closed (see io_close_listener), which takes it
+	 * out of the epoll set anyway. */
+	if (events[n]) {
+		if (unpollable[n])
+			num_unpollable_waiting--;
+		else
+			epoll_ctl(epfd, EPOLL_CTL_DEL, fd->fd, NULL);
+		num_waiting--;
+	}
+	if (n != num_fds - 1) {
+		/* Move last one over us. */
+		fds[n] = fds[num_fds-1];
+		events[n] = events[num_fds-1];
+		unpollable[n] = unpollable[num_fds-1];
+		assert(fds[n]->backend_info == num_fds-1);
+		fds[n]->backend_info = n;
+	} else if (num_fds == 1) {
+		/* Free everything when no more fds. */
+		fds = tal_free(fds);
+		events = NULL;
+		unpollable = NULL;
+		max_fds = 0;
+	}
+	num_fds--;
+	fd->backend_info = -1;
+
+	/* Don't hand a freed fd to io_ready() if it was also ready. */
+	for (i = next_ready; i < num_ready; i++)
+		if (ready[i].data.ptr == fd)
+			ready[i].data.ptr = NULL;
+
+	/* Closing a local socket doesn't wake poll() because other end
+	 * has them open.  See 2.6.  When should I use shutdown()?
+	 * in http://www.faqs.org/faqs/unix-faq/socket/ */
+	shutdown(fd->fd, SHUT_RDWR);
+
+	close(fd->fd);
+}
+
+bool add_listener(struct io_listener *l)
+{
+	if (!add_fd(&l->fd, EPOLLIN))
+		return false;
+	return true;
+}
+
+void remove_from_always(struct io_conn *conn)
+{
+	list_del_init(&conn->always);
+}
+
+void backend_new_closing(struct io_conn *conn)
+{
+	/* In case it's on always list, remove it. */
+	list_del_init(&conn->always);
+	list_add_tail(&closing, &conn->closing);
+}
+
+void backend_new_always(struct io_conn *conn)
+{
+	/* In case it's already in always list. */
+	list_del(&conn->always);
+	list_add_tail(&always, &conn->always);
+}
+
+void backend_new_plan(struct io_conn *conn)
+{
+	uint32_t ev = 0;
+
+	if (conn->plan[IO_IN].status == IO_POLLING)
+		ev |= EPOLLIN;
+	if (conn->plan[IO_OUT].status == IO_POLLING)
+		ev |= EPOLLOUT;
+
+	/* Someone closed the fd under us: poll() would say POLLNVAL. */
+	if (!set_events(&conn->fd, ev)) {
+		errno = EBADF;
+		io_close(conn);
+	}
+}
+
+void backend_wake(const void *wait)
+{
+	unsigned int i;
+
+	for (i = 0; i < num_fds; i++) {
+		struct io_conn *c;
+
+		/* Ignore listeners */
+		if (fds[i]->listener)
+			continue;
+
+		c = (void *)fds[i];
+		if (c->plan[IO_IN].status == IO_WAITING
+		    && c->plan[IO_IN].arg.u1.const_vp == wait)
+			io_do_wakeup(c, IO_IN);
+
+		if (c->plan[IO_OUT].status == IO_WAITING
+		    && c->plan[IO_OUT].arg.u1.const_vp == wait)
+			io_do_wakeup(c, IO_OUT);
+	}
+}
+
+bool add_conn(struct io_conn *c)
+{
+	return add_fd(&c->fd, 0);
+}
+
+static void del_conn(struct io_conn *conn)
+{
+	del_fd(&conn->fd);
+	if (conn->finish) {
+		/* Saved by io_close */
+		errno = conn->plan[IO_IN].arg.u1.s;
+		conn->finish(conn, conn->finish_arg);
+	}
+	tal_free(conn);
+}
+
+void del_listener(struct io_listener *l)
+{
+	del_fd(&l->fd);
+}
+
+static void accept_conn(struct io_listener *l)
+{
+	int fd = accept(l->fd.fd, NULL, NULL);
+
+	/* FIXME: What to do here? */
+	if (fd < 0)
+		return;
+
+	io_new_conn(l->ctx, fd, l->init, l->arg);
+}
+
+/* It's OK to miss some, as long as we make progress. */
+static bool close_conns(void)
+{
+	bool ret = false;
+	struct io_conn *conn;
+
+	while ((conn = list_pop(&closing, struct io_conn, closing)) != NULL) {
+		assert(conn->plan[IO_IN].status == IO_CLOSING);
+		assert(conn->plan[IO_OUT].status == IO_CLOSING);
+
+		del_conn(conn);
+		ret = true;
+	}
+	return ret;
+}
+
+static bool handle_always(void)
+{
+	bool ret = false;
+	struct io_conn *conn;
+
+	while ((conn = list_pop(&always, struct io_conn, always)) != NULL) {
+		assert(conn->plan[IO_IN].status == IO_ALWAYS
+		       || conn->plan[IO_OUT].status == IO_ALWAYS);
+
+		/* Re-initialize, for next time. */
+		list_node_init(&conn->always);
+		io_do_always(conn);
+		ret = true;
+	}
+	return ret;
+}
+
+/* This is the main loop. */
+void *io_loop(struct timers *timers, struct timer **expired)
+{
+	void *ret;
+
+	/* if timers is NULL, expired must be.  If not, not. */
+	assert(!timers == !expired);
+
+	/* Make sure this is NULL if we exit for some other reason. */
+	if (expired)
+		*expired = NULL;
+
+	while (!io_loop_return) {
+		int ms_timeout = -1;
+		size_t i;
+
+		if (close_conns()) {
+			/* Could have started/finished more. */
+			continue;
+		}
+
+		if (handle_always()) {
+			/* Could have started/finished more. */
+			continue;
+		}
+
+		/* Everything closed? */
+		if (num_fds == 0)
+			break;
+
+		/* You can't tell them all to go to sleep! */
+		assert(num_waiting);
+
+		if (timers) {
+			struct timeabs now, first;
+
+			now = nowfn();
+
+			/* Call functions for expired timers. */
+			*expired = timers_expire(timers, now);
+			if (*expired)
+				break;
+
+			/* Now figure out how long to wait for the next one. */
+			if (timer_earliest(timers, &first)) {
+				uint64_t next;
+				next = time_to_msec(time_between(first, now));
+				if (next < INT_MAX)
+					ms_timeout = next;
+				else
+					ms_timeout = INT_MAX;
+			}
+		}
+
+		if (num_unpollable_waiting)
+			ms_timeout = 0;
+
+		num_ready = epoll_wait(epfd, ready, MAX_EVENTS, ms_timeout);
+		if (num_ready < 0) {
+			num_ready = 0;
+			break;
+		}
+
+		/* There are rarely any of these, so just look for them. */
+		for (i = 0; num_unpollable_waiting && i < num_fds; i++) {
+			if (!unpollable[i] || !events[i])
+				continue;
+			if (num_ready == MAX_EVENTS)
+				break;
+			ready[num_ready].events = events[i];
+			ready[num_ready].data.ptr = fds[i];
+			num_ready++;
+		}
+
+		for (next_ready = 0;
+		     next_ready < num_ready && !io_loop_return;
+		     next_ready++) {
+			struct fd *fd = ready[next_ready].data.ptr;
+			uint32_t ev;
+
+			/* Closed, or gone idle, earlier in this batch? */
+			if (!fd || !events[fd->backend_info])
+				continue;
+
+			/* Only what we still want (plans may have changed
+			 * while handling earlier ones). */
+			ev = ready[next_ready].events
+				& (events[fd->backend_info]
+				   | EPOLLHUP | EPOLLERR);
+			if (fd->listener) {
+				if (ev & EPOLLIN)
+					accept_conn((void *)fd);
+			} else if (ev & (EPOLLIN|EPOLLOUT)) {
+				io_ready((void *)fd,
+					 ((ev & EPOLLIN) ? POLLIN : 0)
+					 | ((ev & EPOLLOUT) ? POLLOUT : 0));
+			} else if (ev & (EPOLLHUP|EPOLLERR)) {
+				errno = EBADF;
+				io_close((void *)fd);
+			}
+		}
+		num_ready = next_ready = 0;
+	}
+
+	close_conns();
+
+	ret = io_loop_return;
+	io_loop_return = NULL;
+
+	return ret;
+}
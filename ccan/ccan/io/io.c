@@ -14,6 +14,20 @@
 
 void *io_loop_return;
 
+static void (*monitorfn)(void *monitor_arg,
+			 const void *callback, const void *arg,
+			 struct timerel took);
+static void *monitorfn_arg;
+
+void io_set_monitor(void (*fn)(void *monitor_arg,
+			       const void *callback, const void *arg,
+			       struct timerel took),
+		    void *monitor_arg)
+{
+	monitorfn = fn;
+	monitorfn_arg = monitor_arg;
+}
+
 struct io_listener *io_new_listener_(const tal_t *ctx, int fd,
 				     struct io_plan *(*init)(struct io_conn *,
 							     void *),
@@ -55,7 +69,15 @@ static void next_plan(struct io_conn *conn, struct io_plan *plan)
 	plan->io = NULL;
 	plan->next = io_never_called;
 
-	plan = next(conn, plan->next_arg);
+	if (monitorfn) {
+		void *arg = plan->next_arg;
+		struct timeabs start = time_now();
+
+		plan = next(conn, arg);
+		monitorfn(monitorfn_arg, next, arg,
+			  time_between(time_now(), start));
+	} else
+		plan = next(conn, plan->next_arg);
 
 	/* It should have set a plan inside this conn (or duplex) */
 	assert(plan == &conn->plan[IO_IN]
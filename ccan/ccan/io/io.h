@@ -2,6 +2,7 @@
 #ifndef CCAN_IO_H
 #define CCAN_IO_H
 #include <ccan/tal/tal.h>
+#include <ccan/time/time.h>
 #include <ccan/typesafe_cb/typesafe_cb.h>
 #include <stdbool.h>
 #include <unistd.h>
@@ -692,4 +693,18 @@ void io_set_debug(struct io_conn *conn, bool debug);
  * 3) io_break() is called (sychronous debug will resume after io_loop())
  */
 void io_debug_complete(struct io_conn *conn);
+
+/**
+ * io_set_monitor - call a function after each callback, with how long it took.
+ * @fn: the function to call (or NULL to stop).
+ * @monitor_arg: the first argument to hand it.
+ *
+ * @fn gets the callback which was called, and the argument it was given:
+ * that may have been freed by the callback, so only compare the pointer.
+ * This costs two time_now() per callback, so only set it if you want it.
+ */
+void io_set_monitor(void (*fn)(void *monitor_arg,
+			       const void *callback, const void *arg,
+			       struct timerel took),
+		    void *monitor_arg);
 #endif /* CCAN_IO_H */
@@ -1,13 +1,19 @@
-/* Code for talking to bitcoind.  We use bitcoin-cli. */
+/* Code for talking to bitcoind.  We use bitcoin-cli, or its RPC interface
+ * directly if --bitcoin-rpcconnect is given. */
 #include "bitcoin/base58.h"
 #include "bitcoin/block.h"
 #include "bitcoin/shadouble.h"
 #include "bitcoin/tx.h"
 #include "bitcoind.h"
+#include "chainsource.h"
 #include "json.h"
 #include "lightningd.h"
 #include "log.h"
+#include "stats.h"
+#include "trace.h"
 #include "utils.h"
+#include <assert.h>
+#include <ccan/array_size/array_size.h>
 #include <ccan/cast/cast.h>
 #include <ccan/io/io.h>
 #include <ccan/pipecmd/pipecmd.h>
@@ -19,10 +25,18 @@
 #include <ccan/tal/tal.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/types.h>
 
 #define BITCOIN_CLI "bitcoin-cli"
 
 char *bitcoin_datadir;
+char *bitcoin_rpcconnect, *bitcoin_rpcuser, *bitcoin_rpcpassword;
 
 static char **gather_args(const tal_t *ctx, const char *cmd, va_list ap)
 {
@@ -57,13 +71,45 @@ struct bitcoin_cli {
 	size_t output_bytes;
 	size_t new_output;
 	void (*process)(struct bitcoin_cli *);
+	/* For getblock: decoded as it arrives, rather than kept as hex. */
+	struct bitcoin_block_stream *block;
 	void *cb;
 	void *cb_arg;
+	/* For stats. */
+	const char *method;
+	struct timeabs start;
 };
 
+/* How much hex we read at once, if we're decoding it as it arrives. */
+#define BLOCK_READ_CHUNK 65536
+
+/* Hand on the whole bytes' worth of hex we have; keep any odd one. */
+static void stream_output(struct bitcoin_cli *bcli)
+{
+	size_t n = bcli->output_bytes;
+
+	/* bitcoin-cli ends it with a newline. */
+	if (n && bcli->output[n-1] == '\n')
+		n--;
+	n -= n % 2;
+	if (!n)
+		return;
+
+	if (!bitcoin_block_stream_add(bcli->block, bcli->output, n)) {
+		/* Not a block (maybe an error message): keep the rest, for
+		 * process_rawblock to complain about. */
+		bcli->block = tal_free(bcli->block);
+		return;
+	}
+	memmove(bcli->output, bcli->output + n, bcli->output_bytes - n);
+	bcli->output_bytes -= n;
+}
+
 static struct io_plan *read_more(struct io_conn *conn, struct bitcoin_cli *bcli)
 {
 	bcli->output_bytes += bcli->new_output;
+	if (bcli->block)
+		stream_output(bcli);
 	if (bcli->output_bytes == tal_count(bcli->output))
 		tal_resize(&bcli->output, bcli->output_bytes * 2);
 	return io_read_partial(conn, bcli->output + bcli->output_bytes,
@@ -74,7 +120,7 @@ static struct io_plan *read_more(struct io_conn *conn, struct bitcoin_cli *bcli)
 static struct io_plan *output_init(struct io_conn *conn, struct bitcoin_cli *bcli)
 {
 	bcli->output_bytes = bcli->new_output = 0;
-	bcli->output = tal_arr(bcli, char, 100);
+	bcli->output = tal_arr(bcli, char, bcli->block ? BLOCK_READ_CHUNK : 100);
 	return read_more(conn, bcli);
 }
 
@@ -96,7 +142,7 @@ static char *bcli_args(struct bitcoin_cli *bcli)
 static void bcli_finished(struct io_conn *conn, struct bitcoin_cli *bcli)
 {
 	int ret, status;
-	struct lightningd_state *dstate = bcli->dstate;
+	struct lightningd_state *dstate = bcli->dstate->host;
 
 	/* FIXME: If we waited for SIGCHILD, this could never hang! */
 	ret = waitpid(bcli->pid, &status, 0);
@@ -120,38 +166,442 @@ static void bcli_finished(struct io_conn *conn, struct bitcoin_cli *bcli)
 		*bcli->exitstatus = WEXITSTATUS(status);
 
 	log_debug(dstate->base_log, "reaped %u: %s", ret, bcli_args(bcli));
-	dstate->bitcoin_req_running = false;
+	stats_bitcoind(dstate, bcli->method, bcli->start);
+	trace2(bitcoind_done, bcli, bcli->method);
+	dstate->bitcoin_req_running--;
 	bcli->process(bcli);
 
 	next_bcli(dstate);
 }
 
+/* Talking to bitcoind directly: keep-alive HTTP connections, carrying
+ * the same requests bitcoin-cli would have made.  bitcoind answers one
+ * request at a time per connection, so we open up to
+ * config.bitcoind_concurrency of them. */
+struct bitcoind_rpc {
+	struct lightningd_state *dstate;
+	struct addrinfo *addr;
+	/* For HTTP headers. */
+	const char *host, *auth;
+	/* All the rpc_conns we've opened. */
+	struct list_head conns;
+	u64 id;
+};
+
+struct rpc_conn {
+	struct list_node list;
+	struct bitcoind_rpc *rpc;
+	/* NULL if we're not connected. */
+	struct io_conn *conn;
+	/* Request we're working on, if any. */
+	struct bitcoin_cli *bcli;
+	char *request;
+	bool retried;
+	/* Response so far: headers end at body, if we've seen them. */
+	char *response;
+	size_t response_bytes, new_bytes;
+	const char *body;
+	size_t body_len;
+	/* Hex of a getblock result we've already decoded, and dropped. */
+	size_t body_streamed;
+	int status;
+	bool keepalive;
+};
+
+/* bitcoin-cli turns these arguments into JSON values; rest are strings. */
+static const struct {
+	const char *method;
+	size_t param;
+} rpc_nonstring_params[] = {
+	{ "estimatefee", 0 },
+	{ "getblockhash", 0 },
+	{ "getblock", 1 },
+	{ "getblockheader", 1 },
+	{ "gettxout", 1 }
+};
+
+static bool rpc_param_is_string(const char *method, size_t param)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(rpc_nonstring_params); i++) {
+		if (streq(rpc_nonstring_params[i].method, method)
+		    && rpc_nonstring_params[i].param == param)
+			return false;
+	}
+	return true;
+}
+
+static char *rpc_request(const tal_t *ctx, struct bitcoind_rpc *rpc,
+			 char **args)
+{
+	char *body;
+	size_t i, p;
+
+	/* Skip over "bitcoin-cli" and any -options. */
+	for (i = 1; args[i][0] == '-'; i++);
+
+	body = tal_fmt(ctx, "{\"jsonrpc\":\"1.0\",\"id\":%"PRIu64","
+		       "\"method\":\"%s\",\"params\":[",
+		       rpc->id++, args[i]);
+	for (p = 0; args[i+1+p]; p++) {
+		const char *quote = rpc_param_is_string(args[i], p) ? "\"" : "";
+		tal_append_fmt(&body, "%s%s%s%s", p ? "," : "",
+			       quote, args[i+1+p], quote);
+	}
+	tal_append_fmt(&body, "]}");
+
+	return tal_fmt(ctx, "POST / HTTP/1.1\r\n"
+		       "Host: %s\r\n"
+		       "Authorization: Basic %s\r\n"
+		       "Content-Type: application/json\r\n"
+		       "Content-Length: %zu\r\n"
+		       "\r\n"
+		       "%s",
+		       rpc->host, rpc->auth, strlen(body), body);
+}
+
+/* Make it look like bitcoin-cli's output, for the process functions. */
+static void rpc_output(struct rpc_conn *rc, struct bitcoin_cli *bcli)
+{
+	const jsmntok_t *toks, *result, *error;
+	bool valid;
+
+	toks = json_parse_input(rc->body, rc->body_len, &valid);
+	if (!toks || toks[0].type != JSMN_OBJECT)
+		fatal("%s: bitcoind gave %s response %i '%.*s'",
+		      bcli_args(bcli), valid ? "partial" : "invalid",
+		      rc->status, (int)rc->body_len, rc->body);
+
+	result = json_get_member(rc->body, toks, "result");
+	error = json_get_member(rc->body, toks, "error");
+	if (error && !json_tok_is_null(rc->body, error)) {
+		const jsmntok_t *code, *msg;
+
+		code = json_get_member(rc->body, error, "code");
+		msg = json_get_member(rc->body, error, "message");
+		if (!code || !msg)
+			fatal("%s: bitcoind gave bad error '%.*s'",
+			      bcli_args(bcli),
+			      (int)rc->body_len, rc->body);
+		if (!bcli->exitstatus)
+			fatal("%s: bitcoind error %.*s: %.*s",
+			      bcli_args(bcli),
+			      code->end - code->start, rc->body + code->start,
+			      msg->end - msg->start, rc->body + msg->start);
+		/* bitcoin-cli exits with the error code. */
+		*bcli->exitstatus = abs(atoi(rc->body + code->start));
+		bcli->output = tal_fmt(bcli,
+				       "error code: %.*s\nerror message:\n%.*s\n",
+				       code->end - code->start,
+				       rc->body + code->start,
+				       msg->end - msg->start,
+				       rc->body + msg->start);
+	} else {
+		if (!result)
+			fatal("%s: bitcoind gave no result '%.*s'",
+			      bcli_args(bcli),
+			      (int)rc->body_len, rc->body);
+		if (bcli->exitstatus)
+			*bcli->exitstatus = 0;
+		/* Strings come without quotes. */
+		bcli->output = tal_fmt(bcli, "%.*s\n",
+				       result->end - result->start,
+				       rc->body + result->start);
+	}
+	bcli->output_bytes = strlen(bcli->output);
+	tal_free(toks);
+}
+
+static struct io_plan *rpc_send(struct io_conn *conn, struct rpc_conn *rc);
+
+static struct io_plan *rpc_done(struct io_conn *conn, struct rpc_conn *rc)
+{
+	struct lightningd_state *dstate = rc->rpc->dstate;
+	struct bitcoin_cli *bcli = rc->bcli;
+
+	if (rc->status == 401 || rc->status == 403)
+		fatal("bitcoind refused our rpc credentials: check"
+		      " --bitcoin-rpcuser and --bitcoin-rpcpassword");
+
+	/* json_parse_input wants a tal object. */
+	rc->body_len -= rc->body_streamed;
+	rc->body = tal_strndup(rc->response, rc->body, rc->body_len);
+	rpc_output(rc, bcli);
+	log_debug(dstate->base_log, "rpc done: %s", bcli_args(bcli));
+	stats_bitcoind(dstate, bcli->method, bcli->start);
+	trace2(bitcoind_done, bcli, bcli->method);
+
+	/* This may start another request (maybe on this connection). */
+	rc->bcli = NULL;
+	dstate->bitcoin_req_running--;
+	bcli->process(bcli);
+	tal_free(bcli);
+	next_bcli(dstate);
+
+	if (!rc->keepalive)
+		return io_close(conn);
+	return rpc_send(conn, rc);
+}
+
+static bool rpc_parse_headers(struct rpc_conn *rc)
+{
+	char *end, *p;
+	size_t len;
+
+	end = memmem(rc->response, rc->response_bytes, "\r\n\r\n", 4);
+	if (!end)
+		return false;
+	*end = '\0';
+
+	if (sscanf(rc->response, "HTTP/1.%*u %i", &rc->status) != 1)
+		fatal("bitcoind gave bad HTTP response '%s'", rc->response);
+
+	/* HTTP/1.0 closes by default. */
+	rc->keepalive = strstarts(rc->response, "HTTP/1.1");
+	rc->body_len = 0;
+	for (p = strchr(rc->response, '\n'); p; p = strchr(p, '\n')) {
+		p++;
+		len = strcspn(p, "\r\n");
+		if (strncasecmp(p, "Content-Length:", strlen("Content-Length:"))
+		    == 0)
+			rc->body_len = strtoul(p + strlen("Content-Length:"),
+						NULL, 10);
+		else if (strncasecmp(p, "Connection:", strlen("Connection:"))
+			 == 0)
+			rc->keepalive = !strstr(tal_strndup(rc->response, p, len),
+						 "close");
+	}
+	rc->body = end + 4;
+	return true;
+}
+
+/* bitcoind puts the result first: if it's a (hex) string, we decode it as
+ * it arrives and drop it, so what's left is a result of "". */
+static void rpc_stream_result(struct rpc_conn *rc)
+{
+	static const char prefix[] = "{\"result\":\"";
+	struct bitcoin_cli *bcli = rc->bcli;
+	char *hex, *end, *quote;
+	size_t n;
+
+	end = rc->response + rc->response_bytes;
+	if ((size_t)(end - rc->body) < strlen(prefix))
+		return;
+
+	if (memcmp(rc->body, prefix, strlen(prefix)) != 0) {
+		/* An error, probably: rpc_output will sort it out. */
+		bcli->block = tal_free(bcli->block);
+		return;
+	}
+
+	hex = cast_const(char *, rc->body) + strlen(prefix);
+	quote = memchr(hex, '"', end - hex);
+	n = (quote ? quote : end) - hex;
+	n -= n % 2;
+	if (!n)
+		return;
+
+	if (!bitcoin_block_stream_add(bcli->block, hex, n))
+		fatal("%s: bad block from bitcoind", bcli_args(bcli));
+	memmove(hex, hex + n, end - (hex + n));
+	rc->response_bytes -= n;
+	rc->body_streamed += n;
+}
+
+static struct io_plan *rpc_read_more(struct io_conn *conn,
+				     struct rpc_conn *rc)
+{
+	size_t headers;
+
+	rc->response_bytes += rc->new_bytes;
+	if (!rc->body && !rpc_parse_headers(rc))
+		goto more;
+
+	if (rc->bcli->block)
+		rpc_stream_result(rc);
+
+	headers = rc->body - rc->response;
+	if (rc->response_bytes + rc->body_streamed >= headers + rc->body_len) {
+		/* bitcoind never pipelines, so there's nothing after. */
+		if (rc->response_bytes + rc->body_streamed
+		    > headers + rc->body_len)
+			fatal("bitcoind sent %zu extra bytes",
+			      rc->response_bytes + rc->body_streamed
+			      - headers - rc->body_len);
+		return rpc_done(conn, rc);
+	}
+
+more:
+	if (rc->response_bytes == tal_count(rc->response)) {
+		size_t body_off = rc->body ? rc->body - rc->response : 0;
+		tal_resize(&rc->response, rc->response_bytes * 2);
+		if (rc->body)
+			rc->body = rc->response + body_off;
+	}
+	return io_read_partial(conn, rc->response + rc->response_bytes,
+			       tal_count(rc->response) - rc->response_bytes,
+			       &rc->new_bytes, rpc_read_more, rc);
+}
+
+static struct io_plan *rpc_send(struct io_conn *conn, struct rpc_conn *rc)
+{
+	if (!rc->bcli)
+		return io_wait(conn, rc, rpc_send, rc);
+
+	rc->response = tal_free(rc->response);
+	rc->response = tal_arr(rc, char,
+			       rc->bcli->block ? BLOCK_READ_CHUNK : 1000);
+	rc->response_bytes = rc->new_bytes = 0;
+	rc->body = NULL;
+	rc->body_streamed = 0;
+	return io_write(conn, rc->request, strlen(rc->request),
+			rpc_read_more, rc);
+}
+
+static struct io_plan *rpc_init(struct io_conn *conn, struct rpc_conn *rc)
+{
+	return io_connect(conn, rc->rpc->addr, rpc_send, rc);
+}
+
+static void rpc_connect(struct rpc_conn *rc);
+
+static void rpc_disconnected(struct io_conn *conn, struct rpc_conn *rc)
+{
+	rc->conn = NULL;
+	if (!rc->bcli)
+		return;
+
+	/* bitcoind closes idle connections: we only notice on next write. */
+	if (rc->response_bytes == 0 && !rc->retried) {
+		log_debug(rc->rpc->dstate->base_log,
+			  "Reconnecting to bitcoind");
+		rc->retried = true;
+		rpc_connect(rc);
+		return;
+	}
+	fatal("%s: lost connection to bitcoind at %s: %s",
+	      bcli_args(rc->bcli), rc->rpc->host, strerror(errno));
+}
+
+static void rpc_connect(struct rpc_conn *rc)
+{
+	const struct addrinfo *addr = rc->rpc->addr;
+	int fd;
+
+	fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+	if (fd < 0)
+		fatal("Creating socket for bitcoind: %s", strerror(errno));
+
+	rc->response_bytes = 0;
+	rc->conn = io_new_conn(rc, fd, rpc_init, rc);
+	io_set_finish(rc->conn, rpc_disconnected, rc);
+}
+
+static struct rpc_conn *idle_conn(struct bitcoind_rpc *rpc)
+{
+	struct rpc_conn *rc;
+
+	list_for_each(&rpc->conns, rc, list) {
+		if (!rc->bcli)
+			return rc;
+	}
+	return NULL;
+}
+
+/* We never have more than config.bitcoind_concurrency running, so we never
+ * open more connections than that. */
+static void rpc_start(struct bitcoind_rpc *rpc, struct bitcoin_cli *bcli)
+{
+	struct rpc_conn *rc = idle_conn(rpc);
+
+	if (!rc) {
+		rc = tal(rpc, struct rpc_conn);
+		rc->rpc = rpc;
+		rc->conn = NULL;
+		rc->request = NULL;
+		rc->response = NULL;
+		list_add_tail(&rpc->conns, &rc->list);
+	}
+
+	rc->bcli = tal_steal(rc, bcli);
+	rc->retried = false;
+	rc->response_bytes = 0;
+	tal_free(rc->request);
+	rc->request = rpc_request(rc, rpc, bcli->args);
+
+	if (!rc->conn)
+		rpc_connect(rc);
+	else
+		io_wake(rc);
+}
+
+/* Most urgent first, then oldest first. */
+static struct bitcoin_cli *pop_bcli(struct lightningd_state *dstate)
+{
+	struct bitcoin_cli *bcli;
+	size_t i;
+
+	for (i = 0; i < BITCOIND_NUM_PRIOS; i++) {
+		bcli = list_pop(&dstate->bitcoin_req[i], struct bitcoin_cli,
+				list);
+		if (bcli)
+			return bcli;
+	}
+	return NULL;
+}
+
 static void next_bcli(struct lightningd_state *dstate)
 {
 	struct bitcoin_cli *bcli;
 	struct io_conn *conn;
 
-	if (dstate->bitcoin_req_running)
-		return;
+	while (dstate->bitcoin_req_running
+	       < dstate->config.bitcoind_concurrency) {
+		bcli = pop_bcli(dstate);
+		if (!bcli)
+			return;
 
-	bcli = list_pop(&dstate->bitcoin_req, struct bitcoin_cli, list);
-	if (!bcli)
-		return;
+		log_debug(bcli->dstate->base_log, "starting: %s",
+			  bcli_args(bcli));
 
-	log_debug(bcli->dstate->base_log, "starting: %s", bcli_args(bcli));
+		dstate->bitcoin_req_running++;
+		bcli->start = time_now();
+		trace2(bitcoind_start, bcli, bcli->method);
+		if (dstate->bitcoind_rpc) {
+			rpc_start(dstate->bitcoind_rpc, bcli);
+			continue;
+		}
 
-	bcli->pid = pipecmdarr(&bcli->fd, NULL, &bcli->fd, bcli->args);
-	if (bcli->pid < 0)
-		fatal("%s exec failed: %s", bcli->args[0], strerror(errno));
+		bcli->pid = pipecmdarr(&bcli->fd, NULL, &bcli->fd, bcli->args);
+		if (bcli->pid < 0)
+			fatal("%s exec failed: %s",
+			      bcli->args[0], strerror(errno));
+
+		conn = io_new_conn(dstate, bcli->fd, output_init, bcli);
+		tal_steal(conn, bcli);
+		io_set_finish(conn, bcli_finished, bcli);
+	}
+}
+
+static bool bitcoind_busy(const struct lightningd_state *dstate)
+{
+	size_t i;
 
-	dstate->bitcoin_req_running = true;
-	conn = io_new_conn(dstate, bcli->fd, output_init, bcli);
-	tal_steal(conn, bcli);
-	io_set_finish(conn, bcli_finished, bcli);
+	dstate = dstate->host;
+	if (dstate->bitcoin_req_running < dstate->config.bitcoind_concurrency)
+		return false;
+	for (i = 0; i <= BITCOIND_PRIO_POLL; i++)
+		if (!list_empty(&dstate->bitcoin_req[i]))
+			return true;
+	return false;
 }
 
+static void process_rawblock(struct bitcoin_cli *bcli);
+
 static void
 start_bitcoin_cli(struct lightningd_state *dstate,
+		  enum bitcoind_prio prio,
 		  void (*process)(struct bitcoin_cli *),
 		  bool nonzero_exit_ok,
 		  void *cb, void *cb_arg,
@@ -162,8 +612,14 @@ start_bitcoin_cli(struct lightningd_state *dstate,
 
 	bcli->dstate = dstate;
 	bcli->process = process;
+	/* Raw blocks are megabytes of hex: decode them as they arrive. */
+	if (process == process_rawblock)
+		bcli->block = bitcoin_block_stream_new(bcli, 0);
+	else
+		bcli->block = NULL;
 	bcli->cb = cb;
 	bcli->cb_arg = cb_arg;
+	bcli->method = cmd;
 	if (nonzero_exit_ok)
 		bcli->exitstatus = tal(bcli, int);
 	else
@@ -172,8 +628,9 @@ start_bitcoin_cli(struct lightningd_state *dstate,
 	bcli->args = gather_args(bcli, cmd, ap);
 	va_end(ap);
 
-	list_add_tail(&dstate->bitcoin_req, &bcli->list);
-	next_bcli(dstate);
+	/* Tenants' requests queue with the host's. */
+	list_add_tail(&dstate->host->bitcoin_req[prio], &bcli->list);
+	next_bcli(dstate->host);
 }
 
 static void process_estimatefee_6(struct bitcoin_cli *bcli)
@@ -217,7 +674,8 @@ static void process_estimatefee_2(struct bitcoin_cli *bcli)
 
 	/* Don't know at 2?  Try 6... */
 	if (fee < 0) {
-		start_bitcoin_cli(bcli->dstate, process_estimatefee_6,
+		start_bitcoin_cli(bcli->dstate, BITCOIND_PRIO_POLL,
+				  process_estimatefee_6,
 				  false, bcli->cb, bcli->cb_arg,
 				  "estimatefee", "6", NULL);
 		return;
@@ -226,36 +684,115 @@ static void process_estimatefee_2(struct bitcoin_cli *bcli)
 	cb(bcli->dstate, fee_rate, bcli->cb_arg);
 }
 
-void bitcoind_estimate_fee_(struct lightningd_state *dstate,
+static void bitcoind_estimate_fee(struct lightningd_state *dstate,
 			    void (*cb)(struct lightningd_state *dstate,
 				       u64, void *),
 			    void *arg)
 {
-	start_bitcoin_cli(dstate, process_estimatefee_2, false, cb, arg,
+	start_bitcoin_cli(dstate, BITCOIND_PRIO_POLL,
+			  process_estimatefee_2, false, cb, arg,
 			  "estimatefee", "2", NULL);
 }
 
+/* They're sent one at a time, each once bitcoind has answered the last:
+ * run side by side, a child could reach bitcoind before its parent and be
+ * refused.  The batch needn't be in order, either: while any are going
+ * in, we go round again for those refused for missing inputs. */
+struct sendrawtxs {
+	const char **hextxs;
+	/* What we're sending now. */
+	size_t next;
+	/* Something went in this time round. */
+	bool progress;
+	bool *accepted;
+	const char **msgs;
+	void (*cb)(struct lightningd_state *dstate,
+		   const bool *accepted, const char **msgs, void *);
+	void *arg;
+};
+
+/* Its parent may not be there (yet). */
+static bool missing_inputs(const char *msg)
+{
+	return strstr(msg, "Missing inputs") || strstr(msg, "missing-inputs");
+}
+
+static void process_sendrawtx(struct bitcoin_cli *bcli);
+
+static void send_next_rawtx(struct lightningd_state *dstate,
+			    struct sendrawtxs *batch)
+{
+	size_t n = tal_count(batch->hextxs);
+
+	/* Skip those it's already answered for good. */
+	while (batch->next < n
+	       && batch->msgs[batch->next]
+	       && !missing_inputs(batch->msgs[batch->next]))
+		batch->next++;
+
+	if (batch->next == n) {
+		if (batch->progress) {
+			batch->next = 0;
+			batch->progress = false;
+			send_next_rawtx(dstate, batch);
+			return;
+		}
+		batch->cb(dstate, batch->accepted, batch->msgs, batch->arg);
+		tal_free(batch);
+		return;
+	}
+
+	start_bitcoin_cli(dstate, BITCOIND_PRIO_URGENT,
+			  process_sendrawtx, true, NULL, batch,
+			  "sendrawtransaction", batch->hextxs[batch->next],
+			  NULL);
+}
+
 static void process_sendrawtx(struct bitcoin_cli *bcli)
 {
-	void (*cb)(struct lightningd_state *dstate,
-		   const char *msg, void *) = bcli->cb;
-	const char *msg = tal_strndup(bcli, (char *)bcli->output,
+	struct sendrawtxs *batch = bcli->cb_arg;
+	size_t i = batch->next++;
+	const char *msg = tal_strndup(batch->msgs, (char *)bcli->output,
 				      bcli->output_bytes);
 
 	log_debug(bcli->dstate->base_log, "sendrawtx exit %u, gave %s",
 		  *bcli->exitstatus, msg);
 
-	cb(bcli->dstate, msg, bcli->cb_arg);
+	tal_free(batch->msgs[i]);
+	batch->msgs[i] = msg;
+	batch->accepted[i] = (*bcli->exitstatus == 0
+			      || strstr(msg, "txn-already-in-mempool")
+			      || strstr(msg, "already in block chain"));
+	if (batch->accepted[i])
+		batch->progress = true;
+	send_next_rawtx(bcli->dstate, batch);
 }
 
-void bitcoind_sendrawtx_(struct lightningd_state *dstate,
-			 const char *hextx,
-			 void (*cb)(struct lightningd_state *dstate,
-				    const char *msg, void *),
-			 void *arg)
+/* hextxs must last until cb. */
+static void bitcoind_sendrawtxs(struct lightningd_state *dstate,
+				const char **hextxs,
+				void (*cb)(struct lightningd_state *dstate,
+					   const bool *accepted,
+					   const char **msgs, void *),
+				void *arg)
 {
-	start_bitcoin_cli(dstate, process_sendrawtx, true, cb, arg,
-			  "sendrawtransaction", hextx, NULL);
+	struct sendrawtxs *batch = tal(dstate, struct sendrawtxs);
+	size_t i, n = tal_count(hextxs);
+
+	assert(n);
+	batch->hextxs = hextxs;
+	batch->next = 0;
+	batch->progress = false;
+	batch->accepted = tal_arr(batch, bool, n);
+	batch->msgs = tal_arr(batch, const char *, n);
+	for (i = 0; i < n; i++) {
+		batch->accepted[i] = false;
+		batch->msgs[i] = NULL;
+	}
+	batch->cb = cb;
+	batch->arg = arg;
+
+	send_next_rawtx(dstate, batch);
 }
 
 static void process_chaintips(struct bitcoin_cli *bcli)
@@ -318,14 +855,14 @@ static void process_chaintips(struct bitcoin_cli *bcli)
 	cb(bcli->dstate, &tip, bcli->cb_arg);
 }
 
-void bitcoind_get_chaintip_(struct lightningd_state *dstate,
+static void bitcoind_get_chaintip(struct lightningd_state *dstate,
 			    void (*cb)(struct lightningd_state *dstate,
 				       const struct sha256_double *tipid,
 				       void *arg),
 			    void *arg)
 {
-	start_bitcoin_cli(dstate, process_chaintips, false, cb, arg,
-			  "getchaintips", NULL);
+	start_bitcoin_cli(dstate, BITCOIND_PRIO_POLL, process_chaintips, false,
+			  cb, arg, "getchaintips", NULL);
 }
 
 struct normalizing {
@@ -350,7 +887,16 @@ static void process_rawblock(struct bitcoin_cli *bcli)
 		   void *arg) = bcli->cb;
 
 	/* FIXME: Just get header if we can't get full block. */
-	blk = bitcoin_block_from_hex(bcli, bcli->output, bcli->output_bytes);
+	if (bcli->block) {
+		/* All but the newline went in as it arrived. */
+		if (bcli->output_bytes > 1
+		    || (bcli->output_bytes && bcli->output[0] != '\n'))
+			blk = NULL;
+		else
+			blk = bitcoin_block_stream_done(bcli, bcli->block);
+	} else
+		blk = bitcoin_block_from_hex(bcli, bcli->output,
+					     bcli->output_bytes);
 	if (!blk)
 		fatal("%s: bad block '%.*s'?",
 		      bcli_args(bcli),
@@ -359,7 +905,7 @@ static void process_rawblock(struct bitcoin_cli *bcli)
 	cb(bcli->dstate, blk, bcli->cb_arg);
 }
 
-void bitcoind_getrawblock_(struct lightningd_state *dstate,
+static void bitcoind_getrawblock(struct lightningd_state *dstate,
 			   const struct sha256_double *blockid,
 			   void (*cb)(struct lightningd_state *dstate,
 				      struct bitcoin_block *blk,
@@ -369,8 +915,38 @@ void bitcoind_getrawblock_(struct lightningd_state *dstate,
 	char hex[hex_str_size(sizeof(*blockid))];
 
 	bitcoin_blkid_to_hex(blockid, hex, sizeof(hex));
-	start_bitcoin_cli(dstate, process_rawblock, false, cb, arg,
-			  "getblock", hex, "false", NULL);
+	start_bitcoin_cli(dstate, BITCOIND_PRIO_BULK, process_rawblock, false,
+			  cb, arg, "getblock", hex, "false", NULL);
+}
+
+static void process_blockheader(struct bitcoin_cli *bcli)
+{
+	struct bitcoin_block *blk;
+	void (*cb)(struct lightningd_state *dstate,
+		   struct bitcoin_block *blk,
+		   void *arg) = bcli->cb;
+
+	blk = bitcoin_block_hdr_from_hex(bcli, bcli->output, bcli->output_bytes);
+	if (!blk)
+		fatal("%s: bad block header '%.*s'?",
+		      bcli_args(bcli),
+		      (int)bcli->output_bytes, (char *)bcli->output);
+
+	cb(bcli->dstate, blk, bcli->cb_arg);
+}
+
+static void bitcoind_getblockheader(struct lightningd_state *dstate,
+			      const struct sha256_double *blockid,
+			      void (*cb)(struct lightningd_state *dstate,
+					 struct bitcoin_block *blk,
+					 void *arg),
+			      void *arg)
+{
+	char hex[hex_str_size(sizeof(*blockid))];
+
+	bitcoin_blkid_to_hex(blockid, hex, sizeof(hex));
+	start_bitcoin_cli(dstate, BITCOIND_PRIO_BULK, process_blockheader, false,
+			  cb, arg, "getblockheader", hex, "false", NULL);
 }
 
 static void process_getblockcount(struct bitcoin_cli *bcli)
@@ -390,13 +966,14 @@ static void process_getblockcount(struct bitcoin_cli *bcli)
 	cb(bcli->dstate, blockcount, bcli->cb_arg);
 }
 
-void bitcoind_getblockcount_(struct lightningd_state *dstate,
+static void bitcoind_getblockcount(struct lightningd_state *dstate,
 			      void (*cb)(struct lightningd_state *dstate,
 					 u32 blockcount,
 					 void *arg),
 			      void *arg)
 {
-	start_bitcoin_cli(dstate, process_getblockcount, false, cb, arg,
+	start_bitcoin_cli(dstate, BITCOIND_PRIO_POLL,
+			  process_getblockcount, false, cb, arg,
 			  "getblockcount", NULL);
 }
 
@@ -417,7 +994,7 @@ static void process_getblockhash(struct bitcoin_cli *bcli)
 	cb(bcli->dstate, &blkid, bcli->cb_arg);
 }
 
-void bitcoind_getblockhash_(struct lightningd_state *dstate,
+static void bitcoind_getblockhash(struct lightningd_state *dstate,
 			    u32 height,
 			    void (*cb)(struct lightningd_state *dstate,
 				       const struct sha256_double *blkid,
@@ -427,12 +1004,118 @@ void bitcoind_getblockhash_(struct lightningd_state *dstate,
 	char str[STR_MAX_CHARS(height)];
 	sprintf(str, "%u", height);
 
-	start_bitcoin_cli(dstate, process_getblockhash, false, cb, arg,
+	start_bitcoin_cli(dstate, BITCOIND_PRIO_BULK,
+			  process_getblockhash, false, cb, arg,
 			  "getblockhash", str, NULL);
 }
 
+static char *base64(const tal_t *ctx, const char *str)
+{
+	static const char enc[] =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	size_t i, len = strlen(str);
+	char *out = tal_arr(ctx, char, (len + 2) / 3 * 4 + 1), *p = out;
+
+	for (i = 0; i < len; i += 3) {
+		u32 v = (u8)str[i] << 16;
+		if (i + 1 < len)
+			v |= (u8)str[i+1] << 8;
+		if (i + 2 < len)
+			v |= (u8)str[i+2];
+		*(p++) = enc[(v >> 18) & 63];
+		*(p++) = enc[(v >> 12) & 63];
+		*(p++) = i + 1 < len ? enc[(v >> 6) & 63] : '=';
+		*(p++) = i + 2 < len ? enc[v & 63] : '=';
+	}
+	*p = '\0';
+	return out;
+}
+
+/* Like bitcoin-cli: command line, then bitcoin.conf, then the cookie. */
+static char *rpc_userpass(const tal_t *ctx, struct lightningd_state *dstate)
+{
+	char *dir, *config, **lines, *user = NULL, *pass = NULL, *cookie;
+	size_t i;
+
+	if (bitcoin_rpcuser && bitcoin_rpcpassword)
+		return tal_fmt(ctx, "%s:%s", bitcoin_rpcuser, bitcoin_rpcpassword);
+
+	if (bitcoin_datadir)
+		dir = tal_strdup(ctx, bitcoin_datadir);
+	else
+		dir = path_join(ctx, getenv("HOME"), ".bitcoin");
+
+	config = grab_file(ctx, path_join(ctx, dir, "bitcoin.conf"));
+	if (config) {
+		lines = tal_strsplit(ctx, config, "\n", STR_NO_EMPTY);
+		for (i = 0; lines[i]; i++) {
+			tal_strreg(ctx, lines[i],
+				   "^[ \t]*rpcuser[ \t]*=[ \t]*([^ \t]*)", &user);
+			tal_strreg(ctx, lines[i],
+				   "^[ \t]*rpcpassword[ \t]*=[ \t]*([^ \t]*)",
+				   &pass);
+		}
+	}
+	if (bitcoin_rpcuser)
+		user = bitcoin_rpcuser;
+	if (bitcoin_rpcpassword)
+		pass = bitcoin_rpcpassword;
+	if (user && pass)
+		return tal_fmt(ctx, "%s:%s", user, pass);
+
+	/* Testnet and regtest keep theirs in a subdirectory. */
+	cookie = grab_file(ctx, path_join(ctx, dir, ".cookie"));
+	if (!cookie && dstate->config.testnet)
+		cookie = grab_file(ctx, path_join(ctx, dir, "testnet3/.cookie"));
+	if (!cookie && dstate->config.testnet)
+		cookie = grab_file(ctx, path_join(ctx, dir, "regtest/.cookie"));
+	if (!cookie)
+		fatal("No rpcuser/rpcpassword for bitcoind, and no cookie in %s",
+		      dir);
+	return tal_strndup(ctx, cookie, strcspn(cookie, "\r\n"));
+}
+
+static void bitcoind_rpc_init(struct lightningd_state *dstate)
+{
+	struct bitcoind_rpc *rpc;
+	struct addrinfo hints;
+	char *host, *port;
+	int err;
+
+	if (!bitcoin_rpcconnect)
+		return;
+
+	rpc = tal(dstate, struct bitcoind_rpc);
+	rpc->dstate = dstate;
+	list_head_init(&rpc->conns);
+	rpc->id = 0;
+
+	host = tal_strdup(rpc, bitcoin_rpcconnect);
+	port = strrchr(host, ':');
+	if (port)
+		*(port++) = '\0';
+	else
+		port = dstate->config.testnet ? "18332" : "8332";
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	err = getaddrinfo(host, port, &hints, &rpc->addr);
+	if (err != 0)
+		fatal("Looking up bitcoind %s: %s",
+		      bitcoin_rpcconnect, gai_strerror(err));
+	rpc->host = tal_fmt(rpc, "%s:%s", host, port);
+	rpc->auth = base64(rpc, rpc_userpass(rpc, dstate));
+
+	/* bitcoind closes idle connections; don't die writing to them. */
+	signal(SIGPIPE, SIG_IGN);
+
+	dstate->bitcoind_rpc = rpc;
+	log_debug(dstate->base_log, "Using bitcoind rpc at %s", rpc->host);
+}
+
 /* Make testnet/regtest status matches us. */
-void check_bitcoind_config(struct lightningd_state *dstate)
+static void check_bitcoind_config(struct lightningd_state *dstate)
 {
 	void *ctx = tal(dstate, char);
 	char *path, *config, **lines;
@@ -472,3 +1155,133 @@ void check_bitcoind_config(struct lightningd_state *dstate)
 out:
 	tal_free(ctx);
 }
+
+static void process_gettxout(struct bitcoin_cli *bcli)
+{
+	void (*cb)(struct lightningd_state *dstate,
+		   bool unspent, void *) = bcli->cb;
+
+	/* bitcoin-cli prints nothing when it's spent (or never existed), we
+	 * print null for RPC. */
+	bool unspent = bcli->output_bytes != 0
+		&& !(bcli->output_bytes >= 4
+		     && strncmp(bcli->output, "null", 4) == 0);
+
+	cb(bcli->dstate, unspent, bcli->cb_arg);
+}
+
+static void bitcoind_txout_unspent(struct lightningd_state *dstate,
+				   const struct sha256_double *txid,
+				   u32 outnum,
+				   void (*cb)(struct lightningd_state *dstate,
+					      bool unspent, void *),
+				   void *arg)
+{
+	char hex[hex_str_size(sizeof(*txid))];
+	char str[STR_MAX_CHARS(outnum)];
+
+	bitcoin_txid_to_hex(txid, hex, sizeof(hex));
+	sprintf(str, "%u", outnum);
+	start_bitcoin_cli(dstate, BITCOIND_PRIO_POLL, process_gettxout, false,
+			  cb, arg, "gettxout", hex, str, NULL);
+}
+
+static void process_getrawmempool(struct bitcoin_cli *bcli)
+{
+	const jsmntok_t *tokens, *t, *end;
+	bool valid;
+	size_t i;
+	struct sha256_double *txids;
+	void (*cb)(struct lightningd_state *dstate,
+		   const struct sha256_double *txids,
+		   void *arg) = bcli->cb;
+
+	tokens = json_parse_input(bcli->output, bcli->output_bytes, &valid);
+	if (!tokens)
+		fatal("%s: %s response",
+		      bcli_args(bcli),
+		      valid ? "partial" : "invalid");
+
+	if (tokens[0].type != JSMN_ARRAY)
+		fatal("%s: gave non-array (%.*s)?",
+		      bcli_args(bcli),
+		      (int)bcli->output_bytes, bcli->output);
+
+	txids = tal_arr(bcli, struct sha256_double, tokens[0].size);
+	end = json_next(tokens);
+	for (i = 0, t = tokens + 1; t < end; t = json_next(t), i++) {
+		if (!bitcoin_txid_from_hex(bcli->output + t->start,
+					   t->end - t->start, &txids[i]))
+			fatal("%s: gave bad txid for %zu'th tx (%.*s)?",
+			      bcli_args(bcli), i,
+			      t->end - t->start, bcli->output + t->start);
+	}
+
+	cb(bcli->dstate, txids, bcli->cb_arg);
+}
+
+static void bitcoind_getrawmempool(struct lightningd_state *dstate,
+				   void (*cb)(struct lightningd_state *dstate,
+					      const struct sha256_double *txids,
+					      void *arg),
+				   void *arg)
+{
+	start_bitcoin_cli(dstate, BITCOIND_PRIO_POLL, process_getrawmempool,
+			  false, cb, arg, "getrawmempool", NULL);
+}
+
+static void process_getrawtx(struct bitcoin_cli *bcli)
+{
+	struct bitcoin_tx *tx;
+	void (*cb)(struct lightningd_state *dstate,
+		   struct bitcoin_tx *tx, void *) = bcli->cb;
+
+	/* Mined or evicted since getrawmempool: it's not an error. */
+	if (*bcli->exitstatus != 0) {
+		cb(bcli->dstate, NULL, bcli->cb_arg);
+		return;
+	}
+
+	tx = bitcoin_tx_from_hex(bcli, bcli->output, bcli->output_bytes);
+	if (!tx)
+		fatal("%s: bad tx '%.*s'?",
+		      bcli_args(bcli),
+		      (int)bcli->output_bytes, (char *)bcli->output);
+
+	cb(bcli->dstate, tx, bcli->cb_arg);
+}
+
+static void bitcoind_getrawtx(struct lightningd_state *dstate,
+			      const struct sha256_double *txid,
+			      void (*cb)(struct lightningd_state *dstate,
+					 struct bitcoin_tx *tx, void *),
+			      void *arg)
+{
+	char hex[hex_str_size(sizeof(*txid))];
+
+	bitcoin_txid_to_hex(txid, hex, sizeof(hex));
+	start_bitcoin_cli(dstate, BITCOIND_PRIO_BULK, process_getrawtx, true,
+			  cb, arg, "getrawtransaction", hex, NULL);
+}
+
+static void bitcoind_init(struct lightningd_state *dstate)
+{
+	check_bitcoind_config(dstate);
+	bitcoind_rpc_init(dstate);
+}
+
+const struct chain_source bitcoind_chain_source = {
+	"bitcoind",
+	bitcoind_init,
+	bitcoind_busy,
+	bitcoind_get_chaintip,
+	bitcoind_getblockcount,
+	bitcoind_getblockhash,
+	bitcoind_getrawblock,
+	bitcoind_getblockheader,
+	bitcoind_sendrawtxs,
+	bitcoind_estimate_fee,
+	bitcoind_txout_unspent,
+	bitcoind_getrawmempool,
+	bitcoind_getrawtx
+};
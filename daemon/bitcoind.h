@@ -11,92 +11,21 @@ struct ripemd160;
 struct bitcoin_tx;
 struct peer;
 struct bitcoin_block;
+/* Which requests go to bitcoind first. */
+enum bitcoind_prio {
+	/* Broadcasts: penalty and timeout transactions can't wait. */
+	BITCOIND_PRIO_URGENT,
+	/* Polling chaintips, fees. */
+	BITCOIND_PRIO_POLL,
+	/* Fetching blocks. */
+	BITCOIND_PRIO_BULK
+};
+#define BITCOIND_NUM_PRIOS (BITCOIND_PRIO_BULK + 1)
+
 /* -datadir arg for bitcoin-cli. */
 extern char *bitcoin_datadir;
+/* If set, we talk to bitcoind's RPC port directly (host[:port]). */
+extern char *bitcoin_rpcconnect, *bitcoin_rpcuser, *bitcoin_rpcpassword;
 
-void bitcoind_estimate_fee_(struct lightningd_state *dstate,
-			    void (*cb)(struct lightningd_state *dstate,
-				       u64, void *),
-			    void *arg);
-
-#define bitcoind_estimate_fee(dstate, cb, arg)				\
-	bitcoind_estimate_fee_((dstate),				\
-			       typesafe_cb_preargs(void, void *, \
-						   (cb), (arg),		\
-						   struct lightningd_state *, \
-						   u64),		\
-			       (arg))
-
-void bitcoind_sendrawtx_(struct lightningd_state *dstate,
-			 const char *hextx,
-			 void (*cb)(struct lightningd_state *dstate,
-				    const char *msg, void *),
-			 void *arg);
-
-#define bitcoind_sendrawtx(dstate, hextx, cb, arg)			\
-	bitcoind_sendrawtx_((dstate), (hextx),				\
-			    typesafe_cb_preargs(void, void *,		\
-						(cb), (arg),		\
-						struct lightningd_state *, \
-						const char *),		\
-			    (arg))
-
-void bitcoind_get_chaintip_(struct lightningd_state *dstate,
-			     void (*cb)(struct lightningd_state *dstate,
-					const struct sha256_double *tipid,
-					void *arg),
-			     void *arg);
-
-#define bitcoind_get_chaintip(dstate, cb, arg)				\
-	bitcoind_get_chaintip_((dstate),				\
-			       typesafe_cb_preargs(void, void *,	\
-						   (cb), (arg),		\
-						   struct lightningd_state *, \
-						   const struct sha256_double *), \
-			       (arg))
-
-void bitcoind_getblockcount_(struct lightningd_state *dstate,
-			     void (*cb)(struct lightningd_state *dstate,
-					u32 blockcount,
-					void *arg),
-			     void *arg);
-
-#define bitcoind_getblockcount(dstate, cb, arg)		\
-	bitcoind_getblockcount_((dstate),				\
-				typesafe_cb_preargs(void, void *,	\
-						    (cb), (arg),	\
-						    struct lightningd_state *, \
-						    u32 blockcount),	\
-				(arg))
-
-void bitcoind_getblockhash_(struct lightningd_state *dstate,
-			    u32 height,
-			    void (*cb)(struct lightningd_state *dstate,
-				       const struct sha256_double *blkid,
-				       void *arg),
-			    void *arg);
-#define bitcoind_getblockhash(dstate, height, cb, arg)			\
-	bitcoind_getblockhash_((dstate),				\
-			       (height),				\
-			       typesafe_cb_preargs(void, void *,	\
-						   (cb), (arg),		\
-						   struct lightningd_state *, \
-						   const struct sha256_double *), \
-			       (arg))
-
-void bitcoind_getrawblock_(struct lightningd_state *dstate,
-			   const struct sha256_double *blockid,
-			   void (*cb)(struct lightningd_state *dstate,
-				      struct bitcoin_block *blk,
-				      void *arg),
-			   void *arg);
-#define bitcoind_getrawblock(dstate, blkid, cb, arg)			\
-	bitcoind_getrawblock_((dstate), (blkid),			\
-			      typesafe_cb_preargs(void, void *,		\
-						  (cb), (arg),		\
-						  struct lightningd_state *, \
-						  struct bitcoin_block *), \
-			      (arg))
-
-void check_bitcoind_config(struct lightningd_state *dstate);
+/* Our chain_source is bitcoind_chain_source, in chainsource.h. */
 #endif /* LIGHTNING_DAEMON_BITCOIND_H */
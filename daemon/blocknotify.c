@@ -0,0 +1,258 @@
+/* A minimal ZMTP 3.0 SUB socket: enough to hear bitcoind's hashblock
+ * messages, so we don't need libzmq.  Polling still runs as a fallback. */
+#include "blocknotify.h"
+#include "chaintopology.h"
+#include "lightningd.h"
+#include "log.h"
+#include "timeout.h"
+#include <ccan/endian/endian.h>
+#include <ccan/io/io.h>
+#include <ccan/str/str.h>
+#include <ccan/tal/str/str.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+char *bitcoin_zmqpubhashblock;
+
+#define ZMTP_GREETING_LEN 64
+
+/* Frame flags. */
+#define ZMTP_MORE	0x01
+#define ZMTP_LONG	0x02
+#define ZMTP_COMMAND	0x04
+
+/* We only want topic names, so anything big is not for us. */
+#define ZMTP_MAX_FRAME 65536
+
+#define HASHBLOCK_TOPIC "hashblock"
+
+struct blocknotify {
+	struct lightningd_state *dstate;
+	struct addrinfo *addr;
+	const char *host;
+
+	u8 greeting[ZMTP_GREETING_LEN];
+	u8 flags;
+	u8 len8[8];
+	u64 len;
+	u8 *body;
+	/* Is the next frame the start of a message (ie. its topic)? */
+	bool first_part;
+};
+
+static void blocknotify_connect(struct blocknotify *bn);
+
+static struct io_plan *read_frame(struct io_conn *conn,
+				  struct blocknotify *bn);
+
+static struct io_plan *got_body(struct io_conn *conn, struct blocknotify *bn)
+{
+	bool topic = bn->first_part;
+
+	/* Commands (READY, really) aren't part of any message. */
+	if (bn->flags & ZMTP_COMMAND)
+		return read_frame(conn, bn);
+
+	bn->first_part = !(bn->flags & ZMTP_MORE);
+	if (topic
+	    && bn->len == strlen(HASHBLOCK_TOPIC)
+	    && memcmp(bn->body, HASHBLOCK_TOPIC, bn->len) == 0) {
+		log_debug(bn->dstate->base_log, "bitcoind announced a block");
+		topology_poll_now(bn->dstate);
+	}
+	return read_frame(conn, bn);
+}
+
+static struct io_plan *read_body(struct io_conn *conn, struct blocknotify *bn)
+{
+	if (bn->len > ZMTP_MAX_FRAME) {
+		log_unusual(bn->dstate->base_log,
+			    "bitcoind zmq %s sent %"PRIu64" byte frame",
+			    bn->host, bn->len);
+		return io_close(conn);
+	}
+	bn->body = tal_free(bn->body);
+	bn->body = tal_arr(bn, u8, bn->len);
+	return io_read(conn, bn->body, bn->len, got_body, bn);
+}
+
+static struct io_plan *got_long_len(struct io_conn *conn,
+				    struct blocknotify *bn)
+{
+	be64 len;
+
+	memcpy(&len, bn->len8, sizeof(len));
+	bn->len = be64_to_cpu(len);
+	return read_body(conn, bn);
+}
+
+static struct io_plan *got_short_len(struct io_conn *conn,
+				     struct blocknotify *bn)
+{
+	bn->len = bn->len8[0];
+	return read_body(conn, bn);
+}
+
+static struct io_plan *got_flags(struct io_conn *conn, struct blocknotify *bn)
+{
+	if (bn->flags & ZMTP_LONG)
+		return io_read(conn, bn->len8, 8, got_long_len, bn);
+	return io_read(conn, bn->len8, 1, got_short_len, bn);
+}
+
+static struct io_plan *read_frame(struct io_conn *conn, struct blocknotify *bn)
+{
+	return io_read(conn, &bn->flags, 1, got_flags, bn);
+}
+
+static void append(u8 **p, const void *mem, size_t len)
+{
+	size_t n = tal_count(*p);
+
+	tal_resize(p, n + len);
+	memcpy(*p + n, mem, len);
+}
+
+static void append_byte(u8 **p, u8 byte)
+{
+	append(p, &byte, 1);
+}
+
+/* READY command saying we're a SUB, then a subscription message. */
+static u8 *handshake(const tal_t *ctx)
+{
+	static const char socktype[] = "Socket-Type", sub[] = "SUB";
+	u8 *p = tal_arr(ctx, u8, 0);
+	be32 len = cpu_to_be32(strlen(sub));
+
+	append_byte(&p, ZMTP_COMMAND);
+	append_byte(&p, 1 + strlen("READY")
+		    + 1 + strlen(socktype) + sizeof(len) + strlen(sub));
+	append_byte(&p, strlen("READY"));
+	append(&p, "READY", strlen("READY"));
+	append_byte(&p, strlen(socktype));
+	append(&p, socktype, strlen(socktype));
+	append(&p, &len, sizeof(len));
+	append(&p, sub, strlen(sub));
+
+	/* Subscribing is a message: 1, then the topic. */
+	append_byte(&p, 0);
+	append_byte(&p, 1 + strlen(HASHBLOCK_TOPIC));
+	append_byte(&p, 1);
+	append(&p, HASHBLOCK_TOPIC, strlen(HASHBLOCK_TOPIC));
+	return p;
+}
+
+static struct io_plan *sent_handshake(struct io_conn *conn,
+				      struct blocknotify *bn)
+{
+	log_debug(bn->dstate->base_log, "Subscribed to bitcoind zmq %s",
+		  bn->host);
+	bn->first_part = true;
+	return read_frame(conn, bn);
+}
+
+static struct io_plan *got_greeting(struct io_conn *conn,
+				    struct blocknotify *bn)
+{
+	u8 *hs;
+
+	/* Signature, then version: we speak 3.0 (3.1 talks to that too). */
+	if (bn->greeting[0] != 0xFF || bn->greeting[9] != 0x7F
+	    || bn->greeting[10] < 3
+	    || memcmp(bn->greeting + 12, "NULL", 5) != 0) {
+		log_unusual(bn->dstate->base_log,
+			    "bitcoind zmq %s: bad greeting", bn->host);
+		return io_close(conn);
+	}
+
+	hs = handshake(bn);
+	return io_write(conn, hs, tal_count(hs), sent_handshake, bn);
+}
+
+static struct io_plan *sent_greeting(struct io_conn *conn,
+				     struct blocknotify *bn)
+{
+	return io_read(conn, bn->greeting, sizeof(bn->greeting),
+		       got_greeting, bn);
+}
+
+static struct io_plan *connected(struct io_conn *conn, struct blocknotify *bn)
+{
+	/* Signature, version 3.0, NULL mechanism, not server. */
+	memset(bn->greeting, 0, sizeof(bn->greeting));
+	bn->greeting[0] = 0xFF;
+	bn->greeting[9] = 0x7F;
+	bn->greeting[10] = 3;
+	memcpy(bn->greeting + 12, "NULL", 4);
+	return io_write(conn, bn->greeting, sizeof(bn->greeting),
+			sent_greeting, bn);
+}
+
+static struct io_plan *init_conn(struct io_conn *conn, struct blocknotify *bn)
+{
+	return io_connect(conn, bn->addr, connected, bn);
+}
+
+static void disconnected(struct io_conn *conn, struct blocknotify *bn)
+{
+	log_unusual(bn->dstate->base_log,
+		    "Lost bitcoind zmq %s: polling until reconnect", bn->host);
+	new_reltimer(bn->dstate, bn, bn->dstate->config.poll_time,
+		     blocknotify_connect, bn);
+}
+
+static void blocknotify_connect(struct blocknotify *bn)
+{
+	const struct addrinfo *addr = bn->addr;
+	struct io_conn *conn;
+	int fd;
+
+	fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+	if (fd < 0)
+		fatal("Creating socket for bitcoind zmq: %s", strerror(errno));
+
+	conn = io_new_conn(bn, fd, init_conn, bn);
+	io_set_finish(conn, disconnected, bn);
+}
+
+void blocknotify_init(struct lightningd_state *dstate)
+{
+	struct blocknotify *bn;
+	struct addrinfo hints;
+	char *host, *port;
+	int err;
+
+	if (!bitcoin_zmqpubhashblock)
+		return;
+
+	if (!strstarts(bitcoin_zmqpubhashblock, "tcp://"))
+		fatal("--bitcoin-zmqpubhashblock %s: only tcp:// supported",
+		      bitcoin_zmqpubhashblock);
+
+	bn = tal(dstate, struct blocknotify);
+	bn->dstate = dstate;
+	bn->body = NULL;
+
+	host = tal_strdup(bn, bitcoin_zmqpubhashblock + strlen("tcp://"));
+	port = strrchr(host, ':');
+	if (!port)
+		fatal("--bitcoin-zmqpubhashblock %s: needs a port",
+		      bitcoin_zmqpubhashblock);
+	*(port++) = '\0';
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	err = getaddrinfo(host, port, &hints, &bn->addr);
+	if (err != 0)
+		fatal("Looking up bitcoind zmq %s: %s",
+		      bitcoin_zmqpubhashblock, gai_strerror(err));
+	bn->host = tal_fmt(bn, "%s:%s", host, port);
+
+	blocknotify_connect(bn);
+}
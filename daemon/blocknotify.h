@@ -0,0 +1,15 @@
+#ifndef LIGHTNING_DAEMON_BLOCKNOTIFY_H
+#define LIGHTNING_DAEMON_BLOCKNOTIFY_H
+/* Hear about new blocks from bitcoind's ZMQ publisher, instead of waiting
+ * for the next poll. */
+#include "config.h"
+
+struct lightningd_state;
+
+/* tcp://host:port, as bitcoind's -zmqpubhashblock. */
+extern char *bitcoin_zmqpubhashblock;
+
+/* Subscribe, if --bitcoin-zmqpubhashblock was given. */
+void blocknotify_init(struct lightningd_state *dstate);
+
+#endif /* LIGHTNING_DAEMON_BLOCKNOTIFY_H */
@@ -0,0 +1,106 @@
+#include "capture.h"
+#include <ccan/build_assert/build_assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+struct capture {
+	int fd;
+	/* Current segment, and how far into it we are. */
+	u64 segment;
+	char *map;
+	size_t used;
+};
+
+static bool map_segment(struct capture *c, u64 segment)
+{
+	void *map;
+
+	if (ftruncate(c->fd, (segment + 1) * CAPTURE_SEGMENT) != 0)
+		return false;
+	map = mmap(NULL, CAPTURE_SEGMENT, PROT_READ|PROT_WRITE, MAP_SHARED,
+		   c->fd, segment * CAPTURE_SEGMENT);
+	if (map == MAP_FAILED)
+		return false;
+
+	if (c->map)
+		munmap(c->map, CAPTURE_SEGMENT);
+	c->map = map;
+	c->segment = segment;
+	c->used = 0;
+	return true;
+}
+
+/* Drop the unused tail, so the file ends where the records do.  If that
+ * fails (or we crash first), the zeroes read as padding anyway. */
+static void destroy_capture(struct capture *c)
+{
+	if (c->map) {
+		munmap(c->map, CAPTURE_SEGMENT);
+		if (ftruncate(c->fd, c->segment * CAPTURE_SEGMENT + c->used))
+			errno = 0;
+	}
+	close(c->fd);
+}
+
+struct capture *capture_open(const tal_t *ctx, const char *filename)
+{
+	struct capture *c = tal(ctx, struct capture);
+	struct capture_file_hdr *fhdr;
+
+	BUILD_ASSERT(sizeof(*fhdr) % 8 == 0);
+	BUILD_ASSERT(sizeof(struct capture_hdr) % 8 == 0);
+	BUILD_ASSERT(sizeof(CAPTURE_MAGIC) <= sizeof(fhdr->magic));
+
+	c->fd = open(filename, O_RDWR|O_CREAT|O_TRUNC, 0600);
+	if (c->fd < 0)
+		return tal_free(c);
+	c->map = NULL;
+	tal_add_destructor(c, destroy_capture);
+
+	if (!map_segment(c, 0)) {
+		int saved_errno = errno;
+		tal_free(c);
+		errno = saved_errno;
+		return NULL;
+	}
+
+	fhdr = (struct capture_file_hdr *)c->map;
+	memcpy(fhdr->magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC));
+	fhdr->segment_size = cpu_to_le32(CAPTURE_SEGMENT);
+	c->used = sizeof(*fhdr);
+	return c;
+}
+
+bool capture_write(struct capture *c, u32 conn, enum capture_type type,
+		   struct timeabs time, const void *data, size_t len)
+{
+	struct capture_hdr *hdr;
+	size_t max = CAPTURE_SEGMENT - sizeof(*hdr);
+	bool truncated = false;
+
+	if (len > max) {
+		len = max;
+		truncated = true;
+	}
+
+	/* Whatever's left is zeroes, which reads as CAPTURE_PAD. */
+	if (c->used + sizeof(*hdr) + capture_padlen(len) > CAPTURE_SEGMENT
+	    && !map_segment(c, c->segment + 1))
+		return false;
+
+	hdr = (struct capture_hdr *)(c->map + c->used);
+	hdr->nsec = cpu_to_le64((u64)time.ts.tv_sec * 1000000000
+				+ time.ts.tv_nsec);
+	hdr->conn = cpu_to_le32(conn);
+	hdr->len = cpu_to_le32(len);
+	hdr->type = cpu_to_le32(type);
+	hdr->truncated = cpu_to_le32(truncated);
+	memcpy(hdr + 1, data, len);
+	c->used += sizeof(*hdr) + capture_padlen(len);
+	return true;
+}
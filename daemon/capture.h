@@ -0,0 +1,59 @@
+#ifndef LIGHTNING_DAEMON_CAPTURE_H
+#define LIGHTNING_DAEMON_CAPTURE_H
+/* Raw I/O records appended to an mmap'd file, for --log-capture. */
+#include "config.h"
+#include <ccan/endian/endian.h>
+#include <ccan/short_types/short_types.h>
+#include <ccan/tal/tal.h>
+#include <ccan/time/time.h>
+#include <stdbool.h>
+
+#define CAPTURE_MAGIC "lncapture1"
+
+/* The file grows by this much at a time; records never cross one. */
+#define CAPTURE_SEGMENT (16 * 1024 * 1024)
+
+enum capture_type {
+	/* Rest of the segment is unused (it's zeroes, so this is 0). */
+	CAPTURE_PAD,
+	/* Bytes we read. */
+	CAPTURE_IN,
+	/* Bytes we wrote. */
+	CAPTURE_OUT,
+	/* Data is the log prefix for this conn. */
+	CAPTURE_NAME
+};
+
+/* Start of the file. */
+struct capture_file_hdr {
+	char magic[16];
+	le32 segment_size;
+	le32 unused;
+};
+
+/* Each record, followed by len bytes, padded to a multiple of 8. */
+struct capture_hdr {
+	/* Nanoseconds since the epoch. */
+	le64 nsec;
+	le32 conn;
+	le32 len;
+	le32 type;
+	/* Non-zero if len is less than we were given. */
+	le32 truncated;
+};
+
+static inline size_t capture_padlen(size_t len)
+{
+	return (len + 7) & ~(size_t)7;
+}
+
+struct capture;
+
+/* Opens (truncating) filename, or returns NULL and sets errno. */
+struct capture *capture_open(const tal_t *ctx, const char *filename);
+
+/* Appends a record: only memcpy, unless we need a new segment.  Returns
+ * false (and sets errno) if that failed: c is no longer usable. */
+bool capture_write(struct capture *c, u32 conn, enum capture_type type,
+		   struct timeabs time, const void *data, size_t len);
+#endif /* LIGHTNING_DAEMON_CAPTURE_H */
@@ -0,0 +1,29 @@
+#include "chainsource.h"
+#include <ccan/array_size/array_size.h>
+#include <ccan/str/str.h>
+#include <ccan/tal/str/str.h>
+#include <stdio.h>
+
+static const struct chain_source *chain_sources[] = {
+	&bitcoind_chain_source
+};
+
+char *opt_set_chain_source(const char *arg,
+			   const struct chain_source **source)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(chain_sources); i++) {
+		if (streq(arg, chain_sources[i]->name)) {
+			*source = chain_sources[i];
+			return NULL;
+		}
+	}
+	return tal_fmt(NULL, "Unknown chain source '%s'", arg);
+}
+
+void opt_show_chain_source(char buf[OPT_SHOW_LEN],
+			   const struct chain_source *const *source)
+{
+	snprintf(buf, OPT_SHOW_LEN, "%s", (*source)->name);
+}
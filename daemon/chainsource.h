@@ -0,0 +1,179 @@
+#ifndef LIGHTNING_DAEMON_CHAINSOURCE_H
+#define LIGHTNING_DAEMON_CHAINSOURCE_H
+/* Where we learn about the blockchain and send transactions: bitcoind (via
+ * bitcoin-cli or its RPC port) is one, selected by --chain-source. */
+#include "config.h"
+#include <ccan/opt/opt.h>
+#include <ccan/short_types/short_types.h>
+#include <ccan/typesafe_cb/typesafe_cb.h>
+#include <stdbool.h>
+
+struct bitcoin_block;
+struct bitcoin_tx;
+struct lightningd_state;
+struct sha256_double;
+
+/* Answers always come via callback, never before the call returns.  A
+ * source which gets garbage back is expected to fatal(). */
+struct chain_source {
+	const char *name;
+
+	/* Once options are parsed. */
+	void (*init)(struct lightningd_state *dstate);
+
+	/* Are polls stuck waiting for it?  Then we'll skip one. */
+	bool (*busy)(const struct lightningd_state *dstate);
+
+	void (*get_chaintip)(struct lightningd_state *dstate,
+			     void (*cb)(struct lightningd_state *dstate,
+					const struct sha256_double *tipid,
+					void *arg),
+			     void *arg);
+
+	void (*getblockcount)(struct lightningd_state *dstate,
+			      void (*cb)(struct lightningd_state *dstate,
+					 u32 blockcount,
+					 void *arg),
+			      void *arg);
+
+	void (*getblockhash)(struct lightningd_state *dstate,
+			     u32 height,
+			     void (*cb)(struct lightningd_state *dstate,
+					const struct sha256_double *blkid,
+					void *arg),
+			     void *arg);
+
+	void (*getrawblock)(struct lightningd_state *dstate,
+			    const struct sha256_double *blockid,
+			    void (*cb)(struct lightningd_state *dstate,
+				       struct bitcoin_block *blk,
+				       void *arg),
+			    void *arg);
+
+	/* Same, but only the header: blk->tx is empty. */
+	void (*getblockheader)(struct lightningd_state *dstate,
+			       const struct sha256_double *blockid,
+			       void (*cb)(struct lightningd_state *dstate,
+					  struct bitcoin_block *blk,
+					  void *arg),
+			       void *arg);
+
+	/* One answer for the lot (a tal array of hex txs).  accepted[i] says
+	 * it has hextxs[i] now (mempool or chain); msgs[i] is whatever it
+	 * said (bitcoind's error, or the txid). */
+	void (*sendrawtxs)(struct lightningd_state *dstate,
+			   const char **hextxs,
+			   void (*cb)(struct lightningd_state *dstate,
+				      const bool *accepted,
+				      const char **msgs, void *),
+			   void *arg);
+
+	/* Satoshi per kb, or 0 if it can't say. */
+	void (*estimate_fee)(struct lightningd_state *dstate,
+			     void (*cb)(struct lightningd_state *dstate,
+					u64, void *),
+			     void *arg);
+
+	/* Is txid:outnum unspent in the best chain (and mempool)? */
+	void (*txout_unspent)(struct lightningd_state *dstate,
+			      const struct sha256_double *txid, u32 outnum,
+			      void (*cb)(struct lightningd_state *dstate,
+					 bool unspent, void *),
+			      void *arg);
+
+	/* The txids in its mempool now (a tal array). */
+	void (*getrawmempool)(struct lightningd_state *dstate,
+			      void (*cb)(struct lightningd_state *dstate,
+					 const struct sha256_double *txids,
+					 void *arg),
+			      void *arg);
+
+	/* A tx from its mempool: NULL if it isn't there any more. */
+	void (*getrawtx)(struct lightningd_state *dstate,
+			 const struct sha256_double *txid,
+			 void (*cb)(struct lightningd_state *dstate,
+				    struct bitcoin_tx *tx, void *),
+			 void *arg);
+};
+
+extern const struct chain_source bitcoind_chain_source;
+
+char *opt_set_chain_source(const char *arg,
+			   const struct chain_source **source);
+void opt_show_chain_source(char buf[OPT_SHOW_LEN],
+			   const struct chain_source *const *source);
+
+#define chain_source_(dstate) ((dstate)->config.chain_source)
+
+#define chain_busy(dstate) chain_source_(dstate)->busy(dstate)
+
+#define chain_get_chaintip(dstate, cb, arg)				\
+	chain_source_(dstate)->get_chaintip((dstate),			\
+		typesafe_cb_preargs(void, void *, (cb), (arg),		\
+				    struct lightningd_state *,		\
+				    const struct sha256_double *),	\
+		(arg))
+
+#define chain_getblockcount(dstate, cb, arg)				\
+	chain_source_(dstate)->getblockcount((dstate),			\
+		typesafe_cb_preargs(void, void *, (cb), (arg),		\
+				    struct lightningd_state *,		\
+				    u32 blockcount),			\
+		(arg))
+
+#define chain_getblockhash(dstate, height, cb, arg)			\
+	chain_source_(dstate)->getblockhash((dstate), (height),		\
+		typesafe_cb_preargs(void, void *, (cb), (arg),		\
+				    struct lightningd_state *,		\
+				    const struct sha256_double *),	\
+		(arg))
+
+#define chain_getrawblock(dstate, blkid, cb, arg)			\
+	chain_source_(dstate)->getrawblock((dstate), (blkid),		\
+		typesafe_cb_preargs(void, void *, (cb), (arg),		\
+				    struct lightningd_state *,		\
+				    struct bitcoin_block *),		\
+		(arg))
+
+#define chain_getblockheader(dstate, blkid, cb, arg)			\
+	chain_source_(dstate)->getblockheader((dstate), (blkid),	\
+		typesafe_cb_preargs(void, void *, (cb), (arg),		\
+				    struct lightningd_state *,		\
+				    struct bitcoin_block *),		\
+		(arg))
+
+#define chain_sendrawtxs(dstate, hextxs, cb, arg)			\
+	chain_source_(dstate)->sendrawtxs((dstate), (hextxs),		\
+		typesafe_cb_preargs(void, void *, (cb), (arg),		\
+				    struct lightningd_state *,		\
+				    const bool *, const char **),	\
+		(arg))
+
+#define chain_estimate_fee(dstate, cb, arg)				\
+	chain_source_(dstate)->estimate_fee((dstate),			\
+		typesafe_cb_preargs(void, void *, (cb), (arg),		\
+				    struct lightningd_state *,		\
+				    u64),				\
+		(arg))
+
+#define chain_txout_unspent(dstate, txid, outnum, cb, arg)		\
+	chain_source_(dstate)->txout_unspent((dstate), (txid), (outnum), \
+		typesafe_cb_preargs(void, void *, (cb), (arg),		\
+				    struct lightningd_state *,		\
+				    bool),				\
+		(arg))
+
+#define chain_getrawmempool(dstate, cb, arg)				\
+	chain_source_(dstate)->getrawmempool((dstate),			\
+		typesafe_cb_preargs(void, void *, (cb), (arg),		\
+				    struct lightningd_state *,		\
+				    const struct sha256_double *),	\
+		(arg))
+
+#define chain_getrawtx(dstate, txid, cb, arg)				\
+	chain_source_(dstate)->getrawtx((dstate), (txid),		\
+		typesafe_cb_preargs(void, void *, (cb), (arg),		\
+				    struct lightningd_state *,		\
+				    struct bitcoin_tx *),		\
+		(arg))
+#endif /* LIGHTNING_DAEMON_CHAINSOURCE_H */
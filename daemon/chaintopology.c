@@ -1,18 +1,31 @@
 #include "bitcoin/block.h"
 #include "bitcoin/tx.h"
-#include "bitcoind.h"
+#include "chainsource.h"
 #include "chaintopology.h"
+#include "controlled_time.h"
+#include "events.h"
 #include "lightningd.h"
 #include "log.h"
+#include "mempool.h"
 #include "peer.h"
 #include "timeout.h"
+#include "trace.h"
 #include "utils.h"
+#include "wallet.h"
 #include "watch.h"
 #include <ccan/array_size/array_size.h>
 #include <ccan/asort/asort.h>
 #include <ccan/io/io.h>
+#include <ccan/noerr/noerr.h>
+#include <ccan/read_write_all/read_write_all.h>
 #include <ccan/structeq/structeq.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
 
 struct block {
 	int height;
@@ -35,8 +48,13 @@ struct block {
 	/* Transactions in this block we care about */
 	struct sha256_double *txids;
 
-	/* Full copy of txs (trimmed to txs list in connect_block) */
-	struct bitcoin_tx **full_txs;
+	/* Linearized txs, until connect_block looks through them. */
+	varint_t num_raw_txs;
+	u8 *raw_txs;
+
+	/* We weren't watching anything (or it came from the cache), so we
+	 * haven't looked at its txs. */
+	bool header_only;
 };
 
 /* Hash blocks by sha */
@@ -59,24 +77,123 @@ static bool block_eq(const struct block *b, const struct sha256_double *key)
 }
 HTABLE_DEFINE_TYPE(struct block, keyof_block_map, hash_sha, block_eq, block_map);
 
+/* Which block an interesting tx is in (a child of that block). */
+struct block_tx {
+	struct sha256_double txid;
+	struct block *block;
+};
+
+static const struct sha256_double *keyof_txid_map(const struct block_tx *bt)
+{
+	return &bt->txid;
+}
+
+static bool block_tx_eq(const struct block_tx *bt,
+			const struct sha256_double *key)
+{
+	return structeq(&bt->txid, key);
+}
+HTABLE_DEFINE_TYPE(struct block_tx, keyof_txid_map, hash_sha, block_tx_eq,
+		   txid_map);
+
+/* Once bitcoind has a tx, we leave it alone this many blocks: it can drop
+ * things from its mempool, but not often. */
+#define REBROADCAST_BLOCKS 6
+
+/* What we keep of a block once it's too deep to reorg out; only those with
+ * txids we care about. */
+struct pruned_block {
+	struct sha256_double blkid;
+	u32 height;
+	u32 mediantime;
+	/* Its txids start here in topology->pruned_txids. */
+	u32 first_tx;
+};
+
 struct topology {
+	/* Oldest block we still have whole. */
 	struct block *root;
 	struct block *tip;
 	struct block_map block_map;
+	/* Every block's txids, so we don't have to search the chain. */
+	struct txid_map txid_map;
 	u64 feerate;
+	/* When we last asked for an estimate, and whether it's answered. */
+	struct timeabs fee_asked;
+	bool fee_estimating;
 	bool startup;
+	/* Between start_poll_chaintip and next_topology_timer. */
+	bool polling;
+	/* Asked to poll again while we were polling. */
+	bool poll_again;
+	struct oneshot *poll_timer;
+	/* TOPOLOGY_CACHE_FILE we append to, or -1. */
+	int cache_fd;
+
+	/* Blocks before root, oldest first (tal array). */
+	struct pruned_block *pruned;
+	/* Their txids, in the same order (tal array). */
+	struct sha256_double *pruned_txids;
+	/* Indices into pruned_txids, sorted by txid (tal array). */
+	u32 *pruned_order;
+
+	/* Blocks recently reorged out, already scanned, in case they come
+	 * back: oldest first (tal array), and by id. */
+	struct block **orphans;
+	struct block_map orphan_map;
+};
+
+/* We save the chain so a restart needn't walk back through bitcoind: a
+ * magic, then records appended as blocks connect.  A block is written again
+ * if it gains txids; the last tip record says where the chain ends. */
+#define TOPOLOGY_CACHE_FILE "topology.cache"
+#define TOPOLOGY_CACHE_MAGIC "LNTOPO01"
+
+enum topo_record_type {
+	TOPO_RECORD_BLOCK = 1,
+	TOPO_RECORD_TIP = 2,
+	TOPO_RECORD_PRUNED = 3
+};
+
+struct topo_record {
+	le32 type;
+	le32 height;
+	le32 mediantime;
+	/* Followed by this many txids (always 0 for TOPO_RECORD_TIP). */
+	le32 num_txids;
+	union {
+		struct bitcoin_block_hdr hdr;
+		/* TOPO_RECORD_PRUNED only has the id. */
+		struct sha256_double blkid;
+	} u;
 };
 
 static void start_poll_chaintip(struct lightningd_state *dstate);
+static bool need_full_blocks(struct lightningd_state *dstate);
 
 static void next_topology_timer(struct lightningd_state *dstate)
 {
-	if (dstate->topology->startup) {
-		dstate->topology->startup = false;
+	struct topology *topo = dstate->topology;
+
+	if (topo->startup) {
+		topo->startup = false;
+		/* We only saved the txs we cared about, so if blocks came from
+		 * the cache, look for spends now they're known to be current. */
+		if (need_full_blocks(dstate))
+			topology_new_watch(dstate);
 		io_break(dstate);
 	}
-	new_reltimer(dstate, dstate, dstate->config.poll_time,
-		     start_poll_chaintip, dstate);
+	topo->polling = false;
+	if (dstate->config.watch_mempool)
+		mempool_poll(dstate);
+	if (topo->poll_again) {
+		topo->poll_again = false;
+		start_poll_chaintip(dstate);
+		return;
+	}
+	topo->poll_timer = new_reltimer(dstate, dstate,
+					dstate->config.poll_time,
+					start_poll_chaintip, dstate);
 }
 
 static int cmp_times(const u32 *a, const u32 *b, void *unused)
@@ -104,29 +221,459 @@ static u32 get_mediantime(const struct topology *topo, const struct block *b)
 	return times[ARRAY_SIZE(times) / 2];
 }
 
+static void index_tx(struct topology *topo,
+		     struct block *b, const struct sha256_double *txid)
+{
+	struct block_tx *bt = tal(b, struct block_tx);
+
+	bt->txid = *txid;
+	bt->block = b;
+	txid_map_add(&topo->txid_map, bt);
+}
+
 /* FIXME: Remove tx from block when peer done. */
-static void add_tx_to_block(struct block *b, const struct sha256_double *txid)
+static void add_tx_to_block(struct topology *topo,
+			    struct block *b, const struct sha256_double *txid)
 {
 	size_t n = tal_count(b->txids);
+	struct block_tx *bt = txid_map_get(&topo->txid_map, txid);
+
+	/* Refetching a block from the cache finds what we'd saved. */
+	if (bt && bt->block == b)
+		return;
 
 	tal_resize(&b->txids, n+1);
 	b->txids[n] = *txid;
+	index_tx(topo, b, txid);
+}
+
+/* Position in pruned_order where txid is, or would go. */
+static size_t pruned_order_pos(const struct topology *topo,
+			       const struct sha256_double *txid)
+{
+	size_t lo = 0, hi = tal_count(topo->pruned_order);
+
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		const struct sha256_double *t;
+
+		t = &topo->pruned_txids[topo->pruned_order[mid]];
+		if (memcmp(t, txid, sizeof(*t)) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static void add_pruned(struct topology *topo,
+		       const struct sha256_double *blkid,
+		       u32 height, u32 mediantime,
+		       size_t num_txids, const struct sha256_double *txids)
+{
+	size_t i, n = tal_count(topo->pruned);
+	size_t first_tx = tal_count(topo->pruned_txids);
+
+	tal_resize(&topo->pruned, n + 1);
+	topo->pruned[n].blkid = *blkid;
+	topo->pruned[n].height = height;
+	topo->pruned[n].mediantime = mediantime;
+	topo->pruned[n].first_tx = first_tx;
+
+	tal_resize(&topo->pruned_txids, first_tx + num_txids);
+	memcpy(topo->pruned_txids + first_tx, txids,
+	       num_txids * sizeof(txids[0]));
+
+	for (i = 0; i < num_txids; i++) {
+		size_t num = tal_count(topo->pruned_order);
+		size_t pos = pruned_order_pos(topo,
+					      &topo->pruned_txids[first_tx + i]);
+
+		tal_resize(&topo->pruned_order, num + 1);
+		memmove(topo->pruned_order + pos + 1, topo->pruned_order + pos,
+			(num - pos) * sizeof(topo->pruned_order[0]));
+		topo->pruned_order[pos] = first_tx + i;
+	}
+}
+
+/* Returns the pruned block txid is in, and sets its *index there. */
+static const struct pruned_block *find_pruned(const struct topology *topo,
+					      const struct sha256_double *txid,
+					      size_t *index)
+{
+	size_t pos = pruned_order_pos(topo, txid), lo, hi;
+	u32 tx;
+
+	if (pos == tal_count(topo->pruned_order))
+		return NULL;
+	tx = topo->pruned_order[pos];
+	if (!structeq(&topo->pruned_txids[tx], txid))
+		return NULL;
+
+	/* Last block starting at or before tx. */
+	lo = 0;
+	hi = tal_count(topo->pruned);
+	while (hi - lo > 1) {
+		size_t mid = (lo + hi) / 2;
+		if (topo->pruned[mid].first_tx <= tx)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	*index = tx - topo->pruned[lo].first_tx;
+	return &topo->pruned[lo];
+}
+
+static void forget_pruned(struct topology *topo)
+{
+	tal_resize(&topo->pruned, 0);
+	tal_resize(&topo->pruned_txids, 0);
+	tal_resize(&topo->pruned_order, 0);
+}
+
+static void cache_block(struct lightningd_state *dstate,
+			const struct block *b, enum topo_record_type type)
+{
+	struct topology *topo = dstate->topology;
+	struct topo_record rec;
+	size_t n = 0;
+
+	if (topo->cache_fd < 0)
+		return;
+
+	if (type == TOPO_RECORD_BLOCK)
+		n = tal_count(b->txids);
+
+	rec.type = cpu_to_le32(type);
+	rec.height = cpu_to_le32(b->height);
+	rec.mediantime = cpu_to_le32(b->mediantime);
+	rec.num_txids = cpu_to_le32(n);
+	rec.u.hdr = b->hdr;
+
+	if (!write_all(topo->cache_fd, &rec, sizeof(rec))
+	    || !write_all(topo->cache_fd, b->txids, n * sizeof(b->txids[0]))) {
+		log_broken(dstate->base_log, "Writing %s: %s: giving up on it",
+			   TOPOLOGY_CACHE_FILE, strerror(errno));
+		close_noerr(topo->cache_fd);
+		topo->cache_fd = -1;
+	}
+}
+
+static void cache_pruned(struct lightningd_state *dstate, size_t i)
+{
+	struct topology *topo = dstate->topology;
+	const struct pruned_block *pb = &topo->pruned[i];
+	struct topo_record rec;
+	size_t end;
+
+	if (i + 1 < tal_count(topo->pruned))
+		end = topo->pruned[i+1].first_tx;
+	else
+		end = tal_count(topo->pruned_txids);
+
+	memset(&rec, 0, sizeof(rec));
+	rec.type = cpu_to_le32(TOPO_RECORD_PRUNED);
+	rec.height = cpu_to_le32(pb->height);
+	rec.mediantime = cpu_to_le32(pb->mediantime);
+	rec.num_txids = cpu_to_le32(end - pb->first_tx);
+	rec.u.blkid = pb->blkid;
+
+	if (!write_all(topo->cache_fd, &rec, sizeof(rec))
+	    || !write_all(topo->cache_fd, topo->pruned_txids + pb->first_tx,
+			  (end - pb->first_tx) * sizeof(topo->pruned_txids[0]))) {
+		log_broken(dstate->base_log, "Writing %s: %s: giving up on it",
+			   TOPOLOGY_CACHE_FILE, strerror(errno));
+		close_noerr(topo->cache_fd);
+		topo->cache_fd = -1;
+	}
+}
+
+/* Write out the whole chain afresh, then keep appending to it. */
+static void start_topology_cache(struct lightningd_state *dstate)
+{
+	struct topology *topo = dstate->topology;
+	const struct block *b;
+	size_t i;
+	int fd;
+
+	fd = open(TOPOLOGY_CACHE_FILE ".tmp", O_CREAT|O_TRUNC|O_WRONLY, 0600);
+	if (fd < 0) {
+		log_broken(dstate->base_log, "Creating %s.tmp: %s",
+			   TOPOLOGY_CACHE_FILE, strerror(errno));
+		return;
+	}
+	if (!write_all(fd, TOPOLOGY_CACHE_MAGIC,
+		       strlen(TOPOLOGY_CACHE_MAGIC))) {
+		log_broken(dstate->base_log, "Writing %s.tmp: %s",
+			   TOPOLOGY_CACHE_FILE, strerror(errno));
+		close_noerr(fd);
+		unlink_noerr(TOPOLOGY_CACHE_FILE ".tmp");
+		return;
+	}
+
+	topo->cache_fd = fd;
+	for (i = 0; i < tal_count(topo->pruned); i++)
+		cache_pruned(dstate, i);
+	for (b = topo->root; b; b = b->next)
+		cache_block(dstate, b, TOPO_RECORD_BLOCK);
+	cache_block(dstate, topo->tip, TOPO_RECORD_TIP);
+
+	/* cache_block closes it if anything went wrong. */
+	if (topo->cache_fd < 0) {
+		unlink_noerr(TOPOLOGY_CACHE_FILE ".tmp");
+		return;
+	}
+	if (rename(TOPOLOGY_CACHE_FILE ".tmp", TOPOLOGY_CACHE_FILE) != 0) {
+		log_broken(dstate->base_log, "Renaming %s.tmp: %s",
+			   TOPOLOGY_CACHE_FILE, strerror(errno));
+		close_noerr(topo->cache_fd);
+		topo->cache_fd = -1;
+		unlink_noerr(TOPOLOGY_CACHE_FILE ".tmp");
+	}
 }
 
 static bool we_broadcast(struct lightningd_state *dstate,
 			 const struct sha256_double *txid)
 {
-	struct peer *peer;
+	return outgoing_tx_map_get(dstate->outgoing_txs, txid);
+}
 
-	list_for_each(&dstate->peers, peer, list) {
-		struct outgoing_tx *otx;
+/* Is there any reason to fetch whole blocks? */
+static bool need_full_blocks(struct lightningd_state *dstate)
+{
+	struct txwatch_hash_iter wi;
+	struct txowatch_hash_iter oi;
+	struct outgoing_tx_map_iter oti;
+
+	return txwatch_hash_first(&dstate->host->txwatches, &wi)
+		|| txowatch_hash_first(&dstate->host->txowatches, &oi)
+		|| outgoing_tx_map_first(dstate->outgoing_txs, &oti);
+}
 
-		list_for_each(&peer->outgoing_txs, otx, list) {
-			if (structeq(&otx->txid, txid))
-				return true;
+static void get_block_(struct lightningd_state *dstate,
+		       const struct sha256_double *blkid,
+		       void (*cb)(struct lightningd_state *dstate,
+				  struct bitcoin_block *blk,
+				  void *arg),
+		       void *arg)
+{
+	if (need_full_blocks(dstate))
+		chain_getrawblock(dstate, blkid, cb, arg);
+	else
+		chain_getblockheader(dstate, blkid, cb, arg);
+}
+
+#define get_block(dstate, blkid, cb, arg)				\
+	get_block_((dstate), (blkid),					\
+		   typesafe_cb_preargs(void, void *, (cb), (arg),	\
+				       struct lightningd_state *,	\
+				       struct bitcoin_block *),		\
+		   (arg))
+
+/* Blocks with fewer txs aren't worth starting threads for. */
+#define TXID_THREAD_MIN_TXS 512
+#define TXID_MAX_THREADS 4
+
+/* Each thread hashes the views from start to end: they don't allocate or
+ * touch anything else, so that's all the locking we need. */
+struct txid_job {
+	const struct bitcoin_tx_view *views;
+	struct sha256_double *txids;
+	size_t start, end;
+};
+
+static void *txid_thread(void *arg)
+{
+	const struct txid_job *job = arg;
+	size_t i;
+
+	for (i = job->start; i < job->end; i++)
+		bitcoin_tx_view_txid(&job->views[i], &job->txids[i]);
+	return NULL;
+}
+
+static void get_txids(const struct bitcoin_tx_view *views, size_t n,
+		      struct sha256_double *txids)
+{
+	struct txid_job jobs[TXID_MAX_THREADS];
+	pthread_t threads[TXID_MAX_THREADS];
+	bool started[TXID_MAX_THREADS];
+	size_t i, num_threads = TXID_MAX_THREADS;
+
+	if (n < TXID_THREAD_MIN_TXS)
+		num_threads = 1;
+
+	for (i = 0; i < num_threads; i++) {
+		jobs[i].views = views;
+		jobs[i].txids = txids;
+		jobs[i].start = n * i / num_threads;
+		jobs[i].end = n * (i + 1) / num_threads;
+	}
+
+	/* We do the first share ourselves. */
+	for (i = 1; i < num_threads; i++)
+		started[i] = (pthread_create(&threads[i], NULL,
+					     txid_thread, &jobs[i]) == 0);
+	txid_thread(&jobs[0]);
+	for (i = 1; i < num_threads; i++) {
+		if (started[i])
+			pthread_join(threads[i], NULL);
+		else
+			txid_thread(&jobs[i]);
+	}
+}
+
+/* See if any of the block's txs are interesting, then drop them.  We only
+ * build a struct bitcoin_tx for those which spend a txo we watch.  Watches
+ * are all the host's, but each tenant has its own wallet. */
+static void scan_block(struct lightningd_state *dstate, struct block *b)
+{
+	struct topology *topo = dstate->topology;
+	struct lightningd_state *node;
+	const u8 *p = b->raw_txs;
+	size_t i, len = tal_count(b->raw_txs);
+	tal_t *tmpctx = tal(b, char);
+	struct bitcoin_tx_view *views;
+	struct sha256_double *txids;
+
+	views = tal_arr(tmpctx, struct bitcoin_tx_view, b->num_raw_txs);
+	txids = tal_arr(tmpctx, struct sha256_double, b->num_raw_txs);
+
+	/* Decoding the block (bitcoin/block.c) checked they all parse. */
+	for (i = 0; i < b->num_raw_txs; i++) {
+		if (!pull_bitcoin_tx_view(&p, &len, &views[i]))
+			abort();
+	}
+	get_txids(views, b->num_raw_txs, txids);
+
+	for (i = 0; i < b->num_raw_txs; i++) {
+		struct bitcoin_tx *tx = NULL;
+		const u8 *in = views[i].inputs;
+		size_t j, inlen = views[i].inputs_len;
+		/* Its spends were handled when it hit the mempool? */
+		bool fired = mempool_tx_mined(dstate, &txids[i]);
+
+		/* Tell them if it spends a txo we care about. */
+		for (j = 0; j < views[i].input_count; j++) {
+			struct txwatch_output out;
+			struct txowatch *txo;
+			u32 index;
+
+			pull_bitcoin_tx_view_input(&in, &inlen,
+						   &out.txid, &index);
+			out.index = index;
+
+			txo = find_txowatch(dstate, &out);
+			if (txo && !fired) {
+				if (!tx)
+					tx = bitcoin_tx_from_view(tmpctx,
+								  &views[i]);
+				txowatch_fire_all(dstate, &out, tx, j);
+			}
+			for (node = dstate; node;
+			     node = next_node(dstate, node))
+				wallet_output_spent(node, &out);
 		}
+
+		/* And if it pays our wallet. */
+		in = views[i].outputs;
+		inlen = views[i].outputs_len;
+		for (j = 0; j < views[i].output_count; j++) {
+			const u8 *script;
+			size_t script_len;
+			u64 amount;
+
+			pull_bitcoin_tx_view_output(&in, &inlen, &amount,
+						    &script, &script_len);
+			for (node = dstate; node;
+			     node = next_node(dstate, node))
+				wallet_output_seen(node, &txids[i], j, amount,
+						   script, script_len);
+		}
+
+		/* We did spends first, in case that tells us to watch tx. */
+		if (watching_txid(dstate, &txids[i])
+		    || we_broadcast(dstate, &txids[i]))
+			add_tx_to_block(topo, b, &txids[i]);
 	}
-	return false;
+	tal_free(tmpctx);
+	b->raw_txs = tal_free(b->raw_txs);
+	b->num_raw_txs = 0;
+}
+
+static void unindex_txids(struct topology *topo, struct block *b)
+{
+	size_t j;
+
+	for (j = 0; j < tal_count(b->txids); j++) {
+		struct txid_map_iter it;
+		struct block_tx *bt;
+
+		for (bt = txid_map_getfirst(&topo->txid_map, &b->txids[j], &it);
+		     bt;
+		     bt = txid_map_getnext(&topo->txid_map, &b->txids[j], &it)) {
+			if (bt->block == b) {
+				txid_map_del(&topo->txid_map, bt);
+				tal_free(bt);
+				break;
+			}
+		}
+	}
+}
+
+/* Reorgs on testnet often flip back and forth: this many orphans saves
+ * fetching and scanning those again. */
+#define ORPHANS_MAX 16
+
+static void forget_orphans(struct topology *topo)
+{
+	size_t i;
+
+	for (i = 0; i < tal_count(topo->orphans); i++) {
+		block_map_del(&topo->orphan_map, topo->orphans[i]);
+		tal_free(topo->orphans[i]);
+	}
+	tal_resize(&topo->orphans, 0);
+}
+
+static void add_orphan(struct topology *topo, struct block *b)
+{
+	size_t n = tal_count(topo->orphans);
+
+	/* Back to how new_block left it, as far as connect_block cares. */
+	b->height = -1;
+	b->mediantime = 0;
+	b->prev = b->next = NULL;
+
+	if (n == ORPHANS_MAX) {
+		block_map_del(&topo->orphan_map, topo->orphans[0]);
+		tal_free(topo->orphans[0]);
+		memmove(topo->orphans, topo->orphans + 1,
+			sizeof(topo->orphans[0]) * --n);
+	}
+	tal_resize(&topo->orphans, n + 1);
+	topo->orphans[n] = b;
+	block_map_add(&topo->orphan_map, b);
+}
+
+static struct block *take_orphan(struct topology *topo,
+				 const struct sha256_double *blkid)
+{
+	struct block *b = block_map_get(&topo->orphan_map, blkid);
+	size_t i, n = tal_count(topo->orphans);
+
+	if (!b)
+		return NULL;
+
+	block_map_del(&topo->orphan_map, b);
+	for (i = 0; i < n; i++)
+		if (topo->orphans[i] == b)
+			break;
+	assert(i < n);
+	memmove(topo->orphans + i, topo->orphans + i + 1,
+		sizeof(topo->orphans[0]) * (n - i - 1));
+	tal_resize(&topo->orphans, n - 1);
+	return b;
 }
 
 /* Fills in prev, height, mediantime. */
@@ -146,176 +693,363 @@ static void connect_block(struct lightningd_state *dstate,
 	b->height = b->prev->height + 1;
 	b->mediantime = get_mediantime(topo, b);
 
+	/* An orphan coming back has its txids already (and a new copy of
+	 * one makes that stale). */
+	for (i = 0; i < tal_count(b->txids); i++)
+		index_tx(topo, b, &b->txids[i]);
+	tal_free(take_orphan(topo, &b->blkid));
+
 	block_map_add(&topo->block_map, b);
-	
-	/* Now we see if any of those txs are interesting. */
-	for (i = 0; i < tal_count(b->full_txs); i++) {
-		struct bitcoin_tx *tx = b->full_txs[i];
-		struct sha256_double txid;
-		size_t j;
+	trace2(block_connect, b->height, &b->blkid);
+	scan_block(dstate, b);
+}
 
-		/* Tell them if it spends a txo we care about. */
-		for (j = 0; j < tx->input_count; j++) {
-			struct txwatch_output out;
-			struct txowatch *txo;
-			out.txid = tx->input[j].txid;
-			out.index = tx->input[j].index;
+/* Most header-only blocks we fetch again once we're watching: a day. */
+#define REFETCH_MAX_BLOCKS 144
 
-			txo = txowatch_hash_get(&dstate->txowatches, &out);
-			if (txo)
-				txowatch_fire(dstate, txo, tx, j);
+static void refetched_block(struct lightningd_state *dstate,
+			    struct bitcoin_block *blk,
+			    struct sha256_double *blkid)
+{
+	struct topology *topo = dstate->topology;
+	struct block *b = block_map_get(&topo->block_map, blkid);
+	size_t n;
+
+	/* Reorged out meanwhile?  Then it can't matter. */
+	if (b) {
+		n = tal_count(b->txids);
+		b->num_raw_txs = blk->num_txs;
+		b->raw_txs = tal_steal(b, blk->txs);
+		scan_block(dstate, b);
+		if (tal_count(b->txids) != n) {
+			struct sha256_double *txids;
+
+			cache_block(dstate, b, TOPO_RECORD_BLOCK);
+			txids = tal_dup_arr(blkid, struct sha256_double,
+					    b->txids + n,
+					    tal_count(b->txids) - n, 0);
+			watch_topology_changed(dstate, topo->tip->height,
+					       txids);
 		}
-
-		/* We did spends first, in case that tells us to watch tx. */
-		bitcoin_txid(tx, &txid);
-		if (watching_txid(dstate, &txid) || we_broadcast(dstate, &txid))
-			add_tx_to_block(b, &txid);
-	}
-	b->full_txs = tal_free(b->full_txs);
+	} else
+		/* It won't have these txs if it comes back. */
+		tal_free(take_orphan(topo, blkid));
+	tal_free(blkid);
 }
 
-static bool tx_in_block(const struct block *b,
-			const struct sha256_double *txid)
+void topology_new_watch(struct lightningd_state *dstate)
 {
-	size_t i, n = tal_count(b->txids);
+	struct topology *topo = dstate->topology;
+	struct block *b;
+	size_t i;
 
-	for (i = 0; i < n; i++) {
-		if (structeq(&b->txids[i], txid))
-			return true;
+	/* A tenant's watch goes in with the host's. */
+	dstate = dstate->host;
+
+	/* Watches from the db come before the chain: that's fetched whole. */
+	if (!topo || !topo->tip)
+		return;
+
+	/* Orphans weren't scanned for this watch. */
+	forget_orphans(topo);
+
+	for (b = topo->tip, i = 0;
+	     b && i < REFETCH_MAX_BLOCKS;
+	     b = b->prev, i++) {
+		if (!b->header_only)
+			continue;
+		/* Only ask once: it's in hand as far as anyone else cares. */
+		b->header_only = false;
+		chain_getrawblock(dstate, &b->blkid, refetched_block,
+				     tal_dup(dstate, struct sha256_double,
+					     &b->blkid));
 	}
-	return false;
 }
 
-/* FIXME: Use hash table. */
-static struct block *block_for_tx(struct lightningd_state *dstate,
-				  const struct sha256_double *txid)
+/* Where a tx we care about is: in a block we have, or a pruned one. */
+struct tx_place {
+	u32 height;
+	u32 mediantime;
+	/* Its position amongst that block's txids. */
+	size_t index;
+};
+
+static bool find_tx(struct lightningd_state *dstate,
+		    const struct sha256_double *txid,
+		    struct tx_place *place)
 {
 	struct topology *topo = dstate->topology;
-	struct block *b;
-
-	for (b = topo->tip; b; b = b->prev) {
-		if (tx_in_block(b, txid))
-			return b;
+	const struct block_tx *bt = txid_map_get(&topo->txid_map, txid);
+	const struct pruned_block *pb;
+
+	if (bt) {
+		place->height = bt->block->height;
+		place->mediantime = bt->block->mediantime;
+		for (place->index = 0;
+		     !structeq(&bt->block->txids[place->index], txid);
+		     place->index++);
+		return true;
 	}
-	return NULL;
+
+	pb = find_pruned(topo, txid, &place->index);
+	if (!pb)
+		return false;
+	place->height = pb->height;
+	place->mediantime = pb->mediantime;
+	return true;
 }
 
 size_t get_tx_depth(struct lightningd_state *dstate,
 		    const struct sha256_double *txid)
 {
 	struct topology *topo = dstate->topology;
-	const struct block *b;
+	struct tx_place place;
 
-	b = block_for_tx(dstate, txid);
-	if (!b)
+	/* Watches can be made (from the db) before we have a chain. */
+	if (!topo || !topo->tip)
 		return 0;
-	return topo->tip->height - b->height + 1;
+
+	if (!find_tx(dstate, txid, &place))
+		return 0;
+	return topo->tip->height - place.height + 1;
 }
 
-static void try_broadcast(struct lightningd_state *dstate,
-			  const char *msg, char **txs)
+/* Copies of what we sent: peers may go away, and they own txs. */
+struct broadcast {
+	const char **hextxs;
+	struct sha256_double *txids;
+};
+
+static struct broadcast *new_broadcast(struct lightningd_state *dstate)
 {
-	size_t num_txs = tal_count(txs);
-	const char *this_tx;
+	struct broadcast *b = tal(dstate, struct broadcast);
+	b->hextxs = tal_arr(b, const char *, 0);
+	b->txids = tal_arr(b, struct sha256_double, 0);
+	return b;
+}
 
-	/* These are expected. */
-	if (strstr(msg, "txn-mempool-conflict")
-	    || strstr(msg, "transaction already in block chain"))
-		log_debug(dstate->base_log,
-			  "Expected error broadcasting tx %s: %s",
-			  txs[num_txs-1], msg);
-	else
-		log_unusual(dstate->base_log, "Broadcasting tx %s: %s",
-			    txs[num_txs-1], msg);
+static void add_broadcast(struct broadcast *b, const struct outgoing_tx *otx)
+{
+	size_t i, n = tal_count(b->txids);
+	u8 *rawtx;
 
-	if (num_txs == 1) {
-		tal_free(txs);
-		return;
-	}
+	/* Sweeps are shared between peers: once is enough. */
+	for (i = 0; i < n; i++)
+		if (structeq(&b->txids[i], &otx->txid))
+			return;
 
-	/* Strip off last one. */
-	this_tx = txs[num_txs-1];
-	tal_resize(&txs, num_txs-1);
+	rawtx = linearize_tx(b, otx->tx);
 
-	bitcoind_sendrawtx(dstate, this_tx, try_broadcast, txs);
+	tal_resize(&b->hextxs, n + 1);
+	tal_resize(&b->txids, n + 1);
+	b->hextxs[n] = tal_hexstr(b->hextxs, rawtx, tal_count(rawtx));
+	b->txids[n] = otx->txid;
+	tal_free(rawtx);
 }
 
-/* FIXME: This is dumb.  We can group txs and avoid bothering bitcoind
- * if any one tx is in the main chain. */
-static void rebroadcast_txs(struct lightningd_state *dstate)
+static void broadcast_done(struct lightningd_state *dstate,
+			   const bool *accepted, const char **msgs,
+			   struct broadcast *b)
 {
-	/* Copy txs now (peers may go away, and they own txs). */
-	size_t num_txs = 0;
-	char **txs = tal_arr(dstate, char *, 0);
-	struct peer *peer;
+	struct outgoing_tx_map *map = dstate->outgoing_txs;
+	size_t i;
 
-	list_for_each(&dstate->peers, peer, list) {
+	for (i = 0; i < tal_count(b->txids); i++) {
+		struct outgoing_tx_map_iter it;
 		struct outgoing_tx *otx;
 
-		list_for_each(&peer->outgoing_txs, otx, list) {
-			u8 *rawtx;
+		if (accepted[i])
+			log_debug(dstate->base_log, "Broadcast tx %s: %s",
+				  b->hextxs[i], msgs[i]);
+		/* This is expected. */
+		else if (strstr(msgs[i], "txn-mempool-conflict"))
+			log_debug(dstate->base_log,
+				  "Expected error broadcasting tx %s: %s",
+				  b->hextxs[i], msgs[i]);
+		else
+			log_unusual(dstate->base_log, "Broadcasting tx %s: %s",
+				    b->hextxs[i], msgs[i]);
+
+		/* Startup broadcasts can beat the first tip. */
+		if (!accepted[i] || !dstate->topology->tip)
+			continue;
+		for (otx = outgoing_tx_map_getfirst(map, &b->txids[i], &it);
+		     otx;
+		     otx = outgoing_tx_map_getnext(map, &b->txids[i], &it))
+			otx->accepted_height = dstate->topology->tip->height;
+	}
+	tal_free(b);
+}
 
-			if (block_for_tx(dstate, &otx->txid))
-				continue;
+static void send_broadcast(struct lightningd_state *dstate,
+			   struct broadcast *b)
+{
+	if (tal_count(b->txids))
+		chain_sendrawtxs(dstate, b->hextxs, broadcast_done, b);
+	else
+		tal_free(b);
+}
 
-			tal_resize(&txs, num_txs+1);
-			rawtx = linearize_tx(txs, otx->tx);
-			txs[num_txs] = tal_hexstr(txs, rawtx, tal_count(rawtx));
-			num_txs++;
-		}
+/* Only what's neither in a block nor (recently) in bitcoind's mempool. */
+static void rebroadcast_txs(struct lightningd_state *dstate)
+{
+	struct topology *topo = dstate->topology;
+	struct broadcast *b = new_broadcast(dstate);
+	struct outgoing_tx_map_iter it;
+	struct outgoing_tx *otx;
+
+	for (otx = outgoing_tx_map_first(dstate->outgoing_txs, &it);
+	     otx;
+	     otx = outgoing_tx_map_next(dstate->outgoing_txs, &it)) {
+		struct tx_place place;
+
+		if (find_tx(dstate, &otx->txid, &place))
+			continue;
+		if (otx->accepted_height
+		    && topo->tip->height < otx->accepted_height
+		    + REBROADCAST_BLOCKS)
+			continue;
+		add_broadcast(b, otx);
 	}
 
-	if (num_txs)
-		bitcoind_sendrawtx(dstate, txs[num_txs-1], try_broadcast, txs);
-	else
-		tal_free(txs);
+	send_broadcast(dstate, b);
 }
 
 static void destroy_outgoing_tx(struct outgoing_tx *otx)
 {
+	outgoing_tx_map_del(otx->dstate->outgoing_txs, otx);
 	list_del(&otx->list);
 }
 
 void broadcast_tx(struct peer *peer, const struct bitcoin_tx *tx)
 {
 	struct outgoing_tx *otx = tal(peer, struct outgoing_tx);
-	char **txs = tal_arr(peer->dstate, char *, 1);
-	u8 *rawtx;
+	struct broadcast *b;
+	bool sent;
 
+	otx->dstate = peer->dstate;
 	otx->tx = tal_steal(otx, tx);
 	bitcoin_txid(otx->tx, &otx->txid);
+	otx->accepted_height = 0;
+	/* Another peer's copy of a shared sweep? */
+	sent = we_broadcast(peer->dstate, &otx->txid);
 	list_add_tail(&peer->outgoing_txs, &otx->list);
+	outgoing_tx_map_add(peer->dstate->outgoing_txs, otx);
 	tal_add_destructor(otx, destroy_outgoing_tx);
 
 	log_add_struct(peer->log, " (tx %s)", struct sha256_double, &otx->txid);
 
-	rawtx = linearize_tx(txs, otx->tx);
-	txs[0] = tal_hexstr(txs, rawtx, tal_count(rawtx));
-	bitcoind_sendrawtx(peer->dstate, txs[0], try_broadcast, txs);
+	if (sent)
+		return;
+	b = new_broadcast(peer->dstate);
+	add_broadcast(b, otx);
+	send_broadcast(peer->dstate, b);
+}
+
+static void append_txids(struct sha256_double **txids, const struct block *b)
+{
+	size_t n = tal_count(*txids);
+
+	tal_resize(txids, n + tal_count(b->txids));
+	memcpy(*txids + n, b->txids, sizeof(b->txids[0]) * tal_count(b->txids));
 }
 
-static void free_blocks(struct lightningd_state *dstate, struct block *b)
+/* Appends their txids, so watches can be told they're gone. */
+static void free_blocks(struct lightningd_state *dstate, struct block *b,
+			struct sha256_double **txids)
 {
+	struct topology *topo = dstate->topology;
 	struct block *next;
 
 	while (b) {
-		size_t i, n = tal_count(b->txids);
-
-		/* Notify that txs are kicked out. */
-		for (i = 0; i < n; i++)
-			txwatch_fire(dstate, &b->txids[i], 0);
+		trace2(block_disconnect, b->height, &b->blkid);
+		unindex_txids(topo, b);
+		block_map_del(&topo->block_map, b);
+		append_txids(txids, b);
 
 		next = b->next;
-		tal_free(b);
+		add_orphan(topo, b);
 		b = next;
 	}
 }
 
+/* Mediantime needs this many, whatever forever_confirms says. */
+#define PRUNE_MIN_BLOCKS 11
+
+/* How many blocks we keep whole. */
+static u32 unpruned_blocks(const struct lightningd_state *dstate)
+{
+	if (dstate->config.forever_confirms < PRUNE_MIN_BLOCKS)
+		return PRUNE_MIN_BLOCKS;
+	return dstate->config.forever_confirms;
+}
+
+/* Blocks this deep can't be reorged out: keep only what we need of them. */
+static void prune_blocks(struct lightningd_state *dstate)
+{
+	struct topology *topo = dstate->topology;
+
+	while (topo->root != topo->tip
+	       && topo->tip->height - topo->root->height + 1
+	       > unpruned_blocks(dstate)) {
+		struct block *b = topo->root;
+
+		if (tal_count(b->txids))
+			add_pruned(topo, &b->blkid, b->height, b->mediantime,
+				   tal_count(b->txids), b->txids);
+		unindex_txids(topo, b);
+		block_map_del(&topo->block_map, b);
+
+		topo->root = b->next;
+		topo->root->prev = NULL;
+		tal_free(b);
+	}
+}
+
+/* Small moves aren't worth a new commitment on every channel. */
+static bool fee_moved(const struct lightningd_state *dstate, u64 old, u64 rate)
+{
+	u64 diff = rate > old ? rate - old : old - rate;
+
+	if (old == 0)
+		return true;
+	return diff * 100 >= old * dstate->config.fee_change_percent;
+}
+
 static void update_fee(struct lightningd_state *dstate, u64 rate, u64 *feerate)
 {
+	struct lightningd_state *node;
+
+	dstate->topology->fee_estimating = false;
+
+	/* Keep what we had, rather than falling back to the default. */
+	if (rate == 0 || !fee_moved(dstate, *feerate, rate)) {
+		log_debug(dstate->base_log, "Feerate %"PRIu64" -> %"PRIu64
+			  ": ignoring", *feerate, rate);
+		return;
+	}
+
 	log_debug(dstate->base_log, "Feerate %"PRIu64" -> %"PRIu64,
-		  rate, *feerate);
+		  *feerate, rate);
 	*feerate = rate;
+	for (node = dstate; node; node = next_node(dstate, node))
+		peers_new_feerate(node);
+}
+
+static void maybe_estimate_fee(struct lightningd_state *dstate)
+{
+	struct topology *topo = dstate->topology;
+
+	if (topo->fee_estimating)
+		return;
+	if (topo->feerate
+	    && time_less(time_between(controlled_time(), topo->fee_asked),
+			 dstate->config.fee_refresh_time))
+		return;
+
+	topo->fee_asked = controlled_time();
+	topo->fee_estimating = true;
+	chain_estimate_fee(dstate, update_fee, &topo->feerate);
 }
 
 /* B is the new chain (linked by ->next); update topology */
@@ -323,25 +1057,36 @@ static void topology_changed(struct lightningd_state *dstate,
 			     struct block *prev,
 			     struct block *b)
 {
+	u32 old_height = dstate->topology->tip->height;
+	struct sha256_double *txids = tal_arr(dstate, struct sha256_double, 0);
+	struct lightningd_state *node;
+
 	/* Eliminate any old chain. */
 	if (prev->next)
-		free_blocks(dstate, prev->next);
+		free_blocks(dstate, prev->next, &txids);
 
 	prev->next = b;
 	do {
 		connect_block(dstate, prev, b);
+		cache_block(dstate, b, TOPO_RECORD_BLOCK);
+		append_txids(&txids, b);
 		dstate->topology->tip = prev = b;
+		for (node = dstate; node; node = next_node(dstate, node))
+			notify_block(node, b->height, &b->blkid);
 		b = b->next;
 	} while (b);
+	cache_block(dstate, dstate->topology->tip, TOPO_RECORD_TIP);
+	prune_blocks(dstate);
 
-	/* Tell watch code to re-evaluate all txs. */
-	watch_topology_changed(dstate);
+	/* Tell watch code which txs moved: it handles depth itself. */
+	watch_topology_changed(dstate, old_height, txids);
+	tal_free(txids);
 
 	/* Maybe need to rebroadcast. */
 	rebroadcast_txs(dstate);
 
-	/* Once per new block head, update fee estimate. */
-	bitcoind_estimate_fee(dstate, update_fee, &dstate->topology->feerate);
+	/* New block head: maybe update fee estimate. */
+	maybe_estimate_fee(dstate);
 }
 
 static struct block *new_block(struct lightningd_state *dstate,
@@ -365,7 +1110,10 @@ static struct block *new_block(struct lightningd_state *dstate,
 	b->hdr = blk->hdr;
 
 	b->txids = tal_arr(b, struct sha256_double, 0);
-	b->full_txs = tal_steal(b, blk->tx);
+	b->num_raw_txs = blk->num_txs;
+	b->raw_txs = tal_steal(b, blk->txs);
+	/* Every real block has a coinbase. */
+	b->header_only = (blk->num_txs == 0);
 
 	return b;
 }
@@ -379,12 +1127,18 @@ static void gather_blocks(struct lightningd_state *dstate,
 
 	b = new_block(dstate, blk, next);
 
-	/* Recurse if we need prev. */
-	prev = block_map_get(&topo->block_map, &blk->hdr.prev_hash);
-	if (!prev) {
-		bitcoind_getrawblock(dstate, &blk->hdr.prev_hash,
-				     gather_blocks, b);
-		return;
+	/* Recurse if we need prev (unless we had it before). */
+	while (!(prev = block_map_get(&topo->block_map, &b->hdr.prev_hash))) {
+		struct block *orphan = take_orphan(topo, &b->hdr.prev_hash);
+
+		if (!orphan) {
+			get_block(dstate, &b->hdr.prev_hash, gather_blocks, b);
+			return;
+		}
+		log_debug_struct(dstate->base_log, "Reusing orphan block %s",
+				 struct sha256_double, &orphan->blkid);
+		orphan->next = b;
+		b = orphan;
 	}
 
 	/* All done. */
@@ -392,6 +1146,122 @@ static void gather_blocks(struct lightningd_state *dstate,
 	next_topology_timer(dstate);
 }
 
+/* Most blocks we hold in memory while catching up. */
+#define CATCHUP_MAX_BLOCKS 144
+
+/* Fetching many blocks forward from our tip, all at once. */
+struct catchup {
+	struct lightningd_state *dstate;
+	/* Where gather_blocks should start if this doesn't work out. */
+	struct sha256_double tipid;
+	/* Height of blocks[0]. */
+	u32 start;
+	/* NULL until fetched. */
+	struct block **blocks;
+	size_t remaining;
+	/* More after these? */
+	bool more;
+};
+
+/* Argument for each block's fetches. */
+struct catchup_block {
+	struct catchup *c;
+	size_t i;
+};
+
+static void poll_chaintip_now(struct lightningd_state *dstate);
+
+static void catchup_done(struct catchup *c)
+{
+	struct lightningd_state *dstate = c->dstate;
+	struct topology *topo = dstate->topology;
+	size_t i, n = tal_count(c->blocks);
+
+	/* bitcoind could have reorganized under us: walk back instead. */
+	for (i = 0; i < n; i++) {
+		const struct sha256_double *prev;
+
+		prev = i ? &c->blocks[i-1]->blkid : &topo->tip->blkid;
+		if (!structeq(&c->blocks[i]->hdr.prev_hash, prev)) {
+			log_unusual(dstate->base_log,
+				    "Catchup block %u does not connect:"
+				    " fetching backwards", c->start + (u32)i);
+			get_block(dstate, &c->tipid, gather_blocks,
+				  (struct block *)NULL);
+			tal_free(c);
+			return;
+		}
+		c->blocks[i]->next = i + 1 < n ? c->blocks[i+1] : NULL;
+	}
+
+	for (i = 0; i < n; i++)
+		tal_steal(topo, c->blocks[i]);
+	topology_changed(dstate, topo->tip, c->blocks[0]);
+
+	if (c->more)
+		poll_chaintip_now(dstate);
+	else
+		next_topology_timer(dstate);
+	tal_free(c);
+}
+
+static void catchup_got_block(struct lightningd_state *dstate,
+			      struct bitcoin_block *blk,
+			      struct catchup_block *cb)
+{
+	struct catchup *c = cb->c;
+
+	c->blocks[cb->i] = new_block(dstate, blk, NULL);
+	tal_steal(c, c->blocks[cb->i]);
+	if (--c->remaining == 0)
+		catchup_done(c);
+}
+
+static void catchup_got_hash(struct lightningd_state *dstate,
+			     const struct sha256_double *blkid,
+			     struct catchup_block *cb)
+{
+	get_block(dstate, blkid, catchup_got_block, cb);
+}
+
+/* If we're more than one block behind, ask for them all at once: they
+ * overlap, so this costs bandwidth, not round trips. */
+static void start_catchup(struct lightningd_state *dstate, u32 blockcount,
+			  struct sha256_double *tipid)
+{
+	struct topology *topo = dstate->topology;
+	struct catchup *c;
+	size_t i, n;
+
+	if (blockcount <= topo->tip->height + 1) {
+		get_block(dstate, tipid, gather_blocks, (struct block *)NULL);
+		tal_free(tipid);
+		return;
+	}
+
+	c = tal(dstate, struct catchup);
+	c->dstate = dstate;
+	c->tipid = *tipid;
+	tal_free(tipid);
+	c->start = topo->tip->height + 1;
+	n = blockcount - topo->tip->height;
+	c->more = (n > CATCHUP_MAX_BLOCKS);
+	if (c->more)
+		n = CATCHUP_MAX_BLOCKS;
+	c->blocks = tal_arrz(c, struct block *, n);
+	c->remaining = n;
+
+	log_debug(dstate->base_log, "Catching up blocks %u-%u",
+		  c->start, c->start + (u32)n - 1);
+	for (i = 0; i < n; i++) {
+		struct catchup_block *cb = tal(c, struct catchup_block);
+		cb->c = c;
+		cb->i = i;
+		chain_getblockhash(dstate, c->start + i,
+				      catchup_got_hash, cb);
+	}
+}
+
 static void check_chaintip(struct lightningd_state *dstate,
 			   const struct sha256_double *tipid,
 			   void *arg)
@@ -400,21 +1270,45 @@ static void check_chaintip(struct lightningd_state *dstate,
 
 	/* 0 is the main tip. */
 	if (!structeq(tipid, &topo->tip->blkid))
-		bitcoind_getrawblock(dstate, tipid, gather_blocks,
-				     (struct block *)NULL);
+		chain_getblockcount(dstate, start_catchup,
+				       tal_dup(dstate, struct sha256_double,
+					       tipid));
 	else
 		/* Next! */
 		next_topology_timer(dstate);
 }
 
+static void poll_chaintip_now(struct lightningd_state *dstate)
+{
+	chain_get_chaintip(dstate, check_chaintip, NULL);
+}
+
 static void start_poll_chaintip(struct lightningd_state *dstate)
 {
-	if (!list_empty(&dstate->bitcoin_req)) {
+	struct topology *topo = dstate->topology;
+
+	/* We may be called from this timer: that's OK. */
+	topo->poll_timer = tal_free(topo->poll_timer);
+	topo->polling = true;
+
+	if (chain_busy(dstate)) {
 		log_unusual(dstate->base_log,
 			    "Delaying start poll: commands in progress");
 		next_topology_timer(dstate);
 	} else
-		bitcoind_get_chaintip(dstate, check_chaintip, NULL);
+		chain_get_chaintip(dstate, check_chaintip, NULL);
+}
+
+void topology_poll_now(struct lightningd_state *dstate)
+{
+	struct topology *topo = dstate->topology;
+
+	/* The poll timer is the host's, whoever asks. */
+	dstate = dstate->host;
+	if (topo->polling)
+		topo->poll_again = true;
+	else
+		start_poll_chaintip(dstate);
 }
 
 static void init_topo(struct lightningd_state *dstate,
@@ -425,24 +1319,223 @@ static void init_topo(struct lightningd_state *dstate,
 
 	topo->root = new_block(dstate, blk, NULL);
 	topo->root->height = ptr2int(p);
+	/* We never look in the root's txs anyway. */
+	topo->root->header_only = false;
 	block_map_add(&topo->block_map, topo->root);
 	topo->tip = topo->root;
+	start_topology_cache(dstate);
 
 	/* Now grab chaintip immediately. */
-	bitcoind_get_chaintip(dstate, check_chaintip, NULL);
+	chain_get_chaintip(dstate, check_chaintip, NULL);
 }
 
 static void get_init_block(struct lightningd_state *dstate,
 			   const struct sha256_double *blkid,
 			   ptrint_t *blknum)
 {
-	bitcoind_getrawblock(dstate, blkid, init_topo, blknum);
+	get_block(dstate, blkid, init_topo, blknum);
+}
+
+/* Reads the records into @map (blocks allocated off @ctx).  Returns false
+ * if there's no file, or it's not ours. */
+static bool read_topology_cache(struct lightningd_state *dstate,
+				const tal_t *ctx, struct block_map *map,
+				struct sha256_double *tipid)
+{
+	struct topology *topo = dstate->topology;
+	struct stat st;
+	const u8 *p;
+	u8 *buf;
+	size_t len, magiclen = strlen(TOPOLOGY_CACHE_MAGIC);
+	bool have_tip = false;
+	int fd;
+
+	fd = open(TOPOLOGY_CACHE_FILE, O_RDONLY);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			log_unusual(dstate->base_log, "Opening %s: %s",
+				    TOPOLOGY_CACHE_FILE, strerror(errno));
+		return false;
+	}
+	if (fstat(fd, &st) != 0) {
+		log_unusual(dstate->base_log, "Checking %s: %s",
+			    TOPOLOGY_CACHE_FILE, strerror(errno));
+		close(fd);
+		return false;
+	}
+	len = st.st_size;
+	buf = tal_arr(ctx, u8, len);
+	if (!read_all(fd, buf, len)) {
+		log_unusual(dstate->base_log, "Reading %s: %s",
+			    TOPOLOGY_CACHE_FILE, strerror(errno));
+		close(fd);
+		return false;
+	}
+	close(fd);
+
+	if (len < magiclen || memcmp(buf, TOPOLOGY_CACHE_MAGIC, magiclen)) {
+		log_unusual(dstate->base_log, "Ignoring %s: bad magic",
+			    TOPOLOGY_CACHE_FILE);
+		return false;
+	}
+	p = buf + magiclen;
+	len -= magiclen;
+
+	/* We may have died partway through a record: ignore it. */
+	while (len >= sizeof(struct topo_record)) {
+		struct topo_record rec;
+		struct sha256_double blkid;
+		struct block *b;
+		size_t n;
+
+		memcpy(&rec, p, sizeof(rec));
+		p += sizeof(rec);
+		len -= sizeof(rec);
+		n = le32_to_cpu(rec.num_txids);
+		if (len / sizeof(struct sha256_double) < n)
+			break;
+
+		sha256_double(&blkid, &rec.u.hdr, sizeof(rec.u.hdr));
+		if (le32_to_cpu(rec.type) == TOPO_RECORD_PRUNED) {
+			add_pruned(topo, &rec.u.blkid, le32_to_cpu(rec.height),
+				   le32_to_cpu(rec.mediantime), n,
+				   (const struct sha256_double *)p);
+		} else if (le32_to_cpu(rec.type) == TOPO_RECORD_TIP) {
+			*tipid = blkid;
+			have_tip = true;
+		} else if (le32_to_cpu(rec.type) == TOPO_RECORD_BLOCK) {
+			b = block_map_get(map, &blkid);
+			if (!b) {
+				b = tal(ctx, struct block);
+				b->blkid = blkid;
+				b->txids = NULL;
+				block_map_add(map, b);
+			}
+			b->hdr = rec.u.hdr;
+			b->height = le32_to_cpu(rec.height);
+			b->mediantime = le32_to_cpu(rec.mediantime);
+			tal_free(b->txids);
+			b->txids = tal_arr(b, struct sha256_double, n);
+			memcpy(b->txids, p, n * sizeof(b->txids[0]));
+		} else
+			break;
+
+		p += n * sizeof(struct sha256_double);
+		len -= n * sizeof(struct sha256_double);
+	}
+	return have_tip;
+}
+
+/* Returns false if there's no usable cache. */
+static bool load_topology_cache(struct lightningd_state *dstate)
+{
+	struct topology *topo = dstate->topology;
+	tal_t *tmpctx = tal(dstate, char);
+	struct block_map map;
+	struct sha256_double tipid;
+	struct block *b, *next = NULL;
+	size_t i, num = 0;
+
+	block_map_init(&map);
+	if (!read_topology_cache(dstate, tmpctx, &map, &tipid))
+		goto fail;
+
+	/* Walk back from the tip: anything else was reorged out. */
+	b = block_map_get(&map, &tipid);
+	if (!b) {
+		log_unusual(dstate->base_log, "Ignoring %s: tip not found",
+			    TOPOLOGY_CACHE_FILE);
+		goto fail;
+	}
+	topo->tip = b;
+	while (b) {
+		struct block *prev = block_map_get(&map, &b->hdr.prev_hash);
+
+		if (prev && prev->height + 1 != b->height)
+			prev = NULL;
+
+		tal_steal(topo, b);
+		b->prev = prev;
+		b->next = next;
+		b->raw_txs = NULL;
+		b->num_raw_txs = 0;
+		b->header_only = true;
+		block_map_add(&topo->block_map, b);
+		for (i = 0; i < tal_count(b->txids); i++)
+			index_tx(topo, b, &b->txids[i]);
+		topo->root = b;
+		next = b;
+		b = prev;
+		num++;
+	}
+	/* We never look in the root's txs anyway. */
+	topo->root->header_only = false;
+	prune_blocks(dstate);
+
+	block_map_clear(&map);
+	tal_free(tmpctx);
+	log_debug(dstate->base_log, "Read %zu blocks from %s (%u-%u)",
+		  num, TOPOLOGY_CACHE_FILE,
+		  topo->root->height, topo->tip->height);
+	return true;
+
+fail:
+	forget_pruned(topo);
+	block_map_clear(&map);
+	tal_free(tmpctx);
+	return false;
+}
+
+static void forget_topology_cache(struct lightningd_state *dstate)
+{
+	struct topology *topo = dstate->topology;
+	struct sha256_double *txids = tal_arr(dstate, struct sha256_double, 0);
+
+	free_blocks(dstate, topo->root, &txids);
+	tal_free(txids);
+	topo->root = topo->tip = NULL;
+	forget_pruned(topo);
+}
+
+static void check_cached_root(struct lightningd_state *dstate,
+			      const struct sha256_double *blkid,
+			      ptrint_t *start)
+{
+	struct topology *topo = dstate->topology;
+	struct sha256_double *txids;
+	struct block *b;
+
+	/* A reorg deeper than our whole chain: unlikely, but start again. */
+	if (!structeq(blkid, &topo->root->blkid)) {
+		log_unusual(dstate->base_log,
+			    "Ignoring %s: block %u not in main chain",
+			    TOPOLOGY_CACHE_FILE, topo->root->height);
+		forget_topology_cache(dstate);
+		chain_getblockhash(dstate, ptr2int(start), get_init_block,
+				      start);
+		return;
+	}
+
+	log_info(dstate->base_log, "Using %s for blocks %u-%u",
+		 TOPOLOGY_CACHE_FILE, topo->root->height, topo->tip->height);
+	start_topology_cache(dstate);
+
+	/* Watches from the db can now find their txs. */
+	txids = tal_arr(dstate, struct sha256_double, 0);
+	for (b = topo->root; b; b = b->next)
+		append_txids(&txids, b);
+	watch_topology_changed(dstate, topo->root->height, txids);
+	tal_free(txids);
+
+	/* Polling fetches anything since, and reorgs out anything stale. */
+	chain_get_chaintip(dstate, check_chaintip, NULL);
 }
 
 static void get_init_blockhash(struct lightningd_state *dstate, u32 blockcount,
 			       void *unused)
 {
 	u32 start;
+	struct lightningd_state *node;
 	struct peer *peer;
 
 	if (blockcount < 100)
@@ -450,24 +1543,49 @@ static void get_init_blockhash(struct lightningd_state *dstate, u32 blockcount,
 	else
 		start = blockcount - 100;
 
-	/* If loaded from database, go back to earliest possible peer anchor. */
-	list_for_each(&dstate->peers, peer, list) {
-		if (peer->anchor.min_depth && peer->anchor.min_depth < start)
-			start = peer->anchor.min_depth;
+	/* If loaded from database, go back to earliest possible peer anchor
+	 * (tenants' databases are loaded by now, too). */
+	for (node = dstate; node; node = next_node(dstate, node)) {
+		list_for_each(&node->peers, peer, list) {
+			if (peer->anchor.min_depth
+			    && peer->anchor.min_depth < start)
+				start = peer->anchor.min_depth;
+		}
+	}
+
+	/* Our saved chain has to reach back at least as far, or to where
+	 * we pruned it. */
+	if (load_topology_cache(dstate)) {
+		const struct topology *topo = dstate->topology;
+		if ((topo->root->height <= start
+		     || topo->tip->height - topo->root->height + 1
+		     >= unpruned_blocks(dstate))
+		    && topo->tip->height <= blockcount) {
+			chain_getblockhash(dstate,
+					      topo->root->height,
+					      check_cached_root,
+					      int2ptr(start));
+			return;
+		}
+		log_unusual(dstate->base_log,
+			    "Ignoring %s: blocks %u-%u, but blockcount %u",
+			    TOPOLOGY_CACHE_FILE,
+			    topo->root->height,
+			    topo->tip->height, blockcount);
+		forget_topology_cache(dstate);
 	}
 
 	/* Start topology from 100 blocks back. */
-	bitcoind_getblockhash(dstate, start, get_init_block, int2ptr(start));
+	chain_getblockhash(dstate, start, get_init_block, int2ptr(start));
 }
 
 u32 get_tx_mediantime(struct lightningd_state *dstate,
 		      const struct sha256_double *txid)
 {
-	struct block *b;
+	struct tx_place place;
 
-	b = block_for_tx(dstate, txid);
-	if (b)
-		return b->mediantime;
+	if (find_tx(dstate, txid, &place))
+		return place.mediantime;
 
 	fatal("Tx %s not found for get_tx_mediantime",
 	      tal_hexstr(dstate, txid, sizeof(*txid)));
@@ -496,32 +1614,46 @@ u64 get_feerate(struct lightningd_state *dstate)
 struct txlocator *locate_tx(const void *ctx, struct lightningd_state *dstate,
 			    const struct sha256_double *txid)
 {
-	struct block *block = block_for_tx(dstate, txid);
-	if (block == NULL) {
-		return NULL;
-	}
+	struct tx_place place;
+	struct txlocator *loc;
 
-	struct txlocator *loc = talz(ctx, struct txlocator);
-	loc->blkheight = block->height;
+	if (!find_tx(dstate, txid, &place))
+		return NULL;
 
-	size_t i, n = tal_count(block->txids);
-	for (i = 0; i < n; i++) {
-		if (structeq(&block->txids[i], txid)){
-			loc->index = i;
-			break;
-		}
-	}
+	loc = talz(ctx, struct txlocator);
+	loc->blkheight = place.height;
+	loc->index = place.index;
 	return loc;
 }
 
 void setup_topology(struct lightningd_state *dstate)
 {
+	struct lightningd_state *node;
+
 	dstate->topology = tal(dstate, struct topology);
+	/* Tenants' watches (from their databases) can fire during startup. */
+	for (node = next_node(dstate, dstate); node;
+	     node = next_node(dstate, node))
+		node->topology = dstate->topology;
+	dstate->topology->root = dstate->topology->tip = NULL;
+	dstate->topology->cache_fd = -1;
+	dstate->topology->pruned = tal_arr(dstate->topology,
+					   struct pruned_block, 0);
+	dstate->topology->pruned_txids = tal_arr(dstate->topology,
+						 struct sha256_double, 0);
+	dstate->topology->pruned_order = tal_arr(dstate->topology, u32, 0);
 	block_map_init(&dstate->topology->block_map);
+	txid_map_init(&dstate->topology->txid_map);
+	dstate->topology->orphans = tal_arr(dstate->topology, struct block *, 0);
+	block_map_init(&dstate->topology->orphan_map);
 
 	dstate->topology->startup = true;
+	dstate->topology->polling = true;
+	dstate->topology->poll_again = false;
+	dstate->topology->poll_timer = NULL;
 	dstate->topology->feerate = 0;
-	bitcoind_getblockcount(dstate, get_init_blockhash, NULL);
+	dstate->topology->fee_estimating = false;
+	chain_getblockcount(dstate, get_init_blockhash, NULL);
 
 	/* Once it gets topology, it calls io_break() and we return. */
 	io_loop(NULL, NULL);
@@ -43,6 +43,12 @@ void broadcast_tx(struct peer *peer, const struct bitcoin_tx *tx);
 
 void setup_topology(struct lightningd_state *dstate);
 
+/* A watch was added: get txs of blocks we only fetched headers for. */
+void topology_new_watch(struct lightningd_state *dstate);
+
+/* Something (like bitcoind) says the chain changed: check now. */
+void topology_poll_now(struct lightningd_state *dstate);
+
 struct txlocator *locate_tx(const void *ctx, struct lightningd_state *dstate, const struct sha256_double *txid);
 
 #endif /* LIGHTNING_DAEMON_CRYPTOPKT_H */
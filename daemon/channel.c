@@ -123,7 +123,7 @@ static bool change_funding(uint64_t anchor_satoshis,
 bool anchor_too_large(uint64_t anchor_satoshis)
 {
 	/* Anchor must fit in 32 bit. */
-	return anchor_satoshis >= (1ULL << 32) / 1000;
+	return anchor_satoshis >= ANCHOR_LIMIT_SATOSHIS;
 }
 
 struct channel_state *initial_cstate(const tal_t *ctx,
@@ -151,6 +151,7 @@ struct channel_state *initial_cstate(const tal_t *ctx,
 
 	/* Neither side has HTLCs. */
 	funder->num_htlcs = fundee->num_htlcs = 0;
+	funder->htlc_msat = fundee->htlc_msat = 0;
 
 	/* Initially, all goes back to funder. */
 	funder->pay_msat = anchor_satoshis * 1000 - fee_msat;
@@ -224,6 +225,7 @@ bool cstate_add_htlc(struct channel_state *cstate, const struct htlc *htlc,
 
 	cstate->num_nondust = nondust;
 	creator->num_htlcs++;
+	creator->htlc_msat += htlc->msatoshi;
 	return true;
 }
 
@@ -252,6 +254,7 @@ static void remove_htlc(struct channel_state *cstate,
 	/* Actually remove the HTLC. */
 	assert(cstate->side[creator].num_htlcs > 0);
 	cstate->side[creator].num_htlcs--;
+	cstate->side[creator].htlc_msat -= htlc->msatoshi;
 	cstate->num_nondust = nondust;
 }
 
@@ -277,6 +280,7 @@ void force_add_htlc(struct channel_state *cstate, const struct htlc *htlc)
 
 	creator = &cstate->side[htlc_owner(htlc)];
 	creator->num_htlcs++;
+	creator->htlc_msat += htlc->msatoshi;
 	creator->pay_msat -= htlc->msatoshi;
 	
 	/* Remember to count the new one in total txsize if not dust! */
@@ -290,6 +294,7 @@ static void force_remove_htlc(struct channel_state *cstate,
 {
 	cstate->side[beneficiary].pay_msat += htlc->msatoshi;
 	cstate->side[htlc_owner(htlc)].num_htlcs--;
+	cstate->side[htlc_owner(htlc)].htlc_msat -= htlc->msatoshi;
 	if (!is_dust(htlc->msatoshi / 1000))
 		cstate->num_nondust--;
 }
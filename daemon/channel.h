@@ -20,6 +20,8 @@ struct channel_oneside {
 	uint32_t pay_msat, fee_msat;
 	/* Number of HTLCs (required for limiting total number) */
 	unsigned int num_htlcs;
+	/* And their total, in millisatoshi. */
+	uint32_t htlc_msat;
 };
 
 struct channel_state {
@@ -50,6 +52,9 @@ struct channel_state *initial_cstate(const tal_t *ctx,
  * copy_cstate: Make a deep copy of channel_state
  * @ctx: tal context to allocate return value from.
  * @cstate: state to copy.
+ *
+ * The HTLCs themselves live in peer->htlcs, so this is just the totals:
+ * structure assignment works as well, if you already have one.
  */
 struct channel_state *copy_cstate(const tal_t *ctx,
 				  const struct channel_state *cstate);
@@ -133,6 +138,9 @@ bool force_fee(struct channel_state *cstate, uint64_t fee);
  */
 uint64_t fee_by_feerate(size_t txsize, uint64_t fee_rate);
 
+/* The smallest anchor which is anchor_too_large(). */
+#define ANCHOR_LIMIT_SATOSHIS ((1ULL << 32) / 1000)
+
 /**
  * anchor_too_large: does anchor amount fit in 32-bits of millisatoshi.
  * @anchor_satoshis: amount in satoshis
@@ -14,19 +14,32 @@
 #include "remove_dust.h"
 #include "utils.h"
 #include <assert.h>
+#include <ccan/cast/cast.h>
+#include <ccan/structeq/structeq.h>
 #include <inttypes.h>
 
-u8 *wscript_for_htlc(const tal_t *ctx,
-		     const struct peer *peer,
-		     const struct htlc *h,
-		     const struct sha256 *rhash,
-		     enum side side)
+/* Build them once, then just patch in each commitment's revocation hash. */
+static const struct htlc_scripts *htlc_scripts(const struct peer *peer,
+					       const struct htlc *h,
+					       const struct sha256 *rhash,
+					       enum side side)
 {
+	struct htlc_scripts *sc;
 	const struct peer_visible_state *this_side, *other_side;
 	u8 *(*fn)(const tal_t *, secp256k1_context *,
 		  const struct pubkey *, const struct pubkey *,
 		  const struct abs_locktime *, const struct rel_locktime *,
-		  const struct sha256 *, const struct sha256 *);
+		  const struct sha256 *, const struct sha256 *, size_t *);
+
+	/* It's only a cache. */
+	sc = &cast_const(struct htlc *, h)->scripts[side];
+	if (sc->wscript) {
+		if (structeq(&sc->revoke, rhash))
+			return sc;
+		bitcoin_redeem_htlc_change_revoke(sc->wscript, sc->revoke_off,
+						  rhash);
+		goto new_revoke;
+	}
 
 	/* scripts are different for htlcs offered vs accepted */
 	if (side == htlc_owner(h))
@@ -42,9 +55,27 @@ u8 *wscript_for_htlc(const tal_t *ctx,
 		other_side = &peer->local;
 	}
 
-	return fn(ctx, peer->dstate->secpctx,
-		  &this_side->finalkey, &other_side->finalkey,
-		  &h->expiry, &this_side->locktime, rhash, &h->rhash);
+	sc->wscript = fn(h, peer->dstate->secpctx,
+			 &this_side->finalkey, &other_side->finalkey,
+			 &h->expiry, &this_side->locktime, rhash, &h->rhash,
+			 &sc->revoke_off);
+
+new_revoke:
+	sc->revoke = *rhash;
+	tal_free(sc->p2wsh);
+	sc->p2wsh = scriptpubkey_p2wsh(h, sc->wscript);
+	return sc;
+}
+
+u8 *wscript_for_htlc(const tal_t *ctx,
+		     const struct peer *peer,
+		     const struct htlc *h,
+		     const struct sha256 *rhash,
+		     enum side side)
+{
+	const u8 *wscript = htlc_scripts(peer, h, rhash, side)->wscript;
+
+	return tal_dup_arr(ctx, u8, wscript, tal_count(wscript), 0);
 }
 
 static size_t count_htlcs(const struct htlc_map *htlcs, int flag)
@@ -120,7 +151,7 @@ static bool add_output(struct bitcoin_tx *tx, u8 *script, u64 amount,
 	assert(tx->output_count < tal_count(tx->output));
 	if (is_dust(amount))
 		return false;
-	tx->output[tx->output_count].script = script;
+	tx->output[tx->output_count].script = tal_steal(tx, script);
 	tx->output[tx->output_count].script_length = tal_count(script);
 	tx->output[tx->output_count].amount = amount;
 	tx->output_count++;
@@ -141,9 +172,12 @@ struct bitcoin_tx *create_commit_tx(const tal_t *ctx,
 	struct htlc *h;
 	bool pays_to[2];
 	int committed_flag = HTLC_FLAG(side,HTLC_F_COMMITTED);
+	/* Witness scripts and log strings: gone when we return. */
+	tal_t *tmpctx;
 
 	/* Now create commitment tx: one input, two outputs (plus htlcs) */
 	tx = bitcoin_tx(ctx, 1, 2 + count_htlcs(&peer->htlcs, committed_flag));
+	tmpctx = tal(tx, char);
 
  	log_debug(peer->log, "Creating commitment tx:");
 	log_add_struct(peer->log, " rhash = %s", struct sha256, rhash);
@@ -162,26 +196,26 @@ struct bitcoin_tx *create_commit_tx(const tal_t *ctx,
 	tx->input[0].amount = tal_dup(tx->input, u64, &peer->anchor.satoshis);
 
 	tx->output_count = 0;
-	pays_to[LOCAL] = add_output(tx, commit_output_to_us(tx, peer, rhash,
+	pays_to[LOCAL] = add_output(tx, commit_output_to_us(tmpctx, peer, rhash,
 							    side, NULL),
 				    cstate->side[LOCAL].pay_msat / 1000,
 				    &total);
 	if (pays_to[LOCAL])
 		log_debug(peer->log, "Pays %u to local: %s",
 			  cstate->side[LOCAL].pay_msat / 1000,
-			  tal_hexstr(tx, tx->output[tx->output_count-1].script,
+			  tal_hexstr(tmpctx, tx->output[tx->output_count-1].script,
 				     tx->output[tx->output_count-1].script_length));
 	else
 		log_debug(peer->log, "DOES NOT pay %u to local",
 			  cstate->side[LOCAL].pay_msat / 1000);
-	pays_to[REMOTE] = add_output(tx, commit_output_to_them(tx, peer, rhash,
-							       side, NULL),
+	pays_to[REMOTE] = add_output(tx, commit_output_to_them(tmpctx, peer,
+							       rhash, side, NULL),
 				     cstate->side[REMOTE].pay_msat / 1000,
 				     &total);
 	if (pays_to[REMOTE])
 		log_debug(peer->log, "Pays %u to remote: %s",
 			  cstate->side[REMOTE].pay_msat / 1000,
-			  tal_hexstr(tx, tx->output[tx->output_count-1].script,
+			  tal_hexstr(tmpctx, tx->output[tx->output_count-1].script,
 				     tx->output[tx->output_count-1].script_length));
 	else
 		log_debug(peer->log, "DOES NOT pay %u to remote",
@@ -194,13 +228,14 @@ struct bitcoin_tx *create_commit_tx(const tal_t *ctx,
 	for (h = htlc_map_first(&peer->htlcs, &it);
 	     h;
 	     h = htlc_map_next(&peer->htlcs, &it)) {
-		const u8 *wscript;
+		const struct htlc_scripts *sc;
 
 		if (!htlc_has(h, committed_flag))
 			continue;
-		wscript = wscript_for_htlc(tx, peer, h, rhash, side);
+		sc = htlc_scripts(peer, h, rhash, side);
 		/* If we pay any HTLC, it's txout is not just to other side. */
-		if (add_output(tx, scriptpubkey_p2wsh(tx, wscript),
+		if (add_output(tx, tal_dup_arr(tmpctx, u8, sc->p2wsh,
+					       tal_count(sc->p2wsh), 0),
 			       h->msatoshi / 1000, &total)) {
 			*otherside_only = false;
 			log_debug(peer->log, "Pays %"PRIu64" to htlc %"PRIu64,
@@ -210,13 +245,15 @@ struct bitcoin_tx *create_commit_tx(const tal_t *ctx,
 			log_add_struct(peer->log, " rhash %s", struct sha256,
 				       &h->rhash);
 			log_debug(peer->log, "Script: %s",
-				  tal_hexstr(tx, wscript, tal_count(wscript)));
+				  tal_hexstr(tmpctx, sc->wscript,
+					     tal_count(sc->wscript)));
 		} else
 			log_debug(peer->log, "DOES NOT pay %"PRIu64" to htlc %"PRIu64,
 				  h->msatoshi / 1000, h->id);
 	}
 	assert(total <= peer->anchor.satoshis);
 
-	permute_outputs(tx->output, tx->output_count);
+	tal_free(tmpctx);
+	permute_outputs(tx->output, tx->output_count, NULL);
 	return tx;
 }
@@ -58,24 +58,20 @@ static void config_log_stderr_exit(const char *fmt, ...)
 }
 
 /* We turn the config file into cmdline arguments. */
-void opt_parse_from_config(const tal_t *ctx)
+bool config_file_args(const tal_t *ctx, char ***args)
 {
 	char *contents, **lines;
 	char **argv;
 	int i, argc;
 
+	*args = NULL;
 	contents = grab_file(ctx, "config");
 	/* Doesn't have to exist. */
-	if (!contents) {
-		if (errno != ENOENT)
-			fatal("Opening and reading config: %s",
-			      strerror(errno));
-		return;
-	}
+	if (!contents)
+		return errno == ENOENT;
 
 	lines = tal_strsplit(contents, contents, "\r\n", STR_NO_EMPTY);
 
-	/* We have to keep argv around, since opt will point into it */
 	argv = tal_arr(ctx, char *, argc = 1);
 	argv[0] = "lightning config file";
 
@@ -90,6 +86,22 @@ void opt_parse_from_config(const tal_t *ctx)
 	tal_resize(&argv, argc+1);
 	argv[argc] = NULL;
 
-	opt_parse(&argc, argv, config_log_stderr_exit);
 	tal_free(contents);
+	*args = argv;
+	return true;
+}
+
+void opt_parse_from_config(const tal_t *ctx)
+{
+	char **argv;
+	int argc;
+
+	if (!config_file_args(ctx, &argv))
+		fatal("Opening and reading config: %s", strerror(errno));
+	if (!argv)
+		return;
+
+	/* We have to keep argv around, since opt will point into it */
+	argc = tal_count(argv) - 1;
+	opt_parse(&argc, argv, config_log_stderr_exit);
 }
@@ -2,10 +2,15 @@
 #define LIGHTNING_DAEMON_CONFIGDIR_H
 #include "config.h"
 #include <ccan/tal/tal.h>
+#include <stdbool.h>
 
 void configdir_register_opts(const tal_t *ctx,
 			     char **config_dir, char **rpc_filename);
 
 void opt_parse_from_config(const tal_t *ctx);
 
+/* The config file as arguments for opt_parse (argv[0] is a dummy).  Sets
+ * *args NULL if there's no file; false (with errno) if we can't read it. */
+bool config_file_args(const tal_t *ctx, char ***args);
+
 #endif /* LIGHTNING_DAEMON_CONFIGDIR_H */
@@ -1,6 +1,7 @@
 #include "bitcoin/shadouble.h"
 #include "bitcoin/signature.h"
 #include "cryptopkt.h"
+#include "jobs.h"
 #include "lightning.pb-c.h"
 #include "lightningd.h"
 #include "log.h"
@@ -8,6 +9,8 @@
 #include "peer.h"
 #include "protobuf_convert.h"
 #include "secrets.h"
+#include "timeout.h"
+#include <assert.h>
 #include <ccan/build_assert/build_assert.h>
 #include <ccan/crypto/sha256/sha256.h>
 #include <ccan/endian/endian.h>
@@ -48,6 +51,9 @@ struct key_negotiate {
 	/* After DH key exchange, we create io_data to check auth. */
 	struct io_data *iod;
 
+	/* What handshake_job worked out. */
+	struct handshake_job *job;
+
 	/* Logging structure we're using. */
 	struct log *log;
 	
@@ -91,7 +97,7 @@ struct dir_state {
 	u64 nonce;
 	struct enckey enckey;
 
-	/* Current packet (encrypted). */
+	/* Current packet (encrypted), and how big its buffer is. */
 	struct crypto_pkt *cpkt;
 	size_t pkt_len;
 };
@@ -105,6 +111,7 @@ static void setup_crypto(struct dir_state *dir,
 	dir->enckey = enckey_from_secret(shared_secret, serial_pubkey);
 
 	dir->cpkt = NULL;
+	dir->pkt_len = 0;
 }
 
 struct io_data {
@@ -114,6 +121,15 @@ struct io_data {
 	/* Length we're currently reading. */
 	struct crypto_pkt hdr_in;
 
+	/* Reused for every write once we're talking to peer. */
+	u8 *outbuf;
+
+	/* Incoming packets are unpacked into here, and it's all released
+	 * at once.  What doesn't fit goes under arena_spill. */
+	char *arena;
+	size_t arena_used, arena_want;
+	char *arena_spill;
+
 	/* Callback once packet decrypted. */
 	struct io_plan *(*cb)(struct io_conn *, struct peer *);
 
@@ -131,6 +147,43 @@ static void proto_tal_free(void *allocator_data, void *pointer)
 	tal_free(pointer);
 }
 
+/* Enough for most packets; we grow it to this at most. */
+#define ARENA_INIT 4096
+#define ARENA_MAX (256 * 1024)
+#define ARENA_ALIGN 16
+
+static void *proto_arena_alloc(void *allocator_data, size_t size)
+{
+	struct io_data *iod = allocator_data;
+
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	iod->arena_want += size;
+	if (iod->arena_used + size <= tal_count(iod->arena)) {
+		void *p = iod->arena + iod->arena_used;
+		iod->arena_used += size;
+		return p;
+	}
+
+	if (!iod->arena_spill)
+		iod->arena_spill = tal(iod, char);
+	return tal_arr(iod->arena_spill, char, size);
+}
+
+/* It all goes in arena_reset. */
+static void proto_arena_free(void *allocator_data, void *pointer)
+{
+}
+
+static void arena_reset(struct io_data *iod)
+{
+	/* If we spilled, grow so we (probably) won't next time. */
+	if (iod->arena_want > tal_count(iod->arena)
+	    && iod->arena_want <= ARENA_MAX)
+		tal_resize(&iod->arena, iod->arena_want);
+	iod->arena_spill = tal_free(iod->arena_spill);
+	iod->arena_used = iod->arena_want = 0;
+}
+
 static void le64_nonce(unsigned char *npub, u64 nonce)
 {
 	/* BOLT #1: Nonces are 64-bit little-endian numbers */
@@ -188,10 +241,10 @@ static bool decrypt_in_place(void *data, size_t len,
 	return false;
 }
 
-static Pkt *decrypt_body(const tal_t *ctx, struct io_data *iod, struct log *log,
-			 struct crypto_pkt *cpkt, size_t data_len)
+static Pkt *decrypt_body(struct io_data *iod, struct log *log,
+			 struct crypto_pkt *cpkt, size_t data_len,
+			 struct ProtobufCAllocator *prototal)
 {
-	struct ProtobufCAllocator prototal;
 	Pkt *ret;
 
 	if (!decrypt_in_place(cpkt->data, data_len,
@@ -201,46 +254,101 @@ static Pkt *decrypt_body(const tal_t *ctx, struct io_data *iod, struct log *log,
 	}
 
 	/* De-protobuf it. */
+	ret = pkt__unpack(prototal, data_len, cpkt->data);
+	if (!ret)
+		log_unusual(log, "Packet failed to unpack!");
+	else
+		log_debug(log, "Received packet LEN=%u, type=%s",
+			  le32_to_cpu(iod->hdr_in.length),
+			  ret->pkt_case == PKT__PKT_AUTH ? "PKT_AUTH"
+			  : pkt_name(ret->pkt_case));
+	return ret;
+}
+
+/* Packet is a tal object, owning its contents. */
+static Pkt *decrypt_body_tal(const tal_t *ctx, struct io_data *iod,
+			     struct log *log,
+			     struct crypto_pkt *cpkt, size_t data_len)
+{
+	struct ProtobufCAllocator prototal;
+	Pkt *ret;
+
 	prototal.alloc = proto_tal_alloc;
 	prototal.free = proto_tal_free;
 	prototal.allocator_data = tal(ctx, char);
 
-	ret = pkt__unpack(&prototal, data_len, cpkt->data);
-	if (!ret) {
-		log_unusual(log, "Packet failed to unpack!");
+	ret = decrypt_body(iod, log, cpkt, data_len, &prototal);
+	if (!ret)
 		tal_free(prototal.allocator_data);
-	} else {
+	else {
 		/* Make sure packet owns contents */
 		tal_steal(ctx, ret);
 		tal_steal(ret, prototal.allocator_data);
-
-		log_debug(log, "Received packet LEN=%u, type=%s",
-			  le32_to_cpu(iod->hdr_in.length),
-			  ret->pkt_case == PKT__PKT_AUTH ? "PKT_AUTH"
-			  : pkt_name(ret->pkt_case));
 	}
 	return ret;
 }
 
+/* Packet lives in the arena, until the next one (or
+ * peer_release_packet). */
+static Pkt *decrypt_body_arena(struct io_data *iod, struct log *log,
+			       struct crypto_pkt *cpkt, size_t data_len)
+{
+	struct ProtobufCAllocator prototal;
+
+	prototal.alloc = proto_arena_alloc;
+	prototal.free = proto_arena_free;
+	prototal.allocator_data = iod;
+
+	if (!iod->arena)
+		iod->arena = tal_arr(iod, char, ARENA_INIT);
+	else
+		arena_reset(iod);
+
+	return decrypt_body(iod, log, cpkt, data_len, &prototal);
+}
+
+static size_t encrypted_len(size_t len)
+{
+	return sizeof(struct crypto_pkt) + len
+		+ crypto_aead_chacha20poly1305_ABYTES;
+}
+
+/* dst needs encrypted_len(len) bytes; it needn't be aligned.  This only
+ * lays out the plaintext: encrypt_pkts_in_place() does the rest. */
+static void pack_pkt_into(const Pkt *pkt, size_t len, u8 *dst)
+{
+	le32 lelen = cpu_to_le32(len);
+
+	memcpy(dst, &lelen, sizeof(lelen));
+	pkt__pack(pkt, dst + sizeof(struct crypto_pkt));
+}
+
+/* Encrypts num packets laid out back to back by pack_pkt_into(): each
+ * header then its body, on consecutive nonces.  Packing everything first
+ * means this is one pass over one buffer, with the key hot. */
+static void encrypt_pkts_in_place(struct dir_state *out, u8 *buf,
+				  const size_t *lens, size_t num)
+{
+	size_t i;
+
+	for (i = 0; i < num; i++) {
+		encrypt_in_place(buf, sizeof(le32), &out->nonce, &out->enckey);
+		buf += sizeof(struct crypto_pkt);
+		encrypt_in_place(buf, lens[i], &out->nonce, &out->enckey);
+		buf += lens[i] + crypto_aead_chacha20poly1305_ABYTES;
+	}
+}
+
 static struct crypto_pkt *encrypt_pkt(struct io_data *iod, const Pkt *pkt,
 				      size_t *totlen)
 {
 	struct crypto_pkt *cpkt;
-	size_t len;
-
-	len = pkt__get_packed_size(pkt);
-	*totlen = sizeof(*cpkt) + len + crypto_aead_chacha20poly1305_ABYTES;
+	size_t len = pkt__get_packed_size(pkt);
 
+	*totlen = encrypted_len(len);
 	cpkt = (struct crypto_pkt *)tal_arr(iod, char, *totlen);
-	cpkt->length = cpu_to_le32(len);
-
-	/* Encrypt header. */
-	encrypt_in_place(cpkt, sizeof(cpkt->length),
-			 &iod->out.nonce, &iod->out.enckey);
-
-	/* Encrypt body. */
-	pkt__pack(pkt, cpkt->data);
-	encrypt_in_place(cpkt->data, len, &iod->out.nonce, &iod->out.enckey);
+	pack_pkt_into(pkt, len, (u8 *)cpkt);
+	encrypt_pkts_in_place(&iod->out, (u8 *)cpkt, &len, 1);
 
 	return cpkt;
 }
@@ -249,9 +357,13 @@ static struct io_plan *recv_body(struct io_conn *conn, struct peer *peer)
 {
 	struct io_data *iod = peer->io_data;
 
+	peer->usage.bytes_in += sizeof(iod->hdr_in)
+		+ le32_to_cpu(iod->hdr_in.length)
+		+ crypto_aead_chacha20poly1305_ABYTES;
+
 	/* We have full packet. */
-	peer->inpkt = decrypt_body(iod, iod, peer->log, iod->in.cpkt,
-				   le32_to_cpu(iod->hdr_in.length));
+	peer->inpkt = decrypt_body_arena(iod, peer->log, iod->in.cpkt,
+					 le32_to_cpu(iod->hdr_in.length));
 	if (!peer->inpkt)
 		return io_close(conn);
 
@@ -261,6 +373,8 @@ static struct io_plan *recv_body(struct io_conn *conn, struct peer *peer)
 static bool decrypt_header(struct log *log, struct io_data *iod,
 			   size_t *body_len)
 {
+	size_t len;
+
 	/* We have length: Check it. */
 	if (!decrypt_in_place(&iod->hdr_in.length, sizeof(iod->hdr_in.length),
 			      &iod->in.nonce, &iod->in.enckey)) {
@@ -278,12 +392,17 @@ static bool decrypt_header(struct log *log, struct io_data *iod,
 		return false;
 	}
 
-	/* Allocate room for body, copy header. */
+	/* Make room for body (reusing buffer if we can), copy header. */
 	*body_len = le32_to_cpu(iod->hdr_in.length)
 		+ crypto_aead_chacha20poly1305_ABYTES;
+	len = sizeof(iod->hdr_in) + *body_len;
 
-	iod->in.cpkt = (struct crypto_pkt *)
-		tal_arr(iod, char, sizeof(iod->hdr_in) + *body_len);
+	/* Don't hang onto a huge one forever, though. */
+	if (iod->in.pkt_len < len || iod->in.pkt_len > len * 4 + 65536) {
+		tal_free(iod->in.cpkt);
+		iod->in.cpkt = (struct crypto_pkt *)tal_arr(iod, char, len);
+		iod->in.pkt_len = len;
+	}
 	*iod->in.cpkt = iod->hdr_in;
 	return true;
 }
@@ -312,22 +431,59 @@ struct io_plan *peer_read_packet(struct io_conn *conn,
 }
 
 /* Caller must free data! */
+struct io_plan *peer_write_packets(struct io_conn *conn,
+				   struct peer *peer,
+				   const Pkt **pkts, const size_t *lens,
+				   size_t num,
+				   struct io_plan *(*next)(struct io_conn *,
+							   struct peer *))
+{
+	struct io_data *iod = peer->io_data;
+	size_t i, sizes[PEER_WRITE_MAX_PKTS], totlen = 0;
+
+	assert(num <= PEER_WRITE_MAX_PKTS);
+
+	/* Negotiation's last packet: previous write is finished now */
+	iod->out.cpkt = tal_free(iod->out.cpkt);
+
+	for (i = 0; i < num; i++) {
+		sizes[i] = lens ? lens[i] : pkt__get_packed_size(pkts[i]);
+		totlen += encrypted_len(sizes[i]);
+	}
+
+	/* Grow as needed, but don't hang onto a huge one forever. */
+	if (!iod->outbuf)
+		iod->outbuf = tal_arr(iod, u8, totlen);
+	else if (tal_count(iod->outbuf) < totlen
+		 || tal_count(iod->outbuf) > totlen * 4 + 65536)
+		tal_resize(&iod->outbuf, totlen);
+
+	/* One buffer, so one write (and usually one TCP segment).  We pack
+	 * straight into it, then encrypt the whole run in place. */
+	totlen = 0;
+	for (i = 0; i < num; i++) {
+		pack_pkt_into(pkts[i], sizes[i], iod->outbuf + totlen);
+		totlen += encrypted_len(sizes[i]);
+	}
+	encrypt_pkts_in_place(&iod->out, iod->outbuf, sizes, num);
+
+	peer->usage.bytes_out += totlen;
+	return io_write(conn, iod->outbuf, totlen, next, peer);
+}
+
 struct io_plan *peer_write_packet(struct io_conn *conn,
 				  struct peer *peer,
 				  const Pkt *pkt,
 				  struct io_plan *(*next)(struct io_conn *,
 							  struct peer *))
 {
-	struct io_data *iod = peer->io_data;
-	size_t totlen;
-
-	/* We free previous packet here, rather than doing indirection
-	 * via io_write */
-	tal_free(iod->out.cpkt);
-
-	iod->out.cpkt = encrypt_pkt(iod, pkt, &totlen);
+	return peer_write_packets(conn, peer, &pkt, NULL, 1, next);
+}
 
-	return io_write(conn, iod->out.cpkt, totlen, next, peer);
+void peer_release_packet(struct peer *peer)
+{
+	peer->inpkt = NULL;
+	arena_reset(peer->io_data);
 }
 
 static void *pkt_unwrap(Pkt *inpkt, struct log *log, Pkt__PktCase which)
@@ -358,13 +514,70 @@ static void *pkt_unwrap(Pkt *inpkt, struct log *log, Pkt__PktCase which)
 	return inpkt->error;
 }
 
+/* The slow parts of the handshake: they run in a job thread, so a flood
+ * of connections is shared between cores instead of queueing on the main
+ * loop.  They only read dstate's secpctx and our secret, which never
+ * change. */
+struct handshake_job {
+	struct lightningd_state *dstate;
+	struct key_negotiate *neg;
+	bool ok;
+
+	/* Key exchange: their session key in, secret and our proof out. */
+	struct pubkey sessionkey;
+	u8 seckey[32];
+	u8 their_sessionpubkey[33];
+	u8 shared_secret[32];
+	struct signature sig;
+
+	/* Checking their proof: they signed sha with id's key. */
+	struct sha256_double sha;
+	struct pubkey id;
+};
+
+static void exchange_work(struct handshake_job *job)
+{
+	job->ok = secp256k1_ecdh(job->dstate->secpctx, job->shared_secret,
+				 &job->sessionkey.pubkey, job->seckey);
+	if (job->ok)
+		privkey_sign(job->dstate, job->their_sessionpubkey,
+			     sizeof(job->their_sessionpubkey), &job->sig);
+}
+
+static void check_work(struct handshake_job *job)
+{
+	job->ok = check_signed_hash(job->dstate->secpctx, &job->sha,
+				    &job->sig, &job->id);
+}
+
+/* Back in the main loop: the connection picks up where it waited. */
+static void handshake_job_done(struct lightningd_state *dstate,
+			       struct handshake_job *job)
+{
+	struct key_negotiate *neg = job->neg;
+
+	/* It's freed after we return: keep a copy of the answers. */
+	neg->job = tal_dup(neg, struct handshake_job, job);
+	io_wake(neg);
+}
+
+static struct handshake_job *new_handshake_job(struct key_negotiate *neg)
+{
+	struct handshake_job *job = tal(NULL, struct handshake_job);
+
+	job->dstate = neg->dstate;
+	job->neg = neg;
+	neg->job = tal_free(neg->job);
+	return job;
+}
+
+/* Everything but checking the signature (a handshake_job does that). */
 static bool check_proof(struct key_negotiate *neg, struct log *log,
 			Pkt *inpkt,
 			const struct pubkey *expected_id,
-			struct pubkey *id)
+			struct handshake_job *job)
 {
-	struct sha256_double sha;
-	struct signature sig;
+	struct pubkey *id = &job->id;
 	Authenticate *auth;
 
 	auth = pkt_unwrap(inpkt, log, PKT__PKT_AUTH);
@@ -394,7 +607,7 @@ static bool check_proof(struct key_negotiate *neg, struct log *log,
 	 *     endian S value.
 	 */
 	if (!proto_to_signature(neg->dstate->secpctx, auth->session_sig,
-				&sig)) {
+				&job->sig)) {
 		log_unusual(log, "Invalid auth signature");
 		return false;
 	}
@@ -406,37 +619,48 @@ static bool check_proof(struct key_negotiate *neg, struct log *log,
 	 *     its own sessionpubkey, using the secret key corresponding to
 	 *     the sender's `node_id`.
 	 */
-	sha256_double(&sha, neg->our_sessionpubkey,
+	sha256_double(&job->sha, neg->our_sessionpubkey,
 		      sizeof(neg->our_sessionpubkey));
+	return true;
+}
 
-	if (!check_signed_hash(neg->dstate->secpctx, &sha, &sig, id)) {
-		log_unusual(log, "Bad auth signature");
-		return false;
+static struct io_plan *proof_checked(struct io_conn *conn,
+				     struct key_negotiate *neg)
+{
+	struct io_plan *plan;
+
+	if (!neg->job->ok) {
+		log_unusual(neg->log, "Bad auth signature");
+		return io_close(conn);
 	}
 
-	return true;
+	plan = neg->cb(conn, neg->dstate, neg->iod, neg->log, &neg->job->id,
+		       neg->arg);
+	tal_free(neg);
+	return plan;
 }
 
 static struct io_plan *recv_body_negotiate(struct io_conn *conn,
 					   struct key_negotiate *neg)
 {
 	struct io_data *iod = neg->iod;
-	struct io_plan *plan;
+	struct handshake_job *job;
 	Pkt *pkt;
-	struct pubkey id;
 
 	/* We have full packet. */
-	pkt = decrypt_body(neg, iod, neg->log, iod->in.cpkt,
-			   le32_to_cpu(iod->hdr_in.length));
+	pkt = decrypt_body_tal(neg, iod, neg->log, iod->in.cpkt,
+			       le32_to_cpu(iod->hdr_in.length));
 	if (!pkt)
 		return io_close(conn);
 
-	if (!check_proof(neg, neg->log, pkt, neg->expected_id, &id))
+	job = new_handshake_job(neg);
+	if (!check_proof(neg, neg->log, pkt, neg->expected_id, job)) {
+		tal_free(job);
 		return io_close(conn);
+	}
 
-	plan = neg->cb(conn, neg->dstate, neg->iod, neg->log, &id, neg->arg);
-	tal_free(neg);
-	return plan;
+	job_submit(neg->dstate, NULL, check_work, handshake_job_done, job);
+	return io_wait(conn, neg, proof_checked, neg);
 }
 
 static struct io_plan *recv_header_negotiate(struct io_conn *conn,
@@ -482,51 +706,62 @@ static Pkt *authenticate_pkt(const tal_t *ctx,
 	return pkt_wrap(ctx, auth, PKT__PKT_AUTH);
 }
 
-static struct io_plan *keys_exchanged(struct io_conn *conn,
-				      struct key_negotiate *neg)
+static struct io_plan *keys_derived(struct io_conn *conn,
+				    struct key_negotiate *neg)
 {
-	u8 shared_secret[32];
-	struct pubkey sessionkey;
-	struct signature sig;
+	struct handshake_job *job = neg->job;
 	Pkt *auth;
 	size_t totlen;
 
+	if (!job->ok) {
+		log_unusual(neg->log, "Bad ECDH");
+		return io_close(conn);
+	}
+
+	/* Each side combines with their OWN session key to SENDING crypto. */
+	neg->iod = tal(neg, struct io_data);
+	neg->iod->outbuf = NULL;
+	neg->iod->arena = neg->iod->arena_spill = NULL;
+	neg->iod->arena_used = neg->iod->arena_want = 0;
+	setup_crypto(&neg->iod->in, job->shared_secret,
+		     neg->their_sessionpubkey);
+	setup_crypto(&neg->iod->out, job->shared_secret,
+		     neg->our_sessionpubkey);
+
+	auth = authenticate_pkt(neg, neg->dstate->secpctx,
+				&neg->dstate->id, &job->sig);
+
+	neg->iod->out.cpkt = encrypt_pkt(neg->iod, auth, &totlen);
+	return io_write(conn, neg->iod->out.cpkt, totlen, receive_proof, neg);
+}
+
+static struct io_plan *keys_exchanged(struct io_conn *conn,
+				      struct key_negotiate *neg)
+{
+	struct handshake_job *job = new_handshake_job(neg);
+
 	if (!pubkey_from_der(neg->dstate->secpctx,
 			     neg->their_sessionpubkey,
 			     sizeof(neg->their_sessionpubkey),
-			     &sessionkey)) {
+			     &job->sessionkey)) {
 		log_unusual_blob(neg->log,  "Bad sessionkey %s",
 				 neg->their_sessionpubkey,
 				 sizeof(neg->their_sessionpubkey));
+		tal_free(job);
 		return io_close(conn);
 	}
 
-	/* Derive shared secret. */
-	if (!secp256k1_ecdh(neg->dstate->secpctx, shared_secret,
-			    &sessionkey.pubkey, neg->seckey)) {
-		log_unusual(neg->log, "Bad ECDH");
-		return io_close(conn);
-	}
-
-	/* Each side combines with their OWN session key to SENDING crypto. */
-	neg->iod = tal(neg, struct io_data);
-	setup_crypto(&neg->iod->in, shared_secret, neg->their_sessionpubkey);
-	setup_crypto(&neg->iod->out, shared_secret, neg->our_sessionpubkey);
-
-	/* BOLT #1:
+	/* Derive shared secret, and BOLT #1:
 	 *
 	 * `session_sig` is the signature of the SHA256 of SHA256 of the its
 	 * own sessionpubkey, using the secret key corresponding to the
 	 * sender's `node_id`.
 	 */
-	privkey_sign(neg->dstate, neg->their_sessionpubkey,
-		     sizeof(neg->their_sessionpubkey), &sig);
-
-	auth = authenticate_pkt(neg, neg->dstate->secpctx,
-				&neg->dstate->id, &sig);
-
-	neg->iod->out.cpkt = encrypt_pkt(neg->iod, auth, &totlen);
-	return io_write(conn, neg->iod->out.cpkt, totlen, receive_proof, neg);
+	memcpy(job->seckey, neg->seckey, sizeof(job->seckey));
+	memcpy(job->their_sessionpubkey, neg->their_sessionpubkey,
+	       sizeof(job->their_sessionpubkey));
+	job_submit(neg->dstate, NULL, exchange_work, handshake_job_done, job);
+	return io_wait(conn, neg, keys_derived, neg);
 }
 
 /* Read and ignore any extra bytes... */
@@ -588,11 +823,86 @@ static struct io_plan *session_key_len_receive(struct io_conn *conn,
 
 static void gen_sessionkey(secp256k1_context *ctx,
 			   u8 seckey[32],
-			   secp256k1_pubkey *pubkey)
+			   u8 pubkey[33])
 {
+	secp256k1_pubkey sessionkey;
+	size_t outputlen = 33;
+
 	do {
 		randombytes_buf(seckey, 32);
-	} while (!secp256k1_ec_pubkey_create(ctx, pubkey, seckey));
+	} while (!secp256k1_ec_pubkey_create(ctx, &sessionkey, seckey));
+
+	secp256k1_ec_pubkey_serialize(ctx, pubkey, &outputlen, &sessionkey,
+				      SECP256K1_EC_COMPRESSED);
+	assert(outputlen == 33);
+}
+
+/* A burst of (re)connections shouldn't all wait for key generation: we
+ * keep some ready, and top them up a few at a time between other work. */
+#define SESSIONKEY_POOL_SIZE 32
+#define SESSIONKEY_REFILL_BATCH 4
+
+struct sessionkey_pool {
+	size_t num;
+	bool refilling;
+	struct {
+		u8 seckey[32];
+		u8 pubkey[33];
+	} keys[SESSIONKEY_POOL_SIZE];
+};
+
+static void refill_sessionkeys(struct lightningd_state *dstate)
+{
+	struct sessionkey_pool *pool = dstate->sessionkeys;
+	size_t i;
+
+	for (i = 0; i < SESSIONKEY_REFILL_BATCH; i++) {
+		if (pool->num == SESSIONKEY_POOL_SIZE) {
+			pool->refilling = false;
+			return;
+		}
+		gen_sessionkey(dstate->secpctx, pool->keys[pool->num].seckey,
+			       pool->keys[pool->num].pubkey);
+		pool->num++;
+	}
+	new_reltimer(dstate, pool, time_from_sec(0), refill_sessionkeys, dstate);
+}
+
+void sessionkeys_init(struct lightningd_state *dstate)
+{
+	struct sessionkey_pool *pool = tal(dstate, struct sessionkey_pool);
+
+	pool->num = 0;
+	while (pool->num < SESSIONKEY_POOL_SIZE) {
+		gen_sessionkey(dstate->secpctx, pool->keys[pool->num].seckey,
+			       pool->keys[pool->num].pubkey);
+		pool->num++;
+	}
+	pool->refilling = false;
+	dstate->sessionkeys = pool;
+}
+
+static void get_sessionkey(struct lightningd_state *dstate,
+			   u8 seckey[32], u8 pubkey[33])
+{
+	struct sessionkey_pool *pool = dstate->sessionkeys;
+
+	if (!pool->num) {
+		gen_sessionkey(dstate->secpctx, seckey, pubkey);
+		return;
+	}
+
+	pool->num--;
+	memcpy(seckey, pool->keys[pool->num].seckey, 32);
+	memcpy(pubkey, pool->keys[pool->num].pubkey, 33);
+	/* Only one connection gets to use it. */
+	memset(pool->keys[pool->num].seckey, 0, 32);
+
+	if (!pool->refilling) {
+		pool->refilling = true;
+		new_reltimer(dstate, pool, time_from_sec(0),
+			     refill_sessionkeys, dstate);
+	}
 }
 
 static struct io_plan *write_sessionkey(struct io_conn *conn,
@@ -615,8 +925,6 @@ struct io_plan *peer_crypto_setup_(struct io_conn *conn,
 						 void *arg),
 				   void *arg)
 {
-	size_t outputlen;
-	secp256k1_pubkey sessionkey;
 	struct key_negotiate *neg;
 
 	/* BOLT #1:
@@ -633,15 +941,10 @@ struct io_plan *peer_crypto_setup_(struct io_conn *conn,
 	neg->dstate = dstate;
 	neg->expected_id = id;
 	neg->log = log;
+	neg->job = NULL;
 
-	gen_sessionkey(dstate->secpctx, neg->seckey, &sessionkey);
-
-	outputlen = sizeof(neg->our_sessionpubkey);
-	secp256k1_ec_pubkey_serialize(dstate->secpctx,
-				      neg->our_sessionpubkey, &outputlen,
-				      &sessionkey,
-				      SECP256K1_EC_COMPRESSED);
-	assert(outputlen == sizeof(neg->our_sessionpubkey));
+	BUILD_ASSERT(sizeof(neg->our_sessionpubkey) == 33);
+	get_sessionkey(dstate, neg->seckey, neg->our_sessionpubkey);
 	neg->keylen = cpu_to_le32(sizeof(neg->our_sessionpubkey));
 	return io_write(conn, &neg->keylen, sizeof(neg->keylen),
 			write_sessionkey, neg);
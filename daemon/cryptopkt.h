@@ -10,6 +10,10 @@ struct json_connecting;
 struct lightningd_state;
 struct log;
 struct peer;
+struct pubkey;
+
+/* Generate session keys ahead of time, so handshakes don't wait for them. */
+void sessionkeys_init(struct lightningd_state *dstate);
 
 struct io_plan *peer_crypto_setup_(struct io_conn *conn,
 				   struct lightningd_state *dstate,
@@ -40,9 +44,22 @@ struct io_plan *peer_read_packet(struct io_conn *conn,
 				 struct io_plan *(*cb)(struct io_conn *,
 						       struct peer *));
 
+/* Done with peer->inpkt: frees it. */
+void peer_release_packet(struct peer *peer);
+
 struct io_plan *peer_write_packet(struct io_conn *conn,
 				  struct peer *peer,
 				  const Pkt *pkt,
 				  struct io_plan *(*next)(struct io_conn *,
 							  struct peer *));
+
+/* Encrypts them all into a single write, through a buffer we reuse.
+ * @lens are their packed sizes, if already known (otherwise NULL). */
+#define PEER_WRITE_MAX_PKTS 16
+struct io_plan *peer_write_packets(struct io_conn *conn,
+				   struct peer *peer,
+				   const Pkt **pkts, const size_t *lens,
+				   size_t num,
+				   struct io_plan *(*next)(struct io_conn *,
+							   struct peer *));
 #endif /* LIGHTNING_DAEMON_CRYPTOPKT_H */
@@ -4,6 +4,8 @@
 #include "feechange.h"
 #include "htlc.h"
 #include "invoice.h"
+#include "json.h"
+#include "jsonrpc.h"
 #include "lightningd.h"
 #include "log.h"
 #include "names.h"
@@ -11,32 +13,135 @@
 #include "pay.h"
 #include "routing.h"
 #include "secrets.h"
+#include "stats.h"
+#include "timeout.h"
+#include "trace.h"
 #include "utils.h"
 #include "wallet.h"
 #include <ccan/array_size/array_size.h>
 #include <ccan/cast/cast.h>
 #include <ccan/cppmagic/cppmagic.h>
+#include <ccan/crypto/sha256/sha256.h>
+#include <ccan/io/io.h>
+#include <ccan/list/list.h>
 #include <ccan/mem/mem.h>
 #include <ccan/str/hex/hex.h>
+#include <ccan/str/str.h>
+#include <ccan/strmap/strmap.h>
 #include <ccan/tal/str/str.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <sqlite3.h>
 #include <stdarg.h>
+#include <stdio.h>
 #include <unistd.h>
 
 #define DB_FILE "lightning.sqlite3"
 
+/* How often, when idle, we give back some of its free pages. */
+#define DB_VACUUM_SECS 60
+/* What PRAGMA auto_vacuum says for INCREMENTAL. */
+#define DB_AUTO_VACUUM_INCREMENTAL 2
+
 /* They don't use stdint types. */
 #define PRIuSQLITE64 "llu"
 
+/* A parameter noted for the writer thread. */
+struct db_arg {
+	/* SQLITE_INTEGER, SQLITE_BLOB, SQLITE_TEXT or SQLITE_NULL. */
+	int type;
+	s64 v;
+	/* Our own copy, for BLOB and TEXT. */
+	const void *p;
+	size_t len;
+};
+
+/* What db_prepare() hands out: a statement to run now, or a write to note
+ * for the writer thread. */
+struct db_op {
+	/* A literal. */
+	const char *query;
+	/* If we're running it now. */
+	sqlite3_stmt *stmt;
+	/* Otherwise, what to bind to it (tal array). */
+	struct db_arg *args;
+};
+
+/* With config.db_async, all the writes from one pass of the loop. */
+struct db_batch {
+	struct list_node list;
+	/* BEGIN IMMEDIATE, ..., COMMIT (tal array). */
+	struct db_op **ops;
+	/* When it went to the writer, for stats. */
+	struct timeabs queued;
+};
+
 struct db {
 	bool in_transaction;
 	const char *err;
 	sqlite3 *sql;
+	/* Prepared statements, by query: only touched by whoever owns sql. */
+	STRMAP(sqlite3_stmt *) stmts;
+	/* Group commit: peer transactions are savepoints inside this one. */
+	bool in_group;
+	/* db_hold_commits() has the group open. */
+	bool held;
+	/* Batches (groups) started, and how many are on disk. */
+	u64 batches, batches_done;
+	/* The backup command, if one is running. */
+	struct db_backup *backup;
+	/* With config.db_replicate, where changes go. */
+	struct db_repl *repl;
+	/* Reused for statements we run straight away. */
+	struct db_op now;
+	/* Whose transaction we're in (if in_transaction), to charge them. */
+	struct peer *txn_peer;
+	/* Free pages incremental vacuum has released. */
+	u64 vacuumed;
+
+	/* With config.db_async: batch we're adding to (or NULL), and where
+	 * this peer transaction started in it. */
+	struct db_batch *open;
+	size_t txn_start;
+	/* The writer thread, and what it pokes to say it's finished some. */
+	bool have_writer;
+	pthread_t writer;
+	int writer_fds[2];
+	char wakeup_buf[64];
+	size_t wakeup_len;
+
+	/* The rest is shared with the writer thread, under lock.  While
+	 * it's writing, it owns sql and stmts. */
+	pthread_mutex_t lock;
+	pthread_cond_t work, idle;
+	struct list_head queue, finished;
+	bool writing, stop;
+	u64 written;
+	bool writer_failed;
+	char writer_err[512];
 };
 
+static bool finalize_stmt(const char *query, sqlite3_stmt *stmt, void *unused)
+{
+	sqlite3_finalize(stmt);
+	return true;
+}
+
 static void close_db(struct db *db)
 {
+	tal_free(db->backup);
+	if (db->have_writer) {
+		pthread_mutex_lock(&db->lock);
+		db->stop = true;
+		pthread_cond_signal(&db->work);
+		pthread_mutex_unlock(&db->lock);
+		pthread_join(db->writer, NULL);
+		close(db->writer_fds[1]);
+	}
+	strmap_iterate(&db->stmts, finalize_stmt, NULL);
+	strmap_clear(&db->stmts);
 	sqlite3_close(db->sql);
 }
 
@@ -62,23 +167,67 @@ static const char *sqlite3_column_str(sqlite3_stmt *stmt, int iCol)
 #define SQL_STATENAME(var)	stringify(var)" VARCHAR(44)"
 #define SQL_INVLABEL(var)	stringify(var)" VARCHAR("stringify(INVOICE_MAX_LABEL_LEN)")"
 
-/* 8 + 4 + (8 + 32) * (64 + 1) */
+/* Old shachain table's blob: 8 + 4 + (8 + 32) * (64 + 1) */
 #define SHACHAIN_SIZE	2612
-#define SQL_SHACHAIN(var)	stringify(var)" CHAR("stringify(SHACHAIN_SIZE)")"
 
-/* FIXME: Should be fixed size. */
-#define SQL_ROUTING(var)	stringify(var)" BLOB"
+/* The onion itself is in blobs. */
+#define SQL_ROUTING(var)	SQL_SHA256(var)
 #define SQL_FAIL(var)		stringify(var)" BLOB"
 
 #define TABLE(tablename, ...)					\
 	"CREATE TABLE " #tablename " (" CPPMAGIC_JOIN(", ", __VA_ARGS__) ");"
 
-static const char *sql_bool(bool b)
-{
-	/* SQL2003 says TRUE and FALSE are binary literal keywords.
-	 * sqlite3 barfs. */
-	return (b) ? "1" : "0";
-}
+/* For tables added since: the migration is just to create them. */
+#define TABLE_IF_NEW(tablename, ...)					\
+	"CREATE TABLE IF NOT EXISTS " #tablename			\
+	" (" CPPMAGIC_JOIN(", ", __VA_ARGS__) ");"
+
+/* Outputs to our wallet addresses (p2sh is which one). */
+#define WALLET_UTXO_COLUMNS						\
+	SQL_TXID(txid), SQL_U32(idx), SQL_U64(amount), SQL_BLOB(p2sh),	\
+	"PRIMARY KEY(txid, idx)"
+
+/* Each part of a multi-path payment still in flight: its pay row only
+ * says the payment is. */
+#define PAY_PART_COLUMNS						\
+	SQL_RHASH(rhash), SQL_PUBKEY(htlc_peer), SQL_U64(htlc_id),	\
+	SQL_BLOB(ids), "PRIMARY KEY(htlc_peer, htlc_id)"
+
+/* Old paid invoices move to invoice_archive, which we don't load. */
+#define INVOICE_COLUMNS							\
+	SQL_R(r), SQL_U64(msatoshi), SQL_INVLABEL(label),		\
+	SQL_U64(paid_num), SQL_U64(expiry),				\
+	"PRIMARY KEY(label)"
+
+/* Live HTLCs are in htlcs; once dead they move to htlcs_archive, and their
+ * effect on the balance is folded into htlc_totals.
+ * FIXME: state in key is overkill: just need side */
+#define HTLC_COLUMNS							\
+	SQL_PUBKEY(peer), SQL_U64(id),					\
+	SQL_U32(state), SQL_U64(msatoshi),				\
+	SQL_U32(expiry), SQL_RHASH(rhash), SQL_R(r),			\
+	SQL_ROUTING(routing), SQL_PUBKEY(src_peer),			\
+	SQL_U64(src_id), SQL_BLOB(fail),				\
+	"PRIMARY KEY(peer, id, state)"
+
+#define HTLC_ARCHIVE_TABLES						\
+	TABLE(htlcs_archive, HTLC_COLUMNS)				\
+	TABLE(htlc_totals,						\
+	      SQL_PUBKEY(peer), SQL_U64(local_fulfilled),		\
+	      SQL_U64(remote_fulfilled), SQL_U64(next_id),		\
+	      "PRIMARY KEY(peer)")					\
+	"CREATE INDEX htlcs_peer_state ON htlcs(peer, state);"		\
+	"CREATE INDEX htlcs_src ON htlcs(src_peer, src_id);"
+
+/* Big things (so far, just HTLC onions) by their sha256: htlcs rows stay
+ * small, and we only read one back when something needs it.  It goes once
+ * no live HTLC refers to it, so archived rows keep only the hash. */
+#define BLOB_TABLES							\
+	TABLE(blobs, SQL_SHA256(hash), SQL_BLOB(data), "PRIMARY KEY(hash)") \
+	"CREATE INDEX htlcs_routing ON htlcs(routing);"			\
+	"CREATE TRIGGER blobs_unused AFTER DELETE ON htlcs"		\
+	" WHEN NOT EXISTS (SELECT 1 FROM htlcs WHERE routing=OLD.routing)" \
+	" BEGIN DELETE FROM blobs WHERE hash=OLD.routing; END;"
 
 static bool PRINTF_FMT(3,4)
 	db_exec(const char *caller,
@@ -110,19 +259,535 @@ static bool PRINTF_FMT(3,4)
 	return true;
 }
 
-static char *sql_hex_or_null(const tal_t *ctx, const void *buf, size_t len)
+static void db_error(const char *caller, struct lightningd_state *dstate,
+		     int err, const char *query)
+{
+	tal_free(dstate->db->err);
+	dstate->db->err = tal_fmt(dstate->db, "%s:%s:%s:%s",
+				  caller, sqlite3_errstr(err), query,
+				  sqlite3_errmsg(dstate->db->sql));
+	log_broken(dstate->base_log, "%s", dstate->db->err);
+}
+
+/* The cached statement for @query (a literal), parsed the first time. */
+static int get_stmt(struct db *db, const char *query, sqlite3_stmt **stmt)
+{
+	int err;
+
+	*stmt = strmap_get(&db->stmts, query);
+	if (*stmt)
+		return SQLITE_OK;
+
+	err = sqlite3_prepare_v2(db->sql, query, -1, stmt, NULL);
+	if (err == SQLITE_OK)
+		strmap_add(&db->stmts, query, *stmt);
+	return err;
+}
+
+static bool writer_busy(struct db *db)
+{
+	bool busy;
+
+	if (!db->have_writer)
+		return false;
+
+	pthread_mutex_lock(&db->lock);
+	busy = db->writing || !list_empty(&db->queue);
+	pthread_mutex_unlock(&db->lock);
+	return busy;
+}
+
+/* Until the writer's finished what's queued, and handed back sql and
+ * stmts: only we queue more, so it's ours until we do. */
+static void wait_for_writer(struct db *db)
+{
+	if (!db->have_writer)
+		return;
+
+	pthread_mutex_lock(&db->lock);
+	while (db->writing || !list_empty(&db->queue))
+		pthread_cond_wait(&db->idle, &db->lock);
+	pthread_mutex_unlock(&db->lock);
+}
+
+static void open_batch(struct lightningd_state *dstate);
+
+/* Each record is the changes from one iteration of the loop: length of
+ * the rest (le32), sequence number (le64), number of statements (le32),
+ * then each statement as query and arguments (see push_op). */
+struct db_repl {
+	int fd;
+	/* From 0 each time we start. */
+	u64 seq;
+	/* Statements for the next record. */
+	u8 *pending;
+	u32 num_pending;
+	/* Where the current peer transaction started in pending. */
+	size_t txn_start;
+	u32 txn_start_num;
+	/* There's a replicate_flush timer. */
+	bool scheduled;
+};
+
+static void push_op(const struct db_op *op, u8 **p)
+{
+	size_t i, len = strlen(op->query);
+
+	push_le32(len, push, p);
+	push(op->query, len, p);
+	push_le32(tal_count(op->args), push, p);
+	for (i = 0; i < tal_count(op->args); i++) {
+		u8 type = op->args[i].type;
+
+		push(&type, sizeof(type), p);
+		switch (type) {
+		case SQLITE_INTEGER:
+			push_le64(op->args[i].v, push, p);
+			break;
+		case SQLITE_BLOB:
+		case SQLITE_TEXT:
+			push_le32(op->args[i].len, push, p);
+			push(op->args[i].p, op->args[i].len, p);
+			break;
+		}
+	}
+}
+
+/* The standby does its own transactions: one per record. */
+static bool is_txn_control(const char *query)
+{
+	return strstarts(query, "BEGIN") || strstarts(query, "COMMIT")
+		|| strstarts(query, "SAVEPOINT") || strstarts(query, "RELEASE")
+		|| strstarts(query, "ROLLBACK");
+}
+
+static void replicate_flush(struct lightningd_state *dstate)
+{
+	struct db_repl *repl = dstate->db->repl;
+	u8 *rec = tal_arr(repl, u8, 0);
+	size_t off = 0;
+
+	repl->scheduled = false;
+	if (!repl->num_pending)
+		return;
+
+	push_le32(sizeof(u64) + sizeof(u32) + tal_count(repl->pending),
+		  push, &rec);
+	push_le64(repl->seq++, push, &rec);
+	push_le32(repl->num_pending, push, &rec);
+	push(repl->pending, tal_count(repl->pending), &rec);
+	tal_resize(&repl->pending, 0);
+	repl->num_pending = 0;
+
+	/* A blocking write: if the standby falls behind, so do we, rather
+	 * than buffering without limit. */
+	while (off < tal_count(rec)) {
+		ssize_t r = write(repl->fd, rec + off, tal_count(rec) - off);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0) {
+			log_broken(dstate->base_log,
+				   "Replication to %s failed: %s: stopping",
+				   dstate->config.db_replicate,
+				   strerror(errno));
+			dstate->db->repl = tal_free(repl);
+			return;
+		}
+		off += r;
+	}
+	tal_free(rec);
+}
+
+static void replicate_op(struct lightningd_state *dstate,
+			 const struct db_op *op)
+{
+	struct db_repl *repl = dstate->db->repl;
+
+	if (!repl || is_txn_control(op->query))
+		return;
+
+	push_op(op, &repl->pending);
+	repl->num_pending++;
+	if (!repl->scheduled) {
+		repl->scheduled = true;
+		new_reltimer(dstate, repl, time_from_sec(0),
+			     replicate_flush, dstate);
+	}
+}
+
+static void destroy_repl(struct db_repl *repl)
+{
+	close(repl->fd);
+}
+
+static void start_replication(struct lightningd_state *dstate)
+{
+	struct db_repl *repl = tal(dstate->db, struct db_repl);
+
+	repl->fd = open(dstate->config.db_replicate,
+			O_WRONLY | O_APPEND | O_CREAT, 0600);
+	if (repl->fd < 0)
+		fatal("Opening %s: %s", dstate->config.db_replicate,
+		      strerror(errno));
+	tal_add_destructor(repl, destroy_repl);
+	repl->seq = 0;
+	repl->pending = tal_arr(repl, u8, 0);
+	repl->num_pending = 0;
+	repl->txn_start = 0;
+	repl->txn_start_num = 0;
+	repl->scheduled = false;
+	dstate->db->repl = repl;
+}
+
+/* @query (a literal), ready for binding.  NULL on error; the db_bind_
+ * functions and db_step then do nothing.  With config.db_async, anything
+ * which can't run now goes into this loop's batch for the writer. */
+static struct db_op *db_prepare(const char *caller,
+				struct lightningd_state *dstate,
+				const char *query)
+{
+	struct db *db = dstate->db;
+	struct db_op *op;
+	size_t n;
+	int err;
+
+	if (db->in_transaction && db->err)
+		return NULL;
+
+	if (db->in_transaction)
+		db->txn_peer->usage.db_statements++;
+
+	if (dstate->config.db_async
+	    && (db->in_transaction || db->open || writer_busy(db))) {
+		if (!db->open)
+			open_batch(dstate);
+		op = tal(db->open, struct db_op);
+		op->query = query;
+		op->stmt = NULL;
+		op->args = tal_arr(op, struct db_arg, 0);
+		n = tal_count(db->open->ops);
+		tal_resize(&db->open->ops, n + 1);
+		db->open->ops[n] = op;
+		return op;
+	}
+
+	/* To replicate it, we need its arguments after it's run. */
+	if (db->repl) {
+		op = tal(db->repl, struct db_op);
+		op->args = tal_arr(op, struct db_arg, 0);
+	} else
+		op = &db->now;
+	op->query = query;
+	err = get_stmt(db, query, &op->stmt);
+	if (err != SQLITE_OK) {
+		if (op != &db->now)
+			tal_free(op);
+		db_error(caller, dstate, err, query);
+		return NULL;
+	}
+	return op;
+}
+
+/* Runs it and resets it for next time (or just leaves it in the batch). */
+static bool db_step(const char *caller, struct lightningd_state *dstate,
+		    struct db_op *op)
+{
+	int err;
+
+	if (!op)
+		return false;
+	if (!op->stmt)
+		return true;
+
+	err = sqlite3_step(op->stmt);
+	sqlite3_reset(op->stmt);
+	sqlite3_clear_bindings(op->stmt);
+	if (err != SQLITE_DONE) {
+		const char *query = op->query;
+		if (op != &dstate->db->now)
+			tal_free(op);
+		db_error(caller, dstate, err, query);
+		return false;
+	}
+	if (op != &dstate->db->now) {
+		replicate_op(dstate, op);
+		tal_free(op);
+	}
+	return true;
+}
+
+static struct db_arg *db_arg(struct db_op *op, int idx)
+{
+	size_t n = tal_count(op->args);
+
+	if (idx > n) {
+		tal_resize(&op->args, idx);
+		while (n < idx)
+			op->args[n++].type = SQLITE_NULL;
+	}
+	return &op->args[idx - 1];
+}
+
+/* NULL binds as NULL.  Parameters are numbered from 1. */
+static void db_bind_blob_(struct db_op *op, int idx,
+			  const void *p, size_t len,
+			  sqlite3_destructor_type destructor)
+{
+	struct db_arg *arg;
+
+	if (!op)
+		return;
+	if (op->stmt) {
+		if (!p)
+			sqlite3_bind_null(op->stmt, idx);
+		else
+			sqlite3_bind_blob(op->stmt, idx, p, len, destructor);
+		/* Unless we're keeping them to replicate. */
+		if (!op->args)
+			return;
+	}
+
+	arg = db_arg(op, idx);
+	if (p) {
+		arg->type = SQLITE_BLOB;
+		arg->p = tal_dup_arr(op, u8, p, len, 0);
+		arg->len = len;
+	}
+}
+
+static void db_bind_blob(struct db_op *op, int idx,
+			 const void *p, size_t len)
+{
+	db_bind_blob_(op, idx, p, len, SQLITE_TRANSIENT);
+}
+
+/* For large blobs which outlive the db_step(): sqlite reads them in place
+ * (the bindings are cleared once stepped). */
+static void db_bind_blob_static(struct db_op *op, int idx,
+				const void *p, size_t len)
+{
+	db_bind_blob_(op, idx, p, len, SQLITE_STATIC);
+}
+
+static void db_bind_int(struct db_op *op, int idx, s64 v)
+{
+	struct db_arg *arg;
+
+	if (!op)
+		return;
+	if (op->stmt) {
+		sqlite3_bind_int64(op->stmt, idx, v);
+		if (!op->args)
+			return;
+	}
+
+	arg = db_arg(op, idx);
+	arg->type = SQLITE_INTEGER;
+	arg->v = v;
+}
+
+static void db_bind_str(struct db_op *op, int idx, const char *str)
+{
+	struct db_arg *arg;
+
+	if (!op)
+		return;
+	if (op->stmt) {
+		sqlite3_bind_text(op->stmt, idx, str, -1, SQLITE_TRANSIENT);
+		if (!op->args)
+			return;
+	}
+
+	arg = db_arg(op, idx);
+	arg->type = SQLITE_TEXT;
+	arg->p = tal_strdup(op, str);
+	arg->len = strlen(str);
+}
+
+static void db_bind_pubkey(struct lightningd_state *dstate,
+			   struct db_op *op, int idx,
+			   const struct pubkey *pk)
+{
+	u8 der[PUBKEY_DER_LEN];
+
+	pubkey_to_der(dstate->secpctx, der, pk);
+	db_bind_blob(op, idx, der, sizeof(der));
+}
+
+static void db_bind_sig(struct lightningd_state *dstate,
+			struct db_op *op, int idx,
+			const struct bitcoin_signature *sig)
+{
+	u8 compact[64];
+
+	if (!sig) {
+		db_bind_blob(op, idx, NULL, 0);
+		return;
+	}
+
+	assert(sig->stype == SIGHASH_ALL);
+	secp256k1_ecdsa_signature_serialize_compact(dstate->secpctx, compact,
+						    &sig->sig.sig);
+	db_bind_blob(op, idx, compact, sizeof(compact));
+}
+
+/* In the writer thread: false (and writer_err set) on failure. */
+static bool write_batch(struct db *db, const struct db_batch *b)
+{
+	size_t i;
+	int j, err;
+
+	for (i = 0; i < tal_count(b->ops); i++) {
+		const struct db_op *op = b->ops[i];
+		sqlite3_stmt *stmt;
+
+		err = get_stmt(db, op->query, &stmt);
+		if (err != SQLITE_OK)
+			goto fail;
+
+		for (j = 0; j < tal_count(op->args); j++) {
+			const struct db_arg *arg = &op->args[j];
+			switch (arg->type) {
+			case SQLITE_INTEGER:
+				sqlite3_bind_int64(stmt, j+1, arg->v);
+				break;
+			case SQLITE_BLOB:
+				sqlite3_bind_blob(stmt, j+1, arg->p, arg->len,
+						  SQLITE_STATIC);
+				break;
+			case SQLITE_TEXT:
+				sqlite3_bind_text(stmt, j+1, arg->p, arg->len,
+						  SQLITE_STATIC);
+				break;
+			default:
+				sqlite3_bind_null(stmt, j+1);
+			}
+		}
+		err = sqlite3_step(stmt);
+		sqlite3_reset(stmt);
+		sqlite3_clear_bindings(stmt);
+		if (err != SQLITE_DONE)
+			goto fail;
+	}
+	return true;
+
+fail:
+	/* sqlite3_errmsg is per-connection, and we own it for now. */
+	snprintf(db->writer_err, sizeof(db->writer_err), "%s:%s:%s",
+		 sqlite3_errstr(err), b->ops[i]->query,
+		 sqlite3_errmsg(db->sql));
+	return false;
+}
+
+static void *db_writer(struct db *db)
+{
+	bool failed, ok;
+
+	pthread_mutex_lock(&db->lock);
+	for (;;) {
+		struct db_batch *b = list_pop(&db->queue, struct db_batch, list);
+
+		if (!b) {
+			if (db->stop)
+				break;
+			pthread_cond_wait(&db->work, &db->lock);
+			continue;
+		}
+
+		db->writing = true;
+		failed = db->writer_failed;
+		pthread_mutex_unlock(&db->lock);
+		/* After one fails, we're only waiting for main to notice. */
+		ok = !failed && write_batch(db, b);
+		pthread_mutex_lock(&db->lock);
+		if (!ok)
+			db->writer_failed = true;
+		db->writing = false;
+		db->written++;
+		list_add_tail(&db->finished, &b->list);
+		pthread_cond_broadcast(&db->idle);
+
+		/* Main loop will read how many when it gets to it. */
+		if (write(db->writer_fds[1], "", 1) != 1 && errno != EAGAIN)
+			db->writer_failed = true;
+	}
+	pthread_mutex_unlock(&db->lock);
+	return NULL;
+}
+
+/* Free the batches it's done, and let out packets waiting for them. */
+static void reap_batches(struct lightningd_state *dstate)
+{
+	struct db *db = dstate->db;
+	struct db_batch *b;
+	struct list_head done;
+	u64 written;
+	bool failed;
+
+	list_head_init(&done);
+	pthread_mutex_lock(&db->lock);
+	list_append_list(&done, &db->finished);
+	written = db->written;
+	failed = db->writer_failed;
+	pthread_mutex_unlock(&db->lock);
+
+	/* We may have acted on later ones (though not sent anything which
+	 * relies on them): the database from before is our best bet. */
+	if (failed)
+		fatal("db writer: %s", db->writer_err);
+
+	while ((b = list_pop(&done, struct db_batch, list)) != NULL) {
+		stats_latency(dstate, STATS_DB_COMMIT, b->queued);
+		tal_free(b);
+	}
+
+	if (written != db->batches_done) {
+		db->batches_done = written;
+		io_wake(db);
+	}
+}
+
+static struct io_plan *writer_wakeup(struct io_conn *conn,
+				     struct lightningd_state *dstate)
 {
-	char *r;
+	struct db *db = dstate->db;
 
-	if (!buf)
-		return "NULL";
-	r = tal_arr(ctx, char, 3 + hex_str_size(len));
-	r[0] = 'x';
-	r[1] = '\'';
-	hex_encode(buf, len, r+2, hex_str_size(len));
-	r[2+hex_str_size(len)-1] = '\'';
-	r[2+hex_str_size(len)] = '\0';
-	return r;
+	reap_batches(dstate);
+	return io_read_partial(conn, db->wakeup_buf, sizeof(db->wakeup_buf),
+			       &db->wakeup_len, writer_wakeup, dstate);
+}
+
+static void start_writer(struct lightningd_state *dstate)
+{
+	struct db *db = dstate->db;
+
+	pthread_mutex_init(&db->lock, NULL);
+	pthread_cond_init(&db->work, NULL);
+	pthread_cond_init(&db->idle, NULL);
+	list_head_init(&db->queue);
+	list_head_init(&db->finished);
+	db->writing = db->stop = db->writer_failed = false;
+	db->written = 0;
+
+	if (pipe(db->writer_fds) != 0)
+		fatal("db writer pipe: %s", strerror(errno));
+	/* If it fills up, main loop has plenty to read already. */
+	fcntl(db->writer_fds[1], F_SETFL,
+	      fcntl(db->writer_fds[1], F_GETFL) | O_NONBLOCK);
+	io_new_conn(dstate, db->writer_fds[0], writer_wakeup, dstate);
+
+	if (pthread_create(&db->writer, NULL,
+			   (void *(*)(void *))db_writer, db) != 0)
+		fatal("db writer thread: %s", strerror(errno));
+	db->have_writer = true;
+}
+
+/* For writes which must be on disk when we return. */
+static void db_outside_transaction(struct lightningd_state *dstate)
+{
+	assert(!dstate->db->in_transaction);
+	if (!dstate->db->held)
+		db_commit_group(dstate);
 }
 
 static void from_sql_blob(sqlite3_stmt *stmt, int idx, void *p, size_t n)
@@ -172,21 +837,6 @@ static void sig_from_sql(secp256k1_context *secpctx,
 	sig->stype = SIGHASH_ALL;
 }
 
-static char *sig_to_sql(const tal_t *ctx,
-			secp256k1_context *secpctx,
-			const struct bitcoin_signature *sig)
-{
-	u8 compact[64];
-
-	if (!sig)
-		return sql_hex_or_null(ctx, NULL, 0);
-
-	assert(sig->stype == SIGHASH_ALL);
-	secp256k1_ecdsa_signature_serialize_compact(secpctx, compact,
-						    &sig->sig.sig);
-	return sql_hex_or_null(ctx, compact, sizeof(compact));
-}
-
 static void db_load_wallet(struct lightningd_state *dstate)
 {
 	int err;
@@ -219,245 +869,185 @@ static void db_load_wallet(struct lightningd_state *dstate)
 		      sqlite3_errmsg(dstate->db->sql));
 }
 
-void db_add_wallet_privkey(struct lightningd_state *dstate,
-			   const struct privkey *privkey)
-{
-	char *ctx = tal(dstate, char);
-
-	log_debug(dstate->base_log, "%s", __func__);
-	if (!db_exec(__func__, dstate,
-		      "INSERT INTO wallet VALUES (x'%s');",
-		     tal_hexstr(ctx, privkey, sizeof(*privkey))))
-		fatal("db_add_wallet_privkey failed");
-}
-
-static void load_peer_secrets(struct peer *peer)
+static void db_load_wallet_utxos(struct lightningd_state *dstate)
 {
 	int err;
 	sqlite3_stmt *stmt;
-	sqlite3 *sql = peer->dstate->db->sql;
-	char *ctx = tal(peer, char);
-	const char *select;
-	bool secrets_set = false;
 
-	select = tal_fmt(ctx,
-			 "SELECT * FROM peer_secrets WHERE peer = x'%s';",
-			 pubkey_to_hexstr(ctx, peer->dstate->secpctx, peer->id));
+	err = sqlite3_prepare_v2(dstate->db->sql,
+				 "SELECT * FROM wallet_utxos;", -1,
+				 &stmt, NULL);
 
-	err = sqlite3_prepare_v2(sql, select, -1, &stmt, NULL);
 	if (err != SQLITE_OK)
-		fatal("load_peer_secrets:prepare gave %s:%s",
-		      sqlite3_errstr(err), sqlite3_errmsg(sql));
+		fatal("db_load_wallet_utxos:prepare gave %s:%s",
+		      sqlite3_errstr(err), sqlite3_errmsg(dstate->db->sql));
 
 	while ((err = sqlite3_step(stmt)) != SQLITE_DONE) {
+		struct txwatch_output out;
+		struct ripemd160 p2sh;
+
 		if (err != SQLITE_ROW)
-			fatal("load_peer_secrets:step gave %s:%s",
-			      sqlite3_errstr(err), sqlite3_errmsg(sql));
-		if (secrets_set)
-			fatal("load_peer_secrets: two secrets for '%s'",
-			      select);
-		peer_set_secrets_from_db(peer,
-					 sqlite3_column_blob(stmt, 1),
-					 sqlite3_column_bytes(stmt, 1),
-					 sqlite3_column_blob(stmt, 2),
-					 sqlite3_column_bytes(stmt, 2),
-					 sqlite3_column_blob(stmt, 3),
-					 sqlite3_column_bytes(stmt, 3));
-		secrets_set = true;
-	}
-
-	if (!secrets_set)
-		fatal("load_peer_secrets: no secrets for '%s'", select);
-	tal_free(ctx);
+			fatal("db_load_wallet_utxos:step gave %s:%s",
+			      sqlite3_errstr(err),
+			      sqlite3_errmsg(dstate->db->sql));
+		if (sqlite3_column_count(stmt) != 4)
+			fatal("db_load_wallet_utxos:step gave %i cols, not 4",
+			      sqlite3_column_count(stmt));
+		from_sql_blob(stmt, 0, &out.txid, sizeof(out.txid));
+		out.index = sqlite3_column_int(stmt, 1);
+		from_sql_blob(stmt, 3, &p2sh, sizeof(p2sh));
+		if (!restore_wallet_utxo(dstate, &out,
+					 sqlite3_column_int64(stmt, 2), &p2sh))
+			fatal("db_load_wallet_utxos:unknown address");
+	}
+	err = sqlite3_finalize(stmt);
+	if (err != SQLITE_OK)
+		fatal("db_load_wallet_utxos:finalize gave %s:%s",
+		      sqlite3_errstr(err),
+		      sqlite3_errmsg(dstate->db->sql));
 }
 
-static void load_peer_anchor(struct peer *peer)
+void db_add_wallet_utxo(struct lightningd_state *dstate,
+			const struct wallet_utxo *utxo)
 {
-	int err;
-	sqlite3_stmt *stmt;
-	sqlite3 *sql = peer->dstate->db->sql;
-	char *ctx = tal(peer, char);
-	const char *select;
-	bool anchor_set = false;
-
-	select = tal_fmt(ctx,
-			 "SELECT * FROM anchors WHERE peer = x'%s';",
-			 pubkey_to_hexstr(ctx, peer->dstate->secpctx, peer->id));
+	struct db_op *stmt;
 
-	err = sqlite3_prepare_v2(sql, select, -1, &stmt, NULL);
-	if (err != SQLITE_OK)
-		fatal("load_peer_anchor:prepare gave %s:%s",
-		      sqlite3_errstr(err), sqlite3_errmsg(sql));
-
-	while ((err = sqlite3_step(stmt)) != SQLITE_DONE) {
-		if (err != SQLITE_ROW)
-			fatal("load_peer_anchor:step gave %s:%s",
-			      sqlite3_errstr(err), sqlite3_errmsg(sql));
-		if (anchor_set)
-			fatal("load_peer_anchor: two anchors for '%s'",
-			      select);
-		from_sql_blob(stmt, 1,
-			      &peer->anchor.txid, sizeof(peer->anchor.txid));
-		peer->anchor.index = sqlite3_column_int64(stmt, 2);
-		peer->anchor.satoshis = sqlite3_column_int64(stmt, 3);
-		peer->anchor.ours = sqlite3_column_int(stmt, 6);
-
-		/* FIXME: Do timeout! */
-		peer_watch_anchor(peer,
-				  sqlite3_column_int(stmt, 4),
-				  BITCOIN_ANCHOR_DEPTHOK, INPUT_NONE);
-		peer->anchor.min_depth = sqlite3_column_int(stmt, 5);
-		anchor_set = true;
-	}
-
-	if (!anchor_set)
-		fatal("load_peer_anchor: no anchor for '%s'", select);
-	tal_free(ctx);
+	log_debug(dstate->base_log, "%s", __func__);
+	db_outside_transaction(dstate);
+	stmt = db_prepare(__func__, dstate,
+			  "INSERT OR REPLACE INTO wallet_utxos"
+			  " VALUES (?, ?, ?, ?);");
+	db_bind_blob(stmt, 1, &utxo->out.txid, sizeof(utxo->out.txid));
+	db_bind_int(stmt, 2, utxo->out.index);
+	db_bind_int(stmt, 3, utxo->amount);
+	db_bind_blob(stmt, 4, wallet_utxo_p2sh(utxo),
+		     sizeof(struct ripemd160));
+	if (!db_step(__func__, dstate, stmt))
+		fatal("db_add_wallet_utxo failed");
 }
 
-static void load_peer_visible_state(struct peer *peer)
+void db_remove_wallet_utxo(struct lightningd_state *dstate,
+			   const struct wallet_utxo *utxo)
 {
-	int err;
-	sqlite3_stmt *stmt;
-	sqlite3 *sql = peer->dstate->db->sql;
-	char *ctx = tal(peer, char);
-	const char *select;
-	bool visible_set = false;
-
-	select = tal_fmt(ctx,
-			 "SELECT * FROM their_visible_state WHERE peer = x'%s';",
-			 pubkey_to_hexstr(ctx, peer->dstate->secpctx, peer->id));
+	struct db_op *stmt;
 
-	err = sqlite3_prepare_v2(sql, select, -1, &stmt, NULL);
-	if (err != SQLITE_OK)
-		fatal("load_peer_visible_state:prepare gave %s:%s",
-		      sqlite3_errstr(err), sqlite3_errmsg(sql));
-
-	while ((err = sqlite3_step(stmt)) != SQLITE_DONE) {
-		if (err != SQLITE_ROW)
-			fatal("load_peer_visible_state:step gave %s:%s",
-			      sqlite3_errstr(err), sqlite3_errmsg(sql));
-
-		if (sqlite3_column_count(stmt) != 8)
-			fatal("load_peer_visible_state:step gave %i cols, not 8",
-			      sqlite3_column_count(stmt));
-
-		if (visible_set)
-			fatal("load_peer_visible_state: two states for %s", select);
-		visible_set = true;
-		
-		if (sqlite3_column_int64(stmt, 1))
-			peer->remote.offer_anchor = CMD_OPEN_WITH_ANCHOR;
-		else
-			peer->remote.offer_anchor = CMD_OPEN_WITHOUT_ANCHOR;
-		pubkey_from_sql(peer->dstate->secpctx, stmt, 2,
-				&peer->remote.commitkey);
-		pubkey_from_sql(peer->dstate->secpctx, stmt, 3,
-				&peer->remote.finalkey);
-		peer->remote.locktime.locktime = sqlite3_column_int(stmt, 4);
-		peer->remote.mindepth = sqlite3_column_int(stmt, 5);
-		peer->remote.commit_fee_rate = sqlite3_column_int64(stmt, 6);
-		sha256_from_sql(stmt, 7, &peer->remote.next_revocation_hash);
-		log_debug(peer->log, "%s:next_revocation_hash=%s",
-			  __func__,
-			  tal_hexstr(ctx, &peer->remote.next_revocation_hash,
-				     sizeof(peer->remote.next_revocation_hash)));
-
-		/* Now we can fill in anchor witnessscript. */
-		peer->anchor.witnessscript
-			= bitcoin_redeem_2of2(peer, peer->dstate->secpctx,
-					      &peer->local.commitkey,
-					      &peer->remote.commitkey);
-	}
-
-	if (!visible_set)
-		fatal("load_peer_visible_state: no result '%s'", select);
-
-	err = sqlite3_finalize(stmt);
-	if (err != SQLITE_OK)
-		fatal("load_peer_visible_state:finalize gave %s:%s",
-		      sqlite3_errstr(err), sqlite3_errmsg(sql));
-	tal_free(ctx);
+	log_debug(dstate->base_log, "%s", __func__);
+	db_outside_transaction(dstate);
+	stmt = db_prepare(__func__, dstate,
+			  "DELETE FROM wallet_utxos WHERE txid = ? AND idx = ?;");
+	db_bind_blob(stmt, 1, &utxo->out.txid, sizeof(utxo->out.txid));
+	db_bind_int(stmt, 2, utxo->out.index);
+	if (!db_step(__func__, dstate, stmt))
+		fatal("db_remove_wallet_utxo failed");
 }
 
-static void load_peer_commit_info(struct peer *peer)
+void db_add_wallet_privkey(struct lightningd_state *dstate,
+			   const struct privkey *privkey)
 {
-	int err;
-	sqlite3_stmt *stmt;
-	sqlite3 *sql = peer->dstate->db->sql;
-	char *ctx = tal(peer, char);
-	const char *select;
+	struct db_op *stmt;
 
-	select = tal_fmt(ctx,
-			 "SELECT * FROM commit_info WHERE peer = x'%s';",
-			 pubkey_to_hexstr(ctx, peer->dstate->secpctx, peer->id));
-
-	err = sqlite3_prepare_v2(sql, select, -1, &stmt, NULL);
-	if (err != SQLITE_OK)
-		fatal("load_peer_commit_info:prepare gave %s:%s",
-		      sqlite3_errstr(err), sqlite3_errmsg(sql));
-
-	while ((err = sqlite3_step(stmt)) != SQLITE_DONE) {
-		struct commit_info **cip, *ci;
+	log_debug(dstate->base_log, "%s", __func__);
+	db_outside_transaction(dstate);
+	stmt = db_prepare(__func__, dstate, "INSERT INTO wallet VALUES (?);");
+	db_bind_blob(stmt, 1, privkey, sizeof(*privkey));
+	if (!db_step(__func__, dstate, stmt))
+		fatal("db_add_wallet_privkey failed");
+}
 
-		if (err != SQLITE_ROW)
-			fatal("load_peer_commit_info:step gave %s:%s",
-			      sqlite3_errstr(err), sqlite3_errmsg(sql));
+static void secrets_from_sql(struct peer *peer, sqlite3_stmt *stmt)
+{
+	peer_set_secrets_from_db(peer,
+				 sqlite3_column_blob(stmt, 1),
+				 sqlite3_column_bytes(stmt, 1),
+				 sqlite3_column_blob(stmt, 2),
+				 sqlite3_column_bytes(stmt, 2),
+				 sqlite3_column_blob(stmt, 3),
+				 sqlite3_column_bytes(stmt, 3));
+}
 
-		/* peer "SQL_PUBKEY", side TEXT, commit_num INT, revocation_hash "SQL_SHA256", sig "SQL_SIGNATURE", xmit_order INT, prev_revocation_hash "SQL_SHA256",  */
-		if (sqlite3_column_count(stmt) != 7)
-			fatal("load_peer_commit_info:step gave %i cols, not 7",
-			      sqlite3_column_count(stmt));
+static void anchor_from_sql(struct peer *peer, sqlite3_stmt *stmt)
+{
+	from_sql_blob(stmt, 1,
+		      &peer->anchor.txid, sizeof(peer->anchor.txid));
+	peer->anchor.index = sqlite3_column_int64(stmt, 2);
+	peer->anchor.satoshis = sqlite3_column_int64(stmt, 3);
+	peer->anchor.ours = sqlite3_column_int(stmt, 6);
 
-		if (streq(sqlite3_column_str(stmt, 1), "LOCAL"))
-			cip = &peer->local.commit;
-		else {
-			if (!streq(sqlite3_column_str(stmt, 1), "REMOTE"))
-				fatal("load_peer_commit_info:bad side %s",
-				      sqlite3_column_str(stmt, 1));
-			cip = &peer->remote.commit;
-			/* This is a hack where we temporarily store their
-			 * previous revocation hash before we get their
-			 * revocation. */
-			if (sqlite3_column_type(stmt, 6) != SQLITE_NULL) {
-				peer->their_prev_revocation_hash
-					= tal(peer, struct sha256);
-				sha256_from_sql(stmt, 6,
-						peer->their_prev_revocation_hash);
-			}
-		}
+	/* FIXME: Do timeout! */
+	peer_watch_anchor(peer,
+			  sqlite3_column_int(stmt, 4),
+			  BITCOIN_ANCHOR_DEPTHOK, INPUT_NONE);
+	peer->anchor.min_depth = sqlite3_column_int(stmt, 5);
+}
 
-		/* Do we already have this one? */
-		if (*cip)
-			fatal("load_peer_commit_info:duplicate side %s",
+static void visible_state_from_sql(struct peer *peer, sqlite3_stmt *stmt)
+{
+	if (sqlite3_column_int64(stmt, 1))
+		peer->remote.offer_anchor = CMD_OPEN_WITH_ANCHOR;
+	else
+		peer->remote.offer_anchor = CMD_OPEN_WITHOUT_ANCHOR;
+	pubkey_from_sql(peer->dstate->secpctx, stmt, 2,
+			&peer->remote.commitkey);
+	pubkey_from_sql(peer->dstate->secpctx, stmt, 3,
+			&peer->remote.finalkey);
+	peer->remote.locktime.locktime = sqlite3_column_int(stmt, 4);
+	peer->remote.mindepth = sqlite3_column_int(stmt, 5);
+	peer->remote.commit_fee_rate = sqlite3_column_int64(stmt, 6);
+	sha256_from_sql(stmt, 7, &peer->remote.next_revocation_hash);
+	log_debug(peer->log, "%s:next_revocation_hash=%s",
+		  __func__,
+		  tal_hexstr(peer, &peer->remote.next_revocation_hash,
+			     sizeof(peer->remote.next_revocation_hash)));
+
+	/* Now we can fill in anchor witnessscript. */
+	peer->anchor.witnessscript
+		= bitcoin_redeem_2of2(peer, peer->dstate->secpctx,
+				      &peer->local.commitkey,
+				      &peer->remote.commitkey);
+}
+
+static void commit_info_from_sql(struct peer *peer, sqlite3_stmt *stmt)
+{
+	struct commit_info **cip, *ci;
+
+	/* peer "SQL_PUBKEY", side TEXT, commit_num INT, revocation_hash "SQL_SHA256", sig "SQL_SIGNATURE", xmit_order INT, prev_revocation_hash "SQL_SHA256",  */
+	if (streq(sqlite3_column_str(stmt, 1), "LOCAL"))
+		cip = &peer->local.commit;
+	else {
+		if (!streq(sqlite3_column_str(stmt, 1), "REMOTE"))
+			fatal("commit_info_from_sql:bad side %s",
 			      sqlite3_column_str(stmt, 1));
+		cip = &peer->remote.commit;
+		/* This is a hack where we temporarily store their
+		 * previous revocation hash before we get their
+		 * revocation. */
+		if (sqlite3_column_type(stmt, 6) != SQLITE_NULL) {
+			peer->their_prev_revocation_hash
+				= tal(peer, struct sha256);
+			sha256_from_sql(stmt, 6,
+					peer->their_prev_revocation_hash);
+		}
+	}
 
-		*cip = ci = new_commit_info(peer, sqlite3_column_int64(stmt, 2));
-		sha256_from_sql(stmt, 3, &ci->revocation_hash);
-		ci->order = sqlite3_column_int64(stmt, 4);
+	/* Do we already have this one? */
+	if (*cip)
+		fatal("commit_info_from_sql:duplicate side %s",
+		      sqlite3_column_str(stmt, 1));
 
-		if (sqlite3_column_type(stmt, 5) == SQLITE_NULL)
-			ci->sig = NULL;
-		else {
-			ci->sig = tal(ci, struct bitcoin_signature);
-			sig_from_sql(peer->dstate->secpctx, stmt, 5, ci->sig);
-		}
+	*cip = ci = new_commit_info(peer, sqlite3_column_int64(stmt, 2));
+	sha256_from_sql(stmt, 3, &ci->revocation_hash);
+	ci->order = sqlite3_column_int64(stmt, 4);
 
-		/* Set once we have updated HTLCs. */
-		ci->cstate = NULL;
-		ci->tx = NULL;
+	if (sqlite3_column_type(stmt, 5) == SQLITE_NULL)
+		ci->sig = NULL;
+	else {
+		ci->sig = tal(ci, struct bitcoin_signature);
+		sig_from_sql(peer->dstate->secpctx, stmt, 5, ci->sig);
 	}
 
-	err = sqlite3_finalize(stmt);
-	if (err != SQLITE_OK)
-		fatal("load_peer_commit_info:finalize gave %s:%s",
-		      sqlite3_errstr(err), sqlite3_errmsg(sql));
-	tal_free(ctx);
-
-	if (!peer->local.commit)
-		fatal("load_peer_commit_info:no local commit info found");
-	if (!peer->remote.commit)
-		fatal("load_peer_commit_info:no remote commit info found");
+	/* Set once we have updated HTLCs. */
+	ci->cstate = NULL;
+	ci->tx = NULL;
 }
 
 /* Because their HTLCs are not ordered wrt to ours, we can go negative
@@ -484,27 +1074,88 @@ static void apply_htlc(struct channel_state *cstate, const struct htlc *htlc,
 	}
 }
 
-/* As we load the HTLCs, we apply them to get the final channel_state.
- * We also get the last used htlc id.
- * This is slow, but sure. */
-static void load_peer_htlcs(struct peer *peer)
-{
-	int err;
-	sqlite3_stmt *stmt;
-	sqlite3 *sql = peer->dstate->db->sql;
-	char *ctx = tal(peer, char);
-	const char *select;
-	bool to_them_only, to_us_only;
+/* Rows from htlcs and htlcs_archive look the same. */
+static struct htlc *htlc_from_sql(struct peer *peer, sqlite3_stmt *stmt,
+				  const char *caller)
+{
+	struct htlc *htlc;
+	struct sha256 rhash;
+	sqlite3_int64 hstate;
+
+	if (sqlite3_column_count(stmt) != 11)
+		fatal("%s:step gave %i cols, not 11",
+		      caller, sqlite3_column_count(stmt));
+	sha256_from_sql(stmt, 5, &rhash);
+
+	hstate = sqlite3_column_int64(stmt, 2);
+	if (hstate < 0 || hstate >= HTLC_STATE_INVALID)
+		fatal("%s:invalid state %"PRIuSQLITE64, caller, hstate);
+	htlc = peer_new_htlc(peer,
+			     sqlite3_column_int64(stmt, 1),
+			     sqlite3_column_int64(stmt, 3),
+			     &rhash,
+			     sqlite3_column_int64(stmt, 4),
+			     NULL, 0, NULL,
+			     hstate);
+
+	/* The onion stays in blobs until someone wants it. */
+	htlc->routing = tal_free(htlc->routing);
+	if (sqlite3_column_type(stmt, 7) != SQLITE_NULL) {
+		struct sha256 *id = tal(htlc, struct sha256);
+
+		from_sql_blob(stmt, 7, id, sizeof(*id));
+		htlc->routing_id = id;
+	}
 
-	select = tal_fmt(ctx,
-			 "SELECT * FROM htlcs WHERE peer = x'%s' ORDER BY id;",
-			 pubkey_to_hexstr(ctx, peer->dstate->secpctx, peer->id));
+	if (sqlite3_column_type(stmt, 6) != SQLITE_NULL) {
+		htlc->r = &htlc->rval;
+		from_sql_blob(stmt, 6, htlc->r, sizeof(*htlc->r));
+	}
+	if (sqlite3_column_type(stmt, 10) != SQLITE_NULL) {
+		htlc->fail = tal_sql_blob(htlc, stmt, 10);
+	}
 
-	err = sqlite3_prepare_v2(sql, select, -1, &stmt, NULL);
-	if (err != SQLITE_OK)
-		fatal("load_peer_htlcs:prepare gave %s:%s",
-		      sqlite3_errstr(err), sqlite3_errmsg(sql));
+	if (htlc->r && htlc->fail)
+		fatal("%s HTLC %"PRIu64" has failed and fulfilled?",
+		      htlc_owner(htlc) == LOCAL ? "local" : "remote",
+		      htlc->id);
 
+	log_debug(peer->log, "Loaded %s HTLC %"PRIu64" (%s)",
+		  htlc_owner(htlc) == LOCAL ? "local" : "remote",
+		  htlc->id, htlc_state_name(htlc->state));
+	return htlc;
+}
+
+/* Fulfilled HTLCs which have been archived simply moved funds. */
+static void htlc_totals_from_sql(struct peer *peer, sqlite3_stmt *stmt)
+{
+	u64 local_fulfilled, remote_fulfilled;
+	struct channel_state *cstates[2];
+	size_t i;
+
+	local_fulfilled = sqlite3_column_int64(stmt, 1);
+	remote_fulfilled = sqlite3_column_int64(stmt, 2);
+	if (sqlite3_column_int64(stmt, 3) > peer->htlc_id_counter)
+		peer->htlc_id_counter = sqlite3_column_int64(stmt, 3);
+
+	log_debug(peer->log, "Archived HTLCs paid %"PRIu64"/%"PRIu64" msat",
+		  local_fulfilled, remote_fulfilled);
+
+	/* Same as force_add_htlc then force_fulfill_htlc on each. */
+	cstates[0] = peer->local.commit->cstate;
+	cstates[1] = peer->remote.commit->cstate;
+	for (i = 0; i < ARRAY_SIZE(cstates); i++) {
+		cstates[i]->side[LOCAL].pay_msat
+			+= remote_fulfilled - local_fulfilled;
+		cstates[i]->side[REMOTE].pay_msat
+			+= local_fulfilled - remote_fulfilled;
+	}
+}
+
+/* As we load the HTLCs, we apply them to these to get the final
+ * channel_state.  We also get the last used htlc id. */
+static void init_peer_cstates(struct peer *peer)
+{
 	peer->local.commit->cstate = initial_cstate(peer,
 						    peer->anchor.satoshis,
 						    peer->local.commit_fee_rate,
@@ -517,108 +1168,47 @@ static void load_peer_htlcs(struct peer *peer)
 						     peer->local.offer_anchor
 						     == CMD_OPEN_WITH_ANCHOR ?
 						     LOCAL : REMOTE);
+}
 
-	/* We rebuild cstate by running *every* HTLC through. */
-	while ((err = sqlite3_step(stmt)) != SQLITE_DONE) {
-		struct htlc *htlc;
-		struct sha256 rhash;
-		enum htlc_state hstate;
-
-		if (err != SQLITE_ROW)
-			fatal("load_peer_htlcs:step gave %s:%s",
-			      sqlite3_errstr(err), sqlite3_errmsg(sql));
-
-		if (sqlite3_column_count(stmt) != 11)
-			fatal("load_peer_htlcs:step gave %i cols, not 11",
-			      sqlite3_column_count(stmt));
-		sha256_from_sql(stmt, 5, &rhash);
-
-		hstate = htlc_state_from_name(sqlite3_column_str(stmt, 2));
-		if (hstate == HTLC_STATE_INVALID)
-			fatal("load_peer_htlcs:invalid state %s",
-			      sqlite3_column_str(stmt, 2));
-		htlc = peer_new_htlc(peer,
-				     sqlite3_column_int64(stmt, 1),
-				     sqlite3_column_int64(stmt, 3),
-				     &rhash,
-				     sqlite3_column_int64(stmt, 4),
-				     sqlite3_column_blob(stmt, 7),
-				     sqlite3_column_bytes(stmt, 7),
-				     NULL,
-				     hstate);
-
-		if (sqlite3_column_type(stmt, 6) != SQLITE_NULL) {
-			htlc->r = tal(htlc, struct rval);
-			from_sql_blob(stmt, 6, htlc->r, sizeof(*htlc->r));
-		}
-		if (sqlite3_column_type(stmt, 10) != SQLITE_NULL) {
-			htlc->fail = tal_sql_blob(htlc, stmt, 10);
-		}
-
-		if (htlc->r && htlc->fail)
-			fatal("%s HTLC %"PRIu64" has failed and fulfilled?",
-			      htlc_owner(htlc) == LOCAL ? "local" : "remote",
-			      htlc->id);
-
-		log_debug(peer->log, "Loaded %s HTLC %"PRIu64" (%s)",
-			  htlc_owner(htlc) == LOCAL ? "local" : "remote",
-			  htlc->id, htlc_state_name(htlc->state));
-
-		if (htlc_owner(htlc) == LOCAL
-		    && htlc->id >= peer->htlc_id_counter)
-			peer->htlc_id_counter = htlc->id + 1;
-
-		/* Update cstate with this HTLC. */
-		apply_htlc(peer->local.commit->cstate, htlc, LOCAL);
-		apply_htlc(peer->remote.commit->cstate, htlc, REMOTE);
-	}
-
-	err = sqlite3_finalize(stmt);
-	if (err != SQLITE_OK)
-		fatal("load_peer_htlcs:finalize gave %s:%s",
-		      sqlite3_errstr(err), sqlite3_errmsg(sql));
-
-	/* Now set any in-progress fee changes. */
-	select = tal_fmt(ctx,
-			 "SELECT * FROM feechanges WHERE peer = x'%s';",
-			 pubkey_to_hexstr(ctx, peer->dstate->secpctx, peer->id));
+static void live_htlc_from_sql(struct peer *peer, sqlite3_stmt *stmt)
+{
+	struct htlc *htlc = htlc_from_sql(peer, stmt, "live_htlc_from_sql");
 
-	err = sqlite3_prepare_v2(sql, select, -1, &stmt, NULL);
-	if (err != SQLITE_OK)
-		fatal("load_peer_htlcs:prepare gave %s:%s",
-		      sqlite3_errstr(err), sqlite3_errmsg(sql));
+	if (htlc_owner(htlc) == LOCAL
+	    && htlc->id >= peer->htlc_id_counter)
+		peer->htlc_id_counter = htlc->id + 1;
 
-	while ((err = sqlite3_step(stmt)) != SQLITE_DONE) {
-		enum feechange_state feechange_state;
+	/* Update cstate with this HTLC. */
+	apply_htlc(peer->local.commit->cstate, htlc, LOCAL);
+	apply_htlc(peer->remote.commit->cstate, htlc, REMOTE);
+}
 
-		if (err != SQLITE_ROW)
-			fatal("load_peer_htlcs:step gave %s:%s",
-			      sqlite3_errstr(err), sqlite3_errmsg(sql));
+/* Any in-progress fee changes. */
+static void feechange_from_sql(struct peer *peer, sqlite3_stmt *stmt)
+{
+	enum feechange_state feechange_state;
 
-		if (sqlite3_column_count(stmt) != 3)
-			fatal("load_peer_htlcs:step gave %i cols, not 3",
-			      sqlite3_column_count(stmt));
+	feechange_state
+		= feechange_state_from_name(sqlite3_column_str(stmt, 1));
+	if (feechange_state == FEECHANGE_STATE_INVALID)
+		fatal("feechange_from_sql:invalid feechange state %s",
+		      sqlite3_column_str(stmt, 1));
+	if (peer->feechanges[feechange_state])
+		fatal("feechange_from_sql: second feechange in state %s",
+		      sqlite3_column_str(stmt, 1));
+	peer->feechanges[feechange_state]
+		= new_feechange(peer, sqlite3_column_int64(stmt, 2),
+				feechange_state);
+}
 
-		feechange_state
-			= feechange_state_from_name(sqlite3_column_str(stmt, 1));
-		if (feechange_state == FEECHANGE_STATE_INVALID)
-			fatal("load_peer_htlcs:invalid feechange state %s",
-			      sqlite3_column_str(stmt, 1));
-		if (peer->feechanges[feechange_state])
-			fatal("load_peer_htlcs: second feechange in state %s",
-			      sqlite3_column_str(stmt, 1));
-		peer->feechanges[feechange_state]
-			= new_feechange(peer, sqlite3_column_int64(stmt, 2),
-					feechange_state);
-	}
-	err = sqlite3_finalize(stmt);
-	if (err != SQLITE_OK)
-		fatal("load_peer_htlcs:finalize gave %s:%s",
-		      sqlite3_errstr(err), sqlite3_errmsg(sql));
+/* Once every HTLC is applied, we have the final channel_state. */
+static void finish_peer_htlcs(struct peer *peer)
+{
+	bool to_them_only, to_us_only;
 
 	if (!balance_after_force(peer->local.commit->cstate)
 	    || !balance_after_force(peer->remote.commit->cstate))
-		fatal("load_peer_htlcs:channel didn't balance");
+		fatal("finish_peer_htlcs:channel didn't balance");
 
 	/* Update commit->tx and commit->map */
 	peer->local.commit->tx = create_commit_tx(peer->local.commit,
@@ -651,13 +1241,13 @@ static void load_peer_htlcs(struct peer *peer)
 		  peer->remote.staging_cstate->side[REMOTE].fee_msat,
 		  peer->remote.staging_cstate->side[LOCAL].num_htlcs,
 		  peer->remote.staging_cstate->side[REMOTE].num_htlcs);
-	
-	tal_free(ctx);
 }
 
 /* FIXME: A real database person would do this in a single clause along
- * with loading the htlcs in the first place! */
-static void connect_htlc_src(struct lightningd_state *dstate)
+ * with loading the htlcs in the first place!
+ * @peerhex limits it to one peer's HTLCs, if non-NULL. */
+static void connect_htlc_src(struct lightningd_state *dstate,
+			     const char *peerhex)
 {
 	sqlite3 *sql = dstate->db->sql;
 	int err;
@@ -666,7 +1256,10 @@ static void connect_htlc_src(struct lightningd_state *dstate)
 	const char *select;
 
 	select = tal_fmt(ctx,
-			 "SELECT peer,id,state,src_peer,src_id FROM htlcs WHERE src_peer IS NOT NULL AND state <> 'RCVD_REMOVE_ACK_REVOCATION' AND state <> 'SENT_REMOVE_ACK_REVOCATION';");
+			 "SELECT peer,id,state,src_peer,src_id FROM htlcs WHERE src_peer IS NOT NULL%s%s%s;",
+			 peerhex ? " AND peer = x'" : "",
+			 peerhex ? peerhex : "",
+			 peerhex ? "'" : "");
 
 	err = sqlite3_prepare_v2(sql, select, -1, &stmt, NULL);
 	if (err != SQLITE_OK)
@@ -688,19 +1281,18 @@ static void connect_htlc_src(struct lightningd_state *dstate)
 		if (!peer)
 			continue;
 
-		s = htlc_state_from_name(sqlite3_column_str(stmt, 2));
-		if (s == HTLC_STATE_INVALID)
-			fatal("connect_htlc_src:unknown state %s",
-			      sqlite3_column_str(stmt, 2));
+		s = sqlite3_column_int64(stmt, 2);
+		if (s >= HTLC_STATE_INVALID)
+			fatal("connect_htlc_src:unknown state %u", s);
 
 		htlc = htlc_get(&peer->htlcs, sqlite3_column_int64(stmt, 1),
 				htlc_state_owner(s));
 		if (!htlc)
 			fatal("connect_htlc_src:unknown htlc %"PRIuSQLITE64" state %s",
 			      sqlite3_column_int64(stmt, 1),
-			      sqlite3_column_str(stmt, 2));
+			      htlc_state_name(s));
 
-		pubkey_from_sql(dstate->secpctx, stmt, 4, &id);
+		pubkey_from_sql(dstate->secpctx, stmt, 3, &id);
 		peer = find_peer(dstate, &id);
 		if (!peer)
 			fatal("connect_htlc_src:unknown src peer %s",
@@ -710,8 +1302,12 @@ static void connect_htlc_src(struct lightningd_state *dstate)
 		htlc->src = htlc_get(&peer->htlcs,
 				     sqlite3_column_int64(stmt, 4),
 				     REMOTE);
-		if (!htlc->src)
+		/* Once we've passed back the result, the source can finish
+		 * and be archived before this one does. */
+		if (!htlc->src && !htlc->r && !htlc->fail)
 			fatal("connect_htlc_src:unknown src htlc");
+		if (htlc->src)
+			htlc->src->dst = htlc;
 	}
 
 	err = sqlite3_finalize(stmt);
@@ -722,32 +1318,7 @@ static void connect_htlc_src(struct lightningd_state *dstate)
 	tal_free(ctx);
 }
 
-static const char *linearize_shachain(const tal_t *ctx,
-				      const struct shachain *shachain)
-{
-	size_t i;
-	u8 *p = tal_arr(ctx, u8, 0);
-	const char *str;
-
-	push_le64(shachain->min_index, push, &p);
-	push_le32(shachain->num_valid, push, &p);
-	for (i = 0; i < shachain->num_valid; i++) {
-		push_le64(shachain->known[i].index, push, &p);
-		push(&shachain->known[i].hash, sizeof(shachain->known[i].hash),
-		     &p);
-	}
-	for (i = shachain->num_valid; i < ARRAY_SIZE(shachain->known); i++) {
-		static u8 zeroes[sizeof(shachain->known[0].hash)];
-		push_le64(0, push, &p);
-		push(zeroes, sizeof(zeroes), &p);
-	}
-		
-	assert(tal_count(p) == SHACHAIN_SIZE);
-	str = tal_hexstr(ctx, p, tal_count(p));
-	tal_free(p);
-	return str;
-}
-
+/* How the old shachain table kept them. */
 static bool delinearize_shachain(struct shachain *shachain,
 				 const void *data, size_t len)
 {
@@ -761,106 +1332,49 @@ static bool delinearize_shachain(struct shachain *shachain,
 		pull(&p, &len, &shachain->known[i].hash,
 		     sizeof(shachain->known[i].hash));
 	}
-	return p && len == 0;
-}
-
-static void load_peer_shachain(struct peer *peer)
-{
-	int err;
-	sqlite3_stmt *stmt;
-	sqlite3 *sql = peer->dstate->db->sql;
-	char *ctx = tal(peer, char);
-	bool shachain_found = false;
-	const char *select;
-
-	select = tal_fmt(ctx,
-			 "SELECT * FROM shachain WHERE peer = x'%s';",
-			 pubkey_to_hexstr(ctx, peer->dstate->secpctx, peer->id));
-
-	err = sqlite3_prepare_v2(sql, select, -1, &stmt, NULL);
-	if (err != SQLITE_OK)
-		fatal("load_peer_shachain:prepare gave %s:%s",
-		      sqlite3_errstr(err), sqlite3_errmsg(sql));
-
-	while ((err = sqlite3_step(stmt)) != SQLITE_DONE) {
-		const char *hexstr;
-
-		if (err != SQLITE_ROW)
-			fatal("load_peer_shachain:step gave %s:%s",
-			      sqlite3_errstr(err), sqlite3_errmsg(sql));
-
-		/* shachain (peer "SQL_PUBKEY", shachain BINARY(%zu) */
-		if (sqlite3_column_count(stmt) != 2)
-			fatal("load_peer_shachain:step gave %i cols, not 2",
-			      sqlite3_column_count(stmt));
-
-		if (shachain_found)
-			fatal("load_peer_shachain:multiple shachains?");
-
-		hexstr = tal_hexstr(ctx, sqlite3_column_blob(stmt, 1),
-				    sqlite3_column_bytes(stmt, 1));
-		if (!delinearize_shachain(&peer->their_preimages,
-					  sqlite3_column_blob(stmt, 1),
-					  sqlite3_column_bytes(stmt, 1)))
-			fatal("load_peer_shachain:invalid shachain %s",
-			      hexstr);
-		shachain_found = true;
-	}
-
-	if (!shachain_found)
-		fatal("load_peer_shachain:no shachain");
-	tal_free(ctx);
+	return p && len == 0 && shachain->num_valid <= ARRAY_SIZE(shachain->known);
 }
 
-/* We may not have one, and that's OK. */
-static void load_peer_closing(struct peer *peer)
+/* One row per known[] slot: an empty shachain has none. */
+static void shachain_from_sql(struct peer *peer, sqlite3_stmt *stmt)
 {
-	int err;
-	sqlite3_stmt *stmt;
-	sqlite3 *sql = peer->dstate->db->sql;
-	char *ctx = tal(peer, char);
-	bool closing_found = false;
-	const char *select;
-
-	select = tal_fmt(ctx,
-			 "SELECT * FROM closing WHERE peer = x'%s';",
-			 pubkey_to_hexstr(ctx, peer->dstate->secpctx, peer->id));
-
-	err = sqlite3_prepare_v2(sql, select, -1, &stmt, NULL);
-	if (err != SQLITE_OK)
-		fatal("load_peer_closing:prepare gave %s:%s",
-		      sqlite3_errstr(err), sqlite3_errmsg(sql));
+	struct shachain *chain = &peer->their_preimages;
+	u32 pos;
+	u64 index;
 
-	while ((err = sqlite3_step(stmt)) != SQLITE_DONE) {
-		if (err != SQLITE_ROW)
-			fatal("load_peer_closing:step gave %s:%s",
-			      sqlite3_errstr(err), sqlite3_errmsg(sql));
+	/* peer "SQL_PUBKEY", pos, idx, hash */
+	pos = sqlite3_column_int64(stmt, 1);
+	index = sqlite3_column_int64(stmt, 2);
+	if (pos >= ARRAY_SIZE(chain->known))
+		fatal("shachain_from_sql:bad pos %u", pos);
 
-		if (sqlite3_column_count(stmt) != 9)
-			fatal("load_peer_closing:step gave %i cols, not 9",
-			      sqlite3_column_count(stmt));
+	/* Most recent one is the smallest. */
+	if (chain->num_valid == 0 || index < chain->min_index)
+		chain->min_index = index;
+	chain->known[pos].index = index;
+	sha256_from_sql(stmt, 3, &chain->known[pos].hash);
+	if (pos + 1 > chain->num_valid)
+		chain->num_valid = pos + 1;
+}
 
-		if (closing_found)
-			fatal("load_peer_closing:multiple closing?");
-
-		peer->closing.our_fee = sqlite3_column_int64(stmt, 1);
-		peer->closing.their_fee = sqlite3_column_int64(stmt, 2);
-		if (sqlite3_column_type(stmt, 3) == SQLITE_NULL)
-			peer->closing.their_sig = NULL;
-		else {
-			peer->closing.their_sig = tal(peer,
-						      struct bitcoin_signature);
-			sig_from_sql(peer->dstate->secpctx, stmt, 3,
-				     peer->closing.their_sig);
-		}
-		peer->closing.our_script = tal_sql_blob(peer, stmt, 4);
-		peer->closing.their_script = tal_sql_blob(peer, stmt, 5);
-		peer->closing.shutdown_order = sqlite3_column_int64(stmt, 6);
-		peer->closing.closing_order = sqlite3_column_int64(stmt, 7);
-		peer->closing.sigs_in = sqlite3_column_int64(stmt, 8);
-		closing_found = true;
+/* We may not have one, and that's OK. */
+static void closing_from_sql(struct peer *peer, sqlite3_stmt *stmt)
+{
+	peer->closing.our_fee = sqlite3_column_int64(stmt, 1);
+	peer->closing.their_fee = sqlite3_column_int64(stmt, 2);
+	if (sqlite3_column_type(stmt, 3) == SQLITE_NULL)
+		peer->closing.their_sig = NULL;
+	else {
+		peer->closing.their_sig = tal(peer,
+					      struct bitcoin_signature);
+		sig_from_sql(peer->dstate->secpctx, stmt, 3,
+			     peer->closing.their_sig);
 	}
-	tal_free(ctx);
+	peer->closing.our_script = tal_sql_blob(peer, stmt, 4);
+	peer->closing.their_script = tal_sql_blob(peer, stmt, 5);
+	peer->closing.shutdown_order = sqlite3_column_int64(stmt, 6);
+	peer->closing.closing_order = sqlite3_column_int64(stmt, 7);
+	peer->closing.sigs_in = sqlite3_column_int64(stmt, 8);
 }
 
 /* FIXME: much of this is redundant. */
@@ -887,12 +1401,12 @@ static void restore_peer_local_visible_state(struct peer *peer)
 				 &peer->local.next_revocation_hash);
 
 	if (state_is_normal(peer->state))
-		peer->nc = add_connection(peer->dstate,
-					  &peer->dstate->id, peer->id,
-					  peer->dstate->config.fee_base,
-					  peer->dstate->config.fee_per_satoshi,
-					  peer->dstate->config.min_htlc_expiry,
-					  peer->dstate->config.min_htlc_expiry);
+		add_connection(peer->dstate,
+			       &peer->dstate->id, peer->id,
+			       peer->dstate->config.fee_base,
+			       peer->dstate->config.fee_per_satoshi,
+			       peer->dstate->config.min_htlc_expiry,
+			       peer->dstate->config.min_htlc_expiry, 0);
 
 	peer->their_commitsigs = peer->local.commit->commit_num + 1;
 	/* If they created anchor, they didn't send a sig for first commit */
@@ -910,11 +1424,113 @@ static void restore_peer_local_visible_state(struct peer *peer)
 		peer->order_counter = peer->closing.shutdown_order + 1;
 }
 
+/* We restore every peer at once, a table at a time, looking up each row's
+ * peer by its DER-encoded id. */
+struct peer_load {
+	u8 der[PUBKEY_DER_LEN];
+	struct peer *peer;
+	/* Has a channel, so needs more than secrets and closing. */
+	bool channel;
+	/* Which FOUND_ rows we've seen. */
+	unsigned int found;
+};
+
+#define FOUND_SECRETS	0x1
+#define FOUND_CLOSING	0x2
+#define FOUND_ANCHOR	0x4
+#define FOUND_VISIBLE	0x8
+#define FOUND_TOTALS	0x10
+
+static int peer_load_cmp(const void *a, const void *b)
+{
+	const struct peer_load *la = a, *lb = b;
+
+	return memcmp(la->der, lb->der, sizeof(la->der));
+}
+
+/* @once is the FOUND_ flag if a peer can have only one row, else 0.
+ * @peerhex limits it to that peer's rows (see db_load_peer), if non-NULL. */
+static void load_peers_table(struct lightningd_state *dstate,
+			     struct peer_load *loads, const char *peerhex,
+			     const char *table, int cols,
+			     bool channel_only, unsigned int once,
+			     void (*row)(struct peer *peer, sqlite3_stmt *stmt))
+{
+	int err;
+	sqlite3_stmt *stmt;
+	sqlite3 *sql = dstate->db->sql;
+	char *select;
+	struct timeabs start = time_now();
+	size_t rows = 0;
+
+	if (peerhex)
+		select = tal_fmt(dstate, "SELECT * FROM %s WHERE peer = x'%s';",
+				 table, peerhex);
+	else
+		select = tal_fmt(dstate, "SELECT * FROM %s;", table);
+
+	err = sqlite3_prepare_v2(sql, select, -1, &stmt, NULL);
+	if (err != SQLITE_OK)
+		fatal("load_%s:prepare gave %s:%s", table,
+		      sqlite3_errstr(err), sqlite3_errmsg(sql));
+
+	while ((err = sqlite3_step(stmt)) != SQLITE_DONE) {
+		struct peer_load key, *l;
+
+		if (err != SQLITE_ROW)
+			fatal("load_%s:step gave %s:%s", table,
+			      sqlite3_errstr(err), sqlite3_errmsg(sql));
+
+		if (sqlite3_column_count(stmt) != cols)
+			fatal("load_%s:step gave %i cols, not %i", table,
+			      sqlite3_column_count(stmt), cols);
+
+		from_sql_blob(stmt, 0, key.der, sizeof(key.der));
+		l = bsearch(&key, loads, tal_count(loads), sizeof(*loads),
+			    peer_load_cmp);
+		if (!l || (channel_only && !l->channel))
+			continue;
+
+		if (l->found & once)
+			fatal("load_%s: two rows for %s", table,
+			      tal_hexstr(select, l->der, sizeof(l->der)));
+		l->found |= once;
+		row(l->peer, stmt);
+		rows++;
+	}
+
+	err = sqlite3_finalize(stmt);
+	if (err != SQLITE_OK)
+		fatal("load_%s:finalize gave %s:%s", table,
+		      sqlite3_errstr(err), sqlite3_errmsg(sql));
+	tal_free(select);
+	if (!peerhex)
+		startup_phase(dstate, table, start, rows);
+}
+
+static void check_peers_found(const struct peer_load *loads,
+			      const char *table,
+			      bool channel_only, unsigned int once)
+{
+	size_t i;
+
+	for (i = 0; i < tal_count(loads); i++) {
+		if (channel_only && !loads[i].channel)
+			continue;
+		if (!(loads[i].found & once))
+			fatal("load_%s: none for %s", table,
+			      tal_hexstr(loads, loads[i].der,
+					 sizeof(loads[i].der)));
+	}
+}
+
 static void db_load_peers(struct lightningd_state *dstate)
 {
 	int err;
 	sqlite3_stmt *stmt;
 	struct peer *peer;
+	struct peer_load *loads;
+	size_t i;
 
 	err = sqlite3_prepare_v2(dstate->db->sql, "SELECT * FROM peers;", -1,
 				 &stmt, NULL);
@@ -947,7 +1563,7 @@ static void db_load_peers(struct lightningd_state *dstate)
 		peer = new_peer(dstate, l, state, sqlite3_column_int(stmt, 2) ?
 				CMD_OPEN_WITH_ANCHOR : CMD_OPEN_WITHOUT_ANCHOR);
 		peer->htlc_id_counter = 0;
-		peer->id = tal_dup(peer, struct pubkey, &id);
+		peer_set_id(peer, &id);
 		peer->local.commit_fee_rate = sqlite3_column_int64(stmt, 3);
 		log_debug(peer->log, "%s:%s",
 			  __func__, state_name(peer->state));
@@ -958,37 +1574,121 @@ static void db_load_peers(struct lightningd_state *dstate)
 		      sqlite3_errstr(err),
 		      sqlite3_errmsg(dstate->db->sql));
 
+	i = 0;
+	list_for_each(&dstate->peers, peer, list)
+		i++;
+	loads = tal_arr(dstate, struct peer_load, i);
+
+	i = 0;
 	list_for_each(&dstate->peers, peer, list) {
-		load_peer_secrets(peer);
-		load_peer_closing(peer);
+		pubkey_to_der(dstate->secpctx, loads[i].der, peer->id);
+		loads[i].peer = peer;
+		loads[i].channel = peer->state >= STATE_OPEN_WAITING_OURANCHOR
+			&& !state_is_error(peer->state);
+		loads[i].found = 0;
 		peer->anchor.min_depth = 0;
-		if (peer->state >= STATE_OPEN_WAITING_OURANCHOR
-		    && !state_is_error(peer->state)) {
-			load_peer_anchor(peer);
-			load_peer_visible_state(peer);
-			load_peer_shachain(peer);
-			load_peer_commit_info(peer);
-			load_peer_htlcs(peer);
-			restore_peer_local_visible_state(peer);
-		}
+		i++;
+	}
+	qsort(loads, tal_count(loads), sizeof(*loads), peer_load_cmp);
+
+	load_peers_table(dstate, loads, NULL, "peer_secrets", 4, false,
+			 FOUND_SECRETS, secrets_from_sql);
+	check_peers_found(loads, "peer_secrets", false, FOUND_SECRETS);
+	load_peers_table(dstate, loads, NULL, "closing", 9, false,
+			 FOUND_CLOSING, closing_from_sql);
+
+	/* The rest is only for peers with a channel. */
+	load_peers_table(dstate, loads, NULL, "anchors", 7, true,
+			 FOUND_ANCHOR, anchor_from_sql);
+	check_peers_found(loads, "anchors", true, FOUND_ANCHOR);
+	load_peers_table(dstate, loads, NULL, "their_visible_state", 8, true,
+			 FOUND_VISIBLE, visible_state_from_sql);
+	check_peers_found(loads, "their_visible_state", true, FOUND_VISIBLE);
+
+	for (i = 0; i < tal_count(loads); i++) {
+		if (loads[i].channel)
+			shachain_init(&loads[i].peer->their_preimages);
+	}
+	load_peers_table(dstate, loads, NULL, "shachain_known", 4, true, 0,
+			 shachain_from_sql);
+
+	load_peers_table(dstate, loads, NULL, "commit_info", 7, true, 0,
+			 commit_info_from_sql);
+	for (i = 0; i < tal_count(loads); i++) {
+		if (!loads[i].channel)
+			continue;
+		if (!loads[i].peer->local.commit)
+			fatal("load_commit_info:no local commit info found");
+		if (!loads[i].peer->remote.commit)
+			fatal("load_commit_info:no remote commit info found");
+		init_peer_cstates(loads[i].peer);
+	}
+
+	/* We rebuild cstate by running every live HTLC through, plus the
+	 * totals of the archived ones. */
+	load_peers_table(dstate, loads, NULL, "htlc_totals", 4, true,
+			 FOUND_TOTALS, htlc_totals_from_sql);
+	load_peers_table(dstate, loads, NULL, "htlcs", 11, true, 0,
+			 live_htlc_from_sql);
+	load_peers_table(dstate, loads, NULL, "feechanges", 3, true, 0,
+			 feechange_from_sql);
+
+	for (i = 0; i < tal_count(loads); i++) {
+		if (!loads[i].channel)
+			continue;
+		finish_peer_htlcs(loads[i].peer);
+		restore_peer_local_visible_state(loads[i].peer);
 	}
+	tal_free(loads);
 
-	connect_htlc_src(dstate);
+	connect_htlc_src(dstate, NULL);
+}
+
+void db_load_peer(struct peer *peer)
+{
+	struct lightningd_state *dstate = peer->dstate;
+	struct peer_load *loads = tal_arr(peer, struct peer_load, 1);
+	const char *peerhex = pubkey_to_hexstr(loads, dstate->secpctx,
+					       peer->id);
+
+	pubkey_to_der(dstate->secpctx, loads[0].der, peer->id);
+	loads[0].peer = peer;
+	loads[0].channel = true;
+	loads[0].found = 0;
+
+	wait_for_writer(dstate->db);
+	load_peers_table(dstate, loads, peerhex, "commit_info", 7, true, 0,
+			 commit_info_from_sql);
+	if (!peer->local.commit || !peer->remote.commit)
+		fatal("db_load_peer:no commit info found");
+	init_peer_cstates(peer);
+
+	load_peers_table(dstate, loads, peerhex, "htlc_totals", 4, true,
+			 FOUND_TOTALS, htlc_totals_from_sql);
+	load_peers_table(dstate, loads, peerhex, "htlcs", 11, true, 0,
+			 live_htlc_from_sql);
+	load_peers_table(dstate, loads, peerhex, "feechanges", 3, true, 0,
+			 feechange_from_sql);
+	finish_peer_htlcs(peer);
+	connect_htlc_src(dstate, peerhex);
+	tal_free(loads);
 }
 
 
-static const char *pubkeys_to_hex(const tal_t *ctx,
-				  secp256k1_context *secpctx,
-				  const struct pubkey *ids)
+static void db_bind_pubkeys(struct lightningd_state *dstate,
+			    struct db_op *stmt, int idx,
+			    const struct pubkey *ids)
 {
-	u8 *ders = tal_arr(ctx, u8, PUBKEY_DER_LEN * tal_count(ids));
+	u8 *ders = tal_arr(dstate, u8, PUBKEY_DER_LEN * tal_count(ids));
 	size_t i;
 
 	for (i = 0; i < tal_count(ids); i++)
-		pubkey_to_der(secpctx, ders + i * PUBKEY_DER_LEN, &ids[i]);
+		pubkey_to_der(dstate->secpctx, ders + i * PUBKEY_DER_LEN, &ids[i]);
 
-	return tal_hexstr(ctx, ders, tal_count(ders));
+	db_bind_blob(stmt, idx, ders, tal_count(ders));
+	tal_free(ders);
 }
+
 static struct pubkey *pubkeys_from_arr(const tal_t *ctx,
 				       secp256k1_context *secpctx,
 				       const void *blob, size_t len)
@@ -1008,83 +1708,190 @@ static struct pubkey *pubkeys_from_arr(const tal_t *ctx,
 	return ids;
 }
 
+/* The HTLC a pay or pay_parts row says is ours, and in flight. */
+static struct htlc *pay_htlc(struct lightningd_state *dstate,
+			     const struct pubkey *peer_id, u64 htlc_id)
+{
+	struct peer *peer = find_peer(dstate, peer_id);
+	struct htlc *htlc;
+
+	if (!peer)
+		fatal("db_load_pay: unknown peer");
+	htlc = htlc_get(&peer->htlcs, htlc_id, LOCAL);
+	if (!htlc)
+		fatal("db_load_pay: unknown htlc");
+	return htlc;
+}
+
+/* Returns the parts of the multi-path payment rhash, with their ids. */
+static struct htlc **load_pay_parts(struct lightningd_state *dstate,
+				    const tal_t *ctx,
+				    const struct sha256 *rhash,
+				    struct pubkey ***ids)
+{
+	struct htlc **htlcs = tal_arr(ctx, struct htlc *, 0);
+	struct pubkey peer_id;
+	sqlite3_stmt *stmt;
+	size_t n = 0;
+	int err;
+
+	*ids = tal_arr(ctx, struct pubkey *, 0);
+	err = sqlite3_prepare_v2(dstate->db->sql,
+				 "SELECT htlc_peer, htlc_id, ids FROM pay_parts"
+				 " WHERE rhash=?;", -1, &stmt, NULL);
+	if (err != SQLITE_OK)
+		fatal("%s:prepare gave %s:%s", __func__,
+		      sqlite3_errstr(err), sqlite3_errmsg(dstate->db->sql));
+	sqlite3_bind_blob(stmt, 1, rhash, sizeof(*rhash), SQLITE_TRANSIENT);
+
+	while ((err = sqlite3_step(stmt)) != SQLITE_DONE) {
+		if (err != SQLITE_ROW)
+			fatal("%s:step gave %s:%s", __func__,
+			      sqlite3_errstr(err),
+			      sqlite3_errmsg(dstate->db->sql));
+		pubkey_from_sql(dstate->secpctx, stmt, 0, &peer_id);
+		tal_resize(&htlcs, n+1);
+		tal_resize(ids, n+1);
+		htlcs[n] = pay_htlc(dstate, &peer_id,
+				    sqlite3_column_int64(stmt, 1));
+		(*ids)[n] = pubkeys_from_arr(ctx, dstate->secpctx,
+					     sqlite3_column_blob(stmt, 2),
+					     sqlite3_column_bytes(stmt, 2));
+		n++;
+	}
+	sqlite3_finalize(stmt);
+	return htlcs;
+}
+
+static void load_pay_row(struct lightningd_state *dstate, const tal_t *ctx,
+			 sqlite3_stmt *stmt)
+{
+	struct sha256 rhash;
+	struct htlc *htlc;
+	struct pubkey *peer_id;
+	u64 htlc_id, msatoshi;
+	struct pubkey *ids;
+	struct rval *r;
+	void *fail;
+	struct htlc **parts;
+	struct pubkey **part_ids;
+	size_t i;
+
+	if (sqlite3_column_count(stmt) != 7)
+		fatal("db_load_pay:step gave %i cols, not 7",
+		      sqlite3_column_count(stmt));
+
+	sha256_from_sql(stmt, 0, &rhash);
+	msatoshi = sqlite3_column_int64(stmt, 1);
+	ids = pubkeys_from_arr(ctx, dstate->secpctx,
+			       sqlite3_column_blob(stmt, 2),
+			       sqlite3_column_bytes(stmt, 2));
+	if (sqlite3_column_type(stmt, 3) == SQLITE_NULL)
+		peer_id = NULL;
+	else {
+		peer_id = tal(ctx, struct pubkey);
+		pubkey_from_sql(dstate->secpctx, stmt, 3, peer_id);
+	}
+	htlc_id = sqlite3_column_int64(stmt, 4);
+	if (sqlite3_column_type(stmt, 5) == SQLITE_NULL)
+		r = NULL;
+	else {
+		r = tal(ctx, struct rval);
+		from_sql_blob(stmt, 5, r, sizeof(*r));
+	}
+	fail = tal_sql_blob(ctx, stmt, 6);
+	/* Exactly one of these must be set. */
+	if (!fail + !peer_id + !r != 2)
+		fatal("db_load_pay: not exactly one set:"
+		      " fail=%p peer_id=%p r=%p",
+		      fail, peer_id, r);
+	/* A multi-path payment's row names its first part, which may be
+	 * done already: the ones left are in pay_parts. */
+	parts = load_pay_parts(dstate, ctx, &rhash, &part_ids);
+	if (peer_id && !tal_count(parts))
+		htlc = pay_htlc(dstate, peer_id, htlc_id);
+	else
+		htlc = NULL;
+
+	if (!pay_add(dstate, &rhash, msatoshi, ids, htlc, fail, r))
+		fatal("db_load_pay: could not add pay");
+	for (i = 0; i < tal_count(parts); i++)
+		if (!pay_add_part(dstate, &rhash, part_ids[i], parts[i]))
+			fatal("db_load_pay: could not add pay part");
+}
+
+/* Only the ones in progress (or with parts which are, even if another
+ * succeeded): db_load_pay_command gets the rest. */
 static void db_load_pay(struct lightningd_state *dstate)
 {
 	int err;
 	sqlite3_stmt *stmt;
 	char *ctx = tal(dstate, char);
 
-	err = sqlite3_prepare_v2(dstate->db->sql, "SELECT * FROM pay;", -1,
-				 &stmt, NULL);
+	err = sqlite3_prepare_v2(dstate->db->sql,
+				 "SELECT * FROM pay WHERE htlc_peer IS NOT NULL"
+				 " OR rhash IN (SELECT rhash FROM pay_parts);",
+				 -1, &stmt, NULL);
 
 	if (err != SQLITE_OK)
 		fatal("db_load_pay:prepare gave %s:%s",
 		      sqlite3_errstr(err), sqlite3_errmsg(dstate->db->sql));
 
 	while ((err = sqlite3_step(stmt)) != SQLITE_DONE) {
-		struct sha256 rhash;
-		struct htlc *htlc;
-		struct pubkey *peer_id;
-		u64 htlc_id, msatoshi;
-		struct pubkey *ids;
-		struct rval *r;
-		void *fail;
-
 		if (err != SQLITE_ROW)
 			fatal("db_load_pay:step gave %s:%s",
 			      sqlite3_errstr(err),
 			      sqlite3_errmsg(dstate->db->sql));
-		if (sqlite3_column_count(stmt) != 7)
-			fatal("db_load_pay:step gave %i cols, not 7",
-			      sqlite3_column_count(stmt));
-
-		sha256_from_sql(stmt, 0, &rhash);
-		msatoshi = sqlite3_column_int64(stmt, 1);
-		ids = pubkeys_from_arr(ctx, dstate->secpctx,
-				       sqlite3_column_blob(stmt, 2),
-				       sqlite3_column_bytes(stmt, 2));
-		if (sqlite3_column_type(stmt, 3) == SQLITE_NULL)
-			peer_id = NULL;
-		else {
-			peer_id = tal(ctx, struct pubkey);
-			pubkey_from_sql(dstate->secpctx, stmt, 3, peer_id);
-		}
-		htlc_id = sqlite3_column_int64(stmt, 4);
-		if (sqlite3_column_type(stmt, 5) == SQLITE_NULL)
-			r = NULL;
-		else {
-			r = tal(ctx, struct rval);
-			from_sql_blob(stmt, 5, r, sizeof(*r));
-		}
-		fail = tal_sql_blob(ctx, stmt, 6);
-		/* Exactly one of these must be set. */
-		if (!fail + !peer_id + !r != 2)
-			fatal("db_load_pay: not exactly one set:"
-			      " fail=%p peer_id=%p r=%p",
-			      fail, peer_id, r);
-		if (peer_id) {
-			struct peer *peer = find_peer(dstate, peer_id);
-			if (!peer)
-				fatal("db_load_pay: unknown peer");
-			htlc = htlc_get(&peer->htlcs, htlc_id, LOCAL);
-			if (!htlc)
-				fatal("db_load_pay: unknown htlc");
-		} else
-			htlc = NULL;
-
-		if (!pay_add(dstate, &rhash, msatoshi, ids, htlc, fail, r))
-			fatal("db_load_pay: could not add pay");
+		load_pay_row(dstate, ctx, stmt);
 	}
+	sqlite3_finalize(stmt);
 	tal_free(ctx);
 }
 
+bool db_load_pay_command(struct lightningd_state *dstate,
+			 const struct sha256 *rhash)
+{
+	int err;
+	sqlite3_stmt *stmt;
+	char *ctx;
+	bool found;
+
+	/* Everything must be written before we can read it back (even
+	 * with commits held, the writer may have some). */
+	db_outside_transaction(dstate);
+	wait_for_writer(dstate->db);
+
+	err = sqlite3_prepare_v2(dstate->db->sql,
+				 "SELECT * FROM pay WHERE rhash=?;", -1,
+				 &stmt, NULL);
+	if (err != SQLITE_OK)
+		fatal("%s:prepare gave %s:%s", __func__,
+		      sqlite3_errstr(err), sqlite3_errmsg(dstate->db->sql));
+	sqlite3_bind_blob(stmt, 1, rhash, sizeof(*rhash), SQLITE_TRANSIENT);
+
+	err = sqlite3_step(stmt);
+	if (err == SQLITE_ROW) {
+		ctx = tal(dstate, char);
+		load_pay_row(dstate, ctx, stmt);
+		tal_free(ctx);
+		found = true;
+	} else if (err == SQLITE_DONE)
+		found = false;
+	else
+		fatal("%s:step gave %s:%s", __func__,
+		      sqlite3_errstr(err), sqlite3_errmsg(dstate->db->sql));
+	sqlite3_finalize(stmt);
+	return found;
+}
+
 static void db_load_invoice(struct lightningd_state *dstate)
 {
 	int err;
 	sqlite3_stmt *stmt;
 	char *ctx = tal(dstate, char);
 
-	err = sqlite3_prepare_v2(dstate->db->sql, "SELECT * FROM invoice;", -1,
+	err = sqlite3_prepare_v2(dstate->db->sql,
+				 "SELECT * FROM invoice ORDER BY paid_num;", -1,
 				 &stmt, NULL);
 
 	if (err != SQLITE_OK)
@@ -1093,22 +1900,23 @@ static void db_load_invoice(struct lightningd_state *dstate)
 
 	while ((err = sqlite3_step(stmt)) != SQLITE_DONE) {
 		struct rval r;
-		u64 msatoshi, paid_num;
+		u64 msatoshi, paid_num, expiry;
 		const char *label;
 
 		if (err != SQLITE_ROW)
 			fatal("db_load_invoice:step gave %s:%s",
 			      sqlite3_errstr(err),
 			      sqlite3_errmsg(dstate->db->sql));
-		if (sqlite3_column_count(stmt) != 4)
-			fatal("db_load_invoice:step gave %i cols, not 4",
+		if (sqlite3_column_count(stmt) != 5)
+			fatal("db_load_invoice:step gave %i cols, not 5",
 			      sqlite3_column_count(stmt));
 
 		from_sql_blob(stmt, 0, &r, sizeof(r));
 		msatoshi = sqlite3_column_int64(stmt, 1);
 		label = (const char *)sqlite3_column_text(stmt, 2);
 		paid_num = sqlite3_column_int64(stmt, 3);
-		invoice_add(dstate, &r, msatoshi, label, paid_num);
+		expiry = sqlite3_column_int64(stmt, 4);
+		invoice_add(dstate, &r, msatoshi, label, paid_num, expiry);
 	}
 	tal_free(ctx);
 }
@@ -1148,17 +1956,360 @@ static void db_load_addresses(struct lightningd_state *dstate)
 	tal_free(ctx);
 }
 
+static const char *sync_names[] = { "off", "normal", "full", "extra" };
+
+char *opt_set_db_synchronous(const char *arg, enum db_synchronous *sync)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(sync_names); i++) {
+		if (streq(arg, sync_names[i])) {
+			*sync = i;
+			return NULL;
+		}
+	}
+	return tal_fmt(NULL, "Unknown synchronous mode '%s'", arg);
+}
+
+void opt_show_db_synchronous(char buf[OPT_SHOW_LEN],
+			     const enum db_synchronous *sync)
+{
+	snprintf(buf, OPT_SHOW_LEN, "%s", sync_names[*sync]);
+}
+
+/* These are per-connection, so we set them every time we open it. */
+static void db_set_durability(struct lightningd_state *dstate)
+{
+	const struct config *config = &dstate->config;
+	const char *mode = config->db_wal ? "wal" : "delete";
+	sqlite3_stmt *stmt;
+	int err;
+
+	/* This answers with the mode we actually got. */
+	err = sqlite3_prepare_v2(dstate->db->sql,
+				 config->db_wal ? "PRAGMA journal_mode=WAL;"
+				 : "PRAGMA journal_mode=DELETE;",
+				 -1, &stmt, NULL);
+	if (err != SQLITE_OK)
+		fatal("%s:prepare gave %s:%s", __func__, sqlite3_errstr(err),
+		      sqlite3_errmsg(dstate->db->sql));
+	if (sqlite3_step(stmt) != SQLITE_ROW
+	    || !streq(sqlite3_column_str(stmt, 0), mode))
+		fatal("%s: could not set journal_mode=%s: %s", __func__,
+		      mode, sqlite3_errmsg(dstate->db->sql));
+	sqlite3_finalize(stmt);
+
+	if (!db_exec(__func__, dstate,
+		     "PRAGMA synchronous=%s; PRAGMA wal_autocheckpoint=%u;",
+		     sync_names[config->db_synchronous],
+		     config->db_wal_checkpoint))
+		fatal("%s: %s", __func__, dstate->db->err);
+
+	log_debug(dstate->base_log, "%s: journal_mode=%s synchronous=%s",
+		  DB_FILE, mode, sync_names[config->db_synchronous]);
+}
+
+/* We used to keep each shachain as one blob in a shachain table, and
+ * rewrite all of it every time. */
+static void db_migrate_shachain(struct lightningd_state *dstate)
+{
+	sqlite3 *sql = dstate->db->sql;
+	sqlite3_stmt *stmt;
+	int err;
+
+	err = sqlite3_prepare_v2(sql, "SELECT name FROM sqlite_master"
+				 " WHERE type='table' AND name='shachain';",
+				 -1, &stmt, NULL);
+	if (err != SQLITE_OK)
+		fatal("%s:prepare gave %s:%s", __func__,
+		      sqlite3_errstr(err), sqlite3_errmsg(sql));
+	err = sqlite3_step(stmt);
+	sqlite3_finalize(stmt);
+	if (err == SQLITE_DONE)
+		return;
+
+	log_info(dstate->base_log, "Converting shachains to shachain_known");
+	if (!db_exec(__func__, dstate, "BEGIN IMMEDIATE; %s",
+		     TABLE(shachain_known,
+			   SQL_PUBKEY(peer), SQL_U32(pos), SQL_U64(idx),
+			   SQL_SHA256(hash),
+			   "PRIMARY KEY(peer, pos)")))
+		fatal("%s: %s", __func__, dstate->db->err);
+
+	err = sqlite3_prepare_v2(sql, "SELECT * FROM shachain;", -1, &stmt,
+				 NULL);
+	if (err != SQLITE_OK)
+		fatal("%s:prepare gave %s:%s", __func__,
+		      sqlite3_errstr(err), sqlite3_errmsg(sql));
+	while ((err = sqlite3_step(stmt)) == SQLITE_ROW) {
+		struct shachain chain;
+		unsigned int pos;
+
+		if (!delinearize_shachain(&chain,
+					  sqlite3_column_blob(stmt, 1),
+					  sqlite3_column_bytes(stmt, 1)))
+			fatal("%s:invalid shachain", __func__);
+
+		for (pos = 0; pos < chain.num_valid; pos++) {
+			struct db_op *op;
+
+			op = db_prepare(__func__, dstate,
+					"INSERT INTO shachain_known VALUES (?, ?, ?, ?);");
+			db_bind_blob(op, 1, sqlite3_column_blob(stmt, 0),
+				     sqlite3_column_bytes(stmt, 0));
+			db_bind_int(op, 2, pos);
+			db_bind_int(op, 3, chain.known[pos].index);
+			db_bind_blob(op, 4, &chain.known[pos].hash,
+				     sizeof(chain.known[pos].hash));
+			if (!db_step(__func__, dstate, op))
+				fatal("%s: %s", __func__, dstate->db->err);
+		}
+	}
+	if (err != SQLITE_DONE)
+		fatal("%s:step gave %s:%s", __func__,
+		      sqlite3_errstr(err), sqlite3_errmsg(sql));
+	sqlite3_finalize(stmt);
+
+	if (!db_exec(__func__, dstate, "DROP TABLE shachain; COMMIT;"))
+		fatal("%s: %s", __func__, dstate->db->err);
+}
+
+/* Older databases kept state names, and every dead HTLC, in htlcs. */
+static void db_migrate_htlcs(struct lightningd_state *dstate)
+{
+	int err;
+	sqlite3_stmt *stmt;
+	sqlite3 *sql = dstate->db->sql;
+	char *cases = tal_strdup(dstate, "");
+	enum htlc_state s;
+
+	err = sqlite3_prepare_v2(sql, "SELECT name FROM sqlite_master"
+				 " WHERE type='table' AND name='htlcs_archive';",
+				 -1, &stmt, NULL);
+	if (err != SQLITE_OK)
+		fatal("%s:prepare gave %s:%s", __func__,
+		      sqlite3_errstr(err), sqlite3_errmsg(sql));
+	err = sqlite3_step(stmt);
+	sqlite3_finalize(stmt);
+	if (err == SQLITE_ROW) {
+		tal_free(cases);
+		return;
+	}
+
+	log_info(dstate->base_log, "Archiving dead HTLCs");
+	for (s = 0; s < HTLC_STATE_INVALID; s++)
+		tal_append_fmt(&cases, " WHEN '%s' THEN %u",
+			       htlc_state_name(s), s);
+
+	if (!db_exec(__func__, dstate,
+		     "BEGIN IMMEDIATE; %s"
+		     "INSERT INTO htlcs_new SELECT peer, id,"
+		     " CASE state%s ELSE -1 END, msatoshi, expiry, rhash, r,"
+		     " routing, src_peer, src_id, fail FROM htlcs;"
+		     "DROP TABLE htlcs;"
+		     "ALTER TABLE htlcs_new RENAME TO htlcs; %s"
+		     "INSERT INTO htlc_totals SELECT peer,"
+		     " SUM(CASE WHEN state=%u AND r IS NOT NULL"
+		     "     THEN msatoshi ELSE 0 END),"
+		     " SUM(CASE WHEN state=%u AND r IS NOT NULL"
+		     "     THEN msatoshi ELSE 0 END),"
+		     " MAX(CASE WHEN state=%u THEN id + 1 ELSE 0 END)"
+		     " FROM htlcs WHERE state IN (%u, %u) GROUP BY peer;"
+		     "INSERT INTO htlcs_archive"
+		     " SELECT * FROM htlcs WHERE state IN (%u, %u);"
+		     "DELETE FROM htlcs WHERE state IN (%u, %u);"
+		     "COMMIT;",
+		     TABLE(htlcs_new, HTLC_COLUMNS), cases, HTLC_ARCHIVE_TABLES,
+		     RCVD_REMOVE_ACK_REVOCATION, SENT_REMOVE_ACK_REVOCATION,
+		     RCVD_REMOVE_ACK_REVOCATION,
+		     RCVD_REMOVE_ACK_REVOCATION, SENT_REMOVE_ACK_REVOCATION,
+		     RCVD_REMOVE_ACK_REVOCATION, SENT_REMOVE_ACK_REVOCATION,
+		     RCVD_REMOVE_ACK_REVOCATION, SENT_REMOVE_ACK_REVOCATION))
+		fatal("%s: %s", __func__, dstate->db->err);
+	tal_free(cases);
+}
+
+static void db_migrate_invoices(struct lightningd_state *dstate)
+{
+	int err;
+	sqlite3_stmt *stmt;
+	sqlite3 *sql = dstate->db->sql;
+
+	err = sqlite3_prepare_v2(sql, "SELECT name FROM sqlite_master"
+				 " WHERE type='table' AND name='invoice_archive';",
+				 -1, &stmt, NULL);
+	if (err != SQLITE_OK)
+		fatal("%s:prepare gave %s:%s", __func__,
+		      sqlite3_errstr(err), sqlite3_errmsg(sql));
+	err = sqlite3_step(stmt);
+	sqlite3_finalize(stmt);
+	if (err == SQLITE_ROW)
+		return;
+
+	log_info(dstate->base_log, "Adding invoice expiry");
+	if (!db_exec(__func__, dstate,
+		     "BEGIN IMMEDIATE; %s"
+		     "INSERT INTO invoice_new"
+		     " SELECT r, msatoshi, label, paid_num, 0 FROM invoice;"
+		     "DROP TABLE invoice;"
+		     "ALTER TABLE invoice_new RENAME TO invoice; %s"
+		     "COMMIT;",
+		     TABLE(invoice_new, INVOICE_COLUMNS),
+		     TABLE(invoice_archive, INVOICE_COLUMNS)))
+		fatal("%s: %s", __func__, dstate->db->err);
+}
+
+/* sha256(x), for db_migrate_blobs. */
+static void sql_sha256(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+	struct sha256 h;
+
+	if (sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+		sqlite3_result_null(ctx);
+		return;
+	}
+	sha256(&h, sqlite3_value_blob(argv[0]), sqlite3_value_bytes(argv[0]));
+	sqlite3_result_blob(ctx, &h, sizeof(h), SQLITE_TRANSIENT);
+}
+
+/* Older databases kept each HTLC's onion in its row. */
+static void db_migrate_blobs(struct lightningd_state *dstate)
+{
+	int err;
+	sqlite3_stmt *stmt;
+	sqlite3 *sql = dstate->db->sql;
+
+	err = sqlite3_prepare_v2(sql, "SELECT name FROM sqlite_master"
+				 " WHERE type='table' AND name='blobs';",
+				 -1, &stmt, NULL);
+	if (err != SQLITE_OK)
+		fatal("%s:prepare gave %s:%s", __func__,
+		      sqlite3_errstr(err), sqlite3_errmsg(sql));
+	err = sqlite3_step(stmt);
+	sqlite3_finalize(stmt);
+	if (err == SQLITE_ROW)
+		return;
+
+	log_info(dstate->base_log, "Moving HTLC onions to blobs");
+	err = sqlite3_create_function(sql, "sha256", 1, SQLITE_UTF8, NULL,
+				      sql_sha256, NULL, NULL);
+	if (err != SQLITE_OK)
+		fatal("%s:create_function gave %s:%s", __func__,
+		      sqlite3_errstr(err), sqlite3_errmsg(sql));
+	if (!db_exec(__func__, dstate,
+		     "BEGIN IMMEDIATE; %s"
+		     "INSERT OR IGNORE INTO blobs"
+		     " SELECT sha256(routing), routing FROM htlcs"
+		     " WHERE routing IS NOT NULL;"
+		     "UPDATE htlcs SET routing=sha256(routing);"
+		     "UPDATE htlcs_archive SET routing=sha256(routing);"
+		     "COMMIT;", BLOB_TABLES))
+		fatal("%s: %s", __func__, dstate->db->err);
+	sqlite3_create_function(sql, "sha256", 1, SQLITE_UTF8, NULL,
+				NULL, NULL, NULL);
+}
+
+static void db_migrate_wallet_utxos(struct lightningd_state *dstate)
+{
+	if (!db_exec(__func__, dstate,
+		     TABLE_IF_NEW(wallet_utxos, WALLET_UTXO_COLUMNS)))
+		fatal("%s: %s", __func__, dstate->db->err);
+}
+
+static void db_migrate_pay_parts(struct lightningd_state *dstate)
+{
+	if (!db_exec(__func__, dstate,
+		     TABLE_IF_NEW(pay_parts, PAY_PART_COLUMNS)))
+		fatal("%s: %s", __func__, dstate->db->err);
+}
+
 static void db_load(struct lightningd_state *dstate)
 {
+	struct timeabs start = time_now();
+
 	db_load_wallet(dstate);
+	db_load_wallet_utxos(dstate);
 	db_load_addresses(dstate);
+	start = startup_phase(dstate, "db_load_wallet", start, 0);
+	/* Each of its tables is a phase too. */
 	db_load_peers(dstate);
+	start = startup_phase(dstate, "db_load_peers", start, 0);
 	db_load_pay(dstate);
+	start = startup_phase(dstate, "db_load_pay", start, 0);
 	db_load_invoice(dstate);
+	startup_phase(dstate, "db_load_invoice", start, 0);
+}
+
+static bool db_pragma_num(struct db *db, const char *query, s64 *val)
+{
+	sqlite3_stmt *stmt;
+	bool ok;
+
+	if (sqlite3_prepare_v2(db->sql, query, -1, &stmt, NULL) != SQLITE_OK)
+		return false;
+	ok = (sqlite3_step(stmt) == SQLITE_ROW);
+	if (ok)
+		*val = sqlite3_column_int64(stmt, 0);
+	sqlite3_finalize(stmt);
+	return ok;
+}
+
+/* A few pages at a time, so nobody waits long for the db. */
+static void vacuum_step(struct lightningd_state *dstate)
+{
+	struct db *db = dstate->db;
+	s64 before, after, pages;
+
+	new_reltimer(dstate, db, time_from_sec(DB_VACUUM_SECS),
+		     vacuum_step, dstate);
+
+	/* Never inside anyone's transaction, or under the writer. */
+	if (db->in_transaction || db->in_group || db->open
+	    || writer_busy(db) || db->backup)
+		return;
+
+	if (!db_pragma_num(db, "PRAGMA freelist_count;", &before) || !before)
+		return;
+	if (!db_exec(__func__, dstate, "PRAGMA incremental_vacuum(%u);",
+		     dstate->config.db_vacuum_pages))
+		return;
+	if (!db_pragma_num(db, "PRAGMA freelist_count;", &after)
+	    || !db_pragma_num(db, "PRAGMA page_count;", &pages))
+		return;
+
+	db->vacuumed += before - after;
+	log_debug(dstate->base_log,
+		  "%s: vacuum freed %"PRId64" pages, %"PRId64" free of %"PRId64,
+		  DB_FILE, before - after, after, pages);
+}
+
+static void start_vacuum(struct lightningd_state *dstate)
+{
+	s64 mode;
+
+	if (!dstate->config.db_vacuum_pages)
+		return;
+
+	/* Only a full VACUUM can change it for an existing database. */
+	if (!db_pragma_num(dstate->db, "PRAGMA auto_vacuum;", &mode)
+	    || mode != DB_AUTO_VACUUM_INCREMENTAL) {
+		log_info(dstate->base_log,
+			 "%s predates incremental vacuum: not vacuuming",
+			 DB_FILE);
+		return;
+	}
+	new_reltimer(dstate, dstate->db, time_from_sec(DB_VACUUM_SECS),
+		     vacuum_step, dstate);
+}
+
+u64 db_vacuumed_pages(const struct lightningd_state *dstate)
+{
+	return dstate->db->vacuumed;
 }
 
 void db_init(struct lightningd_state *dstate)
 {
+	char *filename;
 	int err;
 	bool created = false;
 
@@ -1167,14 +2318,15 @@ void db_init(struct lightningd_state *dstate)
 		      SQLITE_VERSION_NUMBER, sqlite3_libversion_number());
 
 	dstate->db = tal(dstate, struct db);
+	filename = node_file(dstate->db, dstate, DB_FILE);
 
-	err = sqlite3_open_v2(DB_FILE, &dstate->db->sql,
+	err = sqlite3_open_v2(filename, &dstate->db->sql,
 			      SQLITE_OPEN_READWRITE, NULL);
 	if (err != SQLITE_OK) {
 		log_unusual(dstate->base_log,
 			    "Error opening %s (%s), trying to create",
 			    DB_FILE, sqlite3_errstr(err));
-		err = sqlite3_open_v2(DB_FILE, &dstate->db->sql,
+		err = sqlite3_open_v2(filename, &dstate->db->sql,
 				      SQLITE_OPEN_READWRITE
 				      | SQLITE_OPEN_CREATE, NULL);
 		if (err != SQLITE_OK)
@@ -1183,12 +2335,43 @@ void db_init(struct lightningd_state *dstate)
 		created = true;
 	}
 
+	strmap_init(&dstate->db->stmts);
 	tal_add_destructor(dstate->db, close_db);
 	dstate->db->in_transaction = false;
+	dstate->db->txn_peer = NULL;
+	dstate->db->vacuumed = 0;
+	dstate->db->in_group = dstate->db->held = false;
+	dstate->db->batches = dstate->db->batches_done = 0;
+	dstate->db->open = NULL;
+	dstate->db->backup = NULL;
+	dstate->db->repl = NULL;
+	dstate->db->now.args = NULL;
+	dstate->db->have_writer = false;
 	dstate->db->err = NULL;
 
+	/* Only takes before anything's written, even journal_mode=WAL. */
+	if (created
+	    && !db_exec(__func__, dstate, "PRAGMA auto_vacuum=INCREMENTAL;"))
+		fatal("%s", dstate->db->err);
+
+	db_set_durability(dstate);
+	if (dstate->config.db_async)
+		start_writer(dstate);
+	if (dstate->config.db_replicate)
+		start_replication(dstate);
+
 	if (!created) {
+		struct timeabs start = time_now();
+
+		db_migrate_shachain(dstate);
+		db_migrate_htlcs(dstate);
+		db_migrate_invoices(dstate);
+		db_migrate_wallet_utxos(dstate);
+		db_migrate_blobs(dstate);
+		db_migrate_pay_parts(dstate);
+		startup_phase(dstate, "db_migrate", start, 0);
 		db_load(dstate);
+		start_vacuum(dstate);
 		return;
 	}
 
@@ -1196,28 +2379,23 @@ void db_init(struct lightningd_state *dstate)
 	if (!db_exec(__func__, dstate,
 		     TABLE(wallet,
 			   SQL_PRIVKEY(privkey))
+		     TABLE(wallet_utxos, WALLET_UTXO_COLUMNS)
 		     TABLE(pay,
 			   SQL_RHASH(rhash), SQL_U64(msatoshi),
 			   SQL_BLOB(ids), SQL_PUBKEY(htlc_peer),
 			   SQL_U64(htlc_id), SQL_R(r), SQL_FAIL(fail),
 			   "PRIMARY KEY(rhash)")
-		     TABLE(invoice,
-			   SQL_R(r), SQL_U64(msatoshi), SQL_INVLABEL(label),
-			   SQL_U64(paid_num),
-			   "PRIMARY KEY(label)")
+		     TABLE(pay_parts, PAY_PART_COLUMNS)
+		     TABLE(invoice, INVOICE_COLUMNS)
+		     TABLE(invoice_archive, INVOICE_COLUMNS)
 		     TABLE(anchors,
 			   SQL_PUBKEY(peer),
 			   SQL_TXID(txid), SQL_U32(idx), SQL_U64(amount),
 			   SQL_U32(ok_depth), SQL_U32(min_depth),
 			   SQL_BOOL(ours))
-		     /* FIXME: state in key is overkill: just need side */
-		     TABLE(htlcs,
-			   SQL_PUBKEY(peer), SQL_U64(id),
-			   SQL_STATENAME(state), SQL_U64(msatoshi),
-			   SQL_U32(expiry), SQL_RHASH(rhash), SQL_R(r),
-			   SQL_ROUTING(routing), SQL_PUBKEY(src_peer),
-			   SQL_U64(src_id), SQL_BLOB(fail),
-			   "PRIMARY KEY(peer, id, state)")
+		     TABLE(htlcs, HTLC_COLUMNS)
+		     HTLC_ARCHIVE_TABLES
+		     BLOB_TABLES
 		     TABLE(feechanges,
 			   SQL_PUBKEY(peer), SQL_STATENAME(state),
 			   SQL_U32(fee_rate),
@@ -1228,9 +2406,10 @@ void db_init(struct lightningd_state *dstate)
 			   SQL_U64(xmit_order), SQL_SIGNATURE(sig),
 			   SQL_SHA256(prev_revocation_hash),
 			   "PRIMARY KEY(peer, side)")
-		     TABLE(shachain,
-			   SQL_PUBKEY(peer), SQL_SHACHAIN(shachain),
-			   "PRIMARY KEY(peer)")
+		     TABLE(shachain_known,
+			   SQL_PUBKEY(peer), SQL_U32(pos), SQL_U64(idx),
+			   SQL_SHA256(hash),
+			   "PRIMARY KEY(peer, pos)")
 		     TABLE(their_visible_state,
 			   SQL_PUBKEY(peer), SQL_BOOL(offered_anchor),
 			   SQL_PUBKEY(commitkey), SQL_PUBKEY(finalkey),
@@ -1261,54 +2440,65 @@ void db_init(struct lightningd_state *dstate)
 			   SQL_PUBKEY(peer), SQL_STATENAME(state),
 			   SQL_BOOL(offered_anchor), SQL_U32(our_feerate),
 			   "PRIMARY KEY(peer)"))) {
-		unlink(DB_FILE);
+		unlink(filename);
 		fatal("%s", dstate->db->err);
 	}
+	start_vacuum(dstate);
+}
+
+static void save_shachain_entry(struct peer *peer, unsigned int pos)
+{
+	const struct shachain *chain = &peer->their_preimages;
+	struct db_op *stmt;
+
+	stmt = db_prepare(__func__, peer->dstate,
+			  "INSERT OR REPLACE INTO shachain_known VALUES (?, ?, ?, ?);");
+	db_bind_pubkey(peer->dstate, stmt, 1, peer->id);
+	db_bind_int(stmt, 2, pos);
+	db_bind_int(stmt, 3, chain->known[pos].index);
+	db_bind_blob(stmt, 4, &chain->known[pos].hash,
+		     sizeof(chain->known[pos].hash));
+	db_step(__func__, peer->dstate, stmt);
 }
 
 void db_set_anchor(struct peer *peer)
 {
 	const char *ctx = tal(peer, char);
 	const char *peerid;
+	struct commit_info *ci[] = { peer->local.commit, peer->remote.commit };
+	enum side sides[] = { LOCAL, REMOTE };
+	struct db_op *stmt;
+	size_t i;
 
 	assert(peer->dstate->db->in_transaction);
 	peerid = pubkey_to_hexstr(ctx, peer->dstate->secpctx, peer->id);
 	log_debug(peer->log, "%s(%s)", __func__, peerid);
 
-	db_exec(__func__, peer->dstate, 
-		"INSERT INTO anchors VALUES (x'%s', x'%s', %u, %"PRIu64", %i, %u, %s);",
-		peerid,
-		tal_hexstr(ctx, &peer->anchor.txid, sizeof(peer->anchor.txid)),
-		peer->anchor.index,
-		peer->anchor.satoshis,
-		peer->anchor.ok_depth,
-		peer->anchor.min_depth,
-		sql_bool(peer->anchor.ours));
-
-	db_exec(__func__, peer->dstate, 
-		"INSERT INTO commit_info VALUES(x'%s', '%s', 0, x'%s', %"PRIi64", %s, NULL);",
-		peerid,
-		side_to_str(LOCAL),
-		tal_hexstr(ctx, &peer->local.commit->revocation_hash,
-			   sizeof(peer->local.commit->revocation_hash)),
-		peer->local.commit->order,
-		sig_to_sql(ctx, peer->dstate->secpctx,
-			   peer->local.commit->sig));
-
-	db_exec(__func__, peer->dstate, 
-		"INSERT INTO commit_info VALUES(x'%s', '%s', 0, x'%s', %"PRIi64", %s, NULL);",
-		peerid,
-		side_to_str(REMOTE),
-		tal_hexstr(ctx, &peer->remote.commit->revocation_hash,
-			   sizeof(peer->remote.commit->revocation_hash)),
-		peer->remote.commit->order,
-		sig_to_sql(ctx, peer->dstate->secpctx,
-			   peer->remote.commit->sig));
-
-	db_exec(__func__, peer->dstate,
-		"INSERT INTO shachain VALUES (x'%s', x'%s');",
-		peerid,
-		linearize_shachain(ctx, &peer->their_preimages));
+	stmt = db_prepare(__func__, peer->dstate,
+			  "INSERT INTO anchors VALUES (?, ?, ?, ?, ?, ?, ?);");
+	db_bind_pubkey(peer->dstate, stmt, 1, peer->id);
+	db_bind_blob(stmt, 2, &peer->anchor.txid, sizeof(peer->anchor.txid));
+	db_bind_int(stmt, 3, peer->anchor.index);
+	db_bind_int(stmt, 4, peer->anchor.satoshis);
+	db_bind_int(stmt, 5, peer->anchor.ok_depth);
+	db_bind_int(stmt, 6, peer->anchor.min_depth);
+	db_bind_int(stmt, 7, peer->anchor.ours);
+	db_step(__func__, peer->dstate, stmt);
+
+	for (i = 0; i < ARRAY_SIZE(ci); i++) {
+		stmt = db_prepare(__func__, peer->dstate,
+				  "INSERT INTO commit_info VALUES(?, ?, 0, ?, ?, ?, NULL);");
+		db_bind_pubkey(peer->dstate, stmt, 1, peer->id);
+		db_bind_str(stmt, 2, side_to_str(sides[i]));
+		db_bind_blob(stmt, 3, &ci[i]->revocation_hash,
+			     sizeof(ci[i]->revocation_hash));
+		db_bind_int(stmt, 4, ci[i]->order);
+		db_bind_sig(peer->dstate, stmt, 5, ci[i]->sig);
+		db_step(__func__, peer->dstate, stmt);
+	}
+
+	for (i = 0; i < peer->their_preimages.num_valid; i++)
+		save_shachain_entry(peer, i);
 
 	tal_free(ctx);
 }
@@ -1317,23 +2507,23 @@ bool db_set_visible_state(struct peer *peer)
 {
 	const char *errmsg, *ctx = tal(peer, char);
 	const char *peerid = pubkey_to_hexstr(ctx, peer->dstate->secpctx, peer->id);
+	struct db_op *stmt;
 
 	log_debug(peer->log, "%s(%s)", __func__, peerid);
 	db_start_transaction(peer);
 
-	db_exec(__func__, peer->dstate, 
-		"INSERT INTO their_visible_state VALUES (x'%s', %s, x'%s', x'%s', %u, %u, %"PRIu64", x'%s');",
-		peerid,
-		sql_bool(peer->remote.offer_anchor == CMD_OPEN_WITH_ANCHOR),
-		pubkey_to_hexstr(ctx, peer->dstate->secpctx,
-				 &peer->remote.commitkey),
-		pubkey_to_hexstr(ctx, peer->dstate->secpctx,
-				 &peer->remote.finalkey),
-		peer->remote.locktime.locktime,
-		peer->remote.mindepth,
-		peer->remote.commit_fee_rate,
-		tal_hexstr(ctx, &peer->remote.next_revocation_hash,
-			   sizeof(peer->remote.next_revocation_hash)));
+	stmt = db_prepare(__func__, peer->dstate,
+			  "INSERT INTO their_visible_state VALUES (?, ?, ?, ?, ?, ?, ?, ?);");
+	db_bind_pubkey(peer->dstate, stmt, 1, peer->id);
+	db_bind_int(stmt, 2, peer->remote.offer_anchor == CMD_OPEN_WITH_ANCHOR);
+	db_bind_pubkey(peer->dstate, stmt, 3, &peer->remote.commitkey);
+	db_bind_pubkey(peer->dstate, stmt, 4, &peer->remote.finalkey);
+	db_bind_int(stmt, 5, peer->remote.locktime.locktime);
+	db_bind_int(stmt, 6, peer->remote.mindepth);
+	db_bind_int(stmt, 7, peer->remote.commit_fee_rate);
+	db_bind_blob(stmt, 8, &peer->remote.next_revocation_hash,
+		     sizeof(peer->remote.next_revocation_hash));
+	db_step(__func__, peer->dstate, stmt);
 
 	errmsg = db_commit_transaction(peer);
 
@@ -1345,16 +2535,18 @@ void db_update_next_revocation_hash(struct peer *peer)
 {
 	const char *ctx = tal(peer, char);
 	const char *peerid = pubkey_to_hexstr(ctx, peer->dstate->secpctx, peer->id);
+	struct db_op *stmt;
 
 	log_debug(peer->log, "%s(%s):%s", __func__, peerid,
 		tal_hexstr(ctx, &peer->remote.next_revocation_hash,
 			   sizeof(peer->remote.next_revocation_hash)));
 	assert(peer->dstate->db->in_transaction);
-	db_exec(__func__, peer->dstate, 
-		"UPDATE their_visible_state SET next_revocation_hash=x'%s' WHERE peer=x'%s';",
-		tal_hexstr(ctx, &peer->remote.next_revocation_hash,
-			   sizeof(peer->remote.next_revocation_hash)),
-		peerid);
+	stmt = db_prepare(__func__, peer->dstate,
+			  "UPDATE their_visible_state SET next_revocation_hash=? WHERE peer=?;");
+	db_bind_blob(stmt, 1, &peer->remote.next_revocation_hash,
+		     sizeof(peer->remote.next_revocation_hash));
+	db_bind_pubkey(peer->dstate, stmt, 2, peer->id);
+	db_step(__func__, peer->dstate, stmt);
 	tal_free(ctx);
 }
 
@@ -1362,36 +2554,125 @@ bool db_create_peer(struct peer *peer)
 {
 	const char *errmsg, *ctx = tal(peer, char);
 	const char *peerid = pubkey_to_hexstr(ctx, peer->dstate->secpctx, peer->id);
+	const struct privkey *commit_privkey, *final_privkey;
+	const struct sha256 *revocation_seed;
+	struct db_op *stmt;
 
 	log_debug(peer->log, "%s(%s)", __func__, peerid);
 	db_start_transaction(peer);
-	db_exec(__func__, peer->dstate, 
-		"INSERT INTO peers VALUES (x'%s', '%s', %s, %"PRIi64");",
-		peerid,
-		state_name(peer->state),
-		sql_bool(peer->local.offer_anchor == CMD_OPEN_WITH_ANCHOR),
-		peer->local.commit_fee_rate);
-
-	db_exec(__func__, peer->dstate, 
-		"INSERT INTO peer_secrets VALUES (x'%s', %s);",
-		peerid, peer_secrets_for_db(ctx, peer));
+	stmt = db_prepare(__func__, peer->dstate,
+			  "INSERT INTO peers VALUES (?, ?, ?, ?);");
+	db_bind_pubkey(peer->dstate, stmt, 1, peer->id);
+	db_bind_str(stmt, 2, state_name(peer->state));
+	db_bind_int(stmt, 3, peer->local.offer_anchor == CMD_OPEN_WITH_ANCHOR);
+	db_bind_int(stmt, 4, peer->local.commit_fee_rate);
+	db_step(__func__, peer->dstate, stmt);
+
+	peer_secrets_for_db(peer, &commit_privkey, &final_privkey,
+			    &revocation_seed);
+	stmt = db_prepare(__func__, peer->dstate,
+			  "INSERT INTO peer_secrets VALUES (?, ?, ?, ?);");
+	db_bind_pubkey(peer->dstate, stmt, 1, peer->id);
+	db_bind_blob(stmt, 2, commit_privkey, sizeof(*commit_privkey));
+	db_bind_blob(stmt, 3, final_privkey, sizeof(*final_privkey));
+	db_bind_blob(stmt, 4, revocation_seed, sizeof(*revocation_seed));
+	db_step(__func__, peer->dstate, stmt);
 
 	errmsg = db_commit_transaction(peer);
 	tal_free(ctx);
 	return !errmsg;
 }
 
+static void queue_batch(struct lightningd_state *dstate)
+{
+	struct db *db = dstate->db;
+	struct db_batch *b = db->open;
+	size_t i;
+
+	assert(!db->in_transaction);
+	if (!b)
+		return;
+
+	/* This goes into b, since it's open. */
+	db_step(__func__, dstate, db_prepare(__func__, dstate, "COMMIT;"));
+	db->open = NULL;
+	for (i = 0; i < tal_count(b->ops); i++)
+		replicate_op(dstate, b->ops[i]);
+	b->queued = time_now();
+	pthread_mutex_lock(&db->lock);
+	list_add_tail(&db->queue, &b->list);
+	pthread_cond_signal(&db->work);
+	pthread_mutex_unlock(&db->lock);
+}
+
+static void end_of_loop(struct lightningd_state *dstate)
+{
+	if (dstate->config.db_async)
+		queue_batch(dstate);
+	else
+		db_commit_group(dstate);
+}
+
+static void open_batch(struct lightningd_state *dstate)
+{
+	struct db *db = dstate->db;
+
+	db->open = tal(db, struct db_batch);
+	db->open->ops = tal_arr(db->open, struct db_op *, 0);
+	db->batches++;
+	/* This fires once the loop has run everything else. */
+	new_reltimer(dstate, db->open, time_from_sec(0), end_of_loop, dstate);
+	db_step(__func__, dstate,
+		db_prepare(__func__, dstate, "BEGIN IMMEDIATE;"));
+}
+
 void db_start_transaction(struct peer *peer)
 {
 	const char *ctx = tal(peer, char);
 	const char *peerid = pubkey_to_hexstr(ctx, peer->dstate->secpctx, peer->id);
+	struct db *db = peer->dstate->db;
 
 	log_debug(peer->log, "%s(%s)", __func__, peerid);
-	assert(!peer->dstate->db->in_transaction);
-	peer->dstate->db->in_transaction = true;
-	peer->dstate->db->err = tal_free(peer->dstate->db->err);
+	assert(!db->in_transaction);
+	db->in_transaction = true;
+	db->txn_peer = peer;
+	db->err = tal_free(db->err);
+	trace1(db_begin, peer);
+
+	if (peer->dstate->config.db_async) {
+		/* Nothing's written yet, so aborting just forgets. */
+		if (!db->open)
+			open_batch(peer->dstate);
+		db->txn_start = tal_count(db->open->ops);
+		tal_free(ctx);
+		return;
+	}
+
+	if (db->repl) {
+		db->repl->txn_start = tal_count(db->repl->pending);
+		db->repl->txn_start_num = db->repl->num_pending;
+	}
 
-	db_exec(__func__, peer->dstate, "BEGIN IMMEDIATE;");
+	if (!peer->dstate->config.db_group_commit && !db->in_group) {
+		db_step(__func__, peer->dstate,
+			db_prepare(__func__, peer->dstate, "BEGIN IMMEDIATE;"));
+		tal_free(ctx);
+		return;
+	}
+
+	/* First one this time around the loop opens the real transaction. */
+	if (!db->in_group) {
+		db->in_group = db_step(__func__, peer->dstate,
+				       db_prepare(__func__, peer->dstate,
+						  "BEGIN IMMEDIATE;"));
+		if (db->in_group) {
+			db->batches++;
+			new_reltimer(peer->dstate, db, time_from_sec(0),
+				     end_of_loop, peer->dstate);
+		}
+	}
+	db_step(__func__, peer->dstate,
+		db_prepare(__func__, peer->dstate, "SAVEPOINT peer;"));
 	tal_free(ctx);
 }
 
@@ -1399,11 +2680,43 @@ void db_abort_transaction(struct peer *peer)
 {
 	const char *ctx = tal(peer, char);
 	const char *peerid = pubkey_to_hexstr(ctx, peer->dstate->secpctx, peer->id);
+	struct db *db = peer->dstate->db;
+	size_t i;
 
 	log_debug(peer->log, "%s(%s)", __func__, peerid);
-	assert(peer->dstate->db->in_transaction);
-	peer->dstate->db->in_transaction = false;
-	db_exec(__func__, peer->dstate, "ROLLBACK;");
+	assert(db->in_transaction);
+	db->in_transaction = false;
+
+	if (peer->dstate->config.db_async) {
+		for (i = db->txn_start; i < tal_count(db->open->ops); i++)
+			tal_free(db->open->ops[i]);
+		tal_resize(&db->open->ops, db->txn_start);
+		tal_free(ctx);
+		return;
+	}
+
+	/* The standby never sees what we didn't commit. */
+	if (db->repl) {
+		tal_resize(&db->repl->pending, db->repl->txn_start);
+		db->repl->num_pending = db->repl->txn_start_num;
+	}
+
+	if (!db->in_group) {
+		db_step(__func__, peer->dstate,
+			db_prepare(__func__, peer->dstate, "ROLLBACK;"));
+		tal_free(ctx);
+		return;
+	}
+
+	db_step(__func__, peer->dstate,
+		db_prepare(__func__, peer->dstate, "ROLLBACK TO peer;"));
+	db_step(__func__, peer->dstate,
+		db_prepare(__func__, peer->dstate, "RELEASE peer;"));
+
+	/* Some errors make sqlite roll back everything, including other
+	 * peers' updates which we've already acted on. */
+	if (sqlite3_get_autocommit(db->sql))
+		fatal("%s: group transaction lost: %s", __func__, db->err);
 	tal_free(ctx);
 }
 
@@ -1411,51 +2724,140 @@ const char *db_commit_transaction(struct peer *peer)
 {
 	const char *ctx = tal(peer, char);
 	const char *peerid = pubkey_to_hexstr(ctx, peer->dstate->secpctx, peer->id);
+	struct db *db = peer->dstate->db;
+	struct timeabs start = time_now();
 
 	log_debug(peer->log, "%s(%s)", __func__, peerid);
-	assert(peer->dstate->db->in_transaction);
-	if (!db_exec(__func__, peer->dstate, "COMMIT;"))
+	assert(db->in_transaction);
+	trace1(db_commit, peer);
+	if (peer->dstate->config.db_async)
+		/* Any error will be the writer's, and fatal. */
+		db->in_transaction = false;
+	else if (!db_step(__func__, peer->dstate,
+			  db_prepare(__func__, peer->dstate,
+				     db->in_group ? "RELEASE peer;" : "COMMIT;")))
 		db_abort_transaction(peer);
-	else
-		peer->dstate->db->in_transaction = false;
+	else {
+		db->in_transaction = false;
+		/* Otherwise it's only written with the group. */
+		if (!db->in_group)
+			stats_latency(peer->dstate, STATS_DB_COMMIT, start);
+	}
 	tal_free(ctx);
 
-	return peer->dstate->db->err;
+	return db->err;
+}
+
+void db_commit_group(struct lightningd_state *dstate)
+{
+	struct db *db = dstate->db;
+	struct timeabs start;
+
+	assert(!db->in_transaction);
+	if (db->have_writer) {
+		queue_batch(dstate);
+		wait_for_writer(db);
+		reap_batches(dstate);
+		return;
+	}
+
+	if (!db->in_group)
+		return;
+
+	log_debug(dstate->base_log, "%s", __func__);
+	db->in_group = false;
+	start = time_now();
+	trace0(db_group_commit);
+	if (!db_step(__func__, dstate,
+		     db_prepare(__func__, dstate, "COMMIT;")))
+		/* We've updated peers in memory, but sent nothing: restart
+		 * from what's on disk. */
+		fatal("%s: %s", __func__, db->err);
+	stats_latency(dstate, STATS_DB_COMMIT, start);
+
+	/* Let out the packets which were waiting for this. */
+	db->batches_done = db->batches;
+	io_wake(db);
+}
+
+void db_hold_commits(struct lightningd_state *dstate)
+{
+	struct db *db = dstate->db;
+
+	assert(!db->in_transaction);
+	assert(!db->held);
+
+	/* The writer thread already does each loop's writes together. */
+	if (dstate->config.db_async)
+		return;
+
+	if (!db->in_group) {
+		db->in_group = db_step(__func__, dstate,
+				       db_prepare(__func__, dstate,
+						  "BEGIN IMMEDIATE;"));
+		if (db->in_group)
+			db->batches++;
+	}
+	db->held = db->in_group;
+}
+
+void db_release_commits(struct lightningd_state *dstate)
+{
+	struct db *db = dstate->db;
+
+	if (!db->held)
+		return;
+	db->held = false;
+	db_commit_group(dstate);
+}
+
+bool db_commits_held(const struct lightningd_state *dstate)
+{
+	return dstate->db->held;
+}
+
+u64 db_batch_stamp(const struct lightningd_state *dstate)
+{
+	return dstate->db->batches;
+}
+
+bool db_batch_done(const struct lightningd_state *dstate, u64 stamp)
+{
+	return dstate->db->batches_done >= stamp;
 }
 
 void db_new_htlc(struct peer *peer, const struct htlc *htlc)
 {
 	const char *ctx = tal(peer, char);
 	const char *peerid = pubkey_to_hexstr(ctx, peer->dstate->secpctx, peer->id);
+	struct db_op *stmt;
+	struct sha256 routing_id;
 
 	log_debug(peer->log, "%s(%s)", __func__, peerid);
 	assert(peer->dstate->db->in_transaction);
 
+	sha256(&routing_id, htlc->routing, tal_count(htlc->routing));
+	stmt = db_prepare(__func__, peer->dstate,
+			  "INSERT OR IGNORE INTO blobs VALUES (?, ?);");
+	db_bind_blob(stmt, 1, &routing_id, sizeof(routing_id));
+	db_bind_blob_static(stmt, 2, htlc->routing, tal_count(htlc->routing));
+	db_step(__func__, peer->dstate, stmt);
+
+	stmt = db_prepare(__func__, peer->dstate,
+			  "INSERT INTO htlcs VALUES"
+			  " (?, ?, ?, ?, ?, ?, NULL, ?, ?, ?, NULL);");
+	db_bind_pubkey(peer->dstate, stmt, 1, peer->id);
+	db_bind_int(stmt, 2, htlc->id);
+	db_bind_int(stmt, 3, htlc->state);
+	db_bind_int(stmt, 4, htlc->msatoshi);
+	db_bind_int(stmt, 5, abs_locktime_to_blocks(&htlc->expiry));
+	db_bind_blob(stmt, 6, &htlc->rhash, sizeof(htlc->rhash));
+	db_bind_blob(stmt, 7, &routing_id, sizeof(routing_id));
 	if (htlc->src) {
-		db_exec(__func__, peer->dstate, 
-			"INSERT INTO htlcs VALUES"
-			" (x'%s', %"PRIu64", '%s', %"PRIu64", %u, x'%s', NULL, x'%s', x'%s', %"PRIu64", NULL);",
-			pubkey_to_hexstr(ctx, peer->dstate->secpctx, peer->id),
-			htlc->id,
-			htlc_state_name(htlc->state),
-			htlc->msatoshi,
-			abs_locktime_to_blocks(&htlc->expiry),
-			tal_hexstr(ctx, &htlc->rhash, sizeof(htlc->rhash)),
-			tal_hexstr(ctx, htlc->routing, tal_count(htlc->routing)),
-			peerid,
-			htlc->src->id);
-	} else {
-		db_exec(__func__, peer->dstate, 
-			"INSERT INTO htlcs VALUES"
-			" (x'%s', %"PRIu64", '%s', %"PRIu64", %u, x'%s', NULL, x'%s', NULL, NULL, NULL);",
-			peerid,
-			htlc->id,
-			htlc_state_name(htlc->state),
-			htlc->msatoshi,
-			abs_locktime_to_blocks(&htlc->expiry),
-			tal_hexstr(ctx, &htlc->rhash, sizeof(htlc->rhash)),
-			tal_hexstr(ctx, htlc->routing, tal_count(htlc->routing)));
+		db_bind_pubkey(peer->dstate, stmt, 8, htlc->src->peer->id);
+		db_bind_int(stmt, 9, htlc->src->id);
 	}
+	db_step(__func__, peer->dstate, stmt);
 
 	tal_free(ctx);
 }
@@ -1464,34 +2866,152 @@ void db_new_feechange(struct peer *peer, const struct feechange *feechange)
 {
 	const char *ctx = tal(peer, char);
 	const char *peerid = pubkey_to_hexstr(ctx, peer->dstate->secpctx, peer->id);
+	struct db_op *stmt;
 
 	log_debug(peer->log, "%s(%s)", __func__, peerid);
 	assert(peer->dstate->db->in_transaction);
 
-	db_exec(__func__, peer->dstate, 
-		"INSERT INTO feechanges VALUES"
-		" (x'%s', '%s', %"PRIu64");",
-		peerid,
-		feechange_state_name(feechange->state),
-		feechange->fee_rate);
+	stmt = db_prepare(__func__, peer->dstate,
+			  "INSERT INTO feechanges VALUES (?, ?, ?);");
+	db_bind_pubkey(peer->dstate, stmt, 1, peer->id);
+	db_bind_str(stmt, 2, feechange_state_name(feechange->state));
+	db_bind_int(stmt, 3, feechange->fee_rate);
+	db_step(__func__, peer->dstate, stmt);
 
 	tal_free(ctx);
 }
 
+/* Dead HTLCs are only needed again if they cheat, so keep them out of
+ * the way of startup. */
+static void archive_htlc(struct peer *peer, const struct htlc *htlc)
+{
+	struct db_op *stmt;
+	u64 fulfilled = htlc->r ? htlc->msatoshi : 0;
+	bool ours = (htlc_owner(htlc) == LOCAL);
+
+	stmt = db_prepare(__func__, peer->dstate,
+			  "INSERT INTO htlcs_archive"
+			  " SELECT * FROM htlcs WHERE peer=? AND id=? AND state=?;");
+	db_bind_pubkey(peer->dstate, stmt, 1, peer->id);
+	db_bind_int(stmt, 2, htlc->id);
+	db_bind_int(stmt, 3, htlc->state);
+	db_step(__func__, peer->dstate, stmt);
+
+	stmt = db_prepare(__func__, peer->dstate,
+			  "DELETE FROM htlcs WHERE peer=? AND id=? AND state=?;");
+	db_bind_pubkey(peer->dstate, stmt, 1, peer->id);
+	db_bind_int(stmt, 2, htlc->id);
+	db_bind_int(stmt, 3, htlc->state);
+	db_step(__func__, peer->dstate, stmt);
+
+	stmt = db_prepare(__func__, peer->dstate,
+			  "INSERT OR IGNORE INTO htlc_totals VALUES (?, 0, 0, 0);");
+	db_bind_pubkey(peer->dstate, stmt, 1, peer->id);
+	db_step(__func__, peer->dstate, stmt);
+
+	stmt = db_prepare(__func__, peer->dstate,
+			  "UPDATE htlc_totals SET"
+			  " local_fulfilled = local_fulfilled + ?,"
+			  " remote_fulfilled = remote_fulfilled + ?,"
+			  " next_id = MAX(next_id, ?) WHERE peer=?;");
+	db_bind_int(stmt, 1, ours ? fulfilled : 0);
+	db_bind_int(stmt, 2, ours ? 0 : fulfilled);
+	db_bind_int(stmt, 3, ours ? htlc->id + 1 : 0);
+	db_bind_pubkey(peer->dstate, stmt, 4, peer->id);
+	db_step(__func__, peer->dstate, stmt);
+}
+
 void db_update_htlc_state(struct peer *peer, const struct htlc *htlc,
 			  enum htlc_state oldstate)
 {
 	const char *ctx = tal(peer, char);
 	const char *peerid = pubkey_to_hexstr(ctx, peer->dstate->secpctx, peer->id);
+	struct db_op *stmt;
 
 	log_debug(peer->log, "%s(%s): %"PRIu64" %s->%s", __func__, peerid,
 		  htlc->id, htlc_state_name(oldstate),
 		  htlc_state_name(htlc->state));
 	assert(peer->dstate->db->in_transaction);
-	db_exec(__func__, peer->dstate, 
-		"UPDATE htlcs SET state='%s' WHERE peer=x'%s' AND id=%"PRIu64" AND state='%s';",
-		htlc_state_name(htlc->state), peerid,
-		htlc->id, htlc_state_name(oldstate));
+	stmt = db_prepare(__func__, peer->dstate,
+			  "UPDATE htlcs SET state=? WHERE peer=? AND id=? AND state=?;");
+	db_bind_int(stmt, 1, htlc->state);
+	db_bind_pubkey(peer->dstate, stmt, 2, peer->id);
+	db_bind_int(stmt, 3, htlc->id);
+	db_bind_int(stmt, 4, oldstate);
+	db_step(__func__, peer->dstate, stmt);
+
+	if (htlc_is_dead(htlc))
+		archive_htlc(peer, htlc);
+
+	tal_free(ctx);
+}
+
+/* Same as archive_htlc, for all of them: the totals come from the rows. */
+static void archive_htlcs(struct peer *peer, enum htlc_state state)
+{
+	struct db_op *stmt;
+
+	stmt = db_prepare(__func__, peer->dstate,
+			  "INSERT OR IGNORE INTO htlc_totals VALUES (?, 0, 0, 0);");
+	db_bind_pubkey(peer->dstate, stmt, 1, peer->id);
+	db_step(__func__, peer->dstate, stmt);
+
+	/* Ours die in RCVD_REMOVE_ACK_REVOCATION. */
+	if (state == RCVD_REMOVE_ACK_REVOCATION)
+		stmt = db_prepare(__func__, peer->dstate,
+				  "UPDATE htlc_totals SET"
+				  " local_fulfilled = local_fulfilled +"
+				  " (SELECT IFNULL(SUM(msatoshi), 0) FROM htlcs"
+				  "  WHERE peer=?1 AND state=?2 AND r IS NOT NULL),"
+				  " next_id = MAX(next_id,"
+				  " (SELECT IFNULL(MAX(id) + 1, 0) FROM htlcs"
+				  "  WHERE peer=?1 AND state=?2))"
+				  " WHERE peer=?1;");
+	else
+		stmt = db_prepare(__func__, peer->dstate,
+				  "UPDATE htlc_totals SET"
+				  " remote_fulfilled = remote_fulfilled +"
+				  " (SELECT IFNULL(SUM(msatoshi), 0) FROM htlcs"
+				  "  WHERE peer=?1 AND state=?2 AND r IS NOT NULL)"
+				  " WHERE peer=?1;");
+	db_bind_pubkey(peer->dstate, stmt, 1, peer->id);
+	db_bind_int(stmt, 2, state);
+	db_step(__func__, peer->dstate, stmt);
+
+	stmt = db_prepare(__func__, peer->dstate,
+			  "INSERT INTO htlcs_archive"
+			  " SELECT * FROM htlcs WHERE peer=? AND state=?;");
+	db_bind_pubkey(peer->dstate, stmt, 1, peer->id);
+	db_bind_int(stmt, 2, state);
+	db_step(__func__, peer->dstate, stmt);
+
+	stmt = db_prepare(__func__, peer->dstate,
+			  "DELETE FROM htlcs WHERE peer=? AND state=?;");
+	db_bind_pubkey(peer->dstate, stmt, 1, peer->id);
+	db_bind_int(stmt, 2, state);
+	db_step(__func__, peer->dstate, stmt);
+}
+
+void db_update_htlc_states(struct peer *peer,
+			   enum htlc_state oldstate, enum htlc_state newstate)
+{
+	const char *ctx = tal(peer, char);
+	const char *peerid = pubkey_to_hexstr(ctx, peer->dstate->secpctx, peer->id);
+	struct db_op *stmt;
+
+	log_debug(peer->log, "%s(%s): %s->%s", __func__, peerid,
+		  htlc_state_name(oldstate), htlc_state_name(newstate));
+	assert(peer->dstate->db->in_transaction);
+	stmt = db_prepare(__func__, peer->dstate,
+			  "UPDATE htlcs SET state=? WHERE peer=? AND state=?;");
+	db_bind_int(stmt, 1, newstate);
+	db_bind_pubkey(peer->dstate, stmt, 2, peer->id);
+	db_bind_int(stmt, 3, oldstate);
+	db_step(__func__, peer->dstate, stmt);
+
+	if (newstate == RCVD_REMOVE_ACK_REVOCATION
+	    || newstate == SENT_REMOVE_ACK_REVOCATION)
+		archive_htlcs(peer, newstate);
 
 	tal_free(ctx);
 }
@@ -1502,15 +3022,18 @@ void db_update_feechange_state(struct peer *peer,
 {
 	const char *ctx = tal(peer, char);
 	const char *peerid = pubkey_to_hexstr(ctx, peer->dstate->secpctx, peer->id);
+	struct db_op *stmt;
 
 	log_debug(peer->log, "%s(%s): %s->%s", __func__, peerid,
 		  feechange_state_name(oldstate),
 		  feechange_state_name(f->state));
 	assert(peer->dstate->db->in_transaction);
-	db_exec(__func__, peer->dstate, 
-		"UPDATE feechanges SET state='%s' WHERE peer=x'%s' AND state='%s';",
-		feechange_state_name(f->state), peerid,
-		feechange_state_name(oldstate));
+	stmt = db_prepare(__func__, peer->dstate,
+			  "UPDATE feechanges SET state=? WHERE peer=? AND state=?;");
+	db_bind_str(stmt, 1, feechange_state_name(f->state));
+	db_bind_pubkey(peer->dstate, stmt, 2, peer->id);
+	db_bind_str(stmt, 3, feechange_state_name(oldstate));
+	db_step(__func__, peer->dstate, stmt);
 
 	tal_free(ctx);
 }
@@ -1519,13 +3042,16 @@ void db_update_state(struct peer *peer)
 {
 	const char *ctx = tal(peer, char);
 	const char *peerid = pubkey_to_hexstr(ctx, peer->dstate->secpctx, peer->id);
+	struct db_op *stmt;
 
 	log_debug(peer->log, "%s(%s)", __func__, peerid);
 
 	assert(peer->dstate->db->in_transaction);
-	db_exec(__func__, peer->dstate, 
-		"UPDATE peers SET state='%s' WHERE peer=x'%s';",
-		state_name(peer->state), peerid);
+	stmt = db_prepare(__func__, peer->dstate,
+			  "UPDATE peers SET state=? WHERE peer=?;");
+	db_bind_str(stmt, 1, state_name(peer->state));
+	db_bind_pubkey(peer->dstate, stmt, 2, peer->id);
+	db_step(__func__, peer->dstate, stmt);
 	tal_free(ctx);
 }
 
@@ -1533,16 +3059,18 @@ void db_htlc_fulfilled(struct peer *peer, const struct htlc *htlc)
 {
 	const char *ctx = tal(peer, char);
 	const char *peerid = pubkey_to_hexstr(ctx, peer->dstate->secpctx, peer->id);
+	struct db_op *stmt;
 
 	log_debug(peer->log, "%s(%s)", __func__, peerid);
 
 	assert(peer->dstate->db->in_transaction);
-	db_exec(__func__, peer->dstate, 
-		"UPDATE htlcs SET r=x'%s' WHERE peer=x'%s' AND id=%"PRIu64" AND state='%s';",
-		tal_hexstr(ctx, htlc->r, sizeof(*htlc->r)),
-		peerid,
-		htlc->id,
-		htlc_state_name(htlc->state));
+	stmt = db_prepare(__func__, peer->dstate,
+			  "UPDATE htlcs SET r=? WHERE peer=? AND id=? AND state=?;");
+	db_bind_blob(stmt, 1, htlc->r, sizeof(*htlc->r));
+	db_bind_pubkey(peer->dstate, stmt, 2, peer->id);
+	db_bind_int(stmt, 3, htlc->id);
+	db_bind_int(stmt, 4, htlc->state);
+	db_step(__func__, peer->dstate, stmt);
 
 	tal_free(ctx);
 }
@@ -1551,16 +3079,18 @@ void db_htlc_failed(struct peer *peer, const struct htlc *htlc)
 {
 	const char *ctx = tal(peer, char);
 	const char *peerid = pubkey_to_hexstr(ctx, peer->dstate->secpctx, peer->id);
+	struct db_op *stmt;
 
 	log_debug(peer->log, "%s(%s)", __func__, peerid);
 
 	assert(peer->dstate->db->in_transaction);
-	db_exec(__func__, peer->dstate, 
-		"UPDATE htlcs SET fail=x'%s' WHERE peer=x'%s' AND id=%"PRIu64" AND state='%s';",
-		tal_hexstr(ctx, htlc->fail, sizeof(*htlc->fail)),
-		peerid,
-		htlc->id,
-		htlc_state_name(htlc->state));
+	stmt = db_prepare(__func__, peer->dstate,
+			  "UPDATE htlcs SET fail=? WHERE peer=? AND id=? AND state=?;");
+	db_bind_blob(stmt, 1, htlc->fail, sizeof(*htlc->fail));
+	db_bind_pubkey(peer->dstate, stmt, 2, peer->id);
+	db_bind_int(stmt, 3, htlc->id);
+	db_bind_int(stmt, 4, htlc->state);
+	db_step(__func__, peer->dstate, stmt);
 
 	tal_free(ctx);
 }
@@ -1571,6 +3101,7 @@ void db_new_commit_info(struct peer *peer, enum side side,
 	struct commit_info *ci;
 	const char *ctx = tal(peer, char);
 	const char *peerid = pubkey_to_hexstr(ctx, peer->dstate->secpctx, peer->id);
+	struct db_op *stmt;
 
 	log_debug(peer->log, "%s(%s)", __func__, peerid);
 
@@ -1581,14 +3112,16 @@ void db_new_commit_info(struct peer *peer, enum side side,
 		ci = peer->remote.commit;
 	}
 
-	db_exec(__func__, peer->dstate, "UPDATE commit_info SET commit_num=%"PRIu64", revocation_hash=x'%s', sig=%s, xmit_order=%"PRIi64", prev_revocation_hash=%s WHERE peer=x'%s' AND side='%s';",
-		ci->commit_num,
-		tal_hexstr(ctx, &ci->revocation_hash,
-			   sizeof(ci->revocation_hash)),
-		sig_to_sql(ctx, peer->dstate->secpctx, ci->sig),
-		ci->order,
-		sql_hex_or_null(ctx, prev_rhash, sizeof(*prev_rhash)),
-		peerid, side_to_str(side));
+	stmt = db_prepare(__func__, peer->dstate,
+			  "UPDATE commit_info SET commit_num=?, revocation_hash=?, sig=?, xmit_order=?, prev_revocation_hash=? WHERE peer=? AND side=?;");
+	db_bind_int(stmt, 1, ci->commit_num);
+	db_bind_blob(stmt, 2, &ci->revocation_hash, sizeof(ci->revocation_hash));
+	db_bind_sig(peer->dstate, stmt, 3, ci->sig);
+	db_bind_int(stmt, 4, ci->order);
+	db_bind_blob(stmt, 5, prev_rhash, sizeof(*prev_rhash));
+	db_bind_pubkey(peer->dstate, stmt, 6, peer->id);
+	db_bind_str(stmt, 7, side_to_str(side));
+	db_step(__func__, peer->dstate, stmt);
 	tal_free(ctx);
 }
 
@@ -1597,13 +3130,16 @@ void db_remove_their_prev_revocation_hash(struct peer *peer)
 {
 	const char *ctx = tal(peer, char);
 	const char *peerid = pubkey_to_hexstr(ctx, peer->dstate->secpctx, peer->id);
+	struct db_op *stmt;
 
 	log_debug(peer->log, "%s(%s)", __func__, peerid);
 
 	assert(peer->dstate->db->in_transaction);
 
-	db_exec(__func__, peer->dstate, "UPDATE commit_info SET prev_revocation_hash=NULL WHERE peer=x'%s' AND side='REMOTE' and prev_revocation_hash IS NOT NULL;",
-			 peerid);
+	stmt = db_prepare(__func__, peer->dstate,
+			  "UPDATE commit_info SET prev_revocation_hash=NULL WHERE peer=? AND side='REMOTE' and prev_revocation_hash IS NOT NULL;");
+	db_bind_pubkey(peer->dstate, stmt, 1, peer->id);
+	db_step(__func__, peer->dstate, stmt);
 	tal_free(ctx);
 }
 	
@@ -1612,13 +3148,19 @@ void db_save_shachain(struct peer *peer)
 {
 	const char *ctx = tal(peer, char);
 	const char *peerid = pubkey_to_hexstr(ctx, peer->dstate->secpctx, peer->id);
+	const struct shachain *chain = &peer->their_preimages;
+	unsigned int pos;
 
 	log_debug(peer->log, "%s(%s)", __func__, peerid);
 
 	assert(peer->dstate->db->in_transaction);
-	db_exec(__func__, peer->dstate, "UPDATE shachain SET shachain=x'%s' WHERE peer=x'%s';",
-		linearize_shachain(ctx, &peer->their_preimages),
-		peerid);
+	/* Only the slot shachain_add_hash() just filled has changed. */
+	for (pos = 0; pos < chain->num_valid; pos++) {
+		if (chain->known[pos].index == chain->min_index)
+			break;
+	}
+	assert(pos < chain->num_valid);
+	save_shachain_entry(peer, pos);
 	tal_free(ctx);
 }
 
@@ -1627,35 +3169,140 @@ void db_add_commit_map(struct peer *peer,
 {
 	const char *ctx = tal(peer, char);
 	const char *peerid = pubkey_to_hexstr(ctx, peer->dstate->secpctx, peer->id);
+	struct db_op *stmt;
 
 	log_debug(peer->log, "%s(%s),commit_num=%"PRIu64, __func__, peerid,
 		  commit_num);
 
 	assert(peer->dstate->db->in_transaction);
-	db_exec(__func__, peer->dstate,
-		"INSERT INTO their_commitments VALUES (x'%s', x'%s', %"PRIu64");",
-		peerid,
-		tal_hexstr(ctx, txid, sizeof(*txid)),
-		commit_num);
+	stmt = db_prepare(__func__, peer->dstate,
+			  "INSERT INTO their_commitments VALUES (?, ?, ?);");
+	db_bind_pubkey(peer->dstate, stmt, 1, peer->id);
+	db_bind_blob(stmt, 2, txid, sizeof(*txid));
+	db_bind_int(stmt, 3, commit_num);
+	db_step(__func__, peer->dstate, stmt);
+	tal_free(ctx);
+}
+
+bool db_find_commit_map(struct peer *peer,
+			const struct sha256_double *txid, u64 *commit_num)
+{
+	int err;
+	sqlite3_stmt *stmt;
+	sqlite3 *sql = peer->dstate->db->sql;
+	u8 der[PUBKEY_DER_LEN];
+	bool found;
+
+	wait_for_writer(peer->dstate->db);
+	err = sqlite3_prepare_v2(sql, "SELECT commit_num FROM their_commitments"
+				 " WHERE peer=? AND txid=?;", -1, &stmt, NULL);
+	if (err != SQLITE_OK)
+		fatal("%s:prepare gave %s:%s", __func__,
+		      sqlite3_errstr(err), sqlite3_errmsg(sql));
+
+	pubkey_to_der(peer->dstate->secpctx, der, peer->id);
+	sqlite3_bind_blob(stmt, 1, der, sizeof(der), SQLITE_TRANSIENT);
+	sqlite3_bind_blob(stmt, 2, txid, sizeof(*txid), SQLITE_TRANSIENT);
+	err = sqlite3_step(stmt);
+	if (err != SQLITE_ROW && err != SQLITE_DONE)
+		fatal("%s:step gave %s:%s", __func__,
+		      sqlite3_errstr(err), sqlite3_errmsg(sql));
+	found = (err == SQLITE_ROW);
+	if (found)
+		*commit_num = sqlite3_column_int64(stmt, 0);
+	sqlite3_finalize(stmt);
+	return found;
+}
+
+void db_load_archived_htlcs(struct peer *peer)
+{
+	int err;
+	sqlite3_stmt *stmt;
+	sqlite3 *sql = peer->dstate->db->sql;
+	char *ctx = tal(peer, char);
+	const char *select;
+	size_t n = 0;
+
+	select = tal_fmt(ctx,
+			 "SELECT * FROM htlcs_archive WHERE peer = x'%s';",
+			 pubkey_to_hexstr(ctx, peer->dstate->secpctx, peer->id));
+
+	wait_for_writer(peer->dstate->db);
+	err = sqlite3_prepare_v2(sql, select, -1, &stmt, NULL);
+	if (err != SQLITE_OK)
+		fatal("%s:prepare gave %s:%s", __func__,
+		      sqlite3_errstr(err), sqlite3_errmsg(sql));
+
+	while ((err = sqlite3_step(stmt)) != SQLITE_DONE) {
+		enum htlc_state s;
+
+		if (err != SQLITE_ROW)
+			fatal("%s:step gave %s:%s", __func__,
+			      sqlite3_errstr(err), sqlite3_errmsg(sql));
+
+		/* Anything archived since we started is still in memory. */
+		s = sqlite3_column_int64(stmt, 2);
+		if (s < HTLC_STATE_INVALID
+		    && htlc_get(&peer->htlcs, sqlite3_column_int64(stmt, 1),
+				htlc_state_owner(s)))
+			continue;
+		htlc_from_sql(peer, stmt, __func__);
+		n++;
+	}
+	sqlite3_finalize(stmt);
+	log_debug(peer->log, "Loaded %zu archived HTLCs", n);
 	tal_free(ctx);
 }
 
+const u8 *db_htlc_routing(struct htlc *htlc)
+{
+	int err;
+	sqlite3_stmt *stmt;
+	sqlite3 *sql;
+
+	if (htlc->routing || !htlc->routing_id)
+		return htlc->routing;
+
+	sql = htlc->peer->dstate->db->sql;
+	wait_for_writer(htlc->peer->dstate->db);
+	err = sqlite3_prepare_v2(sql, "SELECT data FROM blobs WHERE hash=?;",
+				 -1, &stmt, NULL);
+	if (err != SQLITE_OK)
+		fatal("%s:prepare gave %s:%s", __func__,
+		      sqlite3_errstr(err), sqlite3_errmsg(sql));
+	sqlite3_bind_blob(stmt, 1, htlc->routing_id, sizeof(*htlc->routing_id),
+			  SQLITE_TRANSIENT);
+	err = sqlite3_step(stmt);
+	if (err != SQLITE_ROW && err != SQLITE_DONE)
+		fatal("%s:step gave %s:%s", __func__,
+		      sqlite3_errstr(err), sqlite3_errmsg(sql));
+	if (err == SQLITE_ROW) {
+		htlc->routing = tal_sql_blob(htlc, stmt, 0);
+		htlc->routing_id = tal_free(htlc->routing_id);
+	} else if (!htlc_is_dead(htlc))
+		fatal("%s:no routing for live HTLC %"PRIu64, __func__, htlc->id);
+	sqlite3_finalize(stmt);
+	return htlc->routing;
+}
+
 /* FIXME: Clean out old ones! */
 bool db_add_peer_address(struct lightningd_state *dstate,
 			 const struct peer_address *addr)
 {
-	const char *ctx = tal(dstate, char);
+	u8 *blob = netaddr_to_blob(dstate, &addr->addr);
+	struct db_op *stmt;
 	bool ok;
 
 	log_debug(dstate->base_log, "%s", __func__);
 
-	assert(!dstate->db->in_transaction);
-	ok = db_exec(__func__, dstate,
-		     "INSERT OR REPLACE INTO peer_address VALUES (x'%s', x'%s');",
-		     pubkey_to_hexstr(ctx, dstate->secpctx, &addr->id),
-		     netaddr_to_hex(ctx, &addr->addr));
+	db_outside_transaction(dstate);
+	stmt = db_prepare(__func__, dstate,
+			  "INSERT OR REPLACE INTO peer_address VALUES (?, ?);");
+	db_bind_pubkey(dstate, stmt, 1, &addr->id);
+	db_bind_blob(stmt, 2, blob, tal_count(blob));
+	ok = db_step(__func__, dstate, stmt);
 
-	tal_free(ctx);
+	tal_free(blob);
 	return ok;
 }
 
@@ -1664,17 +3311,31 @@ void db_forget_peer(struct peer *peer)
 	const char *ctx = tal(peer, char);
 	const char *peerid = pubkey_to_hexstr(ctx, peer->dstate->secpctx, peer->id);
 	size_t i;
-	const char *const tables[] = { "anchors", "htlcs", "commit_info", "shachain", "their_visible_state", "their_commitments", "peer_secrets", "closing", "peers" };
+	/* Literals, since db_prepare keeps them. */
+	const char *const deletes[] = {
+		"DELETE from anchors WHERE peer=?;",
+		"DELETE from htlcs WHERE peer=?;",
+		"DELETE from htlcs_archive WHERE peer=?;",
+		"DELETE from htlc_totals WHERE peer=?;",
+		"DELETE from commit_info WHERE peer=?;",
+		"DELETE from shachain_known WHERE peer=?;",
+		"DELETE from their_visible_state WHERE peer=?;",
+		"DELETE from their_commitments WHERE peer=?;",
+		"DELETE from peer_secrets WHERE peer=?;",
+		"DELETE from closing WHERE peer=?;",
+		"DELETE from peers WHERE peer=?;"
+	};
 	log_debug(peer->log, "%s(%s)", __func__, peerid);
 
 	assert(peer->state == STATE_CLOSED);
 
 	db_start_transaction(peer);
 
-	for (i = 0; i < ARRAY_SIZE(tables); i++) {
-		db_exec(__func__, peer->dstate,
-			"DELETE from %s WHERE peer=x'%s';",
-			tables[i], peerid);
+	for (i = 0; i < ARRAY_SIZE(deletes); i++) {
+		struct db_op *stmt = db_prepare(__func__, peer->dstate,
+						deletes[i]);
+		db_bind_pubkey(peer->dstate, stmt, 1, peer->id);
+		db_step(__func__, peer->dstate, stmt);
 	}
 	if (db_commit_transaction(peer) != NULL)
 		fatal("%s:db_commi_transaction failed", __func__);
@@ -1686,13 +3347,15 @@ void db_begin_shutdown(struct peer *peer)
 {
 	const char *ctx = tal(peer, char);
 	const char *peerid = pubkey_to_hexstr(ctx, peer->dstate->secpctx, peer->id);
+	struct db_op *stmt;
 
 	log_debug(peer->log, "%s(%s)", __func__, peerid);
 
 	assert(peer->dstate->db->in_transaction);
-	db_exec(__func__, peer->dstate,
-		"INSERT INTO closing VALUES (x'%s', 0, 0, NULL, NULL, NULL, 0, 0, 0);",
-		peerid);
+	stmt = db_prepare(__func__, peer->dstate,
+			  "INSERT INTO closing VALUES (?, 0, 0, NULL, NULL, NULL, 0, 0, 0);");
+	db_bind_pubkey(peer->dstate, stmt, 1, peer->id);
+	db_step(__func__, peer->dstate, stmt);
 	tal_free(ctx);
 }
 
@@ -1700,15 +3363,18 @@ void db_set_our_closing_script(struct peer *peer)
 {
 	const char *ctx = tal(peer, char);
 	const char *peerid = pubkey_to_hexstr(ctx, peer->dstate->secpctx, peer->id);
+	struct db_op *stmt;
 
 	log_debug(peer->log, "%s(%s)", __func__, peerid);
 
 	assert(peer->dstate->db->in_transaction);
-	db_exec(__func__, peer->dstate, "UPDATE closing SET our_script=x'%s',shutdown_order=%"PRIu64" WHERE peer=x'%s';",
-		tal_hexstr(ctx, peer->closing.our_script,
-			   tal_count(peer->closing.our_script)),
-		peer->closing.shutdown_order,
-		peerid);
+	stmt = db_prepare(__func__, peer->dstate,
+			  "UPDATE closing SET our_script=?,shutdown_order=? WHERE peer=?;");
+	db_bind_blob(stmt, 1, peer->closing.our_script,
+		     tal_count(peer->closing.our_script));
+	db_bind_int(stmt, 2, peer->closing.shutdown_order);
+	db_bind_pubkey(peer->dstate, stmt, 3, peer->id);
+	db_step(__func__, peer->dstate, stmt);
 	tal_free(ctx);
 }
 
@@ -1717,15 +3383,17 @@ bool db_set_their_closing_script(struct peer *peer)
 	const char *ctx = tal(peer, char);
 	bool ok;
 	const char *peerid = pubkey_to_hexstr(ctx, peer->dstate->secpctx, peer->id);
+	struct db_op *stmt;
 
 	log_debug(peer->log, "%s(%s)", __func__, peerid);
 
-	assert(!peer->dstate->db->in_transaction);
-	ok = db_exec(__func__, peer->dstate,
-		     "UPDATE closing SET their_script=x'%s' WHERE peer=x'%s';",
-		     tal_hexstr(ctx, peer->closing.their_script,
-				tal_count(peer->closing.their_script)),
-		     peerid);
+	db_outside_transaction(peer->dstate);
+	stmt = db_prepare(__func__, peer->dstate,
+			  "UPDATE closing SET their_script=? WHERE peer=?;");
+	db_bind_blob(stmt, 1, peer->closing.their_script,
+		     tal_count(peer->closing.their_script));
+	db_bind_pubkey(peer->dstate, stmt, 2, peer->id);
+	ok = db_step(__func__, peer->dstate, stmt);
 	tal_free(ctx);
 	return ok;
 }
@@ -1737,14 +3405,16 @@ void db_update_our_closing(struct peer *peer)
 {
 	const char *ctx = tal(peer, char);
 	const char *peerid = pubkey_to_hexstr(ctx, peer->dstate->secpctx, peer->id);
+	struct db_op *stmt;
 
 	log_debug(peer->log, "%s(%s)", __func__, peerid);
 
-	db_exec(__func__, peer->dstate,
-		"UPDATE closing SET our_fee=%"PRIu64", closing_order=%"PRIi64" WHERE peer=x'%s';",
-		peer->closing.our_fee,
-		peer->closing.closing_order,
-		peerid);
+	stmt = db_prepare(__func__, peer->dstate,
+			  "UPDATE closing SET our_fee=?, closing_order=? WHERE peer=?;");
+	db_bind_int(stmt, 1, peer->closing.our_fee);
+	db_bind_int(stmt, 2, peer->closing.closing_order);
+	db_bind_pubkey(peer->dstate, stmt, 3, peer->id);
+	db_step(__func__, peer->dstate, stmt);
 	tal_free(ctx);
 }
 
@@ -1753,17 +3423,18 @@ bool db_update_their_closing(struct peer *peer)
 	const char *ctx = tal(peer, char);
 	bool ok;
 	const char *peerid = pubkey_to_hexstr(ctx, peer->dstate->secpctx, peer->id);
+	struct db_op *stmt;
 
 	log_debug(peer->log, "%s(%s)", __func__, peerid);
 
-	assert(!peer->dstate->db->in_transaction);
-	ok = db_exec(__func__, peer->dstate,
-		     "UPDATE closing SET their_fee=%"PRIu64", their_sig=x'%s', sigs_in=%u WHERE peer=x'%s';",
-		     peer->closing.their_fee,
-		     tal_hexstr(ctx, peer->closing.their_sig,
-				tal_count(peer->closing.their_sig)),
-		     peer->closing.sigs_in,
-		     peerid);
+	db_outside_transaction(peer->dstate);
+	stmt = db_prepare(__func__, peer->dstate,
+			  "UPDATE closing SET their_fee=?, their_sig=?, sigs_in=? WHERE peer=?;");
+	db_bind_int(stmt, 1, peer->closing.their_fee);
+	db_bind_sig(peer->dstate, stmt, 2, peer->closing.their_sig);
+	db_bind_int(stmt, 3, peer->closing.sigs_in);
+	db_bind_pubkey(peer->dstate, stmt, 4, peer->id);
+	ok = db_step(__func__, peer->dstate, stmt);
 	tal_free(ctx);
 	return ok;
 }
@@ -1774,22 +3445,20 @@ bool db_new_pay_command(struct lightningd_state *dstate,
 			u64 msatoshi,
 			const struct htlc *htlc)
 {
-	const char *ctx = tal(dstate, char);
-	bool ok;
+	struct db_op *stmt;
 
 	log_debug(dstate->base_log, "%s", __func__);
 	log_add_struct(dstate->base_log, "(%s)", struct sha256, rhash);
 
-	assert(!dstate->db->in_transaction);
-	ok = db_exec(__func__, dstate,
-		     "INSERT INTO pay VALUES (x'%s', %"PRIu64", x'%s', x'%s', %"PRIu64", NULL, NULL);",
-		     tal_hexstr(ctx, rhash, sizeof(*rhash)),
-		     msatoshi,
-		     pubkeys_to_hex(ctx, dstate->secpctx, ids),
-		     pubkey_to_hexstr(ctx, dstate->secpctx, htlc->peer->id),
-		     htlc->id);
-	tal_free(ctx);
-	return ok;
+	db_outside_transaction(dstate);
+	stmt = db_prepare(__func__, dstate,
+			  "INSERT INTO pay VALUES (?, ?, ?, ?, ?, NULL, NULL);");
+	db_bind_blob(stmt, 1, rhash, sizeof(*rhash));
+	db_bind_int(stmt, 2, msatoshi);
+	db_bind_pubkeys(dstate, stmt, 3, ids);
+	db_bind_pubkey(dstate, stmt, 4, htlc->peer->id);
+	db_bind_int(stmt, 5, htlc->id);
+	return db_step(__func__, dstate, stmt);
 }
 
 bool db_replace_pay_command(struct lightningd_state *dstate,
@@ -1798,96 +3467,296 @@ bool db_replace_pay_command(struct lightningd_state *dstate,
 			    u64 msatoshi,
 			    const struct htlc *htlc)
 {
-	const char *ctx = tal(dstate, char);
-	bool ok;
+	struct db_op *stmt;
 
 	log_debug(dstate->base_log, "%s", __func__);
 	log_add_struct(dstate->base_log, "(%s)", struct sha256, rhash);
 
-	assert(!dstate->db->in_transaction);
-	ok = db_exec(__func__, dstate,
-		     "UPDATE pay SET msatoshi=%"PRIu64", ids=x'%s', htlc_peer=x'%s', htlc_id=%"PRIu64", r=NULL, fail=NULL WHERE rhash=x'%s';",
-		     msatoshi,
-		     pubkeys_to_hex(ctx, dstate->secpctx, ids),
-		     pubkey_to_hexstr(ctx, dstate->secpctx, htlc->peer->id),
-		     htlc->id,
-		     tal_hexstr(ctx, rhash, sizeof(*rhash)));
-	tal_free(ctx);
-	return ok;
+	db_outside_transaction(dstate);
+	stmt = db_prepare(__func__, dstate,
+			  "UPDATE pay SET msatoshi=?, ids=?, htlc_peer=?, htlc_id=?, r=NULL, fail=NULL WHERE rhash=?;");
+	db_bind_int(stmt, 1, msatoshi);
+	db_bind_pubkeys(dstate, stmt, 2, ids);
+	db_bind_pubkey(dstate, stmt, 3, htlc->peer->id);
+	db_bind_int(stmt, 4, htlc->id);
+	db_bind_blob(stmt, 5, rhash, sizeof(*rhash));
+	return db_step(__func__, dstate, stmt);
+}
+
+bool db_new_pay_part(struct lightningd_state *dstate,
+		     const struct sha256 *rhash,
+		     const struct pubkey *ids,
+		     const struct htlc *htlc)
+{
+	struct db_op *stmt;
+
+	log_debug(dstate->base_log, "%s", __func__);
+	log_add_struct(dstate->base_log, "(%s)", struct sha256, rhash);
+
+	db_outside_transaction(dstate);
+	stmt = db_prepare(__func__, dstate,
+			  "INSERT INTO pay_parts VALUES (?, ?, ?, ?);");
+	db_bind_blob(stmt, 1, rhash, sizeof(*rhash));
+	db_bind_pubkey(dstate, stmt, 2, htlc->peer->id);
+	db_bind_int(stmt, 3, htlc->id);
+	db_bind_pubkeys(dstate, stmt, 4, ids);
+	return db_step(__func__, dstate, stmt);
+}
+
+void db_complete_pay_part(struct lightningd_state *dstate,
+			  const struct htlc *htlc)
+{
+	struct db_op *stmt;
+
+	log_debug(dstate->base_log, "%s", __func__);
+	log_add_struct(dstate->base_log, "(%s)", struct sha256, &htlc->rhash);
+
+	assert(dstate->db->in_transaction);
+	stmt = db_prepare(__func__, dstate,
+			  "DELETE FROM pay_parts WHERE htlc_peer=? AND htlc_id=?;");
+	db_bind_pubkey(dstate, stmt, 1, htlc->peer->id);
+	db_bind_int(stmt, 2, htlc->id);
+	db_step(__func__, dstate, stmt);
 }
 
 void db_complete_pay_command(struct lightningd_state *dstate,
 			     const struct htlc *htlc)
 {
-	const char *ctx = tal(dstate, char);
+	struct db_op *stmt;
 
 	log_debug(dstate->base_log, "%s", __func__);
 	log_add_struct(dstate->base_log, "(%s)", struct sha256, &htlc->rhash);
 
 	assert(dstate->db->in_transaction);
-	if (htlc->r)
-		db_exec(__func__, dstate,
-			"UPDATE pay SET r=x'%s', htlc_peer=NULL WHERE rhash=x'%s';",
-			tal_hexstr(ctx, htlc->r, sizeof(*htlc->r)),
-			tal_hexstr(ctx, &htlc->rhash, sizeof(htlc->rhash)));
-	else
-		db_exec(__func__, dstate,
-			"UPDATE pay SET fail=x'%s', htlc_peer=NULL WHERE rhash=x'%s';",
-			tal_hexstr(ctx, htlc->fail, tal_count(htlc->fail)),
-			tal_hexstr(ctx, &htlc->rhash, sizeof(htlc->rhash)));
-
-	tal_free(ctx);
+	if (htlc->r) {
+		stmt = db_prepare(__func__, dstate,
+				  "UPDATE pay SET r=?, htlc_peer=NULL WHERE rhash=?;");
+		db_bind_blob(stmt, 1, htlc->r, sizeof(*htlc->r));
+	} else {
+		stmt = db_prepare(__func__, dstate,
+				  "UPDATE pay SET fail=?, htlc_peer=NULL WHERE rhash=?;");
+		db_bind_blob(stmt, 1, htlc->fail, tal_count(htlc->fail));
+	}
+	db_bind_blob(stmt, 2, &htlc->rhash, sizeof(htlc->rhash));
+	db_step(__func__, dstate, stmt);
 }
 
 bool db_new_invoice(struct lightningd_state *dstate,
 		    u64 msatoshi,
 		    const char *label,
-		    const struct rval *r)
+		    const struct rval *r,
+		    u64 expiry)
 {
-	const char *ctx = tal(dstate, char);
-	bool ok;
-	
+	struct db_op *stmt;
+
 	log_debug(dstate->base_log, "%s", __func__);
 
-	assert(!dstate->db->in_transaction);
+	db_outside_transaction(dstate);
 
-	/* Insert label as hex; suspect injection attacks. */
-	ok = db_exec(__func__, dstate,
-		     "INSERT INTO invoice VALUES (x'%s', %"PRIu64", x'%s', %s);",
-		     tal_hexstr(ctx, r, sizeof(*r)),
-		     msatoshi,
-		     tal_hexstr(ctx, label, strlen(label)),
-		     sql_bool(false));
-	tal_free(ctx);
-	return ok;
+	/* Label as a blob, as it always was. */
+	stmt = db_prepare(__func__, dstate,
+			  "INSERT INTO invoice VALUES (?, ?, ?, 0, ?);");
+	db_bind_blob(stmt, 1, r, sizeof(*r));
+	db_bind_int(stmt, 2, msatoshi);
+	db_bind_blob(stmt, 3, label, strlen(label));
+	db_bind_int(stmt, 4, expiry);
+	return db_step(__func__, dstate, stmt);
 }
 
 void db_resolve_invoice(struct lightningd_state *dstate,
 			const char *label, u64 paid_num)
 {
-	const char *ctx = tal(dstate, char);
+	struct db_op *stmt;
 
 	log_debug(dstate->base_log, "%s", __func__);
 
 	assert(dstate->db->in_transaction);
-	
-	db_exec(__func__, dstate, "UPDATE invoice SET paid_num=%"PRIu64" WHERE label=x'%s';",
-		paid_num, tal_hexstr(ctx, label, strlen(label)));
-	tal_free(ctx);
+
+	stmt = db_prepare(__func__, dstate,
+			  "UPDATE invoice SET paid_num=? WHERE label=?;");
+	db_bind_int(stmt, 1, paid_num);
+	db_bind_blob(stmt, 2, label, strlen(label));
+	db_step(__func__, dstate, stmt);
 }
 
 bool db_remove_invoice(struct lightningd_state *dstate,
 		       const char *label)
 {
-	const char *ctx = tal(dstate, char);
-	bool ok;
+	struct db_op *stmt;
 
 	log_debug(dstate->base_log, "%s", __func__);
 
-	assert(!dstate->db->in_transaction);
-	
-	ok = db_exec(__func__, dstate, "DELETE FROM invoice WHERE label=x'%s';",
-			 tal_hexstr(ctx, label, strlen(label)));
-	tal_free(ctx);
-	return ok;
+	db_outside_transaction(dstate);
+
+	stmt = db_prepare(__func__, dstate,
+			  "DELETE FROM invoice WHERE label=?;");
+	db_bind_blob(stmt, 1, label, strlen(label));
+	return db_step(__func__, dstate, stmt);
+}
+
+bool db_sweep_invoices(struct lightningd_state *dstate,
+		       u64 now, u64 archive_upto)
+{
+	log_debug(dstate->base_log, "%s", __func__);
+
+	db_outside_transaction(dstate);
+
+	/* The writer (if any) is idle now, so we can go direct. */
+	if (!db_exec(__func__, dstate,
+		     "BEGIN IMMEDIATE;"
+		     "DELETE FROM invoice WHERE paid_num = 0"
+		     " AND expiry != 0 AND expiry <= %"PRIu64";"
+		     "INSERT OR REPLACE INTO invoice_archive"
+		     " SELECT * FROM invoice"
+		     " WHERE paid_num != 0 AND paid_num <= %"PRIu64";"
+		     "DELETE FROM invoice"
+		     " WHERE paid_num != 0 AND paid_num <= %"PRIu64";"
+		     "COMMIT;", now, archive_upto, archive_upto)) {
+		db_exec(__func__, dstate, "ROLLBACK;");
+		return false;
+	}
+	return true;
+}
+
+/* Pages copied per pass of the loop, by default. */
+#define DB_BACKUP_PAGES 100
+
+struct db_backup {
+	struct command *cmd;
+	const char *path, *tmppath;
+	sqlite3 *dest;
+	sqlite3_backup *b;
+	int pages;
+};
+
+static void destroy_db_backup(struct db_backup *backup)
+{
+	/* Don't leave a torn copy lying around. */
+	if (backup->b) {
+		sqlite3_backup_finish(backup->b);
+		unlink(backup->tmppath);
+	}
+	sqlite3_close(backup->dest);
+	backup->cmd->dstate->db->backup = NULL;
+}
+
+static void backup_step(struct db_backup *backup)
+{
+	struct lightningd_state *dstate = backup->cmd->dstate;
+	struct db *db = dstate->db;
+	struct json_result *response;
+	int err;
+
+	/* Try again once the writer, or an open group, is done with it. */
+	if (db->in_group || db->open || writer_busy(db)) {
+		new_reltimer(dstate, backup, time_from_msec(10),
+			     backup_step, backup);
+		return;
+	}
+
+	err = sqlite3_backup_step(backup->b, backup->pages);
+	if (err == SQLITE_OK || err == SQLITE_BUSY || err == SQLITE_LOCKED) {
+		new_reltimer(dstate, backup, time_from_sec(0),
+			     backup_step, backup);
+		return;
+	}
+
+	if (err != SQLITE_DONE) {
+		command_fail(backup->cmd, "Backup failed: %s",
+			     sqlite3_errstr(err));
+		return;
+	}
+
+	response = new_json_result(backup->cmd);
+	json_object_start(response, NULL);
+	json_add_string(response, "path", backup->path);
+	json_add_num(response, "pages", sqlite3_backup_pagecount(backup->b));
+	json_object_end(response);
+
+	err = sqlite3_backup_finish(backup->b);
+	backup->b = NULL;
+	if (err != SQLITE_OK) {
+		unlink(backup->tmppath);
+		command_fail(backup->cmd, "Backup failed: %s",
+			     sqlite3_errstr(err));
+		return;
+	}
+	if (rename(backup->tmppath, backup->path) != 0) {
+		unlink(backup->tmppath);
+		command_fail(backup->cmd, "Renaming %s: %s",
+			     backup->tmppath, strerror(errno));
+		return;
+	}
+	log_info(dstate->base_log, "Backed up database to %s", backup->path);
+	command_success(backup->cmd, response);
+}
+
+static void json_backup(struct command *cmd,
+			const char *buffer, const jsmntok_t *params)
+{
+	struct db_backup *backup;
+	jsmntok_t *pathtok, *pagestok;
+	unsigned int pages = DB_BACKUP_PAGES;
+	int err;
+
+	if (!json_get_params(buffer, params,
+			     "path", &pathtok,
+			     "?pages", &pagestok,
+			     NULL)) {
+		command_fail(cmd, "Need {path}");
+		return;
+	}
+
+	if (pagestok
+	    && (!json_tok_number(buffer, pagestok, &pages) || pages == 0)) {
+		command_fail(cmd, "Invalid pages '%.*s'",
+			     pagestok->end - pagestok->start,
+			     buffer + pagestok->start);
+		return;
+	}
+
+	if (cmd->dstate->db->backup) {
+		command_fail(cmd, "Backup already running");
+		return;
+	}
+
+	/* Freed with the command, or the db. */
+	backup = tal(cmd, struct db_backup);
+	backup->cmd = cmd;
+	backup->path = tal_strndup(backup, buffer + pathtok->start,
+				   pathtok->end - pathtok->start);
+	backup->tmppath = tal_fmt(backup, "%s.part", backup->path);
+	backup->pages = pages;
+	backup->b = NULL;
+
+	unlink(backup->tmppath);
+	err = sqlite3_open_v2(backup->tmppath, &backup->dest,
+			      SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL);
+	if (err != SQLITE_OK) {
+		sqlite3_close(backup->dest);
+		command_fail(cmd, "Opening %s: %s",
+			     backup->tmppath, sqlite3_errstr(err));
+		return;
+	}
+
+	backup->b = sqlite3_backup_init(backup->dest, "main",
+					cmd->dstate->db->sql, "main");
+	if (!backup->b) {
+		const char *why = tal_strdup(cmd, sqlite3_errmsg(backup->dest));
+		sqlite3_close(backup->dest);
+		unlink(backup->tmppath);
+		command_fail(cmd, "Starting backup: %s", why);
+		return;
+	}
+
+	cmd->dstate->db->backup = backup;
+	tal_add_destructor(backup, destroy_db_backup);
+	backup_step(backup);
 }
+
+const struct json_command backup_command = {
+	"backup",
+	json_backup,
+	"Copy the database to {path}, {pages} at a time (default 100)",
+	"Returns {path} and {pages} once the copy is complete"
+};
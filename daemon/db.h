@@ -1,18 +1,54 @@
 #ifndef LIGHTNING_DAEMON_DB_H
 #define LIGHTNING_DAEMON_DB_H
 #include "config.h"
+#include "lightningd.h"
 #include "peer.h"
+#include <ccan/opt/opt.h>
 #include <stdbool.h>
 
+struct wallet_utxo;
+
 void db_init(struct lightningd_state *dstate);
 
+char *opt_set_db_synchronous(const char *arg, enum db_synchronous *sync);
+void opt_show_db_synchronous(char buf[OPT_SHOW_LEN],
+			     const enum db_synchronous *sync);
+
 bool db_create_peer(struct peer *peer);
+
+/* Restore a dormant peer's commit info, cstates, HTLCs and feechanges, as
+ * they were when it went to sleep (see peer_wake). */
+void db_load_peer(struct peer *peer);
 bool db_set_visible_state(struct peer *peer);
 
 void db_start_transaction(struct peer *peer);
 void db_abort_transaction(struct peer *peer);
 const char *db_commit_transaction(struct peer *peer);
 
+/* With config.db_group_commit, db_commit_transaction() only marks a peer's
+ * updates done: they all reach the disk together, once per loop iteration.
+ * With config.db_async, another thread writes each iteration's batch while
+ * we carry on.  This makes sure it's all on disk now. */
+void db_commit_group(struct lightningd_state *dstate);
+
+/* Packets must wait for the updates before them: note db_batch_stamp()
+ * when queueing, and wait on dstate->db until db_batch_done(). */
+u64 db_batch_stamp(const struct lightningd_state *dstate);
+
+/* Share one transaction between writes up to db_release_commits(), rather
+ * than committing each.  Must be outside a transaction. */
+void db_hold_commits(struct lightningd_state *dstate);
+void db_release_commits(struct lightningd_state *dstate);
+bool db_commits_held(const struct lightningd_state *dstate);
+bool db_batch_done(const struct lightningd_state *dstate, u64 stamp);
+
+/* Pages config.db_vacuum_pages has given back so far. */
+u64 db_vacuumed_pages(const struct lightningd_state *dstate);
+
+void db_add_wallet_utxo(struct lightningd_state *dstate,
+			const struct wallet_utxo *utxo);
+void db_remove_wallet_utxo(struct lightningd_state *dstate,
+			   const struct wallet_utxo *utxo);
 void db_add_wallet_privkey(struct lightningd_state *dstate,
 			   const struct privkey *privkey);
 
@@ -32,14 +68,28 @@ bool db_replace_pay_command(struct lightningd_state *dstate,
 			    const struct pubkey *ids,
 			    u64 msatoshi,
 			    const struct htlc *htlc);
+/* One part of a multi-path payment, once its HTLC is added. */
+bool db_new_pay_part(struct lightningd_state *dstate,
+		     const struct sha256 *rhash,
+		     const struct pubkey *ids,
+		     const struct htlc *htlc);
+/* Brings a finished one back into memory (with pay_add), if we have it. */
+bool db_load_pay_command(struct lightningd_state *dstate,
+			 const struct sha256 *rhash);
 bool db_new_invoice(struct lightningd_state *dstate,
 		    u64 msatoshi,
 		    const char *label,
-		    const struct rval *r);
+		    const struct rval *r,
+		    u64 expiry);
 
 bool db_remove_invoice(struct lightningd_state *dstate,
 		       const char *label);
 
+/* Deletes unpaid invoices expired by @now, archives paid ones up to
+ * paid_num @archive_upto. */
+bool db_sweep_invoices(struct lightningd_state *dstate,
+		       u64 now, u64 archive_upto);
+
 /* FIXME: save error handling until db_commit_transaction for calls
  * which have to be inside transaction anyway. */
 
@@ -51,8 +101,13 @@ void db_htlc_fulfilled(struct peer *peer, const struct htlc *htlc);
 void db_htlc_failed(struct peer *peer, const struct htlc *htlc);
 void db_update_htlc_state(struct peer *peer, const struct htlc *htlc,
 				 enum htlc_state oldstate);
+/* Every HTLC of this peer's in @oldstate is now in @newstate. */
+void db_update_htlc_states(struct peer *peer,
+			   enum htlc_state oldstate, enum htlc_state newstate);
 void db_complete_pay_command(struct lightningd_state *dstate,
 			     const struct htlc *htlc);
+void db_complete_pay_part(struct lightningd_state *dstate,
+			  const struct htlc *htlc);
 void db_resolve_invoice(struct lightningd_state *dstate,
 			const char *label, u64 paid_num);
 void db_update_feechange_state(struct peer *peer,
@@ -70,6 +125,16 @@ void db_update_our_closing(struct peer *peer);
 
 void db_add_commit_map(struct peer *peer,
 		       const struct sha256_double *txid, u64 commit_num);
+/* Recent ones may not be written yet: check peer->their_commits first. */
+bool db_find_commit_map(struct peer *peer,
+			const struct sha256_double *txid, u64 *commit_num);
+
+/* Dead HTLCs aren't loaded at startup: this brings them back. */
+void db_load_archived_htlcs(struct peer *peer);
+
+/* A loaded HTLC's onion stays on disk until this wants it (NULL if it's
+ * dead, and so only the hash is left). */
+const u8 *db_htlc_routing(struct htlc *htlc);
 
 void db_forget_peer(struct peer *peer);
 #endif /* LIGHTNING_DAEMON_DB_H */
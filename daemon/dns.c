@@ -1,19 +1,28 @@
-/* Async dns helper. */
+/* Async dns helper: lookups run in threads, results are cached. */
 #include "dns.h"
 #include "lightningd.h"
 #include "log.h"
-#include "peer.h"
+#include "netaddr.h"
+#include "timeout.h"
 #include <assert.h>
-#include <ccan/err/err.h>
-#include <ccan/read_write_all/read_write_all.h>
+#include <ccan/list/list.h>
+#include <ccan/strmap/strmap.h>
 #include <ccan/tal/str/str.h>
 #include <ccan/tal/tal.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
-#include <stdio.h>
+#include <pthread.h>
 #include <sys/socket.h>
 #include <sys/types.h>
-#include <sys/wait.h>
+#include <unistd.h>
+
+/* getaddrinfo blocks, so a slow server would hold up lookups behind it. */
+#define DNS_THREADS 4
+
+/* getaddrinfo doesn't tell us the record's TTL, so we pick ours. */
+#define DNS_CACHE_SECS 300
+#define DNS_NEGATIVE_CACHE_SECS 10
 
 struct dns_async {
 	size_t use;
@@ -23,51 +32,75 @@ struct dns_async {
 	void (*fail)(struct lightningd_state *, void *arg);
 	const char *name;
 	void *arg;
-	int pid;
+	/* Once a connection owns us, it frees us. */
+	bool connecting;
 	size_t num_addresses;
 	struct netaddr *addresses;
+	/* On dns_cache's waiters, while it's resolving. */
+	struct list_node list;
 };
 
-/* This runs in the child */
-static void lookup_and_write(int fd, const char *name, const char *port)
-{
-	struct addrinfo *addr, *i;
+struct dns_cache {
+	/* "name:port" */
+	const char *key;
+	/* Lookup in progress: these want the answer. */
+	bool resolving;
+	struct list_head waiters;
+	/* Otherwise, the answer (maybe none), good until expires. */
 	struct netaddr *addresses;
-	size_t num;
-	struct addrinfo hints;
+	struct timeabs expires;
+};
 
-	/* We don't want UDP sockets (yet?) */
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = AF_UNSPEC;
-	hints.ai_socktype = SOCK_STREAM;
-	if (getaddrinfo(name, port, &hints, &addr) != 0)
-		return;
+/* What a thread works on: it only touches name, port, res and err. */
+struct dns_lookup {
+	struct list_node list;
+	const char *name, *port;
+	struct addrinfo *res;
+	int err;
+	struct dns_cache *cache;
+};
 
-	num = 0;
-	for (i = addr; i; i = i->ai_next)
-		num++;
+struct dns_resolver {
+	struct lightningd_state *dstate;
+	STRMAP(struct dns_cache *) cache;
+	int wakeup_fds[2];
+	char wakeup_buf[64];
+	size_t wakeup_len;
 
-	addresses = tal_arr(NULL, struct netaddr, num);
-	num = 0;
-	for (i = addr; i; i = i->ai_next) {
-		addresses[num].type = i->ai_socktype;
-		addresses[num].protocol = i->ai_protocol;
-		addresses[num].addrlen = i->ai_addrlen;
-		memset(&addresses[num].saddr, 0, sizeof(addresses[num].saddr));
-		/* Let parent report this error. */
-		if (i->ai_addrlen <= sizeof(addresses[num].saddr))
-			memcpy(&addresses[num].saddr, i->ai_addr, i->ai_addrlen);
-		num++;
-	}
+	/* Everything below is under lock. */
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	struct list_head pending, finished;
+};
 
-	if (!num) {
-		tal_free(addresses);
-		return;
-	}
+/* Doesn't touch tal: that's not thread-safe. */
+static void *dns_worker(struct dns_resolver *r)
+{
+	pthread_mutex_lock(&r->lock);
+	for (;;) {
+		struct dns_lookup *l;
+		struct addrinfo hints;
+
+		l = list_pop(&r->pending, struct dns_lookup, list);
+		if (!l) {
+			pthread_cond_wait(&r->work, &r->lock);
+			continue;
+		}
+		pthread_mutex_unlock(&r->lock);
 
-	if (write_all(fd, &num, sizeof(num)))
-		write_all(fd, addresses, num * sizeof(addresses[0]));
-	tal_free(addresses);
+		/* We don't want UDP sockets (yet?) */
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		l->err = getaddrinfo(l->name, l->port, &hints, &l->res);
+
+		pthread_mutex_lock(&r->lock);
+		list_add_tail(&r->finished, &l->list);
+		/* If it's full, main loop has plenty to read already. */
+		if (write(r->wakeup_fds[1], "", 1) != 1)
+			assert(errno == EAGAIN);
+	}
+	return NULL;
 }
 
 static struct io_plan *connected(struct io_conn *conn, struct dns_async *d)
@@ -75,7 +108,7 @@ static struct io_plan *connected(struct io_conn *conn, struct dns_async *d)
 	/* No longer need to try more connections. */
 	io_set_finish(conn, NULL, NULL);
 
-	/* Keep use count, so reap_child won't fail. */
+	/* Keep use count, so we won't fail. */
 	return d->init(conn, d->dstate, d->arg);
 }
 
@@ -101,6 +134,7 @@ static struct io_plan *init_conn(struct io_conn *conn, struct dns_async *d)
 
 	/* That new connection owns d */
 	tal_steal(conn, d);
+	d->connecting = true;
 	return io_connect(conn, &a, connected, d);
 }
 
@@ -132,42 +166,133 @@ static void try_connect_one(struct dns_async *d)
 	}
 
 	/* We're out of things to try.  Fail. */
-	if (--d->use == 0)
+	if (--d->use == 0) {
 		d->fail(d->dstate, d->arg);
+		/* Otherwise, it's freed with the (failed) connection. */
+		if (!d->connecting)
+			tal_free(d);
+	}
 }
 
-static struct io_plan *start_connecting(struct io_conn *conn,
-					struct dns_async *d)
+static void start_connecting(struct dns_async *d, const struct dns_cache *c)
 {
-	assert(d->num_addresses);
-
-	/* reap_child and our connections can race: only last one should call
-	 * fail. */
-	d->use++;
+	d->num_addresses = tal_count(c->addresses);
+	d->addresses = tal_dup_arr(d, struct netaddr, c->addresses,
+				   d->num_addresses, 0);
+	d->use = 1;
 	try_connect_one(d);
-	return io_close(conn);
 }
 
-static struct io_plan *read_addresses(struct io_conn *conn, struct dns_async *d)
+static void lookup_done(struct dns_resolver *r, struct dns_lookup *l)
+{
+	struct dns_cache *c = l->cache;
+	struct dns_async *d;
+	struct addrinfo *i;
+	size_t num;
+
+	num = 0;
+	if (l->err == 0)
+		for (i = l->res; i; i = i->ai_next)
+			num++;
+
+	tal_free(c->addresses);
+	c->addresses = tal_arr(c, struct netaddr, num);
+	num = 0;
+	for (i = l->err == 0 ? l->res : NULL; i; i = i->ai_next) {
+		struct netaddr *a = &c->addresses[num++];
+		a->type = i->ai_socktype;
+		a->protocol = i->ai_protocol;
+		a->addrlen = i->ai_addrlen;
+		memset(&a->saddr, 0, sizeof(a->saddr));
+		/* try_connect_one reports this error. */
+		if (i->ai_addrlen <= sizeof(a->saddr))
+			memcpy(&a->saddr, i->ai_addr, i->ai_addrlen);
+	}
+	if (l->err == 0)
+		freeaddrinfo(l->res);
+	else
+		log_debug(r->dstate->base_log, "DNS lookup %s failed: %s",
+			  c->key, gai_strerror(l->err));
+
+	c->expires = timeabs_add(time_now(),
+				 time_from_sec(num ? DNS_CACHE_SECS
+					       : DNS_NEGATIVE_CACHE_SECS));
+	c->resolving = false;
+	tal_free(l);
+
+	while ((d = list_pop(&c->waiters, struct dns_async, list)) != NULL)
+		start_connecting(d, c);
+}
+
+static struct io_plan *dns_wakeup(struct io_conn *conn, struct dns_resolver *r)
 {
-	d->addresses = tal_arr(d, struct netaddr, d->num_addresses);
-	return io_read(conn, d->addresses,
-		       d->num_addresses * sizeof(d->addresses[0]),
-		       start_connecting, d);
+	struct list_head done;
+	struct dns_lookup *l;
+
+	list_head_init(&done);
+	pthread_mutex_lock(&r->lock);
+	list_append_list(&done, &r->finished);
+	pthread_mutex_unlock(&r->lock);
+
+	while ((l = list_pop(&done, struct dns_lookup, list)) != NULL)
+		lookup_done(r, l);
+
+	return io_read_partial(conn, r->wakeup_buf, sizeof(r->wakeup_buf),
+			       &r->wakeup_len, dns_wakeup, r);
 }
 
-static struct io_plan *init_dns_conn(struct io_conn *conn, struct dns_async *d)
+/* Started on first use.  The threads may be stuck in getaddrinfo at
+ * exit, so this is never freed. */
+static struct dns_resolver *get_resolver(struct lightningd_state *dstate)
 {
-	return io_read(conn, &d->num_addresses, sizeof(d->num_addresses),
-		       read_addresses, d);
+	struct dns_resolver *r;
+	size_t i;
+
+	if (dstate->dns)
+		return dstate->dns;
+
+	r = tal(NULL, struct dns_resolver);
+	r->dstate = dstate;
+	strmap_init(&r->cache);
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->work, NULL);
+	list_head_init(&r->pending);
+	list_head_init(&r->finished);
+
+	if (pipe(r->wakeup_fds) != 0) {
+		log_unusual(dstate->base_log,
+			    "Creating pipes for dns lookup: %s",
+			    strerror(errno));
+		return tal_free(r);
+	}
+	fcntl(r->wakeup_fds[1], F_SETFL,
+	      fcntl(r->wakeup_fds[1], F_GETFL) | O_NONBLOCK);
+
+	for (i = 0; i < DNS_THREADS; i++) {
+		pthread_t t;
+		if (pthread_create(&t, NULL,
+				   (void *(*)(void *))dns_worker, r) != 0) {
+			/* Can't take back ones we started: use those. */
+			if (i)
+				break;
+			log_unusual(dstate->base_log,
+				    "Creating dns thread: %s", strerror(errno));
+			close(r->wakeup_fds[0]);
+			close(r->wakeup_fds[1]);
+			return tal_free(r);
+		}
+		pthread_detach(t);
+	}
+
+	io_new_conn(dstate, r->wakeup_fds[0], dns_wakeup, r);
+	dstate->dns = r;
+	return r;
 }
 
-static void reap_child(struct io_conn *conn, struct dns_async *d)
+static void start_cached(struct dns_async *d)
 {
-	waitpid(d->pid, NULL, 0);
-	/* Last user calls fail. */
-	if (--d->use == 0)
-		d->fail(d->dstate, d->arg);
+	struct dns_cache *c = strmap_get(&d->dstate->dns->cache, d->name);
+	start_connecting(d, c);
 }
 
 struct dns_async *dns_resolve_and_connect_(struct lightningd_state *dstate,
@@ -178,43 +303,52 @@ struct dns_async *dns_resolve_and_connect_(struct lightningd_state *dstate,
 		  void (*fail)(struct lightningd_state *, void *arg),
 		  void *arg)
 {
-	int pfds[2];
-	struct dns_async *d = tal(NULL, struct dns_async);
-	struct io_conn *conn;
+	struct dns_resolver *r = get_resolver(dstate);
+	struct dns_async *d;
+	struct dns_cache *c;
+	struct dns_lookup *l;
+
+	if (!r)
+		return NULL;
 
+	/* Freed once it's connected, or failed. */
+	d = tal(r, struct dns_async);
 	d->dstate = dstate;
 	d->init = init;
 	d->fail = fail;
 	d->arg = arg;
+	d->connecting = false;
 	d->name = tal_fmt(d, "%s:%s", name, port);
 
-	/* First fork child to get addresses. */
-	if (pipe(pfds) != 0) {
-		log_unusual(dstate->base_log,
-			    "Creating pipes for dns lookup: %s",
-			    strerror(errno));
-		return NULL;
+	c = strmap_get(&r->cache, d->name);
+	if (c && c->resolving) {
+		list_add_tail(&c->waiters, &d->list);
+		return d;
+	}
+	if (c && time_before(time_now(), c->expires)) {
+		/* Callers expect to hear back later, not before we return. */
+		new_reltimer(dstate, d, time_from_sec(0), start_cached, d);
+		return d;
 	}
 
-	fflush(stdout);
-	d->pid = fork();
-	switch (d->pid) {
-	case -1:
-		log_unusual(dstate->base_log, "forking for dns lookup: %s",
-			    strerror(errno));
-		close(pfds[0]);
-		close(pfds[1]);
-		return NULL;
-	case 0:
-		close(pfds[0]);
-		lookup_and_write(pfds[1], name, port);
-		exit(0);
+	if (!c) {
+		c = tal(r, struct dns_cache);
+		c->key = tal_strdup(c, d->name);
+		c->addresses = NULL;
+		list_head_init(&c->waiters);
+		strmap_add(&r->cache, c->key, c);
 	}
+	c->resolving = true;
+	list_add_tail(&c->waiters, &d->list);
 
-	close(pfds[1]);
-	d->use = 1;
-	conn = io_new_conn(dstate, pfds[0], init_dns_conn, d);
-	io_set_finish(conn, reap_child, d);
-	tal_steal(conn, d);
+	l = tal(r, struct dns_lookup);
+	l->name = tal_strdup(l, name);
+	l->port = tal_strdup(l, port);
+	l->cache = c;
+
+	pthread_mutex_lock(&r->lock);
+	list_add_tail(&r->pending, &l->list);
+	pthread_cond_signal(&r->work);
+	pthread_mutex_unlock(&r->lock);
 	return d;
 }
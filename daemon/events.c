@@ -0,0 +1,195 @@
+#include "bitcoin/block.h"
+#include "events.h"
+#include "jsonrpc.h"
+#include "lightningd.h"
+#include "names.h"
+#include "peer.h"
+#include <ccan/array_size/array_size.h>
+#include <ccan/str/hex/hex.h>
+
+enum event_type {
+	EVENT_HTLC = 1,
+	EVENT_PEER = 2,
+	EVENT_BLOCK = 4,
+	EVENT_PAYMENT = 8
+};
+
+static const char *event_names[] = { "htlc", "peer", "block", "payment" };
+
+/* Hangs off the (never-completing) subscribe command. */
+struct subscription {
+	struct list_node list;
+	struct command *cmd;
+	int types;
+};
+
+static bool want_event(struct lightningd_state *dstate, int type)
+{
+	struct subscription *sub;
+
+	list_for_each(&dstate->subscriptions, sub, list)
+		if (sub->types & type)
+			return true;
+	return false;
+}
+
+/* Takes response, and ends the object it started. */
+static void send_event(struct lightningd_state *dstate, int type,
+		       struct json_result *response)
+{
+	struct subscription *sub, *next;
+
+	json_object_end(response);
+	list_for_each_safe(&dstate->subscriptions, sub, next, list) {
+		if (!(sub->types & type))
+			continue;
+		/* Connection has gone: that ends the subscription. */
+		if (!command_notify(sub->cmd, json_result_string(response))) {
+			list_del(&sub->list);
+			tal_free(sub->cmd);
+		}
+	}
+	tal_free(response);
+}
+
+static struct json_result *new_event(struct lightningd_state *dstate,
+				     const char *name)
+{
+	struct json_result *response = new_json_result(dstate);
+
+	json_object_start(response, NULL);
+	json_add_string(response, "type", name);
+	return response;
+}
+
+void notify_htlc_state(const struct htlc *h, enum htlc_state oldstate)
+{
+	struct lightningd_state *dstate = h->peer->dstate;
+	struct json_result *response;
+
+	if (!want_event(dstate, EVENT_HTLC))
+		return;
+
+	response = new_event(dstate, "htlc");
+	json_add_pubkey(response, dstate->secpctx, "peerid", h->peer->id);
+	json_add_u64(response, "id", h->id);
+	json_add_u64(response, "msatoshi", h->msatoshi);
+	json_add_hex(response, "rhash", &h->rhash, sizeof(h->rhash));
+	json_add_string(response, "oldstate", htlc_state_name(oldstate));
+	json_add_string(response, "state", htlc_state_name(h->state));
+	send_event(dstate, EVENT_HTLC, response);
+}
+
+void notify_peer_state(const struct peer *peer, enum state oldstate)
+{
+	struct json_result *response;
+
+	if (!want_event(peer->dstate, EVENT_PEER))
+		return;
+
+	response = new_event(peer->dstate, "peer");
+	/* We don't know who it is until they've told us. */
+	if (peer->id)
+		json_add_pubkey(response, peer->dstate->secpctx,
+				"peerid", peer->id);
+	json_add_string(response, "oldstate", state_name(oldstate));
+	json_add_string(response, "state", state_name(peer->state));
+	send_event(peer->dstate, EVENT_PEER, response);
+}
+
+void notify_block(struct lightningd_state *dstate,
+		  u32 height, const struct sha256_double *blkid)
+{
+	struct json_result *response;
+	char hex[hex_str_size(sizeof(*blkid))];
+
+	if (!want_event(dstate, EVENT_BLOCK))
+		return;
+
+	bitcoin_blkid_to_hex(blkid, hex, sizeof(hex));
+	response = new_event(dstate, "block");
+	json_add_num(response, "height", height);
+	json_add_string(response, "blockid", hex);
+	send_event(dstate, EVENT_BLOCK, response);
+}
+
+void notify_payment(struct lightningd_state *dstate,
+		    const struct sha256 *rhash, bool succeeded)
+{
+	struct json_result *response;
+
+	if (!want_event(dstate, EVENT_PAYMENT))
+		return;
+
+	response = new_event(dstate, "payment");
+	json_add_hex(response, "rhash", rhash, sizeof(*rhash));
+	json_add_string(response, "status", succeeded ? "complete" : "failed");
+	send_event(dstate, EVENT_PAYMENT, response);
+}
+
+static void json_subscribe(struct command *cmd,
+			   const char *buffer, const jsmntok_t *params)
+{
+	jsmntok_t *typestok;
+	struct subscription *sub;
+	struct json_result *response;
+	size_t i;
+
+	if (!json_get_params(buffer, params,
+			     "?types", &typestok,
+			     NULL)) {
+		command_fail(cmd, "Invalid arguments");
+		return;
+	}
+
+	/* We'd hold up the rest of a batch forever. */
+	if (!command_can_notify(cmd)) {
+		command_fail(cmd, "Cannot subscribe within a batch");
+		return;
+	}
+
+	sub = tal(cmd, struct subscription);
+	sub->cmd = cmd;
+	if (!typestok)
+		sub->types = EVENT_HTLC | EVENT_PEER | EVENT_BLOCK
+			| EVENT_PAYMENT;
+	else {
+		const jsmntok_t *t, *end;
+
+		if (typestok->type != JSMN_ARRAY) {
+			command_fail(cmd, "Expected array of types");
+			return;
+		}
+		sub->types = 0;
+		end = json_next(typestok);
+		for (t = typestok + 1; t < end; t = json_next(t)) {
+			for (i = 0; i < ARRAY_SIZE(event_names); i++)
+				if (json_tok_streq(buffer, t, event_names[i]))
+					break;
+			if (i == ARRAY_SIZE(event_names)) {
+				command_fail(cmd, "Unknown type '%.*s'",
+					     json_tok_len(t),
+					     json_tok_contents(buffer, t));
+				return;
+			}
+			sub->types |= (1 << i);
+		}
+	}
+
+	list_add_tail(&cmd->dstate->subscriptions, &sub->list);
+
+	/* Tell them we're listening: events follow. */
+	response = new_json_result(cmd);
+	json_object_start(response, NULL);
+	json_add_string(response, "type", "subscribed");
+	json_object_end(response);
+	command_notify(cmd, json_result_string(response));
+}
+
+const struct json_command subscribe_command = {
+	"subscribe",
+	json_subscribe,
+	"Receive events of {types} (htlc, peer, block, payment; default all)",
+	"Never completes: each event is sent as {event} with the same id,"
+	" containing {type} and what changed."
+};
@@ -0,0 +1,19 @@
+#ifndef LIGHTNING_DAEMON_EVENTS_H
+#define LIGHTNING_DAEMON_EVENTS_H
+/* Pushing changes to JSON-RPC connections which asked for them. */
+#include "config.h"
+#include "bitcoin/shadouble.h"
+#include "htlc.h"
+#include "state.h"
+#include <stdbool.h>
+
+struct lightningd_state;
+struct peer;
+
+void notify_htlc_state(const struct htlc *h, enum htlc_state oldstate);
+void notify_peer_state(const struct peer *peer, enum state oldstate);
+void notify_block(struct lightningd_state *dstate,
+		  u32 height, const struct sha256_double *blkid);
+void notify_payment(struct lightningd_state *dstate,
+		    const struct sha256 *rhash, bool succeeded);
+#endif /* LIGHTNING_DAEMON_EVENTS_H */
@@ -76,6 +76,11 @@ const char *feechange_state_name(enum feechange_state s)
 {
 	size_t i;
 
+	/* They're generated in enum order, so it's almost always here. */
+	if ((size_t)s < ARRAY_SIZE(enum_feechange_state_names) - 1
+	    && enum_feechange_state_names[s].v == s)
+		return enum_feechange_state_names[s].name;
+
 	for (i = 0; enum_feechange_state_names[i].name; i++)
 		if (enum_feechange_state_names[i].v == s)
 			return enum_feechange_state_names[i].name;
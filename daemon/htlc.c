@@ -1,7 +1,10 @@
 #include "db.h"
+#include "events.h"
 #include "htlc.h"
 #include "log.h"
 #include "peer.h"
+#include "stats.h"
+#include "trace.h"
   #include "gen_htlc_state_names.h"
 #include <ccan/array_size/array_size.h>
 #include <inttypes.h>
@@ -10,6 +13,11 @@ const char *htlc_state_name(enum htlc_state s)
 {
 	size_t i;
 
+	/* They're generated in enum order, so it's almost always here. */
+	if ((size_t)s < ARRAY_SIZE(enum_htlc_state_names) - 1
+	    && enum_htlc_state_names[s].v == s)
+		return enum_htlc_state_names[s].name;
+
 	for (i = 0; enum_htlc_state_names[i].name; i++)
 		if (enum_htlc_state_names[i].v == s)
 			return enum_htlc_state_names[i].name;
@@ -168,6 +176,9 @@ void htlc_changestate(struct htlc *h,
 	       == (htlc_state_flags(newstate)&(HTLC_LOCAL_F_OWNER|HTLC_REMOTE_F_OWNER)));
 
 	h->state = newstate;
+	stats_htlc_state(h, oldstate);
+	trace4(htlc_state, h->peer, h->id, oldstate, newstate);
+	notify_htlc_state(h, oldstate);
 
 	if (db_commit) {
 		if (newstate == RCVD_ADD_COMMIT || newstate == SENT_ADD_COMMIT) {
@@ -183,6 +194,15 @@ void htlc_changestate(struct htlc *h,
 	}
 }
 
+bool htlc_changestate_bulk(enum htlc_state oldstate,
+			   enum htlc_state newstate)
+{
+	/* New ones are inserted; the db keeps *_REMOVE_HTLC in the state
+	 * before, alongside HTLCs which aren't being removed. */
+	return newstate != RCVD_ADD_COMMIT && newstate != SENT_ADD_COMMIT
+		&& oldstate != RCVD_REMOVE_HTLC && oldstate != SENT_REMOVE_HTLC;
+}
+
 void htlc_undostate(struct htlc *h,
 		    enum htlc_state oldstate,
 		    enum htlc_state newstate)
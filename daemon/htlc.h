@@ -4,12 +4,15 @@
 #include "bitcoin/locktime.h"
 #include "channel.h"
 #include "htlc_state.h"
+#include "protobuf_convert.h"
 #include "pseudorand.h"
 #include <assert.h>
 #include <ccan/crypto/sha256/sha256.h>
 #include <ccan/crypto/siphash24/siphash24.h>
 #include <ccan/htable/htable_type.h>
 #include <ccan/short_types/short_types.h>
+#include <ccan/structeq/structeq.h>
+#include <ccan/time/time.h>
 
 /* What are we doing: adding or removing? */
 #define HTLC_ADDING			0x400
@@ -56,15 +59,38 @@ struct htlc {
 	struct abs_locktime expiry;
 	/* The hash of the preimage which can redeem this HTLC */
 	struct sha256 rhash;
-	/* The preimage which hashes to rhash (if known) */
+	/* The preimage which hashes to rhash (if known): points at rval. */
 	struct rval *r;
+	struct rval rval;
 
 	/* FIXME: We could union these together: */
-	/* Routing information sent with this HTLC. */
+	/* Routing information sent with this HTLC: if we loaded it, it's
+	 * NULL until db_htlc_routing() reads it in from routing_id. */
 	const u8 *routing;
+	const struct sha256 *routing_id;
 	/* Previous HTLC (if any) which made us offer this (LOCAL only) */
 	struct htlc *src;
+	/* The reverse: what we offered because of this (REMOTE only) */
+	struct htlc *dst;
+	/* Who its onion says to pass it to, once unwrapped (REMOTE only):
+	 * so a reconnect needn't unwrap it again to see if it's for them. */
+	const u8 *next_der;
+	/* Why admission control refused it as they offered it (REMOTE
+	 * only): we fail it as soon as it's committed. */
+	const char *refused;
 	const u8 *fail;
+	/* When we created it (or loaded it), for forwarding stats. */
+	struct timeabs created;
+	/* When it entered this state (see stats_htlc_state). */
+	struct timeabs changed;
+
+	/* Its scripts in the last LOCAL and REMOTE commitment tx we built:
+	 * the next one only differs by revocation hash (see commit_tx.c). */
+	struct htlc_scripts {
+		u8 *wscript, *p2wsh;
+		size_t revoke_off;
+		struct sha256 revoke;
+	} scripts[2];
 };
 
 const char *htlc_state_name(enum htlc_state s);
@@ -73,6 +99,10 @@ void htlc_changestate(struct htlc *h,
 		      enum htlc_state oldstate,
 		      enum htlc_state newstate,
 		      bool db_commit);
+/* Can the db move every HTLC in @oldstate at once (db_update_htlc_states),
+ * instead of htlc_changestate() doing each? */
+bool htlc_changestate_bulk(enum htlc_state oldstate,
+			   enum htlc_state newstate);
 int htlc_state_flags(enum htlc_state state);
 
 static inline bool htlc_has(const struct htlc *h, int flag)
@@ -137,6 +167,23 @@ static inline size_t htlc_map_count(const struct htlc_map *htlcs)
 	return htlcs->raw.elems;
 }
 
+/* htlc_rhash_map: rhash -> every htlc (of any peer) carrying it. */
+static inline const struct sha256 *htlc_rhash(const struct htlc *h)
+{
+	return &h->rhash;
+}
+static inline bool htlc_rhash_eq(const struct htlc *h,
+				 const struct sha256 *rhash)
+{
+	return structeq(&h->rhash, rhash);
+}
+static inline size_t htlc_rhash_hash(const struct sha256 *rhash)
+{
+	return siphash24(siphash_seed(), rhash, sizeof(*rhash));
+}
+HTABLE_DEFINE_TYPE(struct htlc, htlc_rhash, htlc_rhash_hash, htlc_rhash_eq,
+		   htlc_rhash_map);
+
 /* FIXME: Move these out of the hash! */
 static inline bool htlc_is_dead(const struct htlc *htlc)
 {
@@ -1,7 +1,10 @@
+#include "controlled_time.h"
 #include "db.h"
 #include "invoice.h"
 #include "jsonrpc.h"
 #include "lightningd.h"
+#include "log.h"
+#include "timeout.h"
 #include <ccan/str/hex/hex.h>
 #include <ccan/structeq/structeq.h>
 #include <ccan/tal/str/str.h>
@@ -10,64 +13,88 @@
 struct invoice_waiter {
 	struct list_node list;
 	struct command *cmd;
+	/* For waitanyinvoice: tell them everything after this. */
+	bool any;
+	u64 after;
 };
 
-static struct invoice *find_inv(const struct list_head *list,
-				const struct sha256 *rhash)
+struct invoice *find_unpaid(struct lightningd_state *dstate,
+			     const struct sha256 *rhash)
 {
-	struct invoice *i;
+	struct invoice *i = invoice_rhash_map_get(dstate->invoices_by_rhash,
+						  rhash);
 
-	list_for_each(list, i, list) {
-		if (structeq(rhash, &i->rhash))
-			return i;
-	}
-	return NULL;
+	if (i && i->paid_num)
+		return NULL;
+	return i;
 }
 
-struct invoice *find_unpaid(struct lightningd_state *dstate,
-			     const struct sha256 *rhash)
+/* paid_num says which list it's on. */
+static struct invoice *find_invoice_by_label(struct lightningd_state *dstate,
+					     const char *label, bool paid)
 {
-	return find_inv(&dstate->unpaid, rhash);
+	struct invoice *i = invoice_label_map_get(dstate->invoices_by_label,
+						  label);
+
+	if (i && (i->paid_num != 0) != paid)
+		return NULL;
+	return i;
 }
 
-static struct invoice *find_paid(struct lightningd_state *dstate,
-				 const struct sha256 *rhash)
+static void index_invoice(struct lightningd_state *dstate,
+			  struct invoice *invoice)
 {
-	return find_inv(&dstate->paid, rhash);
+	invoice_rhash_map_add(dstate->invoices_by_rhash, invoice);
+	invoice_label_map_add(dstate->invoices_by_label, invoice);
 }
 
-static struct invoice *find_invoice_by_label(const struct list_head *list,
-					     const char *label)
+static void forget_invoice(struct lightningd_state *dstate,
+			   struct invoice *invoice)
 {
-	struct invoice *i;
+	list_del_from(invoice->paid_num ? &dstate->paid : &dstate->unpaid,
+		      &invoice->list);
+	invoice_rhash_map_del(dstate->invoices_by_rhash, invoice);
+	invoice_label_map_del(dstate->invoices_by_label, invoice);
+}
 
-	list_for_each(list, i, list) {
-		if (streq(i->label, label))
-			return i;
-	}
-	return NULL;
+static u64 now_secs(void)
+{
+	return controlled_time().ts.tv_sec;
+}
+
+bool invoice_expired(struct lightningd_state *dstate,
+		     const struct invoice *invoice)
+{
+	return invoice->expiry && invoice->expiry <= now_secs();
 }
 
 void invoice_add(struct lightningd_state *dstate,
 		 const struct rval *r,
 		 u64 msatoshi,
 		 const char *label,
-		 u64 paid_num)
+		 u64 paid_num,
+		 u64 expiry)
 {
 	struct invoice *invoice = tal(dstate, struct invoice);
 
 	invoice->msatoshi = msatoshi;
 	invoice->r = *r;
 	invoice->paid_num = paid_num;
+	invoice->expiry = expiry;
+	list_head_init(&invoice->parts);
+	invoice->parts_msatoshi = 0;
+	invoice->parts_timer = NULL;
 	invoice->label = tal_strdup(invoice, label);
 	sha256(&invoice->rhash, invoice->r.r, sizeof(invoice->r.r));
 
+	/* We load in paid_num order, so paid stays in that order. */
 	if (paid_num) {
-		list_add(&dstate->paid, &invoice->list);
+		list_add_tail(&dstate->paid, &invoice->list);
 		if (paid_num > dstate->invoices_completed)
 			dstate->invoices_completed = paid_num;
 	} else
 		list_add(&dstate->unpaid, &invoice->list);
+	index_invoice(dstate, invoice);
 }
 
 static void tell_waiter(struct command *cmd, const struct invoice *paid)
@@ -78,6 +105,37 @@ static void tell_waiter(struct command *cmd, const struct invoice *paid)
 	json_add_string(response, "label", paid->label);
 	json_add_hex(response, "rhash", &paid->rhash, sizeof(paid->rhash));
 	json_add_u64(response, "msatoshi", paid->msatoshi);
+	json_add_u64(response, "pay_index", paid->paid_num);
+	json_object_end(response);
+	command_success(cmd, response);
+}
+
+/* Everything paid after @after, oldest first. */
+static void tell_any_waiter(struct command *cmd,
+			    struct lightningd_state *dstate, u64 after)
+{
+	struct json_result *response = new_json_result(cmd);
+	struct invoice *i, *first = NULL;
+
+	/* Usually they're nearly up to date: start from the end. */
+	list_for_each_rev(&dstate->paid, i, list) {
+		if (i->paid_num <= after)
+			break;
+		first = i;
+	}
+
+	json_object_start(response, NULL);
+	json_array_start(response, "invoices");
+	for (i = first; i; i = list_next(&dstate->paid, i, list)) {
+		json_object_start(response, NULL);
+		json_add_string(response, "label", i->label);
+		json_add_hex(response, "rhash", &i->rhash, sizeof(i->rhash));
+		json_add_u64(response, "msatoshi", i->msatoshi);
+		json_add_u64(response, "pay_index", i->paid_num);
+		json_object_end(response);
+	}
+	json_array_end(response);
+	json_add_u64(response, "pay_index", dstate->invoices_completed);
 	json_object_end(response);
 	command_success(cmd, response);
 }
@@ -94,77 +152,183 @@ void resolve_invoice(struct lightningd_state *dstate,
 	/* Tell all the waiters about the new paid invoice */
 	while ((w = list_pop(&dstate->invoice_waiters,
 			     struct invoice_waiter,
-			     list)) != NULL)
-		tell_waiter(w->cmd, invoice);
+			     list)) != NULL) {
+		if (w->any)
+			tell_any_waiter(w->cmd, dstate, w->after);
+		else
+			tell_waiter(w->cmd, invoice);
+	}
 
 	db_resolve_invoice(dstate, invoice->label, invoice->paid_num);
 }
 	
-static void json_invoice(struct command *cmd,
-			 const char *buffer, const jsmntok_t *params)
+/* Invoices come in bursts: keep preimages ready, and top them up a
+ * few at a time between other work. */
+#define PREIMAGE_POOL_SIZE 256
+#define PREIMAGE_REFILL_BATCH 32
+
+struct preimage_pool {
+	size_t num;
+	bool refilling;
+	struct {
+		struct rval r;
+		struct sha256 rhash;
+	} preimages[PREIMAGE_POOL_SIZE];
+};
+
+static void gen_preimage(struct rval *r, struct sha256 *rhash)
+{
+	randombytes_buf(r->r, sizeof(r->r));
+	sha256(rhash, r->r, sizeof(r->r));
+}
+
+static void refill_preimages(struct lightningd_state *dstate)
+{
+	struct preimage_pool *pool = dstate->preimages;
+	size_t i;
+
+	for (i = 0; i < PREIMAGE_REFILL_BATCH; i++) {
+		if (pool->num == PREIMAGE_POOL_SIZE) {
+			pool->refilling = false;
+			return;
+		}
+		gen_preimage(&pool->preimages[pool->num].r,
+			     &pool->preimages[pool->num].rhash);
+		pool->num++;
+	}
+	new_reltimer(dstate, pool, time_from_sec(0), refill_preimages, dstate);
+}
+
+static void get_preimage(struct lightningd_state *dstate,
+			 struct rval *r, struct sha256 *rhash)
+{
+	struct preimage_pool *pool = dstate->preimages;
+
+	if (!pool->num) {
+		gen_preimage(r, rhash);
+		return;
+	}
+
+	pool->num--;
+	*r = pool->preimages[pool->num].r;
+	*rhash = pool->preimages[pool->num].rhash;
+	/* Only one invoice gets to use it. */
+	memset(&pool->preimages[pool->num].r, 0, sizeof(*r));
+
+	if (!pool->refilling) {
+		pool->refilling = true;
+		new_reltimer(dstate, pool, time_from_sec(0),
+			     refill_preimages, dstate);
+	}
+}
+
+struct invoice *invoice_new(struct lightningd_state *dstate,
+			    u64 msatoshi, const char *label, u32 expiry)
 {
 	struct invoice *invoice;
-	jsmntok_t *msatoshi, *r, *label;
-	struct json_result *response = new_json_result(cmd);	
+
+	if (invoice_label_map_get(dstate->invoices_by_label, label))
+		return NULL;
+
+	invoice = tal(dstate, struct invoice);
+	get_preimage(dstate, &invoice->r, &invoice->rhash);
+	invoice->msatoshi = msatoshi;
+	invoice->label = tal_strdup(invoice, label);
+	invoice->paid_num = 0;
+	invoice->expiry = expiry ? now_secs() + expiry : 0;
+	list_head_init(&invoice->parts);
+	invoice->parts_msatoshi = 0;
+	invoice->parts_timer = NULL;
+
+	if (!db_new_invoice(dstate, invoice->msatoshi, invoice->label,
+			    &invoice->r, invoice->expiry))
+		return tal_free(invoice);
+
+	list_add(&dstate->unpaid, &invoice->list);
+	index_invoice(dstate, invoice);
+	return invoice;
+}
+
+/* Fills in @invoice from {amount}, {label}, ?{r} and ?{expiry}: returns
+ * an error (off @cmd) if they're no good, or already in use. */
+static const char *invoice_from_params(struct command *cmd,
+				       const char *buffer,
+				       const jsmntok_t *params,
+				       struct invoice *invoice)
+{
+	jsmntok_t *msatoshi, *r, *label, *expirytok;
+	unsigned int expiry = cmd->dstate->config.invoice_expiry;
 
 	if (!json_get_params(buffer, params,
 			     "amount", &msatoshi,
 			     "label", &label,
 			     "?r", &r,
-			     NULL)) {
-		command_fail(cmd, "Need {amount} and {label}");
-		return;
-	}
+			     "?expiry", &expirytok,
+			     NULL))
+		return "Need {amount} and {label}";
 
-	invoice = tal(cmd, struct invoice);
 	if (r) {
 		if (!hex_decode(buffer + r->start, r->end - r->start,
-				invoice->r.r, sizeof(invoice->r.r))) {
-			command_fail(cmd, "Invalid hex r '%.*s'",
-				     r->end - r->start, buffer + r->start);
-			return;
-		}
+				invoice->r.r, sizeof(invoice->r.r)))
+			return tal_fmt(cmd, "Invalid hex r '%.*s'",
+				       r->end - r->start, buffer + r->start);
+		sha256(&invoice->rhash, invoice->r.r, sizeof(invoice->r.r));
+		if (invoice_rhash_map_get(cmd->dstate->invoices_by_rhash,
+					  &invoice->rhash))
+			return tal_fmt(cmd, "Duplicate r value '%.*s'",
+				       r->end - r->start, buffer + r->start);
 	} else
-		randombytes_buf(invoice->r.r, sizeof(invoice->r.r));
-
-	sha256(&invoice->rhash, invoice->r.r, sizeof(invoice->r.r));
-	if (find_unpaid(cmd->dstate, &invoice->rhash)
-	    || find_paid(cmd->dstate, &invoice->rhash)) {
-		command_fail(cmd, "Duplicate r value '%.*s'",
-			     r->end - r->start, buffer + r->start);
-		return;
-	}
+		get_preimage(cmd->dstate, &invoice->r, &invoice->rhash);
 
 	if (!json_tok_u64(buffer, msatoshi, &invoice->msatoshi)
-	    || invoice->msatoshi == 0) {
-		command_fail(cmd, "'%.*s' is not a valid positive number",
-			     msatoshi->end - msatoshi->start,
-			     buffer + msatoshi->start);
-		return;
-	}
+	    || invoice->msatoshi == 0)
+		return tal_fmt(cmd, "'%.*s' is not a valid positive number",
+			       msatoshi->end - msatoshi->start,
+			       buffer + msatoshi->start);
 
 	invoice->label = tal_strndup(invoice, buffer + label->start,
 				     label->end - label->start);
-	if (find_invoice_by_label(&cmd->dstate->paid, invoice->label)
-	    || find_invoice_by_label(&cmd->dstate->unpaid, invoice->label)) {
-		command_fail(cmd, "Duplicate label '%s'", invoice->label);
-		return;
-	}
-	if (strlen(invoice->label) > INVOICE_MAX_LABEL_LEN) {
-		command_fail(cmd, "label '%s' over %u bytes", invoice->label,
-			     INVOICE_MAX_LABEL_LEN);
+	if (invoice_label_map_get(cmd->dstate->invoices_by_label,
+				  invoice->label))
+		return tal_fmt(cmd, "Duplicate label '%s'", invoice->label);
+	if (strlen(invoice->label) > INVOICE_MAX_LABEL_LEN)
+		return tal_fmt(cmd, "label '%s' over %u bytes", invoice->label,
+			       INVOICE_MAX_LABEL_LEN);
+	invoice->paid_num = 0;
+
+	if (expirytok && !json_tok_number(buffer, expirytok, &expiry))
+		return tal_fmt(cmd, "Invalid expiry '%.*s'",
+			       expirytok->end - expirytok->start,
+			       buffer + expirytok->start);
+	invoice->expiry = expiry ? now_secs() + expiry : 0;
+	list_head_init(&invoice->parts);
+	invoice->parts_msatoshi = 0;
+	invoice->parts_timer = NULL;
+	return NULL;
+}
+
+static void json_invoice(struct command *cmd,
+			 const char *buffer, const jsmntok_t *params)
+{
+	struct invoice *invoice = tal(cmd, struct invoice);
+	struct json_result *response = new_json_result(cmd);
+	const char *err;
+
+	err = invoice_from_params(cmd, buffer, params, invoice);
+	if (err) {
+		command_fail(cmd, "%s", err);
 		return;
 	}
-	invoice->paid_num = 0;
 
 	if (!db_new_invoice(cmd->dstate, invoice->msatoshi, invoice->label,
-			    &invoice->r)) {
+			    &invoice->r, invoice->expiry)) {
 		command_fail(cmd, "database error");
 		return;
 	}		
 	/* OK, connect it to main state, respond with hash */
 	tal_steal(cmd->dstate, invoice);
 	list_add(&cmd->dstate->unpaid, &invoice->list);
+	index_invoice(cmd->dstate, invoice);
 
 	json_object_start(response, NULL);
 	json_add_hex(response, "rhash",
@@ -177,46 +341,185 @@ static void json_invoice(struct command *cmd,
 const struct json_command invoice_command = {
 	"invoice",
 	json_invoice,
-	"Create invoice for {msatoshi} with {label} (with a set {r}, otherwise generate one)",
+	"Create invoice for {msatoshi} with {label} (with a set {r}, otherwise generate one), payable for {expiry} seconds",
 	"Returns the {rhash} on success. "
 };
 
-static void json_add_invoices(struct json_result *response,
-			      const struct list_head *list,
-			      const char *buffer, const jsmntok_t *label)
+static void unindex_invoices(struct lightningd_state *dstate,
+			     struct invoice **invoices, size_t num)
 {
-	struct invoice *i;
+	size_t i;
 
-	list_for_each(list, i, list) {
-		if (label && !json_tok_streq(buffer, label, i->label))
-			continue;
-		json_object_start(response, NULL);
-		json_add_string(response, "label", i->label);
-		json_add_hex(response, "rhash", &i->rhash, sizeof(i->rhash));
-		json_add_u64(response, "msatoshi", i->msatoshi);
-		json_add_bool(response, "complete", i->paid_num != 0);
-		json_object_end(response);
+	for (i = 0; i < num; i++) {
+		invoice_rhash_map_del(dstate->invoices_by_rhash, invoices[i]);
+		invoice_label_map_del(dstate->invoices_by_label, invoices[i]);
 	}
 }
 
+static void json_invoices(struct command *cmd,
+			  const char *buffer, const jsmntok_t *params)
+{
+	struct lightningd_state *dstate = cmd->dstate;
+	struct json_result *response;
+	struct invoice **invoices;
+	jsmntok_t *invoicestok;
+	const jsmntok_t *t, *end;
+	size_t i, num = 0;
+	bool held;
+
+	if (!json_get_params(buffer, params,
+			     "invoices", &invoicestok,
+			     NULL)) {
+		command_fail(cmd, "Need {invoices}");
+		return;
+	}
+	if (invoicestok->type != JSMN_ARRAY) {
+		command_fail(cmd, "invoices must be an array");
+		return;
+	}
+
+	/* Check them all first; indexing each catches duplicates among
+	 * them, too. */
+	invoices = tal_arr(cmd, struct invoice *, invoicestok->size);
+	end = json_next(invoicestok);
+	for (t = invoicestok + 1; t < end; t = json_next(t)) {
+		const char *err;
+
+		invoices[num] = tal(invoices, struct invoice);
+		err = invoice_from_params(cmd, buffer, t, invoices[num]);
+		if (err) {
+			unindex_invoices(dstate, invoices, num);
+			command_fail(cmd, "invoices %zu: %s", num, err);
+			return;
+		}
+		index_invoice(dstate, invoices[num]);
+		num++;
+	}
+
+	/* One transaction for all of them (a JSON batch may have one). */
+	held = db_commits_held(dstate);
+	if (!held)
+		db_hold_commits(dstate);
+	for (i = 0; i < num; i++) {
+		if (!db_new_invoice(dstate, invoices[i]->msatoshi,
+				    invoices[i]->label, &invoices[i]->r,
+				    invoices[i]->expiry))
+			break;
+		tal_steal(dstate, invoices[i]);
+		list_add(&dstate->unpaid, &invoices[i]->list);
+	}
+	if (!held)
+		db_release_commits(dstate);
+
+	if (i != num) {
+		unindex_invoices(dstate, invoices + i, num - i);
+		command_fail(cmd, "database error after %zu invoices", i);
+		return;
+	}
+
+	response = new_json_result(cmd);
+	json_object_start(response, NULL);
+	json_array_start(response, "rhashes");
+	for (i = 0; i < num; i++)
+		json_add_hex(response, NULL, &invoices[i]->rhash,
+			     sizeof(invoices[i]->rhash));
+	json_array_end(response);
+	json_object_end(response);
+	command_success(cmd, response);
+}
+
+const struct json_command invoices_command = {
+	"invoices",
+	json_invoices,
+	"Create many {invoices} at once, each an object of {amount}, {label} and optional {r} and {expiry} as invoice takes; if any is bad, none are created",
+	"Returns the {rhashes} on success, in the same order"
+};
+
+static void json_add_invoice(struct json_result *response,
+			     const struct invoice *i)
+{
+	json_object_start(response, NULL);
+	json_add_string(response, "label", i->label);
+	json_add_hex(response, "rhash", &i->rhash, sizeof(i->rhash));
+	json_add_u64(response, "msatoshi", i->msatoshi);
+	json_add_bool(response, "complete", i->paid_num != 0);
+	if (i->expiry)
+		json_add_u64(response, "expiry", i->expiry);
+	json_object_end(response);
+}
+
+/* We list paid, then unpaid. */
+static struct invoice *next_invoice(struct lightningd_state *dstate,
+				    struct invoice *i)
+{
+	struct invoice *next;
+
+	if (!i)
+		next = list_top(&dstate->paid, struct invoice, list);
+	else if (i->paid_num)
+		next = list_next(&dstate->paid, i, list);
+	else
+		return list_next(&dstate->unpaid, i, list);
+
+	if (!next)
+		next = list_top(&dstate->unpaid, struct invoice, list);
+	return next;
+}
+
 static void json_listinvoice(struct command *cmd,
 			     const char *buffer, const jsmntok_t *params)
 {
-	jsmntok_t *label = NULL;
+	jsmntok_t *label = NULL, *limittok = NULL, *aftertok = NULL;
 	struct json_result *response = new_json_result(cmd);	
+	struct invoice *i;
+	unsigned int n = 0, limit = 0;
 
 	if (!json_get_params(buffer, params,
 			     "?label", &label,
+			     "?limit", &limittok,
+			     "?after", &aftertok,
 			     NULL)) {
 		command_fail(cmd, "Invalid arguments");
 		return;
 	}
 
-	
+	if (limittok && !json_tok_number(buffer, limittok, &limit)) {
+		command_fail(cmd, "Invalid limit '%.*s'",
+			     limittok->end - limittok->start,
+			     buffer + limittok->start);
+		return;
+	}
+
 	json_object_start(response, NULL);
 	json_array_start(response, NULL);
-	json_add_invoices(response, &cmd->dstate->paid, buffer, label);
-	json_add_invoices(response, &cmd->dstate->unpaid, buffer, label);
+	if (label) {
+		i = invoice_label_map_get(cmd->dstate->invoices_by_label,
+					  tal_strndup(cmd, buffer + label->start,
+						      label->end - label->start));
+		if (i)
+			json_add_invoice(response, i);
+	} else {
+		/* Carry on from where the last page left off. */
+		if (aftertok) {
+			const char *after;
+
+			after = tal_strndup(cmd, buffer + aftertok->start,
+					    aftertok->end - aftertok->start);
+			i = invoice_label_map_get(cmd->dstate->invoices_by_label,
+						  after);
+			if (!i) {
+				command_fail(cmd, "Unknown invoice '%s'", after);
+				return;
+			}
+		} else
+			i = NULL;
+
+		while ((!limit || n < limit)
+		       && (i = next_invoice(cmd->dstate, i)) != NULL) {
+			json_add_invoice(response, i);
+			n++;
+		}
+	}
 	json_array_end(response);
 	json_object_end(response);
 	command_success(cmd, response);
@@ -225,7 +528,7 @@ static void json_listinvoice(struct command *cmd,
 const struct json_command listinvoice_command = {
 	"listinvoice",
 	json_listinvoice,
-	"Show invoice {label} (or all, if no {label}))",
+	"Show invoice {label} (or all, if no {label}, up to {limit} of them after label {after})",
 	"Returns an array of {label}, {rhash}, {msatoshi} and {complete} on success. "
 };
 
@@ -246,7 +549,7 @@ static void json_delinvoice(struct command *cmd,
 
 	label = tal_strndup(cmd, buffer + labeltok->start,
 			    labeltok->end - labeltok->start);
-	i = find_invoice_by_label(&cmd->dstate->unpaid, label);
+	i = find_invoice_by_label(cmd->dstate, label, false);
 	if (!i) {
 		command_fail(cmd, "Unknown invoice");
 		return;
@@ -255,7 +558,8 @@ static void json_delinvoice(struct command *cmd,
 		command_fail(cmd, "Database error");
 		return;
 	}
-	list_del_from(&cmd->dstate->unpaid, &i->list);
+	forget_invoice(cmd->dstate, i);
+	fail_invoice_parts(i, "invoice deleted");
 	
 	json_object_start(response, NULL);
 	json_add_string(response, "label", i->label);
@@ -293,7 +597,7 @@ static void json_waitinvoice(struct command *cmd,
 	else {
 		label = tal_strndup(cmd, buffer + labeltok->start,
 				    labeltok->end - labeltok->start);
-		i = find_invoice_by_label(&cmd->dstate->paid, label);
+		i = find_invoice_by_label(cmd->dstate, label, true);
 		if (!i) {
 			command_fail(cmd, "Label not found");
 			return;
@@ -311,6 +615,7 @@ static void json_waitinvoice(struct command *cmd,
 	/* FIXME: Better to use io_wait directly? */
 	w = tal(cmd, struct invoice_waiter);
 	w->cmd = cmd;
+	w->any = false;
 	list_add_tail(&cmd->dstate->invoice_waiters, &w->list);
 }
 
@@ -318,5 +623,106 @@ const struct json_command waitinvoice_command = {
 	"waitinvoice",
 	json_waitinvoice,
 	"Wait for the next invoice to be paid, after {label} (if supplied)))",
-	"Returns {label}, {rhash} and {msatoshi} on success. "
+	"Returns {label}, {rhash}, {msatoshi} and {pay_index} on success. "
+};
+
+static void json_waitanyinvoice(struct command *cmd,
+				const char *buffer, const jsmntok_t *params)
+{
+	jsmntok_t *aftertok;
+	u64 after = 0;
+	struct invoice_waiter *w;
+
+	if (!json_get_params(buffer, params,
+			     "?after", &aftertok,
+			     NULL)) {
+		command_fail(cmd, "Invalid arguments");
+		return;
+	}
+
+	if (aftertok && !json_tok_u64(buffer, aftertok, &after)) {
+		command_fail(cmd, "Invalid after '%.*s'",
+			     aftertok->end - aftertok->start,
+			     buffer + aftertok->start);
+		return;
+	}
+
+	if (after < cmd->dstate->invoices_completed) {
+		tell_any_waiter(cmd, cmd->dstate, after);
+		return;
+	}
+
+	w = tal(cmd, struct invoice_waiter);
+	w->cmd = cmd;
+	w->any = true;
+	w->after = after;
+	list_add_tail(&cmd->dstate->invoice_waiters, &w->list);
+}
+
+const struct json_command waitanyinvoice_command = {
+	"waitanyinvoice",
+	json_waitanyinvoice,
+	"Wait for invoices to be paid after pay_index {after} (if supplied)",
+	"Returns {invoices} paid since, and the latest {pay_index}, on success. "
 };
+
+/* Often enough that expired invoices don't pile up. */
+#define INVOICE_SWEEP_SECS 60
+
+static void sweep_invoices(struct lightningd_state *dstate)
+{
+	struct invoice *i, *next;
+	u64 now = now_secs(), archive_upto = 0;
+	size_t expired = 0, archived = 0;
+	u32 keep = dstate->config.invoice_paid_keep;
+
+	/* Paid ones are numbered in order: keep the newest few. */
+	if (keep && dstate->invoices_completed > keep)
+		archive_upto = dstate->invoices_completed - keep;
+
+	/* Don't bother the database unless there's something to do. */
+	list_for_each(&dstate->unpaid, i, list)
+		expired += (i->expiry && i->expiry <= now);
+	list_for_each(&dstate->paid, i, list)
+		archived += (i->paid_num <= archive_upto);
+	if (!expired && !archived)
+		goto again;
+
+	if (!db_sweep_invoices(dstate, now, archive_upto)) {
+		log_broken(dstate->base_log, "Could not sweep invoices");
+		goto again;
+	}
+
+	list_for_each_safe(&dstate->unpaid, i, next, list) {
+		if (i->expiry && i->expiry <= now) {
+			forget_invoice(dstate, i);
+			fail_invoice_parts(i, "invoice expired");
+			tal_free(i);
+		}
+	}
+	list_for_each_safe(&dstate->paid, i, next, list) {
+		if (i->paid_num <= archive_upto) {
+			forget_invoice(dstate, i);
+			tal_free(i);
+		}
+	}
+	log_debug(dstate->base_log,
+		  "Deleted %zu expired invoices, archived %zu paid",
+		  expired, archived);
+again:
+	new_reltimer(dstate, dstate, time_from_sec(INVOICE_SWEEP_SECS),
+		     sweep_invoices, dstate);
+}
+
+void invoices_init(struct lightningd_state *dstate)
+{
+	struct preimage_pool *pool = tal(dstate, struct preimage_pool);
+
+	pool->num = 0;
+	pool->refilling = false;
+	dstate->preimages = pool;
+	refill_preimages(dstate);
+
+	new_reltimer(dstate, dstate, time_from_sec(INVOICE_SWEEP_SECS),
+		     sweep_invoices, dstate);
+}
@@ -2,6 +2,10 @@
 #define LIGHTNING_DAEMON_INVOICE_H
 #include "config.h"
 #include "peer.h"
+#include <ccan/crypto/siphash24/siphash24.h>
+#include <ccan/htable/htable_type.h>
+#include <ccan/str/str.h>
+#include <ccan/structeq/structeq.h>
 
 struct lightningd_state;
 
@@ -12,8 +16,47 @@ struct invoice {
 	struct rval r;
 	struct sha256 rhash;
 	u64 paid_num;
+	/* Seconds since epoch after which it can't be paid (0 == never). */
+	u64 expiry;
+	/* HTLCs paying part of it, held until the rest arrive. */
+	struct list_head parts;
+	u64 parts_msatoshi;
+	struct oneshot *parts_timer;
 };
 
+/* Both paid and unpaid invoices, by rhash and by label. */
+static inline const struct sha256 *invoice_rhash(const struct invoice *i)
+{
+	return &i->rhash;
+}
+static inline size_t invoice_rhash_hash(const struct sha256 *rhash)
+{
+	return siphash24(siphash_seed(), rhash, sizeof(*rhash));
+}
+static inline bool invoice_rhash_eq(const struct invoice *i,
+				    const struct sha256 *rhash)
+{
+	return structeq(&i->rhash, rhash);
+}
+HTABLE_DEFINE_TYPE(struct invoice, invoice_rhash, invoice_rhash_hash,
+		   invoice_rhash_eq, invoice_rhash_map);
+
+static inline const char *invoice_label(const struct invoice *i)
+{
+	return i->label;
+}
+static inline size_t invoice_label_hash(const char *label)
+{
+	return siphash24(siphash_seed(), label, strlen(label));
+}
+static inline bool invoice_label_eq(const struct invoice *i,
+				    const char *label)
+{
+	return streq(i->label, label);
+}
+HTABLE_DEFINE_TYPE(struct invoice, invoice_label, invoice_label_hash,
+		   invoice_label_eq, invoice_label_map);
+
 #define INVOICE_MAX_LABEL_LEN 128
 
 /* From database */
@@ -21,7 +64,14 @@ void invoice_add(struct lightningd_state *dstate,
 		 const struct rval *r,
 		 u64 msatoshi,
 		 const char *label,
-		 u64 complete);
+		 u64 complete,
+		 u64 expiry);
+
+/* A new unpaid invoice, as the "invoice" command makes, payable for
+ * @expiry seconds (0 for ever): NULL if @label is taken, or on database
+ * error. */
+struct invoice *invoice_new(struct lightningd_state *dstate,
+			    u64 msatoshi, const char *label, u32 expiry);
 
 void resolve_invoice(struct lightningd_state *dstate,
 		     struct invoice *invoice);
@@ -29,4 +79,10 @@ void resolve_invoice(struct lightningd_state *dstate,
 struct invoice *find_unpaid(struct lightningd_state *dstate,
 			    const struct sha256 *rhash);
 
+bool invoice_expired(struct lightningd_state *dstate,
+		     const struct invoice *invoice);
+
+/* Periodically drop expired invoices, and archive old paid ones. */
+void invoices_init(struct lightningd_state *dstate);
+
 #endif /* LIGHTNING_DAEMON_INVOICE_H */
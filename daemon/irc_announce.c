@@ -7,30 +7,78 @@
 #include "daemon/peer.h"
 #include "daemon/routing.h"
 #include "daemon/secrets.h"
+#include "daemon/sigpool.h"
 #include "daemon/timeout.h"
 #include "utils.h"
 
 #include <ccan/list/list.h>
 #include <ccan/str/hex/hex.h>
+#include <ccan/str/str.h>
+#include <ccan/strmap/strmap.h>
 
-static bool announce_channel(const tal_t *ctx, struct ircstate *state, struct peer *p)
+/* Unchanged channels are only re-announced this often, for newcomers. */
+#define ANNOUNCE_REFRESH_SECS 300
+
+/* Stay under the server's flood limits: one message per this. */
+#define ANNOUNCE_PACE_MSEC 2000
+
+struct irc_announcement {
+	/* On ircstate's announce_queue, if queued. */
+	struct list_node list;
+	bool queued;
+	struct ircstate *state;
+	/* Our parent. */
+	struct peer *peer;
+	/* The CHAN message, and it with our signature in front. */
+	char *content, *msg;
+	/* When we last sent it (0 if we haven't, since connecting). */
+	struct timeabs sent;
+};
+
+static void destroy_announcement(struct irc_announcement *a)
+{
+	if (a->queued)
+		list_del_from(&a->state->announce_queue, &a->list);
+}
+
+static struct irc_announcement *get_announcement(struct ircstate *state,
+						 struct peer *p)
+{
+	struct irc_announcement *a = p->irc_announce;
+
+	if (!a) {
+		a = p->irc_announce = talz(p, struct irc_announcement);
+		a->state = state;
+		a->peer = p;
+		tal_add_destructor(a, destroy_announcement);
+	}
+	return a;
+}
+
+/* Builds the message afresh, but only signs it if it changed. */
+static bool announce_channel(struct ircstate *state, struct peer *p)
 {
 	char txid[65];
 	int siglen;
 	u8 der[72];
 	struct signature sig;
-	struct privmsg *msg = talz(ctx, struct privmsg);
+	struct privmsg msg;
+	struct irc_announcement *a = p->irc_announce;
+	tal_t *ctx = tal(state, char);
 	struct txlocator *loc = locate_tx(ctx, state->dstate, &p->anchor.txid);
+	char *content;
+	bool ok;
 
-	if (loc == NULL)
+	if (loc == NULL) {
+		tal_free(ctx);
 		return false;
+	}
 
 	bitcoin_txid_to_hex(&p->anchor.txid, txid, sizeof(txid));
-	msg->channel = "#lightning-nodes";
-	msg->msg = tal_fmt(
-		msg, "CHAN %s %s %s %d %d %d %d %d",
-		pubkey_to_hexstr(msg, state->dstate->secpctx, &state->dstate->id),
-		pubkey_to_hexstr(msg, state->dstate->secpctx, p->id),
+	content = tal_fmt(
+		ctx, "CHAN %s %s %s %d %d %d %d %d",
+		pubkey_to_hexstr(ctx, state->dstate->secpctx, &state->dstate->id),
+		pubkey_to_hexstr(ctx, state->dstate->secpctx, p->id),
 		txid,
 		loc->blkheight,
 		loc->index,
@@ -39,26 +87,71 @@ static bool announce_channel(const tal_t *ctx, struct ircstate *state, struct pe
 		p->remote.locktime.locktime
 		);
 
-	privkey_sign(state->dstate, msg->msg, strlen(msg->msg), &sig);
-	siglen = signature_to_der(state->dstate->secpctx, der, &sig);
-	msg->msg = tal_fmt(msg, "%s %s", tal_hexstr(ctx, der, siglen), msg->msg);
+	if (!a->content || !streq(a->content, content)) {
+		privkey_sign(state->dstate, content, strlen(content), &sig);
+		siglen = signature_to_der(state->dstate->secpctx, der, &sig);
+		tal_free(a->content);
+		tal_free(a->msg);
+		a->content = tal_steal(a, content);
+		a->msg = tal_fmt(a, "%s %s",
+				 tal_hexstr(ctx, der, siglen), a->content);
+	}
+	tal_free(ctx);
+
+	msg.channel = "#lightning-nodes";
+	msg.msg = a->msg;
+	ok = irc_send_msg(state, &msg);
+	if (ok)
+		a->sent = time_now();
+	return ok;
+}
+
+/* One at a time, so a node with many channels doesn't get kicked. */
+static void send_next_announcement(struct ircstate *state)
+{
+	struct irc_announcement *a;
+
+	a = list_pop(&state->announce_queue, struct irc_announcement, list);
+	if (!a) {
+		state->announcing = false;
+		return;
+	}
+	a->queued = false;
+
+	/* It might have started closing while it waited. */
+	if (state_is_normal(a->peer->state))
+		announce_channel(state, a->peer);
 
-	irc_send_msg(state, msg);
-	return true;
+	new_reltimer(state->dstate, state, time_from_msec(ANNOUNCE_PACE_MSEC),
+		     send_next_announcement, state);
 }
 
 static void announce_channels(struct ircstate *state)
 {
-	tal_t *ctx = tal(state, tal_t);
+	struct timeabs now = time_now();
 	struct peer *p;
 
 	list_for_each(&state->dstate->peers, p, list) {
+		struct irc_announcement *a;
 
 		if (!state_is_normal(p->state))
 			continue;
-		announce_channel(ctx, state, p);
+
+		a = get_announcement(state, p);
+		if (a->queued)
+			continue;
+		if (a->sent.ts.tv_sec
+		    && time_less(time_between(now, a->sent),
+				 time_from_sec(ANNOUNCE_REFRESH_SECS)))
+			continue;
+		list_add_tail(&state->announce_queue, &a->list);
+		a->queued = true;
+	}
+
+	if (!state->announcing && state->connected) {
+		state->announcing = true;
+		send_next_announcement(state);
 	}
-	tal_free(ctx);
 
 	new_reltimer(state->dstate, state, time_from_sec(60), announce_channels, state);
 }
@@ -66,12 +159,113 @@ static void announce_channels(struct ircstate *state)
 /* Reconnect to IRC server upon disconnection. */
 static void handle_irc_disconnect(struct ircstate *state)
 {
+	struct peer *p;
+
+	/* Whoever's there next time hasn't heard any of it. */
+	list_for_each(&state->dstate->peers, p, list)
+		if (p->irc_announce)
+			p->irc_announce->sent.ts.tv_sec = 0;
+
 	new_reltimer(state->dstate, state, state->reconnect_timeout, irc_connect, state);
 }
 
+/* Announcements arriving this close together are checked together. */
+#define INGEST_BATCH_MSEC 100
+#define INGEST_BATCH_MAX 512
+
+/* A verified-looking announcement, waiting for its signature check. */
+struct chan_update {
+	struct chan_seen *seen;
+	char *content;
+	struct pubkey pk1, pk2;
+	struct sha256_double hash;
+	struct signature sig;
+	u32 base_fee, delay;
+	s32 proportional_fee;
+};
+
+/* Per (pk1, pk2) as announced. */
+struct chan_seen {
+	/* Last one we accepted: the same again needs no checking. */
+	char *content;
+	/* If set, pending[pending-1] is the latest from this channel. */
+	size_t pending;
+};
+
+struct irc_ingest {
+	STRMAP(struct chan_seen *) seen;
+	struct chan_update *pending;
+	struct oneshot *timer;
+};
+
+static void flush_ingest(struct ircstate *istate)
+{
+	struct irc_ingest *ingest = istate->ingest;
+	struct chan_update *u = ingest->pending;
+	size_t i, n = tal_count(u), accepted = 0;
+	struct sig_job *jobs;
+
+	ingest->timer = tal_free(ingest->timer);
+	ingest->pending = tal_arr(ingest, struct chan_update, 0);
+
+	jobs = tal_arr(u, struct sig_job, n);
+	for (i = 0; i < n; i++) {
+		jobs[i].hash = u[i].hash;
+		jobs[i].privkey = NULL;
+		jobs[i].pubkey = &u[i].pk1;
+		jobs[i].sig = &u[i].sig;
+	}
+	sigpool_run(istate->dstate, jobs, n);
+
+	for (i = 0; i < n; i++) {
+		u[i].seen->pending = 0;
+		if (!jobs[i].ok) {
+			log_debug(istate->log,
+				  "Ignoring announcement %s,"
+				  " signature check failed.", u[i].content);
+			continue;
+		}
+
+		/*
+		 * FIXME Check in topology that the tx is in the block and
+		 * that the endpoints match.
+		 */
+
+		/* Capacity isn't announced: older nodes reject extra fields. */
+		add_connection(istate->dstate, &u[i].pk1, &u[i].pk2,
+			       u[i].base_fee, u[i].proportional_fee,
+			       u[i].delay, 6, 0);
+		tal_free(u[i].seen->content);
+		u[i].seen->content = tal_steal(u[i].seen, u[i].content);
+		accepted++;
+	}
+	log_debug(istate->log, "Checked %zu announcements, accepted %zu",
+		  n, accepted);
+	tal_free(u);
+}
+
+static struct chan_seen *get_seen(struct irc_ingest *ingest,
+				  const char *pk1, const char *pk2)
+{
+	char *key = tal_fmt(ingest, "%s %s", pk1, pk2);
+	struct chan_seen *seen = strmap_get(&ingest->seen, key);
+
+	if (seen) {
+		tal_free(key);
+		return seen;
+	}
+	seen = tal(ingest, struct chan_seen);
+	tal_steal(seen, key);
+	seen->content = NULL;
+	seen->pending = 0;
+	strmap_add(&ingest->seen, key, seen);
+	return seen;
+}
+
 /*
  * Handle an incoming message by checking if it is a channel
- * announcement, parse it and add the channel to the topology if yes.
+ * announcement, parse it and queue it to be checked and added to the
+ * topology if yes.
  *
  * The format for a valid announcement is:
  * <sig> CHAN <pk1> <pk2> <anchor txid> <block height> <tx position> <base_fee>
@@ -79,35 +273,39 @@ static void handle_irc_disconnect(struct ircstate *state)
  */
 static void handle_irc_privmsg(struct ircstate *istate, const struct privmsg *msg)
 {
+	struct irc_ingest *ingest = istate->ingest;
 	int blkheight;
 	char **splits = tal_strsplit(msg, msg->msg + 1, " ", STR_NO_EMPTY);
 
 	if (tal_count(splits) != 11 || !streq(splits[1], "CHAN"))
 		return;
 
+	char *content = strchr(msg->msg, ' ') + 1;
+	struct chan_seen *seen = get_seen(ingest, splits[2], splits[3]);
+
+	/* IRC re-announces the same thing often. */
+	if (seen->content && streq(seen->content, content))
+		return;
+
 	int siglen = hex_data_size(strlen(splits[0]));
 	u8 *der = tal_hexdata(msg, splits[0], strlen(splits[0]));
 	if (der == NULL)
 		return;
 
-	struct signature sig;
-	struct sha256_double hash;
-	char *content = strchr(msg->msg, ' ') + 1;
-	if (!signature_from_der(istate->dstate->secpctx, der, siglen, &sig))
+	struct chan_update u;
+	if (!signature_from_der(istate->dstate->secpctx, der, siglen, &u.sig))
 		return;
 
-	sha256_double(&hash, content, strlen(content));
+	sha256_double(&u.hash, content, strlen(content));
 	splits++;
 
-	struct pubkey *pk1 = talz(msg, struct pubkey);
-	struct pubkey *pk2 = talz(msg, struct pubkey);
-	struct sha256_double *txid = talz(msg, struct sha256_double);
+	struct sha256_double txid;
 	int index;
 
 	bool ok = true;
-	ok &= pubkey_from_hexstr(istate->dstate->secpctx, splits[1], strlen(splits[1]), pk1);
-	ok &= pubkey_from_hexstr(istate->dstate->secpctx, splits[2], strlen(splits[2]), pk2);
-	ok &= bitcoin_txid_from_hex(splits[3], strlen(splits[3]), txid);
+	ok &= pubkey_from_hexstr(istate->dstate->secpctx, splits[1], strlen(splits[1]), &u.pk1);
+	ok &= pubkey_from_hexstr(istate->dstate->secpctx, splits[2], strlen(splits[2]), &u.pk2);
+	ok &= bitcoin_txid_from_hex(splits[3], strlen(splits[3]), &txid);
 	blkheight = atoi(splits[4]);
 	index = atoi(splits[5]);
 	if (!ok || index < 0 || blkheight < 0) {
@@ -115,20 +313,31 @@ static void handle_irc_privmsg(struct ircstate *istate, const struct privmsg *ms
 		return;
 	}
 
-	if (!check_signed_hash(istate->dstate->secpctx, &hash, &sig, pk1)) {
-		log_debug(istate->log,
-			  "Ignoring announcement from %s, signature check failed.",
-			  splits[1]);
-		return;
-	}
+	u.seen = seen;
+	u.base_fee = atoi(splits[6]);
+	u.proportional_fee = atoi(splits[7]);
+	u.delay = atoi(splits[8]);
 
-	/*
-	 * FIXME Check in topology that the tx is in the block and
-	 * that the endpoints match.
-	 */
+	/* A newer one from the same channel replaces what's waiting. */
+	if (seen->pending) {
+		struct chan_update *old = &ingest->pending[seen->pending - 1];
+		tal_free(old->content);
+		*old = u;
+	} else {
+		size_t n = tal_count(ingest->pending);
+		tal_resize(&ingest->pending, n + 1);
+		ingest->pending[n] = u;
+		seen->pending = n + 1;
+	}
+	ingest->pending[seen->pending - 1].content
+		= tal_strdup(ingest->pending, content);
 
-	add_connection(istate->dstate, pk1, pk2, atoi(splits[6]),
-		       atoi(splits[7]), atoi(splits[8]), 6);
+	if (tal_count(ingest->pending) >= INGEST_BATCH_MAX)
+		flush_ingest(istate);
+	else if (!ingest->timer)
+		ingest->timer = new_reltimer(istate->dstate, ingest,
+					     time_from_msec(INGEST_BATCH_MSEC),
+					     flush_ingest, istate);
 }
 
 void setup_irc_connection(struct lightningd_state *dstate)
@@ -141,6 +350,11 @@ void setup_irc_connection(struct lightningd_state *dstate)
 	state->dstate = dstate;
 	state->server = "irc.freenode.net";
 	state->reconnect_timeout = time_from_sec(15);
+	list_head_init(&state->announce_queue);
+	state->ingest = tal(state, struct irc_ingest);
+	strmap_init(&state->ingest->seen);
+	state->ingest->pending = tal_arr(state->ingest, struct chan_update, 0);
+	state->ingest->timer = NULL;
 	state->log = new_log(state, state->dstate->log_record, "%s:irc",
 			     log_prefix(state->dstate->base_log));
 
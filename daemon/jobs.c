@@ -0,0 +1,186 @@
+/* A shared pool of worker threads, woken by a list and a condition
+ * variable, which wake the main loop through a pipe when they're done. */
+#include "jobs.h"
+#include "lightningd.h"
+#include "log.h"
+#include "timeout.h"
+#include <assert.h>
+#include <ccan/io/io.h>
+#include <ccan/list/list.h>
+#include <ccan/tal/tal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+/* Enough to keep a few slow jobs from queueing behind each other. */
+#define JOB_THREADS 4
+
+struct job_ref;
+
+struct job {
+	struct list_node list;
+	struct lightningd_state *dstate;
+	void (*work)(void *arg);
+	void (*done)(struct lightningd_state *dstate, void *arg);
+	void *arg;
+	/* If it was submitted for a peer: ref is NULL once that's freed. */
+	bool for_peer;
+	struct job_ref *ref;
+};
+
+/* Allocated off the peer, so we find out if it goes. */
+struct job_ref {
+	struct job *job;
+};
+
+struct job_pool {
+	struct lightningd_state *dstate;
+	int wakeup_fds[2];
+	char wakeup_buf[64];
+	size_t wakeup_len;
+
+	/* Everything below is under lock. */
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	struct list_head pending, finished;
+};
+
+/* Doesn't touch tal: that's not thread-safe. */
+static void *job_worker(struct job_pool *pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		struct job *job;
+
+		job = list_pop(&pool->pending, struct job, list);
+		if (!job) {
+			pthread_cond_wait(&pool->work, &pool->lock);
+			continue;
+		}
+		pthread_mutex_unlock(&pool->lock);
+
+		job->work(job->arg);
+
+		pthread_mutex_lock(&pool->lock);
+		list_add_tail(&pool->finished, &job->list);
+		/* If it's full, main loop has plenty to read already. */
+		if (write(pool->wakeup_fds[1], "", 1) != 1)
+			assert(errno == EAGAIN);
+	}
+	return NULL;
+}
+
+static void peer_gone(struct job_ref *ref)
+{
+	ref->job->ref = NULL;
+}
+
+static void job_done(struct job *job)
+{
+	if (job->ref) {
+		tal_del_destructor(job->ref, peer_gone);
+		job->ref = tal_free(job->ref);
+		job->done(job->dstate, job->arg);
+	} else if (!job->for_peer)
+		job->done(job->dstate, job->arg);
+	else
+		log_debug(job->dstate->base_log, "Dropping job for freed peer");
+	tal_free(job);
+}
+
+static struct io_plan *job_wakeup(struct io_conn *conn, struct job_pool *pool)
+{
+	struct list_head done;
+	struct job *job;
+
+	list_head_init(&done);
+	pthread_mutex_lock(&pool->lock);
+	list_append_list(&done, &pool->finished);
+	pthread_mutex_unlock(&pool->lock);
+
+	while ((job = list_pop(&done, struct job, list)) != NULL)
+		job_done(job);
+
+	return io_read_partial(conn, pool->wakeup_buf, sizeof(pool->wakeup_buf),
+			       &pool->wakeup_len, job_wakeup, pool);
+}
+
+/* Started on first use.  Like dns, the threads are never stopped, so
+ * this is never freed. */
+static struct job_pool *get_job_pool(struct lightningd_state *dstate)
+{
+	struct job_pool *pool;
+	size_t i;
+
+	if (dstate->jobs)
+		return dstate->jobs;
+
+	pool = tal(NULL, struct job_pool);
+	pool->dstate = dstate;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	list_head_init(&pool->pending);
+	list_head_init(&pool->finished);
+
+	if (pipe(pool->wakeup_fds) != 0) {
+		log_unusual(dstate->base_log,
+			    "Creating pipes for jobs: %s", strerror(errno));
+		return tal_free(pool);
+	}
+	fcntl(pool->wakeup_fds[1], F_SETFL,
+	      fcntl(pool->wakeup_fds[1], F_GETFL) | O_NONBLOCK);
+
+	for (i = 0; i < JOB_THREADS; i++) {
+		pthread_t t;
+		if (pthread_create(&t, NULL,
+				   (void *(*)(void *))job_worker, pool) != 0) {
+			/* Can't take back ones we started: use those. */
+			if (i)
+				break;
+			log_unusual(dstate->base_log,
+				    "Creating job thread: %s", strerror(errno));
+			close(pool->wakeup_fds[0]);
+			close(pool->wakeup_fds[1]);
+			return tal_free(pool);
+		}
+		pthread_detach(t);
+	}
+
+	io_new_conn(dstate, pool->wakeup_fds[0], job_wakeup, pool);
+	dstate->jobs = pool;
+	return pool;
+}
+
+void job_submit_(struct lightningd_state *dstate, struct peer *peer,
+		 void (*work)(void *arg),
+		 void (*done)(struct lightningd_state *dstate, void *arg),
+		 void *arg)
+{
+	struct job_pool *pool = get_job_pool(dstate);
+	struct job *job = tal(NULL, struct job);
+
+	job->dstate = dstate;
+	job->work = work;
+	job->done = done;
+	job->arg = tal_steal(job, arg);
+	job->for_peer = (peer != NULL);
+	if (peer) {
+		job->ref = tal(peer, struct job_ref);
+		job->ref->job = job;
+		tal_add_destructor(job->ref, peer_gone);
+	} else
+		job->ref = NULL;
+
+	if (pool) {
+		pthread_mutex_lock(&pool->lock);
+		list_add_tail(&pool->pending, &job->list);
+		pthread_cond_signal(&pool->work);
+		pthread_mutex_unlock(&pool->lock);
+		return;
+	}
+
+	/* No threads: do it now, but still answer from the loop. */
+	work(job->arg);
+	new_reltimer(dstate, job, time_from_sec(0), job_done, job);
+}
@@ -0,0 +1,25 @@
+#ifndef LIGHTNING_DAEMON_JOBS_H
+#define LIGHTNING_DAEMON_JOBS_H
+/* Worker threads for slow, self-contained work: the result is handed
+ * back to the main loop, which calls the done callback. */
+#include "config.h"
+#include <ccan/typesafe_cb/typesafe_cb.h>
+
+struct lightningd_state;
+struct peer;
+
+/* @arg (a tal object) is now owned by the job, and freed after @done.
+ * @work runs in another thread, so it must only touch @arg, and never
+ * tal or ccan/io.  If @peer is freed first, @done isn't called. */
+#define job_submit(dstate, peer, workfn, donefn, arg)			\
+	job_submit_((dstate), (peer),					\
+		    typesafe_cb(void, void *, (workfn), (arg)),		\
+		    typesafe_cb_preargs(void, void *, (donefn), (arg),	\
+					struct lightningd_state *),	\
+		    (arg))
+
+void job_submit_(struct lightningd_state *dstate, struct peer *peer,
+		 void (*work)(void *arg),
+		 void (*done)(struct lightningd_state *dstate, void *arg),
+		 void *arg);
+#endif /* LIGHTNING_DAEMON_JOBS_H */
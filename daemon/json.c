@@ -1,5 +1,6 @@
 /* JSON core and helpers */
 #include "json.h"
+#include "utils.h"
 #include <assert.h>
 #include <ccan/build_assert/build_assert.h>
 #include <ccan/str/hex/hex.h>
@@ -13,7 +14,9 @@
 
 struct json_result {
 	unsigned int indent;
-	/* tal_count() of this is strlen() + 1 */
+	/* strlen(s); tal_count(s) is the space we have, which grows by
+	 * doubling so building a large result is linear. */
+	size_t len;
 	char *s;
 };
 
@@ -222,50 +225,63 @@ const jsmntok_t *json_delve(const char *buffer,
 }
 
 /* FIXME: Return false if unknown params specified, too! */
+/* More than any command takes. */
+#define JSON_MAX_PARAMS 16
+
 bool json_get_params(const char *buffer, const jsmntok_t param[], ...)
 {
 	va_list ap;
-	const char *name;
-	const jsmntok_t **tokptr, *p, *end;
-
-	if (param->type == JSMN_ARRAY) {
-		if (param->size == 0)
-			p = NULL;
-		else
-			p = param + 1;
-		end = json_next(param);
-	} else
-		assert(param->type == JSMN_OBJECT);
+	const char *names[JSON_MAX_PARAMS];
+	const jsmntok_t **tokptrs[JSON_MAX_PARAMS];
+	bool compulsory[JSON_MAX_PARAMS], found[JSON_MAX_PARAMS];
+	const jsmntok_t *p, *end;
+	size_t i, num = 0;
 
 	va_start(ap, param);
-	while ((name = va_arg(ap, const char *)) != NULL) {
-		tokptr = va_arg(ap, const jsmntok_t **);
-		bool compulsory = true;
-		if (name[0] == '?') {
-			name++;
-			compulsory = false;
+	while ((names[num] = va_arg(ap, const char *)) != NULL) {
+		tokptrs[num] = va_arg(ap, const jsmntok_t **);
+		compulsory[num] = true;
+		if (names[num][0] == '?') {
+			names[num]++;
+			compulsory[num] = false;
 		}
-		if (param->type == JSMN_ARRAY) {
-			*tokptr = p;
-			if (p) {
-				p = json_next(p);
-				if (p == end)
-					p = NULL;
+		*tokptrs[num] = NULL;
+		found[num] = false;
+		num++;
+		assert(num < JSON_MAX_PARAMS);
+	}
+	va_end(ap);
+
+	end = json_next(param);
+	if (param->type == JSMN_ARRAY) {
+		p = param + 1;
+		for (i = 0; i < num && p < end; i++, p = json_next(p))
+			*tokptrs[i] = p;
+	} else {
+		assert(param->type == JSMN_OBJECT);
+		/* One pass over the members, whatever order they're in: the
+		 * first of any duplicates wins. */
+		for (p = param + 1; p < end; p = json_next(p+1)) {
+			for (i = 0; i < num; i++) {
+				if (found[i]
+				    || !json_tok_streq(buffer, p, names[i]))
+					continue;
+				*tokptrs[i] = p + 1;
+				found[i] = true;
+				break;
 			}
-		} else {
-			*tokptr = json_get_member(buffer, param, name);
 		}
+	}
+
+	for (i = 0; i < num; i++) {
 		/* Convert 'null' to NULL */
-		if (*tokptr
-		    && (*tokptr)->type == JSMN_PRIMITIVE
-		    && buffer[(*tokptr)->start] == 'n') {
-			*tokptr = NULL;
-		}
-		if (compulsory && !*tokptr)
+		if (*tokptrs[i]
+		    && (*tokptrs[i])->type == JSMN_PRIMITIVE
+		    && buffer[(*tokptrs[i])->start] == 'n')
+			*tokptrs[i] = NULL;
+		if (compulsory[i] && !*tokptrs[i])
 			return false;
 	}
-
-	va_end(ap);
 	return true;
 }
 
@@ -303,43 +319,88 @@ again:
 	return toks;
 }
 
+int json_parse_more(jsmn_parser *parser, jsmntok_t **toks,
+		    const char *input, size_t len)
+{
+	jsmnerr_t ret;
+
+again:
+	/* jsmn picks up where it left off, even after running out. */
+	ret = jsmn_parse(parser, input, len, *toks, tal_count(*toks) - 1);
+
+	switch (ret) {
+	case JSMN_ERROR_INVAL:
+		return -1;
+	case JSMN_ERROR_NOMEM:
+		tal_resize(toks, tal_count(*toks) * 2);
+		goto again;
+	case JSMN_ERROR_PART:
+		break;
+	}
+
+	/* Make sure last one is always referencable. */
+	(*toks)[parser->toknext].type = -1;
+	(*toks)[parser->toknext].start = (*toks)[parser->toknext].end = 0;
+	(*toks)[parser->toknext].size = 0;
+	return parser->toknext;
+}
+
+/* Make sure there's room for another extra chars plus the nul. */
+static void result_reserve(struct json_result *res, size_t extra)
+{
+	size_t max = tal_count(res->s);
+
+	if (res->len + extra + 1 <= max)
+		return;
+	while (res->len + extra + 1 > max)
+		max *= 2;
+	tal_resize(&res->s, max);
+}
+
 static void result_append(struct json_result *res, const char *str)
 {
-	size_t len = tal_count(res->s) - 1;
+	size_t len = strlen(str);
 
-	tal_resize(&res->s, len + strlen(str) + 1);
-	strcpy(res->s + len, str);
+	result_reserve(res, len);
+	memcpy(res->s + res->len, str, len + 1);
+	res->len += len;
 }
 
 static void PRINTF_FMT(2,3)
 result_append_fmt(struct json_result *res, const char *fmt, ...)
 {
-	size_t len = tal_count(res->s) - 1, fmtlen;
+	size_t spare = tal_count(res->s) - res->len;
+	int fmtlen;
 	va_list ap;
 
+	/* Usually it fits in what we have already. */
 	va_start(ap, fmt);
-	fmtlen = vsnprintf(NULL, 0, fmt, ap);
+	fmtlen = vsnprintf(res->s + res->len, spare, fmt, ap);
 	va_end(ap);
+	assert(fmtlen >= 0);
 
-	tal_resize(&res->s, len + fmtlen + 1);
-	va_start(ap, fmt);
-	vsprintf(res->s + len, fmt, ap);
-	va_end(ap);
+	if ((size_t)fmtlen >= spare) {
+		result_reserve(res, fmtlen);
+		va_start(ap, fmt);
+		vsprintf(res->s + res->len, fmt, ap);
+		va_end(ap);
+	}
+	res->len += fmtlen;
 }
 
 static bool result_ends_with(struct json_result *res, const char *str)
 {
-	size_t len = tal_count(res->s) - 1;
+	size_t len = strlen(str);
 
-	if (strlen(str) > len)
+	if (len > res->len)
 		return false;
-	return streq(res->s + len - strlen(str), str);
+	return memcmp(res->s + res->len - len, str, len) == 0;
 }
 
 static void json_start_member(struct json_result *result, const char *fieldname)
 {
 	/* Prepend comma if required. */
-	if (result->s[0]
+	if (result->len
 	    && !result_ends_with(result, "{ ")
 	    && !result_ends_with(result, "[ "))
 		result_append(result, ", ");
@@ -428,10 +489,13 @@ void json_add_null(struct json_result *result, const char *fieldname)
 void json_add_hex(struct json_result *result, const char *fieldname,
 		  const void *data, size_t len)
 {
-	char hex[hex_str_size(len)];
-
-	hex_encode(data, len, hex, sizeof(hex));
-	json_add_string(result, fieldname, hex);
+	/* Straight into the result, no copy (or stack array) needed. */
+	json_start_member(result, fieldname);
+	result_reserve(result, hex_str_size(len) + 2);
+	result->s[result->len++] = '"';
+	hex_encode_fast(data, len, result->s + result->len, hex_str_size(len));
+	result->len += hex_str_size(len) - 1;
+	result_append(result, "\"");
 }
 
 void json_add_pubkey(struct json_result *response,
@@ -464,19 +528,42 @@ void json_add_object(struct json_result *result, ...)
 	va_end(ap);
 }
 
+/* Results are built one at a time: the last one, once sent, is where the
+ * next starts, at its high-water size. */
+static struct json_result *spare_result;
+
 struct json_result *new_json_result(const tal_t *ctx)
 {
-	struct json_result *r = tal(ctx, struct json_result);
+	struct json_result *r;
 
-	/* Using tal_arr means that it has a valid count. */
-	r->s = tal_arrz(r, char, 1);
+	if (spare_result) {
+		r = tal_steal(ctx, spare_result);
+		spare_result = NULL;
+		r->s[0] = '\0';
+	} else {
+		r = tal(ctx, struct json_result);
+		/* Using tal_arr means that it has a valid count. */
+		r->s = tal_arrz(r, char, 64);
+	}
+	r->len = 0;
 	r->indent = 0;
 	return r;
 }
+
+void json_result_recycle(struct json_result *result)
+{
+	if (spare_result
+	    && tal_count(spare_result->s) >= tal_count(result->s)) {
+		tal_free(result);
+		return;
+	}
+	tal_free(spare_result);
+	spare_result = tal_steal(NULL, result);
+}
 	
 const char *json_result_string(const struct json_result *result)
 {
 	assert(!result->indent);
-	assert(tal_count(result->s) == strlen(result->s) + 1);
+	assert(result->len == strlen(result->s));
 	return result->s;
 }
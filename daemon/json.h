@@ -69,6 +69,11 @@ const jsmntok_t *json_delve(const char *buffer,
 /* If input is complete and valid, return tokens. */
 jsmntok_t *json_parse_input(const char *input, int len, bool *valid);
 
+/* Carry on parsing input, which has grown to len since last time: *toks
+ * grows as needed.  Returns number of tokens so far, or -1 if invalid. */
+int json_parse_more(jsmn_parser *parser, jsmntok_t **toks,
+		    const char *input, size_t len);
+
 /* Creating JSON strings */
 
 /* '"fieldname" : [ ' or '[ ' if fieldname is NULL */
@@ -110,4 +115,8 @@ void json_add_pubkey(struct json_result *response,
 void json_add_object(struct json_result *result, ...);
 
 const char *json_result_string(const struct json_result *result);
+
+/* As tal_free(result), but the next new_json_result() may reuse it rather
+ * than allocate. */
+void json_result_recycle(struct json_result *result);
 #endif /* LIGHTNING_DAEMON_JSON_H */
@@ -1,12 +1,16 @@
 /* Code for JSON_RPC API */
 /* eg: { "method" : "dev-echo", "params" : [ "hello", "Arabella!" ], "id" : "1" } */
 #include "controlled_time.h"
+#include "db.h"
 #include "json.h"
 #include "jsonrpc.h"
 #include "lightningd.h"
 #include "log.h"
 #include "peer.h"
+#include "stats.h"
+#include "timeout.h"
 #include "version.h"
+#include <assert.h>
 #include <ccan/array_size/array_size.h>
 #include <ccan/err/err.h>
 #include <ccan/io/io.h>
@@ -14,24 +18,66 @@
 #include <ccan/tal/str/str.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/un.h>
 
+/* How many commands a single connection can have running at once. */
+#define JSONRPC_MAX_COMMANDS 64
+
+/* Requests from one connection can hold up everyone else this long before
+ * we let the peers (and other connections) have a turn. */
+#define JSONRPC_BUDGET_MSEC 5
+
+/* Frames start with a 4 byte big-endian length: the zero top byte is how
+ * we tell them from plain JSON. */
+#define JSONRPC_MAX_FRAME (1 << 24)
+
 struct json_output {
 	struct list_node list;
+	/* What to write, in buf (after room for a frame's length). */
 	const char *json;
+	size_t len;
+	char *buf;
+};
+
+/* A [] of requests: run in order, answered together. */
+struct json_batch {
+	/* In jcon->batches. */
+	struct list_node list;
+	struct json_connection *jcon;
+	/* Our own copy, since jcon->buffer moves on. */
+	char *buffer;
+	jsmntok_t *toks;
+	/* The next request to run. */
+	const jsmntok_t *next;
+	/* Responses so far, comma-separated. */
+	char *responses;
+	/* The command we're waiting for, if any. */
+	struct command *running;
+	/* Are we inside run_batch()? */
+	bool in_run;
 };
 
 static void finish_jcon(struct io_conn *conn, struct json_connection *jcon)
 {
+	struct command *cmd;
+	struct json_batch *batch;
+
 	log_debug(jcon->log, "Closing (%s)", strerror(errno));
-	if (jcon->current) {
-		log_unusual(jcon->log, "Abandoning current command");
-		jcon->current->jcon = NULL;
+	while ((cmd = list_pop(&jcon->commands, struct command, list))) {
+		log_unusual(jcon->log, "Abandoning command %s", cmd->id);
+		cmd->jcon = NULL;
+		cmd->batch = NULL;
 	}
+	while ((batch = list_pop(&jcon->batches, struct json_batch, list)))
+		tal_free(batch);
+	tal_free(jcon);
 }
 
 static void json_help(struct command *cmd,
@@ -47,7 +93,15 @@ static const struct json_command help_command = {
 static void json_stop(struct command *cmd,
 		      const char *buffer, const jsmntok_t *params)
 {
-	struct json_result *response = new_json_result(cmd);
+	struct json_result *response;
+
+	/* Stopping would stop every tenant in the process. */
+	if (cmd->dstate->host != cmd->dstate) {
+		command_fail(cmd, "A tenant cannot stop its host");
+		return;
+	}
+
+	response = new_json_result(cmd);
 
 	/* This can't have closed yet! */
 	cmd->jcon->stop = true;
@@ -95,15 +149,11 @@ static void log_to_json(unsigned int skipped,
 			enum log_level level,
 			const char *prefix,
 			const char *log,
+			size_t len,
 			struct log_info *info)
 {
+	/* Includes those below info->level, or from other sources. */
 	info->num_skipped += skipped;
-
-	if (level < info->level) {
-		info->num_skipped++;
-		return;
-	}
-
 	add_skipped(info);
 
 	json_object_start(info->response, NULL);
@@ -122,7 +172,7 @@ static void log_to_json(unsigned int skipped,
 		else
 			json_add_string(info->response, "direction", "OUT");
 
-		json_add_hex(info->response, "data", log+1, tal_count(log)-1);
+		json_add_hex(info->response, "data", log+1, len);
 	} else
 		json_add_string(info->response, "log", log);
 
@@ -134,9 +184,19 @@ static void json_getlog(struct command *cmd,
 {
 	struct log_info info;
 	struct log_record *lr = cmd->dstate->log_record;
-	jsmntok_t *level;
+	jsmntok_t *level, *sourcetok, *sincetok;
+	const char *source = NULL;
+	struct timerel since;
+	double secs;
 
-	json_get_params(buffer, params, "?level", &level, NULL);
+	if (!json_get_params(buffer, params,
+			     "?level", &level,
+			     "?source", &sourcetok,
+			     "?since", &sincetok,
+			     NULL)) {
+		command_fail(cmd, "Invalid parameters");
+		return;
+	}
 
 	info.num_skipped = 0;
 
@@ -155,13 +215,28 @@ static void json_getlog(struct command *cmd,
 		return;
 	}
 
+	if (sourcetok)
+		source = tal_strndup(cmd, buffer + sourcetok->start,
+				     sourcetok->end - sourcetok->start);
+
+	/* In the same seconds as "time": since creation_time. */
+	if (sincetok) {
+		if (!json_tok_double(buffer, sincetok, &secs) || secs < 0) {
+			command_fail(cmd, "Invalid since param");
+			return;
+		}
+		since = time_from_nsec(secs * 1000000000.0);
+	}
+
 	info.response = new_json_result(cmd);
 	json_object_start(info.response, NULL);
 	json_add_time(info.response, "creation_time", log_init_time(lr)->ts);
 	json_add_num(info.response, "bytes_used", (unsigned int)log_used(lr));
 	json_add_num(info.response, "bytes_max", (unsigned int)log_max_mem(lr));
+	json_add_u64(info.response, "file_dropped", log_file_dropped(lr));
 	json_array_start(info.response, "log");
-	log_each_line(lr, log_to_json, &info);
+	log_each_match(lr, info.level, source, sincetok ? &since : NULL,
+		       log_to_json, &info);
 	json_array_end(info.response);
 	json_object_end(info.response);
 	command_success(cmd, info.response);
@@ -170,7 +245,7 @@ static void json_getlog(struct command *cmd,
 static const struct json_command getlog_command = {
 	"getlog",
 	json_getlog,
-	"Get logs, with optional level: [io|debug|info|unusual]",
+	"Get logs, with optional level: [io|debug|info|unusual], only from {source} and {since} seconds after creation_time if given",
 	"Returns log array"
 };
 
@@ -231,6 +306,10 @@ static void json_restart(struct command *cmd,
 	const jsmntok_t *p, *end;
 	size_t n = 0;
 
+	if (cmd->dstate->host != cmd->dstate) {
+		command_fail(cmd, "A tenant cannot restart its host");
+		return;
+	}
 	if (params->type != JSMN_ARRAY) {
 		command_fail(cmd, "Need array to reexec");
 		return;
@@ -260,6 +339,7 @@ static void json_getinfo(struct command *cmd,
 			 const char *buffer, const jsmntok_t *params)
 {
 	struct json_result *response = new_json_result(cmd);
+	size_t i;
 
 	json_object_start(response, NULL);
 	json_add_pubkey(response, cmd->dstate->secpctx, "id", &cmd->dstate->id);
@@ -268,6 +348,34 @@ static void json_getinfo(struct command *cmd,
 		json_add_num(response, "port", cmd->dstate->portnum);
 	json_add_bool(response, "testnet", cmd->dstate->config.testnet);
 	json_add_string(response, "version", version());
+	json_add_u64(response, "route_cache_hits",
+		     cmd->dstate->rstate->route_cache_hits);
+	json_add_u64(response, "route_cache_misses",
+		     cmd->dstate->rstate->route_cache_misses);
+	json_add_u64(response, "forwarded",
+		     cmd->dstate->forward_stats.forwarded);
+	json_add_u64(response, "forward_failed",
+		     cmd->dstate->forward_stats.failed);
+	json_add_u64(response, "db_vacuumed_pages",
+		     db_vacuumed_pages(cmd->dstate));
+	if (cmd->dstate->forward_stats.forwarded) {
+		json_add_u64(response, "forward_avg_msec",
+			     time_to_msec(cmd->dstate->forward_stats.total)
+			     / cmd->dstate->forward_stats.forwarded);
+		json_add_u64(response, "forward_max_msec",
+			     time_to_msec(cmd->dstate->forward_stats.max));
+	}
+	json_array_start(response, "startup");
+	for (i = 0; i < tal_count(cmd->dstate->startup); i++) {
+		const struct startup_phase *p = &cmd->dstate->startup[i];
+
+		json_object_start(response, NULL);
+		json_add_string(response, "phase", p->name);
+		json_add_u64(response, "msec", time_to_msec(p->time));
+		json_add_u64(response, "count", p->count);
+		json_object_end(response);
+	}
+	json_array_end(response);
 	json_object_end(response);
 	command_success(cmd, response);
 }
@@ -276,7 +384,7 @@ static const struct json_command getinfo_command = {
 	"getinfo",
 	json_getinfo,
 	"Get general information about this node",
-	"Returns {id}, {port}, {testnet}, etc."
+	"Returns {id}, {port}, {testnet}, {startup} phases, etc."
 };
 
 static const struct json_command *cmdlist[] = {
@@ -284,17 +392,35 @@ static const struct json_command *cmdlist[] = {
 	&stop_command,
 	&getlog_command,
 	&connect_command,
+	&connectmany_command,
 	&getpeers_command,
 	&gethtlcs_command,
 	&close_command,
 	&newaddr_command,
+	&listfunds_command,
 	&invoice_command,
+	&invoices_command,
 	&listinvoice_command,
 	&delinvoice_command,
 	&waitinvoice_command,
+	&waitanyinvoice_command,
 	&getroute_command,
+	&getroutes_command,
 	&sendpay_command,
+	&sendpays_command,
+	&sendmultipay_command,
+	&getroutepenalties_command,
+	&getnodes_command,
+	&getchannels_command,
 	&getinfo_command,
+	&reload_command,
+	&backup_command,
+	&getstats_command,
+	&getmemory_command,
+	&getallocs_command,
+	&getrebalance_command,
+	&setrebalance_command,
+	&subscribe_command,
 	/* Developer/debugging options. */
 	&dev_newhtlc_command,
 	&dev_fulfillhtlc_command,
@@ -310,6 +436,7 @@ static const struct json_command *cmdlist[] = {
 	&dev_signcommit_command,
 	&dev_output_command,
 	&dev_add_route_command,
+	&dev_add_routes_command,
 	&dev_routefail_command,
 };
 
@@ -332,35 +459,132 @@ static void json_help(struct command *cmd,
 	command_success(cmd, response);
 }
 
-static const struct json_command *find_cmd(const char *buffer,
-					   const jsmntok_t *tok)
+/* cmdlist by name, built on first use, so finding one is a bsearch. */
+static const struct json_command *sorted_cmds[ARRAY_SIZE(cmdlist)];
+static size_t num_sorted_cmds;
+
+static int cmd_cmp(const void *a, const void *b)
+{
+	const struct json_command *const *ca = a, *const *cb = b;
+
+	return strcmp((*ca)->name, (*cb)->name);
+}
+
+static void sort_cmds(void)
 {
 	unsigned int i;
 
 	/* cmdlist[i]->name can be NULL in test code. */
 	for (i = 0; i < ARRAY_SIZE(cmdlist); i++)
-		if (cmdlist[i]->name
-		    && json_tok_streq(buffer, tok, cmdlist[i]->name))
-			return cmdlist[i];
+		if (cmdlist[i]->name)
+			sorted_cmds[num_sorted_cmds++] = cmdlist[i];
+	qsort(sorted_cmds, num_sorted_cmds, sizeof(sorted_cmds[0]), cmd_cmp);
+}
+
+static const struct json_command *find_cmd(const char *buffer,
+					   const jsmntok_t *tok)
+{
+	size_t lo = 0, hi, len = tok->end - tok->start;
+
+	if (tok->type != JSMN_STRING)
+		return NULL;
+
+	if (!num_sorted_cmds)
+		sort_cmds();
+
+	hi = num_sorted_cmds;
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		const char *name = sorted_cmds[mid]->name;
+		int c = strncmp(name, buffer + tok->start, len);
+
+		/* Same prefix, but a longer name sorts after it. */
+		if (c == 0 && name[len])
+			c = 1;
+		if (c == 0)
+			return sorted_cmds[mid];
+		if (c < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
 	return NULL;
 }
 
-static void json_result(struct json_connection *jcon,
-			const char *id, const char *res, const char *err)
+/* Formats straight into a spare output buffer, if we have one. */
+static void PRINTF_FMT(2,3)
+json_output(struct json_connection *jcon, const char *fmt, ...)
 {
-	struct json_output *out = tal(jcon, struct json_output);
+	struct json_output *out;
+	va_list ap;
+	int len;
 
-	out->json = tal_fmt(out,
-			    "{ \"result\" : %s,"
-			    " \"error\" : %s,"
-			    " \"id\" : %s }\n",
-			    res, err, id);
+	out = list_pop(&jcon->spare_output, struct json_output, list);
+	if (!out) {
+		out = tal(jcon, struct json_output);
+		out->buf = tal_arr(out, char, 4 + 256);
+	}
+
+	va_start(ap, fmt);
+	len = vsnprintf(out->buf + 4, tal_count(out->buf) - 4, fmt, ap);
+	va_end(ap);
+	assert(len > 0);
+
+	if ((size_t)len + 1 > tal_count(out->buf) - 4) {
+		tal_resize(&out->buf, 4 + len + 1);
+		va_start(ap, fmt);
+		vsnprintf(out->buf + 4, len + 1, fmt, ap);
+		va_end(ap);
+	} else if (tal_count(out->buf) > (size_t)len * 4 + 65536)
+		/* Don't keep a huge one for the small ones after. */
+		tal_resize(&out->buf, 4 + len + 1);
+
+	if (jcon->framed) {
+		/* No need for the trailing \n, just the length. */
+		len--;
+		out->buf[0] = len >> 24;
+		out->buf[1] = len >> 16;
+		out->buf[2] = len >> 8;
+		out->buf[3] = len;
+		out->json = out->buf;
+		out->len = 4 + len;
+	} else {
+		out->json = out->buf + 4;
+		out->len = len;
+	}
 
 	/* Queue for writing, and wake writer (and maybe reader). */
 	list_add_tail(&jcon->output, &out->list);
 	io_wake(jcon);
 }
 
+static void run_batch(struct json_batch *batch);
+
+static void json_result(struct json_connection *jcon,
+			struct json_batch *batch,
+			const char *id, const char *res, const char *err)
+{
+	if (!batch) {
+		json_output(jcon,
+			    "{ \"result\" : %s, \"error\" : %s, \"id\" : %s }\n",
+			    res, err, id);
+		return;
+	}
+
+	tal_append_fmt(&batch->responses,
+		       "%s{ \"result\" : %s, \"error\" : %s, \"id\" : %s }",
+		       batch->responses[0] ? ", " : "", res, err, id);
+
+	/* If it finished later, carry on with the rest next time around.
+	 * (We may be deep inside a peer transaction right now). */
+	if (batch->running) {
+		batch->running = NULL;
+		if (!batch->in_run)
+			new_reltimer(jcon->dstate, batch, time_from_sec(0),
+				     run_batch, batch);
+	}
+}
+
 struct json_result *null_response(const tal_t *ctx)
 {
 	struct json_result *response;
@@ -371,6 +595,26 @@ struct json_result *null_response(const tal_t *ctx)
 	return response;
 }
 
+static void command_done(struct json_connection *jcon, struct command *cmd)
+{
+	tal_t *child;
+
+	if (cmd->name)
+		stats_rpc(cmd->dstate, cmd->name, cmd->start);
+	list_del_from(&jcon->commands, &cmd->list);
+	jcon->num_commands--;
+
+	if (jcon->spare_cmd) {
+		tal_free(cmd);
+		return;
+	}
+
+	/* Everything it allocated goes, as if we'd freed it. */
+	while ((child = tal_first(cmd)) != NULL)
+		tal_free(child);
+	jcon->spare_cmd = tal_steal(jcon, cmd);
+}
+
 void command_success(struct command *cmd, struct json_result *result)
 {
 	struct json_connection *jcon = cmd->jcon;
@@ -381,10 +625,13 @@ void command_success(struct command *cmd, struct json_result *result)
 		tal_free(cmd);
 		return;
 	}
-	assert(jcon->current == cmd);
-	json_result(jcon, cmd->id, json_result_string(result), "null");
+	json_result(jcon, cmd->batch, cmd->id, json_result_string(result),
+		    "null");
 	log_debug(jcon->log, "Success");
-	jcon->current = tal_free(cmd);
+	/* It's usually the command's, and would go with it anyway. */
+	if (tal_parent(result) == cmd)
+		json_result_recycle(result);
+	command_done(jcon, cmd);
 }
 
 void command_fail(struct command *cmd, const char *fmt, ...)
@@ -413,86 +660,177 @@ void command_fail(struct command *cmd, const char *fmt, ...)
 	/* Now surround in quotes. */
 	quote = tal_fmt(cmd, "\"%s\"", error);
 
-	assert(jcon->current == cmd);
-	json_result(jcon, cmd->id, "null", quote);
-	jcon->current = tal_free(cmd);
+	json_result(jcon, cmd->batch, cmd->id, "null", quote);
+	command_done(jcon, cmd);
+}
+
+bool command_can_notify(const struct command *cmd)
+{
+	return cmd->jcon && !cmd->batch;
+}
+
+bool command_notify(struct command *cmd, const char *json)
+{
+	if (!cmd->jcon)
+		return false;
+
+	json_output(cmd->jcon, "{ \"event\" : %s, \"id\" : %s }\n",
+		    json, cmd->id);
+	return true;
 }
 
 static void json_command_malformed(struct json_connection *jcon,
+				   struct json_batch *batch,
 				   const char *id,
 				   const char *error)
 {
-	return json_result(jcon, id, "null", error);
+	return json_result(jcon, batch, id, "null", error);
 }
 
-static void parse_request(struct json_connection *jcon, const jsmntok_t tok[])
+static void parse_request(struct json_connection *jcon,
+			  struct json_batch *batch,
+			  const char *buffer, const jsmntok_t tok[])
 {
 	const jsmntok_t *method, *id, *params;
 	const struct json_command *cmd;
+	struct command *c;
 
-	assert(!jcon->current);
 	if (tok[0].type != JSMN_OBJECT) {
-		json_command_malformed(jcon, "null",
+		json_command_malformed(jcon, batch, "null",
 				       "Expected {} for json command");
 		return;
 	}
 
-	method = json_get_member(jcon->buffer, tok, "method");
-	params = json_get_member(jcon->buffer, tok, "params");
-	id = json_get_member(jcon->buffer, tok, "id");
+	method = json_get_member(buffer, tok, "method");
+	params = json_get_member(buffer, tok, "params");
+	id = json_get_member(buffer, tok, "id");
 
 	if (!id) {
-		json_command_malformed(jcon, "null", "No id");
+		json_command_malformed(jcon, batch, "null", "No id");
 		return;
 	}
 	if (id->type != JSMN_STRING && id->type != JSMN_PRIMITIVE) {
-		json_command_malformed(jcon, "null",
+		json_command_malformed(jcon, batch, "null",
 				       "Expected string/primitive for id");
 		return;
 	}
 
 	/* This is a convenient tal parent for durarion of command
 	 * (which may outlive the conn!). */
-	jcon->current = tal(jcon->dstate, struct command);
-	jcon->current->jcon = jcon;
-	jcon->current->dstate = jcon->dstate;
-	jcon->current->id = tal_strndup(jcon->current,
-					json_tok_contents(jcon->buffer, id),
-					json_tok_len(id));
+	if (jcon->spare_cmd) {
+		c = tal_steal(jcon->dstate, jcon->spare_cmd);
+		jcon->spare_cmd = NULL;
+	} else
+		c = tal(jcon->dstate, struct command);
+	c->jcon = jcon;
+	c->dstate = jcon->dstate;
+	if (json_tok_len(id) < sizeof(c->id_buf)) {
+		memcpy(c->id_buf, json_tok_contents(buffer, id),
+		       json_tok_len(id));
+		c->id_buf[json_tok_len(id)] = '\0';
+		c->id = c->id_buf;
+	} else
+		c->id = tal_strndup(c,
+				    json_tok_contents(buffer, id),
+				    json_tok_len(id));
+	c->batch = batch;
+	c->name = NULL;
+	c->start = time_now();
+	list_add_tail(&jcon->commands, &c->list);
+	jcon->num_commands++;
+	if (batch)
+		batch->running = c;
 
 	if (!method || !params) {
-		command_fail(jcon->current, method ? "No params" : "No method");
+		command_fail(c, method ? "No params" : "No method");
 		return;
 	}
 
 	if (method->type != JSMN_STRING) {
-		command_fail(jcon->current, "Expected string for method");
+		command_fail(c, "Expected string for method");
 		return;
 	}
 
-	cmd = find_cmd(jcon->buffer, method);
+	cmd = find_cmd(buffer, method);
 	if (!cmd) {
-		command_fail(jcon->current,
+		command_fail(c,
 			     "Unknown command '%.*s'",
 			     (int)(method->end - method->start),
-			     jcon->buffer + method->start);
+			     buffer + method->start);
 		return;
 	}
 
 	if (params->type != JSMN_ARRAY && params->type != JSMN_OBJECT) {
-		command_fail(jcon->current,
+		command_fail(c,
 			     "Expected array or object for params");
 		return;
 	}
 
-	cmd->dispatch(jcon->current, jcon->buffer, params);
+	c->name = cmd->name;
+	cmd->dispatch(c, buffer, params);
+}
+
+/* Run requests until one has to wait, or we're done. */
+static void run_batch(struct json_batch *batch)
+{
+	struct json_connection *jcon = batch->jcon;
+	const jsmntok_t *end = json_next(batch->toks);
+
+	/* Whatever they write can go to disk together. */
+	db_hold_commits(jcon->dstate);
+	batch->in_run = true;
+	while (!batch->running && batch->next != end) {
+		const jsmntok_t *t = batch->next;
+
+		batch->next = json_next(t);
+		parse_request(jcon, batch, batch->buffer, t);
+	}
+	batch->in_run = false;
+	db_release_commits(jcon->dstate);
+
+	if (batch->running)
+		return;
+
+	json_output(jcon, "[ %s ]\n", batch->responses);
+	list_del_from(&jcon->batches, &batch->list);
+	tal_free(batch);
+}
+
+static void parse_batch(struct json_connection *jcon,
+			const char *buffer, const jsmntok_t tok[])
+{
+	struct json_batch *batch = tal(jcon, struct json_batch);
+	size_t i, num = json_next(tok) - tok;
+
+	batch->jcon = jcon;
+	batch->buffer = tal_dup_arr(batch, char,
+				    buffer + tok->start,
+				    tok->end - tok->start, 0);
+	batch->toks = tal_dup_arr(batch, jsmntok_t, tok, num, 0);
+	for (i = 0; i < num; i++) {
+		batch->toks[i].start -= tok->start;
+		batch->toks[i].end -= tok->start;
+	}
+	batch->next = batch->toks + 1;
+	batch->responses = tal_strdup(batch, "");
+	batch->running = NULL;
+	batch->in_run = false;
+	list_add_tail(&jcon->batches, &batch->list);
+
+	run_batch(batch);
 }
 
 static struct io_plan *write_json(struct io_conn *conn,
 				  struct json_connection *jcon)
 {
 	struct json_output *out;
-	
+
+	/* That's written: keep it for next time. */
+	if (jcon->writing) {
+		list_add(&jcon->spare_output, &jcon->writing->list);
+		jcon->writing = NULL;
+	}
+
 	out = list_pop(&jcon->output, struct json_output, list);
 	if (!out) {
 		if (jcon->stop) {
@@ -507,65 +845,200 @@ static struct io_plan *write_json(struct io_conn *conn,
 		return io_out_wait(conn, jcon, write_json, jcon);
 	}
 
-	jcon->outbuf = tal_steal(jcon, out->json);
-	tal_free(out);
+	jcon->writing = out;
+	log_io(jcon->log, false, out->json, out->len);
+	return io_write(conn, out->json, out->len, write_json, jcon);
+}
 
-	log_io(jcon->log, false, jcon->outbuf, strlen(jcon->outbuf));
-	return io_write(conn,
-			jcon->outbuf, strlen(jcon->outbuf), write_json, jcon);
+/* Move what's left down to the start of the buffer, tokens and all. */
+static void compact_jcon(struct json_connection *jcon)
+{
+	size_t i, off = jcon->consumed;
+
+	memmove(jcon->buffer, jcon->buffer + off, jcon->used - off);
+	jcon->used -= off;
+	jcon->parser.pos -= off;
+
+	memmove(jcon->toks, jcon->toks + jcon->first,
+		(jcon->parser.toknext - jcon->first) * sizeof(jcon->toks[0]));
+	jcon->parser.toknext -= jcon->first;
+	if (jcon->parser.toksuper != -1)
+		jcon->parser.toksuper -= jcon->first;
+	for (i = 0; i < jcon->parser.toknext; i++) {
+		jcon->toks[i].start -= off;
+		if (jcon->toks[i].end != -1)
+			jcon->toks[i].end -= off;
+	}
+	jcon->first = jcon->consumed = 0;
+}
+
+static size_t frame_len(const char *p)
+{
+	const u8 *u = (const u8 *)p;
+
+	return ((size_t)u[0] << 24) | ((size_t)u[1] << 16)
+		| ((size_t)u[2] << 8) | u[3];
+}
+
+static struct io_plan *read_json(struct io_conn *conn,
+				 struct json_connection *jcon);
+
+static bool over_budget(struct timeabs start)
+{
+	return time_greater(time_between(time_now(), start),
+			    time_from_msec(JSONRPC_BUDGET_MSEC));
+}
+
+static void resume_jcon(struct json_connection *jcon)
+{
+	jcon->resume = NULL;
+	io_wake(&jcon->resume);
+}
+
+/* A timer, not io_always: those (and zero timers) go before any fds are
+ * polled, but this expires only after the loop has looked at them. */
+static struct io_plan *jcon_yield(struct io_conn *conn,
+				  struct json_connection *jcon)
+{
+	log_debug(jcon->log, "Over budget: yielding");
+	jcon->len_read = 0;
+	jcon->resume = new_reltimer(jcon->dstate, jcon, time_from_msec(1),
+				    resume_jcon, jcon);
+	return io_wait(conn, &jcon->resume, read_json, jcon);
+}
+
+/* Each frame holds exactly one request (or batch), so no need to parse
+ * incrementally: we know when we have it all. */
+static struct io_plan *read_frames(struct io_conn *conn,
+				   struct json_connection *jcon,
+				   struct timeabs start)
+{
+	size_t want;
+	bool handled = false;
+
+	while (jcon->used - jcon->consumed >= 4) {
+		size_t len = frame_len(jcon->buffer + jcon->consumed);
+		const char *body = jcon->buffer + jcon->consumed + 4;
+
+		if (len >= JSONRPC_MAX_FRAME) {
+			log_unusual(jcon->log, "Frame length %zu too large",
+				    len);
+			return io_close(conn);
+		}
+		if (jcon->used - jcon->consumed - 4 < len)
+			break;
+
+		if (handled && over_budget(start))
+			return jcon_yield(conn, jcon);
+		handled = true;
+
+		jsmn_init(&jcon->parser);
+		if (json_parse_more(&jcon->parser, &jcon->toks, body, len) <= 0
+		    || jcon->toks[0].end == -1
+		    || json_next(jcon->toks) != jcon->toks + jcon->parser.toknext) {
+			log_unusual(jcon->log, "Invalid json frame: '%.*s'",
+				    (int)len, body);
+			return io_close(conn);
+		}
+
+		if (jcon->toks[0].type == JSMN_ARRAY)
+			parse_batch(jcon, body, jcon->toks);
+		else
+			parse_request(jcon, NULL, body, jcon->toks);
+		jcon->consumed += 4 + len;
+
+		if (jcon->num_commands >= JSONRPC_MAX_COMMANDS) {
+			jcon->len_read = 0;
+			return io_wait(conn, jcon, read_json, jcon);
+		}
+	}
+
+	/* Move the partial frame down, and make sure it will fit. */
+	memmove(jcon->buffer, jcon->buffer + jcon->consumed,
+		jcon->used - jcon->consumed);
+	jcon->used -= jcon->consumed;
+	jcon->consumed = 0;
+
+	want = jcon->used >= 4 ? 4 + frame_len(jcon->buffer) : 4;
+	while (tal_count(jcon->buffer) < want)
+		tal_resize(&jcon->buffer, tal_count(jcon->buffer) * 2);
+
+	return io_read_partial(conn, jcon->buffer + jcon->used,
+			       tal_count(jcon->buffer) - jcon->used,
+			       &jcon->len_read, read_json, jcon);
 }
 
 static struct io_plan *read_json(struct io_conn *conn,
 				 struct json_connection *jcon)
 {
-	jsmntok_t *toks;
-	bool valid;
+	struct timeabs start = time_now();
 
 	log_io(jcon->log, true, jcon->buffer + jcon->used, jcon->len_read);
 
-	/* Resize larger if we're full. */
+	/* JSON can't start with a zero byte: it's using frames. */
+	if (!jcon->framed && jcon->used == 0 && jcon->len_read
+	    && jcon->buffer[0] == '\0') {
+		log_debug(jcon->log, "Using length-prefixed frames");
+		jcon->framed = true;
+	}
+
 	jcon->used += jcon->len_read;
-	if (jcon->used == tal_count(jcon->buffer))
-		tal_resize(&jcon->buffer, jcon->used * 2);
+	if (jcon->framed)
+		return read_frames(conn, jcon, start);
+
+	if (jcon->len_read
+	    && json_parse_more(&jcon->parser, &jcon->toks,
+			       jcon->buffer, jcon->used) < 0) {
+		log_unusual(jcon->dstate->base_log,
+			    "Invalid token in json input: '%.*s'",
+			    (int)(jcon->used - jcon->consumed),
+			    jcon->buffer + jcon->consumed);
+		return io_close(conn);
+	}
 
 again:
-	toks = json_parse_input(jcon->buffer, jcon->used, &valid);
-	if (!toks) {
-		if (!valid) {
-			log_unusual(jcon->dstate->base_log,
-				    "Invalid token in json input: '%.*s'",
-				    (int)jcon->used, jcon->buffer);
-			return io_close(conn);
+	if (jcon->first == jcon->parser.toknext) {
+		/* Nothing left but whitespace?  Start afresh. */
+		if (jcon->parser.pos == jcon->used) {
+			jcon->used = jcon->consumed = jcon->first = 0;
+			jsmn_init(&jcon->parser);
 		}
-		/* We need more. */
 		goto read_more;
 	}
 
-	/* Empty buffer? (eg. just whitespace). */
-	if (tal_count(toks) == 1) {
-		jcon->used = 0;
+	/* Not finished yet? */
+	if (jcon->toks[jcon->first].end == -1)
 		goto read_more;
-	}
 
-	parse_request(jcon, toks);
+	if (jcon->toks[jcon->first].type == JSMN_ARRAY)
+		parse_batch(jcon, jcon->buffer, jcon->toks + jcon->first);
+	else
+		parse_request(jcon, NULL, jcon->buffer,
+			      jcon->toks + jcon->first);
 
-	/* Remove first {}. */
-	memmove(jcon->buffer, jcon->buffer + toks[0].end,
-		tal_count(jcon->buffer) - toks[0].end);
-	jcon->used -= toks[0].end;
-	tal_free(toks);
+	/* Skip over that {}. */
+	jcon->consumed = jcon->toks[jcon->first].end;
+	jcon->first = json_next(jcon->toks + jcon->first) - jcon->toks;
 
-	/* Need to wait for command to finish? */
-	if (jcon->current) {
+	/* Too many commands running?  Wait for one to finish. */
+	if (jcon->num_commands >= JSONRPC_MAX_COMMANDS) {
 		jcon->len_read = 0;
 		return io_wait(conn, jcon, read_json, jcon);
 	}
 
-	/* See if we can parse the rest. */
+	/* See if we can handle the rest (if it's still our turn). */
+	if (over_budget(start))
+		return jcon_yield(conn, jcon);
 	goto again;
 
 read_more:
-	tal_free(toks);
+	/* If we're full, make room: move down if over half is done with. */
+	if (jcon->used == tal_count(jcon->buffer)) {
+		if (jcon->consumed > jcon->used / 2)
+			compact_jcon(jcon);
+		else
+			tal_resize(&jcon->buffer, jcon->used * 2);
+	}
 	return io_read_partial(conn, jcon->buffer + jcon->used,
 			       tal_count(jcon->buffer) - jcon->used,
 			       &jcon->len_read, read_json, jcon);
@@ -578,13 +1051,22 @@ static struct io_plan *jcon_connected(struct io_conn *conn,
 
 	jcon = tal(dstate, struct json_connection);
 	jcon->dstate = dstate;
-	jcon->used = 0;
+	jcon->used = jcon->consumed = jcon->first = 0;
 	jcon->buffer = tal_arr(jcon, char, 64);
+	jcon->toks = tal_arr(jcon, jsmntok_t, 10);
+	jsmn_init(&jcon->parser);
 	jcon->stop = false;
-	jcon->current = NULL;
+	list_head_init(&jcon->commands);
+	jcon->num_commands = 0;
+	list_head_init(&jcon->batches);
+	jcon->framed = false;
+	jcon->resume = NULL;
 	jcon->log = new_log(jcon, dstate->log_record, "%sjcon fd %i:",
 			    log_prefix(dstate->base_log), io_conn_fd(conn));
 	list_head_init(&jcon->output);
+	jcon->writing = NULL;
+	list_head_init(&jcon->spare_output);
+	jcon->spare_cmd = NULL;
 
 	io_set_finish(conn, finish_jcon, jcon);
 
@@ -3,6 +3,7 @@
 #include "config.h"
 #include "json.h"
 #include <ccan/list/list.h>
+#include <ccan/time/time.h>
 
 /* Context for a command (from JSON, but might outlive the connection!)
  * You can allocate off this for temporary objects. */
@@ -11,8 +12,17 @@ struct command {
 	struct lightningd_state *dstate;
 	/* The 'id' which we need to include in the response. */
 	const char *id;
+	/* Where it lives, if it's short (they usually are). */
+	char id_buf[24];
 	/* The connection, or NULL if it closed. */
 	struct json_connection *jcon;
+	/* In jcon->commands. */
+	struct list_node list;
+	/* If part of a batch request, the batch (NULL if conn closed). */
+	struct json_batch *batch;
+	/* Which command (once we know), and when it arrived, for stats. */
+	const char *name;
+	struct timeabs start;
 };
 
 struct json_connection {
@@ -30,15 +40,38 @@ struct json_connection {
 	size_t used;
 	/* How much has just been filled. */
 	size_t len_read;
+	/* How much we've handled, and the token where the next starts. */
+	size_t consumed, first;
+
+	/* Tokens parsed so far, from the start of buffer. */
+	jsmn_parser parser;
+	jsmntok_t *toks;
 
 	/* We've been told to stop. */
 	bool stop;
 
-	/* Current command. */
-	struct command *current;
+	/* Requests and responses are length-prefixed, not bare JSON. */
+	bool framed;
+
+	/* Commands in progress: responses may come back in any order. */
+	struct list_head commands;
+	size_t num_commands;
+
+	/* Batch requests in progress. */
+	struct list_head batches;
+
+	/* We've had our turn: this will let us carry on. */
+	struct oneshot *resume;
 
 	struct list_head output;
-	const char *outbuf;
+	/* What we're writing now. */
+	struct json_output *writing;
+
+	/* Reused between commands, at their high-water size, so a steady
+	 * stream of them needn't allocate: outputs once written, and the
+	 * last command once done. */
+	struct list_head spare_output;
+	struct command *spare_cmd;
 };
 
 struct json_command {
@@ -53,30 +86,60 @@ struct json_result *null_response(const tal_t *ctx);
 void command_success(struct command *cmd, struct json_result *response);
 void PRINTF_FMT(2, 3) command_fail(struct command *cmd, const char *fmt, ...);
 
+/* For commands which stay running and send { "event" : json, "id" : id }
+ * as things happen.  Returns false once the connection has gone. */
+bool command_can_notify(const struct command *cmd);
+bool command_notify(struct command *cmd, const char *json);
+
 /* For initialization */
 void setup_jsonrpc(struct lightningd_state *dstate, const char *rpc_filename);
 
+/* Configuration. */
+extern const struct json_command reload_command;
+extern const struct json_command backup_command;
+
 /* Peer management */
 extern const struct json_command newaddr_command;
+extern const struct json_command listfunds_command;
 extern const struct json_command connect_command;
+extern const struct json_command connectmany_command;
 extern const struct json_command close_command;
 extern const struct json_command getpeers_command;
 
 /* Invoice management. */
 extern const struct json_command invoice_command;
+extern const struct json_command invoices_command;
 extern const struct json_command listinvoice_command;
 extern const struct json_command delinvoice_command;
 extern const struct json_command waitinvoice_command;
+extern const struct json_command waitanyinvoice_command;
 
 /* Payment management. */
 extern const struct json_command getroute_command;
+extern const struct json_command getroutes_command;
 extern const struct json_command sendpay_command;
+extern const struct json_command sendpays_command;
+extern const struct json_command sendmultipay_command;
+extern const struct json_command getroutepenalties_command;
+extern const struct json_command getnodes_command;
+extern const struct json_command getchannels_command;
+
+/* Statistics. */
+extern const struct json_command getstats_command;
+extern const struct json_command getmemory_command;
+extern const struct json_command getallocs_command;
+extern const struct json_command getrebalance_command;
+extern const struct json_command setrebalance_command;
+
+/* Event subscription. */
+extern const struct json_command subscribe_command;
 
 /* Low-level commands. */
 extern const struct json_command gethtlcs_command;
 
 /* Developer commands. */
 extern const struct json_command dev_add_route_command;
+extern const struct json_command dev_add_routes_command;
 extern const struct json_command dev_newhtlc_command;
 extern const struct json_command dev_fulfillhtlc_command;
 extern const struct json_command dev_failhtlc_command;
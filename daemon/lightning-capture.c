@@ -0,0 +1,386 @@
+/*
+ * Decode, or replay against a running lightningd, a --log-capture file.
+ */
+#include "capture.h"
+#include "configdir.h"
+#include "controlled_time.h"
+#include "version.h"
+#include <ccan/err/err.h>
+#include <ccan/opt/opt.h>
+#include <ccan/read_write_all/read_write_all.h>
+#include <ccan/str/hex/hex.h>
+#include <ccan/tal/str/str.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/* How long replay waits for more output before giving up. */
+#define REPLAY_IDLE_MSEC 1000
+
+/* Tal wrappers for opt. */
+static void *opt_allocfn(size_t size)
+{
+	return tal_alloc_(NULL, size, false, TAL_LABEL("opt_allocfn", ""));
+}
+
+static void *tal_reallocfn(void *ptr, size_t size)
+{
+	if (!ptr)
+		return opt_allocfn(size);
+	tal_resize_(&ptr, 1, size, false);
+	return ptr;
+}
+
+static void tal_freefn(void *ptr)
+{
+	tal_free(ptr);
+}
+
+struct timeabs controlled_time(void)
+{
+	return time_now();
+}
+
+struct conn {
+	const char *name;
+	u64 records, in, out;
+	/* For replay. */
+	int fd;
+	u64 received;
+};
+
+struct record {
+	u64 nsec;
+	u32 conn;
+	enum capture_type type;
+	bool truncated;
+	const char *data;
+	size_t len;
+};
+
+struct capture_file {
+	const char *map;
+	size_t size, off, segment_size;
+	/* Indexed by conn id, which lightningd hands out in order. */
+	struct conn **conns;
+};
+
+static struct capture_file *open_capture(const tal_t *ctx, const char *name)
+{
+	struct capture_file *f = tal(ctx, struct capture_file);
+	const struct capture_file_hdr *fhdr;
+	struct stat st;
+	int fd;
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) != 0)
+		err(1, "Opening %s", name);
+	if (st.st_size < sizeof(*fhdr))
+		errx(1, "%s is too short", name);
+
+	f->size = st.st_size;
+	f->map = mmap(NULL, f->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (f->map == MAP_FAILED)
+		err(1, "Mapping %s", name);
+	close(fd);
+
+	fhdr = (const struct capture_file_hdr *)f->map;
+	if (memcmp(fhdr->magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) != 0)
+		errx(1, "%s is not a capture file", name);
+	f->segment_size = le32_to_cpu(fhdr->segment_size);
+	if (f->segment_size < sizeof(*fhdr))
+		errx(1, "%s has bad segment size %zu", name, f->segment_size);
+	f->off = sizeof(*fhdr);
+	f->conns = tal_arrz(f, struct conn *, 0);
+	return f;
+}
+
+static struct conn *get_conn(struct capture_file *f, u32 id)
+{
+	if (id >= tal_count(f->conns))
+		tal_resizez(&f->conns, id + 1);
+	if (!f->conns[id]) {
+		f->conns[id] = tal(f, struct conn);
+		f->conns[id]->name = tal_fmt(f->conns[id], "#%u", id);
+		f->conns[id]->records = 0;
+		f->conns[id]->in = f->conns[id]->out = 0;
+		f->conns[id]->fd = -1;
+		f->conns[id]->received = 0;
+	}
+	return f->conns[id];
+}
+
+/* Returns false at the end. */
+static bool next_record(struct capture_file *f, struct record *r)
+{
+	const struct capture_hdr *hdr;
+	struct conn *c;
+
+	for (;;) {
+		if (f->off + sizeof(*hdr) > f->size)
+			return false;
+		hdr = (const struct capture_hdr *)(f->map + f->off);
+		if (le32_to_cpu(hdr->type) != CAPTURE_PAD)
+			break;
+		/* Skip to the next segment. */
+		f->off = (f->off / f->segment_size + 1) * f->segment_size;
+	}
+
+	r->nsec = le64_to_cpu(hdr->nsec);
+	r->conn = le32_to_cpu(hdr->conn);
+	r->type = le32_to_cpu(hdr->type);
+	r->truncated = le32_to_cpu(hdr->truncated);
+	r->len = le32_to_cpu(hdr->len);
+	r->data = (const char *)(hdr + 1);
+	if (r->len > f->size - f->off - sizeof(*hdr)) {
+		warnx("Capture ends in the middle of a record");
+		return false;
+	}
+	f->off += sizeof(*hdr) + capture_padlen(r->len);
+
+	c = get_conn(f, r->conn);
+	c->records++;
+	switch (r->type) {
+	case CAPTURE_NAME:
+		c->name = tal_strndup(c, r->data, r->len);
+		break;
+	case CAPTURE_IN:
+		c->in += r->len;
+		break;
+	case CAPTURE_OUT:
+		c->out += r->len;
+		break;
+	default:
+		errx(1, "Unknown record type %u at offset %zu",
+		     r->type, f->off);
+	}
+	return true;
+}
+
+static bool is_text(const char *data, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		if (!isprint((unsigned char)data[i])
+		    && !isspace((unsigned char)data[i]))
+			return false;
+	return true;
+}
+
+static void dump(struct capture_file *f, bool summary)
+{
+	struct record r;
+	u64 start = 0;
+	size_t i;
+
+	while (next_record(f, &r)) {
+		const char *dir;
+
+		if (!start)
+			start = r.nsec;
+		if (summary || r.type == CAPTURE_NAME)
+			continue;
+
+		dir = r.type == CAPTURE_IN ? "IN" : "OUT";
+		printf("+%"PRIu64".%09"PRIu64" %s %s %zu%s\n",
+		       (r.nsec - start) / 1000000000,
+		       (r.nsec - start) % 1000000000,
+		       get_conn(f, r.conn)->name, dir, r.len,
+		       r.truncated ? " (truncated)" : "");
+		if (is_text(r.data, r.len)) {
+			fwrite(r.data, r.len, 1, stdout);
+			printf("\n");
+		} else {
+			char *hex = tal_arr(f, char, hex_str_size(r.len));
+			hex_encode(r.data, r.len, hex, hex_str_size(r.len));
+			printf("%s\n", hex);
+			tal_free(hex);
+		}
+	}
+
+	if (!summary)
+		return;
+	for (i = 0; i < tal_count(f->conns); i++) {
+		const struct conn *c = f->conns[i];
+		if (!c)
+			continue;
+		printf("%s %"PRIu64" records, %"PRIu64" bytes in,"
+		       " %"PRIu64" bytes out\n",
+		       c->name, c->records, c->in, c->out);
+	}
+}
+
+static int connect_rpc(const char *rpc_filename)
+{
+	struct sockaddr_un addr;
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	if (strlen(rpc_filename) + 1 > sizeof(addr.sun_path))
+		errx(1, "rpc filename '%s' too long", rpc_filename);
+	strcpy(addr.sun_path, rpc_filename);
+	addr.sun_family = AF_UNIX;
+
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+		err(1, "Connecting to '%s'", rpc_filename);
+	return fd;
+}
+
+/* Read whatever responses are waiting: returns false if nothing came
+ * within timeout msec. */
+static bool drain(struct capture_file *f, int timeout)
+{
+	struct pollfd *pfd = tal_arr(f, struct pollfd, 0);
+	struct conn **c = tal_arr(f, struct conn *, 0);
+	char buf[65536];
+	size_t i, n = 0;
+	bool any;
+
+	for (i = 0; i < tal_count(f->conns); i++) {
+		if (!f->conns[i] || f->conns[i]->fd < 0)
+			continue;
+		tal_resize(&pfd, n + 1);
+		tal_resize(&c, n + 1);
+		pfd[n].fd = f->conns[i]->fd;
+		pfd[n].events = POLLIN;
+		c[n++] = f->conns[i];
+	}
+
+	if (poll(pfd, n, timeout) < 0)
+		err(1, "poll");
+
+	any = false;
+	for (i = 0; i < n; i++) {
+		ssize_t r;
+
+		if (!pfd[i].revents)
+			continue;
+		r = read(c[i]->fd, buf, sizeof(buf));
+		if (r <= 0) {
+			warnx("%s: lightningd closed connection", c[i]->name);
+			close(c[i]->fd);
+			c[i]->fd = -1;
+			continue;
+		}
+		c[i]->received += r;
+		any = true;
+	}
+	tal_free(pfd);
+	tal_free(c);
+	return any;
+}
+
+/* Sends everything each connection read, in order, on a connection of its
+ * own: responses are read and counted, but not checked. */
+static void replay(struct capture_file *f, const char *rpc_filename,
+		   bool realtime)
+{
+	struct timeabs start = time_now();
+	struct record r;
+	u64 first = 0, sent = 0, received = 0, expected = 0;
+	size_t i;
+
+	while (next_record(f, &r)) {
+		struct conn *c = get_conn(f, r.conn);
+
+		if (!first)
+			first = r.nsec;
+		if (r.type != CAPTURE_IN)
+			continue;
+
+		if (realtime) {
+			struct timerel elapsed = time_between(time_now(), start);
+			u64 due = r.nsec - first, now = time_to_nsec(elapsed);
+
+			while (now < due) {
+				drain(f, (due - now + 999999) / 1000000);
+				now = time_to_nsec(time_between(time_now(),
+								start));
+			}
+		}
+
+		if (c->fd < 0)
+			c->fd = connect_rpc(rpc_filename);
+		if (!write_all(c->fd, r.data, r.len))
+			err(1, "Writing to %s", c->name);
+		sent += r.len;
+		drain(f, 0);
+	}
+
+	/* Wait for the rest of the responses. */
+	for (;;) {
+		bool done = true;
+
+		for (i = 0; i < tal_count(f->conns); i++) {
+			const struct conn *c = f->conns[i];
+			if (c && c->fd >= 0 && c->received < c->out)
+				done = false;
+		}
+		if (done || !drain(f, REPLAY_IDLE_MSEC))
+			break;
+	}
+
+	for (i = 0; i < tal_count(f->conns); i++) {
+		struct conn *c = f->conns[i];
+		if (!c)
+			continue;
+		received += c->received;
+		expected += c->out;
+		if (c->fd >= 0)
+			close(c->fd);
+	}
+
+	printf("Replayed %"PRIu64" bytes in %"PRIu64" msec:"
+	       " %"PRIu64" bytes back (captured %"PRIu64")\n",
+	       sent, time_to_msec(time_between(time_now(), start)),
+	       received, expected);
+}
+
+int main(int argc, char *argv[])
+{
+	char *lightning_dir, *rpc_filename;
+	bool do_replay = false, realtime = false, summary = false;
+	const tal_t *ctx = tal(NULL, char);
+	struct capture_file *f;
+
+	err_set_progname(argv[0]);
+
+	opt_set_alloc(opt_allocfn, tal_reallocfn, tal_freefn);
+	configdir_register_opts(ctx, &lightning_dir, &rpc_filename);
+
+	opt_register_noarg("--summary", opt_set_bool, &summary,
+			   "Only print totals for each connection");
+	opt_register_noarg("--replay", opt_set_bool, &do_replay,
+			   "Send what was read to lightningd again");
+	opt_register_noarg("--realtime", opt_set_bool, &realtime,
+			   "Replay with the original timing, not flat out");
+	opt_register_noarg("--help|-h", opt_usage_and_exit,
+			   "<capturefile>", "Show this message");
+	opt_register_version();
+
+	opt_early_parse(argc, argv, opt_log_stderr_exit);
+	opt_parse(&argc, argv, opt_log_stderr_exit);
+
+	if (argc != 2)
+		errx(1, "Need a capture file\n%s", opt_usage(argv[0], NULL));
+
+	f = open_capture(ctx, argv[1]);
+	if (do_replay) {
+		if (chdir(lightning_dir) != 0)
+			err(1, "Moving into '%s'", lightning_dir);
+		replay(f, rpc_filename, realtime);
+	} else
+		dump(f, summary);
+
+	tal_free(ctx);
+	return 0;
+}
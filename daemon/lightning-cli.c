@@ -10,6 +10,7 @@
 #include <ccan/read_write_all/read_write_all.h>
 #include <ccan/str/str.h>
 #include <ccan/tal/str/str.h>
+#include <poll.h>
 #include <stdio.h>
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -45,6 +46,175 @@ struct timeabs controlled_time(void)
 	return time_now();
 }
 
+static char *make_request(const tal_t *ctx, const char *method,
+			  const char *idstr, char **params, size_t num)
+{
+	char *cmd;
+	size_t i;
+
+	cmd = tal_fmt(ctx,
+		      "{ \"method\" : \"%s\", \"id\" : \"%s\", \"params\" : [ ",
+		      method, idstr);
+
+	for (i = 0; i < num; i++) {
+		/* Numbers, bools, objects and arrays are left unquoted,
+		 * and quoted things left alone. */
+		if (strspn(params[i], "0123456789") == strlen(params[i])
+		    || streq(params[i], "true")
+		    || streq(params[i], "false")
+		    || params[i][0] == '{'
+		    || params[i][0] == '['
+		    || params[i][0] == '"')
+			tal_append_fmt(&cmd, "%s", params[i]);
+		else
+			tal_append_fmt(&cmd, "\"%s\"", params[i]);
+		if (i != num - 1)
+			tal_append_fmt(&cmd, ", ");
+	}
+	tal_append_fmt(&cmd, "] }");
+	return cmd;
+}
+
+/* A line is either raw JSON, or a command and parameters like argv. */
+static char *line_to_request(const tal_t *ctx, char *line, size_t linenum)
+{
+	char **words;
+	size_t num;
+
+	line += strspn(line, " \t");
+	if (line[0] == '{' || line[0] == '[')
+		return tal_strdup(ctx, line);
+
+	words = tal_strsplit(ctx, line, " \t", STR_NO_EMPTY);
+	num = tal_count(words) - 1;
+	if (!num)
+		return NULL;
+
+	return make_request(ctx, words[0],
+			    tal_fmt(ctx, "lightning-cli-%i-%zu",
+				    getpid(), linenum),
+			    words + 1, num - 1);
+}
+
+/* Returns false if it was an error. */
+static bool print_response(const char *resp, const jsmntok_t *toks)
+{
+	const jsmntok_t *error;
+
+	printf("%.*s\n", json_tok_len(toks), json_tok_contents(resp, toks));
+	if (toks->type != JSMN_OBJECT)
+		return true;
+
+	error = json_get_member(resp, toks, "error");
+	return !error || json_tok_is_null(resp, error);
+}
+
+/* Send each line of stdin as a request without waiting for answers, and
+ * print those as they come back (maybe out of order: they carry the id). */
+static int pipeline(const tal_t *ctx, int fd)
+{
+	char *in = tal_arr(ctx, char, 1024), *resp = tal_arr(ctx, char, 1024);
+	size_t in_used = 0, resp_used = 0, linenum = 0, outstanding = 0;
+	jsmntok_t *toks = tal_arr(ctx, jsmntok_t, 10);
+	jsmn_parser parser;
+	bool in_eof = false;
+	int ret = NO_ERROR;
+
+	jsmn_init(&parser);
+	while (!in_eof || outstanding) {
+		struct pollfd pfd[2];
+		ssize_t r;
+		char *nl;
+
+		pfd[0].fd = fd;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = in_eof ? -1 : STDIN_FILENO;
+		pfd[1].events = POLLIN;
+		if (poll(pfd, 2, -1) < 0)
+			err(ERROR_TALKING_TO_LIGHTNINGD, "poll");
+
+		if (pfd[1].revents) {
+			if (in_used == tal_count(in))
+				tal_resize(&in, in_used * 2);
+			r = read(STDIN_FILENO, in + in_used,
+				 tal_count(in) - in_used);
+			if (r < 0)
+				err(ERROR_USAGE, "reading stdin");
+			in_used += r;
+			if (r == 0) {
+				in_eof = true;
+				/* Last line may not have a newline. */
+				if (in_used) {
+					if (in_used == tal_count(in))
+						tal_resize(&in, in_used + 1);
+					in[in_used++] = '\n';
+				}
+			}
+
+			while ((nl = memchr(in, '\n', in_used)) != NULL) {
+				char *req;
+
+				*nl = '\0';
+				req = line_to_request(ctx, in, ++linenum);
+				if (req) {
+					if (!write_all(fd, req, strlen(req)))
+						err(ERROR_TALKING_TO_LIGHTNINGD,
+						    "Writing command");
+					outstanding++;
+					tal_free(req);
+				}
+				in_used -= nl + 1 - in;
+				memmove(in, nl + 1, in_used);
+			}
+		}
+
+		if (!pfd[0].revents)
+			continue;
+
+		if (resp_used == tal_count(resp))
+			tal_resize(&resp, resp_used * 2);
+		r = read(fd, resp + resp_used, tal_count(resp) - resp_used);
+		if (r < 0)
+			err(ERROR_TALKING_TO_LIGHTNINGD, "reading response");
+		if (r == 0)
+			errx(ERROR_TALKING_TO_LIGHTNINGD,
+			     "lightningd closed with %zu requests outstanding",
+			     outstanding);
+		resp_used += r;
+
+		/* Print every complete response, then start again after. */
+		for (;;) {
+			int n = json_parse_more(&parser, &toks, resp, resp_used);
+			size_t end;
+
+			if (n < 0)
+				errx(ERROR_TALKING_TO_LIGHTNINGD,
+				     "Malformed response '%.*s'",
+				     (int)resp_used, resp);
+			if (n == 0) {
+				if (parser.pos == resp_used) {
+					resp_used = 0;
+					jsmn_init(&parser);
+				}
+				break;
+			}
+			if (toks[0].end == -1)
+				break;
+
+			if (!print_response(resp, toks))
+				ret = ERROR_FROM_LIGHTNINGD;
+			if (outstanding)
+				outstanding--;
+
+			end = toks[0].end;
+			resp_used -= end;
+			memmove(resp, resp + end, resp_used);
+			jsmn_init(&parser);
+		}
+	}
+	return ret;
+}
+
 int main(int argc, char *argv[])
 {
 	int fd, i, off;
@@ -57,13 +227,16 @@ int main(int argc, char *argv[])
 	char *lightning_dir;
 	const tal_t *ctx = tal(NULL, char);
 	size_t num_opens, num_closes;
-	bool valid;
+	bool valid, from_stdin = false;
 
 	err_set_progname(argv[0]);
 
 	opt_set_alloc(opt_allocfn, tal_reallocfn, tal_freefn);
 	configdir_register_opts(ctx, &lightning_dir, &rpc_filename);
 
+	opt_register_noarg("--stdin", opt_set_bool, &from_stdin,
+			   "Send each line of stdin as a command, print"
+			   " responses as they arrive");
 	opt_register_noarg("--help|-h", opt_usage_and_exit,
 			   "<command> [<params>...]", "Show this message");
 	opt_register_version();
@@ -72,7 +245,7 @@ int main(int argc, char *argv[])
 	opt_parse(&argc, argv, opt_log_stderr_exit);
 
 	method = argv[1];
-	if (!method)
+	if (!method && !from_stdin)
 		errx(ERROR_USAGE, "Need at least one argument\n%s",
 		     opt_usage(argv[0], NULL));
 
@@ -90,27 +263,14 @@ int main(int argc, char *argv[])
 		err(ERROR_TALKING_TO_LIGHTNINGD,
 		    "Connecting to '%s'", rpc_filename);
 
-	idstr = tal_fmt(ctx, "lightning-cli-%i", getpid());
-	cmd = tal_fmt(ctx,
-		      "{ \"method\" : \"%s\", \"id\" : \"%s\", \"params\" : [ ",
-		      method, idstr);
-
-	for (i = 2; i < argc; i++) {
-		/* Numbers, bools, objects and arrays are left unquoted,
-		 * and quoted things left alone. */
-		if (strspn(argv[i], "0123456789") == strlen(argv[i])
-		    || streq(argv[i], "true")
-		    || streq(argv[i], "false")
-		    || argv[i][0] == '{'
-		    || argv[i][0] == '['
-		    || argv[i][0] == '"')
-			tal_append_fmt(&cmd, "%s", argv[i]);
-		else
-			tal_append_fmt(&cmd, "\"%s\"", argv[i]);
-		if (i != argc - 1)
-			tal_append_fmt(&cmd, ", ");
+	if (from_stdin) {
+		int ret = pipeline(ctx, fd);
+		tal_free(ctx);
+		return ret;
 	}
-	tal_append_fmt(&cmd, "] }");
+
+	idstr = tal_fmt(ctx, "lightning-cli-%i", getpid());
+	cmd = make_request(ctx, method, idstr, argv + 2, argc - 2);
 
 	if (!write_all(fd, cmd, strlen(cmd)))
 		err(ERROR_TALKING_TO_LIGHTNINGD, "Writing command");
@@ -0,0 +1,464 @@
+/*
+ * Load a running lightningd with a weighted mix of JSON-RPC commands, over
+ * many connections at once, and report throughput and latency per command.
+ */
+#include "configdir.h"
+#include "controlled_time.h"
+#include "json.h"
+#include "version.h"
+#include <ccan/asort/asort.h>
+#include <ccan/crypto/sha256/sha256.h>
+#include <ccan/err/err.h>
+#include <ccan/opt/opt.h>
+#include <ccan/read_write_all/read_write_all.h>
+#include <ccan/str/hex/hex.h>
+#include <ccan/str/str.h>
+#include <ccan/tal/str/str.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/* How long we wait for the last answers once we stop sending. */
+#define DRAIN_MSEC 10000
+
+/* Tal wrappers for opt. */
+static void *opt_allocfn(size_t size)
+{
+	return tal_alloc_(NULL, size, false, TAL_LABEL("opt_allocfn", ""));
+}
+
+static void *tal_reallocfn(void *ptr, size_t size)
+{
+	if (!ptr)
+		return opt_allocfn(size);
+	tal_resize_(&ptr, 1, size, false);
+	return ptr;
+}
+
+static void tal_freefn(void *ptr)
+{
+	tal_free(ptr);
+}
+
+struct timeabs controlled_time(void)
+{
+	return time_now();
+}
+
+enum load_cmd {
+	LOAD_INVOICE,
+	LOAD_LISTINVOICE,
+	LOAD_GETROUTE,
+	LOAD_GETPEERS,
+	LOAD_SENDPAY,
+	LOAD_NUM_CMDS
+};
+
+static const char *cmd_names[LOAD_NUM_CMDS] = {
+	"invoice", "listinvoice", "getroute", "getpeers", "sendpay"
+};
+
+struct cmd_stats {
+	unsigned int weight;
+	u64 errors;
+	/* Microseconds each successful one took (tal array). */
+	u64 *usec;
+};
+
+struct load {
+	struct cmd_stats cmd[LOAD_NUM_CMDS];
+	unsigned int total_weight;
+	char *dest;
+	u64 msatoshi;
+	/* getroute's answer to dest, for sendpay. */
+	char *route;
+	u64 next_label;
+};
+
+struct conn {
+	int fd;
+	char *buf;
+	size_t used;
+	jsmn_parser parser;
+	jsmntok_t *toks;
+	/* What it's waiting for, if anything, and since when. */
+	bool busy;
+	enum load_cmd cmd;
+	struct timeabs start;
+};
+
+static int connect_rpc(const char *rpc_filename)
+{
+	struct sockaddr_un addr;
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	if (strlen(rpc_filename) + 1 > sizeof(addr.sun_path))
+		errx(1, "rpc filename '%s' too long", rpc_filename);
+	strcpy(addr.sun_path, rpc_filename);
+	addr.sun_family = AF_UNIX;
+
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+		err(1, "Connecting to '%s'", rpc_filename);
+	return fd;
+}
+
+/* "invoice:2,getpeers:1": anything not named isn't sent. */
+static char *opt_set_mix(const char *arg, struct load *load)
+{
+	char **parts = tal_strsplit(NULL, arg, ",", STR_NO_EMPTY);
+	size_t i;
+	int c;
+
+	for (c = 0; c < LOAD_NUM_CMDS; c++)
+		load->cmd[c].weight = 0;
+
+	for (i = 0; parts[i]; i++) {
+		char *colon = strchr(parts[i], ':'), *end;
+		unsigned long weight = 1;
+
+		if (colon) {
+			*colon = '\0';
+			weight = strtoul(colon + 1, &end, 10);
+			if (*end || end == colon + 1)
+				return tal_fmt(NULL, "Bad weight for '%s'",
+					       parts[i]);
+		}
+		for (c = 0; c < LOAD_NUM_CMDS; c++)
+			if (streq(parts[i], cmd_names[c]))
+				break;
+		if (c == LOAD_NUM_CMDS)
+			return tal_fmt(NULL, "Unknown command '%s'", parts[i]);
+		load->cmd[c].weight = weight;
+	}
+	tal_free(parts);
+	return NULL;
+}
+
+static enum load_cmd pick_cmd(const struct load *load)
+{
+	unsigned int r = random() % load->total_weight;
+	int c;
+
+	for (c = 0; r >= load->cmd[c].weight; c++)
+		r -= load->cmd[c].weight;
+	return c;
+}
+
+static char *make_request(const tal_t *ctx, struct load *load,
+			  enum load_cmd cmd)
+{
+	const char *params;
+	struct sha256 rhash;
+	char hex[hex_str_size(sizeof(rhash))];
+	size_t i;
+
+	switch (cmd) {
+	case LOAD_INVOICE:
+		params = tal_fmt(ctx, "[ %"PRIu64", \"rpcload-%i-%"PRIu64"\" ]",
+				 load->msatoshi, getpid(), load->next_label++);
+		break;
+	case LOAD_LISTINVOICE:
+		params = "{ \"limit\" : 100 }";
+		break;
+	case LOAD_GETROUTE:
+		params = tal_fmt(ctx, "[ \"%s\", %"PRIu64", 1 ]",
+				 load->dest, load->msatoshi);
+		break;
+	case LOAD_GETPEERS:
+		params = "[ ]";
+		break;
+	case LOAD_SENDPAY:
+		/* Nobody knows the preimage: it fails at the end. */
+		for (i = 0; i < sizeof(rhash.u.u8); i++)
+			rhash.u.u8[i] = random();
+		hex_encode(&rhash, sizeof(rhash), hex, sizeof(hex));
+		params = tal_fmt(ctx, "[ %s, \"%s\" ]", load->route, hex);
+		break;
+	default:
+		abort();
+	}
+	return tal_fmt(ctx, "{ \"method\" : \"%s\", \"id\" : \"rpcload\","
+		       " \"params\" : %s }", cmd_names[cmd], params);
+}
+
+static void send_request(struct conn *c, struct load *load,
+			 enum load_cmd cmd, struct timeabs start)
+{
+	char *req = make_request(c, load, cmd);
+
+	if (!write_all(c->fd, req, strlen(req)))
+		err(1, "Writing %s", cmd_names[cmd]);
+	tal_free(req);
+	c->busy = true;
+	c->cmd = cmd;
+	c->start = start;
+}
+
+/* Returns the response's top token once it's all here, or NULL. */
+static const jsmntok_t *read_response(struct conn *c)
+{
+	ssize_t r;
+	int n;
+
+	if (c->used == tal_count(c->buf))
+		tal_resize(&c->buf, c->used * 2);
+	r = read(c->fd, c->buf + c->used, tal_count(c->buf) - c->used);
+	if (r < 0)
+		err(1, "Reading response");
+	if (r == 0)
+		errx(1, "lightningd closed connection");
+	c->used += r;
+
+	n = json_parse_more(&c->parser, &c->toks, c->buf, c->used);
+	if (n < 0)
+		errx(1, "Malformed response '%.*s'", (int)c->used, c->buf);
+	if (n == 0 || c->toks[0].end == -1)
+		return NULL;
+	return c->toks;
+}
+
+/* We only ever have one request outstanding, so the rest is ours too. */
+static void done_response(struct conn *c)
+{
+	c->used = 0;
+	jsmn_init(&c->parser);
+	c->busy = false;
+}
+
+static bool response_ok(const struct conn *c, const jsmntok_t *toks)
+{
+	const jsmntok_t *error;
+
+	if (toks->type != JSMN_OBJECT)
+		return false;
+	error = json_get_member(c->buf, toks, "error");
+	return !error || json_tok_is_null(c->buf, error);
+}
+
+static void new_conn(const tal_t *ctx, struct conn *c, const char *rpc_filename)
+{
+	c->fd = connect_rpc(rpc_filename);
+	c->buf = tal_arr(ctx, char, 1024);
+	c->used = 0;
+	c->toks = tal_arr(ctx, jsmntok_t, 10);
+	jsmn_init(&c->parser);
+	c->busy = false;
+}
+
+/* One getroute up front, for sendpay to use throughout. */
+static void get_route(struct conn *c, struct load *load)
+{
+	const jsmntok_t *toks, *result, *route;
+
+	send_request(c, load, LOAD_GETROUTE, time_now());
+	while ((toks = read_response(c)) == NULL);
+	if (!response_ok(c, toks))
+		errx(1, "getroute failed: %.*s",
+		     json_tok_len(toks), json_tok_contents(c->buf, toks));
+	result = json_get_member(c->buf, toks, "result");
+	route = result ? json_get_member(c->buf, result, "route") : NULL;
+	if (!route)
+		errx(1, "No route in '%.*s'",
+		     json_tok_len(toks), json_tok_contents(c->buf, toks));
+	load->route = tal_strndup(load, json_tok_contents(c->buf, route),
+				  json_tok_len(route));
+	done_response(c);
+}
+
+static int cmp_u64(const u64 *a, const u64 *b, void *unused)
+{
+	if (*a < *b)
+		return -1;
+	return *a > *b;
+}
+
+static u64 percentile(const u64 *sorted, size_t n, unsigned int pct)
+{
+	return sorted[(n - 1) * pct / 100];
+}
+
+static void report(struct load *load, struct timerel elapsed)
+{
+	u64 msec = time_to_msec(elapsed) + 1, total = 0;
+	int c;
+
+	for (c = 0; c < LOAD_NUM_CMDS; c++) {
+		struct cmd_stats *s = &load->cmd[c];
+		size_t n = tal_count(s->usec);
+
+		if (!n && !s->errors)
+			continue;
+		total += n + s->errors;
+		printf("%s: %zu ok, %"PRIu64" errors, %"PRIu64"/sec",
+		       cmd_names[c], n, s->errors, (n + s->errors) * 1000 / msec);
+		if (n) {
+			asort(s->usec, n, cmp_u64, NULL);
+			printf(", usec p50 %"PRIu64" p90 %"PRIu64
+			       " p99 %"PRIu64" max %"PRIu64,
+			       percentile(s->usec, n, 50),
+			       percentile(s->usec, n, 90),
+			       percentile(s->usec, n, 99), s->usec[n - 1]);
+		}
+		printf("\n");
+	}
+	printf("total: %"PRIu64" in %"PRIu64" msec: %"PRIu64"/sec\n",
+	       total, msec, total * 1000 / msec);
+}
+
+/* Each connection has at most one request outstanding.  With a --rate,
+ * each request is due at a set time, and its latency counts from then:
+ * otherwise a slow daemon would slow us down and hide it. */
+static void run(const tal_t *ctx, struct load *load, struct conn *conns,
+		size_t num_conns, unsigned int rate, unsigned int duration)
+{
+	struct timeabs start = time_now(), due = start, now;
+	struct pollfd *pfd = tal_arr(ctx, struct pollfd, num_conns);
+	bool sending = true;
+	u64 sent = 0;
+	size_t i, busy = 0;
+
+	for (;;) {
+		int timeout = 100;
+
+		now = time_now();
+		if (time_to_sec(time_between(now, start)) >= duration)
+			sending = false;
+		if (!sending && !busy)
+			break;
+		if (!sending
+		    && time_to_msec(time_between(now, start))
+		    > duration * 1000ULL + DRAIN_MSEC) {
+			warnx("%zu requests unanswered", busy);
+			break;
+		}
+
+		for (i = 0; sending && i < num_conns; i++) {
+			if (conns[i].busy)
+				continue;
+			if (rate && time_after(due, now))
+				break;
+			send_request(&conns[i], load, pick_cmd(load),
+				     rate ? due : now);
+			busy++;
+			sent++;
+			if (rate)
+				due = timeabs_add(start,
+						  time_from_usec(sent * 1000000
+								 / rate));
+		}
+		if (rate && sending && time_after(due, now))
+			timeout = time_to_msec(time_between(due, now)) + 1;
+
+		for (i = 0; i < num_conns; i++) {
+			pfd[i].fd = conns[i].busy ? conns[i].fd : -1;
+			pfd[i].events = POLLIN;
+		}
+		if (poll(pfd, num_conns, timeout) < 0)
+			err(1, "poll");
+
+		for (i = 0; i < num_conns; i++) {
+			struct conn *c = &conns[i];
+			struct cmd_stats *s;
+			const jsmntok_t *toks;
+
+			if (!pfd[i].revents)
+				continue;
+			toks = read_response(c);
+			if (!toks)
+				continue;
+			s = &load->cmd[c->cmd];
+			if (response_ok(c, toks)) {
+				size_t n = tal_count(s->usec);
+				tal_resize(&s->usec, n + 1);
+				s->usec[n] = time_to_usec(time_between(time_now(),
+								       c->start));
+			} else
+				s->errors++;
+			done_response(c);
+			busy--;
+		}
+	}
+	report(load, time_between(time_now(), start));
+}
+
+int main(int argc, char *argv[])
+{
+	char *lightning_dir, *rpc_filename;
+	const tal_t *ctx = tal(NULL, char);
+	struct load *load = talz(ctx, struct load);
+	unsigned int connections = 10, rate = 0, duration = 10, seed = 1;
+	unsigned long long msatoshi = 1000;
+	struct conn *conns;
+	size_t i;
+	int c;
+
+	err_set_progname(argv[0]);
+
+	load->cmd[LOAD_INVOICE].weight = 1;
+	load->cmd[LOAD_LISTINVOICE].weight = 2;
+	load->cmd[LOAD_GETPEERS].weight = 2;
+
+	opt_set_alloc(opt_allocfn, tal_reallocfn, tal_freefn);
+	configdir_register_opts(ctx, &lightning_dir, &rpc_filename);
+
+	opt_register_arg("--connections", opt_set_uintval, opt_show_uintval,
+			 &connections, "Connections to send requests on");
+	opt_register_arg("--rate", opt_set_uintval, opt_show_uintval, &rate,
+			 "Requests per second in all (0 for flat out)");
+	opt_register_arg("--duration", opt_set_uintval, opt_show_uintval,
+			 &duration, "Seconds to send requests for");
+	opt_register_arg("--mix", opt_set_mix, NULL, load,
+			 "Commands and their weights, eg. invoice:1,getpeers:2"
+			 " (default invoice:1,listinvoice:2,getpeers:2)");
+	opt_register_arg("--dest", opt_set_charp, NULL, &load->dest,
+			 "Node id for getroute and sendpay");
+	opt_register_arg("--msatoshi", opt_set_ulonglongval_si,
+			 opt_show_ulonglongval_si, &msatoshi,
+			 "Amount for invoice, getroute and sendpay");
+	opt_register_arg("--seed", opt_set_uintval, opt_show_uintval, &seed,
+			 "Random seed for the mix");
+	opt_register_noarg("--help|-h", opt_usage_and_exit, "",
+			   "Show this message");
+	opt_register_version();
+
+	opt_early_parse(argc, argv, opt_log_stderr_exit);
+	opt_parse(&argc, argv, opt_log_stderr_exit);
+	if (argc != 1)
+		errx(1, "No arguments expected\n%s", opt_usage(argv[0], NULL));
+	if (connections == 0)
+		errx(1, "Need at least one connection");
+
+	for (c = 0; c < LOAD_NUM_CMDS; c++) {
+		load->total_weight += load->cmd[c].weight;
+		load->cmd[c].usec = tal_arr(load, u64, 0);
+	}
+	if (!load->total_weight)
+		errx(1, "--mix has nothing to send");
+	if ((load->cmd[LOAD_GETROUTE].weight || load->cmd[LOAD_SENDPAY].weight)
+	    && !load->dest)
+		errx(1, "getroute and sendpay need --dest");
+	load->msatoshi = msatoshi;
+	srandom(seed);
+
+	if (chdir(lightning_dir) != 0)
+		err(1, "Moving into '%s'", lightning_dir);
+
+	conns = tal_arr(ctx, struct conn, connections);
+	for (i = 0; i < connections; i++)
+		new_conn(conns, &conns[i], rpc_filename);
+
+	if (load->cmd[LOAD_SENDPAY].weight)
+		get_route(&conns[0], load);
+
+	run(ctx, load, conns, connections, rate, duration);
+
+	for (i = 0; i < connections; i++)
+		close(conns[i].fd);
+	tal_free(ctx);
+	return 0;
+}
@@ -1,27 +1,48 @@
 #include "bitcoind.h"
+#include "blocknotify.h"
+#include "chainsource.h"
 #include "chaintopology.h"
 #include "configdir.h"
 #include "controlled_time.h"
+#include "cryptopkt.h"
 #include "db.h"
+#include "invoice.h"
 #include "irc_announce.h"
 #include "jsonrpc.h"
 #include "lightningd.h"
 #include "log.h"
+#include "memory.h"
 #include "opt_time.h"
+#include "pay.h"
 #include "peer.h"
+#include "rebalance.h"
 #include "routing.h"
+#include "routing_snapshot.h"
 #include "secrets.h"
+#include "sigpool.h"
+#include "stats.h"
+#include "status_page.h"
 #include "timeout.h"
+#include "wallet.h"
+#include <ccan/array_size/array_size.h>
 #include <ccan/container_of/container_of.h>
 #include <ccan/err/err.h>
 #include <ccan/io/io.h>
 #include <ccan/opt/opt.h>
+#include <ccan/str/str.h>
+#include <ccan/tal/path/path.h>
 #include <ccan/tal/str/str.h>
 #include <ccan/tal/tal.h>
 #include <ccan/time/time.h>
 #include <ccan/timer/timer.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <signal.h>
+#include <sodium/core.h>
+#include <stdarg.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
@@ -121,6 +142,12 @@ static void config_register_opts(struct lightningd_state *dstate)
 	opt_register_arg("--default-fee-rate", opt_set_u64, opt_show_u64,
 			 &dstate->config.default_fee_rate,
 			 "Satoshis per kb if can't estimate fees");
+	opt_register_arg("--fee-refresh", opt_set_time, opt_show_time,
+			 &dstate->config.fee_refresh_time,
+			 "Minimum time between fee estimates");
+	opt_register_arg("--fee-change-percent", opt_set_u32, opt_show_u32,
+			 &dstate->config.fee_change_percent,
+			 "Ignore fee estimates which move less than this percent");
 	opt_register_arg("--min-htlc-expiry", opt_set_u32, opt_show_u32,
 			 &dstate->config.min_htlc_expiry,
 			 "Minimum number of blocks to accept an HTLC before expiry");
@@ -130,12 +157,30 @@ static void config_register_opts(struct lightningd_state *dstate)
 	opt_register_arg("--deadline-blocks", opt_set_u32, opt_show_u32,
 			 &dstate->config.deadline_blocks,
 			 "Number of blocks before HTLC timeout before we drop connection");
+	opt_register_arg("--chain-source", opt_set_chain_source,
+			 opt_show_chain_source, &dstate->config.chain_source,
+			 "Where to get blocks and send transactions: bitcoind");
 	opt_register_arg("--bitcoind-poll", opt_set_time, opt_show_time,
 			 &dstate->config.poll_time,
 			 "Time between polling for new transactions");
+	opt_register_arg("--bitcoind-concurrency", opt_set_u32, opt_show_u32,
+			 &dstate->config.bitcoind_concurrency,
+			 "Most requests to send bitcoind at once");
+	opt_register_noarg("--watch-mempool", opt_set_bool,
+			   &dstate->config.watch_mempool,
+			   "React to spends of our channels in the mempool, before they're mined");
 	opt_register_arg("--commit-time", opt_set_time, opt_show_time,
 			 &dstate->config.commit_time,
 			 "Time after changes before sending out COMMIT");
+	opt_register_noarg("--commit-adaptive", opt_set_bool,
+			   &dstate->config.commit_adaptive,
+			   "Commit at once when idle, waiting up to --commit-time as load grows");
+	opt_register_arg("--stall-warn", opt_set_time, opt_show_time,
+			 &dstate->config.stall_warn,
+			 "Log any callback which stops the loop for longer (0s to disable)");
+	opt_register_arg("--timer-slack", opt_set_time, opt_show_time,
+			 &dstate->config.timer_slack,
+			 "Let timers fire this late, so nearby ones fire together (0s for exact)");
 	opt_register_arg("--fee-base", opt_set_u32, opt_show_u32,
 			 &dstate->config.fee_base,
 			 "Millisatoshi minimum to charge for HTLC");
@@ -144,11 +189,123 @@ static void config_register_opts(struct lightningd_state *dstate)
 			 "Microsatoshi fee for every satoshi in HTLC");
 	opt_register_arg("--add-route", opt_add_route, NULL,
 			 dstate,
-			 "Add route of form srcid/dstid/base/var/delay/minblocks"
-			 "(base in millisatoshi, var in millionths of satoshi per satoshi)");
+			 "Add route of form srcid/dstid/base/var/delay/minblocks[/capacity]"
+			 "(base and capacity in millisatoshi, var in millionths of satoshi per satoshi)");
+	opt_register_arg("--add-routes=<file>", opt_add_routes, NULL,
+			 dstate,
+			 "Add routes from file, one per line as --add-route takes");
+	opt_register_arg("--route-engine", opt_set_route_engine,
+			 opt_show_route_engine, &dstate->config.route_engine,
+			 "Route search algorithm: dijkstra or bfg");
+	opt_register_arg("--route-snapshot-time", opt_set_time, opt_show_time,
+			 &dstate->config.route_snapshot_time,
+			 "Time between saving routes to " ROUTING_SNAPSHOT_FILE
+			 " (0s to disable)");
+	opt_register_arg("--route-snapshot-follow", opt_set_charp,
+			 opt_show_charp, &dstate->config.route_snapshot_follow,
+			 "Also load routes from this node's " ROUTING_SNAPSHOT_FILE
+			 " whenever it's rewritten");
 	opt_register_noarg("--disable-irc", opt_set_invbool,
 			   &dstate->config.use_irc,
 			   "Disable IRC peer discovery for routing");
+	opt_register_noarg("--db-group-commit", opt_set_bool,
+			   &dstate->config.db_group_commit,
+			   "Write all peers' database updates in one transaction per loop iteration");
+	opt_register_noarg("--db-async", opt_set_bool,
+			   &dstate->config.db_async,
+			   "Write those transactions from a separate thread");
+	opt_register_noarg("--db-wal", opt_set_bool, &dstate->config.db_wal,
+			   "Use a write-ahead log for the database");
+	opt_register_arg("--db-synchronous", opt_set_db_synchronous,
+			 opt_show_db_synchronous,
+			 &dstate->config.db_synchronous,
+			 "Database sync mode: extra, full, normal (risks losing funds on power loss) or off (risks corruption)");
+	opt_register_arg("--db-wal-checkpoint", opt_set_u32, opt_show_u32,
+			 &dstate->config.db_wal_checkpoint,
+			 "Write-ahead log pages between checkpoints (0 for none until exit)");
+	opt_register_arg("--db-vacuum-pages", opt_set_u32, opt_show_u32,
+			 &dstate->config.db_vacuum_pages,
+			 "Free database pages to release each minute, when idle (0 for none)");
+	opt_register_arg("--db-replicate", opt_set_charp, opt_show_charp,
+			 &dstate->config.db_replicate,
+			 "Append database changes to this file, for a standby (each --tenant's goes in its directory)");
+	opt_register_arg("--sig-threads", opt_set_u32, opt_show_u32,
+			 &dstate->config.sig_threads,
+			 "Threads to spread batches of signatures over (0 for none)");
+	opt_register_arg("--max-reconnects", opt_set_u32, opt_show_u32,
+			 &dstate->config.max_reconnects,
+			 "Peers to try reconnecting to at once (0 for no limit)");
+	opt_register_arg("--peer-queue-max", opt_set_u64, opt_show_u64,
+			 &dstate->config.peer_queue_max,
+			 "Bytes queued for a peer before we stop routing to it");
+	opt_register_arg("--peer-htlc-max", opt_set_u32, opt_show_u32,
+			 &dstate->config.peer_htlc_max,
+			 "HTLCs offered to a peer before we stop routing to it");
+	opt_register_arg("--htlc-max-inflight", opt_set_u32, opt_show_u32,
+			 &dstate->config.htlc_max_inflight,
+			 "HTLCs each side of a channel may have in flight (0 for the protocol's 300)");
+	opt_register_arg("--htlc-max-inflight-msat", opt_set_u64,
+			 opt_show_u64, &dstate->config.htlc_max_inflight_msat,
+			 "Millisatoshi each side of a channel may have in HTLCs (0 for no limit)");
+	opt_register_arg("--htlc-min-msat", opt_set_u64, opt_show_u64,
+			 &dstate->config.htlc_min_msat,
+			 "Refuse HTLCs smaller than this many millisatoshi");
+	opt_register_arg("--commit-latency-target", opt_set_time,
+			 opt_show_time, &dstate->config.commit_latency_target,
+			 "Stop forwarding HTLCs while commits take longer than this on average (0s to disable)");
+	opt_register_arg("--memory-sample-time", opt_set_time, opt_show_time,
+			 &dstate->config.memory_sample_time,
+			 "Time between samples of memory use (0s to disable)");
+	opt_register_noarg("--alloc-profile", opt_set_bool,
+			   &dstate->config.alloc_profile,
+			   "Count allocations by backtrace, for getallocs");
+	opt_register_arg("--invoice-expiry", opt_set_u32, opt_show_u32,
+			 &dstate->config.invoice_expiry,
+			 "Default seconds until an invoice expires (0 for never)");
+	opt_register_arg("--invoice-paid-keep", opt_set_u32, opt_show_u32,
+			 &dstate->config.invoice_paid_keep,
+			 "Paid invoices to keep before archiving older ones (0 for all)");
+	opt_register_arg("--rebalance-time", opt_set_time, opt_show_time,
+			 &dstate->config.rebalance_time,
+			 "Time between attempts to move funds from our fullest channel to our emptiest (0s to disable)");
+	opt_register_arg("--dormant-time", opt_set_time, opt_show_time,
+			 &dstate->config.dormant_time,
+			 "Time a peer is idle before we keep only its balance in memory (0s to disable)");
+	opt_register_arg("--peer-ping-time", opt_set_time, opt_show_time,
+			 &dstate->config.peer_ping_time,
+			 "Time between checks that a connected peer is still acking (0s to disable)");
+	opt_register_arg("--peer-dead-time", opt_set_time, opt_show_time,
+			 &dstate->config.peer_dead_time,
+			 "Time a peer can go without acking before we disconnect it");
+	opt_register_arg("--status-page-time", opt_set_time, opt_show_time,
+			 &dstate->config.status_page_time,
+			 "Time between updates of the " STATUS_PAGE_FILE " file for monitors (0s to disable)");
+}
+
+static char *opt_add_listen_fd(const char *arg,
+			       struct lightningd_state *dstate)
+{
+	size_t n = tal_count(dstate->listen_fds);
+	char *endp;
+	long fd = strtol(arg, &endp, 10);
+
+	if (endp == arg || *endp || fd < 0 || fd > INT_MAX)
+		return tal_fmt(NULL, "'%s' is not a file descriptor", arg);
+	tal_resize(&dstate->listen_fds, n + 1);
+	dstate->listen_fds[n] = fd;
+	return NULL;
+}
+
+/* DIR[:PORT] for each --tenant, parsed once we've read all the options. */
+static char *opt_add_tenant(const char *arg, char ***tenants)
+{
+	size_t n = tal_count(*tenants);
+
+	if (!arg[0])
+		return tal_fmt(NULL, "--tenant needs a directory");
+	tal_resize(tenants, n + 1);
+	(*tenants)[n] = tal_strdup(*tenants, arg);
+	return NULL;
 }
 
 static void dev_register_opts(struct lightningd_state *dstate)
@@ -156,6 +313,13 @@ static void dev_register_opts(struct lightningd_state *dstate)
 	controlled_time_register_opts();
 	opt_register_noarg("--dev-no-routefail", opt_set_bool,
 			   &dstate->dev_never_routefail, opt_hidden);
+	opt_register_arg("--dev-link-latency", opt_set_time, opt_show_time,
+			 &dstate->dev_link_latency, opt_hidden);
+	opt_register_arg("--dev-link-loss", opt_set_u32, opt_show_u32,
+			 &dstate->dev_link_loss_percent, opt_hidden);
+	/* What dev-restart hands the new us, instead of binding afresh. */
+	opt_register_arg("--dev-listen-fd", opt_add_listen_fd, NULL,
+			 dstate, opt_hidden);
 }
 	
 static void default_config(struct config *config)
@@ -196,6 +360,11 @@ static void default_config(struct config *config)
 	/* Use this rate by default if estimatefee doesn't estimate. */
 	config->default_fee_rate = 40000;
 
+	/* Blocks come faster than estimates usefully change. */
+	config->fee_refresh_time = time_from_sec(10 * 60);
+	/* Don't redo every channel's commitment for noise. */
+	config->fee_change_percent = 10;
+
 	/* Don't bother me unless I have 6 hours to collect. */
 	config->min_htlc_expiry = 6 * 6;
 	/* Don't lock up channel for more than 5 days. */
@@ -207,8 +376,21 @@ static void default_config(struct config *config)
 	/* How often to bother bitcoind. */
 	config->poll_time = time_from_sec(30);
 
+	/* bitcoind's default -rpcthreads. */
+	config->bitcoind_concurrency = 4;
+
+	/* Blocks are enough for most. */
+	config->watch_mempool = false;
+
 	/* Send commit 10msec after receiving; almost immediately. */
 	config->commit_time = time_from_msec(10);
+	config->commit_adaptive = false;
+
+	/* Anything this slow is hurting every peer. */
+	config->stall_warn = time_from_msec(100);
+
+	/* Peers' commit timers within 5msec share a database commit. */
+	config->timer_slack = time_from_msec(5);
 
 	/* Discourage dust payments */
 	config->fee_base = 546000;
@@ -217,61 +399,448 @@ static void default_config(struct config *config)
 
 	/* Discover new peers using IRC */
 	config->use_irc = true;
+
+	/* Stop searching as soon as we reach the destination. */
+	config->route_engine = ROUTE_ENGINE_DIJKSTRA;
+	config->chain_source = &bitcoind_chain_source;
+
+	/* Losing a few minutes of gossip on a crash is fine. */
+	config->route_snapshot_time = time_from_sec(5 * 60);
+	config->route_snapshot_follow = NULL;
+
+	/* One fsync per peer update, as simple as it gets. */
+	config->db_group_commit = false;
+	config->db_async = false;
+
+	/* sqlite's defaults: safe even against power loss. */
+	config->db_wal = false;
+	config->db_synchronous = DB_SYNC_FULL;
+	config->db_wal_checkpoint = 1000;
+	/* A few hundred KB a minute keeps up with any churn, cheaply. */
+	config->db_vacuum_pages = 100;
+	config->db_replicate = NULL;
+
+	/* Batches are rare enough that threads aren't worth it by default. */
+	config->sig_threads = 0;
+
+	/* Enough to get going quickly after restart, without a stampede. */
+	config->max_reconnects = 8;
+
+	/* Well beyond normal use, but short of the protocol's 300 HTLCs. */
+	config->peer_queue_max = 1024 * 1024;
+	config->peer_htlc_max = 200;
+
+	/* Each HTLC costs every commit a signature and an output: well
+	 * short of the protocol's 300 before a few peers make every commit
+	 * slow.  The rest only if asked. */
+	config->htlc_max_inflight = 120;
+	config->htlc_max_inflight_msat = 0;
+	config->htlc_min_msat = 0;
+	config->commit_latency_target = time_from_sec(0);
+
+	/* Invoices used to last for ever: keep that unless asked. */
+	config->invoice_expiry = 0;
+	config->invoice_paid_keep = 0;
+
+	config->memory_sample_time = time_from_sec(60);
+	/* A backtrace per allocation is too slow to do unless asked. */
+	config->alloc_profile = false;
+
+	/* It spends our money on fees: only if asked. */
+	config->rebalance_time = time_from_sec(0);
+
+	/* Long enough that only peers which are really gone sleep. */
+	config->dormant_time = time_from_sec(60 * 60);
+
+	/* The kernel would take many minutes to give up on a dead peer,
+	 * and HTLCs through it would hang all that time. */
+	config->peer_ping_time = time_from_sec(15);
+	config->peer_dead_time = time_from_sec(45);
+
+	/* Only monitors which know to look want the file. */
+	config->status_page_time = time_from_sec(0);
 }
 
-static void check_config(struct lightningd_state *dstate)
+/* Returns NULL, or what's wrong with it. */
+static char *config_problem(const tal_t *ctx, const struct config *config)
 {
 	/* We do this by ensuring it's less than the minimum we would accept. */
-	if (dstate->config.commitment_fee_max_percent
-	    < dstate->config.commitment_fee_min_percent)
-		fatal("Commitment fee invalid min-max %u-%u",
-		      dstate->config.commitment_fee_min_percent,
-		      dstate->config.commitment_fee_max_percent);
+	if (config->commitment_fee_max_percent
+	    < config->commitment_fee_min_percent)
+		return tal_fmt(ctx, "Commitment fee invalid min-max %u-%u",
+			       config->commitment_fee_min_percent,
+			       config->commitment_fee_max_percent);
 
-	if (dstate->config.forever_confirms < 100)
-		log_unusual(dstate->base_log,
-			    "Warning: forever-confirms of %u is less than 100!",
-			    dstate->config.forever_confirms);
+	if (config->bitcoind_concurrency == 0)
+		return tal_fmt(ctx, "bitcoind-concurrency must be at least 1");
+
+	if (time_to_nsec(config->peer_ping_time)
+	    && time_less(config->peer_dead_time, config->peer_ping_time))
+		return tal_fmt(ctx, "peer-dead-time can't be less than"
+			       " peer-ping-time");
 
 	/* BOLT #2:
 	 *
 	 * a node MUST estimate the deadline for successful redemption
 	 * for each HTLC it offers.  A node MUST NOT offer a HTLC
 	 * after this deadline */
-	if (dstate->config.deadline_blocks >= dstate->config.min_htlc_expiry)
-		fatal("Deadline %u can't be more than minimum expiry %u",
-		      dstate->config.deadline_blocks,
-		      dstate->config.min_htlc_expiry);
+	if (config->deadline_blocks >= config->min_htlc_expiry)
+		return tal_fmt(ctx, "Deadline %u can't be more than minimum expiry %u",
+			       config->deadline_blocks,
+			       config->min_htlc_expiry);
+	return NULL;
+}
+
+static void check_config(struct lightningd_state *dstate)
+{
+	char *problem = config_problem(dstate, &dstate->config);
+
+	if (problem)
+		fatal("%s", problem);
+
+	if (dstate->config.forever_confirms < 100)
+		log_unusual(dstate->base_log,
+			    "Warning: forever-confirms of %u is less than 100!",
+			    dstate->config.forever_confirms);
+}
+
+/* Everything reads these afresh each time, so they can change under us. */
+static const char *reloadable_opts[] = {
+	"log-level",
+	"commit-fee-min", "commit-fee-max", "commit-fee",
+	"default-fee-rate", "fee-refresh", "fee-change-percent",
+	"min-htlc-expiry", "max-htlc-expiry", "deadline-blocks",
+	"bitcoind-poll", "commit-time", "commit-adaptive", "timer-slack",
+	"fee-base", "fee-per-satoshi",
+	"max-reconnects", "peer-queue-max", "peer-htlc-max",
+	"htlc-max-inflight", "htlc-max-inflight-msat", "htlc-min-msat",
+	"commit-latency-target",
+	"invoice-expiry", "invoice-paid-keep"
+};
+
+static bool reloadable(const char *arg)
+{
+	size_t i, len;
+
+	if (!strstarts(arg, "--"))
+		return false;
+	len = strcspn(arg + 2, "=");
+	for (i = 0; i < ARRAY_SIZE(reloadable_opts); i++)
+		if (strlen(reloadable_opts[i]) == len
+		    && strncmp(arg + 2, reloadable_opts[i], len) == 0)
+			return true;
+	return false;
+}
+
+static void add_reloadable(char ***argv, char **args)
+{
+	size_t i, n = tal_count(*argv) - 1;
+
+	for (i = 1; args[i]; i++) {
+		if (!reloadable(args[i]))
+			continue;
+		tal_resize(argv, n + 2);
+		(*argv)[n++] = args[i];
+		(*argv)[n] = NULL;
+	}
+}
+
+/* opt_parse's errlog doesn't give us a context. */
+static char *reload_err;
+
+static void reload_errlog(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	if (!reload_err)
+		reload_err = tal_vfmt(NULL, fmt, ap);
+	va_end(ap);
+}
+
+/* The config file, then the command line, as at startup, but only the
+ * options in reloadable_opts; the rest need a restart.  Options which are no
+ * longer given keep their current value. */
+static char *reload_config(const tal_t *ctx, struct lightningd_state *dstate)
+{
+	struct config old = dstate->config;
+	enum log_level old_level = get_log_level(dstate->log_record);
+	char **file, **argv = tal_arrz(ctx, char *, 2);
+	char *problem = NULL;
+	int argc;
+
+	argv[0] = "lightningd reload";
+	if (!config_file_args(argv, &file)) {
+		problem = tal_fmt(ctx, "Opening and reading config: %s",
+				  strerror(errno));
+		goto out;
+	}
+	if (file)
+		add_reloadable(&argv, file);
+	add_reloadable(&argv, dstate->cmdline);
+
+	argc = tal_count(argv) - 1;
+	reload_err = tal_free(reload_err);
+	if (!opt_parse(&argc, argv, reload_errlog))
+		problem = tal_strdup(ctx, reload_err);
+	else
+		problem = config_problem(ctx, &dstate->config);
+
+	if (problem) {
+		dstate->config = old;
+		set_log_level(dstate->log_record, old_level);
+	} else
+		log_info(dstate->base_log, "Reloaded config");
+
+out:
+	tal_free(argv);
+	return problem;
+}
+
+static void json_reload(struct command *cmd,
+			const char *buffer, const jsmntok_t *params)
+{
+	char *problem = reload_config(cmd, cmd->dstate);
+
+	if (problem)
+		command_fail(cmd, "%s", problem);
+	else
+		command_success(cmd, null_response(cmd));
+}
+
+const struct json_command reload_command = {
+	"reload",
+	json_reload,
+	"Re-read the config file",
+	"Applies changed fee, timing, limit and log-level options; others need a restart"
+};
+
+/* SIGHUP does the same as the reload command: the handler just wakes us. */
+static int sighup_fds[2];
+
+static void sighup_handler(int signum)
+{
+	/* If the pipe's full, we'll reload anyway. */
+	if (write(sighup_fds[1], "", 1) != 1)
+		errno = 0;
 }
 
-static struct lightningd_state *lightningd_state(void)
+struct sighup {
+	struct lightningd_state *dstate;
+	char buf[16];
+	size_t len;
+};
+
+static struct io_plan *sighup_reload(struct io_conn *conn, struct sighup *s)
 {
-	struct lightningd_state *dstate = tal(NULL, struct lightningd_state);
+	char *problem;
 
-	dstate->log_record = new_log_record(dstate, 20*1024*1024, LOG_INFORM);
-	dstate->base_log = new_log(dstate, dstate->log_record,
-				   "lightningd(%u):", (int)getpid());
+	if (s->len) {
+		problem = reload_config(s, s->dstate);
+		if (problem)
+			log_unusual(s->dstate->base_log, "SIGHUP reload: %s",
+				    problem);
+		tal_free(problem);
+	}
+	return io_read_partial(conn, s->buf, sizeof(s->buf), &s->len,
+			       sighup_reload, s);
+}
+
+static void sighup_init(struct lightningd_state *dstate)
+{
+	struct sighup *s;
+
+	if (pipe(sighup_fds) != 0) {
+		log_unusual(dstate->base_log, "No SIGHUP reload: pipe: %s",
+			    strerror(errno));
+		return;
+	}
+	fcntl(sighup_fds[1], F_SETFL,
+	      fcntl(sighup_fds[1], F_GETFL) | O_NONBLOCK);
+
+	s = tal(dstate, struct sighup);
+	s->dstate = dstate;
+	s->len = 0;
+	io_new_conn(dstate, sighup_fds[0], sighup_reload, s);
+	signal(SIGHUP, sighup_handler);
+}
+
+struct timeabs startup_phase(struct lightningd_state *dstate, const char *name,
+			     struct timeabs start, size_t count)
+{
+	struct timeabs now = time_now();
+	size_t n = tal_count(dstate->startup);
+
+	tal_resize(&dstate->startup, n + 1);
+	dstate->startup[n].name = name;
+	dstate->startup[n].time = time_between(now, start);
+	dstate->startup[n].count = count;
+	log_debug(dstate->base_log, "Startup %s: %"PRIu64" msec, %zu",
+		  name, time_to_msec(dstate->startup[n].time), count);
+	return now;
+}
+
+static size_t num_peers(const struct lightningd_state *dstate)
+{
+	const struct peer *peer;
+	size_t n = 0;
+
+	list_for_each(&dstate->peers, peer, list)
+		n++;
+	return n;
+}
+
+static void log_startup(struct lightningd_state *dstate, struct timeabs begin)
+{
+	const struct startup_phase *slowest = NULL;
+	size_t i;
+
+	for (i = 0; i < tal_count(dstate->startup); i++)
+		if (!slowest
+		    || time_greater(dstate->startup[i].time, slowest->time))
+			slowest = &dstate->startup[i];
+
+	log_info(dstate->base_log, "Startup took %"PRIu64" msec%s%s%s",
+		 time_to_msec(time_between(time_now(), begin)),
+		 slowest ? " (slowest: " : "",
+		 slowest ? slowest->name : "",
+		 slowest ? ")" : "");
+}
+
+/* A tenant's log is for its own peers: it needn't be as big. */
+#define TENANT_LOG_MEM (1024*1024)
+
+char *node_file(const tal_t *ctx, const struct lightningd_state *dstate,
+		const char *name)
+{
+	if (dstate->host == dstate)
+		return tal_strdup(ctx, name);
+	return tal_fmt(ctx, "%s/%s", dstate->config_dir, name);
+}
+
+/* @host is NULL, unless this is to be one of its tenants. */
+static struct lightningd_state *lightningd_state(struct lightningd_state *host,
+						 const char *dir)
+{
+	struct lightningd_state *dstate = tal(host, struct lightningd_state);
+	size_t i;
+
+	if (host) {
+		dstate->host = host;
+		dstate->log_record = new_log_record(dstate, TENANT_LOG_MEM,
+						    LOG_INFORM);
+		dstate->base_log = new_log(dstate, dstate->log_record,
+					   "lightningd(%u):%s:",
+					   (int)getpid(), dir);
+	} else {
+		dstate->host = dstate;
+		dstate->log_record = new_log_record(dstate, 20*1024*1024,
+						    LOG_INFORM);
+		dstate->base_log = new_log(dstate, dstate->log_record,
+					   "lightningd(%u):", (int)getpid());
+	}
+	list_head_init(&dstate->tenants);
 
 	list_head_init(&dstate->peers);
-	list_head_init(&dstate->pay_commands);
+	dstate->peers_by_id = tal(dstate, struct peer_map);
+	peer_map_init(dstate->peers_by_id);
+	dstate->peers_by_der = tal(dstate, struct peer_der_map);
+	peer_der_map_init(dstate->peers_by_der);
+	if (host)
+		dstate->outgoing_txs = host->outgoing_txs;
+	else {
+		dstate->outgoing_txs = tal(dstate, struct outgoing_tx_map);
+		outgoing_tx_map_init(dstate->outgoing_txs);
+	}
+	memset(&dstate->forward_stats, 0, sizeof(dstate->forward_stats));
+	list_head_init(&dstate->reconnect_queue);
+	dstate->reconnects_inflight = 0;
+	pay_init(dstate);
 	dstate->portnum = 0;
 	timers_init(&dstate->timers, controlled_time());
 	txwatch_hash_init(&dstate->txwatches);
+	txwatch_height_map_init(&dstate->txwatch_heights);
 	txowatch_hash_init(&dstate->txowatches);
+	watch_filter_init(&dstate->txwatch_filter);
+	watch_filter_init(&dstate->txowatch_filter);
 	dstate->secpctx = secp256k1_context_create(SECP256K1_CONTEXT_VERIFY
 						   | SECP256K1_CONTEXT_SIGN);
 	default_config(&dstate->config);
-	list_head_init(&dstate->bitcoin_req);
-	list_head_init(&dstate->wallet);
+	for (i = 0; i < BITCOIND_NUM_PRIOS; i++)
+		list_head_init(&dstate->bitcoin_req[i]);
+	wallet_init(dstate);
 	list_head_init(&dstate->unpaid);
 	list_head_init(&dstate->paid);
+	dstate->invoices_by_rhash = tal(dstate, struct invoice_rhash_map);
+	invoice_rhash_map_init(dstate->invoices_by_rhash);
+	dstate->invoices_by_label = tal(dstate, struct invoice_label_map);
+	invoice_label_map_init(dstate->invoices_by_label);
+	dstate->htlcs_by_rhash = tal(dstate, struct htlc_rhash_map);
+	htlc_rhash_map_init(dstate->htlcs_by_rhash);
 	dstate->invoices_completed = 0;
 	list_head_init(&dstate->invoice_waiters);
+	list_head_init(&dstate->subscriptions);
 	list_head_init(&dstate->addresses);
+	list_head_init(&dstate->anchor_watches);
 	dstate->dev_never_routefail = false;
-	dstate->bitcoin_req_running = false;
-	dstate->nodes = empty_node_map(dstate);
+	dstate->dev_link_latency = time_from_sec(0);
+	dstate->dev_link_loss_percent = 0;
+	dstate->bitcoin_req_running = 0;
+	dstate->bitcoind_rpc = NULL;
+	dstate->topology = NULL;
+	dstate->rstate = host ? host->rstate : new_routing_state(dstate);
 	dstate->reexec = NULL;
+	dstate->startup = tal_arr(dstate, struct startup_phase, 0);
+	stats_init(dstate);
+	dstate->listen_fds = tal_arr(dstate, int, 0);
+	dstate->dns = NULL;
+	dstate->jobs = NULL;
+	dstate->sweeper = NULL;
+	dstate->mempool = NULL;
+	dstate->onion_cache = NULL;
+	dstate->rebalancer = NULL;
+	return dstate;
+}
+
+/* Another node in this process, with its own keys, database, JSON-RPC
+ * socket and peers, in the directory @arg names (relative to ours).  It
+ * takes our options. */
+static struct lightningd_state *new_tenant(struct lightningd_state *host,
+					   const char *arg)
+{
+	const char *colon = strrchr(arg, ':');
+	struct lightningd_state *dstate;
+	char *dir;
+
+	/* DIR:PORT, or just DIR (a dynamic port, as without --port). */
+	if (colon && colon[1] && strspn(colon + 1, "0123456789")
+	    == strlen(colon + 1))
+		dir = tal_strndup(host, arg, colon - arg);
+	else {
+		dir = tal_strdup(host, arg);
+		colon = NULL;
+	}
+
+	dstate = lightningd_state(host, dir);
+	tal_steal(dstate, dir);
+	dstate->config_dir = dir;
+	dstate->rpc_filename = node_file(dstate, dstate, "lightning-rpc");
+	dstate->portnum = colon ? atoi(colon + 1) : 0;
+	dstate->cmdline = host->cmdline;
+	dstate->config = host->config;
+	/* Each numbers its own stream from 0: they can't share a file. */
+	if (host->config.db_replicate)
+		dstate->config.db_replicate
+			= node_file(dstate, dstate,
+				    path_basename(dstate,
+						  host->config.db_replicate));
+	set_log_level(dstate->log_record, get_log_level(host->log_record));
+
+	if (mkdir(dir, 0700) != 0 && errno != EEXIST)
+		fatal("Could not make tenant directory %s: %s",
+		      dir, strerror(errno));
+	list_add_tail(&host->tenants, &dstate->tenant_list);
+	log_info(host->base_log, "Tenant in %s", dir);
 	return dstate;
 }
 
@@ -296,15 +865,30 @@ static void tal_freefn(void *ptr)
 
 int main(int argc, char *argv[])
 {
-	struct lightningd_state *dstate = lightningd_state();
+	struct lightningd_state *dstate, *node;
 	unsigned int portnum = 0;
+	struct timeabs begin, start;
+	char **tenants;
+	size_t i;
+
+	memory_track();
+	dstate = lightningd_state(NULL, NULL);
+	tenants = tal_arr(dstate, char *, 0);
 
 	err_set_progname(argv[0]);
 	opt_set_alloc(opt_allocfn, tal_reallocfn, tal_freefn);
 
+	/* opt_parse eats argv, and reload wants it again. */
+	dstate->cmdline = tal_dup_arr(dstate, char *, argv, argc + 1, 0);
+
 	if (!streq(protobuf_c_version(), PROTOBUF_C_VERSION))
 		errx(1, "Compiled against protobuf %s, but have %s",
 		     PROTOBUF_C_VERSION, protobuf_c_version());
+
+	/* This also picks libsodium's SIMD chacha20 and poly1305 for this
+	 * CPU: without it, every packet goes through the portable code. */
+	if (sodium_init() < 0)
+		errx(1, "Could not initialize libsodium");
 	
 	opt_register_noarg("--help|-h", opt_usage_and_exit,
 			   "\n"
@@ -312,9 +896,23 @@ int main(int argc, char *argv[])
 			   "Print this message.");
 	opt_register_arg("--port", opt_set_uintval, NULL, &portnum,
 			 "Port to bind to (otherwise, dynamic port is used)");
+	opt_register_arg("--tenant", opt_add_tenant, NULL, &tenants,
+			 "Also run the node in DIR[:PORT], sharing our chain, bitcoind and routes (repeatable)");
 	opt_register_arg("--bitcoin-datadir", opt_set_charp, NULL,
 			 &bitcoin_datadir,
 			 "-datadir arg for bitcoin-cli");
+	opt_register_arg("--bitcoin-rpcconnect", opt_set_charp, NULL,
+			 &bitcoin_rpcconnect,
+			 "Talk to bitcoind RPC at host[:port], not bitcoin-cli");
+	opt_register_arg("--bitcoin-rpcuser", opt_set_charp, NULL,
+			 &bitcoin_rpcuser,
+			 "bitcoind RPC username (default: from bitcoin.conf)");
+	opt_register_arg("--bitcoin-rpcpassword", opt_set_charp, NULL,
+			 &bitcoin_rpcpassword,
+			 "bitcoind RPC password (default: from bitcoin.conf)");
+	opt_register_arg("--bitcoin-zmqpubhashblock", opt_set_charp, NULL,
+			 &bitcoin_zmqpubhashblock,
+			 "Hear of new blocks from bitcoind at tcp://host:port");
 	opt_register_logging(dstate->base_log);
 	opt_register_version();
 
@@ -349,28 +947,74 @@ int main(int argc, char *argv[])
 		errx(1, "no arguments accepted");
 
 	check_config(dstate);
+
+	/* Everything after this is done for each of them too. */
+	for (i = 0; i < tal_count(tenants); i++)
+		new_tenant(dstate, tenants[i]);
+	tenants = tal_free(tenants);
 	
-	check_bitcoind_config(dstate);
+	begin = start = time_now();
+	dstate->config.chain_source->init(dstate);
+	start = startup_phase(dstate, "chain_source", start, 0);
 
 	/* Set up node ID and private key. */
-	secrets_init(dstate);
-	new_node(dstate, &dstate->id);
+	for (node = dstate; node; node = next_node(dstate, node)) {
+		secrets_init(node);
+		new_node(node, &node->id);
+	}
+	start = startup_phase(dstate, "secrets_init", start, 0);
 
-	/* Read or create database. */
-	db_init(dstate);
+	/* Read or create database (db_load records its own phases).  The
+	 * tenants' too, so the topology knows how far back to start. */
+	for (node = dstate; node; node = next_node(dstate, node))
+		db_init(node);
+	start = startup_phase(dstate, "db_init", start, num_peers(dstate));
+
+	/* One pool of signing threads is plenty. */
+	sigpool_init(dstate);
+	for (node = dstate; node; node = next_node(dstate, node)) {
+		node->sigpool = dstate->sigpool;
+		sessionkeys_init(node);
+		invoices_init(node);
+	}
+	start = startup_phase(dstate, "sigpool_init", start,
+			      dstate->config.sig_threads);
 
-	/* Initialize block topology. */
+	/* Initialize block topology (it fetches the blocks later). */
 	setup_topology(dstate);
+	blocknotify_init(dstate);
+	start = startup_phase(dstate, "setup_topology", start, 0);
 
 	/* Create RPC socket (if any) */
-	setup_jsonrpc(dstate, dstate->rpc_filename);
+	for (node = dstate; node; node = next_node(dstate, node))
+		setup_jsonrpc(node, node->rpc_filename);
+	sighup_init(dstate);
+	start = startup_phase(dstate, "setup_jsonrpc", start, 0);
 
 	/* Set up connections from peers. */
 	setup_listeners(dstate, portnum);
+	for (node = next_node(dstate, dstate); node;
+	     node = next_node(dstate, node))
+		setup_listeners(node, node->portnum);
+	start = startup_phase(dstate, "setup_listeners", start,
+			      tal_count(dstate->listen_fds));
 
-	/* set up IRC peer discovery */
-	if (dstate->config.use_irc)
-		setup_irc_connection(dstate);
+	/* Routes from last time, so we can pay before IRC catches up. */
+	routing_snapshot_init(dstate);
+	start = startup_phase(dstate, "routing_snapshot_init", start, 0);
+
+	memory_init(dstate);
+	for (node = dstate; node; node = next_node(dstate, node)) {
+		node->memory = dstate->memory;
+		rebalance_init(node);
+		peer_dormancy_init(node);
+		peer_liveness_init(node);
+		status_page_init(node);
+
+		/* set up IRC peer discovery */
+		if (node->config.use_irc)
+			setup_irc_connection(node);
+	}
 
 	/* Make sure we use the artificially-controlled time for timers */
 	io_time_override(controlled_time);
@@ -378,8 +1022,15 @@ int main(int argc, char *argv[])
 	log_info(dstate->base_log, "Hello world!");
 
 	/* If we loaded peers from database, reconnect now. */
-	reconnect_peers(dstate);
-	
+	start = time_now();
+	for (node = dstate; node; node = next_node(dstate, node))
+		reconnect_peers(node);
+	startup_phase(dstate, "reconnect_peers", start, num_peers(dstate));
+	log_startup(dstate, begin);
+
+	/* FIXME: One loop, one thread: ccan/io and tal aren't thread-safe,
+	 * and forwarding touches both peers' state directly.  Slow work goes
+	 * elsewhere instead (db writer, sigpool, dns, route search child). */
 	for (;;) {
 		struct timer *expired;
 		void *v = io_loop(&dstate->timers, &expired);
@@ -390,21 +1041,46 @@ int main(int argc, char *argv[])
 
 		if (expired)
 			timer_expired(dstate, expired);
-		else
-			cleanup_peers(dstate);
+		else {
+			for (node = dstate; node;
+			     node = next_node(dstate, node))
+				cleanup_peers(node);
+		}
 	}
 
+	for (node = dstate; node; node = next_node(dstate, node))
+		db_commit_group(node);
+
+	if (time_to_nsec(dstate->config.route_snapshot_time))
+		save_routing_snapshot(dstate);
+
 	if (dstate->reexec) {
 		int fd;
+		size_t i;
 		char *mocktimearg;
 
 		log_unusual(dstate->base_log, "Restart at user request");
+		log_flush(dstate->log_record);
 		fflush(stdout);
 		fflush(stderr);
 
-		/* Manually close all fds (or near enough!) */
-		for (fd = 3; fd < 1024; fd++)
-			close(fd);
+		/* Manually close all fds (or near enough!), except the
+		 * listeners: connections queue on those meanwhile, rather
+		 * than being refused. */
+		for (fd = 3; fd < 1024; fd++) {
+			for (i = 0; i < tal_count(dstate->listen_fds); i++)
+				if (dstate->listen_fds[i] == fd)
+					break;
+			if (i == tal_count(dstate->listen_fds))
+				close(fd);
+		}
+		for (i = 0; i < tal_count(dstate->listen_fds); i++) {
+			size_t n = tal_count(dstate->reexec);
+			tal_resizez(&dstate->reexec, n+1);
+			dstate->reexec[n-1]
+				= tal_fmt(dstate->reexec, "--dev-listen-fd=%i",
+					  dstate->listen_fds[i]);
+		}
 
 		/* Maybe append mocktime arg. */
 		mocktimearg = controlled_time_arg(dstate->reexec);
@@ -423,6 +1099,7 @@ int main(int argc, char *argv[])
 		      dstate->reexec[0], strerror(errno));
 	}
 
+	log_flush(dstate->log_record);
 	tal_free(dstate);
 	opt_free_table();
 	return 0;
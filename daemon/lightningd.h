@@ -2,13 +2,25 @@
 #define LIGHTNING_DAEMON_LIGHTNING_H
 #include "config.h"
 #include "bitcoin/pubkey.h"
+#include "bitcoind.h"
+#include "routing.h"
 #include "watch.h"
 #include <ccan/list/list.h>
 #include <ccan/short_types/short_types.h>
+#include <ccan/tal/tal.h>
+#include <ccan/time/time.h>
 #include <ccan/timer/timer.h>
 #include <secp256k1.h>
 #include <stdio.h>
 
+/* How much sqlite fsyncs (PRAGMA synchronous), weakest first. */
+enum db_synchronous {
+	DB_SYNC_OFF,
+	DB_SYNC_NORMAL,
+	DB_SYNC_FULL,
+	DB_SYNC_EXTRA
+};
+
 /* Various adjustable things. */
 struct config {
 	/* Are we on testnet? */
@@ -41,6 +53,12 @@ struct config {
 	/* What fee we use if estimatefee fails (satoshis/kb) */
 	u64 default_fee_rate;
 
+	/* How long a fee estimate is good for. */
+	struct timerel fee_refresh_time;
+
+	/* How far (percent) an estimate must move before we use it. */
+	u32 fee_change_percent;
+
 	/* Minimum/maximum time for an expiring HTLC (blocks). */
 	u32 min_htlc_expiry, max_htlc_expiry;
 
@@ -54,11 +72,117 @@ struct config {
 	/* How long between polling bitcoind. */
 	struct timerel poll_time;
 
+	/* Most requests we have bitcoind working on at once. */
+	u32 bitcoind_concurrency;
+
+	/* Look for spends of watched outputs in bitcoind's mempool too? */
+	bool watch_mempool;
+
 	/* How long between changing commit and sending COMMIT message. */
 	struct timerel commit_time;
 
+	/* Wait only as long as recent load suggests, up to commit_time? */
+	bool commit_adaptive;
+
+	/* Log any callback which holds up the loop this long (0 for never). */
+	struct timerel stall_warn;
+
+	/* Timers may go off this much late, so nearby ones go off together
+	 * (0 for exact). */
+	struct timerel timer_slack;
+
 	/* Whether to enable IRC peer discovery. */
 	bool use_irc;
+
+	/* Which algorithm find_route uses. */
+	enum route_engine route_engine;
+
+	/* Where we learn about the blockchain. */
+	const struct chain_source *chain_source;
+
+	/* How often to save the routing graph (0 for never). */
+	struct timerel route_snapshot_time;
+
+	/* Another node's routing snapshot to keep loading (NULL for none). */
+	char *route_snapshot_follow;
+
+	/* Commit all peers' database updates together each loop iteration? */
+	bool db_group_commit;
+
+	/* Hand those to a writer thread instead of waiting for them?  Then
+	 * a failed database write is fatal, as we've moved on. */
+	bool db_async;
+
+	/* Write-ahead log instead of a rollback journal?  The WAL needs one
+	 * fsync per commit rather than several, and readers don't block. */
+	bool db_wal;
+
+	/* FULL (the default) means a commit survives power loss.  With a
+	 * WAL, NORMAL only loses the last commits on power loss or an OS
+	 * crash, never on our crash, and doesn't corrupt anything: but
+	 * we'll have told the peer about them, so we may then broadcast a
+	 * revoked commitment and lose funds.  OFF can corrupt the database
+	 * on power loss.  Anything below FULL is for benchmarking. */
+	enum db_synchronous db_synchronous;
+
+	/* WAL pages before we copy back into the database (0 for only when we
+	 * close it, so the WAL grows without bound). */
+	u32 db_wal_checkpoint;
+
+	/* Free pages to give back to the filesystem each idle minute (0 for
+	 * never). */
+	u32 db_vacuum_pages;
+
+	/* File (or fifo) to append each iteration's database changes to, for
+	 * a standby to apply (NULL for none). */
+	char *db_replicate;
+
+	/* Threads to share out batches of signatures (0 for none). */
+	u32 sig_threads;
+
+	/* Outgoing reconnects to attempt at once (0 for no limit). */
+	u32 max_reconnects;
+
+	/* Stop routing through a peer with this much queued for it, or
+	 * this many HTLCs offered to it, until it's halfway back. */
+	u64 peer_queue_max;
+	u32 peer_htlc_max;
+
+	/* Admission control, for each side of a channel: HTLCs in flight
+	 * (0 for the protocol's 300), and their total (0 for no limit). */
+	u32 htlc_max_inflight;
+	u64 htlc_max_inflight_msat;
+	/* Smaller HTLCs cost a commit as much as any other: refuse them. */
+	u64 htlc_min_msat;
+	/* Stop forwarding while commits average longer (0 for never). */
+	struct timerel commit_latency_target;
+
+	/* Default seconds an invoice can be paid for (0 for ever). */
+	u32 invoice_expiry;
+
+	/* Paid invoices to keep loaded; older ones are archived (0 for all).*/
+	u32 invoice_paid_keep;
+
+	/* How often to sample memory use, for getmemory (0 for never). */
+	struct timerel memory_sample_time;
+
+	/* Count allocations by backtrace, for getallocs. */
+	bool alloc_profile;
+
+	/* How often to try moving funds between our channels (0 for never). */
+	struct timerel rebalance_time;
+
+	/* How long a peer sits idle before going dormant (0 for never). */
+	struct timerel dormant_time;
+
+	/* How often to check a peer is still acking (0 for never). */
+	struct timerel peer_ping_time;
+
+	/* How long a peer can go without acking before we hang up. */
+	struct timerel peer_dead_time;
+
+	/* How often to rewrite the status page for monitors (0 for never). */
+	struct timerel status_page_time;
 };
 
 /* Here's where the global variables hide! */
@@ -68,12 +192,24 @@ struct lightningd_state {
 	struct log *base_log;
 	FILE *logf;
 
+	/* How we were started, for reload. */
+	char **cmdline;
+
 	/* Our config dir, and rpc file */
 	char *config_dir;
 	char *rpc_filename;
 
+	/* Whose chain topology, watches, bitcoind and routing graph we use:
+	 * ourselves, unless we're a --tenant. */
+	struct lightningd_state *host;
+	/* The host's tenants, via their tenant_list. */
+	struct list_head tenants;
+	struct list_node tenant_list;
+
 	/* Port we're listening on */
 	u16 portnum;
+	/* Sockets it's on: kept open across dev-restart. */
+	int *listen_fds;
 	
 	/* Configuration settings. */
 	struct config config;
@@ -81,7 +217,7 @@ struct lightningd_state {
 	/* The database where we keep our stuff. */
 	struct db *db;
 
-	/* Any pending timers. */
+	/* Any pending timers (tenants add theirs to the host's). */
 	struct timers timers;
 
 	/* Cached block topology. */
@@ -89,46 +225,145 @@ struct lightningd_state {
 	
 	/* Our peers. */
 	struct list_head peers;
+	/* The same, by id (once we know it). */
+	struct peer_map *peers_by_id;
+	struct peer_der_map *peers_by_der;
+	/* All their outgoing_txs, by txid. */
+	struct outgoing_tx_map *outgoing_txs;
+
+	/* Peers waiting for a reconnect slot, and how many are in use. */
+	struct list_head reconnect_queue;
+	u32 reconnects_inflight;
 
 	/* Addresses to contact peers. */
 	struct list_head addresses;
 
-	/* Any outstanding "pay" commands. */
-	struct list_head pay_commands;
+	/* Any outstanding "pay" commands, by rhash. */
+	struct pay_command_map *pay_commands;
+
+	/* Routes getroute found, for sendpay to use by id. */
+	struct route_handles *route_handles;
 	
 	/* Crypto tables for global use. */
 	secp256k1_context *secpctx;
 
+	/* Threads for signing, if any. */
+	struct sigpool *sigpool;
+
+	/* Threads for DNS lookups, and their cache (NULL until needed). */
+	struct dns_resolver *dns;
+
+	/* Worker threads for slow jobs (NULL until needed). */
+	struct job_pool *jobs;
+
+	/* Onchain outputs waiting to be spent (NULL until needed). */
+	struct sweeper *sweeper;
+
+	/* Mempool txs we've looked at, for --watch-mempool (NULL until
+	 * needed). */
+	struct mempool *mempool;
+
+	/* Shared secrets of onions we've unwrapped (NULL until needed). */
+	struct onion_cache *onion_cache;
+
+	/* Anchor txs we're watching, each for one or more channels. */
+	struct list_head anchor_watches;
+
+	/* Ready-made session keys for handshakes. */
+	struct sessionkey_pool *sessionkeys;
+	/* Preimages ready for new invoices. */
+	struct preimage_pool *preimages;
+
+	/* Pays ourselves in circles, to keep our channels usable. */
+	struct rebalancer *rebalancer;
+
 	/* Our private key */
 	struct secret *secret;
 
 	/* This is us. */
 	struct pubkey id;
 
-	/* Transactions/txos we are watching. */
+	/* Transactions/txos we (and our tenants) are watching. */
 	struct txwatch_hash txwatches;
 	struct txowatch_hash txowatches;
+	/* Quick "no" for each of those. */
+	struct watch_filter txwatch_filter, txowatch_filter;
+	/* Confirmed txwatches, by tip height they next care about. */
+	struct txwatch_height_map txwatch_heights;
 
-	/* Outstanding bitcoind requests. */
-	struct list_head bitcoin_req;
-	bool bitcoin_req_running;
+	/* Outstanding bitcoind requests (tenants' too), by priority. */
+	struct list_head bitcoin_req[BITCOIND_NUM_PRIOS];
+	/* How many have been sent to bitcoind. */
+	u32 bitcoin_req_running;
+	/* Non-NULL if we're talking to bitcoind over RPC, not bitcoin-cli. */
+	struct bitcoind_rpc *bitcoind_rpc;
 
-	/* Wallet addresses we maintain. */
-	struct list_head wallet;
+	/* Wallet addresses we maintain, and their outputs. */
+	struct wallet_state *wallet;
 
 	/* Payments for r values we know about. */
 	struct list_head paid, unpaid;
+	/* The same invoices, so we don't have to search those. */
+	struct invoice_rhash_map *invoices_by_rhash;
+	struct invoice_label_map *invoices_by_label;
+	/* Every peer's HTLCs, by rhash, for when we learn a preimage. */
+	struct htlc_rhash_map *htlcs_by_rhash;
 	u64 invoices_completed;
 	/* Waiting for new invoices to be paid. */
 	struct list_head invoice_waiters;
+
+	/* JSON-RPC connections waiting for events. */
+	struct list_head subscriptions;
 	
-	/* All known nodes. */
-	struct node_map *nodes;
+	/* All known nodes and connections between them. */
+	struct routing_state *rstate;
+
+	/* HTLCs we've passed on (or refused to), and how long passing on
+	 * took from when they were offered to us. */
+	struct {
+		u64 forwarded, failed;
+		struct timerel total, max;
+	} forward_stats;
+
+	/* Counters and latencies (see getstats). */
+	struct stats *stats;
+
+	/* Samples of memory use (see getmemory). */
+	struct memory *memory;
+
+	/* Where startup went (see getinfo). */
+	struct startup_phase {
+		const char *name;
+		struct timerel time;
+		size_t count;
+	} *startup;
 
 	/* For testing: don't fail if we can't route. */
 	bool dev_never_routefail;
 
+	/* For testing: every link this slow, and dropping this often. */
+	struct timerel dev_link_latency;
+	u32 dev_link_loss_percent;
+
 	/* Re-exec hack for testing. */
 	char **reexec;
 };
+/* Records (and logs) time since @start for startup phase @name, which
+ * handled @count things; returns now, for the next phase's start. */
+struct timeabs startup_phase(struct lightningd_state *dstate, const char *name,
+			     struct timeabs start, size_t count);
+
+/* @name in our lightning dir: the host runs in its own, but not tenants. */
+char *node_file(const tal_t *ctx, const struct lightningd_state *dstate,
+		const char *name);
+
+/* The host, then each of its tenants, then NULL. */
+static inline struct lightningd_state *
+next_node(struct lightningd_state *host, struct lightningd_state *prev)
+{
+	if (prev == host)
+		return list_top(&host->tenants, struct lightningd_state,
+				tenant_list);
+	return list_next(&host->tenants, prev, tenant_list);
+}
 #endif /* LIGHTNING_DAEMON_LIGHTNING_H */
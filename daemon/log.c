@@ -1,6 +1,7 @@
 #include "bitcoin/locktime.h"
 #include "bitcoin/pubkey.h"
 #include "bitcoin/tx.h"
+#include "capture.h"
 #include "channel.h"
 #include "controlled_time.h"
 #include "htlc.h"
@@ -8,10 +9,8 @@
 #include "log.h"
 #include "peer.h"
 #include "protobuf_convert.h"
-#include "pseudorand.h"
 #include "utils.h"
 #include <ccan/array_size/array_size.h>
-#include <ccan/list/list.h>
 #include <ccan/opt/opt.h>
 #include <ccan/read_write_all/read_write_all.h>
 #include <ccan/str/hex/hex.h>
@@ -20,23 +19,82 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+/* Rough guess, to decide how many entries each level's bytes will hold. */
+#define LOG_AVG_ENTRY_BYTES 64
+
+#define LOG_NUM_LEVELS (LOG_BROKEN + 1)
+
+/* Blobs up to this size aren't hexed until someone reads them. */
+#define LOG_DEFER_BLOB_MAX 128
+
+/* Big enough for a deferred entry, once formatted. */
+#define LOG_DEFER_BUF 1024
+
+/* Entries which are just a format and the raw value for its %s. */
+enum log_deferred {
+	LOG_NOT_DEFERRED,
+	LOG_DEFER_PUBKEY,
+	LOG_DEFER_HEX
+};
+
 struct log_entry {
-	struct list_node list;
+	/* Counts across all levels, so we can merge them, and see gaps. */
+	u64 seq;
 	struct timeabs time;
-	enum log_level level;
-	unsigned int skipped;
 	const char *prefix;
-	char *log;
+	/* Whose it is, for --log-mmap readers (which can't use prefix). */
+	u32 log_id;
+	/* Where it is in the ring's bytes: for LOG_IO the first is the
+	 * direction, otherwise it's nul-terminated.  If deferred, it's
+	 * the nul-terminated format, then the raw value. */
+	size_t off, len;
+	enum log_deferred deferred;
+};
+
+/* One per level, so a flood of debug can't push out what's rarer. */
+struct log_ring {
+	/* Fixed size: entries[first] is the oldest of num. */
+	struct log_entry *entries;
+	size_t max_entries, first, num;
+	/* Fixed size: messages are never split, so [end] onwards may be
+	 * wasted until we wrap. */
+	char *bytes;
+	size_t size, end, bytes_used;
+};
+
+/* --log-mmap: the rings live in a file, so they outlive us however we die.
+ * It's this header, then each level's entries and bytes. */
+#define LOG_MMAP_MAGIC "LNLOGMAP"
+#define LOG_MMAP_VERSION 1
+#define LOG_MMAP_NAMES 256
+#define LOG_MMAP_NAME_LEN 64
+
+struct log_mmap_name {
+	/* Log id + 1 (0 is unused): a later log may take the slot. */
+	u32 id;
+	char name[LOG_MMAP_NAME_LEN];
+};
+
+struct log_mmap_hdr {
+	char magic[8];
+	u32 version;
+	/* Only this build's layout will do. */
+	u32 hdr_size, entry_size;
+	struct timeabs init_time;
+	/* Pointers in here are only good while we're running. */
+	struct log_ring ring[LOG_NUM_LEVELS];
+	struct log_mmap_name names[LOG_MMAP_NAMES];
 };
 
 struct log_record {
-	size_t mem_used;
 	size_t max_mem;
 	struct lightningd_state *dstate;
 	void (*print)(const char *prefix,
@@ -47,12 +105,32 @@ struct log_record {
 	enum log_level print_level;
 	struct timeabs init_time;
 
-	struct list_head log;
+	/* Our own, or in the --log-mmap file. */
+	struct log_ring *ring;
+	/* With --log-mmap, who each entry's log_id is. */
+	struct log_mmap_name *mmap_names;
+	u64 seq;
+	/* Where the last entry went, for log_add. */
+	enum log_level last_level;
+	/* Last entry was compiled out (see LOG_MIN_LEVEL). */
+	bool last_elided;
+	/* In a forked child: the rings and writer are our parent's. */
+	bool suspended;
+
+	/* For --log-file. */
+	struct log_writer *writer;
+
+	/* For --log-capture. */
+	struct capture *capture;
+	u32 next_id;
 };
 
 struct log {
 	struct log_record *lr;
 	const char *prefix;
+	/* Identifies us in --log-capture, once we've written our name. */
+	u32 id;
+	bool captured;
 };
 
 static void log_default_print(const char *prefix,
@@ -67,39 +145,143 @@ static void log_default_print(const char *prefix,
 	}
 }
 
-static size_t log_bufsize(const struct log_entry *e)
+static struct log_entry *ring_entry(const struct log_ring *ring, size_t i)
 {
-	if (e->level == LOG_IO)
-		return tal_count(e->log);
-	else
-		return strlen(e->log) + 1;
+	return &ring->entries[(ring->first + i) % ring->max_entries];
+}
+
+static void drop_oldest(struct log_ring *ring)
+{
+	ring->bytes_used -= ring_entry(ring, 0)->len;
+	ring->first = (ring->first + 1) % ring->max_entries;
+	ring->num--;
 }
 
-static size_t prune_log(struct log_record *log)
+/* Make room for len bytes (no more than the ring's bytes), dropping the
+ * oldest entries as needed: returns the new (newest) entry. */
+static struct log_entry *ring_add(struct log_ring *ring, size_t len)
 {
-	struct log_entry *i, *next, *tail;
-	size_t skipped = 0, deleted = 0;
+	size_t size = ring->size, off;
+	struct log_entry *e;
 
-	/* Never delete the last one. */
-	tail = list_tail(&log->log, struct log_entry, list);
+	assert(len <= size);
+	if (ring->num == ring->max_entries)
+		drop_oldest(ring);
 
-	list_for_each_safe(&log->log, i, next, list) {
-		/* 50% chance of deleting debug, 25% inform, 12.5% unusual. */
-		if (i == tail || !pseudorand(2 << i->level)) {
-			i->skipped += skipped;
-			skipped = 0;
-			continue;
-		}
+	for (;;) {
+		size_t oldest;
 
-		list_del_from(&log->log, &i->list);
-		log->mem_used -= sizeof(*i) + log_bufsize(i);
-		tal_free(i);
-		skipped++;
-		deleted++;
+		if (!ring->num) {
+			off = 0;
+			break;
+		}
+		oldest = ring_entry(ring, 0)->off;
+		if (oldest < ring->end) {
+			/* Free space is after end, and before oldest. */
+			if (ring->end + len <= size) {
+				off = ring->end;
+				break;
+			}
+			if (len <= oldest) {
+				off = 0;
+				break;
+			}
+		} else if (ring->end + len <= oldest) {
+			/* We've wrapped: free space is between them. */
+			off = ring->end;
+			break;
+		}
+		drop_oldest(ring);
 	}
 
-	assert(!skipped);
-	return deleted;
+	e = ring_entry(ring, ring->num++);
+	e->off = off;
+	e->len = len;
+	ring->end = off + len;
+	ring->bytes_used += len;
+	return e;
+}
+
+/* So a reader can tell whose entries are whose. */
+static void mmap_name(const struct log *log)
+{
+	struct log_mmap_name *n
+		= &log->lr->mmap_names[log->id % LOG_MMAP_NAMES];
+
+	if (n->id == log->id + 1)
+		return;
+	strncpy(n->name, log->prefix, sizeof(n->name) - 1);
+	n->name[sizeof(n->name) - 1] = '\0';
+	n->id = log->id + 1;
+}
+
+/* Returns where to put the len bytes of the message. */
+static char *add_entry(struct log *log, enum log_level level, size_t len,
+		       u64 seq, struct timeabs time)
+{
+	struct log_ring *ring = &log->lr->ring[level];
+	struct log_entry *e = ring_add(ring, len);
+
+	e->seq = seq;
+	e->time = time;
+	e->prefix = log->prefix;
+	e->log_id = log->id;
+	e->deferred = LOG_NOT_DEFERRED;
+	if (log->lr->mmap_names)
+		mmap_name(log);
+	log->lr->last_level = level;
+	log->lr->last_elided = false;
+	return ring->bytes + e->off;
+}
+
+/* Plenty for any sane message: longer ones are truncated. */
+static size_t max_entry_len(const struct log_record *lr, enum log_level level)
+{
+	return lr->ring[level].size / 4;
+}
+
+/* Formats a deferred entry into buf: no allocation, for crashes. */
+static const char *undefer(const struct log_record *lr, enum log_level level,
+			   const struct log_entry *e, char buf[LOG_DEFER_BUF])
+{
+	const char *fmt = lr->ring[level].bytes + e->off, *raw;
+	char hex[hex_str_size(LOG_DEFER_BLOB_MAX)];
+	u8 der[PUBKEY_DER_LEN];
+
+	if (e->deferred == LOG_NOT_DEFERRED)
+		return fmt;
+
+	raw = fmt + strlen(fmt) + 1;
+	if (e->deferred == LOG_DEFER_PUBKEY) {
+		pubkey_to_der(lr->dstate->secpctx, der,
+			      (const struct pubkey *)raw);
+		hex_encode(der, sizeof(der), hex, sizeof(hex));
+	} else
+		hex_encode(raw, e->len - (raw - fmt), hex, sizeof(hex));
+
+	snprintf(buf, LOG_DEFER_BUF, fmt, hex);
+	return buf;
+}
+
+/* Instead of formatting val into fmt's %s, save them for later: only
+ * worth it if nobody's about to print it. */
+static bool log_deferred(struct log *log, enum log_level level,
+			 const char *fmt, enum log_deferred deferred,
+			 const void *val, size_t len)
+{
+	size_t flen = strlen(fmt) + 1;
+	struct log_ring *ring = &log->lr->ring[level];
+	char *p;
+
+	/* Plain entries get truncated, but these can't. */
+	if (flen + len > max_entry_len(log->lr, level))
+		return false;
+
+	p = add_entry(log, level, flen + len, log->lr->seq++, time_now());
+	memcpy(p, fmt, flen);
+	memcpy(p + flen, val, len);
+	ring_entry(ring, ring->num - 1)->deferred = deferred;
+	return true;
 }
 
 struct log_record *new_log_record(struct lightningd_state *dstate,
@@ -107,16 +289,36 @@ struct log_record *new_log_record(struct lightningd_state *dstate,
 				  enum log_level printlevel)
 {
 	struct log_record *lr = tal(dstate, struct log_record);
+	size_t i, share = max_mem / LOG_NUM_LEVELS, num;
 
 	/* Give a reasonable size for memory limit! */
-	assert(max_mem > sizeof(struct log) * 2);
-	lr->mem_used = 0;
+	assert(share > (sizeof(struct log_entry) + LOG_AVG_ENTRY_BYTES) * 4);
 	lr->max_mem = max_mem;
 	lr->dstate = dstate;
 	lr->print = log_default_print;
 	lr->print_level = printlevel;
 	lr->init_time = time_now();
-	list_head_init(&lr->log);
+	lr->seq = 0;
+	lr->last_level = LOG_DBG;
+	lr->last_elided = false;
+	lr->suspended = false;
+	lr->writer = NULL;
+	lr->capture = NULL;
+	lr->next_id = 0;
+	lr->mmap_names = NULL;
+
+	/* Everything's allocated up front: logging just fills it in. */
+	lr->ring = tal_arr(lr, struct log_ring, LOG_NUM_LEVELS);
+	num = share / (sizeof(struct log_entry) + LOG_AVG_ENTRY_BYTES);
+	for (i = 0; i < LOG_NUM_LEVELS; i++) {
+		struct log_ring *ring = &lr->ring[i];
+		ring->max_entries = num;
+		ring->entries = tal_arr(lr, struct log_entry, num);
+		ring->size = share - num * sizeof(struct log_entry);
+		ring->bytes = tal_arr(lr, char, ring->size);
+		ring->first = ring->num = 0;
+		ring->end = ring->bytes_used = 0;
+	}
 
 	return lr;
 }
@@ -129,6 +331,8 @@ new_log(const tal_t *ctx, struct log_record *record, const char *fmt, ...)
 	va_list ap;
 
 	log->lr = record;
+	log->id = record->next_id++;
+	log->captured = false;
 	va_start(ap, fmt);
 	/* log->lr owns this, since its entries keep a pointer to it. */
 	log->prefix = tal_vfmt(log->lr, fmt, ap);
@@ -142,10 +346,20 @@ void set_log_level(struct log_record *lr, enum log_level level)
 	lr->print_level = level;
 }
 
+enum log_level get_log_level(const struct log_record *lr)
+{
+	return lr->print_level;
+}
+
 void set_log_prefix(struct log *log, const char *prefix)
 {
 	/* log->lr owns this, since it keeps a pointer to it. */
 	log->prefix = tal_strdup(log->lr, prefix);
+	log->captured = false;
+	if (log->lr->mmap_names && !log->lr->suspended) {
+		log->lr->mmap_names[log->id % LOG_MMAP_NAMES].id = 0;
+		mmap_name(log);
+	}
 }
 
 void set_log_outfn_(struct log_record *lr,
@@ -171,7 +385,12 @@ size_t log_max_mem(const struct log_record *lr)
 
 size_t log_used(const struct log_record *lr)
 {
-	return lr->mem_used;
+	size_t i, used = 0;
+
+	for (i = 0; i < LOG_NUM_LEVELS; i++)
+		used += lr->ring[i].num * sizeof(struct log_entry)
+			+ lr->ring[i].bytes_used;
+	return used;
 }
 
 const struct timeabs *log_init_time(const struct log_record *lr)
@@ -179,81 +398,143 @@ const struct timeabs *log_init_time(const struct log_record *lr)
 	return &lr->init_time;
 }
 
-static void add_entry(struct log *log, struct log_entry *l)
+/* Formats straight into the ring. */
+static char *log_vfmt(struct log *log, enum log_level level,
+		      u64 seq, struct timeabs time,
+		      const char *prefix, const char *fmt, va_list ap)
 {
-	log->lr->mem_used += sizeof(*l) + log_bufsize(l);
-	list_add_tail(&log->lr->log, &l->list);
-
-	if (log->lr->mem_used > log->lr->max_mem) {
-		size_t old_mem = log->lr->mem_used, deleted;
-		deleted = prune_log(log->lr);
-		log_debug(log, "Log pruned %zu entries (mem %zu -> %zu)",
-			  deleted, old_mem, log->lr->mem_used);
+	size_t plen = prefix ? strlen(prefix) : 0, len;
+	char *p;
+	va_list ap2;
+
+	va_copy(ap2, ap);
+	len = plen + vsnprintf(NULL, 0, fmt, ap2) + 1;
+	va_end(ap2);
+
+	if (len > max_entry_len(log->lr, level)) {
+		len = max_entry_len(log->lr, level);
+		if (plen > len - 1)
+			plen = len - 1;
 	}
+	/* prefix may be in the ring, so move it before we overwrite. */
+	p = add_entry(log, level, len, seq, time);
+	if (plen)
+		memmove(p, prefix, plen);
+	vsnprintf(p + plen, len - plen, fmt, ap);
+	return p;
 }
 
-static struct log_entry *new_log_entry(struct log *log, enum log_level level)
+void logv(struct log *log, enum log_level level, const char *fmt, va_list ap)
 {
-	struct log_entry *l = tal(log->lr, struct log_entry);
+	int save_errno = errno;
+	char *str;
 
-	l->time = time_now();
-	l->level = level;
-	l->skipped = 0;
-	l->prefix = log->prefix;
+	if (log->lr->suspended)
+		return;
+	str = log_vfmt(log, level, log->lr->seq++, time_now(), NULL, fmt, ap);
 
-	return l;
+	if (level >= log->lr->print_level)
+		log->lr->print(log->prefix, level, false, str,
+			       log->lr->print_arg);
+	errno = save_errno;
 }
 
-void logv(struct log *log, enum log_level level, const char *fmt, va_list ap)
+void log_elided(struct log *log)
 {
-	struct log_entry *l = new_log_entry(log, level);
-
-	l->log = tal_vfmt(l, fmt, ap);
+	log->lr->last_elided = true;
+}
 
-	if (level >= log->lr->print_level)
-		log->lr->print(log->prefix, level, false, l->log,
-			       log->lr->print_arg);
+void log_suspend(struct log_record *lr)
+{
+	lr->suspended = true;
+}
 
-	add_entry(log, l);
+static void capture_io(struct log *log, bool in, const void *data, size_t len)
+{
+	struct log_record *lr = log->lr;
+	struct timeabs now = time_now();
+	bool ok = true;
+
+	if (!log->captured) {
+		ok = capture_write(lr->capture, log->id, CAPTURE_NAME, now,
+				   log->prefix, strlen(log->prefix));
+		log->captured = true;
+	}
+	if (ok)
+		ok = capture_write(lr->capture, log->id,
+				   in ? CAPTURE_IN : CAPTURE_OUT, now,
+				   data, len);
+	if (!ok) {
+		lr->capture = tal_free(lr->capture);
+		log_unusual(log, "Stopped --log-capture: %s", strerror(errno));
+	}
 }
 
 void log_io(struct log *log, bool in, const void *data, size_t len)
 {
 	int save_errno = errno;
-	struct log_entry *l = new_log_entry(log, LOG_IO);
+	char *p;
 
-	l->log = tal_arr(l, char, 1 + len);
-	l->log[0] = in;
-	memcpy(l->log + 1, data, len);
+	if (log->lr->suspended)
+		return;
+
+	if (log->lr->capture)
+		capture_io(log, in, data, len);
+
+	if (LOG_IO < LOG_MIN_LEVEL) {
+		log_elided(log);
+		errno = save_errno;
+		return;
+	}
+
+	if (1 + len > max_entry_len(log->lr, LOG_IO))
+		len = max_entry_len(log->lr, LOG_IO) - 1;
+	p = add_entry(log, LOG_IO, 1 + len, log->lr->seq++, time_now());
+	p[0] = in;
+	memcpy(p + 1, data, len);
 
 	if (LOG_IO >= log->lr->print_level) {
 		const char *dir = in ? "[IN]" : "[OUT]";
-		char *hex = tal_arr(l, char, strlen(dir) + hex_str_size(len));
+		char *hex = tal_arr(log, char, strlen(dir) + hex_str_size(len));
 		strcpy(hex, dir);
 		hex_encode(data, len, hex + strlen(dir), hex_str_size(len));
-		log->lr->print(log->prefix, LOG_IO, false, l->log,
+		log->lr->print(log->prefix, LOG_IO, false, hex,
 			       log->lr->print_arg);
 		tal_free(hex);
 	}
 
-	add_entry(log, l);
 	errno = save_errno;
 }
 
 static void do_log_add(struct log *log, const char *fmt, va_list ap)
 {
-	struct log_entry *l = list_tail(&log->lr->log, struct log_entry, list);
-	size_t oldlen = strlen(l->log);
-
-	/* Remove from list, so it doesn't get pruned. */
-	log->lr->mem_used -= sizeof(*l) + oldlen + 1;
-	list_del_from(&log->lr->log, &l->list);
+	enum log_level level = log->lr->last_level;
+	struct log_ring *ring = &log->lr->ring[level];
+	struct log_entry *l;
+	size_t oldlen;
+	const char *old;
+	char *str, buf[LOG_DEFER_BUF];
+
+	if (log->lr->last_elided || log->lr->suspended)
+		return;
 
-	tal_append_vfmt(&l->log, fmt, ap);
-	add_entry(log, l);
+	/* Nothing to add to? */
+	if (!ring->num || level == LOG_IO) {
+		logv(log, level, fmt, ap);
+		return;
+	}
 
-	if (l->level >= log->lr->print_level)
-		log->lr->print(log->prefix, l->level, true, l->log + oldlen,
+	/* Take it off, and put it back in (with the same seq) longer. */
+	l = ring_entry(ring, ring->num - 1);
+	old = undefer(log->lr, level, l, buf);
+	oldlen = strlen(old);
+	ring->num--;
+	ring->bytes_used -= l->len;
+	ring->end = l->off;
+	str = log_vfmt(log, level, l->seq, l->time, old, fmt, ap);
+
+	if (level >= log->lr->print_level && oldlen < strlen(str))
+		log->lr->print(log->prefix, level, true, str + oldlen,
 			       log->lr->print_arg);
 }
 
@@ -332,10 +613,12 @@ static char *to_string_(const tal_t *ctx,
 	} else if (streq(structname, "struct channel_oneside")) {
 		s = tal_fmt(ctx, "{ pay_msat=%u"
 			    " fee_msat=%u"
-			    " num_htlcs=%u }",
+			    " num_htlcs=%u"
+			    " htlc_msat=%u }",
 			    u.channel_oneside->pay_msat,
 			    u.channel_oneside->fee_msat,
-			    u.channel_oneside->num_htlcs);
+			    u.channel_oneside->num_htlcs,
+			    u.channel_oneside->htlc_msat);
 	} else if (streq(structname, "struct channel_state")) {
 		s = tal_fmt(ctx, "{ anchor=%"PRIu64
 			    " fee_rate=%"PRIu64
@@ -358,7 +641,7 @@ void log_struct_(struct log *log, int level,
 		 const char *structname,
 		 const char *fmt, ...)
 {
-	tal_t *ctx = tal(log, char);
+	tal_t *ctx;
 	char *s;
 	union loggable_structs u;
 	va_list ap;
@@ -368,7 +651,29 @@ void log_struct_(struct log *log, int level,
 	u.charp_ = va_arg(ap, const char *);
 	va_end(ap);
 
+	if (log->lr->suspended || (level == -1 && log->lr->last_elided))
+		return;
+
+	/* Hex conversions are most of the cost: do them if it's read. */
+	if (level != -1 && level < log->lr->print_level) {
+		bool deferred = false;
+
+		if (streq(structname, "struct pubkey"))
+			deferred = log_deferred(log, level, fmt,
+						LOG_DEFER_PUBKEY, u.pubkey,
+						sizeof(*u.pubkey));
+		else if (streq(structname, "struct sha256_double")
+			 || streq(structname, "struct sha256")
+			 || streq(structname, "struct rval"))
+			deferred = log_deferred(log, level, fmt,
+						LOG_DEFER_HEX, u.sha256,
+						sizeof(*u.sha256));
+		if (deferred)
+			return;
+	}
+
 	/* GCC checks we're one of these, so we should be. */
+	ctx = tal(log, char);
 	s = to_string_(ctx, log->lr, structname, u);
 	if (!s)
 		fatal("Logging unknown type %s", structname);
@@ -393,6 +698,14 @@ void log_blob_(struct log *log, enum log_level level, const char *fmt,
 	blob = va_arg(ap, void *);
 	va_end(ap);
 
+	if (log->lr->suspended || (level == -1 && log->lr->last_elided))
+		return;
+
+	if (level != -1 && level < log->lr->print_level
+	    && len <= LOG_DEFER_BLOB_MAX
+	    && log_deferred(log, level, fmt, LOG_DEFER_HEX, blob, len))
+		return;
+
 	hex = tal_hexstr(log, blob, len);
 	if (level == -1)
 		log_add(log, fmt, hex);
@@ -401,21 +714,102 @@ void log_blob_(struct log *log, enum log_level level, const char *fmt,
 	tal_free(hex);
 }
 
+/* First entry of the ring at or after since: they're in time order. */
+static size_t ring_find_time(const struct log_ring *ring, struct timeabs since)
+{
+	size_t lo = 0, hi = ring->num;
+
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if (time_before(ring_entry(ring, mid)->time, since))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+void log_each_match_(const struct log_record *lr,
+		     enum log_level min_level,
+		     const char *source,
+		     const struct timerel *since,
+		     void (*func)(unsigned int skipped,
+				  struct timerel time,
+				  enum log_level level,
+				  const char *prefix,
+				  const char *log,
+				  size_t len,
+				  void *arg),
+		     void *arg)
+{
+	size_t idx[LOG_NUM_LEVELS] = { 0 };
+	u64 next_seq = 0;
+	char buf[LOG_DEFER_BUF];
+	/* A log's entries all share its prefix, so usually it's the same. */
+	const char *last_prefix = NULL;
+	bool last_matched = false;
+	enum log_level i;
+
+	/* Less interesting levels are in their own rings: ignore them. */
+	for (i = 0; i < min_level; i++)
+		idx[i] = lr->ring[i].num;
+	if (since) {
+		struct timeabs t = timeabs_add(lr->init_time, *since);
+		for (i = min_level; i < LOG_NUM_LEVELS; i++)
+			idx[i] = ring_find_time(&lr->ring[i], t);
+	}
+
+	/* Merge the levels back into order: no allocation, for crashes. */
+	for (;;) {
+		const struct log_entry *e = NULL, *head;
+		enum log_level level = LOG_IO;
+
+		for (i = min_level; i < LOG_NUM_LEVELS; i++) {
+			if (idx[i] == lr->ring[i].num)
+				continue;
+			head = ring_entry(&lr->ring[i], idx[i]);
+			if (!e || head->seq < e->seq) {
+				e = head;
+				level = i;
+			}
+		}
+		if (!e)
+			break;
+
+		idx[level]++;
+		if (source) {
+			if (e->prefix != last_prefix) {
+				last_prefix = e->prefix;
+				last_matched = strstr(e->prefix, source) != NULL;
+			}
+			if (!last_matched)
+				continue;
+		}
+		if (e->deferred) {
+			const char *str = undefer(lr, level, e, buf);
+			func(e->seq - next_seq,
+			     time_between(e->time, lr->init_time),
+			     level, e->prefix, str, strlen(str), arg);
+		} else
+			func(e->seq - next_seq,
+			     time_between(e->time, lr->init_time),
+			     level, e->prefix, lr->ring[level].bytes + e->off,
+			     e->len - 1, arg);
+		next_seq = e->seq + 1;
+	}
+}
+
 void log_each_line_(const struct log_record *lr,
 		    void (*func)(unsigned int skipped,
 				 struct timerel time,
 				 enum log_level level,
 				 const char *prefix,
 				 const char *log,
+				 size_t len,
 				 void *arg),
 		    void *arg)
 {
-	const struct log_entry *i;
-
-	list_for_each(&lr->log, i, list) {
-		func(i->skipped, time_between(i->time, lr->init_time),
-		     i->level, i->prefix, i->log, arg);
-	}
+	log_each_match_(lr, LOG_IO, NULL, NULL, func, arg);
 }
 
 struct log_data {
@@ -428,6 +822,7 @@ static void log_one_line(unsigned int skipped,
 			 enum log_level level,
 			 const char *prefix,
 			 const char *log,
+			 size_t loglen,
 			 struct log_data *data)
 {
 	char buf[101];
@@ -452,7 +847,7 @@ static void log_one_line(unsigned int skipped,
 
 	write_all(data->fd, buf, strlen(buf));
 	if (level == LOG_IO) {
-		size_t off, used, len = tal_count(log)-1;
+		size_t off, used, len = loglen;
 
 		/* No allocations, may be in signal handler. */
 		for (off = 0; off < len; off += used) {
@@ -499,28 +894,324 @@ static char *arg_log_prefix(const char *arg, struct log *log)
 	return NULL;
 }
 
+/* How much --log-file output can be waiting before we drop lines. */
+#define LOG_FILE_BUF (1024 * 1024)
+
+/* A thread writes the file, so a slow disk doesn't hold up the loop. */
+struct log_writer {
+	int fd;
+	pthread_t thread;
+
+	/* Everything below is under lock. */
+	pthread_mutex_t lock;
+	pthread_cond_t work, idle;
+	/* Ring of bytes waiting to be written. */
+	char buf[LOG_FILE_BUF];
+	size_t start, used;
+	/* Lines we had no room for: total, and not yet mentioned. */
+	u64 dropped, unreported;
+};
+
+/* Called with lock held. */
+static void writer_put(struct log_writer *w, const char *p, size_t len)
+{
+	while (len) {
+		size_t end = (w->start + w->used) % sizeof(w->buf);
+		size_t n = sizeof(w->buf) - end;
+
+		if (n > len)
+			n = len;
+		memcpy(w->buf + end, p, n);
+		w->used += n;
+		p += n;
+		len -= n;
+	}
+}
+
+static void *log_writer(struct log_writer *w)
+{
+	pthread_mutex_lock(&w->lock);
+	for (;;) {
+		size_t n;
+
+		while (!w->used)
+			pthread_cond_wait(&w->work, &w->lock);
+
+		/* Just up to the end of the ring: we'll get the rest next. */
+		n = w->used;
+		if (w->start + n > sizeof(w->buf))
+			n = sizeof(w->buf) - w->start;
+		pthread_mutex_unlock(&w->lock);
+
+		/* Nowhere to report errors, so give up on this chunk. */
+		write_all(w->fd, w->buf + w->start, n);
+
+		pthread_mutex_lock(&w->lock);
+		w->start = (w->start + n) % sizeof(w->buf);
+		w->used -= n;
+		if (!w->used)
+			pthread_cond_signal(&w->idle);
+	}
+	return NULL;
+}
+
 static void log_to_file(const char *prefix,
 			enum log_level level,
 			bool continued,
 			const char *str,
-			FILE *logf)
+			struct log_writer *w)
 {
-	if (!continued) {
-		fprintf(logf, "%s %s\n", prefix, str);
+	const char *sep = continued ? " \t" : " ";
+	size_t len = strlen(prefix) + strlen(sep) + strlen(str) + 1;
+	char note[100];
+
+	pthread_mutex_lock(&w->lock);
+	note[0] = '\0';
+	if (w->unreported)
+		sprintf(note, "... %"PRIu64" lines dropped ...\n",
+			w->unreported);
+
+	if (w->used + strlen(note) + len > sizeof(w->buf)) {
+		w->dropped++;
+		w->unreported++;
 	} else {
-		fprintf(logf, "%s \t%s\n", prefix, str);
+		writer_put(w, note, strlen(note));
+		writer_put(w, prefix, strlen(prefix));
+		writer_put(w, sep, strlen(sep));
+		writer_put(w, str, strlen(str));
+		writer_put(w, "\n", 1);
+		w->unreported = 0;
+		pthread_cond_signal(&w->work);
 	}
+	pthread_mutex_unlock(&w->lock);
+}
+
+/* When we're going down: the thread may never get to it. */
+static void flush_log_writer(struct log_writer *w)
+{
+	/* Might be in a signal handler, so don't wait for the lock. */
+	if (w->start + w->used > sizeof(w->buf)) {
+		write_all(w->fd, w->buf + w->start, sizeof(w->buf) - w->start);
+		write_all(w->fd, w->buf,
+			  w->start + w->used - sizeof(w->buf));
+	} else
+		write_all(w->fd, w->buf + w->start, w->used);
+	w->used = 0;
+}
+
+void log_flush(struct log_record *lr)
+{
+	struct log_writer *w = lr->writer;
+
+	if (!w)
+		return;
+	pthread_mutex_lock(&w->lock);
+	while (w->used)
+		pthread_cond_wait(&w->idle, &w->lock);
+	pthread_mutex_unlock(&w->lock);
 }
 
 static char *arg_log_to_file(const char *arg, struct log *log)
 {
-	FILE *logf = fopen(arg, "a");
-	if (!logf)
+	/* The thread never stops, so this is never freed. */
+	struct log_writer *w = tal(NULL, struct log_writer);
+
+	w->fd = open(arg, O_WRONLY|O_APPEND|O_CREAT, 0666);
+	if (w->fd < 0) {
+		tal_free(w);
 		return tal_fmt(NULL, "Failed to open: %s", strerror(errno));
-	set_log_outfn(log->lr, log_to_file, logf);
+	}
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->work, NULL);
+	pthread_cond_init(&w->idle, NULL);
+	w->start = w->used = 0;
+	w->dropped = w->unreported = 0;
+	if (pthread_create(&w->thread, NULL,
+			   (void *(*)(void *))log_writer, w) != 0)
+		return tal_fmt(NULL, "Failed to start log writer: %s",
+			       strerror(errno));
+
+	set_log_outfn(log->lr, log_to_file, w);
+	log->lr->writer = w;
 	return NULL;
 }
 
+u64 log_file_dropped(const struct log_record *lr)
+{
+	return lr->writer ? lr->writer->dropped : 0;
+}
+
+static char *arg_log_capture(const char *arg, struct log *log)
+{
+	log->lr->capture = capture_open(log->lr, arg);
+	if (!log->lr->capture)
+		return tal_fmt(NULL, "Failed to open: %s", strerror(errno));
+	return NULL;
+}
+
+static size_t mmap_size(const struct log_ring *ring)
+{
+	size_t i, len = sizeof(struct log_mmap_hdr);
+
+	for (i = 0; i < LOG_NUM_LEVELS; i++)
+		len += ring[i].max_entries * sizeof(struct log_entry)
+			+ ring[i].size;
+	return len;
+}
+
+/* Points each ring into the file, after the header. */
+static void mmap_rings(struct log_mmap_hdr *hdr)
+{
+	char *p = (char *)(hdr + 1);
+	size_t i;
+
+	for (i = 0; i < LOG_NUM_LEVELS; i++) {
+		hdr->ring[i].entries = (struct log_entry *)p;
+		p += hdr->ring[i].max_entries * sizeof(struct log_entry);
+		hdr->ring[i].bytes = p;
+		p += hdr->ring[i].size;
+	}
+}
+
+/* Move what we have so far into the file, and log straight into it. */
+static char *arg_log_mmap(const char *arg, struct log *log)
+{
+	struct log_record *lr = log->lr;
+	struct log_mmap_hdr *hdr;
+	size_t i, len = mmap_size(lr->ring);
+	int fd;
+
+	if (lr->mmap_names)
+		return tal_fmt(NULL, "Already logging to a file");
+
+	fd = open(arg, O_RDWR|O_CREAT|O_TRUNC, 0600);
+	if (fd < 0)
+		return tal_fmt(NULL, "Failed to open: %s", strerror(errno));
+	if (ftruncate(fd, len) != 0) {
+		close(fd);
+		return tal_fmt(NULL, "Failed to size: %s", strerror(errno));
+	}
+	/* Never unmapped: the kernel writes it back after we're gone. */
+	hdr = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (hdr == MAP_FAILED)
+		return tal_fmt(NULL, "Failed to map: %s", strerror(errno));
+
+	memcpy(hdr->magic, LOG_MMAP_MAGIC, sizeof(hdr->magic));
+	hdr->version = LOG_MMAP_VERSION;
+	hdr->hdr_size = sizeof(*hdr);
+	hdr->entry_size = sizeof(struct log_entry);
+	hdr->init_time = lr->init_time;
+	for (i = 0; i < LOG_NUM_LEVELS; i++)
+		hdr->ring[i] = lr->ring[i];
+	mmap_rings(hdr);
+	for (i = 0; i < LOG_NUM_LEVELS; i++) {
+		memcpy(hdr->ring[i].entries, lr->ring[i].entries,
+		       lr->ring[i].max_entries * sizeof(struct log_entry));
+		memcpy(hdr->ring[i].bytes, lr->ring[i].bytes,
+		       lr->ring[i].size);
+		tal_free(lr->ring[i].entries);
+		tal_free(lr->ring[i].bytes);
+	}
+	tal_free(lr->ring);
+	lr->ring = hdr->ring;
+	lr->mmap_names = hdr->names;
+	mmap_name(log);
+	return NULL;
+}
+
+/* Corrupt entries (eg. we died mid-write) are skipped, not trusted. */
+static bool mmap_entry_ok(const struct log_ring *ring, enum log_level level,
+			  const struct log_entry *e)
+{
+	const char *fmt = ring->bytes + e->off, *pct;
+
+	if (e->off > ring->size || e->len > ring->size - e->off || !e->len)
+		return false;
+	if (level == LOG_IO)
+		return e->deferred == LOG_NOT_DEFERRED;
+	if (!memchr(fmt, '\0', e->len))
+		return false;
+	if (e->deferred == LOG_NOT_DEFERRED)
+		return true;
+	if (e->deferred != LOG_DEFER_PUBKEY && e->deferred != LOG_DEFER_HEX)
+		return false;
+	/* We'll hand it to snprintf: only ever one %s in these. */
+	pct = strchr(fmt, '%');
+	if (!pct || pct[1] != 's' || strchr(pct + 2, '%'))
+		return false;
+	if (e->deferred == LOG_DEFER_PUBKEY)
+		return e->len == strlen(fmt) + 1 + sizeof(struct pubkey);
+	return e->len - (strlen(fmt) + 1) <= LOG_DEFER_BLOB_MAX;
+}
+
+static char *arg_log_mmap_dump(const char *arg, void *unused)
+{
+	struct log_mmap_hdr *hdr;
+	struct log_record lr;
+	struct lightningd_state dstate;
+	struct stat st;
+	size_t i, j;
+	int fd;
+
+	fd = open(arg, O_RDONLY);
+	if (fd < 0)
+		return tal_fmt(NULL, "Failed to open: %s", strerror(errno));
+	if (fstat(fd, &st) != 0 || st.st_size < sizeof(*hdr)) {
+		close(fd);
+		return tal_fmt(NULL, "Too short");
+	}
+	/* Private, so we can fix it up as we read it. */
+	hdr = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (hdr == MAP_FAILED)
+		return tal_fmt(NULL, "Failed to map: %s", strerror(errno));
+	if (memcmp(hdr->magic, LOG_MMAP_MAGIC, sizeof(hdr->magic)) != 0
+	    || hdr->version != LOG_MMAP_VERSION
+	    || hdr->hdr_size != sizeof(*hdr)
+	    || hdr->entry_size != sizeof(struct log_entry)
+	    || mmap_size(hdr->ring) != st.st_size)
+		return tal_fmt(NULL, "Not a --log-mmap file from this version");
+
+	memset(&lr, 0, sizeof(lr));
+	memset(&dstate, 0, sizeof(dstate));
+	dstate.secpctx = secp256k1_context_create(SECP256K1_CONTEXT_NONE);
+	lr.dstate = &dstate;
+	lr.init_time = hdr->init_time;
+	lr.ring = hdr->ring;
+	/* So log_dump_to_file doesn't think it's empty. */
+	lr.seq = 1;
+	mmap_rings(hdr);
+
+	for (i = 0; i < LOG_NUM_LEVELS; i++) {
+		struct log_ring *ring = &hdr->ring[i];
+		size_t keep = 0;
+
+		if (ring->first >= ring->max_entries
+		    || ring->num > ring->max_entries)
+			ring->num = ring->first = 0;
+		/* Move the good ones down over the bad. */
+		for (j = 0; j < ring->num; j++) {
+			struct log_entry *e = ring_entry(ring, j);
+			const struct log_mmap_name *n;
+
+			if (!mmap_entry_ok(ring, i, e))
+				continue;
+			n = &hdr->names[e->log_id % LOG_MMAP_NAMES];
+			if (n->id == e->log_id + 1
+			    && memchr(n->name, '\0', sizeof(n->name)))
+				e->prefix = n->name;
+			else
+				e->prefix = "?:";
+			*ring_entry(ring, keep++) = *e;
+		}
+		ring->num = keep;
+	}
+
+	log_dump_to_file(STDOUT_FILENO, &lr);
+	exit(0);
+}
+
 void opt_register_logging(struct log *log)
 {
 	opt_register_arg("--log-level", arg_log_level, NULL, log,
@@ -529,6 +1220,12 @@ void opt_register_logging(struct log *log)
 			 "log prefix");
 	opt_register_arg("--log-file=<file>", arg_log_to_file, NULL, log,
 			 "log to file instead of stdout");
+	opt_register_arg("--log-capture=<file>", arg_log_capture, NULL, log,
+			 "record raw RPC I/O to file");
+	opt_register_arg("--log-mmap=<file>", arg_log_mmap, NULL, log,
+			 "keep the in-memory log in this file, so it survives a kill or hang");
+	opt_register_arg("--log-mmap-dump=<file>", arg_log_mmap_dump, NULL,
+			 NULL, "print a --log-mmap file, and exit");
 }
 
 static struct log *crashlog;
@@ -561,6 +1258,9 @@ static void log_crash(int sig)
 			logfile = NULL;
 	}
 
+	if (crashlog->lr->writer)
+		flush_log_writer(crashlog->lr->writer);
+
 	if (sig)
 		fprintf(stderr, "Fatal signal %u. ", sig);
 	if (logfile)
@@ -586,19 +1286,17 @@ void crashlog_activate(struct log *log)
 
 void log_dump_to_file(int fd, const struct log_record *lr)
 {
-	const struct log_entry *i;
 	char buf[100];
 	struct log_data data;
 	time_t start;
 
-	i = list_top(&lr->log, const struct log_entry, list);
-	if (!i) {
+	if (!lr->seq) {
 		write_all(fd, "0 bytes:\n\n", strlen("0 bytes:\n\n"));
 		return;
 	}
 
 	start = lr->init_time.ts.tv_sec;
-	sprintf(buf, "%zu bytes, %s", lr->mem_used, ctime(&start));
+	sprintf(buf, "%zu bytes, %s", log_used(lr), ctime(&start));
 	write_all(fd, buf, strlen(buf));
 
 	/* ctime includes \n... WTF? */
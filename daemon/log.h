@@ -1,10 +1,12 @@
 #ifndef LIGHTNING_DAEMON_LOG_H
 #define LIGHTNING_DAEMON_LOG_H
 #include "config.h"
+#include <ccan/short_types/short_types.h>
 #include <ccan/tal/tal.h>
 #include <ccan/typesafe_cb/typesafe_cb.h>
 #include <stdarg.h>
 
+struct log;
 struct timerel;
 struct lightningd_state;
 
@@ -21,6 +23,18 @@ enum log_level {
 	LOG_BROKEN
 };
 
+/* Build with LOG_MIN_LEVEL (eg. make LOG_MIN_LEVEL=INFORM) to compile out
+ * anything less: their arguments aren't even evaluated. */
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_IO
+#endif
+
+/* So a log_add() after one of those is dropped too. */
+void log_elided(struct log *log);
+
+#define log_at_level_(level, log, call)				\
+	((level) >= LOG_MIN_LEVEL ? (call) : log_elided(log))
+
 /* We have a single record. */
 struct log_record *new_log_record(struct lightningd_state *dstate,
 				  size_t max_mem,
@@ -30,11 +44,17 @@ struct log_record *new_log_record(struct lightningd_state *dstate,
 struct log *PRINTF_FMT(3,4)
 new_log(const tal_t *ctx, struct log_record *record, const char *fmt, ...);
 
-#define log_debug(log, ...) log_((log), LOG_DBG, __VA_ARGS__)
-#define log_info(log, ...) log_((log), LOG_INFORM, __VA_ARGS__)
-#define log_unusual(log, ...) log_((log), LOG_UNUSUAL, __VA_ARGS__)
-#define log_broken(log, ...) log_((log), LOG_BROKEN, __VA_ARGS__)
-
+#define log_debug(log, ...)						\
+	log_at_level_(LOG_DBG, (log), log_((log), LOG_DBG, __VA_ARGS__))
+#define log_info(log, ...)						\
+	log_at_level_(LOG_INFORM, (log), log_((log), LOG_INFORM, __VA_ARGS__))
+#define log_unusual(log, ...)						\
+	log_at_level_(LOG_UNUSUAL, (log),				\
+		      log_((log), LOG_UNUSUAL, __VA_ARGS__))
+#define log_broken(log, ...)						\
+	log_at_level_(LOG_BROKEN, (log), log_((log), LOG_BROKEN, __VA_ARGS__))
+
+/* Not compiled out, since --log-capture wants it whatever the level. */
 void log_io(struct log *log, bool in, const void *data, size_t len);
 
 void log_(struct log *log, enum log_level level, const char *fmt, ...)
@@ -50,14 +70,17 @@ void log_blob_(struct log *log, enum log_level level, const char *fmt,
 #define log_add_blob(log, fmt, blob, len)			\
 	log_blob_((log), -1, (fmt), (len), (char *)(blob))
 
+#define log_level_blob_(log, level, fmt, blob, len)			\
+	log_at_level_((level), (log),					\
+		       log_blob_((log), (level), (fmt), (len), (char *)(blob)))
 #define log_debug_blob(log, fmt, blob, len)			\
-	log_blob_((log), LOG_DBG, (fmt), (len), (char *)(blob))
+	log_level_blob_((log), LOG_DBG, (fmt), (blob), (len))
 #define log_info_blob(log, fmt, blob, len)				\
-	log_blob_((log), LOG_INFORM, (fmt), (len), (char *)(blob))
+	log_level_blob_((log), LOG_INFORM, (fmt), (blob), (len))
 #define log_unusual_blob(log, fmt, blob, len)				\
-	log_blob_((log), LOG_UNUSUAL, (fmt), (len), (char *)(blob))
+	log_level_blob_((log), LOG_UNUSUAL, (fmt), (blob), (len))
 #define log_broken_blob(log, fmt, blob, len)				\
-	log_blob_((log), LOG_BROKEN, (fmt), (len), (char *)(blob))
+	log_level_blob_((log), LOG_BROKEN, (fmt), (blob), (len))
 
 /* Makes sure ptr is a 'structtype', makes sure it's in loggable_structs. */
 #define log_struct_check_(log, loglevel, fmt, structtype, ptr)		\
@@ -69,14 +92,17 @@ void log_blob_(struct log *log, enum log_level level, const char *fmt,
 #define log_add_struct(log, fmt, structtype, ptr)			\
 	log_struct_check_((log), -1, (fmt), structtype, (ptr))
 
+#define log_level_struct_(log, level, fmt, structtype, ptr)		\
+	log_at_level_((level), (log),					\
+		      log_struct_check_((log), (level), (fmt), structtype, (ptr)))
 #define log_debug_struct(log, fmt, structtype, ptr)	\
-	log_struct_check_((log), LOG_DBG, (fmt), structtype, (ptr))
+	log_level_struct_((log), LOG_DBG, (fmt), structtype, (ptr))
 #define log_info_struct(log, fmt, structtype, ptr)	\
-	log_struct_check_((log), LOG_INFORM, (fmt), structtype, (ptr))
+	log_level_struct_((log), LOG_INFORM, (fmt), structtype, (ptr))
 #define log_unusual_struct(log, fmt, structtype, ptr)	\
-	log_struct_check_((log), LOG_UNUSUAL, (fmt), structtype, (ptr))
+	log_level_struct_((log), LOG_UNUSUAL, (fmt), structtype, (ptr))
 #define log_broken_struct(log, fmt, structtype, ptr)	\
-	log_struct_check_((log), LOG_BROKEN, (fmt), structtype, (ptr))
+	log_level_struct_((log), LOG_BROKEN, (fmt), structtype, (ptr))
 
 /* This must match the log_add_struct_ definitions. */
 union loggable_structs {
@@ -97,7 +123,12 @@ void PRINTF_FMT(4,5) log_struct_(struct log *log, int level,
 				 const char *structname,
 				 const char *fmt, ...);
 
+/* Drop everything logged to lr from now on: for a forked child, which
+ * shares its parent's rings (with --log-mmap) and writer lock. */
+void log_suspend(struct log_record *lr);
+
 void set_log_level(struct log_record *lr, enum log_level level);
+enum log_level get_log_level(const struct log_record *lr);
 void set_log_prefix(struct log *log, const char *prefix);
 const char *log_prefix(const struct log *log);
 #define set_log_outfn(lr, print, arg)					\
@@ -116,6 +147,10 @@ void set_log_outfn_(struct log_record *lr,
 		    void *arg);
 
 size_t log_max_mem(const struct log_record *lr);
+/* Lines --log-file couldn't keep up with. */
+u64 log_file_dropped(const struct log_record *lr);
+/* Wait until --log-file has written everything so far. */
+void log_flush(struct log_record *lr);
 size_t log_used(const struct log_record *lr);
 const struct timeabs *log_init_time(const struct log_record *lr);
 
@@ -126,17 +161,46 @@ const struct timeabs *log_init_time(const struct log_record *lr);
 					   struct timerel,		\
 					   enum log_level,		\
 					   const char *,		\
-					   const char *), (arg))
+					   const char *,		\
+					   size_t), (arg))
 
+/* For LOG_IO, log[0] is true for input, and len bytes of data follow;
+ * otherwise log is a string of len chars. */
 void log_each_line_(const struct log_record *lr,
 		    void (*func)(unsigned int skipped,
 				 struct timerel time,
 				 enum log_level level,
 				 const char *prefix,
 				 const char *log,
+				 size_t len,
 				 void *arg),
 		    void *arg);
 
+#define log_each_match(lr, min_level, source, since, func, arg)		\
+	log_each_match_((lr), (min_level), (source), (since),		\
+		       typesafe_cb_preargs(void, void *, (func), (arg),	\
+					   unsigned int,		\
+					   struct timerel,		\
+					   enum log_level,		\
+					   const char *,		\
+					   const char *,		\
+					   size_t), (arg))
+
+/* As log_each_line, but only entries of at least min_level, whose prefix
+ * contains source (unless NULL), logged since (unless NULL) after
+ * log_init_time().  skipped counts everything else too. */
+void log_each_match_(const struct log_record *lr,
+		     enum log_level min_level,
+		     const char *source,
+		     const struct timerel *since,
+		     void (*func)(unsigned int skipped,
+				  struct timerel time,
+				  enum log_level level,
+				  const char *prefix,
+				  const char *log,
+				  size_t len,
+				  void *arg),
+		     void *arg);
 
 void log_dump_to_file(int fd, const struct log_record *lr);
 void opt_register_logging(struct log *log);
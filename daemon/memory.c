@@ -0,0 +1,560 @@
+/* Counts tal's allocations with a backend which remembers each size, and
+ * attributes them by walking the tree under dstate, or (if profiling) by
+ * who allocated them.  Other threads never use tal, so plain counters do. */
+#include "jsonrpc.h"
+#include "lightningd.h"
+#include "log.h"
+#include "memory.h"
+#include "timeout.h"
+#include <ccan/asort/asort.h>
+#include <ccan/strmap/strmap.h>
+#include <ccan/tal/str/str.h>
+#include <ccan/tal/tal.h>
+#include <errno.h>
+#include <execinfo.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* An hour's worth, at the default rate. */
+#define MEMORY_SAMPLES 60
+
+/* Everything tal got from malloc, including headers and properties. */
+static size_t allocated, allocations;
+
+#ifdef TAL_FREELISTS
+/* Small allocations come in MEMORY_CLASS_BYTES steps, and freed ones are
+ * kept (up to MEMORY_CLASS_KEEP of each size) for the next of that size.
+ * A free one's second header word is the next on its list. */
+#define MEMORY_CLASS_BYTES 16
+#define MEMORY_CLASSES 32
+#define MEMORY_CLASS_KEEP 4096
+
+static size_t *freelist[MEMORY_CLASSES + 1];
+static size_t freelist_len[MEMORY_CLASSES + 1];
+/* What the free lists are holding on to. */
+static size_t cached;
+
+/* 0 if it's too big for a class. */
+static size_t size_class(size_t size)
+{
+	size_t c = (size + MEMORY_CLASS_BYTES - 1) / MEMORY_CLASS_BYTES;
+
+	if (c > MEMORY_CLASSES)
+		return 0;
+	return c ? c : 1;
+}
+
+static size_t *get_block(size_t size)
+{
+	size_t c = size_class(size), *p;
+
+	if (c && freelist[c]) {
+		p = freelist[c];
+		freelist[c] = (size_t *)p[1];
+		freelist_len[c]--;
+		cached -= c * MEMORY_CLASS_BYTES;
+		return p;
+	}
+	if (c)
+		size = c * MEMORY_CLASS_BYTES;
+	return malloc(sizeof(size_t) * 2 + size);
+}
+
+static void put_block(size_t *p)
+{
+	size_t c = size_class(*p);
+
+	if (!c || freelist_len[c] == MEMORY_CLASS_KEEP) {
+		free(p);
+		return;
+	}
+	p[1] = (size_t)freelist[c];
+	freelist[c] = p;
+	freelist_len[c]++;
+	cached += c * MEMORY_CLASS_BYTES;
+}
+#else
+static const size_t cached = 0;
+
+static size_t *get_block(size_t size)
+{
+	return malloc(sizeof(size_t) * 2 + size);
+}
+
+static void put_block(size_t *p)
+{
+	free(p);
+}
+#endif /* TAL_FREELISTS */
+
+/* With --alloc-profile, each allocation's backtrace is counted, and an
+ * allocated block's second header word points to where it came from.  The
+ * first few frames are always tal's own.  Sites are never freed (blocks
+ * point at them), and come from malloc so they don't count themselves. */
+#define PROFILE_FRAMES 12
+#define PROFILE_SITES 4096
+
+struct alloc_site {
+	void *frame[PROFILE_FRAMES];
+	int num_frames;
+	/* Since the last reset. */
+	u64 allocations, bytes;
+	/* Still allocated. */
+	u64 live, live_bytes;
+};
+
+static bool profiling;
+/* The last one is for everything once the others are used up. */
+static struct alloc_site *sites;
+static size_t num_sites;
+/* Open addressing: index + 1 into sites, 0 if empty. */
+static u32 site_index[PROFILE_SITES * 2];
+
+static size_t hash_frames(void *const *frame, int num)
+{
+	size_t h = num;
+	int i;
+
+	for (i = 0; i < num; i++)
+		h = (h ^ (size_t)frame[i]) * 0x100000001B3ULL;
+	return h ^ (h >> 29);
+}
+
+static struct alloc_site *find_site(void)
+{
+	void *frame[PROFILE_FRAMES + 1];
+	int num = backtrace(frame, PROFILE_FRAMES + 1) - 1;
+	size_t i = hash_frames(frame + 1, num) % (PROFILE_SITES * 2);
+	struct alloc_site *site;
+
+	/* frame[0] is us. */
+	while (site_index[i]) {
+		site = &sites[site_index[i] - 1];
+		if (site->num_frames == num
+		    && memcmp(site->frame, frame + 1,
+			      num * sizeof(frame[0])) == 0)
+			return site;
+		i = (i + 1) % (PROFILE_SITES * 2);
+	}
+
+	if (num_sites == PROFILE_SITES - 1)
+		return &sites[PROFILE_SITES - 1];
+	site = &sites[num_sites++];
+	memcpy(site->frame, frame + 1, num * sizeof(frame[0]));
+	site->num_frames = num;
+	site_index[i] = num_sites;
+	return site;
+}
+
+static struct alloc_site *profile(size_t bytes)
+{
+	struct alloc_site *site;
+
+	if (!profiling)
+		return NULL;
+	site = find_site();
+	site->allocations++;
+	site->bytes += bytes;
+	return site;
+}
+
+/* From what malloc gives us to what tal hands out. */
+static size_t tal_offset;
+static const void *last_alloc;
+
+struct memory_sample {
+	struct timeabs time;
+	u64 bytes, allocations;
+};
+
+struct memory {
+	struct memory_sample sample[MEMORY_SAMPLES];
+	/* Next one to overwrite, and how many are valid. */
+	size_t next, num;
+};
+
+struct usage {
+	u64 bytes, objects;
+};
+
+struct usage_map {
+	STRMAP(struct usage *) map;
+};
+
+static void set_site(size_t *p, struct alloc_site *site)
+{
+	p[1] = (size_t)site;
+	if (site) {
+		site->live++;
+		site->live_bytes += *p;
+	}
+}
+
+static void clear_site(size_t *p)
+{
+	struct alloc_site *site = (struct alloc_site *)p[1];
+
+	if (site) {
+		site->live--;
+		site->live_bytes -= *p;
+	}
+}
+
+static void *count_alloc(size_t size)
+{
+	size_t *p = get_block(size);
+	if (!p)
+		return NULL;
+	*p = size;
+	allocated += size;
+	allocations++;
+	last_alloc = p;
+	set_site(p, profile(size));
+	return p + 2;
+}
+
+/* A resize counts as an allocation by whoever resized it. */
+static void *count_resize(void *ptr, size_t size)
+{
+	size_t *p = (size_t *)ptr - 2, *newp;
+	struct alloc_site *old = (struct alloc_site *)p[1];
+
+	clear_site(p);
+#ifdef TAL_FREELISTS
+	/* Still fits its class?  Otherwise, it moves in or out of one. */
+	if (size_class(*p) || size_class(size)) {
+		if (size_class(*p) == size_class(size)) {
+			allocated += size - *p;
+			*p = size;
+			set_site(p, profile(size));
+			return ptr;
+		}
+		newp = get_block(size);
+		if (!newp) {
+			set_site(p, old);
+			return NULL;
+		}
+		memcpy(newp + 2, ptr, *p < size ? *p : size);
+		allocated += size - *p;
+		*newp = size;
+		put_block(p);
+		set_site(newp, profile(size));
+		return newp + 2;
+	}
+#endif
+	allocated -= *p;
+	newp = realloc(p, sizeof(size_t) * 2 + size);
+	if (!newp) {
+		allocated += *p;
+		set_site(p, old);
+		return NULL;
+	}
+	*newp = size;
+	allocated += size;
+	set_site(newp, profile(size));
+	return newp + 2;
+}
+
+static void count_free(void *ptr)
+{
+	size_t *p = (size_t *)ptr - 2;
+
+	clear_site(p);
+	allocated -= *p;
+	allocations--;
+	put_block(p);
+}
+
+void memory_track(void)
+{
+	char *p;
+
+	tal_set_backend(count_alloc, count_resize, count_free, NULL);
+
+	/* tal's header is private, so measure it. */
+	p = tal(NULL, char);
+	tal_offset = (const char *)p - (const char *)last_alloc;
+	tal_free(p);
+}
+
+/* What @p itself took (not its properties, nor its children). */
+static size_t object_bytes(const tal_t *p)
+{
+	return *(const size_t *)((const char *)p - tal_offset);
+}
+
+static const char *label(const tal_t *p)
+{
+	const char *name = tal_name(p);
+	return name ? name : "unnamed";
+}
+
+static void add_usage(const tal_t *ctx, struct usage_map *m,
+		      const char *name, size_t bytes)
+{
+	struct usage *u = strmap_get(&m->map, name);
+
+	if (!u) {
+		u = talz(ctx, struct usage);
+		strmap_add(&m->map, name, u);
+	}
+	u->bytes += bytes;
+	u->objects++;
+}
+
+static bool json_add_usage(const char *name, struct usage *u,
+			   struct json_result *response)
+{
+	json_object_start(response, name);
+	json_add_u64(response, "bytes", u->bytes);
+	json_add_u64(response, "objects", u->objects);
+	json_object_end(response);
+	return true;
+}
+
+static void take_sample(struct lightningd_state *dstate)
+{
+	struct memory *m = dstate->memory;
+	struct memory_sample *s = &m->sample[m->next];
+
+	s->time = time_now();
+	s->bytes = allocated;
+	s->allocations = allocations;
+	m->next = (m->next + 1) % MEMORY_SAMPLES;
+	if (m->num < MEMORY_SAMPLES)
+		m->num++;
+
+	new_reltimer(dstate, dstate, dstate->config.memory_sample_time,
+		     take_sample, dstate);
+}
+
+void memory_init(struct lightningd_state *dstate)
+{
+	dstate->memory = talz(dstate, struct memory);
+
+	if (dstate->config.alloc_profile) {
+		sites = calloc(PROFILE_SITES, sizeof(*sites));
+		if (!sites)
+			fatal("Could not allocate %u allocation sites",
+			      PROFILE_SITES);
+		profiling = true;
+	}
+
+	/* Zero means never. */
+	if (time_to_nsec(dstate->config.memory_sample_time))
+		take_sample(dstate);
+}
+
+static void json_getmemory(struct command *cmd,
+			   const char *buffer, const jsmntok_t *params)
+{
+	struct lightningd_state *dstate = cmd->dstate;
+	struct memory *m = dstate->memory;
+	struct json_result *response;
+	/* Not under dstate, so the walk doesn't see it. */
+	const tal_t *ctx = tal(NULL, char);
+	struct usage_map subsystems, types;
+	const tal_t *p;
+	u64 total = allocated, attributed;
+	size_t i;
+
+	strmap_init(&subsystems.map);
+	strmap_init(&types.map);
+	attributed = object_bytes(dstate);
+	for (p = tal_first(dstate); p; p = tal_next(dstate, p)) {
+		const tal_t *top = p;
+		size_t bytes = object_bytes(p);
+
+		while (tal_parent(top) != dstate)
+			top = tal_parent(top);
+		add_usage(ctx, &subsystems, label(top), bytes);
+		add_usage(ctx, &types, label(p), bytes);
+		attributed += bytes;
+	}
+
+	response = new_json_result(cmd);
+	json_object_start(response, NULL);
+	json_add_u64(response, "bytes", total);
+	json_add_u64(response, "allocations", allocations);
+	json_add_u64(response, "cached_bytes", cached);
+	json_add_u64(response, "unattributed_bytes",
+		     total > attributed ? total - attributed : 0);
+	json_object_start(response, "subsystems");
+	strmap_iterate(&subsystems.map, json_add_usage, response);
+	json_object_end(response);
+	json_object_start(response, "types");
+	strmap_iterate(&types.map, json_add_usage, response);
+	json_object_end(response);
+	json_array_start(response, "samples");
+	for (i = 0; i < m->num; i++) {
+		const struct memory_sample *s;
+
+		s = &m->sample[(m->next + MEMORY_SAMPLES - m->num + i)
+			       % MEMORY_SAMPLES];
+		json_object_start(response, NULL);
+		json_add_u64(response, "time", s->time.ts.tv_sec);
+		json_add_u64(response, "bytes", s->bytes);
+		json_add_u64(response, "allocations", s->allocations);
+		json_object_end(response);
+	}
+	json_array_end(response);
+	json_object_end(response);
+
+	strmap_clear(&subsystems.map);
+	strmap_clear(&types.map);
+	tal_free(ctx);
+	command_success(cmd, response);
+}
+
+const struct json_command getmemory_command = {
+	"getmemory",
+	json_getmemory,
+	"Show where our memory goes",
+	"Returns total {bytes} and {allocations}, {cached_bytes} kept for reuse, {bytes} and {objects} for each of our {subsystems} and each of the {types} under them, and periodic {samples} of the totals"
+};
+
+static int cmp_site_bytes(struct alloc_site *const *a,
+			  struct alloc_site *const *b, void *unused)
+{
+	if ((*a)->bytes > (*b)->bytes)
+		return -1;
+	return (*a)->bytes < (*b)->bytes;
+}
+
+static void json_add_site(struct json_result *response,
+			  const struct alloc_site *site)
+{
+	char **syms;
+	int i;
+
+	json_object_start(response, NULL);
+	json_add_u64(response, "allocations", site->allocations);
+	json_add_u64(response, "bytes", site->bytes);
+	json_add_u64(response, "live", site->live);
+	json_add_u64(response, "live_bytes", site->live_bytes);
+	json_array_start(response, "backtrace");
+	syms = backtrace_symbols(site->frame, site->num_frames);
+	for (i = 0; syms && i < site->num_frames; i++)
+		json_add_string(response, NULL, syms[i]);
+	free(syms);
+	json_array_end(response);
+	json_object_end(response);
+}
+
+/* pprof's legacy heap profile: in use, then [allocated since reset]. */
+static bool write_pprof(const char *filename,
+			struct alloc_site **sorted, size_t num)
+{
+	FILE *f = fopen(filename, "w"), *maps;
+	u64 live = 0, live_bytes = 0, allocs = 0, bytes = 0;
+	size_t i, len;
+	char buf[4096];
+	int j;
+
+	if (!f)
+		return false;
+
+	for (i = 0; i < num; i++) {
+		live += sorted[i]->live;
+		live_bytes += sorted[i]->live_bytes;
+		allocs += sorted[i]->allocations;
+		bytes += sorted[i]->bytes;
+	}
+	fprintf(f, "heap profile: %"PRIu64": %"PRIu64
+		" [%"PRIu64": %"PRIu64"] @ heapprofile\n",
+		live, live_bytes, allocs, bytes);
+	for (i = 0; i < num; i++) {
+		fprintf(f, "%"PRIu64": %"PRIu64" [%"PRIu64": %"PRIu64"] @",
+			sorted[i]->live, sorted[i]->live_bytes,
+			sorted[i]->allocations, sorted[i]->bytes);
+		for (j = 0; j < sorted[i]->num_frames; j++)
+			fprintf(f, " %p", sorted[i]->frame[j]);
+		fprintf(f, "\n");
+	}
+
+	/* So pprof can find our symbols. */
+	fprintf(f, "\nMAPPED_LIBRARIES:\n");
+	maps = fopen("/proc/self/maps", "r");
+	if (maps) {
+		while ((len = fread(buf, 1, sizeof(buf), maps)) != 0)
+			fwrite(buf, 1, len, f);
+		fclose(maps);
+	}
+	return fclose(f) == 0;
+}
+
+static void json_getallocs(struct command *cmd,
+			   const char *buffer, const jsmntok_t *params)
+{
+	jsmntok_t *limittok, *resettok, *filetok;
+	unsigned int limit = 20;
+	bool reset = false;
+	struct alloc_site **sorted;
+	struct json_result *response;
+	size_t i, num;
+
+	if (!profiling) {
+		command_fail(cmd, "Not profiling: start with --alloc-profile");
+		return;
+	}
+
+	if (!json_get_params(buffer, params,
+			     "?limit", &limittok,
+			     "?reset", &resettok,
+			     "?file", &filetok,
+			     NULL)) {
+		command_fail(cmd, "Invalid parameters");
+		return;
+	}
+
+	if (limittok && !json_tok_number(buffer, limittok, &limit)) {
+		command_fail(cmd, "limit must be a number");
+		return;
+	}
+	if (resettok && !json_tok_bool(buffer, resettok, &reset)) {
+		command_fail(cmd, "reset must be true or false");
+		return;
+	}
+
+	sorted = tal_arr(cmd, struct alloc_site *, num_sites + 1);
+	for (num = 0; num < num_sites; num++)
+		sorted[num] = &sites[num];
+	/* And the catch-all, if anything's come to it. */
+	if (sites[PROFILE_SITES - 1].live || sites[PROFILE_SITES - 1].allocations)
+		sorted[num++] = &sites[PROFILE_SITES - 1];
+	asort(sorted, num, cmp_site_bytes, NULL);
+
+	if (filetok) {
+		char *filename = tal_strndup(cmd, buffer + filetok->start,
+					     filetok->end - filetok->start);
+		if (!write_pprof(filename, sorted, num)) {
+			command_fail(cmd, "Could not write %s: %s",
+				     filename, strerror(errno));
+			return;
+		}
+	}
+
+	response = new_json_result(cmd);
+	json_object_start(response, NULL);
+	json_add_u64(response, "sites", num);
+	json_array_start(response, "top");
+	for (i = 0; i < num && i < limit; i++)
+		json_add_site(response, sorted[i]);
+	json_array_end(response);
+	json_object_end(response);
+
+	if (reset) {
+		for (i = 0; i < PROFILE_SITES; i++)
+			sites[i].allocations = sites[i].bytes = 0;
+	}
+	command_success(cmd, response);
+}
+
+const struct json_command getallocs_command = {
+	"getallocs",
+	json_getallocs,
+	"Show the {limit} (default 20) backtraces which allocated most since the last {reset}, writing all of them to pprof heap profile {file} if given",
+	"Returns the number of {sites}, and the {top} ones' {allocations}, {bytes}, {live} objects, {live_bytes} and {backtrace}"
+};
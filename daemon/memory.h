@@ -0,0 +1,14 @@
+#ifndef LIGHTNING_DAEMON_MEMORY_H
+#define LIGHTNING_DAEMON_MEMORY_H
+/* Where tal's memory goes: see getmemory. */
+#include "config.h"
+
+struct lightningd_state;
+
+/* Count what tal allocates: call before anything is allocated. */
+void memory_track(void);
+
+/* Start sampling the totals every config.memory_sample_time, and
+ * profiling allocations if config.alloc_profile. */
+void memory_init(struct lightningd_state *dstate);
+#endif /* LIGHTNING_DAEMON_MEMORY_H */
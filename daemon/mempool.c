@@ -0,0 +1,191 @@
+#include "bitcoin/tx.h"
+#include "chainsource.h"
+#include "chaintopology.h"
+#include "lightningd.h"
+#include "log.h"
+#include "mempool.h"
+#include "peer.h"
+#include "watch.h"
+#include <ccan/htable/htable_type.h>
+#include <ccan/structeq/structeq.h>
+
+/* Most new txs we fetch each poll: the rest wait for the next. */
+#define MEMPOOL_FETCH_MAX 500
+
+struct mempool_tx {
+	struct sha256_double txid;
+	/* Which poll last listed it. */
+	u64 seen;
+	/* Fired txowatches, at this tip height. */
+	bool fired;
+	u32 height;
+};
+
+static const struct sha256_double *mempool_tx_key(const struct mempool_tx *mt)
+{
+	return &mt->txid;
+}
+
+static size_t mempool_tx_hash(const struct sha256_double *txid)
+{
+	size_t ret;
+
+	memcpy(&ret, txid, sizeof(ret));
+	return ret;
+}
+
+static bool mempool_tx_eq(const struct mempool_tx *mt,
+			  const struct sha256_double *txid)
+{
+	return structeq(&mt->txid, txid);
+}
+HTABLE_DEFINE_TYPE(struct mempool_tx, mempool_tx_key, mempool_tx_hash,
+		   mempool_tx_eq, mempool_tx_map);
+
+struct mempool {
+	struct mempool_tx_map txs;
+	u64 polls;
+	/* getrawmempool, or its getrawtransactions, outstanding. */
+	bool polling;
+	size_t fetching;
+};
+
+static struct mempool *get_mempool(struct lightningd_state *dstate)
+{
+	if (!dstate->mempool) {
+		dstate->mempool = tal(dstate, struct mempool);
+		mempool_tx_map_init(&dstate->mempool->txs);
+		dstate->mempool->polls = 0;
+		dstate->mempool->polling = false;
+		dstate->mempool->fetching = 0;
+	}
+	return dstate->mempool;
+}
+
+static void forget_tx(struct mempool *m, struct mempool_tx *mt)
+{
+	mempool_tx_map_del(&m->txs, mt);
+	tal_free(mt);
+}
+
+static void got_tx(struct lightningd_state *dstate, struct bitcoin_tx *tx,
+		   struct sha256_double *txid)
+{
+	struct mempool *m = dstate->mempool;
+	struct mempool_tx *mt = mempool_tx_map_get(&m->txs, txid);
+	size_t i;
+
+	if (--m->fetching == 0)
+		m->polling = false;
+
+	/* Gone already (or mined, and seen in a block meanwhile)? */
+	if (!tx || !mt)
+		goto out;
+
+	for (i = 0; i < tx->input_count; i++) {
+		struct txwatch_output out;
+		struct txowatch *txo;
+
+		out.txid = tx->input[i].txid;
+		out.index = tx->input[i].index;
+		txo = find_txowatch(dstate, &out);
+		if (!txo)
+			continue;
+
+		log_unusual(txo->peer->log, "Spend of watched output"
+			    " in mempool: not waiting for a block");
+		mt->fired = true;
+		mt->height = get_block_height(dstate);
+		txowatch_fire_all(dstate, &out, tx, i);
+	}
+out:
+	tal_free(txid);
+}
+
+static void got_mempool(struct lightningd_state *dstate,
+			const struct sha256_double *txids,
+			struct mempool *m)
+{
+	struct mempool_tx_map_iter it;
+	struct mempool_tx *mt, **gone;
+	size_t i, n = 0;
+
+	m->polls++;
+	for (i = 0; i < tal_count(txids); i++) {
+		mt = mempool_tx_map_get(&m->txs, &txids[i]);
+		if (mt) {
+			mt->seen = m->polls;
+			continue;
+		}
+
+		/* What's there at the start was there before we were. */
+		if (m->polls != 1) {
+			if (n == MEMPOOL_FETCH_MAX)
+				continue;
+			n++;
+			m->fetching++;
+			chain_getrawtx(dstate, &txids[i], got_tx,
+				       tal_dup(dstate, struct sha256_double,
+					       &txids[i]));
+		}
+		mt = tal(m, struct mempool_tx);
+		mt->txid = txids[i];
+		mt->seen = m->polls;
+		mt->fired = false;
+		mt->height = 0;
+		mempool_tx_map_add(&m->txs, mt);
+	}
+
+	/* Forget what's left the mempool, but hold onto any we fired until
+	 * the block which mined it must have been scanned. */
+	gone = tal_arr(m, struct mempool_tx *, 0);
+	for (mt = mempool_tx_map_first(&m->txs, &it);
+	     mt;
+	     mt = mempool_tx_map_next(&m->txs, &it)) {
+		if (mt->seen == m->polls)
+			continue;
+		if (mt->fired && mt->height + 1 >= get_block_height(dstate))
+			continue;
+		tal_resize(&gone, tal_count(gone) + 1);
+		gone[tal_count(gone) - 1] = mt;
+	}
+	for (i = 0; i < tal_count(gone); i++)
+		forget_tx(m, gone[i]);
+	tal_free(gone);
+
+	if (!m->fetching)
+		m->polling = false;
+}
+
+void mempool_poll(struct lightningd_state *dstate)
+{
+	struct mempool *m = get_mempool(dstate);
+
+	if (m->polling)
+		return;
+
+	/* Nothing to look for? */
+	if (dstate->txowatches.raw.elems == 0)
+		return;
+
+	m->polling = true;
+	chain_getrawmempool(dstate, got_mempool, m);
+}
+
+bool mempool_tx_mined(struct lightningd_state *dstate,
+		      const struct sha256_double *txid)
+{
+	struct mempool_tx *mt;
+	bool fired;
+
+	if (!dstate->mempool)
+		return false;
+
+	mt = mempool_tx_map_get(&dstate->mempool->txs, txid);
+	if (!mt)
+		return false;
+
+	fired = mt->fired;
+	forget_tx(dstate->mempool, mt);
+	return fired;
+}
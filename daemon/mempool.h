@@ -0,0 +1,19 @@
+#ifndef LIGHTNING_DAEMON_MEMPOOL_H
+#define LIGHTNING_DAEMON_MEMPOOL_H
+/* With --watch-mempool, spends of outputs we watch are handed to their
+ * txowatch as soon as bitcoind's mempool has them, rather than once they're
+ * mined: the tx is at depth 0 until it is. */
+#include "config.h"
+#include <stdbool.h>
+
+struct lightningd_state;
+struct sha256_double;
+
+/* Look for new mempool txs, if we're not already. */
+void mempool_poll(struct lightningd_state *dstate);
+
+/* This tx is in a block: true if its spends were already fired from the
+ * mempool (so don't fire them again). */
+bool mempool_tx_mined(struct lightningd_state *dstate,
+		      const struct sha256_double *txid);
+#endif /* LIGHTNING_DAEMON_MEMPOOL_H */
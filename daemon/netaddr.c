@@ -6,7 +6,6 @@
 #include <ccan/cast/cast.h>
 #include <ccan/endian/endian.h>
 #include <ccan/short_types/short_types.h>
-#include <ccan/str/hex/hex.h>
 #include <ccan/tal/str/str.h>
 #include <netdb.h>
 #include <stdio.h>
@@ -49,10 +48,9 @@ char *netaddr_name(const tal_t *ctx, const struct netaddr *a)
 	return tal_fmt(ctx, "%s:%u", name, port);
 }
 
-char *netaddr_to_hex(const tal_t *ctx, const struct netaddr *a)
+u8 *netaddr_to_blob(const tal_t *ctx, const struct netaddr *a)
 {
 	u8 *blob = tal_arr(ctx, u8, 0);
-	char *hex;
 
 	push_le32(a->type, push, &blob);
 	push_le32(a->protocol, push, &blob);
@@ -60,9 +58,7 @@ char *netaddr_to_hex(const tal_t *ctx, const struct netaddr *a)
 	assert(a->addrlen <= sizeof(a->saddr));
 	push(&a->saddr, a->addrlen, &blob);
 
-	hex = tal_hexstr(ctx, blob, tal_count(blob));
-	tal_free(blob);
-	return hex;
+	return blob;
 }
 
 bool netaddr_from_blob(const void *linear, size_t len, struct netaddr *a)
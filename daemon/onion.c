@@ -1,82 +1,308 @@
+#include "lightningd.h"
 #include "log.h"
 #include "onion.h"
 #include "peer.h"
 #include "protobuf_convert.h"
-#include "routing.h"
+#include "secrets.h"
+#include <assert.h>
+#include <ccan/build_assert/build_assert.h>
+#include <ccan/crypto/sha256/sha256.h>
+#include <ccan/mem/mem.h>
+#include <secp256k1_ecdh.h>
+#include <sodium/crypto_auth_hmacsha256.h>
+#include <sodium/crypto_stream_chacha20.h>
+#include <sodium/randombytes.h>
+#include <sodium/utils.h>
 #include <string.h>
 
-/* FIXME: http://www.cypherpunks.ca/~iang/pubs/Sphinx_Oakland09.pdf */
+/* Sphinx (http://www.cypherpunks.ca/~iang/pubs/Sphinx_Oakland09.pdf):
+ *
+ *   ephemeral key | ONION_MAX_HOPS * (hop data | hmac) | hmac
+ *
+ * Every hop sees the same size, whatever its position in the route.  Each
+ * does one ECDH with the ephemeral key, checks the hmac, decrypts and
+ * shifts its own hop off the front, and blinds the ephemeral key for the
+ * next: the same work, however long the route. */
+#define ONION_HOP_DATA_LEN 64
+#define ONION_HMAC_LEN 32
+#define ONION_HOP_LEN (ONION_HOP_DATA_LEN + ONION_HMAC_LEN)
+#define ONION_ROUTING_LEN (ONION_MAX_HOPS * ONION_HOP_LEN)
 
-/* Frees r */
-static const u8 *to_onion(const tal_t *ctx, const Route *r)
+/* Retried HTLCs (eg. after reconnect) bring the same onion again: we keep
+ * the last few shared secrets rather than redo the ECDH. */
+#define ONION_CACHE_SIZE 32
+
+struct onion_cache {
+	struct onion_secret {
+		u8 ephemeral[PUBKEY_DER_LEN];
+		struct sha256 secret;
+	} secrets[ONION_CACHE_SIZE];
+	size_t num, next;
+};
+
+/* What each hop derives from its shared secret. */
+struct hop_keys {
+	/* Stream key, to encrypt the routing info. */
+	u8 rho[crypto_stream_chacha20_KEYBYTES];
+	/* HMAC key. */
+	u8 mu[crypto_auth_hmacsha256_KEYBYTES];
+};
+
+static void derive_keys(const struct sha256 *secret, struct hop_keys *keys)
 {
-	u8 *onion = tal_arr(ctx, u8, route__get_packed_size(r));
-	route__pack(r, onion);
-	tal_free(r);
-	return onion;
+	BUILD_ASSERT(sizeof(keys->rho) == sizeof(struct sha256));
+	crypto_auth_hmacsha256(keys->rho, (const u8 *)"rho", 3, secret->u.u8);
+	crypto_auth_hmacsha256(keys->mu, (const u8 *)"mu", 2, secret->u.u8);
+}
+
+/* The factor which takes this hop's ephemeral key to the next one's. */
+static void blinding_factor(secp256k1_context *secpctx,
+			    const struct pubkey *ephemeral,
+			    const struct sha256 *secret,
+			    struct sha256 *blind)
+{
+	struct sha256_ctx ctx;
+	u8 der[PUBKEY_DER_LEN];
+
+	pubkey_to_der(secpctx, der, ephemeral);
+	sha256_init(&ctx);
+	sha256_update(&ctx, der, sizeof(der));
+	sha256_update(&ctx, secret->u.u8, sizeof(secret->u.u8));
+	sha256_done(&ctx, blind);
+}
+
+static void stream_xor(const struct hop_keys *keys, u8 *data, size_t len)
+{
+	static const u8 nonce[crypto_stream_chacha20_NONCEBYTES];
+
+	crypto_stream_chacha20_xor(data, data, len, nonce, keys->rho);
+}
+
+static void xor_bytes(u8 *dst, const u8 *src, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		dst[i] ^= src[i];
+}
+
+/* Length-prefixed RouteStep, padded out to ONION_HOP_DATA_LEN. */
+static void hop_data(u8 *dst, secp256k1_context *secpctx,
+		     const struct pubkey *next, u64 amount)
+{
+	RouteStep step;
+	BitcoinPubkey *key = NULL;
+	size_t len;
+
+	route_step__init(&step);
+	if (next) {
+		step.next_case = ROUTE_STEP__NEXT_BITCOIN;
+		step.bitcoin = key = pubkey_to_proto(NULL, secpctx, next);
+		step.amount = amount;
+	} else {
+		step.next_case = ROUTE_STEP__NEXT_END;
+		step.end = true;
+		step.amount = 0;
+	}
+
+	len = route_step__get_packed_size(&step);
+	assert(len < ONION_HOP_DATA_LEN);
+	memset(dst, 0, ONION_HOP_DATA_LEN);
+	dst[0] = len;
+	route_step__pack(&step, dst + 1);
+	tal_free(key);
+}
+
+/* The end of the routing info, as the last hop will see it: what each hop
+ * before it shifted in (zeroes) and then decrypted. */
+static void make_filler(u8 *filler, const struct hop_keys *keys,
+			size_t num_hops)
+{
+	u8 stream[ONION_ROUTING_LEN + ONION_HOP_LEN];
+	size_t i, len;
+
+	memset(filler, 0, (num_hops - 1) * ONION_HOP_LEN);
+	for (i = 0; i + 1 < num_hops; i++) {
+		len = (i + 1) * ONION_HOP_LEN;
+		memset(stream, 0, sizeof(stream));
+		stream_xor(&keys[i], stream, sizeof(stream));
+		xor_bytes(filler, stream + sizeof(stream) - len, len);
+	}
 }
 
-/* Create an onion for this path. */
+/* Create an onion for this path: ids[0] is the first to unwrap it. */
 const u8 *onion_create(const tal_t *ctx,
 		       secp256k1_context *secpctx,
 		       const struct pubkey *ids,
 		       const u64 *amounts,
 		       size_t num_hops)
 {
-	Route *r = tal(ctx, Route);
+	struct hop_keys keys[ONION_MAX_HOPS];
+	u8 filler[(ONION_MAX_HOPS - 1) * ONION_HOP_LEN];
+	u8 *onion = tal_arr(ctx, u8, ONION_LEN), *routing, *hmac;
+	struct pubkey ephemeral;
+	u8 seckey[32];
 	size_t i;
 
-	route__init(r);
-	r->n_steps = num_hops + 1;
-	r->steps = tal_arr(r, RouteStep *, r->n_steps);
+	BUILD_ASSERT(ONION_LEN == PUBKEY_DER_LEN + ONION_ROUTING_LEN
+		     + ONION_HMAC_LEN);
+	assert(num_hops > 0 && num_hops <= ONION_MAX_HOPS);
 
+	do
+		randombytes_buf(seckey, sizeof(seckey));
+	while (!secp256k1_ec_seckey_verify(secpctx, seckey));
+	if (!secp256k1_ec_pubkey_create(secpctx, &ephemeral.pubkey, seckey))
+		abort();
+	pubkey_to_der(secpctx, onion, &ephemeral);
+
+	/* We blind our secret key alongside the ephemeral key, so each
+	 * hop's ephemeral key is a (fast) generator multiplication. */
 	for (i = 0; i < num_hops; i++) {
-		r->steps[i] = tal(r, RouteStep);
-		route_step__init(r->steps[i]);
-		r->steps[i]->next_case = ROUTE_STEP__NEXT_BITCOIN;
-		r->steps[i]->bitcoin = pubkey_to_proto(r, secpctx, &ids[i]);
-		r->steps[i]->amount = amounts[i];
+		struct sha256 secret, blind;
+
+		if (!secp256k1_ecdh(secpctx, secret.u.u8,
+				    &ids[i].pubkey, seckey))
+			abort();
+		derive_keys(&secret, &keys[i]);
+		blinding_factor(secpctx, &ephemeral, &secret, &blind);
+		if (!secp256k1_ec_privkey_tweak_mul(secpctx, seckey,
+						    blind.u.u8)
+		    || !secp256k1_ec_pubkey_create(secpctx, &ephemeral.pubkey,
+						   seckey))
+			abort();
+	}
+	make_filler(filler, keys, num_hops);
+
+	/* Wrap from the inside out. */
+	routing = onion + PUBKEY_DER_LEN;
+	hmac = routing + ONION_ROUTING_LEN;
+	memset(routing, 0, ONION_ROUTING_LEN);
+	memset(hmac, 0, ONION_HMAC_LEN);
+	for (i = num_hops; i-- > 0;) {
+		memmove(routing + ONION_HOP_LEN, routing,
+			ONION_ROUTING_LEN - ONION_HOP_LEN);
+		if (i + 1 < num_hops)
+			hop_data(routing, secpctx, &ids[i+1], amounts[i+1]);
+		else
+			hop_data(routing, secpctx, NULL, 0);
+		memcpy(routing + ONION_HOP_DATA_LEN, hmac, ONION_HMAC_LEN);
+		stream_xor(&keys[i], routing, ONION_ROUTING_LEN);
+		if (i == num_hops - 1)
+			memcpy(routing + ONION_ROUTING_LEN
+			       - (num_hops - 1) * ONION_HOP_LEN,
+			       filler, (num_hops - 1) * ONION_HOP_LEN);
+		crypto_auth_hmacsha256(hmac, routing, ONION_ROUTING_LEN,
+				       keys[i].mu);
+	}
+
+	memset(seckey, 0, sizeof(seckey));
+	return onion;
+}
+
+static void onion_shared_secret(struct lightningd_state *dstate,
+				const u8 *der, const struct pubkey *ephemeral,
+				struct sha256 *secret)
+{
+	struct onion_cache *cache = dstate->onion_cache;
+	struct onion_secret *s;
+	size_t i;
+
+	if (!cache) {
+		cache = dstate->onion_cache = tal(dstate, struct onion_cache);
+		cache->num = cache->next = 0;
+	}
+
+	for (i = 0; i < cache->num; i++) {
+		if (memcmp(cache->secrets[i].ephemeral, der,
+			   PUBKEY_DER_LEN) == 0) {
+			*secret = cache->secrets[i].secret;
+			return;
+		}
 	}
 
-	/* Now the stop marker. */
-	r->steps[i] = tal(r, RouteStep);
-	route_step__init(r->steps[i]);
-	r->steps[i]->next_case = ROUTE_STEP__NEXT_END;
-	r->steps[i]->end = true;
-	r->steps[i]->amount = 0;
+	privkey_ecdh(dstate, ephemeral, secret);
 
-	return to_onion(ctx, r);
+	s = &cache->secrets[cache->next];
+	memcpy(s->ephemeral, der, PUBKEY_DER_LEN);
+	s->secret = *secret;
+	cache->next = (cache->next + 1) % ONION_CACHE_SIZE;
+	if (cache->num < ONION_CACHE_SIZE)
+		cache->num++;
 }
 
 /* Decode next step in the route, and fill out the onion to send onwards. */
-RouteStep *onion_unwrap(struct peer *peer,
+RouteStep *onion_unwrap(const tal_t *ctx, struct peer *peer,
 			const void *data, size_t len, const u8 **next)
 {
-	struct ProtobufCAllocator *prototal = make_prototal(peer);
-	Route *r;
+	secp256k1_context *secpctx = peer->dstate->secpctx;
+	struct ProtobufCAllocator *prototal;
+	u8 routing[ONION_ROUTING_LEN + ONION_HOP_LEN];
+	u8 hmac[ONION_HMAC_LEN];
+	const u8 *in = data;
+	struct sha256 secret, blind;
+	struct pubkey ephemeral;
+	struct hop_keys keys;
 	RouteStep *step;
+	u8 *out;
 
-	r = route__unpack(prototal, len, data);
-	if (!r || r->n_steps == 0) { 
+	*next = NULL;
+	if (len != ONION_LEN
+	    || !pubkey_from_der(secpctx, in, PUBKEY_DER_LEN, &ephemeral)) {
+		log_unusual(peer->log, "Malformed onion (%zu bytes)", len);
+		return NULL;
+	}
+
+	onion_shared_secret(peer->dstate, in, &ephemeral, &secret);
+	derive_keys(&secret, &keys);
+
+	crypto_auth_hmacsha256(hmac, in + PUBKEY_DER_LEN, ONION_ROUTING_LEN,
+			       keys.mu);
+	if (sodium_memcmp(hmac, in + PUBKEY_DER_LEN + ONION_ROUTING_LEN,
+			  sizeof(hmac)) != 0) {
+		log_unusual(peer->log, "Onion hmac mismatch");
+		return NULL;
+	}
+
+	/* Decrypt, with zeroes shifted in to replace our hop. */
+	memcpy(routing, in + PUBKEY_DER_LEN, ONION_ROUTING_LEN);
+	memset(routing + ONION_ROUTING_LEN, 0, ONION_HOP_LEN);
+	stream_xor(&keys, routing, sizeof(routing));
+
+	prototal = make_prototal(peer);
+	step = routing[0] < ONION_HOP_DATA_LEN
+		? route_step__unpack(prototal, routing[0], routing + 1) : NULL;
+	if (!step) {
 		log_unusual(peer->log, "Failed to unwrap onion");
 		tal_free(prototal);
 		return NULL;
 	}
-
-	/* Remove first step. */
-	step = r->steps[0];
 	/* Make sure that step owns the rest */
-	steal_from_prototal(peer, prototal, step);
-
-	/* Re-pack with remaining steps. */
-	r->n_steps--;
-	memmove(r->steps, r->steps + 1, sizeof(*r->steps) * r->n_steps);
+	steal_from_prototal(ctx, prototal, step);
 
-	if (!r->n_steps) {
-		*next = NULL;
-		tal_free(r);
-	} else
-		*next = to_onion(peer, r);
+	/* An all-zero hmac means nobody is after us. */
+	if (memeqzero(routing + ONION_HOP_DATA_LEN, ONION_HMAC_LEN)) {
+		if (step->next_case == ROUTE_STEP__NEXT_BITCOIN) {
+			log_unusual(peer->log, "Onion ends before its route");
+			tal_free(step);
+			return NULL;
+		}
+		return step;
+	}
 
+	out = tal_arr(ctx, u8, ONION_LEN);
+	blinding_factor(secpctx, &ephemeral, &secret, &blind);
+	if (!secp256k1_ec_pubkey_tweak_mul(secpctx, &ephemeral.pubkey,
+					   blind.u.u8)) {
+		log_unusual(peer->log, "Onion blinding failed");
+		tal_free(out);
+		tal_free(step);
+		return NULL;
+	}
+	pubkey_to_der(secpctx, out, &ephemeral);
+	memcpy(out + PUBKEY_DER_LEN, routing + ONION_HOP_LEN,
+	       ONION_ROUTING_LEN);
+	memcpy(out + PUBKEY_DER_LEN + ONION_ROUTING_LEN,
+	       routing + ONION_HOP_DATA_LEN, ONION_HMAC_LEN);
+	*next = out;
 	return step;
 }
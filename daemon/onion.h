@@ -1,18 +1,28 @@
 #ifndef LIGHTNING_DAEMON_ONION_H
 #define LIGHTNING_DAEMON_ONION_H
 #include "config.h"
+#include "bitcoin/pubkey.h"
 #include "lightning.pb-c.h"
+#include "routing.h"
 #include <ccan/short_types/short_types.h>
 #include <secp256k1.h>
 
 struct peer;
 struct node_connection;
 
-/* Decode next step in the route, and fill out the onion to send onwards. */
-RouteStep *onion_unwrap(struct peer *peer,
+/* The route from us, then whoever we hand it to. */
+#define ONION_MAX_HOPS (ROUTING_MAX_HOPS + 1)
+
+/* Every onion is this long, wherever it is in its route. */
+#define ONION_LEN (PUBKEY_DER_LEN + ONION_MAX_HOPS * (64 + 32) + 32)
+
+/* Decode next step in the route, and fill out the onion to send onwards:
+ * both are allocated off ctx, so the onion can be handed on with take(). */
+RouteStep *onion_unwrap(const tal_t *ctx, struct peer *peer,
 			const void *data, size_t len, const u8 **next);
 
-/* Create an onion for sending msatoshi down path, paying fees. */
+/* Create an onion for sending msatoshi down path, paying fees: ids[0] is
+ * the first to unwrap it, to find ids[1] and amounts[1]. */
 const u8 *onion_create(const tal_t *ctx,
 		       secp256k1_context *secpctx,
 		       const struct pubkey *ids,
@@ -5,10 +5,12 @@
 #include "commit_tx.h"
 #include "controlled_time.h"
 #include "cryptopkt.h"
+#include "db.h"
 #include "htlc.h"
 #include "lightningd.h"
 #include "log.h"
 #include "names.h"
+#include "onion.h"
 #include "packets.h"
 #include "peer.h"
 #include "protobuf_convert.h"
@@ -16,6 +18,7 @@
 #include "state.h"
 #include "utils.h"
 #include <ccan/array_size/array_size.h>
+#include <ccan/container_of/container_of.h>
 #include <ccan/crypto/sha256/sha256.h>
 #include <ccan/io/io.h>
 #include <ccan/mem/mem.h>
@@ -25,6 +28,24 @@
 #include <ccan/tal/str/str.h>
 #include <inttypes.h>
 
+/* This makes sure all packets are valid. */
+static void check_pkt(const Pkt *pkt)
+{
+#ifndef NDEBUG
+	size_t len;
+	u8 *packed;
+	Pkt *cpy;
+
+	len = pkt__get_packed_size(pkt);
+	packed = tal_arr(NULL, u8, len);
+	pkt__pack(pkt, packed);
+	cpy = pkt__unpack(NULL, len, memcheck(packed, len));
+	assert(cpy);
+	pkt__free_unpacked(cpy, NULL);
+	tal_free(packed);
+#endif
+}
+
 /* Wrap (and own!) member inside Pkt */
 static Pkt *make_pkt(const tal_t *ctx, Pkt__PktCase type, const void *msg)
 {
@@ -35,30 +56,141 @@ static Pkt *make_pkt(const tal_t *ctx, Pkt__PktCase type, const void *msg)
 	/* This is a union, so doesn't matter which we assign. */
 	pkt->error = (Error *)tal_steal(pkt, msg);
 
-	/* This makes sure all packets are valid. */
-#ifndef NDEBUG
-	{
-		size_t len;
-		u8 *packed;
-		Pkt *cpy;
-		
-		len = pkt__get_packed_size(pkt);
-		packed = tal_arr(pkt, u8, len);
-		pkt__pack(pkt, packed);
-		cpy = pkt__unpack(NULL, len, memcheck(packed, len));
-		assert(cpy);
-		pkt__free_unpacked(cpy, NULL);
-		tal_free(packed);
-	}
-#endif
+	check_pkt(pkt);
 	return pkt;
 }
 
+/* The packets we send most are each built in one allocation, and reused
+ * once sent, rather than built from a fresh tree of tal allocations. */
+struct pooled_pkt {
+	Pkt pkt;
+	union {
+		struct {
+			UpdateAddHtlc msg;
+			Sha256Hash rhash;
+			Locktime expiry;
+			Routing route;
+			u8 onion[ONION_LEN];
+		} add;
+		struct {
+			UpdateFulfillHtlc msg;
+			Rval r;
+		} fulfill;
+		struct {
+			UpdateCommit msg;
+			Signature sig;
+		} commit;
+		struct {
+			UpdateRevocation msg;
+			Sha256Hash preimage, next_hash;
+		} revocation;
+	} u;
+	/* Routing which isn't ONION_LEN (eg. from an older db), or NULL. */
+	u8 *spill;
+	/* On peer->pkt_pool, once sent. */
+	struct pooled_pkt *next;
+};
+
+/* Enough to refill a whole write. */
+#define PKT_POOL_MAX PEER_WRITE_MAX_PKTS
+
+static bool is_pooled(Pkt__PktCase type)
+{
+	return type == PKT__PKT_UPDATE_ADD_HTLC
+		|| type == PKT__PKT_UPDATE_FULFILL_HTLC
+		|| type == PKT__PKT_UPDATE_COMMIT
+		|| type == PKT__PKT_UPDATE_REVOCATION;
+}
+
+static struct pooled_pkt *get_pooled_pkt(struct peer *peer,
+					 Pkt__PktCase type)
+{
+	struct pooled_pkt *p = peer->pkt_pool;
+
+	assert(is_pooled(type));
+	if (p) {
+		peer->pkt_pool = p->next;
+		peer->pkt_pool_len--;
+	} else
+		p = tal(peer, struct pooled_pkt);
+
+	pkt__init(&p->pkt);
+	p->pkt.pkt_case = type;
+	p->spill = NULL;
+	return p;
+}
+
+void free_sent_pkt(struct peer *peer, Pkt *pkt)
+{
+	struct pooled_pkt *p;
+
+	if (!is_pooled(pkt->pkt_case) || peer->pkt_pool_len == PKT_POOL_MAX) {
+		tal_free(pkt);
+		return;
+	}
+
+	p = container_of(pkt, struct pooled_pkt, pkt);
+	p->spill = tal_free(p->spill);
+	p->next = peer->pkt_pool;
+	peer->pkt_pool = p;
+	peer->pkt_pool_len++;
+}
+
+void free_pkt_pool(struct peer *peer)
+{
+	struct pooled_pkt *p;
+
+	while ((p = peer->pkt_pool) != NULL) {
+		peer->pkt_pool = p->next;
+		tal_free(p);
+	}
+	peer->pkt_pool_len = 0;
+}
+
+const struct out_pkt *queued_pkt(const struct peer *peer, size_t i)
+{
+	size_t mask = tal_count(peer->outpkt) - 1;
+
+	assert(i < peer->num_outpkt);
+	return &peer->outpkt[(peer->outpkt_start + i) & mask];
+}
+
+void drop_queued_pkts(struct peer *peer, size_t n)
+{
+	size_t i, mask = tal_count(peer->outpkt) - 1;
+
+	assert(n <= peer->num_outpkt);
+	for (i = 0; i < n; i++)
+		peer->outpkt_bytes -= queued_pkt(peer, i)->len;
+	peer->outpkt_start = (peer->outpkt_start + n) & mask;
+	peer->num_outpkt -= n;
+}
+
 static void queue_raw_pkt(struct peer *peer, Pkt *pkt)
 {
-	size_t n = tal_count(peer->outpkt);
-	tal_resize(&peer->outpkt, n+1);
-	peer->outpkt[n] = pkt;
+	size_t size = tal_count(peer->outpkt);
+	struct out_pkt *o;
+
+	/* Full?  Double it, unwrapping as we go. */
+	if (peer->num_outpkt == size) {
+		size_t i;
+		struct out_pkt *ring;
+
+		ring = tal_arr(peer, struct out_pkt, size ? size * 2 : 4);
+		for (i = 0; i < peer->num_outpkt; i++)
+			ring[i] = *queued_pkt(peer, i);
+		tal_free(peer->outpkt);
+		peer->outpkt = ring;
+		peer->outpkt_start = 0;
+		size = tal_count(ring);
+	}
+
+	o = &peer->outpkt[(peer->outpkt_start + peer->num_outpkt) & (size - 1)];
+	o->pkt = pkt;
+	o->batch = db_batch_stamp(peer->dstate);
+	o->len = pkt__get_packed_size(pkt);
+	peer->num_outpkt++;
+	peer->outpkt_bytes += o->len;
 
 	log_debug(peer->log, "Queued pkt %s (order=%"PRIu64")",
 		  pkt_name(pkt->pkt_case), peer->order_counter);
@@ -134,34 +266,49 @@ void queue_pkt_open_complete(struct peer *peer)
 
 void queue_pkt_htlc_add(struct peer *peer, struct htlc *htlc)
 {
-	UpdateAddHtlc *u = tal(peer, UpdateAddHtlc);
+	struct pooled_pkt *p = get_pooled_pkt(peer, PKT__PKT_UPDATE_ADD_HTLC);
+	UpdateAddHtlc *u = &p->u.add.msg;
+	const u8 *routing = db_htlc_routing(htlc);
+	size_t len = tal_count(routing);
 
 	update_add_htlc__init(u);
 
 	u->id = htlc->id;
 	u->amount_msat = htlc->msatoshi;
-	u->r_hash = sha256_to_proto(u, &htlc->rhash);
-	u->expiry = abs_locktime_to_proto(u, &htlc->expiry);
-	u->route = tal(u, Routing);
-	routing__init(u->route);
-	u->route->info.data = tal_dup_arr(u, u8,
-					  htlc->routing,
-					  tal_count(htlc->routing),
-					  0);
-	u->route->info.len = tal_count(u->route->info.data);
-
-	queue_pkt(peer, PKT__PKT_UPDATE_ADD_HTLC, u);
+	sha256_fill_proto(&p->u.add.rhash, &htlc->rhash);
+	u->r_hash = &p->u.add.rhash;
+	abs_locktime_fill_proto(&p->u.add.expiry, &htlc->expiry);
+	u->expiry = &p->u.add.expiry;
+	routing__init(&p->u.add.route);
+	u->route = &p->u.add.route;
+	if (len == sizeof(p->u.add.onion)) {
+		memcpy(p->u.add.onion, routing, len);
+		u->route->info.data = p->u.add.onion;
+	} else
+		u->route->info.data = p->spill
+			= tal_dup_arr(p, u8, routing, len, 0);
+	u->route->info.len = len;
+
+	p->pkt.update_add_htlc = u;
+	check_pkt(&p->pkt);
+	queue_raw_pkt(peer, &p->pkt);
 }
 
 void queue_pkt_htlc_fulfill(struct peer *peer, struct htlc *htlc)
 {
-	UpdateFulfillHtlc *f = tal(peer, UpdateFulfillHtlc);
+	struct pooled_pkt *p;
+	UpdateFulfillHtlc *f;
 
+	p = get_pooled_pkt(peer, PKT__PKT_UPDATE_FULFILL_HTLC);
+	f = &p->u.fulfill.msg;
 	update_fulfill_htlc__init(f);
 	f->id = htlc->id;
-	f->r = rval_to_proto(f, htlc->r);
+	rval_fill_proto(&p->u.fulfill.r, htlc->r);
+	f->r = &p->u.fulfill.r;
 
-	queue_pkt(peer, PKT__PKT_UPDATE_FULFILL_HTLC, f);
+	p->pkt.update_fulfill_htlc = f;
+	check_pkt(&p->pkt);
+	queue_raw_pkt(peer, &p->pkt);
 }
 
 void queue_pkt_htlc_fail(struct peer *peer, struct htlc *htlc)
@@ -193,17 +340,23 @@ void queue_pkt_feechange(struct peer *peer, u64 feerate)
 /* OK, we're sending a signature for their pending changes. */
 void queue_pkt_commit(struct peer *peer, const struct bitcoin_signature *sig)
 {
-	UpdateCommit *u = tal(peer, UpdateCommit);
+	struct pooled_pkt *p = get_pooled_pkt(peer, PKT__PKT_UPDATE_COMMIT);
+	UpdateCommit *u = &p->u.commit.msg;
+
+	peer->commit_sent = time_now();
 
 	/* Now send message */
 	update_commit__init(u);
-	if (sig)
-		u->sig = signature_to_proto(u, peer->dstate->secpctx,
-					    &sig->sig);
-	else
+	if (sig) {
+		signature_fill_proto(peer->dstate->secpctx,
+				     &p->u.commit.sig, &sig->sig);
+		u->sig = &p->u.commit.sig;
+	} else
 		u->sig = NULL;
 
-	queue_pkt(peer, PKT__PKT_UPDATE_COMMIT, u);
+	p->pkt.update_commit = u;
+	check_pkt(&p->pkt);
+	queue_raw_pkt(peer, &p->pkt);
 }
 
 
@@ -213,13 +366,20 @@ void queue_pkt_revocation(struct peer *peer,
 			  const struct sha256 *preimage,
 			  const struct sha256 *next_hash)
 {
-	UpdateRevocation *u = tal(peer, UpdateRevocation);
+	struct pooled_pkt *p = get_pooled_pkt(peer,
+					      PKT__PKT_UPDATE_REVOCATION);
+	UpdateRevocation *u = &p->u.revocation.msg;
 
 	update_revocation__init(u);
 
-	u->revocation_preimage = sha256_to_proto(u, preimage);
-	u->next_revocation_hash	= sha256_to_proto(u, next_hash);
-	queue_pkt(peer, PKT__PKT_UPDATE_REVOCATION, u);
+	sha256_fill_proto(&p->u.revocation.preimage, preimage);
+	u->revocation_preimage = &p->u.revocation.preimage;
+	sha256_fill_proto(&p->u.revocation.next_hash, next_hash);
+	u->next_revocation_hash = &p->u.revocation.next_hash;
+
+	p->pkt.update_revocation = u;
+	check_pkt(&p->pkt);
+	queue_raw_pkt(peer, &p->pkt);
 }
 
 Pkt *pkt_err(struct peer *peer, const char *msg, ...)
@@ -423,6 +583,7 @@ Pkt *accept_pkt_htlc_add(struct peer *peer, const Pkt *pkt, struct htlc **h)
 			   abs_locktime_to_blocks(&expiry),
 			   u->route->info.data, u->route->info.len,
 			   NULL, RCVD_ADD_HTLC);
+	peer->usage.htlcs_received++;
 	return NULL;
 }
 
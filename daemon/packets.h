@@ -8,6 +8,7 @@ struct htlc;
 struct sha256;
 struct bitcoin_signature;
 struct commit_info;
+struct out_pkt;
 
 /* Send various kinds of packets */
 void queue_pkt_open(struct peer *peer, OpenChannel__AnchorOffer anchor);
@@ -25,6 +26,15 @@ void queue_pkt_revocation(struct peer *peer,
 void queue_pkt_close_shutdown(struct peer *peer);
 void queue_pkt_close_signature(struct peer *peer);
 
+/* The output queue, oldest first. */
+const struct out_pkt *queued_pkt(const struct peer *peer, size_t i);
+void drop_queued_pkts(struct peer *peer, size_t n);
+
+/* Done with a packet from the queue (it may be kept for reuse). */
+void free_sent_pkt(struct peer *peer, Pkt *pkt);
+/* Free the ones kept for reuse. */
+void free_pkt_pool(struct peer *peer);
+
 Pkt *pkt_err(struct peer *peer, const char *msg, ...);
 Pkt *pkt_reconnect(struct peer *peer, u64 ack);
 void queue_pkt_err(struct peer *peer, Pkt *err);
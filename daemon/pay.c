@@ -1,5 +1,6 @@
 #include "chaintopology.h"
 #include "db.h"
+#include "events.h"
 #include "failure.h"
 #include "jsonrpc.h"
 #include "lightningd.h"
@@ -8,13 +9,19 @@
 #include "pay.h"
 #include "peer.h"
 #include "routing.h"
+#include "timeout.h"
+#include <assert.h>
+#include <ccan/crypto/siphash24/siphash24.h>
+#include <ccan/htable/htable_type.h>
+#include <ccan/list/list.h>
 #include <ccan/str/hex/hex.h>
 #include <ccan/structeq/structeq.h>
+#include <ccan/tal/str/str.h>
 #include <inttypes.h>
 
-/* Outstanding "pay" commands. */
+/* Outstanding "pay" commands.  Finished ones live only in the database,
+ * until someone asks about them again. */
 struct pay_command {
-	struct list_node list;
 	struct sha256 rhash;
 	u64 msatoshi;
 	const struct pubkey *ids;
@@ -22,8 +29,129 @@ struct pay_command {
 	struct htlc *htlc;
 	/* Preimage if this succeeded. */
 	const struct rval *rval;
+	/* Who is waiting: a sendpay, or one of a sendpays batch. */
 	struct command *cmd;
+	struct pay_batch *batch;
+	size_t batch_idx;
+	/* Or someone inside the daemon (see pay_route). */
+	void (*cb)(const struct rval *rval, void *arg);
+	void *cbarg;
+	/* Multi-path: every part still in flight (htlc is the first), and
+	 * why any failed.  The database has each part (see pay_add_part). */
+	struct pay_part {
+		struct htlc *htlc;
+		const struct pubkey *ids;
+	} *parts;
+	const char *part_error;
+};
+
+static const struct sha256 *pay_command_key(const struct pay_command *pc)
+{
+	return &pc->rhash;
+}
+static size_t pay_command_hash(const struct sha256 *rhash)
+{
+	return siphash24(siphash_seed(), rhash, sizeof(*rhash));
+}
+static bool pay_command_eq(const struct pay_command *pc,
+			   const struct sha256 *rhash)
+{
+	return structeq(&pc->rhash, rhash);
+}
+HTABLE_DEFINE_TYPE(struct pay_command, pay_command_key, pay_command_hash,
+		   pay_command_eq, pay_command_map);
+
+/* A route getroute found, with its onion already built, so sendpay can
+ * be handed its id instead of the whole route.  Used once, or forgotten
+ * after ROUTE_HANDLE_SECS. */
+#define ROUTE_HANDLE_SECS 60
+/* A client which never uses them can't make us keep more than this. */
+#define ROUTE_HANDLES_MAX 64
+
+struct route_handle {
+	struct list_node list;
+	struct route_handles *handles;
+	u64 id;
+	struct pubkey *ids;
+	u64 *amounts;
+	unsigned int delay;
+	const u8 *onion;
 };
+
+struct route_handles {
+	struct list_head list;
+	size_t num;
+	u64 next_id;
+};
+
+void pay_init(struct lightningd_state *dstate)
+{
+	dstate->pay_commands = tal(dstate, struct pay_command_map);
+	pay_command_map_init(dstate->pay_commands);
+
+	dstate->route_handles = tal(dstate, struct route_handles);
+	list_head_init(&dstate->route_handles->list);
+	dstate->route_handles->num = 0;
+	dstate->route_handles->next_id = 1;
+}
+
+static void destroy_route_handle(struct route_handle *rh)
+{
+	list_del_from(&rh->handles->list, &rh->list);
+	rh->handles->num--;
+}
+
+static void route_handle_expired(struct route_handle *rh)
+{
+	tal_free(rh);
+}
+
+static struct route_handle *new_route_handle(struct lightningd_state *dstate,
+					     struct pubkey *ids,
+					     u64 *amounts,
+					     unsigned int delay)
+{
+	struct route_handles *handles = dstate->route_handles;
+	struct route_handle *rh;
+
+	if (handles->num == ROUTE_HANDLES_MAX)
+		tal_free(list_top(&handles->list, struct route_handle, list));
+
+	rh = tal(handles, struct route_handle);
+	rh->handles = handles;
+	rh->id = handles->next_id++;
+	rh->ids = tal_steal(rh, ids);
+	rh->amounts = tal_steal(rh, amounts);
+	rh->delay = delay;
+	/* The first peer gets it: the onion carries us from there. */
+	rh->onion = onion_create(rh, dstate->secpctx, ids, amounts,
+				 tal_count(ids));
+	list_add_tail(&handles->list, &rh->list);
+	handles->num++;
+	tal_add_destructor(rh, destroy_route_handle);
+	new_reltimer(dstate, rh, time_from_sec(ROUTE_HANDLE_SECS),
+		     route_handle_expired, rh);
+	return rh;
+}
+
+static struct route_handle *find_route_handle(struct lightningd_state *dstate,
+					      u64 id)
+{
+	struct route_handle *rh;
+
+	list_for_each(&dstate->route_handles->list, rh, list)
+		if (rh->id == id)
+			return rh;
+	return NULL;
+}
+
+static void forget_pay_command(struct lightningd_state *dstate,
+			       struct pay_command *pc)
+{
+	pay_command_map_del(dstate->pay_commands, pc);
+	tal_free(pc);
+}
+
 static void json_pay_success(struct command *cmd, const struct rval *rval)
 {
 	struct json_result *response;
@@ -35,32 +163,35 @@ static void json_pay_success(struct command *cmd, const struct rval *rval)
 	command_success(cmd, response);
 }
 
-static void handle_json(struct command *cmd, const struct htlc *htlc,
-			const FailInfo *f)
+static const char *pay_failure(const tal_t *ctx,
+			       struct lightningd_state *dstate,
+			       const FailInfo *f)
 {
 	struct pubkey id;
 	const char *idstr = "INVALID";
 
-	if (htlc->r) {
-		json_pay_success(cmd, htlc->r);
-		return;
-	}
+	if (!f)
+		return "failed (bad message)";
 
-	if (!f) {
-		command_fail(cmd, "failed (bad message)");
-		return;
-	}
+	if (proto_to_pubkey(dstate->secpctx, f->id, &id))
+		idstr = pubkey_to_hexstr(ctx, dstate->secpctx, &id);
 
-	if (proto_to_pubkey(cmd->dstate->secpctx, f->id, &id))
-		idstr = pubkey_to_hexstr(cmd, cmd->dstate->secpctx, &id);
+	return tal_fmt(ctx, "failed: error code %u node %s reason %s",
+		       f->error_code, idstr, f->reason ? f->reason : "unknown");
+}
 
-	command_fail(cmd,
-		     "failed: error code %u node %s reason %s",
-		     f->error_code, idstr, f->reason ? f->reason : "unknown");
+static void handle_json(struct command *cmd, const struct htlc *htlc,
+			const FailInfo *f)
+{
+	if (htlc->r)
+		json_pay_success(cmd, htlc->r);
+	else
+		command_fail(cmd, "%s",
+			     pay_failure(cmd, cmd->dstate, f));
 }
 
 static void check_routing_failure(struct lightningd_state *dstate,
-				  const struct pay_command *pc,
+				  const struct pubkey *ids,
 				  const FailInfo *f)
 {
 	size_t i;
@@ -69,7 +200,7 @@ static void check_routing_failure(struct lightningd_state *dstate,
 	if (!f)
 		return;
 
-	/* FIXME: We remove route on *any* failure. */
+	/* FIXME: We blame the route on *any* failure. */
 	log_debug(dstate->base_log, "Seeking route for fail code %u",
 		  f->error_code);
 	if (!proto_to_pubkey(dstate->secpctx, f->id, &id)) {
@@ -80,26 +211,86 @@ static void check_routing_failure(struct lightningd_state *dstate,
 	log_add_struct(dstate->base_log, " node %s", struct pubkey, &id);
 
 	/* Don't remove route if it's last node (obviously) */
-	for (i = 0; i+1 < tal_count(pc->ids); i++) {
-		if (structeq(&pc->ids[i], &id)) {
-			remove_connection(dstate, &pc->ids[i], &pc->ids[i+1]);
+	for (i = 0; i+1 < tal_count(ids); i++) {
+		if (structeq(&ids[i], &id)) {
+			/* They don't know the next node: it's gone. */
+			if (f->error_code == NOT_FOUND_404)
+				remove_connection(dstate, &ids[i],
+						  &ids[i+1]);
+			else
+				connection_failed(dstate, &ids[i],
+						  &ids[i+1]);
 			return;
 		}
 	}
 
-	if (structeq(&pc->ids[i], &id))
+	if (structeq(&ids[i], &id))
 		log_debug(dstate->base_log, "Final node: ignoring");
 	else
 		log_debug(dstate->base_log, "Node not on route: ignoring");
 }
 
+static void batch_payment_done(struct pay_batch *batch,
+			       const struct pay_command *pc,
+			       const struct htlc *htlc,
+			       const FailInfo *f);
+
+/* One part of a multi-path payment is done: any success is a success. */
+static bool complete_pay_part(struct lightningd_state *dstate,
+			      struct pay_command *pc,
+			      const struct htlc *htlc)
+{
+	size_t n = tal_count(pc->parts), k;
+
+	for (k = 0; k < n; k++)
+		if (pc->parts[k].htlc == htlc)
+			break;
+	if (k == n)
+		return false;
+
+	db_complete_pay_part(dstate, htlc);
+	if (htlc->r) {
+		if (!pc->rval) {
+			db_complete_pay_command(dstate, htlc);
+			pc->rval = tal_dup(pc, struct rval, htlc->r);
+			notify_payment(dstate, &pc->rhash, true);
+			if (pc->cmd)
+				json_pay_success(pc->cmd, pc->rval);
+		}
+	} else {
+		FailInfo *f = failinfo_unwrap(pc, htlc->fail,
+					      tal_count(htlc->fail));
+		check_routing_failure(dstate, pc->parts[k].ids, f);
+		if (!pc->part_error)
+			pc->part_error = pay_failure(pc, dstate, f);
+	}
+
+	pc->parts[k] = pc->parts[n-1];
+	tal_resize(&pc->parts, n-1);
+	if (n > 1)
+		return true;
+
+	/* That was the last one. */
+	pc->htlc = NULL;
+	if (!pc->rval) {
+		db_complete_pay_command(dstate, htlc);
+		notify_payment(dstate, &pc->rhash, false);
+		if (pc->cmd)
+			command_fail(pc->cmd, "%s", pc->part_error);
+	}
+	forget_pay_command(dstate, pc);
+	return true;
+}
+
 void complete_pay_command(struct lightningd_state *dstate,
 			  const struct htlc *htlc)
 {
 	struct pay_command *i;
 
-	list_for_each(&dstate->pay_commands, i, list) {
-		if (i->htlc == htlc) {
+	i = pay_command_map_get(dstate->pay_commands, &htlc->rhash);
+	if (i && i->parts && complete_pay_part(dstate, i, htlc))
+		return;
+	if (i && i->htlc == htlc) {
 			FailInfo *f = NULL;
 
 			db_complete_pay_command(dstate, htlc);
@@ -107,19 +298,24 @@ void complete_pay_command(struct lightningd_state *dstate,
 			if (htlc->r)
 				i->rval = tal_dup(i, struct rval, htlc->r);
 			else {
-				f = failinfo_unwrap(i->cmd, htlc->fail,
+				f = failinfo_unwrap(i, htlc->fail,
 						    tal_count(htlc->fail));
-				check_routing_failure(dstate, i, f);
+				check_routing_failure(dstate, i->ids, f);
 			}
 
 			/* No longer connected to live HTLC. */
 			i->htlc = NULL;
+			notify_payment(dstate, &i->rhash, htlc->r != NULL);
 
 			/* Can be NULL if JSON RPC goes away. */
 			if (i->cmd)
 				handle_json(i->cmd, htlc, f);
+			else if (i->batch)
+				batch_payment_done(i->batch, i, htlc, f);
+			else if (i->cb)
+				i->cb(i->rval, i->cbarg);
+			forget_pay_command(dstate, i);
 			return;
-		}
 	}
 
 	/* Can happen with testing low-level commands. */
@@ -127,19 +323,13 @@ void complete_pay_command(struct lightningd_state *dstate,
 		    htlc->id, htlc->r ? "fulfill" : "fail");
 }
 
-/* When JSON RPC goes away, cmd is freed: detach from any running paycommand */
-static void remove_cmd_from_pc(struct command *cmd)
+/* When JSON RPC goes away, cmd is freed: detach from the paycommand.
+ * This hangs off cmd, pointing to the pc. */
+static void remove_cmd_from_pc(struct pay_command **pcp)
 {
-	struct pay_command *pc;
-
-	list_for_each(&cmd->dstate->pay_commands, pc, list) {
-		if (pc->cmd == cmd) {
-			pc->cmd = NULL;
-			return;
-		}
-	}
-	/* We can reach here, in the case where another pay command
-	 * re-uses the pc->cmd before we get around to cleaning up. */
+	/* Another pay command may have re-used the pc already. */
+	if ((*pcp)->cmd == tal_parent(pcp))
+		(*pcp)->cmd = NULL;
 }
 
 static struct pay_command *find_pay_command(struct lightningd_state *dstate,
@@ -147,11 +337,10 @@ static struct pay_command *find_pay_command(struct lightningd_state *dstate,
 {
 	struct pay_command *pc;
 
-	list_for_each(&dstate->pay_commands, pc, list) {
-		if (structeq(rhash, &pc->rhash))
-			return pc;
-	}
-	return NULL;
+	pc = pay_command_map_get(dstate->pay_commands, rhash);
+	if (!pc && db_load_pay_command(dstate, rhash))
+		pc = pay_command_map_get(dstate->pay_commands, rhash);
+	return pc;
 }
 
 /* For database restore. */
@@ -165,7 +354,7 @@ bool pay_add(struct lightningd_state *dstate,
 {
 	struct pay_command *pc;
 
-	if (find_pay_command(dstate, rhash))
+	if (pay_command_map_get(dstate->pay_commands, rhash))
 		return false;
 
 	pc = tal(dstate, struct pay_command);
@@ -178,8 +367,38 @@ bool pay_add(struct lightningd_state *dstate,
 	else
 		pc->rval = NULL;
 	pc->cmd = NULL;
+	pc->batch = NULL;
+	pc->cb = NULL;
+	pc->parts = NULL;
+	pc->part_error = NULL;
+
+	pay_command_map_add(dstate->pay_commands, pc);
+	return true;
+}
+
+/* For database restore, after pay_add. */
+bool pay_add_part(struct lightningd_state *dstate,
+		  const struct sha256 *rhash,
+		  const struct pubkey *ids,
+		  struct htlc *htlc)
+{
+	struct pay_command *pc;
+	size_t n;
 
-	list_add_tail(&dstate->pay_commands, &pc->list);
+	pc = pay_command_map_get(dstate->pay_commands, rhash);
+	if (!pc)
+		return false;
+
+	if (!pc->parts)
+		pc->parts = tal_arr(pc, struct pay_part, 0);
+	n = tal_count(pc->parts);
+	tal_resize(&pc->parts, n+1);
+	pc->parts[n].htlc = htlc;
+	pc->parts[n].ids = tal_dup_arr(pc, struct pubkey, ids, tal_count(ids),
+				       0);
+	/* Still in progress, even if another part succeeded. */
+	if (!pc->htlc)
+		pc->htlc = htlc;
 	return true;
 }
 
@@ -195,25 +414,159 @@ static void json_add_route(struct json_result *response,
 	json_object_end(response);
 }
 
+/* Fees, delays need to be calculated backwards along route.  Returns the
+ * ids, and the amount and delay at each hop. */
+static struct pubkey *route_hops(const tal_t *ctx,
+				 struct lightningd_state *dstate,
+				 const struct peer *peer,
+				 const struct node_connection *route,
+				 u64 msatoshi,
+				 u64 **amountsp,
+				 unsigned int **delaysp)
+{
+	const struct node_connection *nc;
+	struct pubkey *ids;
+	u64 *amounts, total_amount;
+	unsigned int total_delay, *delays;
+	int i;
+
+	ids = tal_arr(ctx, struct pubkey, tal_count(route)+1);
+	amounts = *amountsp = tal_arr(ctx, u64, tal_count(route)+1);
+	delays = *delaysp = tal_arr(ctx, unsigned int, tal_count(route)+1);
+	total_amount = msatoshi;
+
+	total_delay = 0;
+	for (i = tal_count(route) - 1; i >= 0; i--) {
+		ids[i+1] = node_by_index(dstate->rstate, route[i].dst)->id;
+		amounts[i+1] = total_amount;
+		total_amount += connection_fee(&route[i], total_amount);
+
+		total_delay += route[i].delay;
+		if (total_delay < route[i].min_blocks)
+			total_delay = route[i].min_blocks;
+		delays[i+1] = total_delay;
+	}
+	/* We don't charge ourselves any fees. */
+	ids[0] = *peer->id;
+	amounts[0] = total_amount;
+	/* We do require delay though. */
+	nc = get_connection(dstate, &dstate->id, peer->id);
+	total_delay += nc->delay;
+	if (total_delay < nc->min_blocks)
+		total_delay = nc->min_blocks;
+	delays[0] = total_delay;
+	return ids;
+}
+
+static void json_add_hops(struct json_result *response,
+			  const char *fieldname,
+			  struct lightningd_state *dstate,
+			  const struct peer *peer,
+			  const struct node_connection *route,
+			  u64 msatoshi)
+{
+	struct pubkey *ids;
+	u64 *amounts;
+	unsigned int *delays;
+	size_t i;
+
+	ids = route_hops(response, dstate, peer, route, msatoshi,
+			 &amounts, &delays);
+
+	json_array_start(response, fieldname);
+	for (i = 0; i < tal_count(ids); i++)
+		json_add_route(response, dstate->secpctx,
+			       &ids[i], amounts[i], delays[i]);
+	json_array_end(response);
+	tal_free(ids);
+	tal_free(amounts);
+	tal_free(delays);
+}
+
+struct getroute {
+	struct command *cmd;
+	u64 msatoshi;
+	bool alternatives;
+	/* If they asked for the search's costs. */
+	struct route_trace *trace;
+	struct timeabs start;
+};
+
+static void getroute_done(const struct alt_route *routes, struct getroute *gr)
+{
+	struct command *cmd = gr->cmd;
+	struct json_result *response;
+	size_t i;
+
+	if (tal_count(routes) == 0 && !gr->trace) {
+		command_fail(cmd, "no route found");
+		return;
+	}
+
+	response = new_json_result(cmd);
+	json_object_start(response, NULL);
+	if (gr->trace) {
+		json_add_route_trace(response, "trace", gr->trace);
+		json_add_u64(response, "usec",
+			     time_to_usec(time_between(time_now(),
+						       gr->start)));
+		/* The costs are the point, even without a route. */
+		if (tal_count(routes) == 0) {
+			json_object_end(response);
+			command_success(cmd, response);
+			return;
+		}
+	}
+	json_add_hops(response, "route", cmd->dstate,
+		      routes[0].peer, routes[0].route, gr->msatoshi);
+	if (tal_count(routes[0].route) < ONION_MAX_HOPS) {
+		struct pubkey *ids;
+		u64 *amounts;
+		unsigned int *delays;
+		struct route_handle *rh;
+
+		ids = route_hops(cmd, cmd->dstate, routes[0].peer,
+				 routes[0].route, gr->msatoshi,
+				 &amounts, &delays);
+		rh = new_route_handle(cmd->dstate, ids, amounts, delays[0]);
+		json_add_u64(response, "handle", rh->id);
+	}
+	if (gr->alternatives) {
+		json_array_start(response, "alternatives");
+		for (i = 1; i < tal_count(routes); i++)
+			json_add_hops(response, NULL, cmd->dstate,
+				      routes[i].peer, routes[i].route,
+				      gr->msatoshi);
+		json_array_end(response);
+	}
+	json_object_end(response);
+	command_success(cmd, response);
+}
+
 static void json_getroute(struct command *cmd,
 			  const char *buffer, const jsmntok_t *params)
 {
 	struct pubkey id;
-	jsmntok_t *idtok, *msatoshitok, *riskfactortok;
-	struct json_result *response;
-	int i;
+	jsmntok_t *idtok, *msatoshitok, *riskfactortok, *alttok, *disjointtok;
+	jsmntok_t *maxfeetok, *maxdelaytok, *maxhopstok, *excludetok, *tracetok;
 	u64 msatoshi;
-	s64 fee;
 	double riskfactor;
-	struct node_connection **route;
-	struct peer *peer;
-	u64 *amounts, total_amount;
-	unsigned int total_delay, *delays;
+	unsigned int alternatives = 0;
+	bool node_disjoint = false, trace = false;
+	struct route_limits *limits = NULL;
+	struct getroute *gr;
 
 	if (!json_get_params(buffer, params,
 			     "id", &idtok,
 			     "msatoshi", &msatoshitok,
 			     "riskfactor", &riskfactortok,
+			     "?alternatives", &alttok,
+			     "?disjoint", &disjointtok,
+			     "?maxfee", &maxfeetok,
+			     "?maxdelay", &maxdelaytok,
+			     "?maxhops", &maxhopstok,
+			     "?exclude", &excludetok,
+			     "?trace", &tracetok,
 			     NULL)) {
 		command_fail(cmd, "Need id and msatoshi");
 		return;
@@ -240,77 +593,467 @@ static void json_getroute(struct command *cmd,
 		return;
 	}
 
-	peer = find_route(cmd->dstate, &id, msatoshi, riskfactor, &fee, &route);
-	if (!peer) {
-		command_fail(cmd, "no route found");
+	if (alttok && !json_tok_number(buffer, alttok, &alternatives)) {
+		command_fail(cmd, "'%.*s' is not a valid number",
+			     (int)(alttok->end - alttok->start),
+			     buffer + alttok->start);
 		return;
 	}
 
-	/* Fees, delays need to be calculated backwards along route. */
-	amounts = tal_arr(cmd, u64, tal_count(route)+1);
-	delays = tal_arr(cmd, unsigned int, tal_count(route)+1);
-	total_amount = msatoshi;
+	if (tracetok && !json_tok_bool(buffer, tracetok, &trace)) {
+		command_fail(cmd, "trace must be true or false");
+		return;
+	}
 
-	total_delay = 0;
-	for (i = tal_count(route) - 1; i >= 0; i--) {
-		amounts[i+1] = total_amount;
-		total_amount += connection_fee(route[i], total_amount);
+	if (disjointtok) {
+		if (json_tok_streq(buffer, disjointtok, "node"))
+			node_disjoint = true;
+		else if (!json_tok_streq(buffer, disjointtok, "link")) {
+			command_fail(cmd, "disjoint must be 'link' or 'node'");
+			return;
+		}
+	}
 
-		total_delay += route[i]->delay;
-		if (total_delay < route[i]->min_blocks)
-			total_delay = route[i]->min_blocks;
-		delays[i+1] = total_delay;
+	if (alternatives > ROUTING_MAX_ALTERNATIVES) {
+		command_fail(cmd, "At most %u alternatives",
+			     ROUTING_MAX_ALTERNATIVES);
+		return;
 	}
-	/* We don't charge ourselves any fees. */
-	amounts[0] = total_amount;
-	/* We do require delay though. */
-	total_delay += peer->nc->delay;
-	if (total_delay < peer->nc->min_blocks)
-		total_delay = peer->nc->min_blocks;
-	delays[0] = total_delay;
+
+	if (maxfeetok || maxdelaytok || maxhopstok || excludetok) {
+		limits = tal(cmd, struct route_limits);
+		route_limits_init(limits);
+	}
+
+	if (maxfeetok && !json_tok_u64(buffer, maxfeetok, &limits->max_fee)) {
+		command_fail(cmd, "'%.*s' is not a valid number",
+			     (int)(maxfeetok->end - maxfeetok->start),
+			     buffer + maxfeetok->start);
+		return;
+	}
+
+	if (maxdelaytok
+	    && !json_tok_number(buffer, maxdelaytok, &limits->max_delay)) {
+		command_fail(cmd, "'%.*s' is not a valid number",
+			     (int)(maxdelaytok->end - maxdelaytok->start),
+			     buffer + maxdelaytok->start);
+		return;
+	}
+
+	if (maxhopstok
+	    && (!json_tok_number(buffer, maxhopstok, &limits->max_hops)
+		|| limits->max_hops == 0)) {
+		command_fail(cmd, "'%.*s' is not a valid number of hops",
+			     (int)(maxhopstok->end - maxhopstok->start),
+			     buffer + maxhopstok->start);
+		return;
+	}
+
+	if (excludetok) {
+		const jsmntok_t *t, *end = json_next(excludetok);
+		struct pubkey *exclude = tal_arr(limits, struct pubkey, 0);
+		size_t n = 0;
+
+		if (excludetok->type != JSMN_ARRAY) {
+			command_fail(cmd, "exclude must be an array of ids");
+			return;
+		}
+		for (t = excludetok + 1; t < end; t = json_next(t)) {
+			tal_resize(&exclude, n+1);
+			if (!pubkey_from_hexstr(cmd->dstate->secpctx,
+						buffer + t->start,
+						t->end - t->start,
+						&exclude[n])) {
+				command_fail(cmd, "exclude %zu is not a valid id",
+					     n);
+				return;
+			}
+			n++;
+		}
+		limits->exclude = exclude;
+	}
+
+	gr = tal(cmd, struct getroute);
+	gr->cmd = cmd;
+	gr->msatoshi = msatoshi;
+	gr->alternatives = (alttok != NULL);
+	gr->trace = trace ? talz(gr, struct route_trace) : NULL;
+	gr->start = time_now();
+	find_alt_routes_async(cmd->dstate, &id, msatoshi, riskfactor,
+			      alternatives + 1, node_disjoint, limits,
+			      gr->trace, getroute_done, gr);
+}
+
+const struct json_command getroute_command = {
+	"getroute",
+	json_getroute,
+	"Return route for {msatoshi} to {id}, and up to {alternatives} more with no {disjoint} (link or node) in common, with at most {maxfee} msatoshi fees, {maxdelay} blocks delay and {maxhops} hops, avoiding {exclude} ids; if {trace}, with what the search cost",
+	"Returns a {route} array of {id} {msatoshi} {delay}: msatoshi and delay (in blocks) is cumulative, and a {handle} sendpay can use instead for a minute.  With {alternatives}, also an array of such arrays.  With {trace}, a {trace} of {searches}, {cache_hits}, {nodes_visited}, {edges_visited}, {relaxations}, connections {pruned} by each reason, and usec in each phase, plus the total {usec}."
+};
+
+static void json_getroutes(struct command *cmd,
+			   const char *buffer, const jsmntok_t *params)
+{
+	jsmntok_t *idstok, *msatoshitok, *riskfactortok;
+	const jsmntok_t *t, *end;
+	struct pubkey *ids;
+	struct alt_route *routes;
+	struct json_result *response;
+	u64 msatoshi;
+	double riskfactor;
+	size_t i, n = 0;
+
+	if (!json_get_params(buffer, params,
+			     "ids", &idstok,
+			     "msatoshi", &msatoshitok,
+			     "riskfactor", &riskfactortok,
+			     NULL)) {
+		command_fail(cmd, "Need ids, msatoshi and riskfactor");
+		return;
+	}
+
+	if (idstok->type != JSMN_ARRAY) {
+		command_fail(cmd, "ids must be an array");
+		return;
+	}
+
+	if (!json_tok_u64(buffer, msatoshitok, &msatoshi)) {
+		command_fail(cmd, "'%.*s' is not a valid number",
+			     (int)(msatoshitok->end - msatoshitok->start),
+			     buffer + msatoshitok->start);
+		return;
+	}
+
+	if (!json_tok_double(buffer, riskfactortok, &riskfactor)) {
+		command_fail(cmd, "'%.*s' is not a valid double",
+			     (int)(riskfactortok->end - riskfactortok->start),
+			     buffer + riskfactortok->start);
+		return;
+	}
+
+	ids = tal_arr(cmd, struct pubkey, idstok->size);
+	end = json_next(idstok);
+	for (t = idstok + 1; t < end; t = json_next(t), n++) {
+		if (!pubkey_from_hexstr(cmd->dstate->secpctx,
+					buffer + t->start, t->end - t->start,
+					&ids[n])) {
+			command_fail(cmd, "id %zu is not valid", n);
+			return;
+		}
+	}
+
+	/* One search for all of them. */
+	routes = find_routes_many(cmd->dstate, cmd, ids, n, msatoshi,
+				  riskfactor);
 
 	response = new_json_result(cmd);
 	json_object_start(response, NULL);
-	json_array_start(response, "route");
-	json_add_route(response, cmd->dstate->secpctx,
-		       peer->id, amounts[0], delays[0]);
-	for (i = 0; i < tal_count(route); i++)
-		json_add_route(response, cmd->dstate->secpctx,
-			       &route[i]->dst->id, amounts[i+1], delays[i+1]);
+	json_array_start(response, "routes");
+	for (i = 0; i < n; i++) {
+		if (routes[i].peer)
+			json_add_hops(response, NULL, cmd->dstate,
+				      routes[i].peer, routes[i].route,
+				      msatoshi);
+		else
+			json_add_null(response, NULL);
+	}
 	json_array_end(response);
 	json_object_end(response);
 	command_success(cmd, response);
 }
 
-const struct json_command getroute_command = {
-	"getroute",
-	json_getroute,
-	"Return route for {msatoshi} to {id}",
-	"Returns a {route} array of {id} {msatoshi} {delay}: msatoshi and delay (in blocks) is cumulative."
+const struct json_command getroutes_command = {
+	"getroutes",
+	json_getroutes,
+	"Return a route for {msatoshi} to each of {ids}, using {riskfactor}, from one search",
+	"Returns a {routes} array, with a route like getroute's (or null) for each id"
 };
 
-static void json_sendpay(struct command *cmd,
-			 const char *buffer, const jsmntok_t *params)
+/* Look for an earlier payment of rhash.  Returns an error, or NULL with
+ * *paid set and *rval filled in if it already succeeded, otherwise *pc
+ * is the failed one to retry (or NULL). */
+static const char *previous_payment(const tal_t *ctx,
+				    struct lightningd_state *dstate,
+				    const struct sha256 *rhash,
+				    u64 msatoshi,
+				    const struct pubkey *dest,
+				    struct pay_command **pc,
+				    struct rval *rval,
+				    bool *paid)
+{
+	const char *err = NULL;
+
+	*paid = false;
+	*pc = find_pay_command(dstate, rhash);
+	if (!*pc)
+		return NULL;
+
+	log_debug(dstate->base_log, "%s: found previous", __func__);
+	if ((*pc)->htlc) {
+		log_add(dstate->base_log, "... still in progress");
+		return "still in progress";
+	}
+	if ((*pc)->rval) {
+		size_t old_nhops = tal_count((*pc)->ids);
+		log_add(dstate->base_log, "... succeeded");
+		/* Must match successful payment parameters. */
+		if ((*pc)->msatoshi != msatoshi)
+			err = tal_fmt(ctx, "already succeeded with amount %"
+				      PRIu64, (*pc)->msatoshi);
+		else if (!structeq(&(*pc)->ids[old_nhops-1], dest))
+			err = tal_fmt(ctx, "already succeeded to %s",
+				      pubkey_to_hexstr(ctx, dstate->secpctx,
+						       &(*pc)->ids[old_nhops-1]));
+		else {
+			*rval = *(*pc)->rval;
+			*paid = true;
+		}
+		forget_pay_command(dstate, *pc);
+		*pc = NULL;
+		return err;
+	}
+	log_add(dstate->base_log, "... retrying");
+	return NULL;
+}
+
+/* Set up pc (a new one, if NULL) for another attempt at paying. */
+static struct pay_command *start_pay_command(struct lightningd_state *dstate,
+					     struct pay_command *pc,
+					     const struct sha256 *rhash,
+					     struct pubkey *ids,
+					     u64 msatoshi)
+{
+	if (pc)
+		pc->ids = tal_free(pc->ids);
+	else
+		pc = tal(dstate, struct pay_command);
+	pc->cmd = NULL;
+	pc->batch = NULL;
+	pc->cb = NULL;
+	pc->parts = NULL;
+	pc->part_error = NULL;
+	pc->rhash = *rhash;
+	pc->rval = NULL;
+	pc->ids = tal_steal(pc, ids);
+	pc->msatoshi = msatoshi;
+	return pc;
+}
+
+/* Once pc->htlc is added: note it in the database, and index it. */
+static bool record_pay_command(struct lightningd_state *dstate,
+			       struct pay_command *pc, bool replacing)
+{
+	if (replacing)
+		return db_replace_pay_command(dstate, &pc->rhash,
+					      pc->ids, pc->msatoshi,
+					      pc->htlc);
+
+	if (!db_new_pay_command(dstate, &pc->rhash,
+				pc->ids, pc->msatoshi,
+				pc->htlc))
+		return false;
+	pay_command_map_add(dstate->pay_commands, pc);
+	return true;
+}
+
+/* Returns an error, or NULL with the ids, amounts and first delay of
+ * routetok's hops. */
+static const char *parse_route(const tal_t *ctx,
+			       struct lightningd_state *dstate,
+			       const char *buffer,
+			       const jsmntok_t *routetok,
+			       struct pubkey **idsp,
+			       u64 **amountsp,
+			       unsigned int *delay)
 {
 	struct pubkey *ids;
 	u64 *amounts;
-	jsmntok_t *routetok, *rhashtok;
 	const jsmntok_t *t, *end;
-	unsigned int delay;
 	size_t n_hops;
-	struct sha256 rhash;
+
+	if (routetok->type != JSMN_ARRAY)
+		return tal_fmt(ctx, "'%.*s' is not an array",
+			       (int)(routetok->end - routetok->start),
+			       buffer + routetok->start);
+
+	end = json_next(routetok);
+	n_hops = 0;
+	amounts = tal_arr(ctx, u64, n_hops);
+	ids = tal_arr(ctx, struct pubkey, n_hops);
+	for (t = routetok + 1; t < end; t = json_next(t)) {
+		const jsmntok_t *amttok, *idtok, *delaytok;
+
+		if (t->type != JSMN_OBJECT)
+			return tal_fmt(ctx, "route %zu '%.*s' is not an object",
+				       n_hops,
+				       (int)(t->end - t->start),
+				       buffer + t->start);
+		amttok = json_get_member(buffer, t, "msatoshi");
+		idtok = json_get_member(buffer, t, "id");
+		delaytok = json_get_member(buffer, t, "delay");
+		if (!amttok || !idtok || !delaytok)
+			return tal_fmt(ctx, "route %zu needs msatoshi/id/delay",
+				       n_hops);
+
+		tal_resize(&amounts, n_hops+1);
+		if (!json_tok_u64(buffer, amttok, &amounts[n_hops]))
+			return tal_fmt(ctx, "route %zu invalid msatoshi", n_hops);
+		tal_resize(&ids, n_hops+1);
+		if (!pubkey_from_hexstr(dstate->secpctx,
+					buffer + idtok->start,
+					idtok->end - idtok->start,
+					&ids[n_hops]))
+			return tal_fmt(ctx, "route %zu invalid id", n_hops);
+		/* Only need first delay. */
+		if (n_hops == 0 && !json_tok_number(buffer, delaytok, delay))
+			return tal_fmt(ctx, "route %zu invalid delay", n_hops);
+		n_hops++;
+	}
+
+	if (n_hops == 0)
+		return "Empty route";
+
+	*idsp = ids;
+	*amountsp = amounts;
+	return NULL;
+}
+
+/* Sends one payment along the route (building its onion, unless we already
+ * have).  Returns an error, or NULL with *pcp set to the in-flight payment,
+ * or NULL and *pcp NULL and *rval filled in if it had already succeeded. */
+static const char *send_route(const tal_t *ctx,
+			      struct lightningd_state *dstate,
+			      struct pubkey *ids,
+			      const u64 *amounts,
+			      unsigned int delay,
+			      const u8 *onion,
+			      const struct sha256 *rhash,
+			      struct pay_command **pcp,
+			      struct rval *rval)
+{
+	size_t n_hops = tal_count(ids);
 	struct peer *peer;
 	struct pay_command *pc;
-	bool replacing = false;
-	const u8 *onion;
+	bool replacing, paid;
 	enum fail_error error_code;
 	const char *err;
 
+	*pcp = NULL;
+	err = previous_payment(ctx, dstate, rhash, amounts[n_hops-1],
+			       &ids[n_hops-1], &pc, rval, &paid);
+	if (err || paid)
+		return err;
+	replacing = (pc != NULL);
+
+	peer = find_peer(dstate, &ids[0]);
+	if (!peer)
+		return "no connection to first peer found";
+
+	if (n_hops > ONION_MAX_HOPS)
+		return "Route too long";
+
+	/* Onion will carry us from first peer onwards. */
+	if (!onion)
+		onion = onion_create(ctx, dstate->secpctx, ids, amounts,
+				     n_hops);
+
+	pc = start_pay_command(dstate, pc, rhash, ids, amounts[n_hops-1]);
+
+	/* Expiry for HTLCs is absolute.  And add one to give some margin. */
+	err = command_htlc_add(peer, amounts[0],
+			       delay + get_block_height(dstate) + 1,
+			       rhash, NULL,
+			       onion, &error_code, &pc->htlc);
+	if (err) {
+		err = tal_fmt(ctx, "could not add htlc: %u: %s",
+			      error_code, err);
+		forget_pay_command(dstate, pc);
+		return err;
+	}
+
+	if (!record_pay_command(dstate, pc, replacing)) {
+		/* We could reconnect, but db error is *bad*. */
+		peer_fail(peer, __func__);
+		forget_pay_command(dstate, pc);
+		return "database error";
+	}
+
+	*pcp = pc;
+	return NULL;
+}
+
+/* Sends one payment along routetok: returns as send_route does. */
+static const char *send_payment(const tal_t *ctx,
+				struct lightningd_state *dstate,
+				const char *buffer,
+				const jsmntok_t *routetok,
+				const struct sha256 *rhash,
+				struct pay_command **pcp,
+				struct rval *rval)
+{
+	struct pubkey *ids;
+	u64 *amounts;
+	unsigned int delay;
+	const char *err;
+
+	*pcp = NULL;
+	err = parse_route(ctx, dstate, buffer, routetok, &ids, &amounts,
+			  &delay);
+	if (err)
+		return err;
+	return send_route(ctx, dstate, ids, amounts, delay, NULL, rhash,
+			  pcp, rval);
+}
+
+const char *pay_route_(const tal_t *ctx,
+		       struct lightningd_state *dstate,
+		       const struct peer *peer,
+		       const struct node_connection *route,
+		       u64 msatoshi,
+		       const struct sha256 *rhash,
+		       void (*cb)(const struct rval *rval, void *arg),
+		       void *arg)
+{
+	struct pubkey *ids;
+	u64 *amounts;
+	unsigned int *delays;
+	struct pay_command *pc;
+	struct rval rval;
+	const char *err;
+
+	ids = route_hops(ctx, dstate, peer, route, msatoshi,
+			 &amounts, &delays);
+	err = send_route(ctx, dstate, ids, amounts, delays[0], NULL, rhash,
+			 &pc, &rval);
+	tal_free(amounts);
+	tal_free(delays);
+	if (err)
+		return err;
+	if (!pc) {
+		cb(&rval, arg);
+		return NULL;
+	}
+	pc->cb = cb;
+	pc->cbarg = arg;
+	return NULL;
+}
+
+static void json_sendpay(struct command *cmd,
+			 const char *buffer, const jsmntok_t *params)
+{
+	jsmntok_t *routetok, *rhashtok, *handletok;
+	struct sha256 rhash;
+	struct pay_command *pc, **pcp;
+	struct rval rval;
+	const char *err;
+
 	if (!json_get_params(buffer, params,
-			     "route", &routetok,
+			     "?route", &routetok,
 			     "rhash", &rhashtok,
-			     NULL)) {
-		command_fail(cmd, "Need route and rhash");
+			     "?handle", &handletok,
+			     NULL)
+	    || !routetok == !handletok) {
+		command_fail(cmd, "Need route or handle, and rhash");
 		return;
 	}
 
@@ -323,158 +1066,393 @@ static void json_sendpay(struct command *cmd,
 		return;
 	}
 
-	if (routetok->type != JSMN_ARRAY) {
+	if (handletok) {
+		struct route_handle *rh;
+		u64 id;
+
+		if (!json_tok_u64(buffer, handletok, &id)
+		    || !(rh = find_route_handle(cmd->dstate, id))) {
+			command_fail(cmd, "Unknown route handle '%.*s'",
+				     (int)(handletok->end - handletok->start),
+				     buffer + handletok->start);
+			return;
+		}
+		/* Its onion is only good for one payment. */
+		tal_steal(cmd, rh);
+		err = send_route(cmd, cmd->dstate, rh->ids, rh->amounts,
+				 rh->delay, rh->onion, &rhash, &pc, &rval);
+		tal_free(rh);
+	} else
+		err = send_payment(cmd, cmd->dstate, buffer, routetok, &rhash,
+				   &pc, &rval);
+	if (err) {
+		command_fail(cmd, "%s", err);
+		return;
+	}
+	if (!pc) {
+		json_pay_success(cmd, &rval);
+		return;
+	}
+
+	/* Wait until we get response. */
+	pc->cmd = cmd;
+	pcp = tal(cmd, struct pay_command *);
+	*pcp = pc;
+	tal_add_destructor(pcp, remove_cmd_from_pc);
+}
+
+const struct json_command sendpay_command = {
+	"sendpay",
+	json_sendpay,
+	"Send along {route} (or getroute's {handle}) in return for preimage of {rhash}",
+	"Returns the {preimage} on success"
+};
+
+/* A "sendpays" command: HTLCs added together go out in one commit. */
+struct pay_batch {
+	struct command *cmd;
+	struct batch_payment {
+		struct sha256 rhash;
+		/* Set while in flight. */
+		struct pay_command *pc;
+		struct rval *rval;
+		const char *error;
+	} *payments;
+	size_t outstanding;
+};
+
+/* If JSON RPC goes away, the batch is freed with cmd. */
+static void destroy_pay_batch(struct pay_batch *batch)
+{
+	size_t i;
+
+	for (i = 0; i < tal_count(batch->payments); i++) {
+		if (batch->payments[i].pc)
+			batch->payments[i].pc->batch = NULL;
+	}
+}
+
+static void batch_finished(struct pay_batch *batch)
+{
+	struct json_result *response;
+	size_t i;
+
+	response = new_json_result(batch->cmd);
+	json_object_start(response, NULL);
+	json_array_start(response, "payments");
+	for (i = 0; i < tal_count(batch->payments); i++) {
+		const struct batch_payment *bp = &batch->payments[i];
+
+		json_object_start(response, NULL);
+		json_add_hex(response, "rhash", &bp->rhash, sizeof(bp->rhash));
+		if (bp->rval)
+			json_add_hex(response, "preimage",
+				     bp->rval, sizeof(*bp->rval));
+		else
+			json_add_string(response, "error", bp->error);
+		json_object_end(response);
+	}
+	json_array_end(response);
+	json_object_end(response);
+	command_success(batch->cmd, response);
+}
+
+static void batch_payment_done(struct pay_batch *batch,
+			       const struct pay_command *pc,
+			       const struct htlc *htlc,
+			       const FailInfo *f)
+{
+	struct batch_payment *bp = &batch->payments[pc->batch_idx];
+
+	assert(bp->pc == pc);
+	bp->pc = NULL;
+	if (htlc->r)
+		bp->rval = tal_dup(batch, struct rval, htlc->r);
+	else
+		bp->error = pay_failure(batch, batch->cmd->dstate, f);
+
+	if (--batch->outstanding == 0)
+		batch_finished(batch);
+}
+
+static void json_sendpays(struct command *cmd,
+			  const char *buffer, const jsmntok_t *params)
+{
+	jsmntok_t *paymentstok;
+	const jsmntok_t *t, *end;
+	struct pay_batch *batch;
+	size_t i, n;
+
+	if (!json_get_params(buffer, params,
+			     "payments", &paymentstok,
+			     NULL)) {
+		command_fail(cmd, "Need payments");
+		return;
+	}
+
+	if (paymentstok->type != JSMN_ARRAY) {
 		command_fail(cmd, "'%.*s' is not an array",
-			     (int)(routetok->end - routetok->start),
-			     buffer + routetok->start);
+			     (int)(paymentstok->end - paymentstok->start),
+			     buffer + paymentstok->start);
 		return;
 	}
 
-	end = json_next(routetok);
-	n_hops = 0;
-	amounts = tal_arr(cmd, u64, n_hops);
-	ids = tal_arr(cmd, struct pubkey, n_hops);
-	for (t = routetok + 1; t < end; t = json_next(t)) {
-		const jsmntok_t *amttok, *idtok, *delaytok;
+	batch = tal(cmd, struct pay_batch);
+	batch->cmd = cmd;
+	batch->payments = tal_arr(batch, struct batch_payment,
+				  paymentstok->size);
+	batch->outstanding = 0;
+	for (i = 0; i < tal_count(batch->payments); i++)
+		batch->payments[i].pc = NULL;
+	tal_add_destructor(batch, destroy_pay_batch);
 
-		if (t->type != JSMN_OBJECT) {
-			command_fail(cmd, "route %zu '%.*s' is not an object",
-				     n_hops,
-				     (int)(t->end - t->start),
-				     buffer + t->start);
-			return;
-		}
-		amttok = json_get_member(buffer, t, "msatoshi");
-		idtok = json_get_member(buffer, t, "id");
-		delaytok = json_get_member(buffer, t, "delay");
-		if (!amttok || !idtok || !delaytok) {
-			command_fail(cmd, "route %zu needs msatoshi/id/delay",
-				     n_hops);
-			return;
-		}
+	/* Check them all first, so we don't send half a batch. */
+	end = json_next(paymentstok);
+	for (t = paymentstok + 1, n = 0; t < end; t = json_next(t), n++) {
+		const jsmntok_t *rhashtok = NULL;
 
-		tal_resize(&amounts, n_hops+1);
-		if (!json_tok_u64(buffer, amttok, &amounts[n_hops])) {
-			command_fail(cmd, "route %zu invalid msatoshi", n_hops);
-			return;
-		}
-		tal_resize(&ids, n_hops+1);
-		if (!pubkey_from_hexstr(cmd->dstate->secpctx,
-					buffer + idtok->start,
-					idtok->end - idtok->start,
-					&ids[n_hops])) {
-			command_fail(cmd, "route %zu invalid id", n_hops);
+		if (t->type == JSMN_OBJECT)
+			rhashtok = json_get_member(buffer, t, "rhash");
+		if (!rhashtok || !json_get_member(buffer, t, "route")) {
+			command_fail(cmd, "payment %zu needs route and rhash",
+				     n);
 			return;
 		}
-		/* Only need first delay. */
-		if (n_hops == 0 && !json_tok_number(buffer, delaytok, &delay)) {
-			command_fail(cmd, "route %zu invalid delay", n_hops);
+		if (!hex_decode(buffer + rhashtok->start,
+				rhashtok->end - rhashtok->start,
+				&batch->payments[n].rhash,
+				sizeof(batch->payments[n].rhash))) {
+			command_fail(cmd, "payment %zu '%.*s' is not a valid sha256 hash",
+				     n,
+				     (int)(rhashtok->end - rhashtok->start),
+				     buffer + rhashtok->start);
 			return;
 		}
-		n_hops++;
 	}
 
-	if (n_hops == 0) {
-		command_fail(cmd, "Empty route");
+	if (n == 0) {
+		command_fail(cmd, "No payments");
 		return;
 	}
 
-	pc = find_pay_command(cmd->dstate, &rhash);
-	if (pc) {
-		replacing = true;
-		log_debug(cmd->dstate->base_log, "json_sendpay: found previous");
-		if (pc->htlc) {
-			log_add(cmd->dstate->base_log, "... still in progress");
-			command_fail(cmd, "still in progress");
-			return;
-		}
-		if (pc->rval) {
-			size_t old_nhops = tal_count(pc->ids);
-			log_add(cmd->dstate->base_log, "... succeeded");
-			/* Must match successful payment parameters. */
-			if (pc->msatoshi != amounts[n_hops-1]) {
-				command_fail(cmd,
-					     "already succeeded with amount %"
-					     PRIu64, pc->msatoshi);
+	for (t = paymentstok + 1, n = 0; t < end; t = json_next(t), n++) {
+		struct batch_payment *bp = &batch->payments[n];
+		struct rval rval;
+
+		bp->rval = NULL;
+		bp->error = send_payment(batch, cmd->dstate, buffer,
+					 json_get_member(buffer, t, "route"),
+					 &bp->rhash, &bp->pc, &rval);
+		if (bp->pc) {
+			bp->pc->batch = batch;
+			bp->pc->batch_idx = n;
+			batch->outstanding++;
+		} else if (!bp->error)
+			bp->rval = tal_dup(batch, struct rval, &rval);
+	}
+
+	if (batch->outstanding == 0)
+		batch_finished(batch);
+}
+
+const struct json_command sendpays_command = {
+	"sendpays",
+	json_sendpays,
+	"Send each of {payments}, an array of {route} {rhash}, together",
+	"Returns {payments}: an array of {rhash} and {preimage} or {error}, once all are done"
+};
+
+/* A "sendmultipay" command, while we look for routes. */
+struct multipay {
+	struct command *cmd;
+	struct pubkey id;
+	struct sha256 rhash;
+	u64 msatoshi;
+	unsigned int parts;
+};
+
+static void multipay_routes(const struct alt_route *routes,
+			    struct multipay *mp)
+{
+	struct command *cmd = mp->cmd;
+	struct lightningd_state *dstate = cmd->dstate;
+	struct pay_command *pc, **pcp;
+	struct rval rval;
+	bool replacing, paid;
+	const char *err;
+	size_t i;
+
+	if (tal_count(routes) < mp->parts) {
+		command_fail(cmd, "only %zu routes found for %u parts",
+			     tal_count(routes), mp->parts);
+		return;
+	}
+
+	err = previous_payment(cmd, dstate, &mp->rhash, mp->msatoshi,
+			       &mp->id, &pc, &rval, &paid);
+	if (err) {
+		command_fail(cmd, "%s", err);
+		return;
+	}
+	if (paid) {
+		json_pay_success(cmd, &rval);
+		return;
+	}
+	replacing = (pc != NULL);
+
+	/* The first part takes any remainder. */
+	for (i = 0; i < mp->parts; i++) {
+		u64 msatoshi = mp->msatoshi / mp->parts, *amounts;
+		unsigned int *delays;
+		struct pubkey *ids;
+		const u8 *onion;
+		enum fail_error error_code;
+		struct htlc *htlc;
+
+		if (i == 0)
+			msatoshi += mp->msatoshi % mp->parts;
+
+		ids = route_hops(cmd, dstate, routes[i].peer, routes[i].route,
+				 msatoshi, &amounts, &delays);
+		onion = onion_create(cmd, dstate->secpctx, ids, amounts,
+				     tal_count(ids));
+		if (i == 0)
+			pc = start_pay_command(dstate, pc, &mp->rhash,
+					       tal_dup_arr(cmd, struct pubkey,
+							   ids, tal_count(ids),
+							   0),
+					       mp->msatoshi);
+
+		/* Expiry for HTLCs is absolute.  And add one to give some
+		 * margin. */
+		err = command_htlc_add(routes[i].peer, amounts[0],
+				       delays[0] + get_block_height(dstate) + 1,
+				       &mp->rhash, NULL,
+				       onion, &error_code, &htlc);
+		if (err) {
+			err = tal_fmt(pc, "could not add htlc: %u: %s",
+				      error_code, err);
+			if (i == 0) {
+				command_fail(cmd, "%s", err);
+				forget_pay_command(dstate, pc);
 				return;
 			}
-			if (!structeq(&pc->ids[old_nhops-1], &ids[n_hops-1])) {
-				char *previd;
-				previd = pubkey_to_hexstr(cmd,
-							  cmd->dstate->secpctx,
-							  &pc->ids[old_nhops-1]);
-				command_fail(cmd,
-					     "already succeeded to %s",
-					     previd);
+			/* The rest will fail for want of this one. */
+			log_unusual(dstate->base_log, "sendmultipay part %zu: %s",
+				    i, err);
+			pc->part_error = err;
+			break;
+		}
+
+		if (i == 0) {
+			pc->htlc = htlc;
+			if (!record_pay_command(dstate, pc, replacing)) {
+				command_fail(cmd, "database error");
+				/* We could reconnect, but db error is *bad*. */
+				peer_fail(routes[i].peer, __func__);
+				forget_pay_command(dstate, pc);
 				return;
 			}
-			json_pay_success(cmd, pc->rval);
-			return;
+			pc->parts = tal_arr(pc, struct pay_part, 0);
+		}
+		if (!db_new_pay_part(dstate, &mp->rhash, ids, htlc)) {
+			/* We could reconnect, but db error is *bad*. */
+			peer_fail(routes[i].peer, __func__);
 		}
-		log_add(cmd->dstate->base_log, "... retrying");
+		tal_resize(&pc->parts, i+1);
+		pc->parts[i].htlc = htlc;
+		pc->parts[i].ids = tal_steal(pc, ids);
 	}
 
-	peer = find_peer(cmd->dstate, &ids[0]);
-	if (!peer) {
-		command_fail(cmd, "no connection to first peer found");
+	/* Wait until we get response. */
+	pc->cmd = cmd;
+	pcp = tal(cmd, struct pay_command *);
+	*pcp = pc;
+	tal_add_destructor(pcp, remove_cmd_from_pc);
+}
+
+static void json_sendmultipay(struct command *cmd,
+			      const char *buffer, const jsmntok_t *params)
+{
+	jsmntok_t *idtok, *msatoshitok, *rhashtok, *riskfactortok, *partstok;
+	double riskfactor;
+	struct multipay *mp;
+
+	if (!json_get_params(buffer, params,
+			     "id", &idtok,
+			     "msatoshi", &msatoshitok,
+			     "rhash", &rhashtok,
+			     "riskfactor", &riskfactortok,
+			     "?parts", &partstok,
+			     NULL)) {
+		command_fail(cmd, "Need id, msatoshi, rhash and riskfactor");
 		return;
 	}
 
-	/* Onion will carry us from first peer onwards. */
-	onion = onion_create(cmd, cmd->dstate->secpctx, ids+1, amounts+1,
-			     n_hops-1);
+	mp = tal(cmd, struct multipay);
+	mp->cmd = cmd;
+	mp->parts = 2;
 
-	if (pc)
-		pc->ids = tal_free(pc->ids);
-	else
-		pc = tal(cmd->dstate, struct pay_command);
-	pc->cmd = cmd;
-	pc->rhash = rhash;
-	pc->rval = NULL;
-	pc->ids = tal_steal(pc, ids);
-	pc->msatoshi = amounts[n_hops-1];
+	if (!pubkey_from_hexstr(cmd->dstate->secpctx,
+				buffer + idtok->start,
+				idtok->end - idtok->start, &mp->id)) {
+		command_fail(cmd, "Invalid id");
+		return;
+	}
 
-	/* Expiry for HTLCs is absolute.  And add one to give some margin. */
-	err = command_htlc_add(peer, amounts[0],
-			       delay + get_block_height(cmd->dstate) + 1,
-			       &rhash, NULL,
-			       onion, &error_code, &pc->htlc);
-	if (err) {
-		command_fail(cmd, "could not add htlc: %u: %s", error_code, err);
-		tal_free(pc);
+	if (!json_tok_u64(buffer, msatoshitok, &mp->msatoshi)) {
+		command_fail(cmd, "'%.*s' is not a valid number",
+			     (int)(msatoshitok->end - msatoshitok->start),
+			     buffer + msatoshitok->start);
 		return;
 	}
 
-	if (replacing) {
-		if (!db_replace_pay_command(cmd->dstate, &pc->rhash,
-					    pc->ids, pc->msatoshi,
-					    pc->htlc)) {
-			command_fail(cmd, "database error");
-			/* We could reconnect, but db error is *bad*. */
-			peer_fail(peer, __func__);
-			tal_free(pc);
-			return;
-		}
-	} else {
-		if (!db_new_pay_command(cmd->dstate, &pc->rhash,
-					pc->ids, pc->msatoshi,
-					pc->htlc)) {
-			command_fail(cmd, "database error");
-			/* We could reconnect, but db error is *bad*. */
-			peer_fail(peer, __func__);
-			tal_free(pc);
-			return;
-		}
+	if (!hex_decode(buffer + rhashtok->start,
+			rhashtok->end - rhashtok->start,
+			&mp->rhash, sizeof(mp->rhash))) {
+		command_fail(cmd, "'%.*s' is not a valid sha256 hash",
+			     (int)(rhashtok->end - rhashtok->start),
+			     buffer + rhashtok->start);
+		return;
 	}
 
-	/* Wait until we get response. */
-	list_add_tail(&cmd->dstate->pay_commands, &pc->list);
-	tal_add_destructor(cmd, remove_cmd_from_pc);
+	if (!json_tok_double(buffer, riskfactortok, &riskfactor)) {
+		command_fail(cmd, "'%.*s' is not a valid double",
+			     (int)(riskfactortok->end - riskfactortok->start),
+			     buffer + riskfactortok->start);
+		return;
+	}
+
+	if (partstok && !json_tok_number(buffer, partstok, &mp->parts)) {
+		command_fail(cmd, "'%.*s' is not a valid number",
+			     (int)(partstok->end - partstok->start),
+			     buffer + partstok->start);
+		return;
+	}
+
+	if (mp->parts < 1 || mp->parts > ROUTING_MAX_ALTERNATIVES + 1) {
+		command_fail(cmd, "parts must be between 1 and %u",
+			     ROUTING_MAX_ALTERNATIVES + 1);
+		return;
+	}
+
+	if (mp->msatoshi < mp->parts) {
+		command_fail(cmd, "Cannot split %"PRIu64" into %u parts",
+			     mp->msatoshi, mp->parts);
+		return;
+	}
+
+	/* Each route must carry the largest part. */
+	find_alt_routes_async(cmd->dstate, &mp->id,
+			      mp->msatoshi / mp->parts
+			      + mp->msatoshi % mp->parts,
+			      riskfactor, mp->parts, false, NULL, NULL,
+			      multipay_routes, mp);
 }
 
-const struct json_command sendpay_command = {
-	"sendpay",
-	json_sendpay,
-	"Send along {route} in return for preimage of {rhash}",
+const struct json_command sendmultipay_command = {
+	"sendmultipay",
+	json_sendmultipay,
+	"Send {msatoshi} to {id} for {rhash}, split over {parts} (default 2) routes using {riskfactor}",
 	"Returns the {preimage} on success"
 };
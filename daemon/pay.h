@@ -2,12 +2,39 @@
 #define LIGHTNING_DAEMON_PAY_H
 #include "config.h"
 
+#include <ccan/typesafe_cb/typesafe_cb.h>
+
 struct lightningd_state;
 struct htlc;
+struct node_connection;
+struct peer;
+struct rval;
+struct sha256;
+
+/* Sets up dstate->pay_commands and dstate->route_handles. */
+void pay_init(struct lightningd_state *dstate);
 
 void complete_pay_command(struct lightningd_state *dstate,
 			  const struct htlc *htlc);
 
+/* Pays @rhash along @route (as find_route returns) via @peer, for no JSON
+ * command: @cb is called with the preimage once it succeeds, or NULL once
+ * it fails.  Returns an error (and @cb is never called), or NULL. */
+const char *pay_route_(const tal_t *ctx,
+		       struct lightningd_state *dstate,
+		       const struct peer *peer,
+		       const struct node_connection *route,
+		       u64 msatoshi,
+		       const struct sha256 *rhash,
+		       void (*cb)(const struct rval *rval, void *arg),
+		       void *arg);
+
+#define pay_route(ctx, dstate, peer, route, msatoshi, rhash, cb, arg)	\
+	pay_route_((ctx), (dstate), (peer), (route), (msatoshi), (rhash), \
+		   typesafe_cb_preargs(void, void *, (cb), (arg),	\
+				       const struct rval *),		\
+		   (arg))
+
 bool pay_add(struct lightningd_state *dstate,
 	     const struct sha256 *rhash,
 	     u64 msatoshi,
@@ -16,4 +43,9 @@ bool pay_add(struct lightningd_state *dstate,
 	     const u8 *fail,
 	     const struct rval *r);
 	     
+/* A multi-path payment's part still in flight, after pay_add. */
+bool pay_add_part(struct lightningd_state *dstate,
+		  const struct sha256 *rhash,
+		  const struct pubkey *ids,
+		  struct htlc *htlc);
 #endif /* LIGHTNING_DAEMON_PAY_H */
@@ -6,6 +6,7 @@
 #include "cryptopkt.h"
 #include "db.h"
 #include "dns.h"
+#include "events.h"
 #include "find_p2sh_out.h"
 #include "invoice.h"
 #include "jsonrpc.h"
@@ -25,7 +26,10 @@
 #include "routing.h"
 #include "secrets.h"
 #include "state.h"
+#include "stats.h"
+#include "sweep.h"
 #include "timeout.h"
+#include "trace.h"
 #include "utils.h"
 #include "wallet.h"
 #include <bitcoin/base58.h>
@@ -40,12 +44,14 @@
 #include <ccan/ptrint/ptrint.h>
 #include <ccan/str/hex/hex.h>
 #include <ccan/structeq/structeq.h>
+#include <ccan/take/take.h>
 #include <ccan/tal/str/str.h>
 #include <ccan/tal/tal.h>
 #include <errno.h>
 #include <inttypes.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <stdlib.h>
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -55,6 +61,23 @@ struct json_connecting {
 	struct command *cmd;
 	const char *name, *port;
 	struct anchor_input *input;
+	/* For connectmany, the batch we're in (then cmd is NULL). */
+	struct anchor_batch *batch;
+	struct list_node list;
+};
+
+/* Several channels funded by one anchor tx: an output for each. */
+struct anchor_batch {
+	struct lightningd_state *dstate;
+	/* Until we've replied to connectmany. */
+	struct command *cmd;
+	/* json_connectings not yet peers. */
+	struct list_head connecting;
+	/* Output i is for peers[i] (NULL until connected, or once freed). */
+	struct peer **peers;
+	size_t num_peers, num_connected, num_opened, num_signed;
+	/* The tx can only go out once they've all signed their commit. */
+	bool broadcast, failed;
 };
 
 static bool command_htlc_set_fail(struct peer *peer, struct htlc *htlc,
@@ -63,15 +86,78 @@ static bool command_htlc_fail(struct peer *peer, struct htlc *htlc);
 static bool command_htlc_fulfill(struct peer *peer, struct htlc *htlc);
 static void try_commit(struct peer *peer);
 
+/* We sign one per commit, forever: keep a few, and find the rest on disk. */
+#define THEIR_COMMITS_WINDOW 8
+
 void peer_add_their_commit(struct peer *peer,
 			   const struct sha256_double *txid, u64 commit_num)
 {
 	struct their_commit *tc = tal(peer, struct their_commit);
 	tc->txid = *txid;
 	tc->commit_num = commit_num;
+	tc->batch = db_batch_stamp(peer->dstate);
 	list_add_tail(&peer->their_commits, &tc->list);
+	peer->num_their_commits++;
 
 	db_add_commit_map(peer, txid, commit_num);
+
+	/* Only forget ones the database can find for us. */
+	while (peer->num_their_commits > THEIR_COMMITS_WINDOW) {
+		tc = list_top(&peer->their_commits, struct their_commit, list);
+		if (!db_batch_done(peer->dstate, tc->batch))
+			break;
+		list_del_from(&peer->their_commits, &tc->list);
+		tal_free(tc);
+		peer->num_their_commits--;
+	}
+}
+
+static void maybe_free_batch(struct anchor_batch *batch)
+{
+	size_t i;
+
+	if (!list_empty(&batch->connecting))
+		return;
+	for (i = 0; i < batch->num_peers; i++)
+		if (batch->peers[i])
+			return;
+	tal_free(batch);
+}
+
+static void abandon_anchor(struct peer *peer)
+{
+	/* It may have failed already, or closed. */
+	if (!state_is_error(peer->state) && peer->state != STATE_CLOSED)
+		peer_fail(peer, "anchor_batch_failed");
+}
+
+/* Nothing's been broadcast, so none of them can go ahead. */
+static void anchor_batch_failed(struct anchor_batch *batch, const char *why)
+{
+	size_t i;
+
+	if (batch->failed || batch->broadcast)
+		return;
+	batch->failed = true;
+	log_unusual(batch->dstate->base_log, "Anchor batch failed: %s", why);
+	if (batch->cmd) {
+		command_fail(batch->cmd, "%s", why);
+		batch->cmd = NULL;
+	}
+
+	/* Not from inside anyone's state machine. */
+	for (i = 0; i < batch->num_peers; i++)
+		if (batch->peers[i])
+			new_reltimer(batch->dstate, batch->peers[i],
+				     time_from_sec(0), abandon_anchor,
+				     batch->peers[i]);
+}
+
+/* A shared anchor might never have gone out. */
+static bool anchor_unbroadcast(const struct peer *peer)
+{
+	return peer->anchor.input && peer->anchor.input->batch
+		&& !peer->anchor.input->batch->broadcast;
 }
 
 /* Create a bitcoin close tx, using last signature they sent. */
@@ -96,64 +182,6 @@ static const struct bitcoin_tx *bitcoin_close(struct peer *peer)
 	return close_tx;
 }
 
-/* Create a bitcoin spend tx (to spend our commit's outputs) */
-static const struct bitcoin_tx *bitcoin_spend_ours(struct peer *peer)
-{
-	u8 *witnessscript;
-	const struct bitcoin_tx *commit = peer->local.commit->tx;
-	struct bitcoin_signature sig;
-	struct bitcoin_tx *tx;
-	unsigned int p2wsh_out;
-	uint64_t fee;
-
-	/* The redeemscript for a commit tx is fairly complex. */
-	witnessscript = bitcoin_redeem_secret_or_delay(peer,
-						       peer->dstate->secpctx,
-						      &peer->local.finalkey,
-						      &peer->remote.locktime,
-						      &peer->remote.finalkey,
-						      &peer->local.commit->revocation_hash);
-
-	/* Now, create transaction to spend it. */
-	tx = bitcoin_tx(peer, 1, 1);
-	tx->input[0].txid = peer->local.commit->txid;
-	p2wsh_out = find_p2wsh_out(commit, witnessscript);
-	tx->input[0].index = p2wsh_out;
-	tx->input[0].sequence_number = bitcoin_nsequence(&peer->remote.locktime);
-	tx->input[0].amount = tal_dup(tx->input, u64,
-				      &commit->output[p2wsh_out].amount);
-
-	tx->output[0].script = scriptpubkey_p2sh(tx,
-				 bitcoin_redeem_single(tx,
-						       peer->dstate->secpctx,
-						       &peer->local.finalkey));
-	tx->output[0].script_length = tal_count(tx->output[0].script);
-
-	/* Witness length can vary, due to DER encoding of sigs, but we
-	 * use 176 from an example run. */
-	assert(measure_tx_cost(tx) == 83 * 4);
-
-	fee = fee_by_feerate(83 + 176 / 4, get_feerate(peer->dstate));
-
-	/* FIXME: Fail gracefully in these cases (not worth collecting) */
-	if (fee > commit->output[p2wsh_out].amount
-	    || is_dust(commit->output[p2wsh_out].amount - fee))
-		fatal("Amount of %"PRIu64" won't cover fee %"PRIu64,
-		      commit->output[p2wsh_out].amount, fee);
-
-	tx->output[0].amount = commit->output[p2wsh_out].amount - fee;
-
-	sig.stype = SIGHASH_ALL;
-	peer_sign_spend(peer, tx, witnessscript, &sig.sig);
-
-	tx->input[0].witness = bitcoin_witness_secret(tx,
-						      peer->dstate->secpctx,
-						      NULL, 0, &sig,
-						      witnessscript);
-
-	return tx;
-}
-
 /* Sign and return our commit tx */
 static const struct bitcoin_tx *bitcoin_commit(struct peer *peer)
 {
@@ -190,13 +218,24 @@ static u64 commit_tx_fee(const struct bitcoin_tx *commit, u64 anchor_satoshis)
 
 struct peer *find_peer(struct lightningd_state *dstate, const struct pubkey *id)
 {
-	struct peer *peer;
+	return peer_map_get(dstate->peers_by_id, &id->pubkey);
+}
 
-	list_for_each(&dstate->peers, peer, list) {
-		if (peer->id && pubkey_eq(peer->id, id))
-			return peer;
-	}
-	return NULL;
+void peer_set_id(struct peer *peer, const struct pubkey *id)
+{
+	assert(!peer->id);
+	peer->id = tal_dup(peer, struct pubkey, id);
+	peer_map_add(peer->dstate->peers_by_id, peer);
+	pubkey_to_der(peer->dstate->secpctx, peer->id_der, id);
+	peer_der_map_add(peer->dstate->peers_by_der, peer);
+}
+
+u64 peer_sendable_msat(const struct peer *peer)
+{
+	/* What a new HTLC would be checked against. */
+	if (!peer->remote.staging_cstate)
+		return 0;
+	return peer->remote.staging_cstate->side[LOCAL].pay_msat;
 }
 
 void debug_dump_peers(struct lightningd_state *dstate)
@@ -221,13 +260,18 @@ static struct peer *find_peer_json(struct lightningd_state *dstate,
 			      jsmntok_t *peeridtok)
 {
 	struct pubkey peerid;
+	struct peer *peer;
 
 	if (!pubkey_from_hexstr(dstate->secpctx,
 				buffer + peeridtok->start,
 				peeridtok->end - peeridtok->start, &peerid))
 		return NULL;
 
-	return find_peer(dstate, &peerid);
+	/* Whatever they want it for, it'll need more than its balance. */
+	peer = find_peer(dstate, &peerid);
+	if (peer)
+		peer_wake(peer);
+	return peer;
 }
 
 static bool peer_uncommitted_changes(const struct peer *peer)
@@ -252,12 +296,39 @@ static bool peer_uncommitted_changes(const struct peer *peer)
 	return false;
 }
 
+/* With config.commit_adaptive, a commit this big gets the full wait. */
+#define COMMIT_BATCH_FULL 16
+
+static struct timerel commit_delay(const struct peer *peer)
+{
+	struct timerel budget = peer->dstate->config.commit_time;
+	size_t n = peer->commit_stats.last_changes;
+
+	if (!peer->dstate->config.commit_adaptive)
+		return budget;
+
+	/* Idle?  Nothing to wait for, though we still collect whatever
+	 * else this pass of the loop does. */
+	if (!peer->commit_stats.commits
+	    || time_greater(time_between(controlled_time(),
+					 peer->commit_stats.last),
+			    budget))
+		return time_from_nsec(0);
+
+	/* Otherwise, scale with how busy we were last time. */
+	if (n <= 1)
+		return time_from_nsec(0);
+	if (n > COMMIT_BATCH_FULL)
+		n = COMMIT_BATCH_FULL;
+	return time_divide(time_multiply(budget, n - 1), COMMIT_BATCH_FULL - 1);
+}
+
 static void remote_changes_pending(struct peer *peer)
 {
 	if (!peer->commit_timer) {
 		log_debug(peer->log, "remote_changes_pending: adding timer");
 		peer->commit_timer = new_reltimer(peer->dstate, peer,
-						  peer->dstate->config.commit_time,
+						  commit_delay(peer),
 						  try_commit, peer);
 	} else
 		log_debug(peer->log, "remote_changes_pending: timer already exists");
@@ -272,10 +343,15 @@ static void peer_update_complete(struct peer *peer)
 		peer->commit_jsoncmd = NULL;
 	}
 
-	/* Have we got more changes in the meantime? */
+	/* Have we got more changes in the meantime?  They've waited a
+	 * round trip already, so don't make them wait for commit_time too:
+	 * just for whatever else this pass of the loop adds. */
 	if (peer_uncommitted_changes(peer)) {
 		log_debug(peer->log, "peer_update_complete: more changes!");
-		remote_changes_pending(peer);
+		tal_free(peer->commit_timer);
+		peer->commit_timer = new_reltimer(peer->dstate, peer,
+						  time_from_sec(0),
+						  try_commit, peer);
 	}
 }
 
@@ -290,13 +366,16 @@ void peer_open_complete(struct peer *peer, const char *problem)
 static void set_peer_state(struct peer *peer, enum state newstate,
 			   const char *caller, bool db_commit)
 {
+	enum state oldstate = peer->state;
+
 	log_debug(peer->log, "%s: %s => %s", caller,
 		  state_name(peer->state), state_name(newstate));
-	peer->state = newstate;
 
 	/* We can only route in normal state. */
-	if (!state_is_normal(peer->state))
-		peer->nc = tal_free(peer->nc);
+	if (state_is_normal(peer->state) && !state_is_normal(newstate))
+		remove_connection(peer->dstate, &peer->dstate->id, peer->id);
+	peer->state = newstate;
+	notify_peer_state(peer, oldstate);
 
 	if (db_commit)
 		db_update_state(peer);
@@ -309,13 +388,17 @@ static void peer_breakdown(struct peer *peer)
 		peer->commit_jsoncmd = NULL;
 	}
 	
+	/* Nobody else can use an anchor we share, either. */
+	bitcoin_release_anchor(peer, INPUT_NONE);
+
 	/* If we have a closing tx, use it. */
 	if (peer->closing.their_sig) {
 		log_unusual(peer->log, "Peer breakdown: sending close tx");
 		broadcast_tx(peer, bitcoin_close(peer));
 	/* If we have a signed commit tx (maybe not if we just offered
 	 * anchor, or they supplied anchor, or no outputs to us). */
-	} else if (peer->local.commit && peer->local.commit->sig) {
+	} else if (peer->local.commit && peer->local.commit->sig
+		   && !anchor_unbroadcast(peer)) {
 		log_unusual(peer->log, "Peer breakdown: sending commit tx");
 		broadcast_tx(peer, bitcoin_commit(peer));
 	} else {
@@ -406,7 +489,8 @@ static void set_htlc_rval(struct peer *peer,
 {
 	assert(!htlc->r);
 	assert(!htlc->fail);
-	htlc->r = tal_dup(htlc, struct rval, rval);
+	htlc->rval = *rval;
+	htlc->r = &htlc->rval;
 	db_htlc_fulfilled(peer, htlc);
 }
 
@@ -419,6 +503,102 @@ static void set_htlc_fail(struct peer *peer,
 	db_htlc_failed(peer, htlc);
 }
 
+/* A peer that isn't keeping up shouldn't get more work until it drains. */
+static bool peer_congested(struct peer *peer)
+{
+	const struct config *config = &peer->dstate->config;
+	u32 htlcs = peer->remote.staging_cstate->side[LOCAL].num_htlcs;
+
+	if (!peer->congested) {
+		if (peer->outpkt_bytes >= config->peer_queue_max
+		    || htlcs >= config->peer_htlc_max) {
+			log_unusual(peer->log, "Congested: %"PRIu64" bytes queued,"
+				    " %u HTLCs offered", peer->outpkt_bytes, htlcs);
+			peer->congested = true;
+		}
+	} else if (peer->outpkt_bytes <= config->peer_queue_max / 2
+		   && htlcs <= config->peer_htlc_max / 2) {
+		log_info(peer->log, "No longer congested");
+		peer->congested = false;
+	}
+	return peer->congested;
+}
+
+/* Have the kernel probe an idle connection each ping time, so one which has
+ * silently died stops acking (peer_liveness_tick notices), and give up on
+ * it itself after the dead time. */
+static void peer_set_keepalive(struct peer *peer, int fd)
+{
+	const struct config *config = &peer->dstate->config;
+	int on = 1;
+
+	if (!time_to_nsec(config->peer_ping_time))
+		return;
+
+	if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on)) != 0)
+		log_unusual(peer->log, "Setting SO_KEEPALIVE: %s",
+			    strerror(errno));
+#ifdef TCP_KEEPIDLE
+	{
+		int ping = time_to_sec(config->peer_ping_time), count;
+
+		if (ping == 0)
+			ping = 1;
+		count = time_to_sec(config->peer_dead_time) / ping;
+		if (count == 0)
+			count = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &ping, sizeof(ping));
+		setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &ping, sizeof(ping));
+		setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+	}
+#endif
+#ifdef TCP_USER_TIMEOUT
+	{
+		/* Keepalives stop while data is unacked: this covers it. */
+		unsigned int ms = time_to_msec(config->peer_dead_time);
+		setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &ms, sizeof(ms));
+	}
+#endif
+}
+
+/* Whether @side may add an HTLC of @msatoshi to @cstate, or why not.  Every
+ * HTLC we take makes each commitment bigger, and slower to sign and check. */
+static const char *htlc_admission(const struct peer *peer,
+				  const struct channel_state *cstate,
+				  enum side side, u64 msatoshi)
+{
+	const struct config *config = &peer->dstate->config;
+	const struct channel_oneside *one = &cstate->side[side];
+
+	if (msatoshi < config->htlc_min_msat)
+		return "htlc too small";
+	if (config->htlc_max_inflight
+	    && one->num_htlcs >= config->htlc_max_inflight)
+		return "too many htlcs in flight";
+	if (config->htlc_max_inflight_msat
+	    && one->htlc_msat + msatoshi > config->htlc_max_inflight_msat)
+		return "too much in flight";
+	return NULL;
+}
+
+static void forward_failed(struct peer *peer, struct htlc *htlc,
+			   enum fail_error error_code, const char *why)
+{
+	peer->dstate->forward_stats.failed++;
+	command_htlc_set_fail(peer, htlc, error_code, why);
+}
+
+static void forward_done(struct peer *peer, const struct htlc *htlc)
+{
+	struct timerel t = time_between(controlled_time(), htlc->created);
+
+	peer->dstate->forward_stats.forwarded++;
+	peer->dstate->forward_stats.total
+		= timerel_add(peer->dstate->forward_stats.total, t);
+	if (time_greater(t, peer->dstate->forward_stats.max))
+		peer->dstate->forward_stats.max = t;
+}
+
 static void route_htlc_onwards(struct peer *peer,
 			       struct htlc *htlc,
 			       u64 msatoshi,
@@ -427,7 +607,8 @@ static void route_htlc_onwards(struct peer *peer,
 			       const struct peer *only_dest)
 {
 	struct pubkey id;
-	struct peer *next;
+	struct peer *next = NULL;
+	const struct node_connection *nc;
 	struct htlc *newhtlc;
 	enum fail_error error_code;
 	const char *err;
@@ -437,39 +618,92 @@ static void route_htlc_onwards(struct peer *peer,
 				 struct sha256, &htlc->rhash);
 		log_add(peer->log, " (id %"PRIu64")", htlc->id);
 	}
-	
-	if (!proto_to_pubkey(peer->dstate->secpctx, pb_id, &id)) {
+
+	/* Usually it's one of our peers: no need to parse the key. */
+	if (pb_id->key.len == PUBKEY_DER_LEN) {
+		if (!htlc->next_der)
+			htlc->next_der = tal_dup_arr(htlc, u8, pb_id->key.data,
+						     PUBKEY_DER_LEN, 0);
+		next = peer_der_map_get(peer->dstate->peers_by_der,
+					pb_id->key.data);
+	}
+	if (next) {
+		peer_wake(next);
+		id = *next->id;
+	} else if (!proto_to_pubkey(peer->dstate->secpctx, pb_id, &id)) {
 		log_unusual(peer->log,
 			    "Malformed pubkey for HTLC %"PRIu64, htlc->id);
-		command_htlc_set_fail(peer, htlc, BAD_REQUEST_400,
-				      "Malformed pubkey");
+		forward_failed(peer, htlc, BAD_REQUEST_400,
+			       "Malformed pubkey");
 		return;
 	}
 
-	next = find_peer(peer->dstate, &id);
-	if (!next || !next->nc) {
+	if (next && state_is_normal(next->state))
+		nc = get_connection(peer->dstate, &peer->dstate->id, next->id);
+	else
+		nc = NULL;
+	if (!nc) {
 		log_unusual(peer->log, "Can't route HTLC %"PRIu64": no %speer ",
 			    htlc->id, next ? "ready " : "");
 		log_add_struct(peer->log, "%s", struct pubkey, &id);
 		if (!peer->dstate->dev_never_routefail)
-			command_htlc_set_fail(peer, htlc, NOT_FOUND_404,
-					      "Unknown peer");
+			forward_failed(peer, htlc, NOT_FOUND_404,
+				       "Unknown peer");
 		return;
 	}
 
 	if (only_dest && next != only_dest)
 		return;
+
+	if (peer_congested(next)) {
+		log_unusual(peer->log, "Can't route HTLC %"PRIu64
+			    ": next peer congested", htlc->id);
+		forward_failed(peer, htlc, SERVICE_UNAVAILABLE_503,
+			       "Next peer congested");
+		return;
+	}
+
+	/* Still connected, but not acking: it would sit in our queue until
+	 * they recover or we hang up, holding up the HTLC it came from. */
+	if (next->unresponsive) {
+		log_unusual(peer->log, "Can't route HTLC %"PRIu64
+			    ": next peer unresponsive", htlc->id);
+		forward_failed(peer, htlc, SERVICE_UNAVAILABLE_503,
+			       "Next peer unresponsive");
+		return;
+	}
+
+	err = htlc_admission(next, next->remote.staging_cstate, LOCAL, msatoshi);
+	if (err) {
+		log_unusual(peer->log, "Can't route HTLC %"PRIu64": %s",
+			    htlc->id, err);
+		forward_failed(peer, htlc, SERVICE_UNAVAILABLE_503, err);
+		return;
+	}
+
+	/* Commits are already slow: shed forwards until they recover. */
+	if (time_to_usec(peer->dstate->config.commit_latency_target)
+	    && stats_recent_usec(peer->dstate, STATS_COMMIT_RTT)
+	    > time_to_usec(peer->dstate->config.commit_latency_target)) {
+		log_unusual(peer->log, "Can't route HTLC %"PRIu64
+			    ": commits taking %"PRIu64"usec",
+			    htlc->id,
+			    stats_recent_usec(peer->dstate, STATS_COMMIT_RTT));
+		forward_failed(peer, htlc, SERVICE_UNAVAILABLE_503,
+			       "Commit latency too high");
+		return;
+	}
 	
 	/* Offered fee must be sufficient. */
 	if ((s64)(htlc->msatoshi - msatoshi)
-	    < connection_fee(next->nc, msatoshi)) {
+	    < connection_fee(nc, msatoshi)) {
 		log_unusual(peer->log,
 			    "Insufficient fee for HTLC %"PRIu64
 			    ": %"PRIi64" on %"PRIu64,
 			    htlc->id, htlc->msatoshi - msatoshi,
 			    msatoshi);
-		command_htlc_set_fail(peer, htlc, PAYMENT_REQUIRED_402,
-				      "Insufficent fee");
+		forward_failed(peer, htlc, PAYMENT_REQUIRED_402,
+			       "Insufficent fee");
 		return;
 	}
 
@@ -479,19 +713,144 @@ static void route_htlc_onwards(struct peer *peer,
 	/* This checks the HTLC itself is possible. */
 	err = command_htlc_add(next, msatoshi,
 			       abs_locktime_to_blocks(&htlc->expiry)
-			       - next->nc->delay,
-			       &htlc->rhash, htlc, rest_of_route,
+			       - nc->delay,
+			       &htlc->rhash, htlc, take(rest_of_route),
 			       &error_code, &newhtlc);
 	if (err)
-		command_htlc_set_fail(peer, htlc, error_code, err);
+		forward_failed(peer, htlc, error_code, err);
+	else
+		forward_done(peer, htlc);
+}
+
+/* An HTLC paying part of an invoice, held until the rest arrive. */
+struct invoice_part {
+	struct list_node list;
+	struct invoice *invoice;
+	struct htlc *htlc;
+};
+
+/* How long we hold some parts of a payment, waiting for the others. */
+#define INVOICE_PART_TIMEOUT_SECS 60
+
+static void destroy_invoice_part(struct invoice_part *part)
+{
+	struct invoice *invoice = part->invoice;
+
+	list_del_from(&invoice->parts, &part->list);
+	invoice->parts_msatoshi -= part->htlc->msatoshi;
+	if (list_empty(&invoice->parts))
+		invoice->parts_timer = tal_free(invoice->parts_timer);
+}
+
+void fail_invoice_parts(struct invoice *invoice, const char *why)
+{
+	struct invoice_part *part;
+
+	while ((part = list_top(&invoice->parts, struct invoice_part, list))) {
+		struct htlc *htlc = part->htlc;
+
+		log_unusual(htlc->peer->log, "Failing part of '%s' HTLC %"PRIu64
+			    ": %s", invoice->label, htlc->id, why);
+		tal_free(part);
+		command_htlc_set_fail(htlc->peer, htlc, REQUEST_TIMEOUT_408,
+				      why);
+	}
+}
+
+static void invoice_parts_timeout(struct invoice *invoice)
+{
+	/* Timer frees itself. */
+	invoice->parts_timer = NULL;
+	fail_invoice_parts(invoice, "rest of payment never arrived");
+}
+
+static bool invoice_part_held(const struct invoice *invoice,
+			      const struct htlc *htlc)
+{
+	const struct invoice_part *part;
+
+	list_for_each(&invoice->parts, part, list) {
+		if (part->htlc == htlc)
+			return true;
+	}
+	return false;
+}
+
+/* An HTLC for an invoice of ours: it may only be part of the payment. */
+static void pay_invoice(struct peer *peer, struct htlc *htlc,
+			struct invoice *invoice)
+{
+	struct invoice_part *part;
+
+	if (invoice_part_held(invoice, htlc))
+		return;
+
+	if (htlc->msatoshi + invoice->parts_msatoshi > invoice->msatoshi) {
+		log_unusual(peer->log, "Over payment for '%s' HTLC %"PRIu64
+			    ": %"PRIu64" (%"PRIu64" held) not %"PRIu64
+			    " satoshi!",
+			    invoice->label,
+			    htlc->id,
+			    htlc->msatoshi,
+			    invoice->parts_msatoshi,
+			    invoice->msatoshi);
+		command_htlc_set_fail(peer, htlc,
+				      UNAUTHORIZED_401,
+				      "incorrect amount");
+		return;
+	}
+
+	if (htlc->msatoshi + invoice->parts_msatoshi < invoice->msatoshi) {
+		log_info(peer->log, "Holding '%s' HTLC %"PRIu64 ": %"PRIu64
+			 " towards %"PRIu64" msatoshi",
+			 invoice->label, htlc->id, htlc->msatoshi,
+			 invoice->msatoshi);
+		part = tal(htlc, struct invoice_part);
+		part->invoice = invoice;
+		part->htlc = htlc;
+		list_add_tail(&invoice->parts, &part->list);
+		invoice->parts_msatoshi += htlc->msatoshi;
+		tal_add_destructor(part, destroy_invoice_part);
+		if (!invoice->parts_timer)
+			invoice->parts_timer
+				= new_reltimer(peer->dstate, invoice,
+					       time_from_sec(INVOICE_PART_TIMEOUT_SECS),
+					       invoice_parts_timeout, invoice);
+		return;
+	}
+
+	log_info(peer->log, "Immediately resolving '%s' HTLC %"PRIu64,
+		 invoice->label, htlc->id);
+
+	resolve_invoice(peer->dstate, invoice);
+	set_htlc_rval(peer, htlc, &invoice->r);
+	command_htlc_fulfill(peer, htlc);
+
+	/* Now the parts we were holding. */
+	while ((part = list_top(&invoice->parts, struct invoice_part, list))) {
+		struct htlc *h = part->htlc;
+
+		tal_free(part);
+		set_htlc_rval(h->peer, h, &invoice->r);
+		command_htlc_fulfill(h->peer, h);
+	}
 }
 
 static void their_htlc_added(struct peer *peer, struct htlc *htlc,
 			     struct peer *only_dest)
 {
 	RouteStep *step;
-	const u8 *rest_of_route;
+	const u8 *route, *rest_of_route;
 	struct invoice *invoice;
+	const tal_t *ctx;
+
+	if (htlc->refused) {
+		log_unusual(peer->log, "HTLC %"PRIu64" refused: %s",
+			    htlc->id, htlc->refused);
+		command_htlc_set_fail(peer, htlc, SERVICE_UNAVAILABLE_503,
+				      htlc->refused);
+		return;
+	}
 
 	if (abs_locktime_is_seconds(&htlc->expiry)) {
 		log_unusual(peer->log, "HTLC %"PRIu64" is in seconds", htlc->id);
@@ -520,20 +879,24 @@ static void their_htlc_added(struct peer *peer, struct htlc *htlc,
 		return;
 	}
 
-	step = onion_unwrap(peer, htlc->routing, tal_count(htlc->routing),
-			    &rest_of_route);
+	/* The step, and the onion for onwards, unless that gets taken. */
+	ctx = tal(peer, char);
+	route = db_htlc_routing(htlc);
+	step = onion_unwrap(ctx, peer, route, tal_count(route), &rest_of_route);
 	if (!step) {
 		log_unusual(peer->log, "Bad onion, failing HTLC %"PRIu64,
 			    htlc->id);
 		command_htlc_set_fail(peer, htlc, BAD_REQUEST_400,
 				      "invalid onion");
-		return;
+		goto free_rest;
 	}
 
 	switch (step->next_case) {
 	case ROUTE_STEP__NEXT_END:
-		if (only_dest)
-			return;
+		/* Retrying for the peer it came from, in case we lost
+		 * the parts we were holding. */
+		if (only_dest && only_dest != peer)
+			goto free_rest;
 		invoice = find_unpaid(peer->dstate, &htlc->rhash);
 		if (!invoice) {
 			log_unusual(peer->log, "No invoice for HTLC %"PRIu64,
@@ -547,25 +910,16 @@ static void their_htlc_added(struct peer *peer, struct htlc *htlc,
 			goto free_rest;
 		}
 			
-		if (htlc->msatoshi != invoice->msatoshi) {
-			log_unusual(peer->log, "Short payment for '%s' HTLC %"PRIu64
-				    ": %"PRIu64" not %"PRIu64 " satoshi!",
-				    invoice->label,
-				    htlc->id,
-				    htlc->msatoshi,
-				    invoice->msatoshi);
+		if (invoice_expired(peer->dstate, invoice)) {
+			log_unusual(peer->log, "Expired invoice '%s' HTLC %"PRIu64,
+				    invoice->label, htlc->id);
 			command_htlc_set_fail(peer, htlc,
 					      UNAUTHORIZED_401,
-					      "incorrect amount");
-			return;
+					      "invoice expired");
+			goto free_rest;
 		}
 
-		log_info(peer->log, "Immediately resolving '%s' HTLC %"PRIu64,
-			 invoice->label, htlc->id);
-
-		resolve_invoice(peer->dstate, invoice);
-		set_htlc_rval(peer, htlc, &invoice->r);
-		command_htlc_fulfill(peer, htlc);
+		pay_invoice(peer, htlc, invoice);
 		goto free_rest;
 
 	case ROUTE_STEP__NEXT_BITCOIN:
@@ -580,7 +934,7 @@ static void their_htlc_added(struct peer *peer, struct htlc *htlc,
 	}
 
 free_rest:
-	tal_free(rest_of_route);
+	tal_free(ctx);
 }
 
 static void our_htlc_failed(struct peer *peer, struct htlc *htlc)
@@ -594,6 +948,37 @@ static void our_htlc_failed(struct peer *peer, struct htlc *htlc)
 		complete_pay_command(peer->dstate, htlc);
 }
 
+/* Anyone else who offered us this rhash can be paid now, too: eg. a
+ * retry which came in while the first attempt was still outstanding. */
+static void fulfill_same_rhash(struct lightningd_state *dstate,
+			       const struct htlc *htlc)
+{
+	struct htlc_rhash_map_iter it;
+	struct htlc *h;
+
+	/* Parts held for our own invoice are resolved with it. */
+	if (find_unpaid(dstate, &htlc->rhash))
+		return;
+
+	for (h = htlc_rhash_map_getfirst(dstate->htlcs_by_rhash,
+					 &htlc->rhash, &it);
+	     h;
+	     h = htlc_rhash_map_getnext(dstate->htlcs_by_rhash,
+					&htlc->rhash, &it)) {
+		/* Ones still being passed on are settled by their dst. */
+		if (h == htlc->src || h->dst || h->r || h->fail)
+			continue;
+		if (h->state != RCVD_ADD_ACK_REVOCATION)
+			continue;
+		if (!state_can_remove_htlc(h->peer->state))
+			continue;
+		log_info(h->peer->log, "Fulfilling HTLC %"PRIu64
+			 " with preimage from HTLC %"PRIu64, h->id, htlc->id);
+		set_htlc_rval(h->peer, h, htlc->r);
+		command_htlc_fulfill(h->peer, h);
+	}
+}
+
 static void our_htlc_fulfilled(struct peer *peer, struct htlc *htlc)
 {
 	if (htlc->src) {
@@ -602,21 +987,7 @@ static void our_htlc_fulfilled(struct peer *peer, struct htlc *htlc)
 	} else {
 		complete_pay_command(peer->dstate, htlc);
 	}
-}
-
-/* FIXME: Slow! */
-static struct htlc *htlc_with_source(struct peer *peer, struct htlc *src)
-{
-	struct htlc_map_iter it;
-	struct htlc *h;
-
-	for (h = htlc_map_first(&peer->htlcs, &it);
-	     h;
-	     h = htlc_map_next(&peer->htlcs, &it)) {
-		if (h->src == src)
-			return h;
-	}
-	return NULL;
+	fulfill_same_rhash(peer->dstate, htlc);
 }
 
 /* peer has come back online: re-send any we have to send to them. */
@@ -636,14 +1007,22 @@ static void retry_all_routing(struct peer *restarted_peer)
 		     h = htlc_map_next(&peer->htlcs, &it)) {
 			if (h->state != RCVD_ADD_ACK_REVOCATION)
 				continue;
-			if (htlc_with_source(peer, h))
+			/* Already sent on (to whichever peer), or resolved
+			 * and waiting for its own peer to come back? */
+			if (h->dst || h->r || h->fail)
+				continue;
+			/* We've unwrapped it before: only retry if it's
+			 * for this peer. */
+			if (h->next_der
+			    && memcmp(h->next_der, restarted_peer->id_der,
+				      PUBKEY_DER_LEN) != 0)
 				continue;
 			their_htlc_added(peer, h, restarted_peer);
 		}
 	}
 
 	/* Catch any HTLCs which are fulfilled, but the message got reset
-	 * by reconnect. */
+	 * by reconnect, and parts of payments to us we may have forgotten. */
 	for (h = htlc_map_first(&restarted_peer->htlcs, &it);
 	     h;
 	     h = htlc_map_next(&restarted_peer->htlcs, &it)) {
@@ -653,6 +1032,8 @@ static void retry_all_routing(struct peer *restarted_peer)
 			command_htlc_fulfill(restarted_peer, h);
 		else if (h->fail)
 			command_htlc_fail(restarted_peer, h);
+		else if (!h->dst)
+			their_htlc_added(restarted_peer, h, restarted_peer);
 	}
 }
 
@@ -765,6 +1146,28 @@ struct feechanges_table {
 	enum feechange_state from, to;
 };
 
+/* How many changes changestates would make. */
+static size_t count_changes(const struct peer *peer,
+			    const struct htlcs_table *table,
+			    size_t n,
+			    const struct feechanges_table *ftable,
+			    size_t n_ftable)
+{
+	struct htlc_map_iter it;
+	struct htlc *h;
+	size_t i, num = 0;
+
+	for (h = htlc_map_first(&peer->htlcs, &it);
+	     h;
+	     h = htlc_map_next(&peer->htlcs, &it)) {
+		for (i = 0; i < n; i++)
+			num += (h->state == table[i].from);
+	}
+	for (i = 0; i < n_ftable; i++)
+		num += (peer->feechanges[ftable[i].from] != NULL);
+	return num;
+}
+
 static const char *changestates(struct peer *peer,
 				const struct htlcs_table *table,
 				size_t n,
@@ -775,7 +1178,15 @@ static const char *changestates(struct peer *peer,
 	struct htlc_map_iter it;
 	struct htlc *h;
 	bool changed = false;
-	size_t i;
+	const tal_t *ctx = tal(peer, char);
+	bool *bulk = tal_arr(ctx, bool, n), *moved = tal_arrz(ctx, bool, n);
+	struct htlc **changed_htlcs = tal_arr(ctx, struct htlc *, 0);
+	size_t i, num;
+
+	/* Rather than an UPDATE per HTLC, the db moves them by state. */
+	for (i = 0; i < n; i++)
+		bulk[i] = db_commit
+			&& htlc_changestate_bulk(table[i].from, table[i].to);
 
 	for (h = htlc_map_first(&peer->htlcs, &it);
 	     h;
@@ -783,16 +1194,30 @@ static const char *changestates(struct peer *peer,
 		for (i = 0; i < n; i++) {
 			if (h->state == table[i].from) {
 				if (!adjust_cstates(peer, h,
-						    table[i].from, table[i].to))
+						    table[i].from, table[i].to)) {
+					tal_free(ctx);
 					return "accounting error";
+				}
 				htlc_changestate(h, table[i].from,
-						 table[i].to, db_commit);
-				check_both_committed(peer, h);
-				changed = true;
+						 table[i].to,
+						 db_commit && !bulk[i]);
+				num = tal_count(changed_htlcs);
+				tal_resize(&changed_htlcs, num + 1);
+				changed_htlcs[num] = h;
+				changed = moved[i] = true;
 			}
 		}
 	}
 
+	for (i = 0; i < n; i++)
+		if (bulk[i] && moved[i])
+			db_update_htlc_states(peer, table[i].from, table[i].to);
+
+	/* Once the db agrees, since these can touch the HTLCs' rows. */
+	for (i = 0; i < tal_count(changed_htlcs); i++)
+		check_both_committed(peer, changed_htlcs[i]);
+	tal_free(ctx);
+
 	for (i = 0; i < n_ftable; i++) {
 		struct feechange *f = peer->feechanges[ftable[i].from];
 		if (!f)
@@ -1085,6 +1510,11 @@ static Pkt *handle_pkt_htlc_add(struct peer *peer, const Pkt *pkt)
 	if (err)
 		return err;
 	assert(htlc->state == RCVD_ADD_HTLC);
+
+	/* We can't refuse the add itself without failing the channel, so
+	 * note why now, and fail it once it's committed. */
+	htlc->refused = htlc_admission(peer, peer->local.staging_cstate,
+				       REMOTE, htlc->msatoshi);
 	
 	/* BOLT #2:
 	 *
@@ -1252,6 +1682,7 @@ static Pkt *handle_pkt_revocation(struct peer *peer, const Pkt *pkt,
 	if (db_commit_transaction(peer) != NULL)
 		return pkt_err(peer, "database error");
 
+	stats_latency(peer->dstate, STATS_COMMIT_RTT, peer->commit_sent);
 	return NULL;
 }	
 
@@ -1497,28 +1928,29 @@ static void state_single(struct peer *peer,
 {
 	const struct bitcoin_tx *broadcast;
 	enum state newstate;
-	size_t old_outpkts = tal_count(peer->outpkt);
+	size_t old_outpkts = peer->num_outpkt;
 
 	newstate = state(peer, input, pkt, &broadcast);
 	set_peer_state(peer, newstate, input_name(input), false);
 
 	/* We never come here again once we leave opening states. */
 	if (state_is_normal(peer->state)) {
-		assert(!peer->nc);
-		peer->nc = add_connection(peer->dstate,
-					  &peer->dstate->id, peer->id,
-					  peer->dstate->config.fee_base,
-					  peer->dstate->config.fee_per_satoshi,
-					  peer->dstate->config.min_htlc_expiry,
-					  peer->dstate->config.min_htlc_expiry);
+		assert(!get_connection(peer->dstate,
+				       &peer->dstate->id, peer->id));
+		add_connection(peer->dstate,
+			       &peer->dstate->id, peer->id,
+			       peer->dstate->config.fee_base,
+			       peer->dstate->config.fee_per_satoshi,
+			       peer->dstate->config.min_htlc_expiry,
+			       peer->dstate->config.min_htlc_expiry, 0);
 	}
 
 	/* If we added uncommitted changes, we should have set them to send. */
 	if (peer_uncommitted_changes(peer))
 		assert(peer->commit_timer);
 	
-	if (tal_count(peer->outpkt) > old_outpkts) {
-		Pkt *outpkt = peer->outpkt[old_outpkts];
+	if (peer->num_outpkt > old_outpkts) {
+		const Pkt *outpkt = queued_pkt(peer, old_outpkts)->pkt;
 		log_add(peer->log, " (out %s)", pkt_name(outpkt->pkt_case));
 	}
 	if (broadcast)
@@ -1560,60 +1992,6 @@ static void state_event(struct peer *peer,
 	}
 }
 
-/* Create a HTLC fulfill transaction for onchain.tx[out_num]. */
-static const struct bitcoin_tx *htlc_fulfill_tx(const struct peer *peer,
-						unsigned int out_num)
-{
-	struct bitcoin_tx *tx = bitcoin_tx(peer, 1, 1);
-	const struct htlc *htlc = peer->onchain.htlcs[out_num];
-	const u8 *wscript = peer->onchain.wscripts[out_num];
-	struct bitcoin_signature sig;
-	u64 fee, satoshis;
-
-	assert(htlc->r);
-
-	tx->input[0].index = out_num;
-	tx->input[0].txid = peer->onchain.txid;
-	satoshis = htlc->msatoshi / 1000;
-	tx->input[0].amount = tal_dup(tx->input, u64, &satoshis);
-	tx->input[0].sequence_number = bitcoin_nsequence(&peer->remote.locktime);
-
-	/* Using a new output address here would be useless: they can tell
-	 * it's their HTLC, and that we collected it via rval. */
-	tx->output[0].script = scriptpubkey_p2sh(tx,
-				 bitcoin_redeem_single(tx,
-						       peer->dstate->secpctx,
-						       &peer->local.finalkey));
-	tx->output[0].script_length = tal_count(tx->output[0].script);
-
-	log_debug(peer->log, "Pre-witness txlen = %zu\n",
-		  measure_tx_cost(tx) / 4);
-
-	assert(measure_tx_cost(tx) == 83 * 4);
-
-	/* Witness length can vary, due to DER encoding of sigs, but we
-	 * use 539 from an example run. */
-	fee = fee_by_feerate(83 + 539 / 4, get_feerate(peer->dstate));
-
-	/* FIXME: Fail gracefully in these cases (not worth collecting) */
-	if (fee > satoshis || is_dust(satoshis - fee))
-		fatal("HTLC fulfill amount of %"PRIu64" won't cover fee %"PRIu64,
-		      satoshis, fee);
-
-	tx->output[0].amount = satoshis - fee;
-
-	sig.stype = SIGHASH_ALL;
-	peer_sign_htlc_fulfill(peer, tx, wscript, &sig.sig);
-
-	tx->input[0].witness = bitcoin_witness_htlc(tx, peer->dstate->secpctx,
-						    htlc->r, &sig, wscript);
-
-	log_debug(peer->log, "tx cost for htlc fulfill tx: %zu",
-		  measure_tx_cost(tx));
-
-	return tx;
-}
-
 static bool command_htlc_set_fail(struct peer *peer, struct htlc *htlc,
 				  enum fail_error error_code, const char *why)
 {
@@ -1659,11 +2037,9 @@ static bool fulfill_onchain(struct peer *peer, struct htlc *htlc)
 	for (i = 0; i < tal_count(peer->onchain.htlcs); i++) {
 		if (peer->onchain.htlcs[i] == htlc) {
 			/* Already irrevocably resolved? */
-			if (peer->onchain.resolved[i])
+			if (peer->onchain.resolved[i] || sweep_pending(peer, i))
 				return false;
-			peer->onchain.resolved[i]
-				= htlc_fulfill_tx(peer, i);
-			broadcast_tx(peer, peer->onchain.resolved[i]);
+			sweep_onchain_output(peer, i, SWEEP_HTLC_FULFILL);
 			return true;
 		}
 	}
@@ -1695,13 +2071,8 @@ static bool command_htlc_fulfill(struct peer *peer, struct htlc *htlc)
 	return true;
 }
 
-const char *command_htlc_add(struct peer *peer, u64 msatoshi,
-			     unsigned int expiry,
-			     const struct sha256 *rhash,
-			     struct htlc *src,
-			     const u8 *route,
-			     u32 *error_code,
-			     struct htlc **htlc)
+static const char *htlc_add_problem(struct peer *peer, unsigned int expiry,
+				    u32 *error_code)
 {
 	struct abs_locktime locktime;
 
@@ -1742,10 +2113,32 @@ const char *command_htlc_add(struct peer *peer, u64 msatoshi,
 		*error_code = NOT_FOUND_404;
 		return "peer not available";
 	}
+	return NULL;
+}
+
+const char *command_htlc_add(struct peer *peer, u64 msatoshi,
+			     unsigned int expiry,
+			     const struct sha256 *rhash,
+			     struct htlc *src,
+			     const u8 *route,
+			     u32 *error_code,
+			     struct htlc **htlc)
+{
+	const char *err;
+
+	peer_wake(peer);
+	err = htlc_add_problem(peer, expiry, error_code);
+	if (err) {
+		if (taken(route))
+			tal_free(route);
+		return err;
+	}
 
+	/* A taken route (eg. the onion we just peeled) isn't copied. */
 	*htlc = peer_new_htlc(peer, peer->htlc_id_counter,
 			      msatoshi, rhash, expiry, route, tal_count(route),
 			      src, SENT_ADD_HTLC);
+	peer->usage.htlcs_offered++;
 
 	/* BOLT #2:
 	 *
@@ -1779,41 +2172,113 @@ const char *command_htlc_add(struct peer *peer, u64 msatoshi,
 	return NULL;
 }
 
-static struct io_plan *pkt_out(struct io_conn *conn, struct peer *peer)
+static struct io_plan *pkt_out(struct io_conn *conn, struct peer *peer);
+
+static void link_delay_done(struct peer *peer)
 {
-	Pkt *out;
-	size_t n = tal_count(peer->outpkt);
+	peer->link_delayed = true;
+	io_wake(&peer->link_delayed);
+}
 
-	if (n == 0) {
-		/* We close the connection once we've sent everything. */
-		if (!state_can_io(peer->state)) {
-			log_debug(peer->log, "pkt_out: no IO possible, closing");
-			return io_close(conn);
-		}
-		return io_out_wait(conn, peer, pkt_out, peer);
+/* --dev-link-latency and --dev-link-loss: a lost packet on a stream looks
+ * like a dead connection, so that's what we give them. */
+static struct io_plan *link_impair(struct io_conn *conn, struct peer *peer)
+{
+	struct lightningd_state *dstate = peer->dstate;
+
+	if (peer->link_delayed) {
+		peer->link_delayed = false;
+		return NULL;
+	}
+
+	if (dstate->dev_link_loss_percent
+	    && pseudorand(100) < dstate->dev_link_loss_percent) {
+		log_unusual(peer->log, "dev-link-loss: dropping connection");
+		return io_close(conn);
+	}
+
+	if (time_to_nsec(dstate->dev_link_latency)) {
+		new_reltimer(dstate, peer, dstate->dev_link_latency,
+			     link_delay_done, peer);
+		return io_out_wait(conn, &peer->link_delayed, pkt_out, peer);
+	}
+	return NULL;
+}
+
+static struct io_plan *pkt_out(struct io_conn *conn, struct peer *peer)
+{
+	const Pkt *out[PEER_WRITE_MAX_PKTS];
+	size_t lens[PEER_WRITE_MAX_PKTS];
+	struct io_plan *plan;
+	size_t i, n = peer->num_outpkt;
+
+	if (n == 0) {
+		/* We close the connection once we've sent everything. */
+		if (!state_can_io(peer->state)) {
+			log_debug(peer->log, "pkt_out: no IO possible, closing");
+			return io_close(conn);
+		}
+		return io_out_wait(conn, peer, pkt_out, peer);
 	}
 
 	if (peer->fake_close || !peer->output_enabled)
 		return io_out_wait(conn, peer, pkt_out, peer);
 
-	out = peer->outpkt[0];
-	memmove(peer->outpkt, peer->outpkt + 1, (sizeof(*peer->outpkt)*(n-1)));
-	tal_resize(&peer->outpkt, n-1);
-	log_debug(peer->log, "pkt_out: writing %s", pkt_name(out->pkt_case));
-	return peer_write_packet(conn, peer, out, pkt_out);
+	/* Send everything which is on disk; don't tell them about updates
+	 * which aren't yet. */
+	for (i = 0; i < n && i < PEER_WRITE_MAX_PKTS; i++) {
+		if (!db_batch_done(peer->dstate, queued_pkt(peer, i)->batch))
+			break;
+	}
+	if (i == 0)
+		return io_out_wait(conn, peer->dstate->db, pkt_out, peer);
+
+	plan = link_impair(conn, peer);
+	if (plan)
+		return plan;
+
+	n = i;
+	for (i = 0; i < n; i++) {
+		out[i] = queued_pkt(peer, i)->pkt;
+		lens[i] = queued_pkt(peer, i)->len;
+		log_debug(peer->log, "pkt_out: writing %s",
+			  pkt_name(out[i]->pkt_case));
+		stats_pkt_out(peer->dstate, out[i]->pkt_case);
+		trace2(pkt_out, peer, out[i]->pkt_case);
+	}
+	drop_queued_pkts(peer, n);
+
+	/* They're encrypted by now, so we're done with them. */
+	plan = peer_write_packets(conn, peer, out, lens, n, pkt_out);
+	for (i = 0; i < n; i++)
+		free_sent_pkt(peer, cast_const(Pkt *, out[i]));
+	return plan;
 }
 
 static void clear_output_queue(struct peer *peer)
 {
-	size_t i, n = tal_count(peer->outpkt);
-	for (i = 0; i < n; i++)
-		tal_free(peer->outpkt[i]);
-	tal_resize(&peer->outpkt, 0);
+	size_t i;
+	for (i = 0; i < peer->num_outpkt; i++)
+		free_sent_pkt(peer, queued_pkt(peer, i)->pkt);
+	drop_queued_pkts(peer, peer->num_outpkt);
+}
+
+/* Only this thread's: what the signing threads do isn't charged. */
+static u64 cpu_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (u64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
 static struct io_plan *pkt_in(struct io_conn *conn, struct peer *peer)
 {
 	bool keep_going;
+	u64 start = cpu_usec();
+
+	stats_pkt_in(peer->dstate, peer->inpkt->pkt_case);
+	trace2(pkt_in, peer, peer->inpkt->pkt_case);
 
 	/* We ignore packets if they tell us to, or we're closing already */
 	if (peer->fake_close || !state_can_io(peer->state))
@@ -1829,7 +2294,11 @@ static struct io_plan *pkt_in(struct io_conn *conn, struct peer *peer)
 		keep_going = true;
 	}
 
-	peer->inpkt = tal_free(peer->inpkt);
+	peer_release_packet(peer);
+	peer->usage.cpu_usec += cpu_usec() - start;
+	/* This is what keeps peers fair: ccan/io only reads once the loop
+	 * has polled again, so each peer gets one packet per iteration,
+	 * however fast it sends.  Don't loop over buffered packets here. */
 	if (keep_going)
 		return peer_read_packet(conn, peer, pkt_in);
 	else
@@ -1909,12 +2378,9 @@ static void forget_uncommitted_changes(struct peer *peer)
 	log_add_struct(peer->log, " to %s",
 			 struct channel_state, peer->remote.commit->cstate);
 
-	tal_free(peer->local.staging_cstate);
-	tal_free(peer->remote.staging_cstate);
-	peer->local.staging_cstate
-		= copy_cstate(peer, peer->local.commit->cstate);
-	peer->remote.staging_cstate
-		= copy_cstate(peer, peer->remote.commit->cstate);
+	/* It's flat, so we can simply overwrite what's there. */
+	*peer->local.staging_cstate = *peer->local.commit->cstate;
+	*peer->remote.staging_cstate = *peer->remote.commit->cstate;
 
 	/* We forget everything we're routing, and re-send.  This
 	 * works for the reload-from-database case as well as the
@@ -2073,9 +2539,23 @@ static void destroy_peer(struct peer *peer)
 	if (peer->conn)
 		io_close(peer->conn);
 	list_del_from(&peer->dstate->peers, &peer->list);
+	if (peer->id) {
+		peer_map_del(peer->dstate->peers_by_id, peer);
+		peer_der_map_del(peer->dstate->peers_by_der, peer);
+	}
+	if (peer->reconnect_queued)
+		list_del_from(&peer->dstate->reconnect_queue,
+			      &peer->reconnect_list);
+	if (peer->reconnecting)
+		peer->dstate->reconnects_inflight--;
 }
 
+/* Seconds between reconnect attempts, as we back off. */
+#define RECONNECT_MIN_DELAY 1
+#define RECONNECT_MAX_DELAY 60
+
 static void try_reconnect(struct peer *peer);
+static void reconnect_done(struct peer *peer);
 
 static void peer_disconnect(struct io_conn *conn, struct peer *peer)
 {
@@ -2084,6 +2564,8 @@ static void peer_disconnect(struct io_conn *conn, struct peer *peer)
 	/* No longer connected. */
 	peer->conn = NULL;
 	peer->connected = false;
+	peer->unresponsive = false;
+	peer->last_active = controlled_time();
 
 	/* Not even set up yet?  Simply free.*/
 	if (peer->state == STATE_INIT) {
@@ -2109,12 +2591,15 @@ static u64 desired_commit_feerate(struct lightningd_state *dstate)
 	return get_feerate(dstate) * dstate->config.commitment_fee_percent / 100;
 }
 
-static void maybe_propose_new_feerate(struct peer *peer)
+/* The rate we'd propose, capped at what we can afford on their commit
+ * (theirs): current if that's all we can do. */
+static u64 new_commit_feerate(struct peer *peer,
+			      const struct channel_state *theirs, u64 current)
 {
 	u64 rate, max_rate;
 
 	rate = desired_commit_feerate(peer->dstate);
-	max_rate = approx_max_feerate(peer->remote.commit->cstate, LOCAL);
+	max_rate = approx_max_feerate(theirs, LOCAL);
 
 	/* BOLT #2:
 	 *
@@ -2128,18 +2613,42 @@ static void maybe_propose_new_feerate(struct peer *peer)
 		rate = max_rate;
 
 		/* If this is less than we have no, don't change! */
-		if (rate < peer->local.staging_cstate->fee_rate) {
+		if (rate < current) {
 			log_debug(peer->log, "Leaving old rate in place");
-			return;
+			return current;
 		}
 	}
+	return rate;
+}
+
+/* Returns true if it queued a feechange. */
+static bool maybe_propose_new_feerate(struct peer *peer)
+{
+	u64 rate = new_commit_feerate(peer, peer->remote.commit->cstate,
+				      peer->local.staging_cstate->fee_rate);
 
 	/* No fee rate change?  Fine. */
 	if (peer->local.staging_cstate->fee_rate == rate)
-		return;
+		return false;
 
 	set_feechange(peer, rate, SENT_FEECHANGE);
 	queue_pkt_feechange(peer, rate);
+	return true;
+}
+
+/* Everyone gets the new rate in the same pass, so their commits go out
+ * together rather than trickling along behind other changes. */
+void peers_new_feerate(struct lightningd_state *dstate)
+{
+	struct peer *peer;
+
+	list_for_each(&dstate->peers, peer, list) {
+		/* The rest pick it up when they next commit. */
+		if (!state_can_commit(peer->state) || !peer->connected)
+			continue;
+		if (maybe_propose_new_feerate(peer))
+			remote_changes_pending(peer);
+	}
 }
 
 static void do_commit(struct peer *peer, struct command *jsoncmd)
@@ -2157,6 +2666,7 @@ static void do_commit(struct peer *peer, struct command *jsoncmd)
 		{ SENT_FEECHANGE_REVOCATION, SENT_FEECHANGE_ACK_COMMIT}
 	};
 	bool to_us_only;
+	size_t num_changes;
 
 	/* If we want to change the payrate, do it now. */
 	maybe_propose_new_feerate(peer);
@@ -2183,6 +2693,8 @@ static void do_commit(struct peer *peer, struct command *jsoncmd)
 		= tal_dup(peer, struct sha256,
 			  &peer->remote.commit->revocation_hash);
 
+	num_changes = count_changes(peer, changes, ARRAY_SIZE(changes),
+				    feechanges, ARRAY_SIZE(feechanges));
 	db_start_transaction(peer);
 		
 	errmsg = changestates(peer, changes, ARRAY_SIZE(changes),
@@ -2235,6 +2747,14 @@ static void do_commit(struct peer *peer, struct command *jsoncmd)
 	if (db_commit_transaction(peer) != NULL)
 		goto database_error;
 
+	peer->commit_stats.last = controlled_time();
+	peer->commit_stats.commits++;
+	peer->commit_stats.changes += num_changes;
+	peer->commit_stats.last_changes = num_changes;
+	if (num_changes > peer->commit_stats.max_changes)
+		peer->commit_stats.max_changes = num_changes;
+	log_debug(peer->log, "do_commit: %zu changes", num_changes);
+
 	queue_pkt_commit(peer, ci->sig);
 	return;
 
@@ -2248,9 +2768,16 @@ static void try_commit(struct peer *peer)
 {
 	peer->commit_timer = NULL;
 
-	if (state_can_commit(peer->state) && peer->connected)
+	if (state_can_commit(peer->state) && peer->connected) {
+		u64 start = cpu_usec();
 		do_commit(peer, NULL);
-	else {
+		peer->usage.cpu_usec += cpu_usec() - start;
+	} else if (peer->connected
+		   && (peer->state == STATE_NORMAL_COMMITTING
+		       || peer->state == STATE_SHUTDOWN_COMMITTING)) {
+		/* Their revocation will get to peer_update_complete. */
+		log_debug(peer->log, "try_commit: awaiting revocation");
+	} else {
 		/* FIXME: try again when we receive revocation /
 		 * reconnect, rather than using timer! */
 		log_debug(peer->log, "try_commit: state=%s, re-queueing timer",
@@ -2293,6 +2820,12 @@ static bool peer_reconnected(struct peer *peer,
 	 * immediately so don't make peer a parent. */
 	peer->conn = conn;
 	io_set_finish(conn, peer_disconnect, peer);
+	peer_set_keepalive(peer, io_conn_fd(conn));
+
+	/* That's our attempt finished (reconnect_failed won't be called). */
+	if (we_connected)
+		reconnect_done(peer);
+	peer->reconnect_delay = time_from_sec(RECONNECT_MIN_DELAY);
 
 	name = netaddr_name(peer, &addr);
 	log_info(peer->log, "Reconnected %s %s", 
@@ -2316,14 +2849,25 @@ struct peer *new_peer(struct lightningd_state *dstate,
 	peer->connected = false;
 	peer->id = NULL;
 	peer->dstate = dstate;
+	peer->dormant = NULL;
+	peer->last_active = controlled_time();
 	peer->io_data = NULL;
 	peer->secrets = NULL;
 	list_head_init(&peer->watches);
-	peer->outpkt = tal_arr(peer, Pkt *, 0);
+	peer->outpkt = tal_arr(peer, struct out_pkt, 0);
+	peer->outpkt_start = peer->num_outpkt = 0;
+	peer->pkt_pool = NULL;
+	peer->pkt_pool_len = 0;
+	peer->outpkt_bytes = 0;
+	peer->congested = false;
+	peer->rtt_usec = 0;
+	peer->unresponsive = false;
 	peer->commit_jsoncmd = NULL;
 	list_head_init(&peer->outgoing_txs);
 	list_head_init(&peer->their_commits);
+	peer->num_their_commits = 0;
 	peer->anchor.ok_depth = -1;
+	peer->anchor.input = NULL;
 	peer->order_counter = 0;
 	peer->their_commitsigs = 0;
 	peer->cur_commit.watch = NULL;
@@ -2338,11 +2882,17 @@ struct peer *new_peer(struct lightningd_state *dstate,
 	peer->onchain.htlcs = NULL;
 	peer->onchain.wscripts = NULL;
 	peer->commit_timer = NULL;
-	peer->nc = NULL;
+	memset(&peer->commit_stats, 0, sizeof(peer->commit_stats));
+	memset(&peer->usage, 0, sizeof(peer->usage));
+	peer->htlc_stats = new_htlc_stats(peer);
 	peer->their_prev_revocation_hash = NULL;
 	peer->conn = NULL;
+	peer->reconnect_queued = peer->reconnecting = false;
+	peer->reconnect_delay = time_from_sec(RECONNECT_MIN_DELAY);
+	peer->irc_announce = NULL;
 	peer->fake_close = false;
 	peer->output_enabled = true;
+	peer->link_delayed = false;
 	peer->local.offer_anchor = offer_anchor;
 	if (!blocks_to_rel_locktime(dstate->config.locktime_blocks,
 				    &peer->local.locktime))
@@ -2354,6 +2904,7 @@ struct peer *new_peer(struct lightningd_state *dstate,
 	log_debug(peer->log, "New peer %p", peer);
 	
 	htlc_map_init(&peer->htlcs);
+	peer->htlc_next_check = 0;
 	memset(peer->feechanges, 0, sizeof(peer->feechanges));
 	shachain_init(&peer->their_preimages);
 
@@ -2401,7 +2952,7 @@ static bool peer_first_connected(struct peer *peer,
 	struct netaddr addr;
 
 	peer->io_data = tal_steal(peer, iod);
-	peer->id = tal_dup(peer, struct pubkey, id);
+	peer_set_id(peer, id);
 	peer->local.commit_fee_rate = desired_commit_feerate(peer->dstate);
 
 	peer->htlc_id_counter = 0;
@@ -2410,6 +2961,7 @@ static bool peer_first_connected(struct peer *peer,
 	 * immediately so don't make peer a parent. */
 	peer->conn = conn;
 	io_set_finish(conn, peer_disconnect, peer);
+	peer_set_keepalive(peer, io_conn_fd(conn));
 	
 	peer->anchor.min_depth = get_block_height(peer->dstate);
 
@@ -2444,10 +2996,23 @@ static u64 peer_revocations_received(struct peer *peer)
 	return -peer->their_preimages.min_index;
 }
 
+/* First block at which check_htlc_expiry has to act on h. */
+static u32 htlc_check_height(const struct htlc *h)
+{
+	if (htlc_owner(h) == LOCAL)
+		return h->deadline;
+	/* We give it an extra block: see check_htlc_expiry. */
+	return abs_locktime_to_blocks(&h->expiry) + 1;
+}
+
 static void htlc_destroy(struct htlc *htlc)
 {
 	if (!htlc_map_del(&htlc->peer->htlcs, htlc))
 		fatal("Could not find htlc to destroy");
+	htlc_rhash_map_del(htlc->peer->dstate->htlcs_by_rhash, htlc);
+	/* So we'll send the source on again if we need to. */
+	if (htlc->src && htlc->src->dst == htlc)
+		htlc->src->dst = NULL;
 }
 
 struct htlc *peer_new_htlc(struct peer *peer, 
@@ -2468,10 +3033,19 @@ struct htlc *peer_new_htlc(struct peer *peer,
 	h->rhash = *rhash;
 	h->r = NULL;
 	h->fail = NULL;
+	h->refused = NULL;
 	if (!blocks_to_abs_locktime(expiry, &h->expiry))
 		fatal("Invalid HTLC expiry %u", expiry);
 	h->routing = tal_dup_arr(h, u8, route, routelen, 0);
+	h->routing_id = NULL;
 	h->src = src;
+	h->dst = NULL;
+	h->next_der = NULL;
+	h->created = h->changed = controlled_time();
+	h->scripts[LOCAL].wscript = h->scripts[REMOTE].wscript = NULL;
+	h->scripts[LOCAL].p2wsh = h->scripts[REMOTE].p2wsh = NULL;
+	if (src)
+		src->dst = h;
 	if (htlc_owner(h) == LOCAL) {
 		if (src) {
 			h->deadline = abs_locktime_to_blocks(&src->expiry)
@@ -2484,8 +3058,12 @@ struct htlc *peer_new_htlc(struct peer *peer,
 		assert(htlc_owner(h) == REMOTE);
 	}
 	htlc_map_add(&peer->htlcs, h);
+	htlc_rhash_map_add(peer->dstate->htlcs_by_rhash, h);
 	tal_add_destructor(h, htlc_destroy);
 
+	if (htlc_check_height(h) < peer->htlc_next_check)
+		peer->htlc_next_check = htlc_check_height(h);
+
 	return h;
 }
 
@@ -2547,6 +3125,7 @@ static struct io_plan *crypto_on_reconnect(struct io_conn *conn,
 {
 	u64 sigs, revokes, shutdown, closing;
 
+	peer_wake(peer);
 	/* Setup peer->conn and peer->io_data */
 	if (!peer_reconnected(peer, conn, SOCK_STREAM, IPPROTO_TCP,
 			      iod, id, we_connected))
@@ -2600,6 +3179,62 @@ static struct io_plan *crypto_on_reconnect_out(struct io_conn *conn,
 	return crypto_on_reconnect(conn, dstate, iod, id, peer, true);
 }
 
+static void destroy_batch_input(struct anchor_input *input)
+{
+	struct anchor_batch *batch = input->batch;
+	size_t i;
+
+	for (i = 0; i < batch->num_peers; i++)
+		if (batch->peers[i] && batch->peers[i]->anchor.input == input)
+			batch->peers[i] = NULL;
+	anchor_batch_failed(batch, "Peer freed");
+	maybe_free_batch(batch);
+}
+
+static void destroy_batch_connect(struct json_connecting *connect)
+{
+	list_del_from(&connect->batch->connecting, &connect->list);
+	/* Still has the input?  It never became a peer. */
+	if (connect->input) {
+		char *why = tal_fmt(connect->batch, "Failed to connect to %s:%s",
+				    connect->name, connect->port);
+		anchor_batch_failed(connect->batch, why);
+		tal_free(why);
+	}
+	maybe_free_batch(connect->batch);
+}
+
+static void destroy_anchor_batch(struct anchor_batch *batch)
+{
+	struct json_connecting *connect;
+	size_t i;
+
+	/* We're going first (eg. on shutdown): they mustn't come back to us. */
+	list_for_each(&batch->connecting, connect, list)
+		tal_del_destructor(connect, destroy_batch_connect);
+	for (i = 0; i < batch->num_peers; i++)
+		if (batch->peers[i])
+			tal_del_destructor(batch->peers[i]->anchor.input,
+					   destroy_batch_input);
+}
+
+/* @peer has already taken connect->input. */
+static void anchor_batch_connected(struct json_connecting *connect,
+				   struct peer *peer)
+{
+	struct anchor_batch *batch = connect->batch;
+
+	batch->peers[batch->num_connected++] = peer;
+	tal_add_destructor(peer->anchor.input, destroy_batch_input);
+	connect->input = NULL;
+	tal_free(connect);
+
+	if (batch->num_connected == batch->num_peers && batch->cmd) {
+		command_success(batch->cmd, null_response(batch->cmd));
+		batch->cmd = NULL;
+	}
+}
+
 static struct io_plan *crypto_on_out(struct io_conn *conn,
 				     struct lightningd_state *dstate,
 				     struct io_data *iod,
@@ -2607,19 +3242,32 @@ static struct io_plan *crypto_on_out(struct io_conn *conn,
 				     const struct pubkey *id,
 				     struct json_connecting *connect)
 {
+	struct peer *peer;
+
+	/* Others in its batch already failed?  Don't bother. */
+	if (connect->batch && connect->batch->failed) {
+		tal_free(connect);
+		return io_close(conn);
+	}
+
 	/* Initiator currently funds channel */
-	struct peer *peer = new_peer(dstate, log, STATE_INIT, CMD_OPEN_WITH_ANCHOR);
+	peer = new_peer(dstate, log, STATE_INIT, CMD_OPEN_WITH_ANCHOR);
 	if (!peer_first_connected(peer, conn, SOCK_STREAM, IPPROTO_TCP,
 				  iod, id, true)) {
-		command_fail(connect->cmd, "Failed to make peer for %s:%s",
-			     connect->name, connect->port);
+		if (connect->batch)
+			tal_free(connect);
+		else
+			command_fail(connect->cmd,
+				     "Failed to make peer for %s:%s",
+				     connect->name, connect->port);
 		return io_close(conn);
 	}
-	peer->io_data = tal_steal(peer, iod);
-	peer->id = tal_dup(peer, struct pubkey, id);
 	peer->anchor.input = tal_steal(peer, connect->input);
 
-	command_success(connect->cmd, null_response(connect));
+	if (connect->batch)
+		anchor_batch_connected(connect, peer);
+	else
+		command_success(connect->cmd, null_response(connect));
 	return peer_crypto_on(conn, peer);
 }
 
@@ -2631,6 +3279,10 @@ static struct io_plan *peer_connected_out(struct io_conn *conn,
 	const char *name;
 	struct netaddr addr;
 
+	/* If the connection fails now, the batch has to know. */
+	if (connect->batch)
+		tal_steal(conn, connect);
+
 	l = new_log(conn, dstate->log_record, "OUT-%s:%s:",
 		    connect->name, connect->port);
 
@@ -2739,6 +3391,46 @@ fail:
 	return -1;
 }
 
+static void add_listener(struct lightningd_state *dstate, int fd)
+{
+	size_t n = tal_count(dstate->listen_fds);
+
+	tal_resize(&dstate->listen_fds, n + 1);
+	dstate->listen_fds[n] = fd;
+	io_new_listener(dstate, fd, peer_connected_in, dstate);
+}
+
+/* The previous us (see dev-restart) left these open for us. */
+static void inherit_listeners(struct lightningd_state *dstate)
+{
+	int *fds = dstate->listen_fds;
+	size_t i;
+
+	dstate->listen_fds = tal_arr(dstate, int, 0);
+	for (i = 0; i < tal_count(fds); i++) {
+		struct netaddr addr;
+
+		addr.addrlen = sizeof(addr.saddr);
+		if (getsockname(fds[i], &addr.saddr.s, &addr.addrlen) != 0) {
+			log_unusual(dstate->base_log,
+				    "Inherited fd %i is not a socket: %s",
+				    fds[i], strerror(errno));
+			continue;
+		}
+		if (addr.saddr.s.sa_family == AF_INET6)
+			dstate->portnum = ntohs(addr.saddr.ipv6.sin6_port);
+		else
+			dstate->portnum = ntohs(addr.saddr.ipv4.sin_port);
+		log_info(dstate->base_log, "Inherited listener on port %u",
+			 dstate->portnum);
+		add_listener(dstate, fds[i]);
+	}
+	tal_free(fds);
+
+	if (!tal_count(dstate->listen_fds))
+		fatal("Could not use any inherited listeners");
+}
+
 void setup_listeners(struct lightningd_state *dstate, unsigned int portnum)
 {
 	struct sockaddr_in addr;
@@ -2746,6 +3438,11 @@ void setup_listeners(struct lightningd_state *dstate, unsigned int portnum)
 	socklen_t len;
 	int fd1, fd2;
 
+	if (tal_count(dstate->listen_fds)) {
+		inherit_listeners(dstate);
+		return;
+	}
+
 	memset(&addr, 0, sizeof(addr));
 	addr.sin_family = AF_INET;
 	addr.sin_addr.s_addr = INADDR_ANY;
@@ -2774,7 +3471,7 @@ void setup_listeners(struct lightningd_state *dstate, unsigned int portnum)
 			log_info(dstate->base_log,
 				 "Creating IPv6 listener on port %u",
 				 dstate->portnum);
-			io_new_listener(dstate, fd1, peer_connected_in, dstate);
+			add_listener(dstate, fd1);
 		}
 	}
 
@@ -2793,7 +3490,7 @@ void setup_listeners(struct lightningd_state *dstate, unsigned int portnum)
 			log_info(dstate->base_log,
 				 "Creating IPv4 listener on port %u",
 				 dstate->portnum);
-			io_new_listener(dstate, fd2, peer_connected_in, dstate);
+			add_listener(dstate, fd2);
 		}
 	}
 
@@ -2804,26 +3501,81 @@ void setup_listeners(struct lightningd_state *dstate, unsigned int portnum)
 static void peer_failed(struct lightningd_state *dstate,
 			struct json_connecting *connect)
 {
+	/* Its destructor tells the batch. */
+	if (connect->batch) {
+		tal_free(connect);
+		return;
+	}
+
 	/* FIXME: Better diagnostics! */
 	command_fail(connect->cmd, "Failed to connect to peer %s:%s",
 		     connect->name, connect->port);
 }
 
+/* Find the output of hex @txtok we can spend (without one, our largest
+ * output worth less than @limit), or command_fail. */
+static bool anchor_input_from_tx(struct command *cmd,
+				 const char *buffer, const jsmntok_t *txtok,
+				 u64 limit, struct anchor_input *input)
+{
+	struct bitcoin_tx *tx;
+	int output;
+
+	input->batch = NULL;
+	if (!txtok) {
+		struct wallet_utxo *u = wallet_select_coin(cmd->dstate, limit);
+		if (!u) {
+			command_fail(cmd, "No wallet outputs to fund with");
+			return false;
+		}
+		input->txid = u->out.txid;
+		input->index = u->out.index;
+		input->amount = u->amount;
+		input->w = u->w;
+		return true;
+	}
+
+	tx = bitcoin_tx_from_hex(cmd, buffer + txtok->start,
+				 txtok->end - txtok->start);
+	if (!tx) {
+		command_fail(cmd, "'%.*s' is not a valid transaction",
+			     txtok->end - txtok->start,
+			     buffer + txtok->start);
+		return false;
+	}
+
+	bitcoin_txid(tx, &input->txid);
+
+	/* Find an output we know how to spend. */
+	input->w = NULL;
+	for (output = 0; output < tx->output_count; output++) {
+		input->w = wallet_can_spend(cmd->dstate, &tx->output[output]);
+		if (input->w)
+			break;
+	}
+	if (!input->w) {
+		command_fail(cmd, "Tx doesn't send to wallet address");
+		return false;
+	}
+
+	input->index = output;
+	input->amount = tx->output[output].amount;
+	tal_free(tx);
+	return true;
+}
+
 static void json_connect(struct command *cmd,
 			const char *buffer, const jsmntok_t *params)
 {
 	struct json_connecting *connect;
 	jsmntok_t *host, *port, *txtok;
-	struct bitcoin_tx *tx;
-	int output;
-	size_t txhexlen;
 
 	if (!json_get_params(buffer, params,
 			     "host", &host,
 			     "port", &port,
-			     "tx", &txtok,
+			     "?tx", &txtok,
 			     NULL)) {
-		command_fail(cmd, "Need host, port and tx to a wallet address");
+		command_fail(cmd, "Need host and port");
 		return;
 	}
 
@@ -2833,35 +3585,12 @@ static void json_connect(struct command *cmd,
 				    host->end - host->start);
 	connect->port = tal_strndup(connect, buffer + port->start,
 				    port->end - port->start);
+	connect->batch = NULL;
 	connect->input = tal(connect, struct anchor_input);
-
-	txhexlen = txtok->end - txtok->start;
-	tx = bitcoin_tx_from_hex(connect->input, buffer + txtok->start,
-				 txhexlen);
-	if (!tx) {
-		command_fail(cmd, "'%.*s' is not a valid transaction",
-			     txtok->end - txtok->start,
-			     buffer + txtok->start);
+	if (!anchor_input_from_tx(cmd, buffer, txtok, ANCHOR_LIMIT_SATOSHIS,
+				  connect->input))
 		return;
-	}
 
-	bitcoin_txid(tx, &connect->input->txid);
-
-	/* Find an output we know how to spend. */
-	connect->input->w = NULL;
-	for (output = 0; output < tx->output_count; output++) {
-		connect->input->w
-			= wallet_can_spend(cmd->dstate, &tx->output[output]);
-		if (connect->input->w)
-			break;
-	}
-	if (!connect->input->w) {
-		command_fail(cmd, "Tx doesn't send to wallet address");
-		return;
-	}
-
-	connect->input->index = output;
-	connect->input->amount = tx->output[output].amount;
 	if (anchor_too_large(connect->input->amount)) {
 		command_fail(cmd, "Amount %"PRIu64" is too large",
 			     connect->input->amount);
@@ -2877,10 +3606,105 @@ static void json_connect(struct command *cmd,
 const struct json_command connect_command = {
 	"connect",
 	json_connect,
-	"Connect to a {host} at {port} using hex-encoded {tx} to fund",
+	"Connect to a {host} at {port} using hex-encoded {tx} to fund"
+	" (default: the largest wallet output which will do)",
 	"Returns an empty result on success"
 };
 
+static void json_connectmany(struct command *cmd,
+			     const char *buffer, const jsmntok_t *params)
+{
+	struct anchor_batch *batch;
+	struct anchor_input input;
+	jsmntok_t *peerstok, *txtok;
+	const jsmntok_t *t, *end;
+	size_t i, n;
+
+	if (!json_get_params(buffer, params,
+			     "peers", &peerstok,
+			     "?tx", &txtok,
+			     NULL)) {
+		command_fail(cmd, "Need peers");
+		return;
+	}
+
+	if (peerstok->type != JSMN_ARRAY || peerstok->size == 0) {
+		command_fail(cmd, "peers must be an array of {host, port}");
+		return;
+	}
+	end = json_next(peerstok);
+	for (t = peerstok + 1; t < end; t = json_next(t)) {
+		if (t->type != JSMN_OBJECT
+		    || !json_get_member(buffer, t, "host")
+		    || !json_get_member(buffer, t, "port")) {
+			command_fail(cmd, "peers must be an array of {host, port}");
+			return;
+		}
+	}
+	n = peerstok->size;
+
+	/* So the first share (with the remainder) isn't too large. */
+	if (!anchor_input_from_tx(cmd, buffer, txtok,
+				  n * (ANCHOR_LIMIT_SATOSHIS - n), &input))
+		return;
+
+	/* The first channel gets any remainder. */
+	if (anchor_too_large(input.amount / n + input.amount % n)) {
+		command_fail(cmd, "Amount %"PRIu64" is too large for %zu"
+			     " channels", input.amount, n);
+		return;
+	}
+
+	batch = tal(cmd->dstate, struct anchor_batch);
+	batch->dstate = cmd->dstate;
+	batch->cmd = cmd;
+	list_head_init(&batch->connecting);
+	batch->peers = tal_arrz(batch, struct peer *, n);
+	batch->num_peers = n;
+	batch->num_connected = batch->num_opened = batch->num_signed = 0;
+	batch->broadcast = batch->failed = false;
+	tal_add_destructor(batch, destroy_anchor_batch);
+
+	for (i = 0, t = peerstok + 1; i < n; i++, t = json_next(t)) {
+		const jsmntok_t *host = json_get_member(buffer, t, "host");
+		const jsmntok_t *port = json_get_member(buffer, t, "port");
+		struct json_connecting *connect;
+
+		connect = tal(batch, struct json_connecting);
+		connect->cmd = NULL;
+		connect->name = tal_strndup(connect, buffer + host->start,
+					    host->end - host->start);
+		connect->port = tal_strndup(connect, buffer + port->start,
+					    port->end - port->start);
+		connect->input = tal_dup(connect, struct anchor_input, &input);
+		connect->input->amount = input.amount / n;
+		if (i == 0)
+			connect->input->amount += input.amount % n;
+		connect->input->batch = batch;
+		connect->batch = batch;
+		list_add_tail(&batch->connecting, &connect->list);
+		tal_add_destructor(connect, destroy_batch_connect);
+
+		if (!dns_resolve_and_connect(cmd->dstate,
+					     connect->name, connect->port,
+					     peer_connected_out, peer_failed,
+					     connect)) {
+			/* Those already connecting will see it's failed. */
+			anchor_batch_failed(batch, "DNS failed");
+			tal_free(connect);
+			return;
+		}
+	}
+}
+
+const struct json_command connectmany_command = {
+	"connectmany",
+	json_connectmany,
+	"Connect to {peers} (array of {host}, {port}), funding them all from"
+	" hex-encoded {tx} (default: a wallet output), one output each",
+	"Returns an empty result once they're all connected"
+};
+
 /* Have any of our HTLCs passed their deadline? */
 static bool any_deadline_past(struct peer *peer)
 {
@@ -2911,12 +3735,28 @@ static void check_htlc_expiry(struct peer *peer)
 	struct htlc_map_iter it;
 	struct htlc *h;
 
+	/* Most blocks, nothing is due. */
+	if (height < peer->htlc_next_check)
+		return;
+
+	/* Work out when to look next as we go.  Anything already due, but
+	 * not acted on, we look at again next block. */
+	peer->htlc_next_check = UINT32_MAX;
+
 	/* Check their currently still-existing htlcs for expiry */
 	for (h = htlc_map_first(&peer->htlcs, &it);
 	     h;
 	     h = htlc_map_next(&peer->htlcs, &it)) {
 		assert(!abs_locktime_is_seconds(&h->expiry));
 
+		if (!htlc_is_dead(h)) {
+			u32 due = htlc_check_height(h);
+			if (due <= height)
+				due = height + 1;
+			if (due < peer->htlc_next_check)
+				peer->htlc_next_check = due;
+		}
+
 		/* Only their consider HTLCs which are completely locked in. */
 		if (h->state != RCVD_ADD_ACK_REVOCATION)
 			continue;
@@ -2931,6 +3771,8 @@ static void check_htlc_expiry(struct peer *peer)
 		command_htlc_set_fail(peer, h,
 				      REQUEST_TIMEOUT_408, "timed out");
 		if (db_commit_transaction(peer) != NULL) {
+			/* We didn't look at them all. */
+			peer->htlc_next_check = 0;
 			peer_fail(peer, __func__);
 			return;
 		}
@@ -2969,6 +3811,18 @@ static enum watch_result anchor_depthchange(struct peer *peer,
 		/* FIXME: Report losses! */
 		fatal("Funding transaction was unspent!");
 
+	/* Asleep, it has no HTLCs: only its fee rate can matter, by the
+	 * same measure as awake.  It has no changes in flight, so its last
+	 * commit stands for both sides'. */
+	if (peer->dormant) {
+		u64 rate = peer->dormant->fee_rate;
+
+		if (rate >= get_feerate(peer->dstate)
+		    && new_commit_feerate(peer, peer->dormant, rate) == rate)
+			return KEEP_WATCHING;
+		peer_wake(peer);
+	}
+
 	/* Since this gets called on every new block, check HTLCs here. */
 	check_htlc_expiry(peer);
 
@@ -3101,60 +3955,6 @@ static bool is_mutual_close(const struct peer *peer,
 	return false;
 }
 
-/* Create a HTLC refund collection for onchain.tx output out_num. */
-static const struct bitcoin_tx *htlc_timeout_tx(const struct peer *peer,
-						unsigned int out_num)
-{
-	const struct htlc *htlc = peer->onchain.htlcs[out_num];
-	const u8 *wscript = peer->onchain.wscripts[out_num];
-	struct bitcoin_tx *tx = bitcoin_tx(peer, 1, 1);
-	struct bitcoin_signature sig;
-	u64 fee, satoshis;
-
-	/* We must set locktime so HTLC expiry can OP_CHECKLOCKTIMEVERIFY */
-	tx->lock_time = htlc->expiry.locktime;
-	tx->input[0].index = out_num;
-	tx->input[0].txid = peer->onchain.txid;
-	satoshis = htlc->msatoshi / 1000;
-	tx->input[0].amount = tal_dup(tx->input, u64, &satoshis);
-	tx->input[0].sequence_number = bitcoin_nsequence(&peer->remote.locktime);
-
-	/* Using a new output address here would be useless: they can tell
-	 * it's our HTLC, and that we collected it via timeout. */
-	tx->output[0].script = scriptpubkey_p2sh(tx,
-				 bitcoin_redeem_single(tx,
-						       peer->dstate->secpctx,
-						       &peer->local.finalkey));
-	tx->output[0].script_length = tal_count(tx->output[0].script);
-
-	log_unusual(peer->log, "Pre-witness txlen = %zu\n",
-		    measure_tx_cost(tx) / 4);
-
-	assert(measure_tx_cost(tx) == 83 * 4);
-
-	/* Witness length can vary, due to DER encoding of sigs, but we
-	 * use 539 from an example run. */
-	fee = fee_by_feerate(83 + 539 / 4, get_feerate(peer->dstate));
-
-	/* FIXME: Fail gracefully in these cases (not worth collecting) */
-	if (fee > satoshis || is_dust(satoshis - fee))
-		fatal("HTLC refund amount of %"PRIu64" won't cover fee %"PRIu64,
-		      satoshis, fee);
-
-	tx->output[0].amount = satoshis - fee;
-
-	sig.stype = SIGHASH_ALL;
-	peer_sign_htlc_refund(peer, tx, wscript, &sig.sig);
-
-	tx->input[0].witness = bitcoin_witness_htlc(tx, peer->dstate->secpctx,
-						    NULL, &sig, wscript);
-
-	log_unusual(peer->log, "tx cost for htlc timeout tx: %zu",
-		    measure_tx_cost(tx));
-
-	return tx;
-}
-
 static void reset_onchain_closing(struct peer *peer)
 {
 	if (peer->onchain.tx) {
@@ -3202,11 +4002,24 @@ static enum watch_result our_htlc_timeout_depth(struct peer *peer,
 	if (depth == 0)
 		return KEEP_WATCHING;
 	if (depth + 1 < peer->dstate->config.min_htlc_expiry)
-		return KEEP_WATCHING;
+		return KEEP_WATCHING_UNTIL(peer->dstate->config.min_htlc_expiry
+					   - 1);
 	fail_own_htlc(peer, htlc);
 	return DELETE_WATCH;
 }
 
+void peer_onchain_swept(struct peer *peer, unsigned int out_num,
+			const struct bitcoin_tx *tx)
+{
+	struct htlc *h = peer->onchain.htlcs[out_num];
+
+	peer->onchain.resolved[out_num] = tx;
+	if (h && htlc_owner(h) == LOCAL)
+		watch_tx_depth(tx, peer, tx,
+			       peer->dstate->config.min_htlc_expiry - 1,
+			       our_htlc_timeout_depth, h);
+}
+
 static enum watch_result our_htlc_depth(struct peer *peer,
 					unsigned int depth,
 					const struct sha256_double *txid,
@@ -3214,13 +4027,14 @@ static enum watch_result our_htlc_depth(struct peer *peer,
 					unsigned int out_num)
 {
 	struct htlc *h = peer->onchain.htlcs[out_num];
-	u32 height;
+	u32 height, target;
 
 	/* Must be in a block. */
 	if (depth == 0)
 		return KEEP_WATCHING;
 
 	height = get_block_height(peer->dstate);
+	target = depth;
 
 	/* BOLT #onchain:
 	 *
@@ -3230,28 +4044,27 @@ static enum watch_result our_htlc_depth(struct peer *peer,
 	 * out* once the HTLC is expired, AND the output's
 	 * `OP_CHECKSEQUENCEVERIFY` delay has passed.
 	 */
+	/* Rather than hear about every block, wait for the depth at
+	 * which it will be. */
 	if (height < abs_locktime_to_blocks(&h->expiry))
-		return KEEP_WATCHING;
+		target += abs_locktime_to_blocks(&h->expiry) - height;
 
 	if (whose_commit == LOCAL) {
-		if (depth < rel_locktime_to_blocks(&peer->remote.locktime))
-			return KEEP_WATCHING;
+		if (target < rel_locktime_to_blocks(&peer->remote.locktime))
+			target = rel_locktime_to_blocks(&peer->remote.locktime);
 	}
 
+	if (target > depth)
+		return KEEP_WATCHING_UNTIL(target);
+
 	/* BOLT #onchain:
 	 *
 	 * If the output has *timed out* and not been *resolved*, the node
 	 * MUST *resolve* the output by spending it.
 	 */
 	/* FIXME: we should simply delete this watch if HTLC is fulfilled. */
-	if (!peer->onchain.resolved[out_num]) {
-		peer->onchain.resolved[out_num]	= htlc_timeout_tx(peer, out_num);
-		watch_tx(peer->onchain.resolved[out_num],
-			 peer,
-			 peer->onchain.resolved[out_num],
-			 our_htlc_timeout_depth, h);
-		broadcast_tx(peer, peer->onchain.resolved[out_num]);
-	}
+	if (!peer->onchain.resolved[out_num])
+		sweep_onchain_output(peer, out_num, SWEEP_HTLC_TIMEOUT);
 	return DELETE_WATCH;
 }
 
@@ -3276,7 +4089,7 @@ static enum watch_result their_htlc_depth(struct peer *peer,
 					  const struct sha256_double *txid,
 					  ptrint_t *out_num)
 {
-	u32 height;
+	u32 height, expiry;
 	const struct htlc *htlc = peer->onchain.htlcs[ptr2int(out_num)];
 
 	/* Must be in a block. */
@@ -3290,8 +4103,9 @@ static enum watch_result their_htlc_depth(struct peer *peer,
 	 * Otherwise, if the output HTLC has expired, it is considered
 	 * *irrevocably resolved*.
 	 */
-	if (height < abs_locktime_to_blocks(&htlc->expiry))
-		return KEEP_WATCHING;
+	expiry = abs_locktime_to_blocks(&htlc->expiry);
+	if (height < expiry)
+		return KEEP_WATCHING_UNTIL(depth + expiry - height);
 
 	peer->onchain.resolved[ptr2int(out_num)] = irrevocably_resolved(peer);
 	return DELETE_WATCH;
@@ -3304,7 +4118,8 @@ static enum watch_result our_main_output_depth(struct peer *peer,
 {
 	/* Not past CSV timeout? */
 	if (depth < rel_locktime_to_blocks(&peer->remote.locktime))
-		return KEEP_WATCHING;
+		return KEEP_WATCHING_UNTIL(
+			rel_locktime_to_blocks(&peer->remote.locktime));
 
 	assert(peer->onchain.to_us_idx != -1);
 
@@ -3317,9 +4132,7 @@ static enum watch_result our_main_output_depth(struct peer *peer,
 	 *    recommended), the output is *resolved* by the spending
 	 *    transaction
 	 */
-	peer->onchain.resolved[peer->onchain.to_us_idx]
-		= bitcoin_spend_ours(peer);
-	broadcast_tx(peer, peer->onchain.resolved[peer->onchain.to_us_idx]);
+	sweep_onchain_output(peer, peer->onchain.to_us_idx, SWEEP_DELAYED);
 	return DELETE_WATCH;
 }
 
@@ -3334,7 +4147,7 @@ static enum watch_result our_unilateral_depth(struct peer *peer,
 	struct htlc *h;
 
 	if (depth < peer->dstate->config.min_htlc_expiry)
-		return KEEP_WATCHING;
+		return KEEP_WATCHING_UNTIL(peer->dstate->config.min_htlc_expiry);
 
 	for (h = htlc_map_first(&peer->htlcs, &it);
 	     h;
@@ -3434,8 +4247,7 @@ static void resolve_their_htlc(struct peer *peer, unsigned int out_num)
 	 * the output by spending it using the preimage.
 	 */
 	if (peer->onchain.htlcs[out_num]->r) {
-		peer->onchain.resolved[out_num]	= htlc_fulfill_tx(peer, out_num);
-		broadcast_tx(peer, peer->onchain.resolved[out_num]);
+		sweep_onchain_output(peer, out_num, SWEEP_HTLC_FULFILL);
 	} else {
 		/* BOLT #onchain:
 		 *
@@ -3455,11 +4267,13 @@ static void resolve_our_unilateral(struct peer *peer)
 {
 	unsigned int i;
 	const struct bitcoin_tx *tx = peer->onchain.tx;
+	u32 csv = rel_locktime_to_blocks(&peer->remote.locktime);
 
 	/* This only works because we always watch for a long time before
 	 * freeing peer, by which time this has resolved.  We could create
 	 * resolved[] entries for these uncommitted HTLCs, too. */
-	watch_tx(tx, peer, tx, our_unilateral_depth, NULL);
+	watch_tx_depth(tx, peer, tx, peer->dstate->config.min_htlc_expiry,
+		       our_unilateral_depth, NULL);
 
 	for (i = 0; i < tx->output_count; i++) {
 		/* BOLT #onchain:
@@ -3471,7 +4285,8 @@ static void resolve_our_unilateral(struct peer *peer)
 		 *    spending the output.
 		 */
 		if (i == peer->onchain.to_us_idx)
-			watch_tx(tx, peer, tx, our_main_output_depth, NULL);
+			watch_tx_depth(tx, peer, tx, csv,
+				       our_main_output_depth, NULL);
 
 		/* BOLT #onchain:
 		 *
@@ -3559,7 +4374,7 @@ static void resolve_mutual_close(struct peer *peer)
 				       peer->onchain.tx->output_count);
 }
 
-/* Called every time the tx spending the funding tx changes depth. */
+/* Called as the tx spending the funding tx changes depth. */
 static enum watch_result check_for_resolution(struct peer *peer,
 					      unsigned int depth,
 					      const struct sha256_double *txid,
@@ -3585,7 +4400,7 @@ static enum watch_result check_for_resolution(struct peer *peer,
 	 * 100 deep on the most-work blockchain.
 	 */
 	if (depth < forever)
-		return KEEP_WATCHING;
+		return KEEP_WATCHING_UNTIL(forever);
 
 	for (i = 0; i < n; i++) {
 		struct sha256_double txid;
@@ -3617,18 +4432,19 @@ static bool find_their_old_tx(struct peer *peer,
 			      const struct sha256_double *txid,
 			      u64 *idx)
 {
-	/* FIXME: Don't keep these in memory, search db here. */
 	struct their_commit *tc;
 
 	log_debug_struct(peer->log, "Finding txid %s", struct sha256_double,
 			 txid);
-	list_for_each(&peer->their_commits, tc, list) {
+	/* Most likely it's a recent one. */
+	list_for_each_rev(&peer->their_commits, tc, list) {
 		if (structeq(&tc->txid, txid)) {
 			*idx = tc->commit_num;
 			return true;
 		}
 	}
-	return false;
+	/* We only remember the last few from this run. */
+	return db_find_commit_map(peer, txid, idx);
 }
 
 static void resolve_their_steal(struct peer *peer,
@@ -3637,6 +4453,8 @@ static void resolve_their_steal(struct peer *peer,
 	int i, n;
 	const struct bitcoin_tx *tx = peer->onchain.tx;
 	struct bitcoin_tx *steal_tx;
+	struct signature *sigs;
+	const u8 **wscripts;
 	size_t wsize = 0;
 	u64 input_total = 0, fee;
 
@@ -3645,6 +4463,8 @@ static void resolve_their_steal(struct peer *peer,
 		steal_tx = bitcoin_tx(tx, tx->output_count, 1);
 	else
 		steal_tx = bitcoin_tx(tx, tx->output_count - 1, 1);
+	/* onchain.wscripts is by output: we need them by input. */
+	wscripts = tal_arr(steal_tx, const u8 *, steal_tx->input_count);
 	n = 0;
 
 	log_debug(peer->log, "Analyzing tx to steal:");
@@ -3678,8 +4498,9 @@ static void resolve_their_steal(struct peer *peer,
 		steal_tx->input[n].index = i;
 		steal_tx->input[n].amount = tal_dup(steal_tx, u64,
 						    &tx->output[i].amount);
+		wscripts[n] = peer->onchain.wscripts[i];
 		/* Track witness size, for fee. */
-		wsize += tal_count(peer->onchain.wscripts[n]);
+		wsize += tal_count(wscripts[n]);
 		input_total += tx->output[i].amount;
 		n++;
 	}
@@ -3705,21 +4526,20 @@ static void resolve_their_steal(struct peer *peer,
 	steal_tx->output[0].script_length = tal_count(steal_tx->output[0].script);
 
 	/* Now, we can sign them all (they're all of same form). */
+	sigs = tal_arr(steal_tx, struct signature, n);
+	peer_sign_steal_inputs(peer, steal_tx, wscripts, sigs);
 	for (i = 0; i < n; i++) {
 		struct bitcoin_signature sig;
 
 		sig.stype = SIGHASH_ALL;
-		peer_sign_steal_input(peer, steal_tx, i,
-				      peer->onchain.wscripts[i],
-				      &sig.sig);
+		sig.sig = sigs[i];
 
 		steal_tx->input[i].witness
 			= bitcoin_witness_secret(steal_tx,
 						 peer->dstate->secpctx,
 						 revocation_preimage,
 						 sizeof(*revocation_preimage),
-						 &sig,
-						 peer->onchain.wscripts[i]);
+						 &sig, wscripts[i]);
 	}
 
 	broadcast_tx(peer, steal_tx);
@@ -3764,6 +4584,7 @@ static enum watch_result anchor_spent(struct peer *peer,
 	u64 commit_num;
 
 	assert(input_num < tx->input_count);
+	peer_wake(peer);
 
 	/* We only ever sign single-input txs. */
 	if (input_num != 0) {
@@ -3817,6 +4638,8 @@ static enum watch_result anchor_spent(struct peer *peer,
 		struct sha256 *preimage, rhash;
 
 		preimage = get_rhash(peer, commit_num, &rhash);
+		/* An old commit can hold HTLCs which have since finished. */
+		db_load_archived_htlcs(peer);
 		if (!map_onchain_outputs(peer, &rhash, tx, REMOTE, commit_num)) {
 			/* Should not happen */
 			log_broken(peer->log,
@@ -3887,6 +4710,80 @@ static void anchor_timeout(struct peer *peer)
 		state_event(peer, BITCOIN_ANCHOR_TIMEOUT, NULL);
 }
 
+/* Channels funded by the same anchor tx share one watch on it. */
+struct anchor_watch {
+	struct list_node list;
+	struct sha256_double txid;
+	/* The anchor_watchers. */
+	struct list_head channels;
+	struct txwatch *w;
+};
+
+struct anchor_watcher {
+	struct list_node list;
+	struct anchor_watch *aw;
+	struct peer *peer;
+};
+
+static enum watch_result anchor_watch_depth(struct peer *unused,
+					    unsigned int depth,
+					    const struct sha256_double *txid,
+					    struct anchor_watch *aw)
+{
+	struct anchor_watcher *aww, *next;
+
+	list_for_each_safe(&aw->channels, aww, next, list)
+		anchor_depthchange(aww->peer, depth, txid, NULL);
+	return KEEP_WATCHING;
+}
+
+static void destroy_anchor_watcher(struct anchor_watcher *aww)
+{
+	struct anchor_watch *aw = aww->aw;
+
+	list_del_from(&aw->channels, &aww->list);
+	if (list_empty(&aw->channels))
+		tal_free(aw);
+	/* It logs through one of us, so that mustn't be the one going. */
+	else if (aw->w->peer == aww->peer)
+		aw->w->peer = list_top(&aw->channels, struct anchor_watcher,
+				       list)->peer;
+}
+
+static void destroy_anchor_watch(struct anchor_watch *aw)
+{
+	struct anchor_watcher *aww;
+
+	list_del(&aw->list);
+	/* We're going first (eg. on shutdown). */
+	list_for_each(&aw->channels, aww, list)
+		tal_del_destructor(aww, destroy_anchor_watcher);
+}
+
+static void add_anchor_watch(struct peer *peer)
+{
+	struct anchor_watch *aw;
+	struct anchor_watcher *aww;
+
+	list_for_each(&peer->dstate->anchor_watches, aw, list)
+		if (structeq(&aw->txid, &peer->anchor.txid))
+			goto found;
+
+	aw = tal(peer->dstate, struct anchor_watch);
+	aw->txid = peer->anchor.txid;
+	list_head_init(&aw->channels);
+	aw->w = watch_txid(aw, peer, &aw->txid, anchor_watch_depth, aw);
+	list_add_tail(&peer->dstate->anchor_watches, &aw->list);
+	tal_add_destructor(aw, destroy_anchor_watch);
+
+found:
+	aww = tal(peer, struct anchor_watcher);
+	aww->aw = aw;
+	aww->peer = peer;
+	list_add_tail(&aw->channels, &aww->list);
+	tal_add_destructor(aww, destroy_anchor_watcher);
+}
+
 void peer_watch_anchor(struct peer *peer,
 		       int depth,
 		       enum state_input depthok,
@@ -3897,8 +4794,10 @@ void peer_watch_anchor(struct peer *peer,
 	assert(timeout == BITCOIN_ANCHOR_TIMEOUT || timeout == INPUT_NONE);
 
 	peer->anchor.ok_depth = depth;
-	watch_txid(peer, peer, &peer->anchor.txid, anchor_depthchange, NULL);
-	watch_txo(peer, peer, &peer->anchor.txid, 0, anchor_spent, NULL);
+	add_anchor_watch(peer);
+	/* Each spends only its own output. */
+	watch_txo(peer, peer, &peer->anchor.txid, peer->anchor.index,
+		  anchor_spent, NULL);
 
 	/* For anchor timeout, expect 20 minutes per block, +2 hours.
 	 *
@@ -3958,59 +4857,127 @@ struct bitcoin_tx *peer_create_close_tx(struct peer *peer, u64 fee)
 			       cstate.side[REMOTE].pay_msat / 1000);
 }
 
-/* Creation the bitcoin anchor tx, spending output user provided. */
-void bitcoin_create_anchor(struct peer *peer)
+/* Spend the output user provided: output i funds peers[i]'s channel, with
+ * its share of the input (they split the fee). */
+static void create_anchor(struct lightningd_state *dstate,
+			  struct peer **peers, size_t n)
 {
-	u64 fee;
-	struct bitcoin_tx *tx = bitcoin_tx(peer, 1, 1);
+	const struct anchor_input *input = peers[0]->anchor.input;
+	struct bitcoin_tx *tx = bitcoin_tx(peers[0], 1, n);
+	struct sha256_double txid;
+	u64 fee, share, amount = 0;
 	size_t i;
 
-	/* We must be offering anchor for us to try creating it */
-	assert(peer->local.offer_anchor);
-
-	tx->output[0].script = scriptpubkey_p2wsh(tx, peer->anchor.witnessscript);
-	tx->output[0].script_length = tal_count(tx->output[0].script);
+	for (i = 0; i < n; i++) {
+		tx->output[i].script = scriptpubkey_p2wsh(tx,
+					peers[i]->anchor.witnessscript);
+		tx->output[i].script_length = tal_count(tx->output[i].script);
+		amount += peers[i]->anchor.input->amount;
+	}
 
 	/* Add input script length.  FIXME: This is normal case, not exact. */
 	fee = fee_by_feerate(measure_tx_cost(tx)/4 + 1+73 + 1+33 + 1,
-			     get_feerate(peer->dstate));
-	if (fee >= peer->anchor.input->amount)
-		/* FIXME: Report an error here!
-		 * We really should set this when they do command, but
-		 * we need to modify state to allow immediate anchor
-		 * creation: using estimate_fee is a convenient workaround. */
-		fatal("Amount %"PRIu64" below fee %"PRIu64,
-		      peer->anchor.input->amount, fee);
-
-	tx->output[0].amount = peer->anchor.input->amount - fee;
-
-	tx->input[0].txid = peer->anchor.input->txid;
-	tx->input[0].index = peer->anchor.input->index;
-	tx->input[0].amount = tal_dup(tx->input, u64,
-				      &peer->anchor.input->amount);
-
-	wallet_add_signed_input(peer->dstate, peer->anchor.input->w, tx, 0);
-
-	bitcoin_txid(tx, &peer->anchor.txid);
-	peer->anchor.tx = tx;
-	peer->anchor.index = 0;
-	/* We'll need this later, when we're told to broadcast it. */
-	peer->anchor.satoshis = tx->output[0].amount;
+			     get_feerate(dstate));
+	for (i = 0; i < n; i++) {
+		/* The first pays any remainder, as it got any extra. */
+		share = fee / n + (i == 0 ? fee % n : 0);
+		if (share >= peers[i]->anchor.input->amount)
+			/* FIXME: Report an error here!
+			 * We really should set this when they do command, but
+			 * we need to modify state to allow immediate anchor
+			 * creation: using estimate_fee is a convenient
+			 * workaround. */
+			fatal("Amount %"PRIu64" below fee %"PRIu64,
+			      peers[i]->anchor.input->amount, share);
+		tx->output[i].amount = peers[i]->anchor.input->amount - share;
+	}
+
+	tx->input[0].txid = input->txid;
+	tx->input[0].index = input->index;
+	tx->input[0].amount = tal_dup(tx->input, u64, &amount);
+
+	wallet_add_signed_input(dstate, input->w, tx, 0);
 
 	/* To avoid malleation, all inputs must be segwit! */
 	for (i = 0; i < tx->input_count; i++)
 		assert(tx->input[i].witness);
+
+	bitcoin_txid(tx, &txid);
+	for (i = 0; i < n; i++) {
+		peers[i]->anchor.txid = txid;
+		peers[i]->anchor.index = i;
+		/* We'll need this later, when we're told to broadcast it. */
+		peers[i]->anchor.satoshis = tx->output[i].amount;
+		/* Each broadcasts (and keeps) its own copy. */
+		peers[i]->anchor.tx = i ? bitcoin_tx_dup(peers[i], tx) : tx;
+	}
+}
+
+static void anchor_created(struct peer *peer)
+{
+	if (peer->state == STATE_OPEN_WAIT_FOR_ANCHOR_CREATE)
+		state_event(peer, BITCOIN_ANCHOR_CREATED, NULL);
+}
+
+/* Creation the bitcoin anchor tx, spending output user provided. */
+bool bitcoin_create_anchor(struct peer *peer)
+{
+	struct anchor_batch *batch = peer->anchor.input->batch;
+	size_t i;
+
+	/* We must be offering anchor for us to try creating it */
+	assert(peer->local.offer_anchor);
+
+	if (!batch) {
+		create_anchor(peer->dstate, &peer, 1);
+		return true;
+	}
+
+	/* If it failed, we'll be failed in a moment. */
+	if (batch->failed)
+		return false;
+
+	/* We need everyone's commit key for their output. */
+	if (++batch->num_opened < batch->num_peers)
+		return false;
+
+	create_anchor(peer->dstate, batch->peers, batch->num_peers);
+	for (i = 0; i < batch->num_peers; i++)
+		if (batch->peers[i] != peer)
+			new_reltimer(peer->dstate, batch->peers[i],
+				     time_from_sec(0), anchor_created,
+				     batch->peers[i]);
+	return true;
 }
 
 /* We didn't end up broadcasting the anchor: we don't need to do anything
- * to "release" TXOs, since we have our own internal wallet now. */
+ * to "release" TXOs, since we have our own internal wallet now.  But if
+ * it was shared, the other channels can't have it either. */
 void bitcoin_release_anchor(struct peer *peer, enum state_input done)
 {
+	if (peer->anchor.input && peer->anchor.input->batch)
+		anchor_batch_failed(peer->anchor.input->batch,
+				    "Channel failed to open");
 }
 
 /* Get the bitcoin anchor tx. */
 const struct bitcoin_tx *bitcoin_anchor(struct peer *peer)
 {
+	struct anchor_batch *batch = peer->anchor.input->batch;
+	size_t i;
+
+	if (!batch)
+		return peer->anchor.tx;
+
+	/* Until they can all close unilaterally, it mustn't go out. */
+	if (batch->failed || ++batch->num_signed < batch->num_peers)
+		return NULL;
+
+	batch->broadcast = true;
+	for (i = 0; i < batch->num_peers; i++)
+		if (batch->peers[i] != peer)
+			broadcast_tx(batch->peers[i],
+				     batch->peers[i]->anchor.tx);
 	return peer->anchor.tx;
 }
 
@@ -4082,18 +5049,63 @@ static struct io_plan *peer_reconnect(struct io_conn *conn, struct peer *peer)
 				 crypto_on_reconnect_out, peer);
 }
 
+static bool peer_has_htlcs(struct peer *peer)
+{
+	struct htlc_map_iter it;
+
+	return htlc_map_first(&peer->htlcs, &it) != NULL;
+}
+
+static void start_reconnect(struct peer *peer);
+
+/* Connection attempt over (whichever way), so someone else can go. */
+static void reconnect_done(struct peer *peer)
+{
+	struct lightningd_state *dstate = peer->dstate;
+	u32 max = dstate->config.max_reconnects;
+
+	if (!peer->reconnecting)
+		return;
+	peer->reconnecting = false;
+	dstate->reconnects_inflight--;
+
+	while (!max || dstate->reconnects_inflight < max) {
+		struct peer *next = list_pop(&dstate->reconnect_queue,
+					     struct peer, reconnect_list);
+		if (!next)
+			break;
+		next->reconnect_queued = false;
+		start_reconnect(next);
+	}
+}
+
 /* We can't only retry when we want to send: they may want to send us
  * something but not be able to connect (NAT).  So keep retrying.. */ 
 static void reconnect_failed(struct io_conn *conn, struct peer *peer)
 {
+	struct timerel delay;
+	u64 msec;
+
+	reconnect_done(peer);
+
 	/* Already otherwise connected (ie. they connected in)? */
 	if (peer->conn) {
 		log_debug(peer->log, "reconnect_failed: already connected");
 		return;
 	}
 
-	log_debug(peer->log, "Setting timer to re-connect");
-	new_reltimer(peer->dstate, peer, time_from_sec(15), try_reconnect, peer);
+	/* Spread out, so peers which failed together don't retry together. */
+	msec = time_to_msec(peer->reconnect_delay);
+	delay = timerel_add(peer->reconnect_delay,
+			    time_from_msec(pseudorand(msec / 2 + 1)));
+	log_debug(peer->log, "Setting timer to re-connect in %"PRIu64"ms",
+		  time_to_msec(delay));
+	new_reltimer(peer->dstate, peer, delay, try_reconnect, peer);
+
+	peer->reconnect_delay = time_multiply(peer->reconnect_delay, 2);
+	if (time_greater(peer->reconnect_delay,
+			 time_from_sec(RECONNECT_MAX_DELAY)))
+		peer->reconnect_delay = time_from_sec(RECONNECT_MAX_DELAY);
 }
 
 static struct io_plan *init_conn(struct io_conn *conn, struct peer *peer)
@@ -4105,14 +5117,14 @@ static struct io_plan *init_conn(struct io_conn *conn, struct peer *peer)
 	return io_connect(conn, &a, peer_reconnect, peer);
 }
 
-static void try_reconnect(struct peer *peer)
+static void start_reconnect(struct peer *peer)
 {
 	struct io_conn *conn;
 	struct peer_address *addr;
 	char *name;
 	int fd;
 
-	/* Already reconnected? */
+	/* They may have connected in while we waited. */
 	if (peer->conn) {
 		log_debug(peer->log, "try_reconnect: already connected");
 		return;
@@ -4134,6 +5146,8 @@ static void try_reconnect(struct peer *peer)
 	}
 
 	assert(!peer->conn);
+	peer->reconnecting = true;
+	peer->dstate->reconnects_inflight++;
 	conn = io_new_conn(peer->dstate, fd, init_conn, peer);
 	name = netaddr_name(peer, &addr->addr);
 	log_debug(peer->log, "Trying to reconnect to %s", name);
@@ -4141,12 +5155,43 @@ static void try_reconnect(struct peer *peer)
 	io_set_finish(conn, reconnect_failed, peer);
 }
 
+static void try_reconnect(struct peer *peer)
+{
+	struct lightningd_state *dstate = peer->dstate;
+	u32 max = dstate->config.max_reconnects;
+
+	/* Already reconnected, or on our way? */
+	if (peer->conn) {
+		log_debug(peer->log, "try_reconnect: already connected");
+		return;
+	}
+	if (peer->reconnecting || peer->reconnect_queued)
+		return;
+
+	if (!max || dstate->reconnects_inflight < max) {
+		start_reconnect(peer);
+		return;
+	}
+
+	/* Those with HTLCs in flight have something at stake: go first. */
+	log_debug(peer->log, "try_reconnect: waiting for one of %u slots", max);
+	if (peer_has_htlcs(peer))
+		list_add(&dstate->reconnect_queue, &peer->reconnect_list);
+	else
+		list_add_tail(&dstate->reconnect_queue, &peer->reconnect_list);
+	peer->reconnect_queued = true;
+}
+
 void reconnect_peers(struct lightningd_state *dstate)
 {
 	struct peer *peer;
 
 	list_for_each(&dstate->peers, peer, list)
-		try_reconnect(peer);
+		if (peer_has_htlcs(peer))
+			try_reconnect(peer);
+	list_for_each(&dstate->peers, peer, list)
+		if (!peer_has_htlcs(peer))
+			try_reconnect(peer);
 }
 
 static void json_add_abstime(struct json_result *response,
@@ -4161,6 +5206,18 @@ static void json_add_abstime(struct json_result *response,
 	json_object_end(response);
 }
 
+static size_t count_htlcs(const struct peer *peer, enum side owner)
+{
+	struct htlc_map_iter it;
+	struct htlc *h;
+	size_t n = 0;
+
+	for (h = htlc_map_first(&peer->htlcs, &it);
+	     h; h = htlc_map_next(&peer->htlcs, &it))
+		n += (htlc_owner(h) == owner && !htlc_is_dead(h));
+	return n;
+}
+
 static void json_add_htlcs(struct json_result *response,
 			   const char *id,
 			   struct peer *peer,
@@ -4189,6 +5246,25 @@ static void json_add_htlcs(struct json_result *response,
 	json_array_end(response);
 }
 
+/* Optional "state" name and "limit" (0 for none), as getpeers and gethtlcs
+ * take them. */
+static bool json_get_filter(struct command *cmd, const char *buffer,
+			    const jsmntok_t *statetok,
+			    const jsmntok_t *limittok,
+			    const char **state, unsigned int *limit)
+{
+	*state = NULL;
+	*limit = 0;
+	if (statetok)
+		*state = tal_strndup(cmd, buffer + statetok->start,
+				     statetok->end - statetok->start);
+	if (limittok && !json_tok_number(buffer, limittok, limit)) {
+		command_fail(cmd, "limit must be a number");
+		return false;
+	}
+	return true;
+}
+
 /* FIXME: add history command which shows all prior and current commit txs */
 
 /* FIXME: Somehow we should show running DNS lookups! */
@@ -4197,12 +5273,45 @@ static void json_getpeers(struct command *cmd,
 {
 	struct peer *p;
 	struct json_result *response = new_json_result(cmd);	
+	jsmntok_t *statetok, *limittok, *offsettok, *summarytok;
+	const char *state;
+	unsigned int limit, offset = 0, n = 0, shown = 0;
+	bool summary = false;
+
+	if (!json_get_params(buffer, params,
+			     "?state", &statetok,
+			     "?limit", &limittok,
+			     "?offset", &offsettok,
+			     "?summary", &summarytok,
+			     NULL)) {
+		command_fail(cmd, "Invalid parameters");
+		return;
+	}
+	if (!json_get_filter(cmd, buffer, statetok, limittok, &state, &limit))
+		return;
+	if (offsettok && !json_tok_number(buffer, offsettok, &offset)) {
+		command_fail(cmd, "offset must be a number");
+		return;
+	}
+	if (summarytok && !json_tok_bool(buffer, summarytok, &summary)) {
+		command_fail(cmd, "summary must be true or false");
+		return;
+	}
 
 	json_object_start(response, NULL);
 	json_array_start(response, "peers");
 	list_for_each(&cmd->dstate->peers, p, list) {
 		const struct channel_state *last;
 
+		if (state && !streq(state, state_name(p->state)))
+			continue;
+		/* Those matching, in the order we have them. */
+		if (n++ < offset)
+			continue;
+		if (limit && shown == limit)
+			break;
+		shown++;
+
 		json_object_start(response, NULL);
 		json_add_string(response, "name", log_prefix(p->log));
 		json_add_string(response, "state", state_name(p->state));
@@ -4212,24 +5321,65 @@ static void json_getpeers(struct command *cmd,
 					"peerid", p->id);
 
 		json_add_bool(response, "connected", p->connected);
+		json_add_bool(response, "dormant", p->dormant != NULL);
+		if (!summary) {
+			if (p->remote.staging_cstate)
+				json_add_bool(response, "congested",
+					      peer_congested(p));
+			json_add_u64(response, "queued_bytes", p->outpkt_bytes);
+			json_add_num(response, "rtt_usec", p->rtt_usec);
+			json_add_bool(response, "unresponsive",
+				      p->unresponsive);
+			json_add_u64(response, "commits",
+				     p->commit_stats.commits);
+			json_add_u64(response, "committed_changes",
+				     p->commit_stats.changes);
+			json_add_num(response, "biggest_commit",
+				     p->commit_stats.max_changes);
+			json_add_htlc_stats(response, "htlc_stats",
+					    p->htlc_stats);
+			json_object_start(response, "usage");
+			json_add_u64(response, "cpu_usec", p->usage.cpu_usec);
+			json_add_u64(response, "bytes_in", p->usage.bytes_in);
+			json_add_u64(response, "bytes_out", p->usage.bytes_out);
+			json_add_u64(response, "db_statements",
+				     p->usage.db_statements);
+			json_add_u64(response, "htlcs_offered",
+				     p->usage.htlcs_offered);
+			json_add_u64(response, "htlcs_received",
+				     p->usage.htlcs_received);
+			json_object_end(response);
+		}
 
 		/* FIXME: Report anchor. */
 
-		if (!p->local.commit || !p->local.commit->cstate) {
+		if (p->dormant)
+			last = p->dormant;
+		else if (!p->local.commit || !p->local.commit->cstate) {
 			json_object_end(response);
 			continue;
-		}
-		last = p->local.commit->cstate;
+		} else
+			last = p->local.commit->cstate;
 
 		json_add_num(response, "our_amount", last->side[LOCAL].pay_msat);
 		json_add_num(response, "our_fee", last->side[LOCAL].fee_msat);
 		json_add_num(response, "their_amount", last->side[REMOTE].pay_msat);
 		json_add_num(response, "their_fee", last->side[REMOTE].fee_msat);
-		json_add_htlcs(response, "our_htlcs", p, LOCAL);
-		json_add_htlcs(response, "their_htlcs", p, REMOTE);
+		if (summary) {
+			json_add_num(response, "our_htlcs",
+				     count_htlcs(p, LOCAL));
+			json_add_num(response, "their_htlcs",
+				     count_htlcs(p, REMOTE));
+		} else {
+			json_add_htlcs(response, "our_htlcs", p, LOCAL);
+			json_add_htlcs(response, "their_htlcs", p, REMOTE);
+		}
 		json_object_end(response);
 	}
 	json_array_end(response);
+	/* Where the next page starts, if there's more. */
+	if (&p->list != &cmd->dstate->peers.n)
+		json_add_num(response, "next", offset + shown);
 	json_object_end(response);
 	command_success(cmd, response);
 }
@@ -4237,23 +5387,79 @@ static void json_getpeers(struct command *cmd,
 const struct json_command getpeers_command = {
 	"getpeers",
 	json_getpeers,
-	"List the current peers",
-	"Returns a 'peers' array"
+	"List the current peers, only those in {state} if given, at most {limit} from {offset}; counts instead of HTLCs if {summary}",
+	"Returns a 'peers' array, and 'next' offset if there are more"
 };
 
+/* Pages go in id order, ours before theirs with the same id: so the
+ * cursor is the id times two, plus one for theirs. */
+static u64 htlc_cursor(const struct htlc *h)
+{
+	return h->id * 2 + (htlc_owner(h) == REMOTE);
+}
+
+static int cmp_htlc_cursor(const void *a, const void *b)
+{
+	u64 ca = htlc_cursor(*(struct htlc *const *)a);
+	u64 cb = htlc_cursor(*(struct htlc *const *)b);
+
+	return ca < cb ? -1 : ca > cb;
+}
+
+static void json_add_htlc_detail(struct json_result *response,
+				 struct lightningd_state *dstate,
+				 struct htlc *h)
+{
+	const u8 *routing;
+
+	json_object_start(response, NULL);
+	json_add_u64(response, "id", h->id);
+	json_add_string(response, "state", htlc_state_name(h->state));
+	json_add_u64(response, "msatoshi", h->msatoshi);
+	json_add_abstime(response, "expiry", &h->expiry);
+	json_add_hex(response, "rhash", &h->rhash, sizeof(h->rhash));
+	if (h->r)
+		json_add_hex(response, "r", h->r, sizeof(*h->r));
+	if (htlc_owner(h) == LOCAL) {
+		json_add_num(response, "deadline", h->deadline);
+		if (h->src) {
+			json_object_start(response, "src");
+			json_add_pubkey(response, dstate->secpctx,
+					"peerid", h->src->peer->id);
+			json_add_u64(response, "id", h->src->id);
+			json_object_end(response);
+		}
+	} else {
+		routing = db_htlc_routing(h);
+		if (routing)
+			json_add_hex(response, "routing",
+				     routing, tal_count(routing));
+	}
+	json_object_end(response);
+}
+
 static void json_gethtlcs(struct command *cmd,
 			  const char *buffer, const jsmntok_t *params)
 {
 	struct peer *peer;
-	jsmntok_t *peeridtok, *resolvedtok;
-	bool resolved = false;
+	jsmntok_t *peeridtok, *resolvedtok, *statetok, *limittok, *aftertok;
+	jsmntok_t *summarytok;
+	bool resolved = false, summary = false;
 	struct json_result *response = new_json_result(cmd);
-	struct htlc *h;
+	struct htlc *h, **found;
 	struct htlc_map_iter it;
+	const char *state;
+	unsigned int limit;
+	u64 after = 0, msatoshi = 0;
+	size_t i, n = 0;
 
 	if (!json_get_params(buffer, params,
 			     "peerid", &peeridtok,
 			     "?resolved", &resolvedtok,
+			     "?state", &statetok,
+			     "?limit", &limittok,
+			     "?after", &aftertok,
+			     "?summary", &summarytok,
 			     NULL)) {
 		command_fail(cmd, "Need peerid");
 		return;
@@ -4269,39 +5475,54 @@ static void json_gethtlcs(struct command *cmd,
 		command_fail(cmd, "resolved must be true or false");
 		return;
 	}
+	if (!json_get_filter(cmd, buffer, statetok, limittok, &state, &limit))
+		return;
+	if (aftertok && !json_tok_u64(buffer, aftertok, &after)) {
+		command_fail(cmd, "after must be a number");
+		return;
+	}
+	if (summarytok && !json_tok_bool(buffer, summarytok, &summary)) {
+		command_fail(cmd, "summary must be true or false");
+		return;
+	}
 
-	json_object_start(response, NULL);
-	json_array_start(response, "htlcs");
+	if (resolved)
+		db_load_archived_htlcs(peer);
+
+	/* Filter before we sort: the archive is most of them. */
+	found = tal_arr(cmd, struct htlc *, htlc_map_count(&peer->htlcs));
 	for (h = htlc_map_first(&peer->htlcs, &it);
 	     h; h = htlc_map_next(&peer->htlcs, &it)) {
 		if (htlc_is_dead(h) && !resolved)
 			continue;
+		if (state && !streq(state, htlc_state_name(h->state)))
+			continue;
+		if (aftertok && htlc_cursor(h) <= after)
+			continue;
+		found[n++] = h;
+	}
 
-		json_object_start(response, NULL);
-		json_add_u64(response, "id", h->id);
-		json_add_string(response, "state", htlc_state_name(h->state));
-		json_add_u64(response, "msatoshi", h->msatoshi);
-		json_add_abstime(response, "expiry", &h->expiry);
-		json_add_hex(response, "rhash", &h->rhash, sizeof(h->rhash));
-		if (h->r)
-			json_add_hex(response, "r", h->r, sizeof(*h->r));
-		if (htlc_owner(h) == LOCAL) {
-			json_add_num(response, "deadline", h->deadline);
-			if (h->src) {
-				json_object_start(response, "src");
-				json_add_pubkey(response, cmd->dstate->secpctx,
-						"peerid", h->src->peer->id);
-				json_add_u64(response, "id", h->src->id);
-				json_object_end(response);
-			}
-		} else {
-			if (h->routing)
-				json_add_hex(response, "routing",
-					     h->routing, tal_count(h->routing));
-		}
+	json_object_start(response, NULL);
+	if (summary) {
+		for (i = 0; i < n; i++)
+			msatoshi += found[i]->msatoshi;
+		json_add_num(response, "count", n);
+		json_add_u64(response, "msatoshi", msatoshi);
 		json_object_end(response);
+		command_success(cmd, response);
+		return;
 	}
+
+	/* Without a limit, the order never mattered. */
+	if (limit)
+		qsort(found, n, sizeof(*found), cmp_htlc_cursor);
+
+	json_array_start(response, "htlcs");
+	for (i = 0; i < n && (!limit || i < limit); i++)
+		json_add_htlc_detail(response, cmd->dstate, found[i]);
 	json_array_end(response);
+	if (i < n)
+		json_add_u64(response, "next", htlc_cursor(found[i - 1]));
 	json_object_end(response);
 	command_success(cmd, response);
 }
@@ -4309,8 +5530,8 @@ static void json_gethtlcs(struct command *cmd,
 const struct json_command gethtlcs_command = {
 	"gethtlcs",
 	json_gethtlcs,
-	"List HTLCs for {peer}; all if {resolved} is true.",
-	"Returns a 'htlcs' array"
+	"List HTLCs for {peer}; all if {resolved} is true, only those in {state} if given, at most {limit} {after} a cursor; just count and total if {summary}",
+	"Returns a 'htlcs' array, and 'next' cursor if there are more"
 };
 
 /* To avoid freeing underneath ourselves, we free outside event loop. */
@@ -4325,6 +5546,168 @@ void cleanup_peers(struct lightningd_state *dstate)
 	}
 }
 
+/* Idle, with nothing in flight, and normal or done but for waiting for its
+ * close to be buried.  Anything else could need its channel any time. */
+static bool peer_can_sleep(const struct peer *peer, struct timeabs now)
+{
+	struct htlc_map_iter it;
+	size_t i;
+
+	if (peer->dormant || peer->conn || peer->reconnecting)
+		return false;
+	if (!peer->local.commit || !peer->remote.commit)
+		return false;
+	if (time_less(time_between(now, peer->last_active),
+		      peer->dstate->config.dormant_time))
+		return false;
+	if (htlc_map_first(&peer->htlcs, &it)
+	    || peer->num_outpkt
+	    || peer->commit_timer
+	    || peer->commit_jsoncmd)
+		return false;
+
+	if (state_is_normal(peer->state))
+		return true;
+	if (!state_is_onchain(peer->state) || !peer->onchain.resolved)
+		return false;
+	for (i = 0; i < tal_count(peer->onchain.resolved); i++)
+		if (!peer->onchain.resolved[i])
+			return false;
+	return true;
+}
+
+/* Everything db_load_peer can give back, we give up. */
+static void peer_sleep(struct peer *peer)
+{
+	struct their_commit *tc;
+	size_t i;
+
+	peer->dormant = copy_cstate(peer, peer->local.commit->cstate);
+
+	peer->local.commit = tal_free(peer->local.commit);
+	peer->remote.commit = tal_free(peer->remote.commit);
+	peer->local.staging_cstate = tal_free(peer->local.staging_cstate);
+	peer->remote.staging_cstate = tal_free(peer->remote.staging_cstate);
+	peer->their_prev_revocation_hash
+		= tal_free(peer->their_prev_revocation_hash);
+	for (i = 0; i < ARRAY_SIZE(peer->feechanges); i++)
+		peer->feechanges[i] = tal_free(peer->feechanges[i]);
+	htlc_map_clear(&peer->htlcs);
+
+	/* Those we signed are all in the database by now. */
+	while ((tc = list_pop(&peer->their_commits, struct their_commit,
+			      list)) != NULL)
+		tal_free(tc);
+	peer->num_their_commits = 0;
+
+	/* The next connection brings its own. */
+	free_pkt_pool(peer);
+	tal_resize(&peer->outpkt, 0);
+	peer->outpkt_start = 0;
+	peer->io_data = tal_free(peer->io_data);
+
+	log_info(peer->log, "Dormant");
+}
+
+void peer_wake(struct peer *peer)
+{
+	if (!peer->dormant)
+		return;
+
+	peer->dormant = tal_free(peer->dormant);
+	peer->last_active = controlled_time();
+	db_load_peer(peer);
+	log_info(peer->log, "Woken");
+}
+
+static void dormancy_tick(struct lightningd_state *dstate)
+{
+	struct timeabs now = controlled_time();
+	struct peer *peer;
+
+	/* db_load_peer reads it back, so it must all be written. */
+	if (!db_commits_held(dstate)
+	    && db_batch_done(dstate, db_batch_stamp(dstate))) {
+		list_for_each(&dstate->peers, peer, list)
+			if (peer_can_sleep(peer, now))
+				peer_sleep(peer);
+	}
+	peer_dormancy_init(dstate);
+}
+
+void peer_dormancy_init(struct lightningd_state *dstate)
+{
+	struct timerel t = dstate->config.dormant_time;
+
+	/* Zero means never. */
+	if (time_to_nsec(t))
+		new_reltimer(dstate, dstate, t, dormancy_tick, dstate);
+}
+
+/* Sample each connection's round trip, and whether it's waiting on an ack
+ * (data, or a keepalive probe) and has heard nothing for a ping time.  One
+ * unresponsive for the dead time we hang up on: the reconnect logic takes
+ * over, and its HTLCs can time out on chain instead of hanging. */
+static void peer_liveness(struct peer *peer, struct timeabs now)
+{
+#ifdef TCP_INFO
+	const struct config *config = &peer->dstate->config;
+	struct tcp_info info;
+	socklen_t len = sizeof(info);
+
+	if (getsockopt(io_conn_fd(peer->conn), IPPROTO_TCP, TCP_INFO,
+		       &info, &len) != 0)
+		return;
+
+	if (info.tcpi_rtt != peer->rtt_usec) {
+		first_hop_rtt_changed(peer->dstate, peer->id,
+				      peer->rtt_usec, info.tcpi_rtt);
+		peer->rtt_usec = info.tcpi_rtt;
+	}
+	if ((!info.tcpi_unacked && !info.tcpi_probes)
+	    || info.tcpi_last_ack_recv
+	    < time_to_msec(config->peer_ping_time)) {
+		if (peer->unresponsive)
+			log_info(peer->log, "Responsive again");
+		peer->unresponsive = false;
+		return;
+	}
+
+	if (!peer->unresponsive) {
+		log_unusual(peer->log, "Unresponsive: no ack for %ums",
+			    info.tcpi_last_ack_recv);
+		peer->unresponsive = true;
+		peer->unresponsive_since = now;
+	} else if (!time_less(time_between(now, peer->unresponsive_since),
+			      config->peer_dead_time)) {
+		log_unusual(peer->log, "Dead: no ack for %ums, disconnecting",
+			    info.tcpi_last_ack_recv);
+		io_close(peer->conn);
+	}
+#endif
+}
+
+static void peer_liveness_tick(struct lightningd_state *dstate)
+{
+	struct timeabs now = time_now();
+	struct peer *peer, *next;
+
+	/* Closing can free the peer. */
+	list_for_each_safe(&dstate->peers, peer, next, list)
+		if (peer->connected && peer->conn)
+			peer_liveness(peer, now);
+	peer_liveness_init(dstate);
+}
+
+void peer_liveness_init(struct lightningd_state *dstate)
+{
+	struct timerel t = dstate->config.peer_ping_time;
+
+	/* Zero means never. */
+	if (time_to_nsec(t))
+		new_reltimer(dstate, dstate, t, peer_liveness_tick, dstate);
+}
+
 static void json_newhtlc(struct command *cmd,
 			 const char *buffer, const jsmntok_t *params)
 {
@@ -4389,7 +5772,7 @@ static void json_newhtlc(struct command *cmd,
 	log_debug(peer->log, "JSON command to add new HTLC");
 	err = command_htlc_add(peer, msatoshi, expiry, &rhash, NULL,
 			       onion_create(cmd, cmd->dstate->secpctx,
-					    NULL, NULL, 0),
+					    peer->id, NULL, 1),
 			       &error_code, &htlc);
 	if (err) {
 		command_fail(cmd, "could not add htlc: %u:%s", error_code, err);
@@ -13,11 +13,16 @@
 #include "lightning.pb-c.h"
 #include "netaddr.h"
 #include "protobuf_convert.h"
+#include "pseudorand.h"
 #include "state.h"
 #include <ccan/crypto/sha256/sha256.h>
 #include <ccan/crypto/shachain/shachain.h>
+#include <ccan/crypto/siphash24/siphash24.h>
+#include <ccan/htable/htable_type.h>
 #include <ccan/list/list.h>
+#include <ccan/structeq/structeq.h>
 #include <ccan/time/time.h>
+#include <string.h>
 
 struct anchor_input {
 	struct sha256_double txid;
@@ -26,6 +31,17 @@ struct anchor_input {
 	u64 amount;
 	/* Wallet entry to use to spend. */
 	struct wallet *w;
+	/* If it funds other channels too (amount is our share), or NULL. */
+	struct anchor_batch *batch;
+};
+
+/* A packet waiting to go out. */
+struct out_pkt {
+	Pkt *pkt;
+	/* The database batch it has to wait for. */
+	u64 batch;
+	/* Packed size, for peer->outpkt_bytes. */
+	size_t len;
 };
 
 /* Information we remember for their commitment txs which we signed.
@@ -38,6 +54,8 @@ struct their_commit {
 
 	struct sha256_double txid;
 	u64 commit_num;
+	/* Not in the database until db_batch_done() on this. */
+	u64 batch;
 };
 	
 struct commit_info {
@@ -76,13 +94,34 @@ struct peer_visible_state {
 	struct channel_state *staging_cstate;
 };
 
-/* Off peer->outgoing_txs */
+/* Off peer->outgoing_txs, and in the topology's map of them by txid. */
 struct outgoing_tx {
 	struct list_node list;
+	struct lightningd_state *dstate;
 	const struct bitcoin_tx *tx;
 	struct sha256_double txid;
+	/* Block height when bitcoind said it had it, or 0. */
+	u32 accepted_height;
 };
 
+/* outgoing_tx_map: txid -> every peer's outgoing_txs (dstate->outgoing_txs) */
+static inline const struct sha256_double *
+outgoing_tx_key(const struct outgoing_tx *otx)
+{
+	return &otx->txid;
+}
+static inline size_t outgoing_tx_hash(const struct sha256_double *txid)
+{
+	return siphash24(siphash_seed(), txid, sizeof(*txid));
+}
+static inline bool outgoing_tx_eq(const struct outgoing_tx *otx,
+				  const struct sha256_double *txid)
+{
+	return structeq(&otx->txid, txid);
+}
+HTABLE_DEFINE_TYPE(struct outgoing_tx, outgoing_tx_key, outgoing_tx_hash,
+		   outgoing_tx_eq, outgoing_tx_map);
+
 struct peer {
 	/* dstate->peers list */
 	struct list_node list;
@@ -95,6 +134,15 @@ struct peer {
 
 	/* Are we connected now? (Crypto handshake completed). */
 	bool connected;
+
+	/* Waiting in dstate->reconnect_queue, or connecting out now. */
+	struct list_node reconnect_list;
+	bool reconnect_queued, reconnecting;
+	/* Wait before retrying a failed reconnect: doubles each time. */
+	struct timerel reconnect_delay;
+
+	/* What we last said about this channel on IRC (see irc_announce.c) */
+	struct irc_announcement *irc_announce;
 	
 	/* If we're doing a commit, this is the command which triggered it */
 	struct command *commit_jsoncmd;
@@ -104,6 +152,8 @@ struct peer {
 
 	/* Their ID. */
 	struct pubkey *id;
+	/* ...and as it appears in onions, once id is set. */
+	u8 id_der[PUBKEY_DER_LEN];
 
 	/* Order counter for transmission of revocations/commitments. */
 	s64 order_counter;
@@ -111,11 +161,28 @@ struct peer {
 	/* Current received packet. */
 	Pkt *inpkt;
 
-	/* Queue of output packets. */
-	Pkt **outpkt;
-
-	/* Their commitments we have signed (which could appear on chain). */
+	/* Queue of output packets: a ring (tal array, power of 2 size). */
+	struct out_pkt *outpkt;
+	size_t outpkt_start, num_outpkt;
+	/* Sent packets, kept for queue_pkt_* to reuse. */
+	struct pooled_pkt *pkt_pool;
+	size_t pkt_pool_len;
+	/* Total len of those. */
+	u64 outpkt_bytes;
+
+	/* Too far behind to route more HTLCs through (see peer_congested) */
+	bool congested;
+
+	/* Round trip the kernel last measured to them, in usec (0 if none). */
+	u32 rtt_usec;
+	/* Not acking us, and since when (see peer_liveness_tick). */
+	bool unresponsive;
+	struct timeabs unresponsive_since;
+
+	/* Most recent of their commitments we have signed (which could
+	 * appear on chain): the rest are only in the database. */
 	struct list_head their_commits;
+	size_t num_their_commits;
 
 	/* Number of commitment signatures we've received. */
 	u64 their_commitsigs;
@@ -153,6 +220,9 @@ struct peer {
 	/* Counter to make unique HTLC ids. */
 	u64 htlc_id_counter;
 
+	/* No HTLC can expire or pass its deadline before this block. */
+	u32 htlc_next_check;
+
 	/* Mutual close info. */
 	struct {
 		/* Our last suggested closing fee. */
@@ -206,16 +276,43 @@ struct peer {
 	
 	/* Timeout for collecting changes before sending commit. */
 	struct oneshot *commit_timer;
+
+	/* How many changes our commits carried, for the adaptive timer
+	 * (and for tuning it). */
+	struct {
+		struct timeabs last;
+		u64 commits, changes;
+		size_t last_changes, max_changes;
+	} commit_stats;
+	/* When we last sent a commit (real time, for stats). */
+	struct timeabs commit_sent;
+	/* How long its HTLCs took (see getpeers). */
+	struct htlc_stats *htlc_stats;
+	/* What they've cost us, to find the expensive ones (see getpeers). */
+	struct {
+		/* Our thread's, handling their packets and our commits. */
+		u64 cpu_usec;
+		/* Encrypted, as on the wire. */
+		u64 bytes_in, bytes_out;
+		/* Prepared in their transactions. */
+		u64 db_statements;
+		u64 htlcs_offered, htlcs_received;
+	} usage;
 	
 	/* Private keys for dealing with this peer. */
 	struct peer_secrets *secrets;
 
-	/* Our route connection to peer: NULL until we are in normal mode. */
-	struct node_connection *nc;
-	
 	/* For testing. */
 	bool fake_close;
 	bool output_enabled;
+	/* Has this burst sat out --dev-link-latency yet? */
+	bool link_delayed;
+
+	/* Asleep, with only its last committed balance in memory: commit
+	 * info, HTLCs and feechanges are in the database (see peer_wake). */
+	struct channel_state *dormant;
+	/* When it last disconnected or woke, to tell when it's idle. */
+	struct timeabs last_active;
 
 	/* Stuff we have in common. */
 	struct peer_visible_state local, remote;
@@ -227,6 +324,38 @@ struct peer {
 	struct shachain their_preimages;
 };
 
+/* peer_map: id -> peer, for those we know the id of. */
+static inline const secp256k1_pubkey *peer_key(const struct peer *peer)
+{
+	return &peer->id->pubkey;
+}
+static inline size_t peer_key_hash(const secp256k1_pubkey *key)
+{
+	return siphash24(siphash_seed(), key, sizeof(*key));
+}
+static inline bool peer_key_eq(const struct peer *peer,
+			       const secp256k1_pubkey *key)
+{
+	return structeq(&peer->id->pubkey, key);
+}
+HTABLE_DEFINE_TYPE(struct peer, peer_key, peer_key_hash, peer_key_eq, peer_map);
+
+/* peer_der_map: DER-encoded id -> peer, so forwarding needn't parse keys. */
+static inline const u8 *peer_der(const struct peer *peer)
+{
+	return peer->id_der;
+}
+static inline size_t peer_der_hash(const u8 *der)
+{
+	return siphash24(siphash_seed(), der, PUBKEY_DER_LEN);
+}
+static inline bool peer_der_eq(const struct peer *peer, const u8 *der)
+{
+	return memcmp(peer->id_der, der, PUBKEY_DER_LEN) == 0;
+}
+HTABLE_DEFINE_TYPE(struct peer, peer_der, peer_der_hash, peer_der_eq,
+		   peer_der_map);
+
 /* Mapping for id -> network address. */
 struct peer_address {
 	struct list_node list;
@@ -238,6 +367,12 @@ void setup_listeners(struct lightningd_state *dstate, unsigned int portnum);
 
 struct peer *find_peer(struct lightningd_state *dstate, const struct pubkey *id);
 
+/* Sets peer->id, so find_peer finds it. */
+void peer_set_id(struct peer *peer, const struct pubkey *id);
+
+/* Most we could offer in an HTLC right now (ignoring fees). */
+u64 peer_sendable_msat(const struct peer *peer);
+
 struct peer *new_peer(struct lightningd_state *dstate,
 		      struct log *log,
 		      enum state state,
@@ -247,13 +382,17 @@ struct peer *new_peer(struct lightningd_state *dstate,
 bool setup_first_commit(struct peer *peer);
 
 /* Whenever we send a signature, remember the txid -> commit_num mapping */
+/* The sweeper has spent onchain.tx output @out_num with @tx. */
+void peer_onchain_swept(struct peer *peer, unsigned int out_num,
+			const struct bitcoin_tx *tx);
+
 void peer_add_their_commit(struct peer *peer,
 			   const struct sha256_double *txid, u64 commit_num);
 
 /* Allocate a new commit_info struct. */
 struct commit_info *new_commit_info(const tal_t *ctx, u64 commit_num);
 
-/* Freeing removes from map, too */
+/* Freeing removes from map, too.  route may be take(). */
 struct htlc *peer_new_htlc(struct peer *peer, 
 			   u64 id,
 			   u64 msatoshi,
@@ -264,6 +403,11 @@ struct htlc *peer_new_htlc(struct peer *peer,
 			   struct htlc *src,
 			   enum htlc_state state);
 
+/* Fail any HTLCs held as part of a multi-path payment to this invoice. */
+struct invoice;
+void fail_invoice_parts(struct invoice *invoice, const char *why);
+
+/* route may be take(): it's freed if we fail. */
 const char *command_htlc_add(struct peer *peer, u64 msatoshi,
 			     unsigned int expiry,
 			     const struct sha256 *rhash,
@@ -284,6 +428,19 @@ struct bitcoin_tx *peer_create_close_tx(struct peer *peer, u64 fee);
 
 void debug_dump_peers(struct lightningd_state *dstate);
 
+/* Reload a dormant peer's channel before using it: anything which might
+ * need more than its balance, keys and anchor must call this first. */
+void peer_wake(struct peer *peer);
+
+/* Put peers idle for config.dormant_time to sleep, from now on. */
+void peer_dormancy_init(struct lightningd_state *dstate);
+
+/* Start checking connected peers still ack, and timing them. */
+void peer_liveness_init(struct lightningd_state *dstate);
+
 void reconnect_peers(struct lightningd_state *dstate);
+
+/* Fee estimate changed: offer it to every channel at once. */
+void peers_new_feerate(struct lightningd_state *dstate);
 void cleanup_peers(struct lightningd_state *dstate);
 #endif /* LIGHTNING_DAEMON_PEER_H */
@@ -0,0 +1,287 @@
+#include "channel.h"
+#include "controlled_time.h"
+#include "invoice.h"
+#include "jsonrpc.h"
+#include "lightningd.h"
+#include "log.h"
+#include "pay.h"
+#include "peer.h"
+#include "rebalance.h"
+#include "routing.h"
+#include "timeout.h"
+#include <ccan/tal/str/str.h>
+#include <inttypes.h>
+
+/* What setrebalance can change, to start with.  A channel is a source
+ * when we hold at least high_percent of it, a sink at most low_percent. */
+#define REBALANCE_HIGH_PERCENT 80
+#define REBALANCE_LOW_PERCENT 20
+#define REBALANCE_MAX_FEE_PPM 1000
+#define REBALANCE_MAX_MSATOSHI (100000 * 1000ULL)
+
+/* As getroute's riskfactor. */
+#define REBALANCE_RISKFACTOR 1.0
+
+/* Our invoice only has to outlive the payment: don't keep it for ever. */
+#define REBALANCE_INVOICE_EXPIRY (60 * 60)
+
+struct rebalancer {
+	struct lightningd_state *dstate;
+	struct oneshot *timer;
+
+	/* Policy. */
+	u32 high_percent, low_percent;
+	u32 max_fee_ppm;
+	u64 max_msatoshi;
+
+	/* The payment in flight, if any: we only do one at a time. */
+	bool in_flight;
+	u64 msatoshi;
+	s64 fee;
+	u64 next_label;
+
+	/* What happened. */
+	u64 attempts, succeeded, failed, no_candidates, no_route;
+	u64 moved_msatoshi, fees_msatoshi;
+};
+
+/* What we hold of a channel we could pay through now, and its size. */
+static bool peer_balance(const struct peer *peer, u64 *ours, u64 *total)
+{
+	const struct channel_state *cstate = peer->remote.staging_cstate;
+
+	if (!peer->id || !cstate || !state_can_add_htlc(peer->state))
+		return false;
+
+	*ours = cstate->side[LOCAL].pay_msat;
+	*total = *ours + cstate->side[REMOTE].pay_msat;
+	return *total != 0;
+}
+
+static void rebalance_done(const struct rval *rval, struct rebalancer *rb)
+{
+	rb->in_flight = false;
+	if (!rval) {
+		rb->failed++;
+		log_info(rb->dstate->base_log,
+			 "Rebalance of %"PRIu64" msatoshi failed",
+			 rb->msatoshi);
+		return;
+	}
+
+	rb->succeeded++;
+	rb->moved_msatoshi += rb->msatoshi;
+	rb->fees_msatoshi += rb->fee;
+	log_info(rb->dstate->base_log,
+		 "Rebalanced %"PRIu64" msatoshi for %"PRIi64" fee",
+		 rb->msatoshi, rb->fee);
+}
+
+static void try_rebalance(struct rebalancer *rb)
+{
+	struct lightningd_state *dstate = rb->dstate;
+	struct peer *peer, *out = NULL, *in = NULL, *first;
+	u64 ours, total, out_ours = 0, out_total = 0, in_ours = 0, in_total = 0;
+	u64 amount;
+	struct route_limits limits;
+	struct node_connection *route;
+	struct invoice *invoice;
+	const char *label, *err;
+
+	/* Fullest and emptiest channels, as a share of each. */
+	list_for_each(&dstate->peers, peer, list) {
+		if (!peer_balance(peer, &ours, &total))
+			continue;
+		if (ours * 100 >= total * rb->high_percent
+		    && (!out || ours * out_total > out_ours * total)) {
+			out = peer;
+			out_ours = ours;
+			out_total = total;
+		}
+		if (ours * 100 <= total * rb->low_percent
+		    && (!in || ours * in_total < in_ours * total)) {
+			in = peer;
+			in_ours = ours;
+			in_total = total;
+		}
+	}
+	if (!out || !in) {
+		rb->no_candidates++;
+		return;
+	}
+
+	/* Bring both back towards half, as far as one payment goes. */
+	amount = out_ours - out_total / 2;
+	if (amount > in_total / 2 - in_ours)
+		amount = in_total / 2 - in_ours;
+	if (amount > rb->max_msatoshi)
+		amount = rb->max_msatoshi;
+	if (!amount) {
+		rb->no_candidates++;
+		return;
+	}
+
+	route_limits_init(&limits);
+	limits.max_fee = amount * rb->max_fee_ppm / 1000000;
+	first = find_circular_route(dstate, out->id, in->id, amount,
+				    REBALANCE_RISKFACTOR, &limits,
+				    &rb->fee, &route);
+	if (!first) {
+		rb->no_route++;
+		log_debug_struct(dstate->base_log, "Rebalance: no route out %s",
+				 struct pubkey, out->id);
+		log_add_struct(dstate->base_log, " back from %s",
+			       struct pubkey, in->id);
+		return;
+	}
+
+	label = tal_fmt(rb, "rebalance-%"PRIu64"-%"PRIu64,
+			(u64)controlled_time().ts.tv_sec, rb->next_label++);
+	invoice = invoice_new(dstate, amount, label, REBALANCE_INVOICE_EXPIRY);
+	tal_free(label);
+	if (!invoice) {
+		log_broken(dstate->base_log, "Rebalance: could not make invoice");
+		tal_free(route);
+		return;
+	}
+
+	rb->attempts++;
+	rb->in_flight = true;
+	rb->msatoshi = amount;
+	err = pay_route(rb, dstate, first, route, amount, &invoice->rhash,
+			rebalance_done, rb);
+	tal_free(route);
+	if (err) {
+		rb->in_flight = false;
+		rb->failed++;
+		log_unusual(dstate->base_log, "Rebalance: %s", err);
+	}
+}
+
+static void rebalance_tick(struct rebalancer *rb);
+
+static void rebalance_schedule(struct rebalancer *rb)
+{
+	struct timerel t = rb->dstate->config.rebalance_time;
+
+	/* Zero means never. */
+	if (time_to_nsec(t))
+		rb->timer = new_reltimer(rb->dstate, rb, t, rebalance_tick, rb);
+}
+
+static void rebalance_tick(struct rebalancer *rb)
+{
+	rb->timer = NULL;
+	if (!rb->in_flight)
+		try_rebalance(rb);
+	rebalance_schedule(rb);
+}
+
+void rebalance_init(struct lightningd_state *dstate)
+{
+	struct rebalancer *rb = talz(dstate, struct rebalancer);
+
+	rb->dstate = dstate;
+	rb->high_percent = REBALANCE_HIGH_PERCENT;
+	rb->low_percent = REBALANCE_LOW_PERCENT;
+	rb->max_fee_ppm = REBALANCE_MAX_FEE_PPM;
+	rb->max_msatoshi = REBALANCE_MAX_MSATOSHI;
+	dstate->rebalancer = rb;
+	rebalance_schedule(rb);
+}
+
+static void json_add_rebalancer(struct json_result *response,
+				const struct rebalancer *rb)
+{
+	json_object_start(response, NULL);
+	json_add_u64(response, "interval",
+		     time_to_sec(rb->dstate->config.rebalance_time));
+	json_add_num(response, "high_percent", rb->high_percent);
+	json_add_num(response, "low_percent", rb->low_percent);
+	json_add_num(response, "max_fee_ppm", rb->max_fee_ppm);
+	json_add_u64(response, "max_msatoshi", rb->max_msatoshi);
+	json_add_bool(response, "in_flight", rb->in_flight);
+	json_add_u64(response, "attempts", rb->attempts);
+	json_add_u64(response, "succeeded", rb->succeeded);
+	json_add_u64(response, "failed", rb->failed);
+	json_add_u64(response, "no_candidates", rb->no_candidates);
+	json_add_u64(response, "no_route", rb->no_route);
+	json_add_u64(response, "moved_msatoshi", rb->moved_msatoshi);
+	json_add_u64(response, "fees_msatoshi", rb->fees_msatoshi);
+	json_object_end(response);
+}
+
+static void json_getrebalance(struct command *cmd,
+			      const char *buffer, const jsmntok_t *params)
+{
+	struct json_result *response = new_json_result(cmd);
+
+	json_add_rebalancer(response, cmd->dstate->rebalancer);
+	command_success(cmd, response);
+}
+
+const struct json_command getrebalance_command = {
+	"getrebalance",
+	json_getrebalance,
+	"Show the rebalancer's policy, and how it's done",
+	"Returns {interval}, {high_percent}, {low_percent}, {max_fee_ppm}, {max_msatoshi}, whether a payment is {in_flight}, and counts of {attempts}, {succeeded}, {failed}, {no_candidates}, {no_route}, {moved_msatoshi} and {fees_msatoshi}"
+};
+
+static void json_setrebalance(struct command *cmd,
+			      const char *buffer, const jsmntok_t *params)
+{
+	struct rebalancer *rb = cmd->dstate->rebalancer;
+	jsmntok_t *intervaltok, *hightok, *lowtok, *feetok, *maxtok;
+	unsigned int interval = time_to_sec(cmd->dstate->config.rebalance_time);
+	unsigned int high = rb->high_percent, low = rb->low_percent;
+	unsigned int fee_ppm = rb->max_fee_ppm;
+	u64 max_msatoshi = rb->max_msatoshi;
+	struct json_result *response;
+
+	if (!json_get_params(buffer, params,
+			     "?interval", &intervaltok,
+			     "?high_percent", &hightok,
+			     "?low_percent", &lowtok,
+			     "?max_fee_ppm", &feetok,
+			     "?max_msatoshi", &maxtok,
+			     NULL)) {
+		command_fail(cmd, "Invalid parameters");
+		return;
+	}
+
+	if ((intervaltok && !json_tok_number(buffer, intervaltok, &interval))
+	    || (hightok && !json_tok_number(buffer, hightok, &high))
+	    || (lowtok && !json_tok_number(buffer, lowtok, &low))
+	    || (feetok && !json_tok_number(buffer, feetok, &fee_ppm))
+	    || (maxtok && !json_tok_u64(buffer, maxtok, &max_msatoshi))) {
+		command_fail(cmd, "Parameters must be non-negative numbers");
+		return;
+	}
+
+	/* Otherwise a payment could leave a channel worse than it was. */
+	if (low >= 50 || high <= 50 || high > 100) {
+		command_fail(cmd, "Need low_percent < 50 < high_percent <= 100");
+		return;
+	}
+
+	rb->high_percent = high;
+	rb->low_percent = low;
+	rb->max_fee_ppm = fee_ppm;
+	rb->max_msatoshi = max_msatoshi;
+	if (intervaltok) {
+		cmd->dstate->config.rebalance_time = time_from_sec(interval);
+		rb->timer = tal_free(rb->timer);
+		rebalance_schedule(rb);
+	}
+
+	response = new_json_result(cmd);
+	json_add_rebalancer(response, rb);
+	command_success(cmd, response);
+}
+
+const struct json_command setrebalance_command = {
+	"setrebalance",
+	json_setrebalance,
+	"Rebalance every {interval} seconds (0 to stop), from channels we hold {high_percent} of to ones we hold {low_percent} of, up to {max_msatoshi} at a time for at most {max_fee_ppm} millionths in fees",
+	"Returns the same as getrebalance"
+};
@@ -0,0 +1,12 @@
+#ifndef LIGHTNING_DAEMON_REBALANCE_H
+#define LIGHTNING_DAEMON_REBALANCE_H
+/* Every --rebalance-time, we pay ourselves in a circle, out of our fullest
+ * channel and back in through our emptiest, so both can keep forwarding. */
+#include "config.h"
+
+struct lightningd_state;
+
+/* Sets up dstate->rebalancer, and starts it if --rebalance-time says. */
+void rebalance_init(struct lightningd_state *dstate);
+
+#endif /* LIGHTNING_DAEMON_REBALANCE_H */
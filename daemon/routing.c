@@ -1,3 +1,4 @@
+#include "controlled_time.h"
 #include "jsonrpc.h"
 #include "lightningd.h"
 #include "log.h"
@@ -5,11 +6,24 @@
 #include "peer.h"
 #include "pseudorand.h"
 #include "routing.h"
+#include "stats.h"
+#include "trace.h"
 #include <ccan/array_size/array_size.h>
+#include <ccan/asort/asort.h>
 #include <ccan/crypto/siphash24/siphash24.h>
 #include <ccan/htable/htable_type.h>
+#include <ccan/ilog/ilog.h>
+#include <ccan/io/io.h>
+#include <ccan/read_write_all/read_write_all.h>
 #include <ccan/structeq/structeq.h>
+#include <ccan/tal/grab_file/grab_file.h>
+#include <ccan/tal/str/str.h>
+#include <errno.h>
 #include <inttypes.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 /* 365.25 * 24 * 60 / 10 */
 #define BLOCKS_PER_YEAR 52596
@@ -30,334 +44,1845 @@ static bool node_eq(const struct node *n, const secp256k1_pubkey *key)
 }
 HTABLE_DEFINE_TYPE(struct node, keyof_node, hash_key, node_eq, node_map);
 
-struct node_map *empty_node_map(struct lightningd_state *dstate)
+/* We memset this, so padding is zero and we can hash/compare it whole. */
+struct route_cache_key {
+	/* Tenants share the graph, and so the cache. */
+	secp256k1_pubkey src, dst;
+	/* ilog64(msatoshi): fees are proportional, so routes rarely change
+	 * within a power of 2. */
+	u32 bucket;
+	double riskfactor;
+	enum route_engine engine;
+};
+
+struct cached_route {
+	struct routing_state *rstate;
+	struct list_node list;
+	struct route_cache_key key;
+	/* Our first hop (from us), and the route after it. */
+	u32 src, first;
+	struct node_connection *route;
+};
+
+static const struct route_cache_key *
+keyof_cached_route(const struct cached_route *cr)
 {
-	struct node_map *map = tal(dstate, struct node_map);
-	node_map_init(map);
-	return map;
+	return &cr->key;
 }
 
-struct node *get_node(struct lightningd_state *dstate,
-		      const struct pubkey *id)
+static size_t hash_route_key(const struct route_cache_key *key)
+{
+	return siphash24(siphash_seed(), key, sizeof(*key));
+}
+
+static bool cached_route_eq(const struct cached_route *cr,
+			    const struct route_cache_key *key)
+{
+	return structeq(&cr->key, key);
+}
+HTABLE_DEFINE_TYPE(struct cached_route, keyof_cached_route, hash_route_key,
+		   cached_route_eq, route_cache);
+
+static u64 penalty_key(u32 src, u32 dst)
+{
+	return ((u64)src << 32) | dst;
+}
+
+static u64 keyof_penalty(const struct route_penalty *p)
+{
+	return penalty_key(p->src, p->dst);
+}
+
+static size_t hash_penalty_key(u64 key)
+{
+	return siphash24(siphash_seed(), &key, sizeof(key));
+}
+
+static bool penalty_eq(const struct route_penalty *p, u64 key)
 {
-	return node_map_get(dstate->nodes, &id->pubkey);
+	return keyof_penalty(p) == key;
 }
+HTABLE_DEFINE_TYPE(struct route_penalty, keyof_penalty, hash_penalty_key,
+		   penalty_eq, penalty_map);
 
-static void destroy_node(struct node *node)
+struct routing_state *new_routing_state(struct lightningd_state *dstate)
 {
-	/* These remove themselves from the array. */
-	while (tal_count(node->in))
-		tal_free(node->in[0]);
-	while (tal_count(node->out))
-		tal_free(node->out[0]);
+	struct routing_state *rstate = tal(dstate, struct routing_state);
+
+	rstate->nodes = tal(rstate, struct node_map);
+	node_map_init(rstate->nodes);
+	rstate->by_index = tal_arr(rstate, struct node *, 0);
+	rstate->route_cache = tal(rstate, struct route_cache);
+	route_cache_init(rstate->route_cache);
+	list_head_init(&rstate->route_lru);
+	rstate->num_cached_routes = 0;
+	rstate->route_cache_hits = rstate->route_cache_misses = 0;
+	rstate->penalties = tal(rstate, struct penalty_map);
+	penalty_map_init(rstate->penalties);
+	rstate->num_penalties = 0;
+	rstate->generation = 0;
+	rstate->trace = NULL;
+	return rstate;
+}
+
+static void route_cache_key(struct route_cache_key *key,
+			    const struct pubkey *src,
+			    const struct pubkey *dst,
+			    u64 msatoshi, double riskfactor,
+			    enum route_engine engine)
+{
+	memset(key, 0, sizeof(*key));
+	key->src = src->pubkey;
+	key->dst = dst->pubkey;
+	key->bucket = ilog64(msatoshi);
+	key->riskfactor = riskfactor;
+	key->engine = engine;
+}
+
+static void destroy_cached_route(struct cached_route *cr)
+{
+	route_cache_del(cr->rstate->route_cache, cr);
+	list_del(&cr->list);
+	cr->rstate->num_cached_routes--;
+}
+
+static void cache_route(struct routing_state *rstate,
+			    const struct route_cache_key *key,
+			    u32 src, u32 first,
+			    const struct node_connection *route)
+{
+	struct cached_route *cr;
+
+	/* Throw away least recently used. */
+	if (rstate->num_cached_routes == ROUTE_CACHE_MAX)
+		tal_free(list_top(&rstate->route_lru, struct cached_route,
+				  list));
+
+	cr = tal(rstate, struct cached_route);
+	cr->rstate = rstate;
+	cr->key = *key;
+	cr->src = src;
+	cr->first = first;
+	cr->route = tal_dup_arr(cr, struct node_connection, route,
+				tal_count(route), 0);
+	route_cache_add(rstate->route_cache, cr);
+	list_add_tail(&rstate->route_lru, &cr->list);
+	rstate->num_cached_routes++;
+	tal_add_destructor(cr, destroy_cached_route);
+}
+
+static bool route_uses(const struct cached_route *cr, u32 src, u32 dst)
+{
+	size_t i;
+
+	if (cr->src == src && cr->first == dst)
+		return true;
+	for (i = 0; i < tal_count(cr->route); i++) {
+		if (cr->route[i].src == src && cr->route[i].dst == dst)
+			return true;
+	}
+	return false;
+}
+
+/* A connection changed: forget any route going through it.  We don't
+ * flush on new connections, so we may miss newly-cheaper routes until
+ * the cached one changes or falls out of the cache. */
+static void forget_routes_through(struct routing_state *rstate,
+				   u32 src, u32 dst)
+{
+	struct cached_route *cr, *next;
+
+	rstate->generation++;
+	list_for_each_safe(&rstate->route_lru, cr, next, list) {
+		if (route_uses(cr, src, dst))
+			tal_free(cr);
+	}
+}
+
+struct node *get_node(struct lightningd_state *dstate,
+		      const struct pubkey *id)
+{
+	return node_map_get(dstate->rstate->nodes, &id->pubkey);
 }
 
 struct node *new_node(struct lightningd_state *dstate,
 		      const struct pubkey *id)
 {
+	struct routing_state *rstate = dstate->rstate;
 	struct node *n;
 
 	assert(!get_node(dstate, id));
 
-	n = tal(dstate, struct node);
+	n = tal(rstate, struct node);
 	n->id = *id;
-	n->in = tal_arr(n, struct node_connection *, 0);
-	n->out = tal_arr(n, struct node_connection *, 0);
-	node_map_add(dstate->nodes, n);
-	tal_add_destructor(n, destroy_node);
+	n->index = tal_count(rstate->by_index);
+	n->in = tal_arr(n, struct node_connection, 0);
+	node_map_add(rstate->nodes, n);
+	tal_resize(&rstate->by_index, n->index + 1);
+	rstate->by_index[n->index] = n;
 
 	return n;
 }
 
-static bool remove_conn_from_array(struct node_connection ***conns,
-				   struct node_connection *nc)
+static struct node_connection *find_in(const struct node *to, u32 src)
 {
-	size_t i, n;
+	size_t i, n = tal_count(to->in);
 
-	n = tal_count(*conns);
 	for (i = 0; i < n; i++) {
-		if ((*conns)[i] != nc)
+		if (to->in[i].src == src)
+			return &to->in[i];
+	}
+	return NULL;
+}
+
+/* Zeroed if new, so the caller can tell if it changes. */
+static struct node_connection *find_or_add_in(struct node *from,
+					      struct node *to)
+{
+	struct node_connection *nc = find_in(to, from->index);
+	size_t n;
+
+	if (nc)
+		return nc;
+
+	n = tal_count(to->in);
+	tal_resizez(&to->in, n+1);
+	nc = &to->in[n];
+	nc->src = from->index;
+	nc->dst = to->index;
+	return nc;
+}
+
+static struct node *get_or_new_node(struct lightningd_state *dstate,
+				    const struct pubkey *id)
+{
+	struct node *n = get_node(dstate, id);
+
+	if (!n)
+		n = new_node(dstate, id);
+	return n;
+}
+
+static struct node_connection *
+get_or_make_connection(struct lightningd_state *dstate,
+		       const struct pubkey *from_id,
+		       const struct pubkey *to_id)
+{
+	struct node *from, *to;
+	struct node_connection *nc;
+	size_t n;
+
+	from = get_or_new_node(dstate, from_id);
+	to = get_or_new_node(dstate, to_id);
+
+	n = tal_count(to->in);
+	nc = find_or_add_in(from, to);
+	if (tal_count(to->in) == n) {
+		log_debug_struct(dstate->base_log,
+				 "Updating existing route from %s",
+				 struct pubkey, &from->id);
+		log_add_struct(dstate->base_log, " to %s",
+			       struct pubkey, &to->id);
+		return nc;
+	}
+
+	log_debug_struct(dstate->base_log, "Creating new route from %s",
+			 struct pubkey, &from->id);
+	log_add_struct(dstate->base_log, " to %s", struct pubkey, &to->id);
+	log_add(dstate->base_log, " = %u->%u", nc->src, nc->dst);
+	return nc;
+}
+
+/* Returns true if it changed anything. */
+static bool set_connection(struct node_connection *c,
+			   u32 base_fee, s32 proportional_fee,
+			   u32 delay, u32 min_blocks, u64 capacity_msat)
+{
+	/* IRC re-announces the same thing often. */
+	if (c->base_fee == base_fee
+	    && c->proportional_fee == proportional_fee
+	    && c->delay == delay
+	    && c->min_blocks == min_blocks
+	    && c->capacity_msat == capacity_msat)
+		return false;
+
+	c->base_fee = base_fee;
+	c->proportional_fee = proportional_fee;
+	c->delay = delay;
+	c->min_blocks = min_blocks;
+	c->capacity_msat = capacity_msat;
+	return true;
+}
+
+/* Updates existing route if required. */
+void add_connection(struct lightningd_state *dstate,
+		    const struct pubkey *from,
+		    const struct pubkey *to,
+		    u32 base_fee, s32 proportional_fee,
+		    u32 delay, u32 min_blocks, u64 capacity_msat)
+{
+	struct node_connection *c = get_or_make_connection(dstate, from, to);
+
+	if (set_connection(c, base_fee, proportional_fee, delay, min_blocks,
+			   capacity_msat))
+		forget_routes_through(dstate->rstate, c->src, c->dst);
+}
+
+size_t add_connections(struct lightningd_state *dstate,
+		       const struct route_edge *edges, size_t num)
+{
+	struct routing_state *rstate = dstate->rstate;
+	struct cached_route *cr, *next;
+	size_t i, changed = 0;
+	bool updated = false;
+
+	for (i = 0; i < num; i++) {
+		const struct route_edge *e = &edges[i];
+		struct node *to = get_or_new_node(dstate, &e->dst);
+		size_t n = tal_count(to->in);
+		struct node_connection *c;
+
+		c = find_or_add_in(get_or_new_node(dstate, &e->src), to);
+		if (!set_connection(c, e->base_fee, e->proportional_fee,
+				    e->delay, e->min_blocks, e->capacity_msat))
 			continue;
-		n--;
-		memmove(*conns + i, *conns + i + 1, sizeof(**conns) * (n - i));
-		tal_resize(conns, n);
-		return true;
+		changed++;
+		/* Only an existing one can be in a cached route. */
+		if (tal_count(to->in) == n)
+			updated = true;
+	}
+
+	/* Checking every cached route against every change would cost more
+	 * than finding the few we need again. */
+	if (changed)
+		rstate->generation++;
+	if (updated) {
+		list_for_each_safe(&rstate->route_lru, cr, next, list)
+			tal_free(cr);
+	}
+
+	log_debug(dstate->base_log, "Added %zu routes: %zu new or changed",
+		  num, changed);
+	return changed;
+}
+
+const struct node_connection *get_connection(struct lightningd_state *dstate,
+					     const struct pubkey *from_id,
+					     const struct pubkey *to_id)
+{
+	struct node *from, *to;
+
+	from = get_node(dstate, from_id);
+	to = get_node(dstate, to_id);
+	if (!from || !to)
+		return NULL;
+	return find_in(to, from->index);
+}
+
+void remove_connection(struct lightningd_state *dstate,
+		       const struct pubkey *src, const struct pubkey *dst)
+{
+	struct node *from, *to;
+	struct node_connection *nc;
+	size_t i, num_edges;
+
+	log_debug_struct(dstate->base_log, "Removing route from %s",
+			 struct pubkey, src);
+	log_add_struct(dstate->base_log, " to %s", struct pubkey, dst);
+
+	from = get_node(dstate, src);
+	to = get_node(dstate, dst);
+	if (!from || !to) {
+		log_debug(dstate->base_log, "Not found: src=%p dst=%p",
+			  from, to);
+		return;
+	}
+
+	num_edges = tal_count(to->in);
+	nc = find_in(to, from->index);
+	if (!nc) {
+		log_add(dstate->base_log, " None of %zu routes matched",
+			num_edges);
+		return;
+	}
+
+	i = nc - to->in;
+	log_add(dstate->base_log, " Matched route %zu of %zu", i, num_edges);
+	memmove(to->in + i, to->in + i + 1, sizeof(*to->in) * (num_edges-i-1));
+	tal_resize(&to->in, num_edges - 1);
+	forget_routes_through(dstate->rstate, from->index, to->index);
+}
+
+/* Fixed point for route_penalty score. */
+#define PENALTY_UNIT 1024
+
+/* More failures than this don't make it any worse. */
+#define PENALTY_MAX_SCORE (32 * PENALTY_UNIT)
+
+static u64 penalty_score(const struct route_penalty *p, struct timeabs now)
+{
+	u64 sec, score;
+
+	/* --mocktime can go backwards. */
+	if (time_before(now, p->when))
+		return p->score;
+
+	sec = time_to_sec(time_between(now, p->when));
+	if (sec / ROUTE_PENALTY_HALFLIFE >= 64)
+		return 0;
+	score = p->score >> (sec / ROUTE_PENALTY_HALFLIFE);
+
+	/* Linear between halvings is close enough. */
+	return score - score * (sec % ROUTE_PENALTY_HALFLIFE)
+		/ (2 * ROUTE_PENALTY_HALFLIFE);
+}
+
+/* Forget connections which have behaved for long enough. */
+static void prune_penalties(struct routing_state *rstate, struct timeabs now)
+{
+	struct penalty_map_iter it;
+	struct route_penalty *p;
+
+	for (p = penalty_map_first(rstate->penalties, &it);
+	     p;
+	     p = penalty_map_next(rstate->penalties, &it)) {
+		if (!penalty_score(p, now)) {
+			penalty_map_del(rstate->penalties, p);
+			rstate->num_penalties--;
+			tal_free(p);
+		}
+	}
+}
+
+void connection_failed(struct lightningd_state *dstate,
+		       const struct pubkey *src, const struct pubkey *dst)
+{
+	struct routing_state *rstate = dstate->rstate;
+	struct node *from, *to;
+	struct route_penalty *p;
+	struct timeabs now = controlled_time();
+
+	from = get_node(dstate, src);
+	to = get_node(dstate, dst);
+	if (!from || !to)
+		return;
+
+	prune_penalties(rstate, now);
+	p = penalty_map_get(rstate->penalties,
+			    penalty_key(from->index, to->index));
+	if (!p) {
+		p = tal(rstate, struct route_penalty);
+		p->src = from->index;
+		p->dst = to->index;
+		p->failures = 0;
+		p->score = 0;
+		p->when = now;
+		penalty_map_add(rstate->penalties, p);
+		rstate->num_penalties++;
+	}
+
+	p->score = penalty_score(p, now) + PENALTY_UNIT;
+	if (p->score > PENALTY_MAX_SCORE)
+		p->score = PENALTY_MAX_SCORE;
+	p->failures++;
+	p->when = now;
+
+	log_debug_struct(dstate->base_log, "Penalizing route from %s",
+			 struct pubkey, src);
+	log_add_struct(dstate->base_log, " to %s", struct pubkey, dst);
+	log_add(dstate->base_log, " (%u failures)", p->failures);
+
+	forget_routes_through(rstate, from->index, to->index);
+}
+
+/* Too big to reach, but don't overflow if added. */
+#define INFINITE 0x3FFFFFFFFFFFFFFFULL
+
+s64 connection_fee(const struct node_connection *c, u64 msatoshi)
+{
+	s64 fee;
+
+	if (mul_overflows_s64(c->proportional_fee, msatoshi))
+		return INFINITE;
+	fee = (c->proportional_fee * msatoshi) / 1000000;
+	/* This can't overflow: c->base_fee is a u32 */
+	return c->base_fee + fee;
+}
+
+/* Risk of passing through this channel.  We insert a tiny constant here
+ * in order to prefer shorter routes, all things equal. */
+static u64 risk_fee(s64 amount, u32 delay, double riskfactor)
+{
+	/* If fees are so negative we're making money, ignore risk. */
+	if (amount < 0)
+		return 1;
+
+	return 1 + amount * delay * riskfactor / BLOCKS_PER_YEAR / 10000;
+}
+
+/* Each recent failure makes a connection look like it charges another
+ * 10%, plus PENALTY_FEE_MSAT.  We treat this like risk: not actually
+ * paid, but a cost when choosing. */
+#define PENALTY_FEE_MSAT 1000000
+
+static u64 connection_penalty(const struct routing_state *rstate,
+			      const struct node_connection *c,
+			      struct timeabs now)
+{
+	const struct route_penalty *p;
+
+	if (!rstate->num_penalties)
+		return 0;
+	p = penalty_map_get(rstate->penalties, penalty_key(c->src, c->dst));
+	return p ? penalty_score(p, now) : 0;
+}
+
+/* A slow peer holds up every HTLC we send it, so our own edges also score
+ * a failure's worth of penalty per RTT_PENALTY_USEC of round trip. */
+#define RTT_PENALTY_USEC 1000000
+
+static u64 rtt_penalty(u32 rtt_usec)
+{
+	return (u64)rtt_usec * PENALTY_UNIT / RTT_PENALTY_USEC;
+}
+
+/* Every cached route we (src) start: a first hop got cheaper, so any of
+ * them might not be the cheapest now. */
+static void forget_routes_from(struct routing_state *rstate, u32 src)
+{
+	struct cached_route *cr, *next;
+
+	rstate->generation++;
+	list_for_each_safe(&rstate->route_lru, cr, next, list) {
+		if (cr->src == src)
+			tal_free(cr);
+	}
+}
+
+void first_hop_rtt_changed(struct lightningd_state *dstate,
+			   const struct pubkey *id, u32 old_usec, u32 new_usec)
+{
+	struct node *us = get_node(dstate, &dstate->id);
+	struct node *n = get_node(dstate, id);
+	u64 before = rtt_penalty(old_usec), after = rtt_penalty(new_usec);
+
+	if (!us || !n || before == after)
+		return;
+
+	if (after < before)
+		forget_routes_from(dstate->rstate, us->index);
+	else
+		forget_routes_through(dstate->rstate, us->index, n->index);
+}
+
+/* One of our own channels, as a search sees it. */
+struct first_hop {
+	u32 dst;
+	/* What the peer can take from us now. */
+	u64 capacity;
+	/* For its round trip. */
+	u64 penalty;
+};
+
+/* Our peers can't change under a search, so we look them up once at the
+ * start, rather than for every connection from us on every pass. */
+struct first_hops {
+	u32 us;
+	/* Sorted by dst (tal array). */
+	struct first_hop *hops;
+};
+
+static int first_hop_cmp(const struct first_hop *a, const struct first_hop *b,
+			 void *unused)
+{
+	if (a->dst < b->dst)
+		return -1;
+	return a->dst > b->dst;
+}
+
+static void get_first_hops(const tal_t *ctx, struct lightningd_state *dstate,
+			   u32 us, struct first_hops *fh)
+{
+	struct peer *peer;
+	size_t n = 0;
+
+	fh->us = us;
+	fh->hops = tal_arr(ctx, struct first_hop, 0);
+	list_for_each(&dstate->peers, peer, list) {
+		const struct node *node;
+
+		node = peer->id ? get_node(dstate, peer->id) : NULL;
+		if (!node || !find_in(node, us))
+			continue;
+		tal_resize(&fh->hops, n+1);
+		fh->hops[n].dst = node->index;
+		fh->hops[n].capacity = peer_sendable_msat(peer);
+		fh->hops[n].penalty = rtt_penalty(peer->rtt_usec);
+		n++;
+	}
+	asort(fh->hops, n, first_hop_cmp, NULL);
+}
+
+static const struct first_hop *find_first_hop(const struct first_hops *fh,
+					      u32 dst)
+{
+	size_t lo = 0, hi = tal_count(fh->hops);
+
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if (fh->hops[mid].dst == dst)
+			return &fh->hops[mid];
+		if (fh->hops[mid].dst < dst)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return NULL;
+}
+
+static u64 edge_penalty(const struct routing_state *rstate,
+			const struct first_hops *fh,
+			const struct node_connection *c, struct timeabs now)
+{
+	u64 score = connection_penalty(rstate, c, now);
+	const struct first_hop *h;
+
+	if (c->src != fh->us)
+		return score;
+
+	h = find_first_hop(fh, c->dst);
+	if (h)
+		score += h->penalty;
+	return score;
+}
+
+static u64 penalty_fee(u64 score, s64 amount)
+{
+	double fee;
+
+	if (!score)
+		return 0;
+	if (amount < 0)
+		amount = 0;
+	fee = (double)score / PENALTY_UNIT * (amount / 10 + PENALTY_FEE_MSAT);
+
+	/* Stay well clear of INFINITE, even summed over a route. */
+	if (fee > INFINITE / 64)
+		return INFINITE / 64;
+	return fee;
+}
+
+/* Most this connection can carry.  Our own balances change with every
+ * payment, so we ask the peer rather than trusting the graph. */
+static u64 connection_capacity(struct lightningd_state *dstate,
+			       const struct node_connection *c, u32 us)
+{
+	struct peer *peer;
+
+	if (c->src != us)
+		return c->capacity_msat ? c->capacity_msat : UINT64_MAX;
+
+	peer = find_peer(dstate, &node_by_index(dstate->rstate, c->dst)->id);
+	return peer ? peer_sendable_msat(peer) : 0;
+}
+
+/* The same, during a search. */
+static u64 search_capacity(const struct first_hops *fh,
+			   const struct node_connection *c)
+{
+	const struct first_hop *h;
+
+	if (c->src != fh->us)
+		return c->capacity_msat ? c->capacity_msat : UINT64_MAX;
+
+	h = find_first_hop(fh, c->dst);
+	return h ? h->capacity : 0;
+}
+
+static void prune(struct route_trace *t, enum route_prune why)
+{
+	if (t)
+		t->pruned[why]++;
+}
+
+/* Adds the time since @start to @phase; returns now, to start the next. */
+static struct timeabs trace_phase(struct route_trace *t,
+				  enum route_phase phase, struct timeabs start)
+{
+	struct timeabs now;
+
+	if (!t)
+		return start;
+	now = time_now();
+	t->phase_usec[phase] += time_to_usec(time_between(now, start));
+	return now;
+}
+
+/* Temporary data for BFG routefinding, one per node. */
+struct bfg {
+	struct {
+		/* Total to get to here from target. */
+		s64 total;
+		/* Total risk premium of this route. */
+		u64 risk;
+		/* Where that came from. */
+		const struct node_connection *prev;
+	} hop[ROUTING_MAX_HOPS+1];
+};
+
+/* We track totals, rather than costs.  That's because the fee depends
+ * on the current amount passing through. */
+static void bfg_one_edge(struct bfg *bfg,
+			 const struct node_connection *c, double riskfactor,
+			 u64 penalty, u64 capacity, struct route_trace *t)
+{
+	struct bfg *node = &bfg[c->dst], *src = &bfg[c->src];
+	size_t h;
+
+	for (h = 0; h < ROUTING_MAX_HOPS; h++) {
+		s64 fee;
+		u64 risk;
+
+		if (t)
+			t->edges_visited++;
+
+		/* Not reached yet: risk_fee() would overflow. */
+		if (node->hop[h].total >= INFINITE) {
+			prune(t, ROUTE_PRUNE_UNREACHED);
+			continue;
+		}
+
+		/* Too much to fit through this channel? */
+		if ((u64)node->hop[h].total > capacity) {
+			prune(t, ROUTE_PRUNE_CAPACITY);
+			continue;
+		}
+
+		/* FIXME: Bias against smaller channels. */
+		fee = connection_fee(c, node->hop[h].total);
+		risk = node->hop[h].risk + risk_fee(node->hop[h].total + fee,
+						    c->delay, riskfactor)
+			+ penalty_fee(penalty, node->hop[h].total + fee);
+		if (node->hop[h].total + (s64)fee + (s64)risk
+		    < src->hop[h+1].total + (s64)src->hop[h+1].risk) {
+			src->hop[h+1].total = node->hop[h].total + fee;
+			src->hop[h+1].risk = risk;
+			src->hop[h+1].prev = c;
+			if (t)
+				t->relaxations++;
+		} else
+			prune(t, ROUTE_PRUNE_NO_BETTER);
+	}
+}
+
+/* Returns first hop from src (us), with route from there to dst. */
+static struct node *route_bfg(struct lightningd_state *dstate,
+			      struct node *src, struct node *dst,
+			      u64 msatoshi, double riskfactor,
+			      s64 *fee, struct node_connection **route)
+{
+	struct routing_state *rstate = dstate->rstate;
+	struct route_trace *t = rstate->trace;
+	size_t num_nodes = tal_count(rstate->by_index);
+	struct timeabs now = controlled_time(), phase = time_now();
+	struct first_hops fh;
+	struct bfg *bfg;
+	u32 n, first;
+	int runs, i, best;
+
+	if (t)
+		t->searches++;
+
+	/* Reset all the information. */
+	bfg = tal_arr(dstate, struct bfg, num_nodes);
+	for (n = 0; n < num_nodes; n++) {
+		for (i = 0; i < ARRAY_SIZE(bfg[n].hop); i++) {
+			bfg[n].hop[i].total = INFINITE;
+			bfg[n].hop[i].risk = 0;
+		}
+	}
+
+	/* Bellman-Ford-Gibson: like Bellman-Ford, but keep values for
+	 * every path length. */
+	bfg[dst->index].hop[0].total = msatoshi;
+	bfg[dst->index].hop[0].risk = 0;
+	get_first_hops(bfg, dstate, src->index, &fh);
+	phase = trace_phase(t, ROUTE_PHASE_SETUP, phase);
+
+	for (runs = 0; runs < ROUTING_MAX_HOPS; runs++) {
+		/* Run through every edge. */
+		for (n = 0; n < num_nodes; n++) {
+			const struct node *node = rstate->by_index[n];
+			size_t num_edges = tal_count(node->in);
+
+			if (t)
+				t->nodes_visited++;
+			for (i = 0; i < num_edges; i++) {
+				const struct node_connection *c = &node->in[i];
+				bfg_one_edge(bfg, c, riskfactor,
+					     edge_penalty(rstate, &fh, c, now),
+					     search_capacity(&fh, c), t);
+			}
+		}
+	}
+	phase = trace_phase(t, ROUTE_PHASE_SEARCH, phase);
+
+	best = 0;
+	for (i = 1; i <= ROUTING_MAX_HOPS; i++) {
+		if (bfg[src->index].hop[i].total
+		    < bfg[src->index].hop[best].total)
+			best = i;
+	}
+
+	/* No route? */
+	if (bfg[src->index].hop[best].total >= INFINITE) {
+		tal_free(bfg);
+		trace_phase(t, ROUTE_PHASE_BUILD, phase);
+		return NULL;
+	}
+
+	/* Save route from *next* hop (we return first hop as peer).
+	 * Note that we take our own fees into account for routing, even
+	 * though we don't pay them: it presumably effects preference. */
+	first = n = bfg[src->index].hop[best].prev->dst;
+	best--;
+
+	*fee = bfg[n].hop[best].total - msatoshi;
+	*route = tal_arr(dstate, struct node_connection, best);
+	for (i = 0; i < best; i++) {
+		(*route)[i] = *bfg[n].hop[best-i].prev;
+		n = (*route)[i].dst;
+	}
+	assert(n == dst->index);
+	tal_free(bfg);
+	trace_phase(t, ROUTE_PHASE_BUILD, phase);
+	return node_by_index(rstate, first);
+}
+
+/* One (partial) path from the target back towards us. */
+struct dijkstra_label {
+	u32 node;
+	/* Number of connections between here and target. */
+	u32 hops;
+	/* Blocks of delay the HTLC needs from here. */
+	u32 delay;
+	/* Total to get to here from target. */
+	s64 total;
+	/* Total risk premium of this route. */
+	u64 risk;
+	/* Connection we came through (its dst is previous label's node). */
+	const struct node_connection *prev;
+	size_t prev_label;
+};
+
+struct dijkstra {
+	struct dijkstra_label *labels;
+	size_t num_labels;
+	/* Binary min-heap of indices into labels[], by total + risk. */
+	size_t *heap;
+	size_t heap_len;
+	/* Fewest hops of any path to each node we've settled. */
+	u8 *settled_hops;
+};
+
+static s64 label_cost(const struct dijkstra *d, size_t label)
+{
+	return d->labels[label].total + (s64)d->labels[label].risk;
+}
+
+static void heap_swap(struct dijkstra *d, size_t a, size_t b)
+{
+	size_t tmp = d->heap[a];
+	d->heap[a] = d->heap[b];
+	d->heap[b] = tmp;
+}
+
+static void dijkstra_push(struct dijkstra *d,
+			  u32 node, s64 total, u64 risk, u32 hops, u32 delay,
+			  const struct node_connection *prev, size_t prev_label)
+{
+	size_t i;
+	struct dijkstra_label *l;
+
+	if (d->num_labels == tal_count(d->labels)) {
+		tal_resize(&d->labels, d->num_labels * 2);
+		tal_resize(&d->heap, d->num_labels * 2);
+	}
+
+	l = &d->labels[d->num_labels];
+	l->node = node;
+	l->total = total;
+	l->risk = risk;
+	l->hops = hops;
+	l->delay = delay;
+	l->prev = prev;
+	l->prev_label = prev_label;
+
+	/* Sift up. */
+	i = d->heap_len++;
+	d->heap[i] = d->num_labels++;
+	while (i > 0) {
+		size_t parent = (i - 1) / 2;
+		if (label_cost(d, d->heap[parent]) <= label_cost(d, d->heap[i]))
+			break;
+		heap_swap(d, i, parent);
+		i = parent;
 	}
+}
+
+static size_t dijkstra_pop(struct dijkstra *d)
+{
+	size_t top = d->heap[0], i = 0;
+
+	d->heap[0] = d->heap[--d->heap_len];
+
+	/* Sift down. */
+	for (;;) {
+		size_t child = i * 2 + 1;
+		if (child >= d->heap_len)
+			break;
+		if (child + 1 < d->heap_len
+		    && label_cost(d, d->heap[child+1])
+		    < label_cost(d, d->heap[child]))
+			child++;
+		if (label_cost(d, d->heap[i]) <= label_cost(d, d->heap[child]))
+			break;
+		heap_swap(d, i, child);
+		i = child;
+	}
+	return top;
+}
+
+/* Connections and nodes a search must avoid (for alternate routes). */
+struct route_exclusions {
+	/* Per node: don't route through it. */
+	bool *node;
+	/* Per node: one of its in[] connections is in conns[]. */
+	bool *has_conn;
+	const struct node_connection **conns;
+};
+
+static bool excluded(const struct route_exclusions *excl,
+		     const struct node_connection *c)
+{
+	size_t i;
+
+	if (excl->node[c->src])
+		return true;
+	if (!excl->has_conn[c->dst])
+		return false;
+	for (i = 0; i < tal_count(excl->conns); i++)
+		if (excl->conns[i] == c)
+			return true;
 	return false;
 }
 
-static void destroy_connection(struct node_connection *nc)
+void route_limits_init(struct route_limits *limits)
+{
+	limits->max_fee = UINT64_MAX;
+	limits->max_delay = UINT32_MAX;
+	limits->max_hops = ROUTING_MAX_HOPS;
+	limits->exclude = NULL;
+}
+
+/* Same contract as route_bfg.  We settle a node again only if we reach it
+ * in fewer hops than before, so the hop limit costs us nothing as long
+ * as fees are positive.  excl and limits may be NULL.  Paths over the
+ * limits are never labelled, so a node is settled by its best path
+ * within them (a dearer one which would fit better later is not
+ * tried). */
+static struct node *route_dijkstra(struct lightningd_state *dstate,
+				   struct node *src, struct node *dst,
+				   u64 msatoshi, double riskfactor,
+				   const struct route_exclusions *excl,
+				   const struct route_limits *limits,
+				   s64 *fee, struct node_connection **route)
 {
-	if (!remove_conn_from_array(&nc->dst->in, nc)
-	    || !remove_conn_from_array(&nc->src->out, nc))
-		fatal("Connection not found in array?!");
+	struct routing_state *rstate = dstate->rstate;
+	struct route_trace *t = rstate->trace;
+	struct timeabs now = controlled_time(), phase = time_now();
+	struct first_hops fh;
+	struct dijkstra d;
+	size_t i, label;
+	u32 hops, max_hops = ROUTING_MAX_HOPS;
+
+	if (t)
+		t->searches++;
+	if (limits && limits->max_hops < max_hops)
+		max_hops = limits->max_hops;
+
+	/* Everything hangs off labels, so one free cleans up. */
+	d.labels = tal_arr(dstate, struct dijkstra_label, 16);
+	d.heap = tal_arr(d.labels, size_t, 16);
+	d.settled_hops = tal_arr(d.labels, u8, tal_count(rstate->by_index));
+	memset(d.settled_hops, ROUTING_MAX_HOPS + 1, tal_count(d.settled_hops));
+	d.num_labels = d.heap_len = 0;
+	get_first_hops(d.labels, dstate, src->index, &fh);
+
+	dijkstra_push(&d, dst->index, msatoshi, 0, 0, 0, NULL, 0);
+	phase = trace_phase(t, ROUTE_PHASE_SETUP, phase);
+	while (d.heap_len) {
+		const struct dijkstra_label *l;
+		const struct node *n;
+
+		label = dijkstra_pop(&d);
+		l = &d.labels[label];
+
+		/* We got here cheaper, in as few hops? */
+		if (d.settled_hops[l->node] <= l->hops)
+			continue;
+		d.settled_hops[l->node] = l->hops;
+		if (t)
+			t->nodes_visited++;
+
+		if (l->node == src->index)
+			goto found;
+
+		n = node_by_index(rstate, l->node);
+		if (l->hops >= max_hops) {
+			if (t)
+				t->pruned[ROUTE_PRUNE_MAX_HOPS]
+					+= tal_count(n->in);
+			continue;
+		}
+
+		for (i = 0; i < tal_count(n->in); i++) {
+			const struct node_connection *c = &n->in[i];
+			/* FIXME: Bias against smaller channels. */
+			s64 fee = connection_fee(c, l->total);
+			u64 risk;
+			u32 delay = l->delay + c->delay;
+
+			if (t)
+				t->edges_visited++;
+			if (delay < c->min_blocks)
+				delay = c->min_blocks;
+
+			if (d.settled_hops[c->src] <= l->hops + 1) {
+				prune(t, ROUTE_PRUNE_NO_BETTER);
+				continue;
+			}
+			if (excl && excluded(excl, c)) {
+				prune(t, ROUTE_PRUNE_EXCLUDED);
+				continue;
+			}
+			if (l->total + fee >= INFINITE) {
+				prune(t, ROUTE_PRUNE_UNREACHED);
+				continue;
+			}
+			if ((u64)l->total > search_capacity(&fh, c)) {
+				prune(t, ROUTE_PRUNE_CAPACITY);
+				continue;
+			}
+			if (limits) {
+				/* We don't pay ourselves a fee. */
+				s64 paid = (c->src == src->index
+					    ? l->total : l->total + fee)
+					- (s64)msatoshi;
+				if (paid > 0 && (u64)paid > limits->max_fee) {
+					prune(t, ROUTE_PRUNE_MAX_FEE);
+					continue;
+				}
+				if (delay > limits->max_delay) {
+					prune(t, ROUTE_PRUNE_MAX_DELAY);
+					continue;
+				}
+			}
+			risk = l->risk + risk_fee(l->total + fee,
+						  c->delay, riskfactor)
+				+ penalty_fee(edge_penalty(rstate, &fh, c, now),
+					      l->total + fee);
+			dijkstra_push(&d, c->src, l->total + fee, risk,
+				      l->hops + 1, delay, c, label);
+			if (t)
+				t->relaxations++;
+			/* Push may have moved labels[]. */
+			l = &d.labels[label];
+		}
+	}
+
+	tal_free(d.labels);
+	trace_phase(t, ROUTE_PHASE_SEARCH, phase);
+	return NULL;
+
+found:
+	phase = trace_phase(t, ROUTE_PHASE_SEARCH, phase);
+	/* Skip the first hop: we return that as the peer. */
+	label = d.labels[label].prev_label;
+	hops = d.labels[label].hops;
+	src = node_by_index(rstate, d.labels[label].node);
+	*fee = d.labels[label].total - msatoshi;
+	*route = tal_arr(dstate, struct node_connection, hops);
+	for (i = 0; i < hops; i++) {
+		(*route)[i] = *d.labels[label].prev;
+		label = d.labels[label].prev_label;
+	}
+	assert(d.labels[label].node == dst->index);
+	tal_free(d.labels);
+	trace_phase(t, ROUTE_PHASE_BUILD, phase);
+	return src;
+}
+
+/* What the first hop has to receive, minus msatoshi. */
+static s64 route_fee(const struct node_connection *route, u64 msatoshi)
+{
+	s64 total = msatoshi;
+	int i;
+
+	for (i = tal_count(route) - 1; i >= 0; i--)
+		total += connection_fee(&route[i], total);
+	return total - msatoshi;
+}
+
+/* Can every connection of this route carry msatoshi, plus later fees? */
+static bool route_fits(struct lightningd_state *dstate,
+		       u32 src, u32 first_hop,
+		       const struct node_connection *route, u64 msatoshi)
+{
+	struct node_connection first;
+	s64 total = msatoshi;
+	int i;
+
+	for (i = tal_count(route) - 1; i >= 0; i--) {
+		if ((u64)total > connection_capacity(dstate, &route[i], src))
+			return false;
+		total += connection_fee(&route[i], total);
+	}
+
+	first.src = src;
+	first.dst = first_hop;
+	return (u64)total <= connection_capacity(dstate, &first, src);
+}
+
+/* A cached route was found for a similar amount: does this one fit? */
+static bool cached_route_fits(struct lightningd_state *dstate,
+			      const struct cached_route *cr, u64 msatoshi)
+{
+	return route_fits(dstate, cr->src, cr->first, cr->route, msatoshi);
+}
+
+struct peer *find_route(struct lightningd_state *dstate,
+			const struct pubkey *to,
+			u64 msatoshi,
+			double riskfactor,
+			s64 *fee,
+			struct node_connection **route)
+{
+	struct routing_state *rstate = dstate->rstate;
+	struct node *n, *src, *dst;
+	struct route_cache_key key;
+	struct cached_route *cr;
+	struct peer *first;
+	int i, hops;
+
+	/* Note: we map backwards, since we know the amount of satoshi we want
+	 * at the end, and need to derive how much we need to send. */
+	src = get_node(dstate, &dstate->id);
+	dst = get_node(dstate, to);
+	if (!dst) {
+		log_info_struct(dstate->base_log, "find_route: cannot find %s",
+				struct pubkey, to);
+		return NULL;
+	}
+	if (dst == src) {
+		log_info(dstate->base_log, "find_route: cannot route to self");
+		return NULL;
+	}
+
+	route_cache_key(&key, &dstate->id, to, msatoshi, riskfactor,
+			dstate->config.route_engine);
+	cr = route_cache_get(rstate->route_cache, &key);
+	/* Too big for it now?  Search again, and replace it. */
+	if (cr && !cached_route_fits(dstate, cr, msatoshi))
+		cr = tal_free(cr);
+	if (cr) {
+		rstate->route_cache_hits++;
+		if (rstate->trace)
+			rstate->trace->cache_hits++;
+		list_del(&cr->list);
+		list_add_tail(&rstate->route_lru, &cr->list);
+		*route = tal_dup_arr(dstate, struct node_connection,
+				     cr->route, tal_count(cr->route), 0);
+		*fee = route_fee(*route, msatoshi);
+		n = node_by_index(rstate, cr->first);
+	} else {
+		struct timeabs start = time_now();
+
+		rstate->route_cache_misses++;
+		trace2(route_search_start, src, dst);
+		if (dstate->config.route_engine == ROUTE_ENGINE_BFG)
+			n = route_bfg(dstate, src, dst, msatoshi, riskfactor,
+				      fee, route);
+		else
+			n = route_dijkstra(dstate, src, dst, msatoshi,
+					   riskfactor, NULL, NULL, fee, route);
+		stats_latency(dstate, STATS_ROUTE_SEARCH, start);
+		trace2(route_search_done, n, *fee);
+	}
+
+	/* No route? */
+	if (!n) {
+		log_info_struct(dstate->base_log, "find_route: No route to %s",
+				struct pubkey, to);
+		return NULL;
+	}
+
+	/* We should only add routes if we have a peer. */
+	first = find_peer(dstate, &n->id);
+	if (!first) {
+		log_broken_struct(dstate->base_log, "No peer %s?",
+				  struct pubkey, &n->id);
+		*route = tal_free(*route);
+		tal_free(cr);
+		return NULL;
+	}
+
+	if (!cr)
+		cache_route(rstate, &key, src->index, n->index, *route);
+
+	hops = tal_count(*route);
+	msatoshi += *fee;
+	log_info(dstate->base_log, "find_route:");
+	log_add_struct(dstate->base_log, "via %s", struct pubkey, first->id);
+	/* If there are intermidiaries, dump them, and total fees. */
+	if (hops != 0) {
+		for (i = 0; i < hops; i++) {
+			const struct node_connection *c = &(*route)[i];
+			log_add_struct(dstate->base_log, " %s",
+				       struct pubkey,
+				       &node_by_index(dstate->rstate, c->dst)->id);
+			log_add(dstate->base_log, "(%i+%i=%"PRIu64")",
+				c->base_fee, c->proportional_fee,
+				connection_fee(c, msatoshi));
+			msatoshi -= connection_fee(c, msatoshi);
+		}
+		log_add(dstate->base_log, "=%"PRIi64"(%+"PRIi64")",
+			msatoshi, *fee);
+	}
+	return first;
+}
+
+static void exclude_conn(struct route_exclusions *excl,
+			 const struct node_connection *c)
+{
+	size_t n = tal_count(excl->conns);
+
+	tal_resize(&excl->conns, n+1);
+	excl->conns[n] = c;
+	excl->has_conn[c->dst] = true;
+}
+
+/* Stop later searches using any connection (and maybe node) of this. */
+static void exclude_route(struct routing_state *rstate,
+			  struct route_exclusions *excl,
+			  u32 src, u32 first,
+			  const struct node_connection *route,
+			  bool node_disjoint)
+{
+	size_t i, n = tal_count(route);
+
+	exclude_conn(excl, find_in(node_by_index(rstate, first), src));
+	for (i = 0; i < n; i++)
+		exclude_conn(excl, find_in(node_by_index(rstate, route[i].dst),
+					   route[i].src));
+
+	if (node_disjoint && n) {
+		excl->node[first] = true;
+		for (i = 0; i + 1 < n; i++)
+			excl->node[route[i].dst] = true;
+	}
+}
+
+struct alt_route *find_alt_routes(struct lightningd_state *dstate,
+				  const tal_t *ctx,
+				  const struct pubkey *to,
+				  u64 msatoshi,
+				  double riskfactor,
+				  size_t num,
+				  bool node_disjoint,
+				  const struct route_limits *limits)
+{
+	struct routing_state *rstate = dstate->rstate;
+	struct alt_route *routes = tal_arr(ctx, struct alt_route, 0);
+	struct route_exclusions excl;
+	struct node_connection *route;
+	struct node *src, *dst, *n;
+	struct peer *peer;
+	size_t i, num_nodes = tal_count(rstate->by_index);
+	s64 fee;
+
+	if (num == 0)
+		return routes;
+
+	src = get_node(dstate, &dstate->id);
+	dst = get_node(dstate, to);
+
+	/* The best one is just a normal route (and may be cached). */
+	if (!limits) {
+		peer = find_route(dstate, to, msatoshi, riskfactor,
+				  &fee, &route);
+		if (!peer)
+			return routes;
+	} else if (!dst || dst == src)
+		return routes;
+
+	excl.node = tal_arrz(routes, bool, num_nodes);
+	excl.has_conn = tal_arrz(excl.node, bool, num_nodes);
+	excl.conns = tal_arr(excl.node, const struct node_connection *, 0);
+
+	if (limits) {
+		for (i = 0; limits->exclude && i < tal_count(limits->exclude);
+		     i++) {
+			n = get_node(dstate, &limits->exclude[i]);
+			if (n && n != src)
+				excl.node[n->index] = true;
+		}
+		n = route_dijkstra(dstate, src, dst, msatoshi, riskfactor,
+				   &excl, limits, &fee, &route);
+		peer = n ? find_peer(dstate, &n->id) : NULL;
+		if (!peer) {
+			if (n)
+				tal_free(route);
+			goto out;
+		}
+	}
+
+	for (;;) {
+		i = tal_count(routes);
+		tal_resize(&routes, i+1);
+		routes[i].peer = peer;
+		routes[i].fee = fee;
+		routes[i].route = tal_steal(routes, route);
+		if (i + 1 == num)
+			break;
+
+		n = get_node(dstate, peer->id);
+		exclude_route(rstate, &excl, src->index, n->index, route,
+			      node_disjoint);
+		n = route_dijkstra(dstate, src, dst, msatoshi, riskfactor,
+				   &excl, limits, &fee, &route);
+		if (!n)
+			break;
+		peer = find_peer(dstate, &n->id);
+		if (!peer) {
+			tal_free(route);
+			break;
+		}
+	}
+
+out:
+	log_debug(dstate->base_log, "find_alt_routes: found %zu of %zu",
+		  tal_count(routes), num);
+	tal_free(excl.node);
+	return routes;
 }
 
-static struct node_connection *
-get_or_make_connection(struct lightningd_state *dstate,
-		       const struct pubkey *from_id,
-		       const struct pubkey *to_id)
+struct peer *find_circular_route(struct lightningd_state *dstate,
+				 const struct pubkey *out,
+				 const struct pubkey *in,
+				 u64 msatoshi,
+				 double riskfactor,
+				 const struct route_limits *limits,
+				 s64 *fee,
+				 struct node_connection **route)
 {
-	size_t i, n;
-	struct node *from, *to;
-	struct node_connection *nc;
+	struct routing_state *rstate = dstate->rstate;
+	struct route_exclusions excl;
+	struct route_limits lim;
+	struct node *us, *first, *last, *n;
+	const struct node_connection *back, *c;
+	struct peer *peer;
+	size_t i, hops, num_nodes = tal_count(rstate->by_index);
+	s64 back_fee;
+
+	us = get_node(dstate, &dstate->id);
+	first = get_node(dstate, out);
+	last = get_node(dstate, in);
+	if (!us || !first || !last || first == last || first == us
+	    || last == us)
+		return NULL;
 
-	from = get_node(dstate, from_id);
-	if (!from)
-		from = new_node(dstate, from_id);
-	to = get_node(dstate, to_id);
-	if (!to)
-		to = new_node(dstate, to_id);
+	/* The way home is fixed: we search out to @in, for what it needs. */
+	back = find_in(us, last->index);
+	if (!back)
+		return NULL;
+	back_fee = connection_fee(back, msatoshi);
+	if (msatoshi + back_fee > connection_capacity(dstate, back, us->index))
+		return NULL;
 
-	n = tal_count(to->in);
-	for (i = 0; i < n; i++) {
-		if (to->in[i]->src == from) {
-			log_debug_struct(dstate->base_log,
-					 "Updating existing route from %s",
-					 struct pubkey, &from->id);
-			log_add_struct(dstate->base_log, " to %s",
-				       struct pubkey, &to->id);
-			return to->in[i];
-		}
+	if (limits)
+		lim = *limits;
+	else
+		route_limits_init(&lim);
+	if (lim.max_fee < (u64)back_fee || lim.max_delay < back->delay
+	    || lim.max_hops < 2)
+		return NULL;
+	lim.max_fee -= back_fee;
+	lim.max_delay -= back->delay;
+	lim.max_hops--;
+
+	excl.node = tal_arrz(dstate, bool, num_nodes);
+	excl.has_conn = tal_arrz(excl.node, bool, num_nodes);
+	excl.conns = tal_arr(excl.node, const struct node_connection *, 0);
+	for (i = 0; lim.exclude && i < tal_count(lim.exclude); i++) {
+		n = get_node(dstate, &lim.exclude[i]);
+		if (n && n != us)
+			excl.node[n->index] = true;
 	}
 
-	log_debug_struct(dstate->base_log, "Creating new route from %s",
-			 struct pubkey, &from->id);
-	log_add_struct(dstate->base_log, " to %s", struct pubkey, &to->id);
+	/* Leave only our channel to @out.  (Routes through us end there, so
+	 * the search can't come back through us early.) */
+	list_for_each(&dstate->peers, peer, list) {
+		n = peer->id ? get_node(dstate, peer->id) : NULL;
+		if (!n || n == first)
+			continue;
+		c = find_in(n, us->index);
+		if (c)
+			exclude_conn(&excl, c);
+	}
 
-	nc = tal(dstate, struct node_connection);
-	nc->src = from;
-	nc->dst = to;
-	log_add(dstate->base_log, " = %p (%p->%p)", nc, from, to);
+	n = route_dijkstra(dstate, us, last, msatoshi + back_fee, riskfactor,
+			   &excl, &lim, fee, route);
+	tal_free(excl.node);
+	if (!n)
+		return NULL;
+	assert(n == first);
 
-	/* Hook it into in/out arrays. */
-	i = tal_count(to->in);
-	tal_resize(&to->in, i+1);
-	to->in[i] = nc;
-	i = tal_count(from->out);
-	tal_resize(&from->out, i+1);
-	from->out[i] = nc;
+	hops = tal_count(*route);
+	tal_resize(route, hops + 1);
+	(*route)[hops] = *back;
+	*fee += back_fee;
 
-	tal_add_destructor(nc, destroy_connection);
-	return nc;
+	peer = find_peer(dstate, out);
+	if (!peer)
+		*route = tal_free(*route);
+	return peer;
 }
 
-/* Updates existing route if required. */
-struct node_connection *add_connection(struct lightningd_state *dstate,
-				       const struct pubkey *from,
-				       const struct pubkey *to,
-				       u32 base_fee, s32 proportional_fee,
-				       u32 delay, u32 min_blocks)
+/* Every node's outgoing connections: the graph only keeps incoming. */
+struct out_index {
+	/* Node n's are conns[start[n]] to conns[start[n+1]-1]. */
+	u32 *start;
+	const struct node_connection **conns;
+};
+
+static void build_out_index(const tal_t *ctx, struct routing_state *rstate,
+			    struct out_index *out)
 {
-	struct node_connection *c = get_or_make_connection(dstate, from, to);
-	c->base_fee = base_fee;
-	c->proportional_fee = proportional_fee;
-	c->delay = delay;
-	c->min_blocks = min_blocks;
-	return c;
+	size_t n, i, num_nodes = tal_count(rstate->by_index), num = 0;
+	u32 *next;
+
+	out->start = tal_arrz(ctx, u32, num_nodes + 1);
+	for (n = 0; n < num_nodes; n++) {
+		const struct node *node = rstate->by_index[n];
+		for (i = 0; i < tal_count(node->in); i++)
+			out->start[node->in[i].src + 1]++;
+		num += tal_count(node->in);
+	}
+	for (n = 0; n < num_nodes; n++)
+		out->start[n+1] += out->start[n];
+
+	out->conns = tal_arr(ctx, const struct node_connection *, num);
+	next = tal_dup_arr(ctx, u32, out->start, num_nodes, 0);
+	for (n = 0; n < num_nodes; n++) {
+		const struct node *node = rstate->by_index[n];
+		for (i = 0; i < tal_count(node->in); i++)
+			out->conns[next[node->in[i].src]++] = &node->in[i];
+	}
+	tal_free(next);
 }
 
-void remove_connection(struct lightningd_state *dstate,
-		       const struct pubkey *src, const struct pubkey *dst)
+struct alt_route *find_routes_many(struct lightningd_state *dstate,
+				   const tal_t *ctx,
+				   const struct pubkey *to, size_t num,
+				   u64 msatoshi, double riskfactor)
 {
-	struct node *from, *to;
-	size_t i, num_edges;
+	struct routing_state *rstate = dstate->rstate;
+	struct alt_route *routes = tal_arrz(ctx, struct alt_route, num);
+	size_t i, label, num_nodes = tal_count(rstate->by_index);
+	struct timeabs now = controlled_time();
+	struct first_hops fh;
+	struct out_index out;
+	struct dijkstra d;
+	size_t *best;
+	struct node *src = get_node(dstate, &dstate->id);
+
+	if (num == 0)
+		return routes;
+
+	/* Everything hangs off labels, so one free cleans up. */
+	d.labels = tal_arr(dstate, struct dijkstra_label, 16);
+	d.heap = tal_arr(d.labels, size_t, 16);
+	d.settled_hops = tal_arr(d.labels, u8, num_nodes);
+	memset(d.settled_hops, ROUTING_MAX_HOPS + 1, num_nodes);
+	d.num_labels = d.heap_len = 0;
+	best = tal_arr(d.labels, size_t, num_nodes);
+	for (i = 0; i < num_nodes; i++)
+		best[i] = SIZE_MAX;
+	build_out_index(d.labels, rstate, &out);
+	get_first_hops(d.labels, dstate, src->index, &fh);
+
+	/* Out from us this time, so we don't know what a connection will
+	 * carry until we reach the end: charge every fee on msatoshi.  That
+	 * only misses fees on fees, and we work the real ones out below. */
+	dijkstra_push(&d, src->index, msatoshi, 0, 0, 0, NULL, 0);
+	while (d.heap_len) {
+		const struct dijkstra_label *l;
+
+		label = dijkstra_pop(&d);
+		l = &d.labels[label];
+
+		if (d.settled_hops[l->node] <= l->hops)
+			continue;
+		d.settled_hops[l->node] = l->hops;
+		/* The first time is the cheapest. */
+		if (best[l->node] == SIZE_MAX)
+			best[l->node] = label;
 
-	log_debug_struct(dstate->base_log, "Removing route from %s",
-			 struct pubkey, src);
-	log_add_struct(dstate->base_log, " to %s", struct pubkey, dst);
+		if (l->hops == ROUTING_MAX_HOPS)
+			continue;
 
-	from = get_node(dstate, src);
-	to = get_node(dstate, dst);
-	if (!from || !to) {
-		log_debug(dstate->base_log, "Not found: src=%p dst=%p",
-			  from, to);
-		return;
+		for (i = out.start[l->node]; i < out.start[l->node+1]; i++) {
+			const struct node_connection *c = out.conns[i];
+			s64 fee;
+			u64 risk;
+
+			if (d.settled_hops[c->dst] <= l->hops + 1)
+				continue;
+			if (msatoshi > search_capacity(&fh, c))
+				continue;
+			/* We don't pay ourselves a fee. */
+			fee = c->src == src->index
+				? 0 : connection_fee(c, msatoshi);
+			if (l->total + fee >= INFINITE)
+				continue;
+			risk = l->risk + risk_fee(msatoshi, c->delay, riskfactor)
+				+ penalty_fee(edge_penalty(rstate, &fh, c, now),
+					      msatoshi);
+			dijkstra_push(&d, c->dst, l->total + fee, risk,
+				      l->hops + 1, 0, c, label);
+			/* Push may have moved labels[]. */
+			l = &d.labels[label];
+		}
 	}
 
-	num_edges = tal_count(from->out);
+	for (i = 0; i < num; i++) {
+		struct node *dst = get_node(dstate, &to[i]);
+		struct node_connection *route;
+		size_t hops, j;
+		u32 first;
 
-	for (i = 0; i < num_edges; i++) {
-		if (from->out[i]->dst != to)
+		if (!dst || dst == src || best[dst->index] == SIZE_MAX)
 			continue;
 
-		log_add(dstate->base_log, " Matched route %zu of %zu",
-			i, num_edges);
-		/* Destructor makes it delete itself */
-		tal_free(from->out[i]);
-		return;
-	}
-	log_add(dstate->base_log, " None of %zu routes matched", num_edges);
-}
-
-/* Too big to reach, but don't overflow if added. */
-#define INFINITE 0x3FFFFFFFFFFFFFFFULL
-
-static void clear_bfg(struct node_map *nodes)
-{
-	struct node *n;
-	struct node_map_iter it;
+		/* Walk back to our connection to the first peer. */
+		label = best[dst->index];
+		hops = d.labels[label].hops - 1;
+		route = tal_arr(routes, struct node_connection, hops);
+		for (j = hops; j > 0; j--) {
+			route[j-1] = *d.labels[label].prev;
+			label = d.labels[label].prev_label;
+		}
+		first = d.labels[label].node;
+
+		/* Too big once fees on fees are added?  Search properly. */
+		if (!route_fits(dstate, src->index, first, route, msatoshi)) {
+			tal_free(route);
+			routes[i].peer = find_route(dstate, &to[i], msatoshi,
+						    riskfactor, &routes[i].fee,
+						    &routes[i].route);
+			if (routes[i].peer)
+				tal_steal(routes, routes[i].route);
+			continue;
+		}
 
-	for (n = node_map_first(nodes, &it); n; n = node_map_next(nodes, &it)) {
-		size_t i;
-		for (i = 0; i < ARRAY_SIZE(n->bfg); i++) {
-			n->bfg[i].total = INFINITE;
-			n->bfg[i].risk = 0;
+		routes[i].peer = find_peer(dstate,
+					   &node_by_index(rstate, first)->id);
+		if (!routes[i].peer) {
+			tal_free(route);
+			continue;
 		}
+		routes[i].route = route;
+		routes[i].fee = route_fee(route, msatoshi);
 	}
+
+	log_debug(dstate->base_log, "find_routes_many: %zu destinations,"
+		  " %zu labels", num, d.num_labels);
+	tal_free(d.labels);
+	return routes;
 }
 
-s64 connection_fee(const struct node_connection *c, u64 msatoshi)
-{
+/* What the child tells us: header, then one reply per route, then all
+ * the routes' connections. */
+struct route_reply_hdr {
+	u32 num_routes, num_conns;
+	/* Zeroes unless the query was traced. */
+	struct route_trace trace;
+};
+
+struct route_reply {
+	/* Index of first hop (the peer). */
+	u32 first;
+	u32 hops;
 	s64 fee;
+};
 
-	if (mul_overflows_s64(c->proportional_fee, msatoshi))
-		return INFINITE;
-	fee = (c->proportional_fee * msatoshi) / 1000000;
-	/* This can't overflow: c->base_fee is a u32 */
-	return c->base_fee + fee;
+struct route_query {
+	struct lightningd_state *dstate;
+	pid_t pid;
+	/* What find_route would cache the best route under. */
+	struct route_cache_key key;
+	u32 src;
+	/* If graph changes while child works, don't cache result. */
+	u64 generation;
+	/* Nor if it was limited: it mightn't be the best. */
+	bool limited;
+	/* What the search cost goes to (or NULL). */
+	struct route_trace *trace;
+
+	struct route_reply_hdr hdr;
+	struct route_reply *replies;
+	struct node_connection *conns;
+	bool done;
+
+	void (*cb)(const struct alt_route *routes, void *arg);
+	void *arg;
+};
+
+static void add_route_trace(struct route_trace *t,
+			    const struct route_trace *more)
+{
+	size_t i;
+
+	t->searches += more->searches;
+	t->cache_hits += more->cache_hits;
+	t->nodes_visited += more->nodes_visited;
+	t->edges_visited += more->edges_visited;
+	t->relaxations += more->relaxations;
+	for (i = 0; i < ROUTE_PRUNE_NUM; i++)
+		t->pruned[i] += more->pruned[i];
+	for (i = 0; i < ROUTE_PHASE_NUM; i++)
+		t->phase_usec[i] += more->phase_usec[i];
 }
 
-/* Risk of passing through this channel.  We insert a tiny constant here
- * in order to prefer shorter routes, all things equal. */
-static u64 risk_fee(s64 amount, u32 delay, double riskfactor)
+/* This runs in the child. */
+static void search_and_write(struct lightningd_state *dstate, int fd,
+			     const struct pubkey *to, u64 msatoshi,
+			     double riskfactor, size_t num, bool node_disjoint,
+			     const struct route_limits *limits, bool traced)
 {
-	/* If fees are so negative we're making money, ignore risk. */
-	if (amount < 0)
-		return 1;
+	struct alt_route *routes;
+	struct route_reply_hdr hdr;
+	struct route_reply *replies;
+	size_t i;
+
+	memset(&hdr.trace, 0, sizeof(hdr.trace));
+	if (traced)
+		dstate->rstate->trace = &hdr.trace;
+	routes = find_alt_routes(dstate, dstate, to, msatoshi, riskfactor,
+				 num, node_disjoint, limits);
+	hdr.num_routes = tal_count(routes);
+	hdr.num_conns = 0;
+	replies = tal_arr(routes, struct route_reply, hdr.num_routes);
+	for (i = 0; i < hdr.num_routes; i++) {
+		replies[i].first = get_node(dstate, routes[i].peer->id)->index;
+		replies[i].hops = tal_count(routes[i].route);
+		replies[i].fee = routes[i].fee;
+		hdr.num_conns += replies[i].hops;
+	}
 
-	return 1 + amount * delay * riskfactor / BLOCKS_PER_YEAR / 10000;
+	if (!write_all(fd, &hdr, sizeof(hdr))
+	    || !write_all(fd, replies, sizeof(replies[0]) * hdr.num_routes))
+		return;
+	for (i = 0; i < hdr.num_routes; i++)
+		if (!write_all(fd, routes[i].route,
+			       sizeof(routes[i].route[0]) * replies[i].hops))
+			return;
 }
 
-/* We track totals, rather than costs.  That's because the fee depends
- * on the current amount passing through. */
-static void bfg_one_edge(struct node *node, size_t edgenum, double riskfactor)
+static struct io_plan *routes_read(struct io_conn *conn,
+				   struct route_query *q)
 {
-	struct node_connection *c = node->in[edgenum];
-	size_t h;
-
-	assert(c->dst == node);
-	for (h = 0; h < ROUTING_MAX_HOPS; h++) {
-		/* FIXME: Bias against smaller channels. */
-		s64 fee = connection_fee(c, node->bfg[h].total);
-		u64 risk = node->bfg[h].risk + risk_fee(node->bfg[h].total + fee,
-							c->delay, riskfactor);
-		if (node->bfg[h].total + (s64)fee + (s64)risk
-		    < c->src->bfg[h+1].total + (s64)c->src->bfg[h+1].risk) {
-			c->src->bfg[h+1].total = node->bfg[h].total + fee;
-			c->src->bfg[h+1].risk = risk;
-			c->src->bfg[h+1].prev = c;
+	struct routing_state *rstate = q->dstate->rstate;
+	struct alt_route *routes = tal_arr(q, struct alt_route, 0);
+	const struct node_connection *c = q->conns;
+	size_t i, hops = 0;
+
+	for (i = 0; i < q->hdr.num_routes; i++)
+		hops += q->replies[i].hops;
+	if (hops != q->hdr.num_conns)
+		return io_close(conn);
+
+	/* What the child would have logged, if it could. */
+	log_debug(q->dstate->base_log, "Route search child: %u routes, %u hops",
+		  q->hdr.num_routes, q->hdr.num_conns);
+
+	for (i = 0; i < q->hdr.num_routes; i++) {
+		const struct route_reply *r = &q->replies[i];
+		struct node_connection *route;
+		struct peer *peer;
+		size_t n;
+
+		route = tal_dup_arr(routes, struct node_connection,
+				    c, r->hops, 0);
+		c += r->hops;
+
+		/* Peer may have gone away while we were searching. */
+		peer = find_peer(q->dstate, &node_by_index(rstate,
+							   r->first)->id);
+		if (!peer) {
+			tal_free(route);
+			continue;
 		}
+
+		if (i == 0 && !q->limited && q->generation == rstate->generation)
+			cache_route(rstate, &q->key, q->src, r->first, route);
+
+		n = tal_count(routes);
+		tal_resize(&routes, n+1);
+		routes[n].peer = peer;
+		routes[n].fee = r->fee;
+		routes[n].route = route;
 	}
+
+	if (q->trace)
+		add_route_trace(q->trace, &q->hdr.trace);
+	q->done = true;
+	q->cb(routes, q->arg);
+	return io_close(conn);
 }
 
-struct peer *find_route(struct lightningd_state *dstate,
-			const struct pubkey *to,
-			u64 msatoshi,
-			double riskfactor,
-			s64 *fee,
-			struct node_connection ***route)
+static struct io_plan *read_route_conns(struct io_conn *conn,
+					struct route_query *q)
 {
-	struct node *n, *src, *dst;
-	struct node_map_iter it;
-	struct peer *first;
-	int runs, i, best;
-
-	/* Note: we map backwards, since we know the amount of satoshi we want
-	 * at the end, and need to derive how much we need to send. */
-	dst = get_node(dstate, &dstate->id);
-	src = get_node(dstate, to);
-	if (!src) {
-		log_info_struct(dstate->base_log, "find_route: cannot find %s",
-				struct pubkey, to);
-		return NULL;
-	}
+	q->conns = tal_arr(q, struct node_connection, q->hdr.num_conns);
+	return io_read(conn, q->conns, sizeof(q->conns[0]) * q->hdr.num_conns,
+		       routes_read, q);
+}
 
-	/* Reset all the information. */
-	clear_bfg(dstate->nodes);
+static struct io_plan *read_route_replies(struct io_conn *conn,
+					  struct route_query *q)
+{
+	q->replies = tal_arr(q, struct route_reply, q->hdr.num_routes);
+	return io_read(conn, q->replies,
+		       sizeof(q->replies[0]) * q->hdr.num_routes,
+		       read_route_conns, q);
+}
 
-	/* Bellman-Ford-Gibson: like Bellman-Ford, but keep values for
-	 * every path length. */
-	src->bfg[0].total = msatoshi;
-	src->bfg[0].risk = 0;
+static struct io_plan *init_route_conn(struct io_conn *conn,
+				       struct route_query *q)
+{
+	return io_read(conn, &q->hdr, sizeof(q->hdr), read_route_replies, q);
+}
 
-	for (runs = 0; runs < ROUTING_MAX_HOPS; runs++) {
-		log_debug(dstate->base_log, "Run %i", runs);
-		/* Run through every edge. */
-		for (n = node_map_first(dstate->nodes, &it);
-		     n;
-		     n = node_map_next(dstate->nodes, &it)) {
-			size_t num_edges = tal_count(n->in);
-			for (i = 0; i < num_edges; i++) {
-				bfg_one_edge(n, i, riskfactor);
-				log_debug(dstate->base_log, "We seek %p->%p, this is %p -> %p",
-					  dst, src, n->in[i]->src, n->in[i]->dst);
-				log_debug_struct(dstate->base_log,
-						 "Checking from %s",
-						 struct pubkey,
-						 &n->in[i]->src->id);
-				log_add_struct(dstate->base_log,
-					       " to %s",
-					       struct pubkey,
-					       &n->in[i]->dst->id);
-			}
-		}
+static void reap_route_child(struct io_conn *conn, struct route_query *q)
+{
+	waitpid(q->pid, NULL, 0);
+	if (!q->done) {
+		log_broken(q->dstate->base_log, "Route search child failed");
+		q->cb(tal_arr(q, struct alt_route, 0), q->arg);
 	}
+}
 
-	best = 0;
-	for (i = 1; i <= ROUTING_MAX_HOPS; i++) {
-		if (dst->bfg[i].total < dst->bfg[best].total)
-			best = i;
+void find_alt_routes_async_(struct lightningd_state *dstate,
+			    const struct pubkey *to,
+			    u64 msatoshi,
+			    double riskfactor,
+			    size_t num,
+			    bool node_disjoint,
+			    const struct route_limits *limits,
+			    struct route_trace *trace,
+			    void (*cb)(const struct alt_route *routes,
+				       void *arg),
+			    void *arg)
+{
+	struct routing_state *rstate = dstate->rstate;
+	struct lightningd_state *node;
+	struct route_query *q;
+	struct io_conn *conn;
+	struct alt_route *routes;
+	int pfds[2];
+
+	q = tal(NULL, struct route_query);
+	q->dstate = dstate;
+	q->src = get_node(dstate, &dstate->id)->index;
+	q->generation = rstate->generation;
+	q->limited = (limits != NULL);
+	q->trace = trace;
+	q->done = false;
+	q->cb = cb;
+	q->arg = arg;
+	route_cache_key(&q->key, &dstate->id, to, msatoshi, riskfactor,
+			dstate->config.route_engine);
+
+	/* Small graph, cached or hopeless?  No point forking. */
+	if (tal_count(rstate->by_index) < ROUTING_ASYNC_MIN_NODES
+	    || (num == 1 && !limits
+		&& route_cache_get(rstate->route_cache, &q->key))
+	    || !get_node(dstate, to))
+		goto sync;
+
+	if (pipe(pfds) != 0) {
+		log_unusual(dstate->base_log, "Creating pipes for route: %s",
+			    strerror(errno));
+		goto sync;
 	}
 
-	/* No route? */
-	if (dst->bfg[best].total >= INFINITE) {
-		log_info_struct(dstate->base_log, "find_route: No route to %s",
-				struct pubkey, to);
-		return NULL;
+	fflush(stdout);
+	q->pid = fork();
+	switch (q->pid) {
+	case -1:
+		log_unusual(dstate->base_log, "forking for route: %s",
+			    strerror(errno));
+		close(pfds[0]);
+		close(pfds[1]);
+		goto sync;
+	case 0:
+		/* Our parent's still logging to the same rings, and any of
+		 * its threads' locks could have been held as we forked: we
+		 * take none, and all we say goes down the pipe. */
+		for (node = dstate->host; node; node = next_node(dstate->host,
+								   node))
+			log_suspend(node->log_record);
+		close(pfds[0]);
+		search_and_write(dstate, pfds[1], to, msatoshi, riskfactor,
+				 num, node_disjoint, limits, trace != NULL);
+		/* Not exit(): that's our parent's atexit and stdio. */
+		_exit(0);
 	}
 
-	/* Save route from *next* hop (we return first hop as peer).
-	 * Note that we take our own fees into account for routing, even
-	 * though we don't pay them: it presumably effects preference. */
-	dst = dst->bfg[best].prev->dst;
-	best--;
-
-	*fee = dst->bfg[best].total - msatoshi;
-	*route = tal_arr(dstate, struct node_connection *, best);
-	for (i = 0, n = dst;
-	     i < best;
-	     n = n->bfg[best-i].prev->dst, i++) {
-		(*route)[i] = n->bfg[best-i].prev;
-	}
-	assert(n == src);
+	close(pfds[1]);
+	rstate->route_cache_misses++;
+	conn = io_new_conn(dstate, pfds[0], init_route_conn, q);
+	io_set_finish(conn, reap_route_child, q);
+	tal_steal(conn, q);
+	return;
+
+sync:
+	rstate->trace = trace;
+	routes = find_alt_routes(dstate, q, to, msatoshi, riskfactor,
+				 num, node_disjoint, limits);
+	rstate->trace = NULL;
+	cb(routes, arg);
+	tal_free(q);
+}
 
-	/* We should only add routes if we have a peer. */
-	first = find_peer(dstate, &dst->id);
-	if (!first) {
-		log_broken_struct(dstate->base_log, "No peer %s?",
-				  struct pubkey, &(*route)[0]->src->id);
-		return NULL;
-	}
+char *opt_set_route_engine(const char *arg, enum route_engine *engine)
+{
+	if (streq(arg, "dijkstra"))
+		*engine = ROUTE_ENGINE_DIJKSTRA;
+	else if (streq(arg, "bfg"))
+		*engine = ROUTE_ENGINE_BFG;
+	else
+		return tal_fmt(NULL, "Unknown route engine '%s'", arg);
+	return NULL;
+}
 
-	msatoshi += *fee;
-	log_info(dstate->base_log, "find_route:");
-	log_add_struct(dstate->base_log, "via %s", struct pubkey, first->id);
-	/* If there are intermidiaries, dump them, and total fees. */
-	if (best != 0) {
-		for (i = 0; i < best; i++) {
-			log_add_struct(dstate->base_log, " %s",
-				       struct pubkey, &(*route)[i]->dst->id);
-			log_add(dstate->base_log, "(%i+%i=%"PRIu64")",
-				(*route)[i]->base_fee,
-				(*route)[i]->proportional_fee,
-				connection_fee((*route)[i], msatoshi));
-			msatoshi -= connection_fee((*route)[i], msatoshi);
-		}
-		log_add(dstate->base_log, "=%"PRIi64"(%+"PRIi64")",
-			(*route)[best-1]->dst->bfg[best-1].total, *fee);
-	}
-	return first;
+void opt_show_route_engine(char buf[OPT_SHOW_LEN],
+			   const enum route_engine *engine)
+{
+	snprintf(buf, OPT_SHOW_LEN, "%s",
+		 *engine == ROUTE_ENGINE_BFG ? "bfg" : "dijkstra");
 }
 
 static bool get_slash_u32(const char **arg, u32 *v)
@@ -374,31 +1899,96 @@ static bool get_slash_u32(const char **arg, u32 *v)
 	return (endp == *arg);
 }
 
-/* srcid/dstid/base/var/delay/minblocks */
-char *opt_add_route(const char *arg, struct lightningd_state *dstate)
+static bool get_slash_u64(const char **arg, u64 *v)
 {
 	size_t len;
-	struct pubkey src, dst;
-	u32 base, var, delay, minblocks;
+	char *endp;
+
+	if (**arg != '/')
+		return false;
+	(*arg)++;
+	len = strcspn(*arg, "/");
+	*v = strtoull(*arg, &endp, 10);
+	(*arg) += len;
+	return (endp == *arg);
+}
+
+/* srcid/dstid/base/var/delay/minblocks[/capacity] */
+static const char *parse_route_edge(secp256k1_context *secpctx,
+				    const char *arg, struct route_edge *e)
+{
+	size_t len;
+	u32 var;
 
 	len = strcspn(arg, "/");
-	if (!pubkey_from_hexstr(dstate->secpctx, arg, len, &src))
+	if (!pubkey_from_hexstr(secpctx, arg, len, &e->src))
 		return "Bad src pubkey";
-	arg += len + 1;
+	arg += len;
+	if (*arg)
+		arg++;
 	len = strcspn(arg, "/");
-	if (!pubkey_from_hexstr(dstate->secpctx, arg, len, &dst))
+	if (!pubkey_from_hexstr(secpctx, arg, len, &e->dst))
 		return "Bad dst pubkey";
 	arg += len;
 
-	if (!get_slash_u32(&arg, &base)
+	if (!get_slash_u32(&arg, &e->base_fee)
 	    || !get_slash_u32(&arg, &var)
-	    || !get_slash_u32(&arg, &delay)
-	    || !get_slash_u32(&arg, &minblocks))
+	    || !get_slash_u32(&arg, &e->delay)
+	    || !get_slash_u32(&arg, &e->min_blocks))
 		return "Bad base/var/delay/minblocks";
+	e->proportional_fee = var;
+	e->capacity_msat = 0;
+	if (*arg && !get_slash_u64(&arg, &e->capacity_msat))
+		return "Bad capacity";
 	if (*arg)
-		return "Data after minblocks";
+		return "Data after capacity";
+	return NULL;
+}
+
+char *opt_add_route(const char *arg, struct lightningd_state *dstate)
+{
+	struct route_edge e;
+	const char *problem = parse_route_edge(dstate->secpctx, arg, &e);
+
+	if (problem)
+		return tal_strdup(NULL, problem);
+
+	add_connection(dstate, &e.src, &e.dst, e.base_fee,
+		       e.proportional_fee, e.delay, e.min_blocks,
+		       e.capacity_msat);
+	return NULL;
+}
+
+/* One --add-route per line: all must be good, or none are added. */
+char *opt_add_routes(const char *arg, struct lightningd_state *dstate)
+{
+	char *contents = grab_file(NULL, arg), **lines;
+	struct route_edge *edges;
+	size_t i, num = 0;
+
+	if (!contents)
+		return tal_fmt(NULL, "Reading %s: %s", arg, strerror(errno));
+
+	lines = tal_strsplit(contents, contents, "\n", STR_NO_EMPTY);
+	edges = tal_arr(contents, struct route_edge, tal_count(lines) - 1);
+	for (i = 0; lines[i]; i++) {
+		const char *problem;
+
+		if (lines[i][0] == '#')
+			continue;
+		problem = parse_route_edge(dstate->secpctx, lines[i],
+					   &edges[num]);
+		if (problem) {
+			char *err = tal_fmt(NULL, "%s line %zu: %s",
+					    arg, i + 1, problem);
+			tal_free(contents);
+			return err;
+		}
+		num++;
+	}
 
-	add_connection(dstate, &src, &dst, base, var, delay, minblocks);
+	add_connections(dstate, edges, num);
+	tal_free(contents);
 	return NULL;
 }
 
@@ -406,8 +1996,10 @@ static void json_add_route(struct command *cmd,
 			   const char *buffer, const jsmntok_t *params)
 {
 	jsmntok_t *srctok, *dsttok, *basetok, *vartok, *delaytok, *minblockstok;
+	jsmntok_t *capacitytok;
 	struct pubkey src, dst;
 	u32 base, var, delay, minblocks;
+	u64 capacity = 0;
 
 	if (!json_get_params(buffer, params,
 			    "src", &srctok,
@@ -416,6 +2008,7 @@ static void json_add_route(struct command *cmd,
 			    "var", &vartok,
 			    "delay", &delaytok,
 			    "minblocks", &minblockstok,
+			    "?capacity", &capacitytok,
 			    NULL)) {
 		command_fail(cmd, "Need src, dst, base, var, delay & minblocks");
 		return;
@@ -448,17 +2041,79 @@ static void json_add_route(struct command *cmd,
 		return;
 	}
 
-	add_connection(cmd->dstate, &src, &dst, base, var, delay, minblocks);
+	if (capacitytok && !json_tok_u64(buffer, capacitytok, &capacity)) {
+		command_fail(cmd, "capacity must be a number");
+		return;
+	}
+
+	add_connection(cmd->dstate, &src, &dst, base, var, delay, minblocks,
+		       capacity);
 	command_success(cmd, null_response(cmd));
 }
 	
 const struct json_command dev_add_route_command = {
 	"dev-add-route",
 	json_add_route,
-	"Add route from {src} to {dst}, {base} rate in msatoshi, {var} rate in msatoshi, {delay} blocks delay and {minblocks} minimum timeout",
+	"Add route from {src} to {dst}, {base} rate in msatoshi, {var} rate in msatoshi, {delay} blocks delay and {minblocks} minimum timeout, optionally carrying at most {capacity} msatoshi",
 	"Returns an empty result on success"
 };
 
+static void json_add_routes(struct command *cmd,
+			    const char *buffer, const jsmntok_t *params)
+{
+	jsmntok_t *routestok;
+	const jsmntok_t *t, *end;
+	struct json_result *response;
+	struct route_edge *edges;
+	size_t num = 0, changed;
+
+	if (!json_get_params(buffer, params,
+			     "routes", &routestok,
+			     NULL)) {
+		command_fail(cmd, "Need routes");
+		return;
+	}
+
+	if (routestok->type != JSMN_ARRAY) {
+		command_fail(cmd, "routes must be an array");
+		return;
+	}
+
+	/* Check them all before we touch the graph. */
+	edges = tal_arr(cmd, struct route_edge, routestok->size);
+	end = json_next(routestok);
+	for (t = routestok + 1; t < end; t = json_next(t)) {
+		const char *problem;
+
+		problem = parse_route_edge(cmd->dstate->secpctx,
+					   tal_strndup(cmd,
+						       buffer + t->start,
+						       t->end - t->start),
+					   &edges[num]);
+		if (problem) {
+			command_fail(cmd, "routes %zu: %s", num, problem);
+			return;
+		}
+		num++;
+	}
+
+	changed = add_connections(cmd->dstate, edges, num);
+
+	response = new_json_result(cmd);
+	json_object_start(response, NULL);
+	json_add_num(response, "routes", num);
+	json_add_num(response, "changed", changed);
+	json_object_end(response);
+	command_success(cmd, response);
+}
+
+const struct json_command dev_add_routes_command = {
+	"dev-add-routes",
+	json_add_routes,
+	"Add many {routes} at once, each a string as --add-route takes",
+	"Returns the number of {routes} and how many were new or {changed}; if any is bad, none are added"
+};
+
 static void json_routefail(struct command *cmd,
 			   const char *buffer, const jsmntok_t *params)
 {
@@ -491,3 +2146,199 @@ const struct json_command dev_routefail_command = {
 };
 
 
+void json_add_route_trace(struct json_result *response, const char *fieldname,
+			  const struct route_trace *t)
+{
+	static const char *prune_names[ROUTE_PRUNE_NUM] = {
+		"no_better", "unreached", "excluded", "capacity",
+		"maxfee", "maxdelay", "maxhops"
+	};
+	static const char *phase_names[ROUTE_PHASE_NUM] = {
+		"setup_usec", "search_usec", "build_usec"
+	};
+	size_t i;
+
+	json_object_start(response, fieldname);
+	json_add_num(response, "searches", t->searches);
+	json_add_num(response, "cache_hits", t->cache_hits);
+	json_add_u64(response, "nodes_visited", t->nodes_visited);
+	json_add_u64(response, "edges_visited", t->edges_visited);
+	json_add_u64(response, "relaxations", t->relaxations);
+	json_object_start(response, "pruned");
+	for (i = 0; i < ROUTE_PRUNE_NUM; i++)
+		json_add_u64(response, prune_names[i], t->pruned[i]);
+	json_object_end(response);
+	for (i = 0; i < ROUTE_PHASE_NUM; i++)
+		json_add_u64(response, phase_names[i], t->phase_usec[i]);
+	json_object_end(response);
+}
+
+static void json_getroutepenalties(struct command *cmd,
+				   const char *buffer, const jsmntok_t *params)
+{
+	struct routing_state *rstate = cmd->dstate->rstate;
+	struct json_result *response = new_json_result(cmd);
+	struct timeabs now = controlled_time();
+	struct penalty_map_iter it;
+	const struct route_penalty *p;
+
+	json_object_start(response, NULL);
+	json_array_start(response, "penalties");
+	for (p = penalty_map_first(rstate->penalties, &it);
+	     p;
+	     p = penalty_map_next(rstate->penalties, &it)) {
+		u64 score = penalty_score(p, now);
+		if (!score)
+			continue;
+
+		json_object_start(response, NULL);
+		json_add_pubkey(response, cmd->dstate->secpctx, "src",
+				&node_by_index(rstate, p->src)->id);
+		json_add_pubkey(response, cmd->dstate->secpctx, "dst",
+				&node_by_index(rstate, p->dst)->id);
+		json_add_num(response, "failures", p->failures);
+		json_add_u64(response, "last_failure", p->when.ts.tv_sec);
+		json_add_u64(response, "penalty_msat", penalty_fee(score, 0));
+		json_object_end(response);
+	}
+	json_array_end(response);
+	json_object_end(response);
+	command_success(cmd, response);
+}
+
+const struct json_command getroutepenalties_command = {
+	"getroutepenalties",
+	json_getroutepenalties,
+	"Show connections we avoid because payments failed there",
+	"Returns a 'penalties' array of {src}, {dst}, {failures}, {last_failure} and {penalty_msat} (minimum extra cost of routing through it)"
+};
+
+/* Pages of the graph, so a big one never needs one huge response. */
+#define GRAPH_PAGE_NODES 1000
+#define GRAPH_PAGE_CHANNELS 10000
+
+/* Returns false (having failed cmd) if they're no good. */
+static bool get_page_params(struct command *cmd,
+			    const char *buffer, const jsmntok_t *params,
+			    u32 *start, u32 *limit)
+{
+	jsmntok_t *starttok, *limittok;
+
+	if (!json_get_params(buffer, params,
+			     "?start", &starttok,
+			     "?limit", &limittok,
+			     NULL)) {
+		command_fail(cmd, "Invalid arguments");
+		return false;
+	}
+
+	*start = 0;
+	if (starttok && !json_tok_number(buffer, starttok, start)) {
+		command_fail(cmd, "Invalid start '%.*s'",
+			     starttok->end - starttok->start,
+			     buffer + starttok->start);
+		return false;
+	}
+	if (limittok && (!json_tok_number(buffer, limittok, limit)
+			 || *limit == 0)) {
+		command_fail(cmd, "Invalid limit '%.*s'",
+			     limittok->end - limittok->start,
+			     buffer + limittok->start);
+		return false;
+	}
+	return true;
+}
+
+static void json_getnodes(struct command *cmd,
+			  const char *buffer, const jsmntok_t *params)
+{
+	struct routing_state *rstate = cmd->dstate->rstate;
+	struct json_result *response;
+	u32 i, start, limit = GRAPH_PAGE_NODES;
+
+	if (!get_page_params(cmd, buffer, params, &start, &limit))
+		return;
+
+	response = new_json_result(cmd);
+	json_object_start(response, NULL);
+	json_array_start(response, "nodes");
+	/* Nodes are never removed, so an index is a stable place to resume. */
+	for (i = start; i < tal_count(rstate->by_index) && i - start < limit;
+	     i++) {
+		const struct node *n = node_by_index(rstate, i);
+
+		json_object_start(response, NULL);
+		json_add_num(response, "index", n->index);
+		json_add_pubkey(response, cmd->dstate->secpctx, "id", &n->id);
+		json_add_num(response, "channels_in", tal_count(n->in));
+		json_object_end(response);
+	}
+	json_array_end(response);
+	if (i < tal_count(rstate->by_index))
+		json_add_num(response, "next", i);
+	json_object_end(response);
+	command_success(cmd, response);
+}
+
+const struct json_command getnodes_command = {
+	"getnodes",
+	json_getnodes,
+	"Show up to {limit} (default 1000) nodes of the routing graph, from index {start}",
+	"Returns a 'nodes' array of {index}, {id} and {channels_in}, and {next} to give as {start} for the rest, if there are more"
+};
+
+static void json_getchannels(struct command *cmd,
+			     const char *buffer, const jsmntok_t *params)
+{
+	struct routing_state *rstate = cmd->dstate->rstate;
+	struct json_result *response;
+	char fee[sizeof("-2147483648")];
+	u32 i, start, limit = GRAPH_PAGE_CHANNELS;
+	size_t j, num = 0;
+
+	if (!get_page_params(cmd, buffer, params, &start, &limit))
+		return;
+
+	response = new_json_result(cmd);
+	json_object_start(response, NULL);
+	json_array_start(response, "channels");
+	/* A node's channels are never split over pages, unless it alone has
+	 * more than the limit. */
+	for (i = start; i < tal_count(rstate->by_index); i++) {
+		const struct node *n = node_by_index(rstate, i);
+
+		if (num && num + tal_count(n->in) > limit)
+			break;
+		for (j = 0; j < tal_count(n->in); j++) {
+			const struct node_connection *c = &n->in[j];
+
+			json_object_start(response, NULL);
+			json_add_pubkey(response, cmd->dstate->secpctx, "src",
+					&node_by_index(rstate, c->src)->id);
+			json_add_pubkey(response, cmd->dstate->secpctx, "dst",
+					&n->id);
+			json_add_num(response, "base_fee", c->base_fee);
+			sprintf(fee, "%d", c->proportional_fee);
+			json_add_literal(response, "proportional_fee",
+					 fee, strlen(fee));
+			json_add_num(response, "delay", c->delay);
+			json_add_num(response, "min_blocks", c->min_blocks);
+			json_add_u64(response, "capacity_msat",
+				     c->capacity_msat);
+			json_object_end(response);
+		}
+		num += tal_count(n->in);
+	}
+	json_array_end(response);
+	if (i < tal_count(rstate->by_index))
+		json_add_num(response, "next", i);
+	json_object_end(response);
+	command_success(cmd, response);
+}
+
+const struct json_command getchannels_command = {
+	"getchannels",
+	json_getchannels,
+	"Show about {limit} (default 10000) channels of the routing graph, into nodes from index {start}",
+	"Returns a 'channels' array of {src}, {dst}, {base_fee}, {proportional_fee}, {delay}, {min_blocks} and {capacity_msat}, and {next} to give as {start} for the rest, if there are more"
+};
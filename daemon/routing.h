@@ -2,11 +2,30 @@
 #define LIGHTNING_DAEMON_ROUTING_H
 #include "config.h"
 #include "bitcoin/pubkey.h"
+#include <ccan/list/list.h>
+#include <ccan/opt/opt.h>
+#include <ccan/time/time.h>
+#include <ccan/typesafe_cb/typesafe_cb.h>
 
 #define ROUTING_MAX_HOPS 20
 
+/* Smaller graphs than this aren't worth searching in a child process. */
+#define ROUTING_ASYNC_MIN_NODES 1000
+
+/* Most extra routes getroute will look for. */
+#define ROUTING_MAX_ALTERNATIVES 10
+
+/* How many find_route results we remember. */
+#define ROUTE_CACHE_MAX 1024
+
+/* A failed connection's penalty halves every this many seconds. */
+#define ROUTE_PENALTY_HALFLIFE (10 * 60)
+
+/* These live by value in the dst node's in[] array, so any change to the
+ * graph can move them: don't keep pointers to them. */
 struct node_connection {
-	struct node *src, *dst;
+	/* Indices into rstate->by_index[]. */
+	u32 src, dst;
 	/* millisatoshi. */
 	u32 base_fee;
 	/* millionths */
@@ -16,55 +35,256 @@ struct node_connection {
 	u32 delay;
 	/* Minimum allowable HTLC expiry in blocks. */
 	u32 min_blocks;
+
+	/* Largest HTLC it can carry, or 0 if unknown.  For our own
+	 * channels we use the live balance instead. */
+	u64 capacity_msat;
+};
+
+/* A connection to add, for add_connections. */
+struct route_edge {
+	struct pubkey src, dst;
+	u32 base_fee;
+	s32 proportional_fee;
+	u32 delay, min_blocks;
+	u64 capacity_msat;
 };
 
 struct node {
 	struct pubkey id;
-	/* Routes connecting to us, from us. */
-	struct node_connection **in, **out;
-
-	/* Temporary data for routefinding. */
-	struct {
-		/* Total to get to here from target. */
-		s64 total;
-		/* Total risk premium of this route. */
-		u64 risk;
-		/* Where that came from. */
-		struct node_connection *prev;
-	} bfg[ROUTING_MAX_HOPS+1];
+	/* Our index in rstate->by_index[]. */
+	u32 index;
+	/* Routes connecting to us (tal array). */
+	struct node_connection *in;
+};
+
+/* A connection which failed our payments recently. */
+struct route_penalty {
+	/* Indices into rstate->by_index[]. */
+	u32 src, dst;
+	u32 failures;
+	/* Decaying count of failures, in 1/1024ths, as of @when. */
+	u64 score;
+	struct timeabs when;
 };
 
+struct routing_state {
+	/* All known nodes, by id. */
+	struct node_map *nodes;
+	/* The same nodes, densely numbered (tal array).  Never shrinks. */
+	struct node **by_index;
+
+	/* Routes we've found, keyed by destination, amount and risk. */
+	struct route_cache *route_cache;
+	/* Least recently used first. */
+	struct list_head route_lru;
+	size_t num_cached_routes;
+	u64 route_cache_hits, route_cache_misses;
+
+	/* Connections which failed us, by src and dst. */
+	struct penalty_map *penalties;
+	size_t num_penalties;
+
+	/* Increments whenever a cached route could become wrong. */
+	u64 generation;
+
+	/* Non-NULL while a traced search runs: searches add to it. */
+	struct route_trace *trace;
+};
+
+/* Why a search didn't follow a connection. */
+enum route_prune {
+	/* It led somewhere already reached as cheaply, in as few hops. */
+	ROUTE_PRUNE_NO_BETTER,
+	/* From somewhere not reached yet, or the total would overflow. */
+	ROUTE_PRUNE_UNREACHED,
+	/* Excluded, or used by an earlier alternative. */
+	ROUTE_PRUNE_EXCLUDED,
+	ROUTE_PRUNE_CAPACITY,
+	ROUTE_PRUNE_MAX_FEE,
+	ROUTE_PRUNE_MAX_DELAY,
+	ROUTE_PRUNE_MAX_HOPS,
+	ROUTE_PRUNE_NUM
+};
+
+enum route_phase {
+	/* Allocating and clearing per-node state. */
+	ROUTE_PHASE_SETUP,
+	ROUTE_PHASE_SEARCH,
+	/* Walking back to make the route. */
+	ROUTE_PHASE_BUILD,
+	ROUTE_PHASE_NUM
+};
+
+/* What searches cost, for getroute's trace.  BFG visits each node and
+ * tries each connection once per hop count, every run; Dijkstra visits a
+ * node when it settles it, and tries the connections into it. */
+struct route_trace {
+	u32 searches, cache_hits;
+	u64 nodes_visited, edges_visited;
+	/* Tries which made a cheaper path somewhere. */
+	u64 relaxations;
+	u64 pruned[ROUTE_PRUNE_NUM];
+	u64 phase_usec[ROUTE_PHASE_NUM];
+};
+
+/* Which search find_route uses. */
+enum route_engine {
+	/* Priority queue search, stops once it reaches us. */
+	ROUTE_ENGINE_DIJKSTRA,
+	/* Bellman-Ford-Gibson: always ROUTING_MAX_HOPS passes over graph. */
+	ROUTE_ENGINE_BFG
+};
+
+struct json_result;
 struct lightningd_state;
 
+struct routing_state *new_routing_state(struct lightningd_state *dstate);
+
 struct node *new_node(struct lightningd_state *dstate,
 		      const struct pubkey *id);
 
 struct node *get_node(struct lightningd_state *dstate,
 		      const struct pubkey *id);
 
+static inline struct node *node_by_index(const struct routing_state *rstate,
+					 u32 index)
+{
+	return rstate->by_index[index];
+}
+
 /* msatoshi must be possible (< 21 million BTC), ie < 2^60.
  * If it returns more than msatoshi, it overflowed. */
 s64 connection_fee(const struct node_connection *c, u64 msatoshi);
 
 /* Updates existing connection, or creates new one as required. */
-struct node_connection *add_connection(struct lightningd_state *dstate,
-				       const struct pubkey *from,
-				       const struct pubkey *to,
-				       u32 base_fee, s32 proportional_fee,
-				       u32 delay, u32 min_blocks);
+void add_connection(struct lightningd_state *dstate,
+		    const struct pubkey *from,
+		    const struct pubkey *to,
+		    u32 base_fee, s32 proportional_fee,
+		    u32 delay, u32 min_blocks, u64 capacity_msat);
+
+/* The same for many at once, but cached routes are only invalidated once:
+ * returns how many were new or changed. */
+size_t add_connections(struct lightningd_state *dstate,
+		       const struct route_edge *edges, size_t num);
+
+/* Returns NULL if none; only valid until the graph next changes. */
+const struct node_connection *get_connection(struct lightningd_state *dstate,
+					     const struct pubkey *from,
+					     const struct pubkey *to);
 
 void remove_connection(struct lightningd_state *dstate,
 		       const struct pubkey *src, const struct pubkey *dst);
 
+/* A payment failed at src->dst: avoid it for a while. */
+void connection_failed(struct lightningd_state *dstate,
+		       const struct pubkey *src, const struct pubkey *dst);
+
+/* Our round trip to peer @id changed (its edge from us scores by it):
+ * forget cached routes that change could make wrong. */
+void first_hop_rtt_changed(struct lightningd_state *dstate,
+			   const struct pubkey *id, u32 old_usec, u32 new_usec);
+
+/* On success, *route is a tal array of connections (by value) after the
+ * first hop, ending at @to. */
 struct peer *find_route(struct lightningd_state *dstate,
 			const struct pubkey *to,
 			u64 msatoshi,
 			double riskfactor,
 			s64 *fee,
-			struct node_connection ***route);
+			struct node_connection **route);
 
-struct node_map *empty_node_map(struct lightningd_state *dstate);
+struct alt_route {
+	/* As find_route returns. */
+	struct peer *peer;
+	s64 fee;
+	struct node_connection *route;
+};
+
+/* What a route may cost us: search skips paths which go over, rather
+ * than finding the best and rejecting it. */
+struct route_limits {
+	/* Total fee (msatoshi) and delay (blocks) of the whole route. */
+	u64 max_fee;
+	u32 max_delay;
+	/* Connections, including ours to the first peer. */
+	u32 max_hops;
+	/* Nodes not to route through (tal array, or NULL). */
+	const struct pubkey *exclude;
+};
+
+/* No limits (so limit only the fields you want). */
+void route_limits_init(struct route_limits *limits);
+
+/* Up to @num routes (tal array) as find_route would return, best first.
+ * Each shares no connection with any before it; if @node_disjoint, no
+ * intermediate node either.  With @limits (which may be NULL), routes
+ * aren't cached, and are always found as ROUTE_ENGINE_DIJKSTRA does. */
+struct alt_route *find_alt_routes(struct lightningd_state *dstate,
+				  const tal_t *ctx,
+				  const struct pubkey *to,
+				  u64 msatoshi,
+				  double riskfactor,
+				  size_t num,
+				  bool node_disjoint,
+				  const struct route_limits *limits);
+
+/* A route (as find_route would return) out through peer @out and back in
+ * from peer @in, ending at us: for moving our funds from one channel to
+ * another.  Returns the peer for @out, or NULL.  @limits may be NULL; the
+ * route isn't cached. */
+struct peer *find_circular_route(struct lightningd_state *dstate,
+				 const struct pubkey *out,
+				 const struct pubkey *in,
+				 u64 msatoshi,
+				 double riskfactor,
+				 const struct route_limits *limits,
+				 s64 *fee,
+				 struct node_connection **route);
+
+/* A route (as find_route would return) to each of @num destinations @to,
+ * from one search out from us: peer is NULL where there's none.  For
+ * many destinations, this is far cheaper than a find_route each, but
+ * the routes aren't cached, and may cost a little more. */
+struct alt_route *find_routes_many(struct lightningd_state *dstate,
+				   const tal_t *ctx,
+				   const struct pubkey *to, size_t num,
+				   u64 msatoshi, double riskfactor);
+
+/* Same, but calls @cb with the routes when done: for big graphs, we search
+ * in a child process on its copy of the graph, so we don't block.  The
+ * routes are freed after @cb returns.  If @trace isn't NULL, what the
+ * search cost is added to it before @cb is called. */
+void find_alt_routes_async_(struct lightningd_state *dstate,
+			    const struct pubkey *to,
+			    u64 msatoshi,
+			    double riskfactor,
+			    size_t num,
+			    bool node_disjoint,
+			    const struct route_limits *limits,
+			    struct route_trace *trace,
+			    void (*cb)(const struct alt_route *routes,
+				       void *arg),
+			    void *arg);
+
+#define find_alt_routes_async(dstate, to, msatoshi, riskfactor, num,	\
+			      node_disjoint, limits, trace, cb, arg)	\
+	find_alt_routes_async_((dstate), (to), (msatoshi), (riskfactor),\
+			       (num), (node_disjoint), (limits), (trace), \
+			       typesafe_cb_preargs(void, void *, (cb), (arg), \
+						   const struct alt_route *), \
+			       (arg))
+
+/* The trace as an object called @fieldname. */
+void json_add_route_trace(struct json_result *response, const char *fieldname,
+			  const struct route_trace *trace);
 
 char *opt_add_route(const char *arg, struct lightningd_state *dstate);
+char *opt_add_routes(const char *arg, struct lightningd_state *dstate);
+
+char *opt_set_route_engine(const char *arg, enum route_engine *engine);
+void opt_show_route_engine(char buf[OPT_SHOW_LEN],
+			   const enum route_engine *engine);
 
 #endif /* LIGHTNING_DAEMON_ROUTING_H */
@@ -0,0 +1,320 @@
+#include "lightningd.h"
+#include "log.h"
+#include "routing.h"
+#include "routing_snapshot.h"
+#include "timeout.h"
+#include <ccan/endian/endian.h>
+#include <ccan/noerr/noerr.h>
+#include <ccan/read_write_all/read_write_all.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <secp256k1.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/* File is header, then connections, then node keys: all fixed size, so
+ * we can map it and use it in place. */
+#define SNAPSHOT_MAGIC "LNROUTES"
+#define SNAPSHOT_VERSION 2
+
+/* Uncompressed: parsing compressed keys means a sqrt per node. */
+#define SNAPSHOT_KEY_LEN 65
+
+/* How often we look for a new --route-snapshot-follow file. */
+#define SNAPSHOT_FOLLOW_SECS 30
+
+struct snapshot_hdr {
+	char magic[8];
+	le32 version;
+	le32 num_nodes;
+	le32 num_connections;
+	le32 unused;
+};
+
+struct snapshot_connection {
+	/* Indices into the node keys. */
+	le32 src, dst;
+	le32 base_fee;
+	le32 proportional_fee;
+	le32 delay;
+	le32 min_blocks;
+	le64 capacity_msat;
+};
+
+static size_t snapshot_size(u32 num_nodes, u32 num_connections)
+{
+	return sizeof(struct snapshot_hdr)
+		+ (size_t)num_connections * sizeof(struct snapshot_connection)
+		+ (size_t)num_nodes * SNAPSHOT_KEY_LEN;
+}
+
+/* Our own connections return as peers do: they'd be stale from here. */
+static bool snapshot_wanted(const struct node_connection *c, u32 us)
+{
+	return c->src != us;
+}
+
+bool save_routing_snapshot(struct lightningd_state *dstate)
+{
+	const struct routing_state *rstate = dstate->rstate;
+	u32 us = get_node(dstate, &dstate->id)->index;
+	u32 i, j, num_nodes = tal_count(rstate->by_index), num_conns = 0;
+	struct snapshot_hdr *hdr;
+	struct snapshot_connection *sc;
+	u8 *buf, *keys;
+	size_t len;
+	int fd;
+	bool ok;
+
+	for (i = 0; i < num_nodes; i++) {
+		const struct node *n = node_by_index(rstate, i);
+		for (j = 0; j < tal_count(n->in); j++)
+			num_conns += snapshot_wanted(&n->in[j], us);
+	}
+
+	len = snapshot_size(num_nodes, num_conns);
+	buf = tal_arrz(dstate, u8, len);
+	hdr = (struct snapshot_hdr *)buf;
+	memcpy(hdr->magic, SNAPSHOT_MAGIC, sizeof(hdr->magic));
+	hdr->version = cpu_to_le32(SNAPSHOT_VERSION);
+	hdr->num_nodes = cpu_to_le32(num_nodes);
+	hdr->num_connections = cpu_to_le32(num_conns);
+
+	sc = (struct snapshot_connection *)(hdr + 1);
+	for (i = 0; i < num_nodes; i++) {
+		const struct node *n = node_by_index(rstate, i);
+		for (j = 0; j < tal_count(n->in); j++) {
+			const struct node_connection *c = &n->in[j];
+			if (!snapshot_wanted(c, us))
+				continue;
+			sc->src = cpu_to_le32(c->src);
+			sc->dst = cpu_to_le32(c->dst);
+			sc->base_fee = cpu_to_le32(c->base_fee);
+			sc->proportional_fee = cpu_to_le32(c->proportional_fee);
+			sc->delay = cpu_to_le32(c->delay);
+			sc->min_blocks = cpu_to_le32(c->min_blocks);
+			sc->capacity_msat = cpu_to_le64(c->capacity_msat);
+			sc++;
+		}
+	}
+
+	keys = (u8 *)sc;
+	for (i = 0; i < num_nodes; i++) {
+		size_t keylen = SNAPSHOT_KEY_LEN;
+		secp256k1_ec_pubkey_serialize(dstate->secpctx,
+					      keys + i * SNAPSHOT_KEY_LEN,
+					      &keylen,
+					      &node_by_index(rstate, i)->id.pubkey,
+					      SECP256K1_EC_UNCOMPRESSED);
+	}
+
+	/* Write then rename, so a crash never leaves half a snapshot. */
+	fd = open(ROUTING_SNAPSHOT_FILE ".tmp", O_CREAT|O_TRUNC|O_WRONLY, 0600);
+	if (fd < 0) {
+		log_broken(dstate->base_log, "Creating %s.tmp: %s",
+			   ROUTING_SNAPSHOT_FILE, strerror(errno));
+		tal_free(buf);
+		return false;
+	}
+	ok = write_all(fd, buf, len);
+	if (!ok)
+		log_broken(dstate->base_log, "Writing %s.tmp: %s",
+			   ROUTING_SNAPSHOT_FILE, strerror(errno));
+	close_noerr(fd);
+	tal_free(buf);
+
+	if (ok && rename(ROUTING_SNAPSHOT_FILE ".tmp",
+			 ROUTING_SNAPSHOT_FILE) != 0) {
+		log_broken(dstate->base_log, "Renaming %s.tmp: %s",
+			   ROUTING_SNAPSHOT_FILE, strerror(errno));
+		ok = false;
+	}
+	if (!ok) {
+		unlink_noerr(ROUTING_SNAPSHOT_FILE ".tmp");
+		return false;
+	}
+
+	log_debug(dstate->base_log, "Saved %u nodes, %u connections to %s",
+		  num_nodes, num_conns, ROUTING_SNAPSHOT_FILE);
+	return true;
+}
+
+static const char *use_snapshot(struct lightningd_state *dstate,
+				const char *file, const u8 *map, size_t len)
+{
+	const struct snapshot_hdr *hdr = (const struct snapshot_hdr *)map;
+	const struct snapshot_connection *sc;
+	const u8 *keys;
+	struct pubkey *ids;
+	struct route_edge *edges;
+	u32 i, n, num_nodes, num_conns;
+
+	if (len < sizeof(*hdr))
+		return "truncated header";
+	if (memcmp(hdr->magic, SNAPSHOT_MAGIC, sizeof(hdr->magic)) != 0)
+		return "bad magic";
+	if (le32_to_cpu(hdr->version) != SNAPSHOT_VERSION)
+		return "unknown version";
+
+	num_nodes = le32_to_cpu(hdr->num_nodes);
+	num_conns = le32_to_cpu(hdr->num_connections);
+	if (len != snapshot_size(num_nodes, num_conns))
+		return "wrong length";
+
+	sc = (const struct snapshot_connection *)(hdr + 1);
+	for (i = 0; i < num_conns; i++) {
+		if (le32_to_cpu(sc[i].src) >= num_nodes
+		    || le32_to_cpu(sc[i].dst) >= num_nodes
+		    || sc[i].src == sc[i].dst)
+			return "bad connection";
+	}
+
+	/* Check everything before we touch the graph. */
+	keys = (const u8 *)(sc + num_conns);
+	ids = tal_arr(dstate, struct pubkey, num_nodes);
+	for (i = 0; i < num_nodes; i++) {
+		if (!secp256k1_ec_pubkey_parse(dstate->secpctx,
+					       &ids[i].pubkey,
+					       keys + i * SNAPSHOT_KEY_LEN,
+					       SNAPSHOT_KEY_LEN)) {
+			tal_free(ids);
+			return "bad node key";
+		}
+	}
+
+	for (i = 0; i < num_nodes; i++) {
+		if (!get_node(dstate, &ids[i]))
+			new_node(dstate, &ids[i]);
+	}
+
+	edges = tal_arr(ids, struct route_edge, num_conns);
+	for (i = n = 0; i < num_conns; i++) {
+		const struct pubkey *src = &ids[le32_to_cpu(sc[i].src)];
+		if (pubkey_eq(src, &dstate->id))
+			continue;
+		edges[n].src = *src;
+		edges[n].dst = ids[le32_to_cpu(sc[i].dst)];
+		edges[n].base_fee = le32_to_cpu(sc[i].base_fee);
+		edges[n].proportional_fee = le32_to_cpu(sc[i].proportional_fee);
+		edges[n].delay = le32_to_cpu(sc[i].delay);
+		edges[n].min_blocks = le32_to_cpu(sc[i].min_blocks);
+		edges[n].capacity_msat = le64_to_cpu(sc[i].capacity_msat);
+		n++;
+	}
+	add_connections(dstate, edges, n);
+	tal_free(ids);
+
+	log_info(dstate->base_log, "Loaded %u nodes, %u connections from %s",
+		 num_nodes, num_conns, file);
+	return NULL;
+}
+
+/* Returns false if there's nothing there (or it's unreadable). */
+static bool load_routing_snapshot(struct lightningd_state *dstate,
+				  const char *file, struct stat *st)
+{
+	const char *problem;
+	void *map;
+	int fd;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			log_unusual(dstate->base_log, "Opening %s: %s",
+				    file, strerror(errno));
+		return false;
+	}
+
+	if (fstat(fd, st) != 0) {
+		log_unusual(dstate->base_log, "Checking %s: %s",
+			    file, strerror(errno));
+		close(fd);
+		return false;
+	}
+
+	if (st->st_size == 0)
+		problem = "empty";
+	else {
+		map = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED)
+			problem = strerror(errno);
+		else {
+			problem = use_snapshot(dstate, file, map, st->st_size);
+			munmap(map, st->st_size);
+		}
+	}
+	close(fd);
+
+	/* It's only a cache: we'll relearn it all anyway. */
+	if (problem)
+		log_unusual(dstate->base_log, "Ignoring %s: %s",
+			    file, problem);
+	return true;
+}
+
+/* Another node's snapshot, which we pick up each time it's rewritten. */
+struct snapshot_follow {
+	struct lightningd_state *dstate;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	time_t mtime;
+};
+
+static bool follow_changed(const struct snapshot_follow *f,
+			   const struct stat *st)
+{
+	/* It's always renamed into place, so a new one is a new inode. */
+	return st->st_dev != f->dev || st->st_ino != f->ino
+		|| st->st_size != f->size || st->st_mtime != f->mtime;
+}
+
+static void follow_timer(struct snapshot_follow *f)
+{
+	struct lightningd_state *dstate = f->dstate;
+	const char *file = dstate->config.route_snapshot_follow;
+	struct stat st;
+
+	if (stat(file, &st) == 0 && follow_changed(f, &st)
+	    && load_routing_snapshot(dstate, file, &st)) {
+		f->dev = st.st_dev;
+		f->ino = st.st_ino;
+		f->size = st.st_size;
+		f->mtime = st.st_mtime;
+	}
+	new_reltimer(dstate, f, time_from_sec(SNAPSHOT_FOLLOW_SECS),
+		     follow_timer, f);
+}
+
+static void snapshot_timer(struct lightningd_state *dstate)
+{
+	save_routing_snapshot(dstate);
+	new_reltimer(dstate, dstate, dstate->config.route_snapshot_time,
+		     snapshot_timer, dstate);
+}
+
+void routing_snapshot_init(struct lightningd_state *dstate)
+{
+	struct stat st;
+
+	load_routing_snapshot(dstate, ROUTING_SNAPSHOT_FILE, &st);
+
+	if (dstate->config.route_snapshot_follow) {
+		struct snapshot_follow *f = tal(dstate, struct snapshot_follow);
+		f->dstate = dstate;
+		f->dev = 0;
+		f->ino = 0;
+		f->size = 0;
+		f->mtime = 0;
+		follow_timer(f);
+	}
+
+	/* Zero means never. */
+	if (time_to_nsec(dstate->config.route_snapshot_time))
+		new_reltimer(dstate, dstate, dstate->config.route_snapshot_time,
+			     snapshot_timer, dstate);
+}
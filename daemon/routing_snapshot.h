@@ -0,0 +1,19 @@
+#ifndef LIGHTNING_DAEMON_ROUTING_SNAPSHOT_H
+#define LIGHTNING_DAEMON_ROUTING_SNAPSHOT_H
+/* Save the routing graph, so we can route straight away on restart. */
+#include "config.h"
+#include <stdbool.h>
+
+/* In the config dir. */
+#define ROUTING_SNAPSHOT_FILE "routing.snapshot"
+
+struct lightningd_state;
+
+/* Load any snapshot, then save every config.route_snapshot_time (and load
+ * config.route_snapshot_follow whenever it changes). */
+void routing_snapshot_init(struct lightningd_state *dstate);
+
+/* Write out now; false (and logs) if that failed. */
+bool save_routing_snapshot(struct lightningd_state *dstate);
+
+#endif /* LIGHTNING_DAEMON_ROUTING_SNAPSHOT_H */
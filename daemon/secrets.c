@@ -1,10 +1,12 @@
 #include "bitcoin/privkey.h"
 #include "bitcoin/shadouble.h"
 #include "bitcoin/signature.h"
+#include "bitcoin/tx.h"
 #include "lightningd.h"
 #include "log.h"
 #include "peer.h"
 #include "secrets.h"
+#include "sigpool.h"
 #include "utils.h"
 #include <ccan/crypto/sha256/sha256.h>
 #include <ccan/crypto/shachain/shachain.h>
@@ -16,6 +18,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <secp256k1.h>
+#include <secp256k1_ecdh.h>
 #include <sodium/randombytes.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -35,11 +38,29 @@ void privkey_sign(struct lightningd_state *dstate, const void *src, size_t len,
 	sign_hash(dstate->secpctx, &dstate->secret->privkey, &h, sig);
 }
 
+void privkey_ecdh(struct lightningd_state *dstate, const struct pubkey *point,
+		  struct sha256 *secret)
+{
+	/* Only fails if @point times our key is infinity, which it isn't. */
+	if (!secp256k1_ecdh(dstate->secpctx, secret->u.u8, &point->pubkey,
+			    dstate->secret->privkey.secret))
+		fatal("ECDH with our node key failed");
+}
+
+/* Around a commit we use N-1 to N+2 (see peer.c). */
+#define REVOCATION_CACHE_SIZE 4
+
 struct peer_secrets {
 	/* Two private keys, one for commit txs, one for final output. */
 	struct privkey commit, final;
 	/* Seed from which we generate revocation hashes. */
 	struct sha256 revocation_seed;
+	/* We want each one several times around a commit: keep the last few. */
+	struct revocation_cache {
+		bool valid;
+		u64 index;
+		struct sha256 preimage, hash;
+	} revcache[REVOCATION_CACHE_SIZE];
 };
 
 void peer_sign_theircommit(const struct peer *peer,
@@ -128,20 +149,51 @@ void peer_sign_mutual_close(const struct peer *peer,
 		      sig);
 }
 
-void peer_sign_steal_input(const struct peer *peer,
-			   struct bitcoin_tx *spend,
-			   size_t i,
-			   const u8 *witnessscript,
-			   struct signature *sig)
+void peer_sign_steal_inputs(const struct peer *peer,
+			    struct bitcoin_tx *spend,
+			    const u8 **witnessscripts,
+			    struct signature *sigs)
 {
-	/* Spend tx only has one input: that of the commit tx. */
-	sign_tx_input(peer->dstate->secpctx,
-		      spend, i,
-		      NULL, 0,
-		      witnessscript,
-		      &peer->secrets->final,
-		      &peer->local.finalkey,
-		      sig);
+	struct sig_job *jobs = tal_arr(peer, struct sig_job,
+				       spend->input_count);
+	struct sighash_cache cache;
+	size_t i;
+
+	/* One for every output of their commit tx: share them out. */
+	sighash_cache_init(&cache, spend);
+	for (i = 0; i < spend->input_count; i++) {
+		sha256_tx_for_sig_cached(&jobs[i].hash, spend, i, SIGHASH_ALL,
+					 witnessscripts[i], &cache);
+		jobs[i].privkey = &peer->secrets->final;
+		jobs[i].pubkey = &peer->local.finalkey;
+		jobs[i].sig = &sigs[i];
+	}
+	sigpool_run(peer->dstate, jobs, spend->input_count);
+	tal_free(jobs);
+}
+
+void peer_sign_sweep_inputs(struct lightningd_state *dstate,
+			    const struct peer **peers,
+			    struct bitcoin_tx *spend,
+			    const u8 **witnessscripts,
+			    struct signature *sigs)
+{
+	struct sig_job *jobs = tal_arr(dstate, struct sig_job,
+				       spend->input_count);
+	struct sighash_cache cache;
+	size_t i;
+
+	/* Each pays to its own peer's final key. */
+	sighash_cache_init(&cache, spend);
+	for (i = 0; i < spend->input_count; i++) {
+		sha256_tx_for_sig_cached(&jobs[i].hash, spend, i, SIGHASH_ALL,
+					 witnessscripts[i], &cache);
+		jobs[i].privkey = &peers[i]->secrets->final;
+		jobs[i].pubkey = &peers[i]->local.finalkey;
+		jobs[i].sig = &sigs[i];
+	}
+	sigpool_run(dstate, jobs, spend->input_count);
+	tal_free(jobs);
 }
 
 static void new_keypair(struct lightningd_state *dstate,
@@ -159,32 +211,49 @@ void peer_secrets_init(struct peer *peer)
 	new_keypair(peer->dstate, &peer->secrets->commit, &peer->local.commitkey);
 	new_keypair(peer->dstate, &peer->secrets->final, &peer->local.finalkey);
 	randombytes_buf(peer->secrets->revocation_seed.u.u8, sizeof(peer->secrets->revocation_seed.u.u8));
+	memset(peer->secrets->revcache, 0, sizeof(peer->secrets->revcache));
+}
+
+static const struct revocation_cache *revocation(const struct peer *peer,
+						 u64 index)
+{
+	struct revocation_cache *rc;
+
+	/* Slots go round with the index, so we only evict old ones. */
+	rc = &peer->secrets->revcache[index % REVOCATION_CACHE_SIZE];
+	if (rc->valid && rc->index == index)
+		return rc;
+
+	// generate hashes in reverse order, otherwise the first hash gives away everything
+	shachain_from_seed(&peer->secrets->revocation_seed, 0xFFFFFFFFFFFFFFFFL - index, &rc->preimage);
+	sha256(&rc->hash, rc->preimage.u.u8, sizeof(rc->preimage.u.u8));
+	rc->index = index;
+	rc->valid = true;
+	return rc;
 }
 
 void peer_get_revocation_preimage(const struct peer *peer, u64 index,
 				  struct sha256 *preimage)
 {
-	// generate hashes in reverse order, otherwise the first hash gives away everything
-	shachain_from_seed(&peer->secrets->revocation_seed, 0xFFFFFFFFFFFFFFFFL - index, preimage);
+	*preimage = revocation(peer, index)->preimage;
 }
 	
 void peer_get_revocation_hash(const struct peer *peer, u64 index,
 			      struct sha256 *rhash)
 {
-	struct sha256 preimage;
-
-	peer_get_revocation_preimage(peer, index, &preimage);
-	sha256(rhash, preimage.u.u8, sizeof(preimage.u.u8));
+	*rhash = revocation(peer, index)->hash;
 }
 
-const char *peer_secrets_for_db(const tal_t *ctx, struct peer *peer)
+void peer_secrets_for_db(const struct peer *peer,
+			 const struct privkey **commit_privkey,
+			 const struct privkey **final_privkey,
+			 const struct sha256 **revocation_seed)
 {
 	const struct peer_secrets *ps = peer->secrets;
-	return tal_fmt(ctx, "x'%s', x'%s', x'%s'",
-		       tal_hexstr(ctx, &ps->commit, sizeof(ps->commit)),
-		       tal_hexstr(ctx, &ps->final, sizeof(ps->final)),
-		       tal_hexstr(ctx, &ps->revocation_seed,
-				  sizeof(ps->revocation_seed)));
+
+	*commit_privkey = &ps->commit;
+	*final_privkey = &ps->final;
+	*revocation_seed = &ps->revocation_seed;
 }
 
 void peer_set_secrets_from_db(struct peer *peer,
@@ -210,6 +279,7 @@ void peer_set_secrets_from_db(struct peer *peer,
 	memcpy(&ps->commit, commit_privkey, commit_privkey_len);
 	memcpy(&ps->final, final_privkey, final_privkey_len);
 	memcpy(&ps->revocation_seed, revocation_seed, revocation_seed_len);
+	memset(ps->revcache, 0, sizeof(ps->revcache));
 
 	if (!pubkey_from_privkey(peer->dstate->secpctx, &ps->commit,
 				 &peer->local.commitkey))
@@ -221,11 +291,12 @@ void peer_set_secrets_from_db(struct peer *peer,
 
 void secrets_init(struct lightningd_state *dstate)
 {
+	char *privkey = node_file(dstate, dstate, "privkey");
 	int fd;
 
 	dstate->secret = tal(dstate, struct secret);
 
-	fd = open("privkey", O_RDONLY);
+	fd = open(privkey, O_RDONLY);
 	if (fd < 0) {
 		if (errno != ENOENT)
 			fatal("Failed to open privkey: %s", strerror(errno));
@@ -233,13 +304,13 @@ void secrets_init(struct lightningd_state *dstate)
 		log_unusual(dstate->base_log, "Creating privkey file");
 		new_keypair(dstate, &dstate->secret->privkey, &dstate->id);
 
-		fd = open("privkey", O_CREAT|O_EXCL|O_WRONLY, 0400);
+		fd = open(privkey, O_CREAT|O_EXCL|O_WRONLY, 0400);
 		if (fd < 0)
 		 	fatal("Failed to create privkey file: %s",
 			      strerror(errno));
 		if (!write_all(fd, dstate->secret->privkey.secret,
 			       sizeof(dstate->secret->privkey.secret))) {
-			unlink_noerr("privkey");
+			unlink_noerr(privkey);
 		 	fatal("Failed to write to privkey file: %s",
 			      strerror(errno));
 		}
@@ -248,7 +319,7 @@ void secrets_init(struct lightningd_state *dstate)
 			      strerror(errno));
 		close(fd);
 
-		fd = open("privkey", O_RDONLY);
+		fd = open(privkey, O_RDONLY);
 		if (fd < 0)
 			fatal("Failed to reopen privkey: %s", strerror(errno));
 	}
@@ -259,6 +330,7 @@ void secrets_init(struct lightningd_state *dstate)
 	if (!pubkey_from_privkey(dstate->secpctx,
 				 &dstate->secret->privkey, &dstate->id))
 		fatal("Invalid privkey");
+	tal_free(privkey);
 
 	log_info_struct(dstate->base_log, "ID: %s", struct pubkey, &dstate->id);
 }
@@ -6,12 +6,18 @@
 
 struct peer;
 struct lightningd_state;
+struct privkey;
+struct pubkey;
 struct signature;
 struct sha256;
 
 void privkey_sign(struct lightningd_state *dstate, const void *src, size_t len,
 		  struct signature *sig);
 
+/* Shared secret of our node key and @point (for onions). */
+void privkey_ecdh(struct lightningd_state *dstate, const struct pubkey *point,
+		  struct sha256 *secret);
+
 void peer_sign_theircommit(const struct peer *peer,
 			   struct bitcoin_tx *commit,
 			   struct signature *sig);
@@ -39,13 +45,23 @@ void peer_sign_mutual_close(const struct peer *peer,
 			    struct bitcoin_tx *close,
 			    struct signature *sig);
 
-void peer_sign_steal_input(const struct peer *peer,
-			   struct bitcoin_tx *spend,
-			   size_t i,
-			   const u8 *witnessscript,
-			   struct signature *sig);
+/* Signs every input, using witnessscripts[i] for input i (into sigs[i]). */
+void peer_sign_steal_inputs(const struct peer *peer,
+			    struct bitcoin_tx *spend,
+			    const u8 **witnessscripts,
+			    struct signature *sigs);
+
+/* Same, but input i spends an output to peers[i]'s final key. */
+void peer_sign_sweep_inputs(struct lightningd_state *dstate,
+			    const struct peer **peers,
+			    struct bitcoin_tx *spend,
+			    const u8 **witnessscripts,
+			    struct signature *sigs);
 
-const char *peer_secrets_for_db(const tal_t *ctx, struct peer *peer);
+void peer_secrets_for_db(const struct peer *peer,
+			 const struct privkey **commit_privkey,
+			 const struct privkey **final_privkey,
+			 const struct sha256 **revocation_seed);
 
 void peer_set_secrets_from_db(struct peer *peer,
 			      const void *commit_privkey,
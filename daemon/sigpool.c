@@ -0,0 +1,172 @@
+#include "lightningd.h"
+#include "log.h"
+#include "sigpool.h"
+#include <assert.h>
+#include <ccan/tal/tal.h>
+#include <errno.h>
+#include <pthread.h>
+#include <secp256k1.h>
+#include <string.h>
+
+struct sigpool {
+	secp256k1_context *secpctx;
+	pthread_t *threads;
+	size_t num_threads;
+
+	/* Everything below is under lock. */
+	pthread_mutex_t lock;
+	pthread_cond_t work, done;
+	struct sig_job *jobs;
+	size_t num, next, finished;
+	bool stop;
+};
+
+/* Each trip to the lock claims this many jobs, so it's not contended. */
+#define SIGPOOL_CHUNK 16
+
+/* Signs as it goes; checks are gathered up and done together. */
+static void do_chunk(secp256k1_context *secpctx,
+		     struct sig_job *jobs, size_t num)
+{
+	struct sig_check checks[SIGPOOL_CHUNK];
+	struct sig_job *checked[SIGPOOL_CHUNK];
+	size_t i, n = 0;
+
+	assert(num <= SIGPOOL_CHUNK);
+	for (i = 0; i < num; i++) {
+		if (jobs[i].privkey) {
+			sign_hash(secpctx, jobs[i].privkey, &jobs[i].hash,
+				  jobs[i].sig);
+			continue;
+		}
+		checks[n].hash = &jobs[i].hash;
+		checks[n].sig = jobs[i].sig;
+		checks[n].key = jobs[i].pubkey;
+		checked[n++] = &jobs[i];
+	}
+
+	check_signed_hashes(secpctx, checks, n);
+	for (i = 0; i < n; i++)
+		checked[i]->ok = checks[i].ok;
+}
+
+static void do_all(secp256k1_context *secpctx,
+		   struct sig_job *jobs, size_t num)
+{
+	size_t i, n;
+
+	for (i = 0; i < num; i += n) {
+		n = num - i < SIGPOOL_CHUNK ? num - i : SIGPOOL_CHUNK;
+		do_chunk(secpctx, jobs + i, n);
+	}
+}
+
+/* Called with lock held, returns with it held. */
+static void do_jobs(struct sigpool *pool)
+{
+	while (pool->next < pool->num) {
+		struct sig_job *jobs = &pool->jobs[pool->next];
+		/* Leave some for the others when there's not much. */
+		size_t n = (pool->num - pool->next)
+			/ (pool->num_threads + 1);
+
+		if (n == 0)
+			n = 1;
+		else if (n > SIGPOOL_CHUNK)
+			n = SIGPOOL_CHUNK;
+		pool->next += n;
+
+		pthread_mutex_unlock(&pool->lock);
+		do_chunk(pool->secpctx, jobs, n);
+		pthread_mutex_lock(&pool->lock);
+		pool->finished += n;
+		if (pool->finished == pool->num)
+			pthread_cond_signal(&pool->done);
+	}
+}
+
+/* Doesn't touch tal: that's not thread-safe. */
+static void *sig_worker(struct sigpool *pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	while (!pool->stop) {
+		do_jobs(pool);
+		pthread_cond_wait(&pool->work, &pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+static void stop_sigpool(struct sigpool *pool)
+{
+	size_t i;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = true;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+	for (i = 0; i < tal_count(pool->threads); i++)
+		pthread_join(pool->threads[i], NULL);
+}
+
+void sigpool_init(struct lightningd_state *dstate)
+{
+	struct sigpool *pool;
+	u32 i;
+
+	dstate->sigpool = NULL;
+	if (!dstate->config.sig_threads)
+		return;
+
+	pool = tal(dstate, struct sigpool);
+	/* Signing and checking only read it, so it can be shared. */
+	pool->secpctx = dstate->secpctx;
+	pool->threads = tal_arr(pool, pthread_t, 0);
+	pool->num_threads = dstate->config.sig_threads;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	pool->jobs = NULL;
+	pool->num = pool->next = pool->finished = 0;
+	pool->stop = false;
+
+	for (i = 0; i < dstate->config.sig_threads; i++) {
+		pthread_t t;
+		if (pthread_create(&t, NULL,
+				   (void *(*)(void *))sig_worker, pool) != 0)
+			fatal("signature thread: %s", strerror(errno));
+		tal_resize(&pool->threads, i+1);
+		pool->threads[i] = t;
+	}
+	tal_add_destructor(pool, stop_sigpool);
+	dstate->sigpool = pool;
+
+	log_debug(dstate->base_log, "Started %u signature threads",
+		  dstate->config.sig_threads);
+}
+
+void sigpool_run(struct lightningd_state *dstate,
+		 struct sig_job *jobs, size_t num)
+{
+	struct sigpool *pool = dstate->sigpool;
+
+	if (!pool || num < 2) {
+		do_all(dstate->secpctx, jobs, num);
+		return;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->jobs = jobs;
+	pool->num = num;
+	pool->next = pool->finished = 0;
+	pthread_cond_broadcast(&pool->work);
+
+	/* We help too, rather than sitting idle. */
+	do_jobs(pool);
+	while (pool->finished != pool->num)
+		pthread_cond_wait(&pool->done, &pool->lock);
+
+	pool->jobs = NULL;
+	pool->num = pool->next = pool->finished = 0;
+	pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,31 @@
+#ifndef LIGHTNING_DAEMON_SIGPOOL_H
+#define LIGHTNING_DAEMON_SIGPOOL_H
+/* Threads to share out signing and checking of many signatures at once. */
+#include "config.h"
+#include "bitcoin/privkey.h"
+#include "bitcoin/pubkey.h"
+#include "bitcoin/shadouble.h"
+#include "bitcoin/signature.h"
+#include <stdbool.h>
+
+struct lightningd_state;
+
+/* Hashes are done beforehand: that touches the tx, so we can't share it. */
+struct sig_job {
+	struct sha256_double hash;
+	/* If privkey, sign into *sig, otherwise check *sig against pubkey. */
+	const struct privkey *privkey;
+	const struct pubkey *pubkey;
+	struct signature *sig;
+	/* Set for checks. */
+	bool ok;
+};
+
+/* Starts config.sig_threads threads (if any). */
+void sigpool_init(struct lightningd_state *dstate);
+
+/* Does all the jobs, returning when they're done.  Without threads, or
+ * with only one job, we simply do them ourselves. */
+void sigpool_run(struct lightningd_state *dstate,
+		 struct sig_job *jobs, size_t num);
+#endif /* LIGHTNING_DAEMON_SIGPOOL_H */
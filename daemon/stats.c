@@ -0,0 +1,319 @@
+#include "controlled_time.h"
+#include "htlc.h"
+#include "jsonrpc.h"
+#include "lightningd.h"
+#include "log.h"
+#include "names.h"
+#include "peer.h"
+#include "stats.h"
+#include <ccan/array_size/array_size.h>
+#include <ccan/ilog/ilog.h>
+#include <ccan/io/io.h>
+#include <ccan/strmap/strmap.h>
+#include <ccan/tal/tal.h>
+#include <inttypes.h>
+#include <string.h>
+
+/* Bucket i counts times under 2^i usec: the last catches everything. */
+#define STATS_BUCKETS 32
+
+struct histogram {
+	u64 count, total_usec, max_usec;
+	u64 bucket[STATS_BUCKETS];
+	/* Moving average: each new time counts for 1/8. */
+	u64 recent_usec;
+};
+
+/* Pkt__PktCase values are all below this. */
+#define STATS_PKT_MAX 64
+
+struct histogram_map {
+	STRMAP(struct histogram *) map;
+};
+
+/* From creation until it's irrevocably committed, and until it's
+ * resolved (fulfilled or failed), and how long it sat in each state. */
+struct htlc_stats {
+	struct histogram committed, resolved;
+	struct histogram state[HTLC_STATE_INVALID];
+};
+
+struct stats {
+	u64 pkt_in[STATS_PKT_MAX], pkt_out[STATS_PKT_MAX];
+	struct histogram latency[STATS_NUM_LATENCY];
+	/* By bitcoind method, and by our own JSON command. */
+	struct histogram_map bitcoind, rpc;
+	struct htlc_stats htlc;
+};
+
+static const char *latency_names[] = {
+	[STATS_COMMIT_RTT] = "commit_rtt",
+	[STATS_DB_COMMIT] = "db_commit",
+	[STATS_ROUTE_SEARCH] = "route_search",
+	[STATS_IO_CALLBACK] = "io_callback",
+	[STATS_TIMER_CALLBACK] = "timer_callback"
+};
+
+static void io_callback_done(void *dstate, const void *cb, const void *arg,
+			     struct timerel took)
+{
+	stats_callback(dstate, STATS_IO_CALLBACK, cb, arg, took);
+}
+
+static void destroy_stats(struct stats *s)
+{
+	strmap_clear(&s->bitcoind.map);
+	strmap_clear(&s->rpc.map);
+}
+
+void stats_init(struct lightningd_state *dstate)
+{
+	struct stats *s = tal(dstate, struct stats);
+
+	memset(s->pkt_in, 0, sizeof(s->pkt_in));
+	memset(s->pkt_out, 0, sizeof(s->pkt_out));
+	memset(s->latency, 0, sizeof(s->latency));
+	memset(&s->htlc, 0, sizeof(s->htlc));
+	strmap_init(&s->bitcoind.map);
+	strmap_init(&s->rpc.map);
+	tal_add_destructor(s, destroy_stats);
+	dstate->stats = s;
+	io_set_monitor(io_callback_done, dstate);
+}
+
+void stats_pkt_in(struct lightningd_state *dstate, Pkt__PktCase type)
+{
+	if (type < STATS_PKT_MAX)
+		dstate->stats->pkt_in[type]++;
+}
+
+void stats_pkt_out(struct lightningd_state *dstate, Pkt__PktCase type)
+{
+	if (type < STATS_PKT_MAX)
+		dstate->stats->pkt_out[type]++;
+}
+
+static void record_usec(struct histogram *h, u64 usec)
+{
+	size_t b = ilog64(usec);
+
+	if (b >= STATS_BUCKETS)
+		b = STATS_BUCKETS - 1;
+	h->count++;
+	h->total_usec += usec;
+	if (usec > h->max_usec)
+		h->max_usec = usec;
+	h->bucket[b]++;
+	if (h->count == 1)
+		h->recent_usec = usec;
+	else
+		h->recent_usec = h->recent_usec - h->recent_usec / 8 + usec / 8;
+}
+
+static void record(struct histogram *h, struct timeabs start)
+{
+	record_usec(h, time_to_usec(time_between(time_now(), start)));
+}
+
+void stats_latency(struct lightningd_state *dstate,
+		   enum stats_latency which, struct timeabs start)
+{
+	record(&dstate->stats->latency[which], start);
+}
+
+u64 stats_recent_usec(const struct lightningd_state *dstate,
+		      enum stats_latency which)
+{
+	return dstate->stats->latency[which].recent_usec;
+}
+
+void stats_callback(struct lightningd_state *dstate,
+		    enum stats_latency which,
+		    const void *cb, const void *arg, struct timerel took)
+{
+	const struct peer *p;
+	const char *who = "";
+
+	record_usec(&dstate->stats->latency[which], time_to_usec(took));
+
+	if (!time_to_nsec(dstate->config.stall_warn)
+	    || time_less(took, dstate->config.stall_warn))
+		return;
+
+	/* arg may be gone, but if it was a peer it still is: we only free
+	 * them outside callbacks (see cleanup_peers). */
+	list_for_each(&dstate->peers, p, list) {
+		if (p == arg) {
+			who = log_prefix(p->log);
+			break;
+		}
+	}
+	log_unusual(dstate->base_log,
+		    "Loop stalled %"PRIu64"ms in %s %p(%p) %s",
+		    time_to_msec(took),
+		    which == STATS_IO_CALLBACK ? "io callback" : "timer",
+		    cb, arg, who);
+}
+
+static struct histogram *named(struct stats *s, struct histogram_map *m,
+			       const char *name)
+{
+	struct histogram *h = strmap_get(&m->map, name);
+
+	if (!h) {
+		h = talz(s, struct histogram);
+		strmap_add(&m->map, name, h);
+	}
+	return h;
+}
+
+void stats_bitcoind(struct lightningd_state *dstate,
+		    const char *method, struct timeabs start)
+{
+	struct stats *s = dstate->stats;
+
+	record(named(s, &s->bitcoind, method), start);
+}
+
+void stats_rpc(struct lightningd_state *dstate,
+	       const char *command, struct timeabs start)
+{
+	struct stats *s = dstate->stats;
+
+	record(named(s, &s->rpc, command), start);
+}
+
+struct htlc_stats *new_htlc_stats(const tal_t *ctx)
+{
+	return talz(ctx, struct htlc_stats);
+}
+
+static void record_htlc(struct htlc_stats *hs, const struct htlc *h,
+			enum htlc_state oldstate, u64 in_state, u64 age)
+{
+	record_usec(&hs->state[oldstate], in_state);
+	if (h->state == SENT_ADD_ACK_REVOCATION
+	    || h->state == RCVD_ADD_ACK_REVOCATION)
+		record_usec(&hs->committed, age);
+	else if (h->state == RCVD_REMOVE_ACK_REVOCATION
+		 || h->state == SENT_REMOVE_ACK_REVOCATION)
+		record_usec(&hs->resolved, age);
+}
+
+void stats_htlc_state(struct htlc *h, enum htlc_state oldstate)
+{
+	struct timeabs now = controlled_time();
+	u64 in_state = time_to_usec(time_between(now, h->changed));
+	u64 age = time_to_usec(time_between(now, h->created));
+
+	record_htlc(&h->peer->dstate->stats->htlc, h, oldstate, in_state, age);
+	record_htlc(h->peer->htlc_stats, h, oldstate, in_state, age);
+	h->changed = now;
+}
+
+/* The top of the bucket which the nth-percentile time falls in. */
+static u64 percentile(const struct histogram *h, unsigned int pc)
+{
+	u64 want = (h->count * pc + 99) / 100, seen = 0;
+	size_t i;
+
+	for (i = 0; i < STATS_BUCKETS - 1; i++) {
+		seen += h->bucket[i];
+		if (seen >= want)
+			break;
+	}
+	if (i == STATS_BUCKETS - 1)
+		return h->max_usec;
+	/* Never claim more than the worst we've seen. */
+	return (1ULL << i) < h->max_usec ? (1ULL << i) : h->max_usec;
+}
+
+static void json_add_histogram(struct json_result *response,
+			       const char *name, const struct histogram *h)
+{
+	json_object_start(response, name);
+	json_add_u64(response, "count", h->count);
+	if (h->count) {
+		json_add_u64(response, "avg_usec", h->total_usec / h->count);
+		json_add_u64(response, "p50_usec", percentile(h, 50));
+		json_add_u64(response, "p90_usec", percentile(h, 90));
+		json_add_u64(response, "p99_usec", percentile(h, 99));
+		json_add_u64(response, "max_usec", h->max_usec);
+		json_add_u64(response, "recent_usec", h->recent_usec);
+	}
+	json_object_end(response);
+}
+
+void json_add_htlc_stats(struct json_result *response, const char *name,
+			 const struct htlc_stats *hs)
+{
+	size_t i, worst = HTLC_STATE_INVALID;
+
+	json_object_start(response, name);
+	json_add_histogram(response, "committed", &hs->committed);
+	json_add_histogram(response, "resolved", &hs->resolved);
+	json_object_start(response, "states");
+	for (i = 0; i < HTLC_STATE_INVALID; i++) {
+		if (!hs->state[i].count)
+			continue;
+		json_add_histogram(response, htlc_state_name(i),
+				   &hs->state[i]);
+		if (worst == HTLC_STATE_INVALID
+		    || hs->state[i].total_usec > hs->state[worst].total_usec)
+			worst = i;
+	}
+	json_object_end(response);
+	if (worst != HTLC_STATE_INVALID)
+		json_add_string(response, "most_time_in",
+				htlc_state_name(worst));
+	json_object_end(response);
+}
+
+static bool add_named(const char *name, struct histogram *h,
+		      struct json_result *response)
+{
+	json_add_histogram(response, name, h);
+	return true;
+}
+
+static void json_add_pkts(struct json_result *response,
+			  const char *name, const u64 *counts)
+{
+	size_t i;
+
+	json_object_start(response, name);
+	for (i = 0; i < STATS_PKT_MAX; i++)
+		if (counts[i])
+			json_add_u64(response, pkt_name(i), counts[i]);
+	json_object_end(response);
+}
+
+static void json_getstats(struct command *cmd,
+			  const char *buffer, const jsmntok_t *params)
+{
+	struct stats *s = cmd->dstate->stats;
+	struct json_result *response = new_json_result(cmd);
+	size_t i;
+
+	json_object_start(response, NULL);
+	json_add_pkts(response, "pkt_in", s->pkt_in);
+	json_add_pkts(response, "pkt_out", s->pkt_out);
+	for (i = 0; i < ARRAY_SIZE(s->latency); i++)
+		json_add_histogram(response, latency_names[i], &s->latency[i]);
+	json_object_start(response, "bitcoind");
+	strmap_iterate(&s->bitcoind.map, add_named, response);
+	json_object_end(response);
+	json_object_start(response, "rpc");
+	strmap_iterate(&s->rpc.map, add_named, response);
+	json_object_end(response);
+	json_add_htlc_stats(response, "htlc", &s->htlc);
+	json_object_end(response);
+	command_success(cmd, response);
+}
+
+const struct json_command getstats_command = {
+	"getstats",
+	json_getstats,
+	"Show packet counts and latencies",
+	"Returns {pkt_in} and {pkt_out} counts by type, and {count}, {avg_usec}, {p50_usec}, {p90_usec}, {p99_usec} and {max_usec} for {commit_rtt}, {db_commit}, {route_search}, and each {bitcoind} method and {rpc} command; {htlc} has HTLC times to {committed} and {resolved}, per state in {states}, and the state they spend {most_time_in}"
+};
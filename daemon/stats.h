@@ -0,0 +1,56 @@
+#ifndef LIGHTNING_DAEMON_STATS_H
+#define LIGHTNING_DAEMON_STATS_H
+/* Counters and latency histograms for getstats: cheap enough to leave on. */
+#include "config.h"
+#include "htlc_state.h"
+#include "lightning.pb-c.h"
+#include <ccan/tal/tal.h>
+#include <ccan/time/time.h>
+
+struct htlc;
+struct htlc_stats;
+struct json_result;
+struct lightningd_state;
+
+enum stats_latency {
+	/* From sending a commit until their revocation arrives. */
+	STATS_COMMIT_RTT,
+	/* A database transaction reaching the disk. */
+	STATS_DB_COMMIT,
+	/* Searching for a route the cache didn't have. */
+	STATS_ROUTE_SEARCH,
+	/* Each callback from the loop: everyone else waits for these. */
+	STATS_IO_CALLBACK,
+	STATS_TIMER_CALLBACK,
+	STATS_NUM_LATENCY
+};
+
+void stats_init(struct lightningd_state *dstate);
+
+void stats_pkt_in(struct lightningd_state *dstate, Pkt__PktCase type);
+void stats_pkt_out(struct lightningd_state *dstate, Pkt__PktCase type);
+
+/* Each records the time since @start. */
+void stats_latency(struct lightningd_state *dstate,
+		   enum stats_latency which, struct timeabs start);
+/* Average of the last few such times, for shedding load (0 if none). */
+u64 stats_recent_usec(const struct lightningd_state *dstate,
+		      enum stats_latency which);
+/* @cb(@arg) just ran for the loop, which STATS_IO_CALLBACK or
+ * STATS_TIMER_CALLBACK: logged if it took over config.stall_warn. */
+void stats_callback(struct lightningd_state *dstate,
+		    enum stats_latency which,
+		    const void *cb, const void *arg, struct timerel took);
+/* @method and @command are kept, so they must be constant strings. */
+void stats_bitcoind(struct lightningd_state *dstate,
+		    const char *method, struct timeabs start);
+void stats_rpc(struct lightningd_state *dstate,
+	       const char *command, struct timeabs start);
+
+/* Each peer keeps its own HTLC times, as well as the global ones. */
+struct htlc_stats *new_htlc_stats(const tal_t *ctx);
+/* @h just left @oldstate: by controlled_time, like h->created. */
+void stats_htlc_state(struct htlc *h, enum htlc_state oldstate);
+void json_add_htlc_stats(struct json_result *response, const char *name,
+			 const struct htlc_stats *hs);
+#endif /* LIGHTNING_DAEMON_STATS_H */
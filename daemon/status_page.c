@@ -0,0 +1,150 @@
+#include "chaintopology.h"
+#include "lightningd.h"
+#include "log.h"
+#include "peer.h"
+#include "routing.h"
+#include "stats.h"
+#include "status_page.h"
+#include "timeout.h"
+#include <ccan/build_assert/build_assert.h>
+#include <ccan/tal/tal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+struct status_writer {
+	struct lightningd_state *dstate;
+	struct status_page *page;
+};
+
+static enum status_peer_state peer_status_state(enum state state)
+{
+	if (state == STATE_INIT || state_is_opening(state))
+		return STATUS_PEER_OPENING;
+	if (state_is_normal(state))
+		return STATUS_PEER_NORMAL;
+	if (state_is_shutdown(state))
+		return STATUS_PEER_SHUTDOWN;
+	if (state_is_onchain(state))
+		return STATUS_PEER_ONCHAIN;
+	return STATUS_PEER_OTHER;
+}
+
+static void add_peer(struct status_page_data *data, const struct peer *peer)
+{
+	const struct channel_state *cstate;
+
+	data->peers++;
+	data->peers_connected += peer->connected;
+	data->peers_unresponsive += peer->unresponsive;
+	data->peer_states[peer_status_state(peer->state)]++;
+
+	/* A dormant peer only has its balance, and no HTLCs. */
+	if (peer->dormant) {
+		data->peers_dormant++;
+		cstate = peer->dormant;
+	} else
+		cstate = peer->remote.staging_cstate;
+	if (!cstate)
+		return;
+
+	data->htlcs_offered += cstate->side[LOCAL].num_htlcs;
+	data->htlcs_received += cstate->side[REMOTE].num_htlcs;
+	data->our_msat += cstate->side[LOCAL].pay_msat;
+	data->their_msat += cstate->side[REMOTE].pay_msat;
+}
+
+/* Readers copy while we write; the sequence tells them to retry. */
+static void write_page(struct status_page *page,
+		       const struct status_page_data *data)
+{
+	u64 seq = page->seq;
+
+	__atomic_store_n(&page->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(&page->data, data, sizeof(*data));
+	__atomic_store_n(&page->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static void status_page_tick(struct status_writer *sw)
+{
+	struct lightningd_state *dstate = sw->dstate;
+	struct status_page_data data;
+	struct timeabs now = time_now();
+	const struct peer *peer;
+
+	memset(&data, 0, sizeof(data));
+	data.updated_nsec = (u64)now.ts.tv_sec * 1000000000 + now.ts.tv_nsec;
+	data.block_height = get_block_height(dstate);
+	list_for_each(&dstate->peers, peer, list)
+		add_peer(&data, peer);
+	data.forwarded = dstate->forward_stats.forwarded;
+	data.forward_failed = dstate->forward_stats.failed;
+	data.invoices_completed = dstate->invoices_completed;
+	data.route_cache_hits = dstate->rstate->route_cache_hits;
+	data.route_cache_misses = dstate->rstate->route_cache_misses;
+	data.commit_rtt_usec = stats_recent_usec(dstate, STATS_COMMIT_RTT);
+
+	write_page(sw->page, &data);
+	new_reltimer(dstate, sw, dstate->config.status_page_time,
+		     status_page_tick, sw);
+}
+
+static void destroy_status_writer(struct status_writer *sw)
+{
+	munmap(sw->page, sizeof(*sw->page));
+}
+
+void status_page_init(struct lightningd_state *dstate)
+{
+	struct status_writer *sw;
+	char *file;
+	void *map;
+	int fd;
+
+	BUILD_ASSERT(sizeof(STATUS_PAGE_MAGIC) <= sizeof(sw->page->magic));
+	BUILD_ASSERT(sizeof(struct status_page) % 8 == 0);
+
+	/* Zero means never. */
+	if (!time_to_nsec(dstate->config.status_page_time))
+		return;
+
+	/* A new file, so a monitor still mapping the last one (say, from
+	 * before dev-restart) isn't truncated under it. */
+	file = node_file(dstate, dstate, STATUS_PAGE_FILE);
+	unlink(file);
+	fd = open(file, O_RDWR|O_CREAT|O_EXCL, 0644);
+	if (fd < 0 || ftruncate(fd, sizeof(struct status_page)) != 0) {
+		log_unusual(dstate->base_log, "No status page: %s %s",
+			    file, strerror(errno));
+		goto out;
+	}
+	map = mmap(NULL, sizeof(struct status_page), PROT_READ|PROT_WRITE,
+		   MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		log_unusual(dstate->base_log, "No status page: mmap %s",
+			    strerror(errno));
+		goto out;
+	}
+
+	sw = tal(dstate, struct status_writer);
+	sw->dstate = dstate;
+	sw->page = map;
+	tal_add_destructor(sw, destroy_status_writer);
+
+	/* It's zeroes: the header goes in before the first data. */
+	memcpy(sw->page->magic, STATUS_PAGE_MAGIC, sizeof(STATUS_PAGE_MAGIC));
+	sw->page->version = STATUS_PAGE_VERSION;
+	sw->page->size = sizeof(struct status_page);
+	sw->page->pid = getpid();
+	status_page_tick(sw);
+
+out:
+	if (fd >= 0)
+		close(fd);
+	tal_free(file);
+}
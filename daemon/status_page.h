@@ -0,0 +1,79 @@
+#ifndef LIGHTNING_DAEMON_STATUS_PAGE_H
+#define LIGHTNING_DAEMON_STATUS_PAGE_H
+/* Every --status-page-time, we write a summary into an mmap'd file, so a
+ * monitor can read it without asking us (and without us doing any work).
+ *
+ * It's in our byte order, guarded by a sequence lock: seq is odd while we
+ * write.  Use status_page_read(), and if the magic, version or size don't
+ * match, don't trust anything else.  If updated_nsec stops moving, we've
+ * stopped (or restarted and made a new file): open it again. */
+#include "config.h"
+#include <ccan/short_types/short_types.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define STATUS_PAGE_FILE "lightning-status"
+#define STATUS_PAGE_MAGIC "lnstatus"
+#define STATUS_PAGE_VERSION 1
+
+/* How we count peers' states. */
+enum status_peer_state {
+	STATUS_PEER_OPENING,
+	STATUS_PEER_NORMAL,
+	STATUS_PEER_SHUTDOWN,
+	STATUS_PEER_ONCHAIN,
+	/* Errored, or closed and not yet forgotten. */
+	STATUS_PEER_OTHER,
+	STATUS_PEER_NUM_STATES
+};
+
+struct status_page_data {
+	/* When this was written: nanoseconds since the epoch. */
+	u64 updated_nsec;
+	u32 block_height;
+
+	u32 peers, peers_connected, peers_dormant, peers_unresponsive;
+	u32 peer_states[STATUS_PEER_NUM_STATES];
+
+	/* In our channels, and each side's balance (a tenant has its own). */
+	u32 htlcs_offered, htlcs_received;
+	u64 our_msat, their_msat;
+
+	/* As getinfo. */
+	u64 forwarded, forward_failed;
+	u64 invoices_completed;
+	u64 route_cache_hits, route_cache_misses;
+
+	/* Recent average, as getstats. */
+	u64 commit_rtt_usec;
+};
+
+struct status_page {
+	char magic[12];
+	u32 version;
+	/* sizeof(struct status_page). */
+	u32 size;
+	u32 pid;
+	/* Even unless we're writing data. */
+	u64 seq;
+	struct status_page_data data;
+};
+
+/* A copy of what's there; false if we were mid-write (try again). */
+static inline bool status_page_read(const struct status_page *page,
+				    struct status_page_data *data)
+{
+	u64 seq = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE);
+
+	if (seq & 1)
+		return false;
+	memcpy(data, &page->data, sizeof(*data));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&page->seq, __ATOMIC_RELAXED) == seq;
+}
+
+struct lightningd_state;
+
+/* Creates the file and starts writing it, if --status-page-time says. */
+void status_page_init(struct lightningd_state *dstate);
+#endif /* LIGHTNING_DAEMON_STATUS_PAGE_H */
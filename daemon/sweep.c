@@ -0,0 +1,266 @@
+#include "bitcoin/locktime.h"
+#include "bitcoin/script.h"
+#include "bitcoin/tx.h"
+#include "chaintopology.h"
+#include "channel.h"
+#include "htlc.h"
+#include "lightningd.h"
+#include "log.h"
+#include "peer.h"
+#include "remove_dust.h"
+#include "secrets.h"
+#include "sweep.h"
+#include "timeout.h"
+#include <ccan/list/list.h>
+#include <inttypes.h>
+
+/* Keeps each tx well inside standard size, even if they're all HTLCs. */
+#define SWEEP_MAX_INPUTS 100
+
+struct sweeper {
+	struct list_head pending;
+	bool scheduled;
+};
+
+struct sweep_input {
+	struct list_node list;
+	struct peer *peer;
+	unsigned int out_num;
+	enum sweep_type type;
+};
+
+/* Witness lengths can vary, due to DER encoding of sigs: these are from
+ * example runs. */
+static size_t witness_len(enum sweep_type type)
+{
+	return type == SWEEP_DELAYED ? 176 : 539;
+}
+
+static struct sweeper *get_sweeper(struct lightningd_state *dstate)
+{
+	if (!dstate->sweeper) {
+		dstate->sweeper = tal(dstate, struct sweeper);
+		list_head_init(&dstate->sweeper->pending);
+		dstate->sweeper->scheduled = false;
+	}
+	return dstate->sweeper;
+}
+
+static size_t peer_index(struct peer **peers, const struct peer *peer)
+{
+	size_t i;
+
+	for (i = 0; i < tal_count(peers); i++)
+		if (peers[i] == peer)
+			break;
+	return i;
+}
+
+/* Spends up to SWEEP_MAX_INPUTS of the pending outputs, with one output
+ * for each peer (to its final key, as the single spends used to). */
+static void sweep_some(struct lightningd_state *dstate, struct sweeper *s)
+{
+	const tal_t *ctx = tal(dstate, char);
+	struct sweep_input **ins = tal_arr(ctx, struct sweep_input *, 0);
+	struct peer **peers = tal_arr(ctx, struct peer *, 0);
+	const struct peer **inpeers;
+	struct bitcoin_tx *tx, **copies;
+	const u8 **wscripts;
+	struct signature *sigs;
+	struct sweep_input *in;
+	size_t i, j, n, *sizes, total_size = 0, witness = 0;
+	u64 *satoshis, *shares, fee;
+
+	list_for_each(&s->pending, in, list) {
+		n = tal_count(ins);
+		if (n == SWEEP_MAX_INPUTS)
+			break;
+		tal_resize(&ins, n + 1);
+		ins[n] = in;
+		if (peer_index(peers, in->peer) == tal_count(peers)) {
+			n = tal_count(peers);
+			tal_resize(&peers, n + 1);
+			peers[n] = in->peer;
+		}
+	}
+
+	n = tal_count(ins);
+	tx = bitcoin_tx(ctx, n, tal_count(peers));
+	inpeers = tal_arr(ctx, const struct peer *, n);
+	wscripts = tal_arr(ctx, const u8 *, n);
+	satoshis = tal_arrz(ctx, u64, tal_count(peers));
+	sizes = tal_arrz(ctx, size_t, tal_count(peers));
+
+	for (i = 0; i < n; i++) {
+		struct peer *peer = ins[i]->peer;
+		const struct bitcoin_tx *commit = peer->onchain.tx;
+		unsigned int out_num = ins[i]->out_num;
+
+		tx->input[i].txid = peer->onchain.txid;
+		tx->input[i].index = out_num;
+		tx->input[i].sequence_number
+			= bitcoin_nsequence(&peer->remote.locktime);
+		tx->input[i].amount = tal_dup(tx->input, u64,
+					      &commit->output[out_num].amount);
+
+		/* We must set locktime so HTLC expiry can
+		 * OP_CHECKLOCKTIMEVERIFY: they've all expired, so the
+		 * latest will do for all of them. */
+		if (ins[i]->type == SWEEP_HTLC_TIMEOUT) {
+			u32 expiry = peer->onchain.htlcs[out_num]->expiry.locktime;
+			if (expiry > tx->lock_time)
+				tx->lock_time = expiry;
+		}
+
+		inpeers[i] = peer;
+		wscripts[i] = peer->onchain.wscripts[out_num];
+		witness += witness_len(ins[i]->type);
+
+		j = peer_index(peers, peer);
+		satoshis[j] += commit->output[out_num].amount;
+		/* txid, index, empty script and sequence, then witness. */
+		sizes[j] += 41 + witness_len(ins[i]->type) / 4;
+	}
+
+	for (j = 0; j < tal_count(peers); j++) {
+		/* Using a new output address here would be useless: they
+		 * can tell it's ours from how we spent it. */
+		tx->output[j].script = scriptpubkey_p2sh(tx,
+			bitcoin_redeem_single(tx, dstate->secpctx,
+					      &peers[j]->local.finalkey));
+		tx->output[j].script_length = tal_count(tx->output[j].script);
+		sizes[j] += 8 + 1 + tx->output[j].script_length;
+		total_size += sizes[j];
+	}
+
+	/* Each channel pays for its own inputs and output; the first pays the
+	 * remainder (the tx overhead, and rounding). */
+	fee = fee_by_feerate(measure_tx_cost(tx) / 4 + witness / 4,
+			     get_feerate(dstate));
+	shares = tal_arr(ctx, u64, tal_count(peers));
+	shares[0] = fee;
+	for (j = 1; j < tal_count(peers); j++) {
+		shares[j] = fee * sizes[j] / total_size;
+		shares[0] -= shares[j];
+	}
+	for (j = 0; j < tal_count(peers); j++) {
+		/* FIXME: Fail gracefully in these cases (not worth
+		 * collecting) */
+		if (shares[j] > satoshis[j] || is_dust(satoshis[j] - shares[j]))
+			fatal("Sweep amount of %"PRIu64" won't cover fee %"PRIu64,
+			      satoshis[j], shares[j]);
+		tx->output[j].amount = satoshis[j] - shares[j];
+	}
+
+	sigs = tal_arr(ctx, struct signature, n);
+	peer_sign_sweep_inputs(dstate, inpeers, tx, wscripts, sigs);
+	for (i = 0; i < n; i++) {
+		const struct peer *peer = inpeers[i];
+		struct bitcoin_signature sig;
+
+		sig.stype = SIGHASH_ALL;
+		sig.sig = sigs[i];
+
+		switch (ins[i]->type) {
+		case SWEEP_DELAYED:
+			tx->input[i].witness
+				= bitcoin_witness_secret(tx, dstate->secpctx,
+							 NULL, 0, &sig,
+							 wscripts[i]);
+			break;
+		case SWEEP_HTLC_FULFILL:
+			tx->input[i].witness
+				= bitcoin_witness_htlc(tx, dstate->secpctx,
+					peer->onchain.htlcs[ins[i]->out_num]->r,
+					&sig, wscripts[i]);
+			break;
+		case SWEEP_HTLC_TIMEOUT:
+			tx->input[i].witness
+				= bitcoin_witness_htlc(tx, dstate->secpctx,
+						       NULL, &sig, wscripts[i]);
+			break;
+		}
+	}
+
+	log_debug(dstate->base_log, "Sweeping %zu outputs of %zu channels"
+		  " with tx cost %zu, fee %"PRIu64,
+		  n, tal_count(peers), measure_tx_cost(tx), fee);
+
+	/* Everyone else's copy is the same tx: they may outlive the first. */
+	copies = tal_arr(ctx, struct bitcoin_tx *, tal_count(peers));
+	for (j = 0; j < tal_count(peers); j++)
+		copies[j] = j ? bitcoin_tx_dup(peers[j], tx) : tx;
+
+	for (i = 0; i < n; i++) {
+		j = peer_index(peers, ins[i]->peer);
+		peer_onchain_swept(ins[i]->peer, ins[i]->out_num, copies[j]);
+		tal_free(ins[i]);
+	}
+
+	/* The topology only sends it once, but each peer keeps it. */
+	for (j = 0; j < tal_count(peers); j++) {
+		log_unusual(peers[j]->log, "Sweeping onchain outputs");
+		broadcast_tx(peers[j], copies[j]);
+	}
+	tal_free(ctx);
+}
+
+/* One tx per trip around the loop, so hundreds of HTLC outputs don't
+ * stop us talking to everyone else while we sign them all. */
+static void sweep_next(struct lightningd_state *dstate)
+{
+	struct sweeper *s = dstate->sweeper;
+
+	s->scheduled = false;
+	if (list_empty(&s->pending))
+		return;
+
+	sweep_some(dstate, s);
+	if (!list_empty(&s->pending)) {
+		s->scheduled = true;
+		new_reltimer(dstate, s, time_from_sec(0), sweep_next, dstate);
+	}
+}
+
+static void destroy_sweep_input(struct sweep_input *in)
+{
+	list_del(&in->list);
+}
+
+void sweep_onchain_output(struct peer *peer, unsigned int out_num,
+			  enum sweep_type type)
+{
+	struct sweeper *s = get_sweeper(peer->dstate);
+	struct sweep_input *in;
+
+	if (sweep_pending(peer, out_num))
+		return;
+
+	/* If the onchain tx goes (eg. it's replaced), so does this. */
+	in = tal(peer->onchain.tx, struct sweep_input);
+	in->peer = peer;
+	in->out_num = out_num;
+	in->type = type;
+	list_add_tail(&s->pending, &in->list);
+	tal_add_destructor(in, destroy_sweep_input);
+
+	/* Whatever else matures this time around the loop joins it. */
+	if (!s->scheduled) {
+		s->scheduled = true;
+		new_reltimer(peer->dstate, s, time_from_sec(0),
+			     sweep_next, peer->dstate);
+	}
+}
+
+bool sweep_pending(const struct peer *peer, unsigned int out_num)
+{
+	struct sweep_input *in;
+
+	if (!peer->dstate->sweeper)
+		return false;
+
+	list_for_each(&peer->dstate->sweeper->pending, in, list)
+		if (in->peer == peer && in->out_num == out_num)
+			return true;
+	return false;
+}
@@ -0,0 +1,27 @@
+#ifndef LIGHTNING_DAEMON_SWEEP_H
+#define LIGHTNING_DAEMON_SWEEP_H
+/* Onchain outputs we can spend back to ourselves are gathered up, across
+ * channels, and spent together once the loop has run everything else. */
+#include "config.h"
+#include <stdbool.h>
+
+struct peer;
+
+enum sweep_type {
+	/* Our main output from our own commit tx, after the delay. */
+	SWEEP_DELAYED,
+	/* Their HTLC, with the preimage. */
+	SWEEP_HTLC_FULFILL,
+	/* Our HTLC, once it's timed out. */
+	SWEEP_HTLC_TIMEOUT
+};
+
+/* Spend peer->onchain.tx output @out_num.  Once the tx is built, it's
+ * broadcast and handed to peer_onchain_swept().  Forgotten if the onchain
+ * tx is. */
+void sweep_onchain_output(struct peer *peer, unsigned int out_num,
+			  enum sweep_type type);
+
+/* Is that output already waiting to be swept? */
+bool sweep_pending(const struct peer *peer, unsigned int out_num);
+#endif /* LIGHTNING_DAEMON_SWEEP_H */
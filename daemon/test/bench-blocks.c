@@ -0,0 +1,361 @@
+/* Benchmark block processing on recorded blocks: each is parsed, then goes
+ * through new_block, connect_block and watch_topology_changed just as if
+ * bitcoind had handed it to us.
+ *
+ * --blocks is a directory of blocks as "bitcoin-cli getblock HASH 0" prints
+ * them, one per file, in chain order by name; the first is only our root.
+ * We watch --txwatches random txids and --txowatches random outputs, which
+ * never match, plus --real of each taken from the blocks, which do.
+ *
+ * Prints "<height> <txs> <usec> <allocations> <peak bytes>" per block, where
+ * the peak is above what we had before it, then totals. */
+#include "daemon/chaintopology.c"
+#include "daemon/test/bench_alloc.h"
+#include "daemon/watch.c"
+#include <ccan/asort/asort.h>
+#include <ccan/err/err.h>
+#include <ccan/opt/opt.h>
+#include <ccan/tal/grab_file/grab_file.h>
+#include <ccan/tal/path/path.h>
+#include <ccan/time/time.h>
+#include <dirent.h>
+#include <stdio.h>
+
+/* AUTOGENERATED MOCKS START */
+/* Generated stub for mempool_poll */
+void mempool_poll(struct lightningd_state *dstate UNNEEDED)
+{ fprintf(stderr, "mempool_poll called!\n"); abort(); }
+/* Generated stub for new_reltimer_ */
+struct oneshot *new_reltimer_(struct lightningd_state *dstate UNNEEDED,
+			      const tal_t *ctx UNNEEDED,
+			      struct timerel expire UNNEEDED,
+			      void (*cb)(void *) UNNEEDED, void *arg UNNEEDED)
+{ fprintf(stderr, "new_reltimer_ called!\n"); abort(); }
+/* Generated stub for peers_new_feerate */
+void peers_new_feerate(struct lightningd_state *dstate UNNEEDED)
+{ fprintf(stderr, "peers_new_feerate called!\n"); abort(); }
+/* AUTOGENERATED MOCKS END */
+
+/* Logging is a no-op for us. */
+void log_(struct log *log UNNEEDED, enum log_level level UNNEEDED,
+	  const char *fmt UNNEEDED, ...)
+{
+}
+void log_add(struct log *log UNNEEDED, const char *fmt UNNEEDED, ...)
+{
+}
+void log_struct_(struct log *log UNNEEDED, int level UNNEEDED,
+		 const char *structname UNNEEDED,
+		 const char *fmt UNNEEDED, ...)
+{
+}
+
+void fatal(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	verrx(1, fmt, ap);
+}
+
+const struct siphash_seed *siphash_seed(void)
+{
+	static struct siphash_seed seed;
+	return &seed;
+}
+
+struct timeabs controlled_time(void)
+{
+	return time_now();
+}
+
+/* Nothing's in the mempool, and the wallet has nothing to find. */
+bool mempool_tx_mined(struct lightningd_state *dstate UNNEEDED,
+		      const struct sha256_double *txid UNNEEDED)
+{
+	return false;
+}
+void wallet_output_spent(struct lightningd_state *dstate UNNEEDED,
+			 const struct txwatch_output *out UNNEEDED)
+{
+}
+void wallet_output_seen(struct lightningd_state *dstate UNNEEDED,
+			const struct sha256_double *txid UNNEEDED,
+			u32 outnum UNNEEDED, u64 amount UNNEEDED,
+			const u8 *script UNNEEDED, size_t script_len UNNEEDED)
+{
+}
+void notify_block(struct lightningd_state *dstate UNNEEDED,
+		  u32 height UNNEEDED,
+		  const struct sha256_double *blkid UNNEEDED)
+{
+}
+
+/* We only ever ask it for a fee estimate, and never answer, so we only
+ * ask once. */
+static void bench_estimate_fee(struct lightningd_state *dstate UNNEEDED,
+			       void (*cb)(struct lightningd_state *dstate,
+					  u64, void *) UNNEEDED,
+			       void *arg UNNEEDED)
+{
+}
+
+static const struct chain_source bench_chain_source = {
+	.name = "bench",
+	.estimate_fee = bench_estimate_fee
+};
+
+static u64 txwatch_fired, txowatch_fired;
+
+static enum watch_result tx_depth(struct peer *peer UNNEEDED,
+				  unsigned int depth UNNEEDED,
+				  const struct sha256_double *txid UNNEEDED,
+				  void *unused UNNEEDED)
+{
+	txwatch_fired++;
+	return KEEP_WATCHING;
+}
+
+static enum watch_result txo_spent(struct peer *peer UNNEEDED,
+				   const struct bitcoin_tx *tx UNNEEDED,
+				   size_t input_num UNNEEDED,
+				   void *unused UNNEEDED)
+{
+	txowatch_fired++;
+	return KEEP_WATCHING;
+}
+
+static int cmp_names(char *const *a, char *const *b, void *unused)
+{
+	return strcmp(*a, *b);
+}
+
+/* Hex of every block, in order. */
+static char **load_blocks(const tal_t *ctx, const char *dir)
+{
+	char **hex = tal_arr(ctx, char *, 0), **names = tal_arr(ctx, char *, 0);
+	DIR *d = opendir(dir);
+	struct dirent *e;
+	size_t i, n = 0;
+
+	if (!d)
+		err(1, "Opening %s", dir);
+	while ((e = readdir(d)) != NULL) {
+		if (e->d_name[0] == '.')
+			continue;
+		tal_resize(&names, n + 1);
+		names[n++] = path_join(names, dir, e->d_name);
+	}
+	closedir(d);
+	asort(names, n, cmp_names, NULL);
+
+	tal_resize(&hex, n);
+	for (i = 0; i < n; i++) {
+		hex[i] = grab_file(hex, names[i]);
+		if (!hex[i])
+			err(1, "Reading %s", names[i]);
+		/* bitcoin-cli ends it with a newline. */
+		if (strlen(hex[i]) && hex[i][strlen(hex[i]) - 1] == '\n')
+			hex[i][strlen(hex[i]) - 1] = '\0';
+	}
+	tal_free(names);
+	if (n < 2)
+		errx(1, "%s: need at least two blocks", dir);
+	return hex;
+}
+
+static struct bitcoin_block *parse_block(const tal_t *ctx, const char *hex)
+{
+	struct bitcoin_block *blk = bitcoin_block_from_hex(ctx, hex,
+							   strlen(hex));
+	if (!blk)
+		errx(1, "Bad block %.64s...", hex);
+	return blk;
+}
+
+/* The @n'th tx of @blk's (wrapping), and what its first input spends. */
+static void real_tx(const struct bitcoin_block *blk, size_t n,
+		    struct sha256_double *txid, struct txwatch_output *out)
+{
+	const u8 *p = blk->txs, *in;
+	size_t len = tal_count(blk->txs), inlen, i;
+	struct bitcoin_tx_view view;
+	u32 index;
+
+	/* Not the coinbase: its input spends nothing. */
+	if (blk->num_txs > 1)
+		n = 1 + n % (blk->num_txs - 1);
+	else
+		n = 0;
+	for (i = 0; i <= n; i++)
+		if (!pull_bitcoin_tx_view(&p, &len, &view))
+			abort();
+	bitcoin_tx_view_txid(&view, txid);
+
+	in = view.inputs;
+	inlen = view.inputs_len;
+	pull_bitcoin_tx_view_input(&in, &inlen, &out->txid, &index);
+	out->index = index;
+}
+
+static void random_txid(struct sha256_double *txid)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(txid->sha.u.u8); i++)
+		txid->sha.u.u8[i] = random();
+}
+
+static void add_watches(struct lightningd_state *dstate, struct peer *peer,
+			char **hex, unsigned int txwatches,
+			unsigned int txowatches, unsigned int real)
+{
+	struct sha256_double txid;
+	struct txwatch_output out;
+	size_t i, num_blocks = tal_count(hex);
+
+	/* Spread over the blocks after the root. */
+	for (i = 0; i < real; i++) {
+		struct bitcoin_block *blk;
+
+		blk = parse_block(dstate,
+				  hex[1 + i * (num_blocks - 1) / real]);
+		real_tx(blk, i, &txid, &out);
+		watch_txid(dstate, peer, &txid, tx_depth, NULL);
+		watch_txo(dstate, peer, &out.txid, out.index, txo_spent, NULL);
+		tal_free(blk);
+	}
+
+	for (i = 0; i < txwatches; i++) {
+		random_txid(&txid);
+		watch_txid(dstate, peer, &txid, tx_depth, NULL);
+	}
+	for (i = 0; i < txowatches; i++) {
+		random_txid(&out.txid);
+		out.index = random() % 4;
+		watch_txo(dstate, peer, &out.txid, out.index, txo_spent, NULL);
+	}
+}
+
+/* What setup_topology would give us, without asking bitcoind. */
+static void bench_topology(struct lightningd_state *dstate,
+			   const char *hex, unsigned int height)
+{
+	struct topology *topo = tal(dstate, struct topology);
+
+	dstate->topology = topo;
+	topo->cache_fd = -1;
+	topo->pruned = tal_arr(topo, struct pruned_block, 0);
+	topo->pruned_txids = tal_arr(topo, struct sha256_double, 0);
+	topo->pruned_order = tal_arr(topo, u32, 0);
+	block_map_init(&topo->block_map);
+	txid_map_init(&topo->txid_map);
+	topo->orphans = tal_arr(topo, struct block *, 0);
+	block_map_init(&topo->orphan_map);
+	topo->startup = false;
+	topo->polling = false;
+	topo->poll_again = false;
+	topo->poll_timer = NULL;
+	topo->feerate = 0;
+	topo->fee_estimating = false;
+
+	topo->root = new_block(dstate, parse_block(dstate, hex), NULL);
+	topo->root->height = height;
+	topo->root->header_only = false;
+	topo->root->raw_txs = tal_free(topo->root->raw_txs);
+	topo->root->num_raw_txs = 0;
+	block_map_add(&topo->block_map, topo->root);
+	topo->tip = topo->root;
+}
+
+int main(int argc, char *argv[])
+{
+	struct lightningd_state *dstate;
+	struct peer *peer;
+	char *dir = NULL, **hex;
+	unsigned int txwatches = 1000, txowatches = 1000, real = 10;
+	unsigned int height = 0, seed = 1;
+	u64 total_usec = 0, total_allocs = 0, total_txs = 0;
+	size_t i, max_peak = 0;
+
+	bench_alloc_init();
+
+	opt_register_noarg("--help|-h", opt_usage_and_exit, "",
+			   "Print this message.");
+	opt_register_arg("--blocks", opt_set_charp, NULL, &dir,
+			 "Directory of hex blocks, in order by name");
+	opt_register_arg("--height", opt_set_uintval, opt_show_uintval,
+			 &height, "Height of the first block");
+	opt_register_arg("--txwatches", opt_set_uintval, opt_show_uintval,
+			 &txwatches, "Random txids to watch");
+	opt_register_arg("--txowatches", opt_set_uintval, opt_show_uintval,
+			 &txowatches, "Random outputs to watch");
+	opt_register_arg("--real", opt_set_uintval, opt_show_uintval, &real,
+			 "Txids and outputs to watch from the blocks");
+	opt_register_arg("--seed", opt_set_uintval, opt_show_uintval, &seed,
+			 "Random seed for the watches");
+	opt_parse(&argc, argv, opt_log_stderr_exit);
+	if (argc != 1)
+		opt_usage_exit_fail("No arguments expected");
+	if (!dir)
+		opt_usage_exit_fail("Need --blocks");
+
+	srandom(seed);
+	dstate = talz(NULL, struct lightningd_state);
+	dstate->host = dstate;
+	list_head_init(&dstate->tenants);
+	dstate->base_log = NULL;
+	dstate->config.chain_source = &bench_chain_source;
+	dstate->config.forever_confirms = 100;
+	dstate->config.fee_refresh_time = time_from_sec(10 * 60);
+	dstate->outgoing_txs = tal(dstate, struct outgoing_tx_map);
+	outgoing_tx_map_init(dstate->outgoing_txs);
+	txwatch_hash_init(&dstate->txwatches);
+	txwatch_height_map_init(&dstate->txwatch_heights);
+	txowatch_hash_init(&dstate->txowatches);
+	watch_filter_init(&dstate->txwatch_filter);
+	watch_filter_init(&dstate->txowatch_filter);
+
+	peer = talz(dstate, struct peer);
+	peer->dstate = dstate;
+
+	hex = load_blocks(dstate, dir);
+	bench_topology(dstate, hex[0], height);
+	add_watches(dstate, peer, hex, txwatches, txowatches, real);
+
+	for (i = 1; i < tal_count(hex); i++) {
+		struct timeabs start;
+		struct bitcoin_block *blk;
+		size_t before = allocated, txs;
+		u64 allocs = allocations, usec;
+
+		peak = allocated;
+		start = time_now();
+		blk = parse_block(dstate, hex[i]);
+		txs = blk->num_txs;
+		topology_changed(dstate, dstate->topology->tip,
+				 new_block(dstate, blk, NULL));
+		tal_free(blk);
+		usec = time_to_usec(time_between(time_now(), start));
+
+		printf("%u %zu %"PRIu64" %"PRIu64" %zu\n",
+		       dstate->topology->tip->height, txs, usec,
+		       allocations - allocs, peak - before);
+		total_usec += usec;
+		total_allocs += allocations - allocs;
+		total_txs += txs;
+		if (peak - before > max_peak)
+			max_peak = peak - before;
+	}
+
+	printf("%zu blocks, %"PRIu64" txs: %"PRIu64" usec per block,"
+	       " %"PRIu64" allocations per block, %zu peak bytes\n",
+	       tal_count(hex) - 1, total_txs, total_usec / (tal_count(hex) - 1),
+	       total_allocs / (tal_count(hex) - 1), max_peak);
+	printf("Fired %"PRIu64" txwatches, %"PRIu64" txowatches\n",
+	       txwatch_fired, txowatch_fired);
+
+	tal_free(dstate);
+	opt_free_table();
+	return 0;
+}
@@ -0,0 +1,299 @@
+/* Benchmark the encrypted transport: two ends of a socketpair in one
+ * process, doing the handshake and then streaming packets one way.
+ *
+ * Prints "<name> <iterations> <nsec per iteration> <allocations per
+ * iteration>", for handshakes and then for each packet size. */
+#include "daemon/cryptopkt.c"
+#include "daemon/test/bench_alloc.h"
+#include <ccan/array_size/array_size.h>
+#include <ccan/err/err.h>
+#include <ccan/opt/opt.h>
+#include <ccan/time/time.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/* AUTOGENERATED MOCKS START */
+/* AUTOGENERATED MOCKS END */
+
+/* Logging is a no-op for us. */
+void log_(struct log *log UNNEEDED, enum log_level level UNNEEDED,
+	  const char *fmt UNNEEDED, ...)
+{
+}
+void log_blob_(struct log *log UNNEEDED, enum log_level level UNNEEDED,
+	       const char *fmt UNNEEDED, size_t len UNNEEDED, ...)
+{
+}
+void log_elided(struct log *log UNNEEDED)
+{
+}
+
+const char *pkt_name(Pkt__PktCase pkt UNNEEDED)
+{
+	return "pkt";
+}
+
+/* Both ends are us. */
+static struct privkey privkey;
+
+void privkey_sign(struct lightningd_state *dstate, const void *src, size_t len,
+		  struct signature *sig)
+{
+	struct sha256_double h;
+
+	sha256_double(&h, src, len);
+	sign_hash(dstate->secpctx, &privkey, &h, sig);
+}
+
+/* Only the session key pool uses timers: we run it between handshakes, as
+ * the daemon would between other work. */
+static void (*timer_cb)(void *);
+static void *timer_arg;
+
+struct oneshot *new_reltimer_(struct lightningd_state *dstate UNNEEDED,
+			      const tal_t *ctx UNNEEDED,
+			      struct timerel expire UNNEEDED,
+			      void (*cb)(void *), void *arg)
+{
+	timer_cb = cb;
+	timer_arg = arg;
+	return NULL;
+}
+
+static void run_timers(void)
+{
+	while (timer_cb) {
+		void (*cb)(void *) = timer_cb;
+		timer_cb = NULL;
+		cb(timer_arg);
+	}
+}
+
+/* Handshake crypto comes back through the loop, as it would from a job
+ * thread: by the time a pipe reads, the connection is waiting for it. */
+struct bench_job {
+	struct lightningd_state *dstate;
+	void (*work)(void *arg);
+	void (*done)(struct lightningd_state *dstate, void *arg);
+	void *arg;
+	char byte;
+};
+
+static struct io_plan *job_ready(struct io_conn *conn, struct bench_job *j)
+{
+	j->work(j->arg);
+	j->done(j->dstate, j->arg);
+	return io_close(conn);
+}
+
+static struct io_plan *job_wait(struct io_conn *conn, struct bench_job *j)
+{
+	return io_read(conn, &j->byte, 1, job_ready, j);
+}
+
+void job_submit_(struct lightningd_state *dstate, struct peer *peer UNNEEDED,
+		 void (*work)(void *arg),
+		 void (*done)(struct lightningd_state *dstate, void *arg),
+		 void *arg)
+{
+	struct bench_job *j = tal(NULL, struct bench_job);
+	struct io_conn *conn;
+	int fds[2];
+
+	j->dstate = dstate;
+	j->work = work;
+	j->done = done;
+	j->arg = tal_steal(j, arg);
+	if (pipe(fds) != 0 || write(fds[1], "", 1) != 1)
+		err(1, "job pipe");
+	close(fds[1]);
+	conn = io_new_conn(NULL, fds[0], job_wait, j);
+	tal_steal(conn, j);
+}
+
+static struct lightningd_state *dstate;
+
+/* What the connections are doing. */
+static bool handshake_only, waiting;
+static const Pkt *msg;
+static size_t to_send, to_recv;
+static struct timeabs start, end;
+static size_t allocs_start, allocs_end;
+
+struct endpoint {
+	bool sender;
+	struct peer *peer;
+};
+
+static struct io_plan *send_next(struct io_conn *conn, struct peer *peer)
+{
+	if (to_send == 0)
+		return io_close(conn);
+	to_send--;
+	return peer_write_packet(conn, peer, msg, send_next);
+}
+
+static struct io_plan *recv_next(struct io_conn *conn, struct peer *peer)
+{
+	if (peer->inpkt) {
+		if (peer->inpkt->pkt_case != msg->pkt_case)
+			errx(1, "Received packet %u", peer->inpkt->pkt_case);
+		peer_release_packet(peer);
+		to_recv--;
+	}
+	if (to_recv == 0) {
+		end = time_now();
+		allocs_end = allocations;
+		return io_close(conn);
+	}
+	return peer_read_packet(conn, peer, recv_next);
+}
+
+static struct io_plan *start_msgs(struct io_conn *conn, struct endpoint *ep)
+{
+	if (ep->sender)
+		return send_next(conn, ep->peer);
+	return recv_next(conn, ep->peer);
+}
+
+static struct io_plan *handshake_done(struct io_conn *conn,
+				      struct lightningd_state *dstate,
+				      struct io_data *iod,
+				      struct log *log,
+				      const struct pubkey *id,
+				      struct endpoint *ep)
+{
+	if (!structeq(id, &dstate->id))
+		errx(1, "Handshake gave wrong id");
+
+	if (handshake_only)
+		return io_close(conn);
+
+	/* The transport only uses these. */
+	ep->peer = talz(ep, struct peer);
+	ep->peer->io_data = tal_steal(ep->peer, iod);
+	ep->peer->log = log;
+
+	/* Whoever finishes first waits, so we only time the packets. */
+	if (!waiting) {
+		waiting = true;
+		return io_wait(conn, &waiting, start_msgs, ep);
+	}
+	waiting = false;
+	io_wake(&waiting);
+	start = time_now();
+	allocs_start = allocations;
+	return start_msgs(conn, ep);
+}
+
+static struct io_plan *init_endpoint(struct io_conn *conn, struct endpoint *ep)
+{
+	return peer_crypto_setup(conn, dstate, NULL, NULL,
+				 handshake_done, ep);
+}
+
+/* Runs the pair until both ends close. */
+static void run_pair(void)
+{
+	const tal_t *ctx = tal(NULL, char);
+	struct endpoint *eps = tal_arrz(ctx, struct endpoint, 2);
+	int fds[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+		err(1, "socketpair");
+
+	eps[0].sender = true;
+	io_new_conn(ctx, fds[0], init_endpoint, &eps[0]);
+	io_new_conn(ctx, fds[1], init_endpoint, &eps[1]);
+	io_loop(NULL, NULL);
+	run_timers();
+	tal_free(ctx);
+}
+
+/* An HTLC add, with this much (onion) routing information. */
+static Pkt *htlc_pkt(const tal_t *ctx, size_t routelen)
+{
+	UpdateAddHtlc *u = tal(ctx, UpdateAddHtlc);
+	struct abs_locktime expiry;
+	struct sha256 rhash;
+
+	update_add_htlc__init(u);
+	u->id = 1;
+	u->amount_msat = 1000000;
+	memset(&rhash, 1, sizeof(rhash));
+	u->r_hash = sha256_to_proto(u, &rhash);
+	blocks_to_abs_locktime(500000, &expiry);
+	u->expiry = abs_locktime_to_proto(u, &expiry);
+	u->route = tal(u, Routing);
+	routing__init(u->route);
+	u->route->info.len = routelen;
+	u->route->info.data = tal_arrz(u, u8, routelen);
+	return pkt_wrap(ctx, u, PKT__PKT_UPDATE_ADD_HTLC);
+}
+
+static void report(const char *name, size_t n)
+{
+	struct timerel t = time_between(end, start);
+
+	printf("%s %zu %"PRIu64" %zu\n", name, n, time_to_nsec(t) / n,
+	       (allocs_end - allocs_start) / n);
+}
+
+int main(int argc, char *argv[])
+{
+	/* Empty, a typical onion, and big ones. */
+	const size_t sizes[] = { 0, 1254, 16384, 65536 };
+	unsigned int handshakes = 1000, msgs = 100000;
+	size_t i;
+
+	bench_alloc_init();
+
+	opt_register_noarg("--help|-h", opt_usage_and_exit, "",
+			   "Print this message.");
+	opt_register_arg("--handshakes", opt_set_uintval, opt_show_uintval,
+			 &handshakes, "Number of handshakes to time");
+	opt_register_arg("--msgs", opt_set_uintval, opt_show_uintval,
+			 &msgs, "Packets to send of each size");
+	opt_parse(&argc, argv, opt_log_stderr_exit);
+	if (argc != 1)
+		opt_usage_exit_fail("No arguments expected");
+	if (handshakes == 0 || msgs == 0)
+		opt_usage_exit_fail("Need at least one of each");
+
+	dstate = talz(NULL, struct lightningd_state);
+	dstate->secpctx = secp256k1_context_create(SECP256K1_CONTEXT_VERIFY
+						   | SECP256K1_CONTEXT_SIGN);
+	memset(privkey.secret, 1, sizeof(privkey.secret));
+	if (!pubkey_from_privkey(dstate->secpctx, &privkey, &dstate->id))
+		abort();
+	sessionkeys_init(dstate);
+
+	handshake_only = true;
+	start = time_now();
+	allocs_start = allocations;
+	for (i = 0; i < handshakes; i++)
+		run_pair();
+	end = time_now();
+	allocs_end = allocations;
+	report("handshake", handshakes);
+
+	handshake_only = false;
+	for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+		char name[sizeof("msg_18446744073709551615")];
+
+		msg = htlc_pkt(dstate, sizes[i]);
+		to_send = to_recv = msgs;
+		run_pair();
+		sprintf(name, "msg_%zu", sizes[i]);
+		report(name, msgs);
+		tal_free(msg);
+	}
+
+	secp256k1_context_destroy(dstate->secpctx);
+	tal_free(dstate);
+	opt_free_table();
+	return 0;
+}
@@ -0,0 +1,565 @@
+/* Benchmark the database write path: synthetic peers take HTLCs through
+ * their whole lifecycle, one peer transaction per step as peer.c does,
+ * under each journal mode, with and without group commit.
+ *
+ * Prints "<mode> <lifecycles> <ops per second> <bytes written per
+ * lifecycle> <fsyncs per second>", where a lifecycle is one HTLC from
+ * add to archived, and the ops are the db_ calls. */
+#include "daemon/db.c"
+#include "daemon/htlc.c"
+#include "daemon/onion.h"
+#include <ccan/err/err.h>
+#include <ccan/opt/opt.h>
+#include <ccan/time/time.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <sys/syscall.h>
+
+/* AUTOGENERATED MOCKS START */
+/* Generated stub for add_connection */
+void add_connection(struct lightningd_state *dstate UNNEEDED,
+		    const struct pubkey *from UNNEEDED,
+		    const struct pubkey *to UNNEEDED,
+		    u32 base_fee UNNEEDED, s32 proportional_fee UNNEEDED,
+		    u32 delay UNNEEDED, u32 min_blocks UNNEEDED, u64 capacity_msat UNNEEDED)
+{ fprintf(stderr, "add_connection called!\n"); abort(); }
+/* Generated stub for balance_after_force */
+bool balance_after_force(struct channel_state *cstate UNNEEDED)
+{ fprintf(stderr, "balance_after_force called!\n"); abort(); }
+/* Generated stub for command_fail */
+void command_fail(struct command *cmd UNNEEDED, const char *fmt UNNEEDED, ...)
+{ fprintf(stderr, "command_fail called!\n"); abort(); }
+/* Generated stub for command_success */
+void command_success(struct command *cmd UNNEEDED, struct json_result *response UNNEEDED)
+{ fprintf(stderr, "command_success called!\n"); abort(); }
+/* Generated stub for copy_cstate */
+struct channel_state *copy_cstate(const tal_t *ctx UNNEEDED,
+				  const struct channel_state *cstate UNNEEDED)
+{ fprintf(stderr, "copy_cstate called!\n"); abort(); }
+/* Generated stub for create_commit_tx */
+struct bitcoin_tx *create_commit_tx(const tal_t *ctx UNNEEDED,
+				    struct peer *peer UNNEEDED,
+				    const struct sha256 *rhash UNNEEDED,
+				    const struct channel_state *cstate UNNEEDED,
+				    enum side side UNNEEDED,
+				    bool *otherside_only UNNEEDED)
+{ fprintf(stderr, "create_commit_tx called!\n"); abort(); }
+/* Generated stub for feechange_state_from_name */
+enum feechange_state feechange_state_from_name(const char *name UNNEEDED)
+{ fprintf(stderr, "feechange_state_from_name called!\n"); abort(); }
+/* Generated stub for feechange_state_name */
+const char *feechange_state_name(enum feechange_state s UNNEEDED)
+{ fprintf(stderr, "feechange_state_name called!\n"); abort(); }
+/* Generated stub for find_peer */
+struct peer *find_peer(struct lightningd_state *dstate UNNEEDED, const struct pubkey *id UNNEEDED)
+{ fprintf(stderr, "find_peer called!\n"); abort(); }
+/* Generated stub for force_add_htlc */
+void force_add_htlc(struct channel_state *cstate UNNEEDED, const struct htlc *htlc UNNEEDED)
+{ fprintf(stderr, "force_add_htlc called!\n"); abort(); }
+/* Generated stub for force_fail_htlc */
+void force_fail_htlc(struct channel_state *cstate UNNEEDED, const struct htlc *htlc UNNEEDED)
+{ fprintf(stderr, "force_fail_htlc called!\n"); abort(); }
+/* Generated stub for force_fulfill_htlc */
+void force_fulfill_htlc(struct channel_state *cstate UNNEEDED, const struct htlc *htlc UNNEEDED)
+{ fprintf(stderr, "force_fulfill_htlc called!\n"); abort(); }
+/* Generated stub for initial_cstate */
+struct channel_state *initial_cstate(const tal_t *ctx UNNEEDED,
+				     uint64_t anchor_satoshis UNNEEDED,
+				     uint64_t fee_rate UNNEEDED,
+				     enum side side UNNEEDED)
+{ fprintf(stderr, "initial_cstate called!\n"); abort(); }
+/* Generated stub for invoice_add */
+void invoice_add(struct lightningd_state *dstate UNNEEDED,
+		 const struct rval *r UNNEEDED,
+		 u64 msatoshi UNNEEDED,
+		 const char *label UNNEEDED,
+		 u64 complete UNNEEDED,
+		 u64 expiry UNNEEDED)
+{ fprintf(stderr, "invoice_add called!\n"); abort(); }
+/* Generated stub for json_add_num */
+void json_add_num(struct json_result *result UNNEEDED, const char *fieldname UNNEEDED,
+		  unsigned int value UNNEEDED)
+{ fprintf(stderr, "json_add_num called!\n"); abort(); }
+/* Generated stub for json_add_string */
+void json_add_string(struct json_result *result UNNEEDED, const char *fieldname UNNEEDED, const char *value UNNEEDED)
+{ fprintf(stderr, "json_add_string called!\n"); abort(); }
+/* Generated stub for json_get_params */
+bool json_get_params(const char *buffer UNNEEDED, const jsmntok_t param[] UNNEEDED, ...)
+{ fprintf(stderr, "json_get_params called!\n"); abort(); }
+/* Generated stub for json_object_end */
+void json_object_end(struct json_result *ptr UNNEEDED)
+{ fprintf(stderr, "json_object_end called!\n"); abort(); }
+/* Generated stub for json_object_start */
+void json_object_start(struct json_result *ptr UNNEEDED, const char *fieldname UNNEEDED)
+{ fprintf(stderr, "json_object_start called!\n"); abort(); }
+/* Generated stub for json_tok_number */
+bool json_tok_number(const char *buffer UNNEEDED, const jsmntok_t *tok UNNEEDED,
+		     unsigned int *num UNNEEDED)
+{ fprintf(stderr, "json_tok_number called!\n"); abort(); }
+/* Generated stub for netaddr_from_blob */
+bool netaddr_from_blob(const void *linear UNNEEDED, size_t len UNNEEDED, struct netaddr *a UNNEEDED)
+{ fprintf(stderr, "netaddr_from_blob called!\n"); abort(); }
+/* Generated stub for netaddr_to_blob */
+u8 *netaddr_to_blob(const tal_t *ctx UNNEEDED, const struct netaddr *a UNNEEDED)
+{ fprintf(stderr, "netaddr_to_blob called!\n"); abort(); }
+/* Generated stub for new_commit_info */
+struct commit_info *new_commit_info(const tal_t *ctx UNNEEDED, u64 commit_num UNNEEDED)
+{ fprintf(stderr, "new_commit_info called!\n"); abort(); }
+/* Generated stub for new_feechange */
+struct feechange *new_feechange(struct peer *peer UNNEEDED,
+				u64 fee_rate UNNEEDED,
+				enum feechange_state state UNNEEDED)
+{ fprintf(stderr, "new_feechange called!\n"); abort(); }
+/* Generated stub for new_json_result */
+struct json_result *new_json_result(const tal_t *ctx UNNEEDED)
+{ fprintf(stderr, "new_json_result called!\n"); abort(); }
+/* Generated stub for new_peer */
+struct peer *new_peer(struct lightningd_state *dstate UNNEEDED,
+		      struct log *log UNNEEDED,
+		      enum state state UNNEEDED,
+		      enum state_input offer_anchor UNNEEDED)
+{ fprintf(stderr, "new_peer called!\n"); abort(); }
+/* Generated stub for notify_htlc_state */
+void notify_htlc_state(const struct htlc *h UNNEEDED, enum htlc_state oldstate UNNEEDED)
+{ fprintf(stderr, "notify_htlc_state called!\n"); abort(); }
+/* Generated stub for pay_add */
+bool pay_add(struct lightningd_state *dstate UNNEEDED,
+	     const struct sha256 *rhash UNNEEDED,
+	     u64 msatoshi UNNEEDED,
+	     const struct pubkey *ids UNNEEDED,
+	     struct htlc *htlc UNNEEDED,
+	     const u8 *fail UNNEEDED,
+	     const struct rval *r UNNEEDED)
+{ fprintf(stderr, "pay_add called!\n"); abort(); }
+/* Generated stub for pay_add_part */
+bool pay_add_part(struct lightningd_state *dstate UNNEEDED,
+		  const struct sha256 *rhash UNNEEDED,
+		  const struct pubkey *ids UNNEEDED,
+		  struct htlc *htlc UNNEEDED)
+{ fprintf(stderr, "pay_add_part called!\n"); abort(); }
+/* Generated stub for peer_get_revocation_hash */
+void peer_get_revocation_hash(const struct peer *peer UNNEEDED, u64 index UNNEEDED,
+			      struct sha256 *rhash UNNEEDED)
+{ fprintf(stderr, "peer_get_revocation_hash called!\n"); abort(); }
+/* Generated stub for peer_new_htlc */
+struct htlc *peer_new_htlc(struct peer *peer UNNEEDED, 
+			   u64 id UNNEEDED,
+			   u64 msatoshi UNNEEDED,
+			   const struct sha256 *rhash UNNEEDED,
+			   u32 expiry UNNEEDED,
+			   const u8 *route UNNEEDED,
+			   size_t route_len UNNEEDED,
+			   struct htlc *src UNNEEDED,
+			   enum htlc_state state UNNEEDED)
+{ fprintf(stderr, "peer_new_htlc called!\n"); abort(); }
+/* Generated stub for peer_secrets_for_db */
+void peer_secrets_for_db(const struct peer *peer UNNEEDED,
+			 const struct privkey **commit_privkey UNNEEDED,
+			 const struct privkey **final_privkey UNNEEDED,
+			 const struct sha256 **revocation_seed UNNEEDED)
+{ fprintf(stderr, "peer_secrets_for_db called!\n"); abort(); }
+/* Generated stub for peer_set_id */
+void peer_set_id(struct peer *peer UNNEEDED, const struct pubkey *id UNNEEDED)
+{ fprintf(stderr, "peer_set_id called!\n"); abort(); }
+/* Generated stub for peer_set_secrets_from_db */
+void peer_set_secrets_from_db(struct peer *peer UNNEEDED,
+			      const void *commit_privkey UNNEEDED,
+			      size_t commit_privkey_len UNNEEDED,
+			      const void *final_privkey UNNEEDED,
+			      size_t final_privkey_len UNNEEDED,
+			      const void *revocation_seed UNNEEDED,
+			      size_t revocation_seed_len UNNEEDED)
+{ fprintf(stderr, "peer_set_secrets_from_db called!\n"); abort(); }
+/* Generated stub for restore_wallet_address */
+bool restore_wallet_address(struct lightningd_state *dstate UNNEEDED,
+			    const struct privkey *privkey UNNEEDED)
+{ fprintf(stderr, "restore_wallet_address called!\n"); abort(); }
+/* Generated stub for restore_wallet_utxo */
+bool restore_wallet_utxo(struct lightningd_state *dstate UNNEEDED,
+			 const struct txwatch_output *out UNNEEDED, u64 amount UNNEEDED,
+			 const struct ripemd160 *p2sh UNNEEDED)
+{ fprintf(stderr, "restore_wallet_utxo called!\n"); abort(); }
+/* Generated stub for siphash_seed */
+const struct siphash_seed *siphash_seed(void)
+{ fprintf(stderr, "siphash_seed called!\n"); abort(); }
+/* Generated stub for startup_phase */
+struct timeabs startup_phase(struct lightningd_state *dstate UNNEEDED, const char *name UNNEEDED,
+			     struct timeabs start UNNEEDED, size_t count UNNEEDED)
+{ fprintf(stderr, "startup_phase called!\n"); abort(); }
+/* Generated stub for stats_htlc_state */
+void stats_htlc_state(struct htlc *h UNNEEDED, enum htlc_state oldstate UNNEEDED)
+{ fprintf(stderr, "stats_htlc_state called!\n"); abort(); }
+/* Generated stub for wallet_utxo_p2sh */
+const struct ripemd160 *wallet_utxo_p2sh(const struct wallet_utxo *u UNNEEDED)
+{ fprintf(stderr, "wallet_utxo_p2sh called!\n"); abort(); }
+/* AUTOGENERATED MOCKS END */
+
+/* These aren't declared the way the mock generator expects. */
+enum state name_to_state(const char *name UNNEEDED)
+{ fprintf(stderr, "name_to_state called!\n"); abort(); }
+struct log *new_log(const tal_t *ctx UNNEEDED,
+		    struct log_record *record UNNEEDED, const char *fmt UNNEEDED,
+		    ...)
+{ fprintf(stderr, "new_log called!\n"); abort(); }
+void peer_watch_anchor(struct peer *peer UNNEEDED, int depth UNNEEDED,
+		       enum state_input depthok UNNEEDED,
+		       enum state_input timeout UNNEEDED)
+{ fprintf(stderr, "peer_watch_anchor called!\n"); abort(); }
+const char *state_name(enum state s UNNEEDED)
+{ fprintf(stderr, "state_name called!\n"); abort(); }
+
+/* The database goes in the current directory. */
+char *node_file(const tal_t *ctx,
+		const struct lightningd_state *dstate UNNEEDED,
+		const char *name)
+{
+	return tal_strdup(ctx, name);
+}
+
+/* Logging and stats are no-ops for us. */
+void log_(struct log *log UNNEEDED, enum log_level level UNNEEDED,
+	  const char *fmt UNNEEDED, ...)
+{
+}
+void log_struct_(struct log *log UNNEEDED, int level UNNEEDED,
+		 const char *structname UNNEEDED,
+		 const char *fmt UNNEEDED, ...)
+{
+}
+void stats_latency(struct lightningd_state *dstate UNNEEDED,
+		   enum stats_latency which UNNEEDED, struct timeabs start UNNEEDED)
+{
+}
+
+void fatal(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	verrx(1, fmt, ap);
+}
+
+/* The loop runs these once everything else is done: so do we, after each
+ * round of peers. */
+struct bench_timer {
+	void (*cb)(void *);
+	void *arg;
+};
+static struct bench_timer timers[8];
+static size_t num_timers;
+
+struct oneshot *new_reltimer_(struct lightningd_state *dstate UNNEEDED,
+			      const tal_t *ctx UNNEEDED,
+			      struct timerel expire UNNEEDED,
+			      void (*cb)(void *), void *arg)
+{
+	if (num_timers == ARRAY_SIZE(timers))
+		errx(1, "Too many timers");
+	timers[num_timers].cb = cb;
+	timers[num_timers].arg = arg;
+	num_timers++;
+	return NULL;
+}
+
+static void run_timers(void)
+{
+	while (num_timers) {
+		struct bench_timer t = timers[--num_timers];
+		t.cb(t.arg);
+	}
+}
+
+/* sqlite writes and syncs with these: we count them on the way through. */
+static size_t syncs;
+static u64 bytes;
+
+int fsync(int fd)
+{
+	syncs++;
+	return syscall(SYS_fsync, fd);
+}
+
+int fdatasync(int fd)
+{
+	syncs++;
+	return syscall(SYS_fdatasync, fd);
+}
+
+ssize_t write(int fd, const void *buf, size_t count)
+{
+	ssize_t ret = syscall(SYS_write, fd, buf, count);
+
+	if (ret > 0)
+		bytes += ret;
+	return ret;
+}
+
+ssize_t pwrite64(int fd, const void *buf, size_t count, off_t offset)
+{
+	ssize_t ret = syscall(SYS_pwrite64, fd, buf, count, offset);
+
+	if (ret > 0)
+		bytes += ret;
+	return ret;
+}
+
+static struct lightningd_state *dstate;
+static size_t ops;
+
+static struct peer *new_bench_peer(unsigned int n)
+{
+	struct peer *peer = talz(dstate, struct peer);
+	struct privkey privkey;
+	enum side side;
+
+	peer->dstate = dstate;
+	peer->id = tal(peer, struct pubkey);
+	memset(&privkey, 0, sizeof(privkey));
+	privkey.secret[0] = 1;
+	memcpy(privkey.secret + 1, &n, sizeof(n));
+	if (!pubkey_from_privkey(dstate->secpctx, &privkey, peer->id))
+		abort();
+	peer->local.commit = talz(peer, struct commit_info);
+	peer->remote.commit = talz(peer, struct commit_info);
+	shachain_init(&peer->their_preimages);
+	htlc_map_init(&peer->htlcs);
+
+	/* db_set_anchor would have left these. */
+	for (side = LOCAL; side <= REMOTE; side++) {
+		struct db_op *stmt;
+
+		stmt = db_prepare(__func__, dstate,
+				  "INSERT INTO commit_info VALUES"
+				  " (?, ?, 0, ?, 0, NULL, NULL);");
+		db_bind_pubkey(dstate, stmt, 1, peer->id);
+		db_bind_str(stmt, 2, side_to_str(side));
+		db_bind_blob(stmt, 3, &peer->local.commit->revocation_hash,
+			     sizeof(struct sha256));
+		if (!db_step(__func__, dstate, stmt))
+			errx(1, "Adding commit_info: %s", dstate->db->err);
+	}
+	return peer;
+}
+
+static void move_htlcs(struct peer *peer, struct htlc *htlcs, size_t n,
+		       enum htlc_state from, enum htlc_state to)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		assert(htlcs[i].state == from);
+		htlcs[i].state = to;
+		/* The db doesn't see RCVD_REMOVE_HTLC. */
+		if (to == RCVD_REMOVE_HTLC)
+			continue;
+		if (to == SENT_ADD_COMMIT)
+			db_new_htlc(peer, &htlcs[i]);
+		else if (from == RCVD_REMOVE_HTLC)
+			db_update_htlc_state(peer, &htlcs[i],
+					     SENT_ADD_ACK_REVOCATION);
+		else
+			db_update_htlc_state(peer, &htlcs[i], from);
+		ops++;
+	}
+}
+
+static void commit(struct peer *peer, enum side side)
+{
+	struct commit_info *ci = side == LOCAL
+		? peer->local.commit : peer->remote.commit;
+	struct sha256 prev = ci->revocation_hash;
+
+	ci->commit_num++;
+	sha256(&ci->revocation_hash, &ci->commit_num, sizeof(ci->commit_num));
+	db_new_commit_info(peer, side, &prev);
+	ops++;
+	if (side == REMOTE) {
+		struct sha256_double txid;
+
+		sha256_double(&txid, &ci->commit_num, sizeof(ci->commit_num));
+		db_add_commit_map(peer, &txid, ci->commit_num);
+		ops++;
+	}
+}
+
+/* Their preimage for the commit they just revoked. */
+static void revoked(struct peer *peer)
+{
+	u64 index = 0xFFFFFFFFFFFFFFFFULL - (peer->remote.commit->commit_num - 1);
+	struct sha256 seed, preimage;
+
+	memset(&seed, 2, sizeof(seed));
+	shachain_from_seed(&seed, index, &preimage);
+	if (!shachain_add_hash(&peer->their_preimages, index, &preimage))
+		abort();
+	db_save_shachain(peer);
+	ops++;
+}
+
+/* One step for one peer, as its own transaction. */
+static void step(struct peer *peer, struct htlc *htlcs, size_t n,
+		 unsigned int stepnum)
+{
+	db_start_transaction(peer);
+	switch (stepnum) {
+	case 0:
+		/* We offer them, and commit. */
+		move_htlcs(peer, htlcs, n, SENT_ADD_HTLC, SENT_ADD_COMMIT);
+		commit(peer, REMOTE);
+		break;
+	case 1:
+		move_htlcs(peer, htlcs, n, SENT_ADD_COMMIT, RCVD_ADD_REVOCATION);
+		revoked(peer);
+		break;
+	case 2:
+		move_htlcs(peer, htlcs, n,
+			   RCVD_ADD_REVOCATION, RCVD_ADD_ACK_COMMIT);
+		commit(peer, LOCAL);
+		break;
+	case 3:
+		move_htlcs(peer, htlcs, n,
+			   RCVD_ADD_ACK_COMMIT, SENT_ADD_ACK_REVOCATION);
+		break;
+	case 4:
+		/* They fulfill, and commit. */
+		move_htlcs(peer, htlcs, n,
+			   SENT_ADD_ACK_REVOCATION, RCVD_REMOVE_HTLC);
+		move_htlcs(peer, htlcs, n, RCVD_REMOVE_HTLC, RCVD_REMOVE_COMMIT);
+		commit(peer, LOCAL);
+		break;
+	case 5:
+		move_htlcs(peer, htlcs, n,
+			   RCVD_REMOVE_COMMIT, SENT_REMOVE_REVOCATION);
+		break;
+	case 6:
+		move_htlcs(peer, htlcs, n,
+			   SENT_REMOVE_REVOCATION, SENT_REMOVE_ACK_COMMIT);
+		commit(peer, REMOTE);
+		break;
+	case 7:
+		move_htlcs(peer, htlcs, n,
+			   SENT_REMOVE_ACK_COMMIT, RCVD_REMOVE_ACK_REVOCATION);
+		revoked(peer);
+		break;
+	}
+	if (db_commit_transaction(peer))
+		errx(1, "Step %u: %s", stepnum, dstate->db->err);
+}
+
+static void run_mode(const char *name, bool wal, bool group,
+		     unsigned int num_peers, unsigned int per_commit,
+		     unsigned int rounds)
+{
+	struct peer **peers;
+	struct htlc **htlcs;
+	struct timeabs start;
+	struct timerel t;
+	double secs;
+	u64 bytes_start, next_id = 0;
+	size_t syncs_start, lifecycles;
+	unsigned int i, j, r, s;
+
+	unlink(DB_FILE);
+	unlink(DB_FILE "-wal");
+	unlink(DB_FILE "-shm");
+	dstate->config.db_wal = wal;
+	dstate->config.db_group_commit = group;
+	db_init(dstate);
+
+	peers = tal_arr(dstate, struct peer *, num_peers);
+	htlcs = tal_arr(dstate, struct htlc *, num_peers);
+	for (i = 0; i < num_peers; i++) {
+		peers[i] = new_bench_peer(i);
+		htlcs[i] = tal_arrz(peers[i], struct htlc, per_commit);
+	}
+
+	ops = 0;
+	syncs_start = syncs;
+	bytes_start = bytes;
+	start = time_now();
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < num_peers; i++) {
+			for (j = 0; j < per_commit; j++) {
+				struct htlc *h = &htlcs[i][j];
+				u8 *routing;
+
+				h->peer = peers[i];
+				h->id = next_id++;
+				h->state = SENT_ADD_HTLC;
+				h->msatoshi = 1000000;
+				blocks_to_abs_locktime(500000, &h->expiry);
+				sha256(&h->rhash, &h->id, sizeof(h->id));
+				/* Real onions all differ, so blobs can't
+				 * share them. */
+				routing = tal_arrz(peers[i], u8, ONION_LEN);
+				memcpy(routing, &h->rhash, sizeof(h->rhash));
+				h->routing = routing;
+			}
+		}
+		/* Each step is one pass of the loop, over every peer. */
+		for (s = 0; s < 8; s++) {
+			for (i = 0; i < num_peers; i++)
+				step(peers[i], htlcs[i], per_commit, s);
+			run_timers();
+		}
+		for (i = 0; i < num_peers; i++)
+			for (j = 0; j < per_commit; j++)
+				htlcs[i][j].routing
+					= tal_free(htlcs[i][j].routing);
+	}
+	t = time_between(time_now(), start);
+
+	lifecycles = (size_t)rounds * num_peers * per_commit;
+	secs = time_to_nsec(t) / 1000000000.0;
+	printf("%s %zu %.0f %"PRIu64" %.1f\n", name, lifecycles,
+	       ops / secs, (bytes - bytes_start) / lifecycles,
+	       (syncs - syncs_start) / secs);
+
+	tal_free(peers);
+	tal_free(htlcs);
+	dstate->db = tal_free(dstate->db);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int num_peers = 10, per_commit = 1, rounds = 100;
+	char dir[] = "/tmp/bench-db.XXXXXX";
+
+	opt_register_noarg("--help|-h", opt_usage_and_exit, "",
+			   "Print this message.");
+	opt_register_arg("--peers", opt_set_uintval, opt_show_uintval,
+			 &num_peers, "Peers doing HTLCs at once");
+	opt_register_arg("--htlcs", opt_set_uintval, opt_show_uintval,
+			 &per_commit, "HTLCs in each commitment");
+	opt_register_arg("--rounds", opt_set_uintval, opt_show_uintval,
+			 &rounds, "Lifecycles for each peer's HTLCs");
+	opt_parse(&argc, argv, opt_log_stderr_exit);
+	if (argc != 1)
+		opt_usage_exit_fail("No arguments expected");
+	if (num_peers == 0 || per_commit == 0 || rounds == 0)
+		opt_usage_exit_fail("Need at least one of each");
+
+	if (!mkdtemp(dir) || chdir(dir) != 0)
+		err(1, "Making %s", dir);
+
+	dstate = talz(NULL, struct lightningd_state);
+	dstate->secpctx = secp256k1_context_create(SECP256K1_CONTEXT_SIGN);
+	dstate->config.db_synchronous = DB_SYNC_FULL;
+	dstate->config.db_wal_checkpoint = 1000;
+
+	run_mode("delete", false, false, num_peers, per_commit, rounds);
+	run_mode("delete-group", false, true, num_peers, per_commit, rounds);
+	run_mode("wal", true, false, num_peers, per_commit, rounds);
+	run_mode("wal-group", true, true, num_peers, per_commit, rounds);
+
+	unlink(DB_FILE);
+	unlink(DB_FILE "-wal");
+	unlink(DB_FILE "-shm");
+	if (chdir("/") != 0 || rmdir(dir) != 0)
+		warn("Removing %s", dir);
+
+	secp256k1_context_destroy(dstate->secpctx);
+	tal_free(dstate);
+	opt_free_table();
+	return 0;
+}
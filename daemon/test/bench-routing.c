@@ -0,0 +1,422 @@
+/* Benchmark find_route on a recorded or synthetic graph.
+ *
+ * Recorded graphs are one route per line, as --add-route takes them:
+ * src/dst/base/var/delay/minblocks.  We route from the first node seen.
+ * Otherwise we grow a scale-free (Barabasi-Albert) graph of --nodes nodes,
+ * each new one linking to --degree existing nodes, preferring busy ones. */
+#include "daemon/routing.c"
+#include "daemon/test/bench_alloc.h"
+#include <ccan/asort/asort.h>
+#include <ccan/err/err.h>
+#include <ccan/tal/grab_file/grab_file.h>
+#include <ccan/tal/str/str.h>
+#include <ccan/time/time.h>
+#include <stdio.h>
+
+/* AUTOGENERATED MOCKS START */
+/* Generated stub for command_fail */
+void command_fail(struct command *cmd UNNEEDED, const char *fmt UNNEEDED, ...)
+{ fprintf(stderr, "command_fail called!\n"); abort(); }
+/* Generated stub for command_success */
+void command_success(struct command *cmd UNNEEDED, struct json_result *response UNNEEDED)
+{ fprintf(stderr, "command_success called!\n"); abort(); }
+/* Generated stub for fatal */
+void fatal(const char *fmt UNNEEDED, ...)
+{ fprintf(stderr, "fatal called!\n"); abort(); }
+/* Generated stub for json_add_literal */
+void json_add_literal(struct json_result *result UNNEEDED, const char *fieldname UNNEEDED,
+		      const char *literal UNNEEDED, int len UNNEEDED)
+{ fprintf(stderr, "json_add_literal called!\n"); abort(); }
+/* Generated stub for json_add_num */
+void json_add_num(struct json_result *result UNNEEDED, const char *fieldname UNNEEDED,
+		  unsigned int value UNNEEDED)
+{ fprintf(stderr, "json_add_num called!\n"); abort(); }
+/* Generated stub for json_add_pubkey */
+void json_add_pubkey(struct json_result *response UNNEEDED,
+		     secp256k1_context *secpctx UNNEEDED,
+		     const char *fieldname UNNEEDED,
+		     const struct pubkey *key UNNEEDED)
+{ fprintf(stderr, "json_add_pubkey called!\n"); abort(); }
+/* Generated stub for json_add_u64 */
+void json_add_u64(struct json_result *result UNNEEDED, const char *fieldname UNNEEDED,
+		  uint64_t value UNNEEDED)
+{ fprintf(stderr, "json_add_u64 called!\n"); abort(); }
+/* Generated stub for json_array_end */
+void json_array_end(struct json_result *ptr UNNEEDED)
+{ fprintf(stderr, "json_array_end called!\n"); abort(); }
+/* Generated stub for json_array_start */
+void json_array_start(struct json_result *ptr UNNEEDED, const char *fieldname UNNEEDED)
+{ fprintf(stderr, "json_array_start called!\n"); abort(); }
+/* Generated stub for json_get_params */
+bool json_get_params(const char *buffer UNNEEDED, const jsmntok_t param[] UNNEEDED, ...)
+{ fprintf(stderr, "json_get_params called!\n"); abort(); }
+/* Generated stub for json_next */
+const jsmntok_t *json_next(const jsmntok_t *tok UNNEEDED)
+{ fprintf(stderr, "json_next called!\n"); abort(); }
+/* Generated stub for json_object_end */
+void json_object_end(struct json_result *ptr UNNEEDED)
+{ fprintf(stderr, "json_object_end called!\n"); abort(); }
+/* Generated stub for json_object_start */
+void json_object_start(struct json_result *ptr UNNEEDED, const char *fieldname UNNEEDED)
+{ fprintf(stderr, "json_object_start called!\n"); abort(); }
+/* Generated stub for json_tok_bool */
+bool json_tok_bool(const char *buffer UNNEEDED, const jsmntok_t *tok UNNEEDED, bool *b UNNEEDED)
+{ fprintf(stderr, "json_tok_bool called!\n"); abort(); }
+/* Generated stub for json_tok_number */
+bool json_tok_number(const char *buffer UNNEEDED, const jsmntok_t *tok UNNEEDED,
+		     unsigned int *num UNNEEDED)
+{ fprintf(stderr, "json_tok_number called!\n"); abort(); }
+/* Generated stub for json_tok_u64 */
+bool json_tok_u64(const char *buffer UNNEEDED, const jsmntok_t *tok UNNEEDED,
+		  uint64_t *num UNNEEDED)
+{ fprintf(stderr, "json_tok_u64 called!\n"); abort(); }
+/* Generated stub for log_suspend */
+void log_suspend(struct log_record *lr UNNEEDED)
+{ fprintf(stderr, "log_suspend called!\n"); abort(); }
+/* Generated stub for new_json_result */
+struct json_result *new_json_result(const tal_t *ctx UNNEEDED)
+{ fprintf(stderr, "new_json_result called!\n"); abort(); }
+/* Generated stub for null_response */
+struct json_result *null_response(const tal_t *ctx UNNEEDED)
+{ fprintf(stderr, "null_response called!\n"); abort(); }
+/* AUTOGENERATED MOCKS END */
+
+/* Logging is a no-op for us. */
+void log_(struct log *log UNNEEDED, enum log_level level UNNEEDED,
+	  const char *fmt UNNEEDED, ...)
+{
+}
+void log_add(struct log *log UNNEEDED, const char *fmt UNNEEDED, ...)
+{
+}
+void log_struct_(struct log *log UNNEEDED, int level UNNEEDED,
+		 const char *structname UNNEEDED,
+		 const char *fmt UNNEEDED, ...)
+{
+}
+
+/* We time searches ourselves. */
+void stats_latency(struct lightningd_state *dstate UNNEEDED,
+		   enum stats_latency which UNNEEDED, struct timeabs start UNNEEDED)
+{
+}
+
+const struct siphash_seed *siphash_seed(void)
+{
+	static struct siphash_seed seed;
+	return &seed;
+}
+
+struct timeabs controlled_time(void)
+{
+	return time_now();
+}
+
+struct peer *find_peer(struct lightningd_state *dstate,
+		       const struct pubkey *id)
+{
+	struct peer *peer;
+
+	list_for_each(&dstate->peers, peer, list)
+		if (structeq(peer->id, id))
+			return peer;
+	return NULL;
+}
+
+/* With plenty to spend. */
+u64 peer_sendable_msat(const struct peer *peer)
+{
+	return UINT64_MAX;
+}
+
+static void make_pubkey(secp256k1_context *secpctx, struct pubkey *id,
+			unsigned int seed)
+{
+	unsigned char privkey[32];
+
+	/* Zero isn't a valid key. */
+	memset(privkey, 0, sizeof(privkey));
+	privkey[27] = 1;
+	privkey[28] = seed >> 24;
+	privkey[29] = seed >> 16;
+	privkey[30] = seed >> 8;
+	privkey[31] = seed;
+	if (!secp256k1_ec_pubkey_create(secpctx, &id->pubkey, privkey))
+		abort();
+}
+
+static void load_graph(struct lightningd_state *dstate, const char *file)
+{
+	char *contents = grab_file(dstate, file), **lines;
+	size_t i;
+
+	if (!contents)
+		err(1, "Reading %s", file);
+
+	lines = tal_strsplit(contents, contents, "\n", STR_NO_EMPTY);
+	for (i = 0; lines[i]; i++) {
+		char *msg = opt_add_route(lines[i], dstate);
+		if (msg)
+			errx(1, "%s:%zu: %s", file, i + 1, msg);
+	}
+	tal_free(contents);
+
+	if (tal_count(dstate->rstate->by_index) < 2)
+		errx(1, "%s: need at least two nodes", file);
+	dstate->id = node_by_index(dstate->rstate, 0)->id;
+}
+
+static void add_channel(struct lightningd_state *dstate,
+			const struct pubkey *a, const struct pubkey *b)
+{
+	add_connection(dstate, a, b, random() % 1000, random() % 10000,
+		       random() % 144, 0, 0);
+	add_connection(dstate, b, a, random() % 1000, random() % 10000,
+		       random() % 144, 0, 0);
+}
+
+static void make_graph(struct lightningd_state *dstate,
+		       size_t num_nodes, size_t degree)
+{
+	struct pubkey *ids = tal_arr(dstate, struct pubkey, num_nodes);
+	/* Every channel end: picking from this prefers busy nodes. */
+	u32 *ends = tal_arr(dstate, u32, 0);
+	u32 *picked = tal_arr(dstate, u32, degree);
+	size_t i, j, k, n = 0;
+
+	if (num_nodes <= degree || degree == 0)
+		errx(1, "Need --nodes > --degree > 0");
+
+	for (i = 0; i < num_nodes; i++) {
+		make_pubkey(dstate->secpctx, &ids[i], i);
+		new_node(dstate, &ids[i]);
+	}
+
+	/* Seed nodes are all equally likely to start with. */
+	for (i = 0; i < degree; i++) {
+		tal_resize(&ends, n + 1);
+		ends[n++] = i;
+	}
+
+	for (i = degree; i < num_nodes; i++) {
+		for (j = 0; j < degree; j++) {
+			do {
+				picked[j] = ends[random() % n];
+				for (k = 0; k < j; k++)
+					if (picked[k] == picked[j])
+						break;
+			} while (k != j);
+		}
+		tal_resize(&ends, n + degree * 2);
+		for (j = 0; j < degree; j++) {
+			add_channel(dstate, &ids[i], &ids[picked[j]]);
+			ends[n++] = i;
+			ends[n++] = picked[j];
+		}
+	}
+	dstate->id = ids[0];
+
+	tal_free(picked);
+	tal_free(ends);
+	tal_free(ids);
+}
+
+/* A peer for each node we have a channel to. */
+static void add_peers(struct lightningd_state *dstate)
+{
+	struct routing_state *rstate = dstate->rstate;
+	u32 us = get_node(dstate, &dstate->id)->index;
+	size_t n;
+
+	list_head_init(&dstate->peers);
+	for (n = 0; n < tal_count(rstate->by_index); n++) {
+		struct node *node = rstate->by_index[n];
+		struct peer *peer;
+
+		if (!find_in(node, us))
+			continue;
+		peer = talz(dstate, struct peer);
+		peer->id = &node->id;
+		list_add_tail(&dstate->peers, &peer->list);
+	}
+}
+
+static int cmp_u64(const u64 *a, const u64 *b, void *unused)
+{
+	if (*a < *b)
+		return -1;
+	return *a > *b;
+}
+
+static u64 percentile(const u64 *sorted, size_t num, unsigned int pct)
+{
+	return sorted[(num - 1) * pct / 100];
+}
+
+static void bench(struct lightningd_state *dstate, enum route_engine engine,
+		  size_t queries, u64 msatoshi, bool use_cache)
+{
+	struct routing_state *rstate = dstate->rstate;
+	size_t num_nodes = tal_count(rstate->by_index);
+	u64 *nsec = tal_arr(dstate, u64, queries);
+	size_t i, found = 0, hops = 0;
+	char buf[OPT_SHOW_LEN];
+
+	dstate->config.route_engine = engine;
+	for (i = 0; i < queries; i++) {
+		struct node *dst;
+		struct node_connection *route;
+		struct peer *first;
+		struct timeabs start;
+		s64 fee;
+
+		do {
+			dst = node_by_index(rstate, random() % num_nodes);
+		} while (structeq(&dst->id, &dstate->id));
+
+		start = time_now();
+		first = find_route(dstate, &dst->id, msatoshi, 1, &fee, &route);
+		nsec[i] = time_to_nsec(time_between(time_now(), start));
+
+		if (first) {
+			found++;
+			hops += tal_count(route) + 1;
+			tal_free(route);
+		}
+
+		/* Otherwise we'd mainly be timing the cache. */
+		while (!use_cache && !list_empty(&rstate->route_lru))
+			tal_free(list_top(&rstate->route_lru,
+					  struct cached_route, list));
+	}
+
+	asort(nsec, queries, cmp_u64, NULL);
+	opt_show_route_engine(buf, &engine);
+	printf("%s: %zu/%zu routes found, %.1f hops average\n",
+	       buf, found, queries, found ? (double)hops / found : 0.0);
+	printf("%s: usec p50 %"PRIu64" p90 %"PRIu64" p99 %"PRIu64
+	       " max %"PRIu64"\n", buf,
+	       percentile(nsec, queries, 50) / 1000,
+	       percentile(nsec, queries, 90) / 1000,
+	       percentile(nsec, queries, 99) / 1000,
+	       nsec[queries - 1] / 1000);
+	if (use_cache)
+		printf("%s: cache hits %"PRIu64" misses %"PRIu64"\n", buf,
+		       rstate->route_cache_hits, rstate->route_cache_misses);
+	tal_free(nsec);
+}
+
+/* The same number of destinations, from one search. */
+static void bench_many(struct lightningd_state *dstate, size_t queries,
+		       u64 msatoshi)
+{
+	struct routing_state *rstate = dstate->rstate;
+	size_t num_nodes = tal_count(rstate->by_index);
+	struct pubkey *to = tal_arr(dstate, struct pubkey, queries);
+	struct alt_route *routes;
+	struct timeabs start;
+	size_t i, found = 0, hops = 0;
+	u64 nsec;
+
+	for (i = 0; i < queries; i++) {
+		struct node *dst;
+		do {
+			dst = node_by_index(rstate, random() % num_nodes);
+		} while (structeq(&dst->id, &dstate->id));
+		to[i] = dst->id;
+	}
+
+	start = time_now();
+	routes = find_routes_many(dstate, dstate, to, queries, msatoshi, 1);
+	nsec = time_to_nsec(time_between(time_now(), start));
+
+	for (i = 0; i < queries; i++) {
+		if (!routes[i].peer)
+			continue;
+		found++;
+		hops += tal_count(routes[i].route) + 1;
+	}
+	printf("many: %zu/%zu routes found, %.1f hops average\n",
+	       found, queries, found ? (double)hops / found : 0.0);
+	printf("many: usec total %"PRIu64", %"PRIu64" per route\n",
+	       nsec / 1000, nsec / 1000 / queries);
+	tal_free(routes);
+	tal_free(to);
+}
+
+static char *opt_set_engine(const char *arg, enum route_engine **engine)
+{
+	*engine = tal(NULL, enum route_engine);
+	return opt_set_route_engine(arg, *engine);
+}
+
+int main(int argc, char *argv[])
+{
+	struct lightningd_state *dstate;
+	char *graph = NULL;
+	unsigned int nodes = 10000, degree = 2, queries = 1000, seed = 1;
+	unsigned long long msatoshi = 100000;
+	enum route_engine *engine = NULL;
+	bool use_cache = false, many = false;
+	size_t before;
+
+	bench_alloc_init();
+
+	opt_register_noarg("--help|-h", opt_usage_and_exit, "",
+			   "Print this message.");
+	opt_register_arg("--graph", opt_set_charp, NULL, &graph,
+			 "Load routes from this file instead of generating");
+	opt_register_arg("--nodes", opt_set_uintval, opt_show_uintval, &nodes,
+			 "Number of nodes to generate");
+	opt_register_arg("--degree", opt_set_uintval, opt_show_uintval,
+			 &degree, "Channels each generated node opens");
+	opt_register_arg("--seed", opt_set_uintval, opt_show_uintval, &seed,
+			 "Random seed for graph and queries");
+	opt_register_arg("--queries", opt_set_uintval, opt_show_uintval,
+			 &queries, "Number of find_route calls per engine");
+	opt_register_arg("--msatoshi", opt_set_ulonglongval_si,
+			 opt_show_ulonglongval_si, &msatoshi,
+			 "Amount to route");
+	opt_register_arg("--engine", opt_set_engine, NULL, &engine,
+			 "Only benchmark this engine (dijkstra or bfg)");
+	opt_register_noarg("--cache", opt_set_bool, &use_cache,
+			   "Leave the route cache on");
+	opt_register_noarg("--many", opt_set_bool, &many,
+			   "Also find routes to --queries nodes in one search");
+	opt_parse(&argc, argv, opt_log_stderr_exit);
+	if (argc != 1)
+		opt_usage_exit_fail("No arguments expected");
+	if (queries == 0)
+		opt_usage_exit_fail("Need at least one query");
+
+	srandom(seed);
+	dstate = tal(NULL, struct lightningd_state);
+	dstate->secpctx = secp256k1_context_create(SECP256K1_CONTEXT_SIGN);
+	dstate->base_log = NULL;
+
+	before = allocated;
+	dstate->rstate = new_routing_state(dstate);
+	if (graph)
+		load_graph(dstate, graph);
+	else
+		make_graph(dstate, nodes, degree);
+
+	printf("%zu nodes, %zu bytes per node\n",
+	       tal_count(dstate->rstate->by_index),
+	       (allocated - before) / tal_count(dstate->rstate->by_index));
+	add_peers(dstate);
+
+	if (!engine || *engine == ROUTE_ENGINE_DIJKSTRA)
+		bench(dstate, ROUTE_ENGINE_DIJKSTRA, queries, msatoshi,
+		      use_cache);
+	if (!engine || *engine == ROUTE_ENGINE_BFG)
+		bench(dstate, ROUTE_ENGINE_BFG, queries, msatoshi, use_cache);
+	if (many)
+		bench_many(dstate, queries, msatoshi);
+
+	secp256k1_context_destroy(dstate->secpctx);
+	tal_free(dstate);
+	tal_free(engine);
+	opt_free_table();
+	return 0;
+}
@@ -0,0 +1,609 @@
+/* Generate a database for the startup benchmark (bench-startup.sh): peers
+ * with normal channels, live HTLCs, a history of archived HTLCs, invoices
+ * and pay commands, written through db.c so it's exactly what lightningd
+ * would have left.
+ *
+ * Usage: bench-startup [options] <lightning-dir> */
+#include "daemon/db.c"
+#include "daemon/htlc.c"
+#include "daemon/onion.h"
+#include <ccan/err/err.h>
+#include <ccan/opt/opt.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* AUTOGENERATED MOCKS START */
+/* Generated stub for add_connection */
+void add_connection(struct lightningd_state *dstate UNNEEDED,
+		    const struct pubkey *from UNNEEDED,
+		    const struct pubkey *to UNNEEDED,
+		    u32 base_fee UNNEEDED, s32 proportional_fee UNNEEDED,
+		    u32 delay UNNEEDED, u32 min_blocks UNNEEDED, u64 capacity_msat UNNEEDED)
+{ fprintf(stderr, "add_connection called!\n"); abort(); }
+/* Generated stub for balance_after_force */
+bool balance_after_force(struct channel_state *cstate UNNEEDED)
+{ fprintf(stderr, "balance_after_force called!\n"); abort(); }
+/* Generated stub for command_fail */
+void command_fail(struct command *cmd UNNEEDED, const char *fmt UNNEEDED, ...)
+{ fprintf(stderr, "command_fail called!\n"); abort(); }
+/* Generated stub for command_success */
+void command_success(struct command *cmd UNNEEDED, struct json_result *response UNNEEDED)
+{ fprintf(stderr, "command_success called!\n"); abort(); }
+/* Generated stub for copy_cstate */
+struct channel_state *copy_cstate(const tal_t *ctx UNNEEDED,
+				  const struct channel_state *cstate UNNEEDED)
+{ fprintf(stderr, "copy_cstate called!\n"); abort(); }
+/* Generated stub for create_commit_tx */
+struct bitcoin_tx *create_commit_tx(const tal_t *ctx UNNEEDED,
+				    struct peer *peer UNNEEDED,
+				    const struct sha256 *rhash UNNEEDED,
+				    const struct channel_state *cstate UNNEEDED,
+				    enum side side UNNEEDED,
+				    bool *otherside_only UNNEEDED)
+{ fprintf(stderr, "create_commit_tx called!\n"); abort(); }
+/* Generated stub for feechange_state_from_name */
+enum feechange_state feechange_state_from_name(const char *name UNNEEDED)
+{ fprintf(stderr, "feechange_state_from_name called!\n"); abort(); }
+/* Generated stub for feechange_state_name */
+const char *feechange_state_name(enum feechange_state s UNNEEDED)
+{ fprintf(stderr, "feechange_state_name called!\n"); abort(); }
+/* Generated stub for find_peer */
+struct peer *find_peer(struct lightningd_state *dstate UNNEEDED, const struct pubkey *id UNNEEDED)
+{ fprintf(stderr, "find_peer called!\n"); abort(); }
+/* Generated stub for force_add_htlc */
+void force_add_htlc(struct channel_state *cstate UNNEEDED, const struct htlc *htlc UNNEEDED)
+{ fprintf(stderr, "force_add_htlc called!\n"); abort(); }
+/* Generated stub for force_fail_htlc */
+void force_fail_htlc(struct channel_state *cstate UNNEEDED, const struct htlc *htlc UNNEEDED)
+{ fprintf(stderr, "force_fail_htlc called!\n"); abort(); }
+/* Generated stub for force_fulfill_htlc */
+void force_fulfill_htlc(struct channel_state *cstate UNNEEDED, const struct htlc *htlc UNNEEDED)
+{ fprintf(stderr, "force_fulfill_htlc called!\n"); abort(); }
+/* Generated stub for initial_cstate */
+struct channel_state *initial_cstate(const tal_t *ctx UNNEEDED,
+				     uint64_t anchor_satoshis UNNEEDED,
+				     uint64_t fee_rate UNNEEDED,
+				     enum side side UNNEEDED)
+{ fprintf(stderr, "initial_cstate called!\n"); abort(); }
+/* Generated stub for invoice_add */
+void invoice_add(struct lightningd_state *dstate UNNEEDED,
+		 const struct rval *r UNNEEDED,
+		 u64 msatoshi UNNEEDED,
+		 const char *label UNNEEDED,
+		 u64 complete UNNEEDED,
+		 u64 expiry UNNEEDED)
+{ fprintf(stderr, "invoice_add called!\n"); abort(); }
+/* Generated stub for json_add_num */
+void json_add_num(struct json_result *result UNNEEDED, const char *fieldname UNNEEDED,
+		  unsigned int value UNNEEDED)
+{ fprintf(stderr, "json_add_num called!\n"); abort(); }
+/* Generated stub for json_add_string */
+void json_add_string(struct json_result *result UNNEEDED, const char *fieldname UNNEEDED, const char *value UNNEEDED)
+{ fprintf(stderr, "json_add_string called!\n"); abort(); }
+/* Generated stub for json_get_params */
+bool json_get_params(const char *buffer UNNEEDED, const jsmntok_t param[] UNNEEDED, ...)
+{ fprintf(stderr, "json_get_params called!\n"); abort(); }
+/* Generated stub for json_object_end */
+void json_object_end(struct json_result *ptr UNNEEDED)
+{ fprintf(stderr, "json_object_end called!\n"); abort(); }
+/* Generated stub for json_object_start */
+void json_object_start(struct json_result *ptr UNNEEDED, const char *fieldname UNNEEDED)
+{ fprintf(stderr, "json_object_start called!\n"); abort(); }
+/* Generated stub for json_tok_number */
+bool json_tok_number(const char *buffer UNNEEDED, const jsmntok_t *tok UNNEEDED,
+		     unsigned int *num UNNEEDED)
+{ fprintf(stderr, "json_tok_number called!\n"); abort(); }
+/* Generated stub for netaddr_from_blob */
+bool netaddr_from_blob(const void *linear UNNEEDED, size_t len UNNEEDED, struct netaddr *a UNNEEDED)
+{ fprintf(stderr, "netaddr_from_blob called!\n"); abort(); }
+/* Generated stub for netaddr_to_blob */
+u8 *netaddr_to_blob(const tal_t *ctx UNNEEDED, const struct netaddr *a UNNEEDED)
+{ fprintf(stderr, "netaddr_to_blob called!\n"); abort(); }
+/* Generated stub for new_commit_info */
+struct commit_info *new_commit_info(const tal_t *ctx UNNEEDED, u64 commit_num UNNEEDED)
+{ fprintf(stderr, "new_commit_info called!\n"); abort(); }
+/* Generated stub for new_feechange */
+struct feechange *new_feechange(struct peer *peer UNNEEDED,
+				u64 fee_rate UNNEEDED,
+				enum feechange_state state UNNEEDED)
+{ fprintf(stderr, "new_feechange called!\n"); abort(); }
+/* Generated stub for new_json_result */
+struct json_result *new_json_result(const tal_t *ctx UNNEEDED)
+{ fprintf(stderr, "new_json_result called!\n"); abort(); }
+/* Generated stub for new_peer */
+struct peer *new_peer(struct lightningd_state *dstate UNNEEDED,
+		      struct log *log UNNEEDED,
+		      enum state state UNNEEDED,
+		      enum state_input offer_anchor UNNEEDED)
+{ fprintf(stderr, "new_peer called!\n"); abort(); }
+/* Generated stub for notify_htlc_state */
+void notify_htlc_state(const struct htlc *h UNNEEDED, enum htlc_state oldstate UNNEEDED)
+{ fprintf(stderr, "notify_htlc_state called!\n"); abort(); }
+/* Generated stub for pay_add */
+bool pay_add(struct lightningd_state *dstate UNNEEDED,
+	     const struct sha256 *rhash UNNEEDED,
+	     u64 msatoshi UNNEEDED,
+	     const struct pubkey *ids UNNEEDED,
+	     struct htlc *htlc UNNEEDED,
+	     const u8 *fail UNNEEDED,
+	     const struct rval *r UNNEEDED)
+{ fprintf(stderr, "pay_add called!\n"); abort(); }
+/* Generated stub for pay_add_part */
+bool pay_add_part(struct lightningd_state *dstate UNNEEDED,
+		  const struct sha256 *rhash UNNEEDED,
+		  const struct pubkey *ids UNNEEDED,
+		  struct htlc *htlc UNNEEDED)
+{ fprintf(stderr, "pay_add_part called!\n"); abort(); }
+/* Generated stub for peer_get_revocation_hash */
+void peer_get_revocation_hash(const struct peer *peer UNNEEDED, u64 index UNNEEDED,
+			      struct sha256 *rhash UNNEEDED)
+{ fprintf(stderr, "peer_get_revocation_hash called!\n"); abort(); }
+/* Generated stub for peer_new_htlc */
+struct htlc *peer_new_htlc(struct peer *peer UNNEEDED, 
+			   u64 id UNNEEDED,
+			   u64 msatoshi UNNEEDED,
+			   const struct sha256 *rhash UNNEEDED,
+			   u32 expiry UNNEEDED,
+			   const u8 *route UNNEEDED,
+			   size_t route_len UNNEEDED,
+			   struct htlc *src UNNEEDED,
+			   enum htlc_state state UNNEEDED)
+{ fprintf(stderr, "peer_new_htlc called!\n"); abort(); }
+/* Generated stub for peer_set_id */
+void peer_set_id(struct peer *peer UNNEEDED, const struct pubkey *id UNNEEDED)
+{ fprintf(stderr, "peer_set_id called!\n"); abort(); }
+/* Generated stub for peer_set_secrets_from_db */
+void peer_set_secrets_from_db(struct peer *peer UNNEEDED,
+			      const void *commit_privkey UNNEEDED,
+			      size_t commit_privkey_len UNNEEDED,
+			      const void *final_privkey UNNEEDED,
+			      size_t final_privkey_len UNNEEDED,
+			      const void *revocation_seed UNNEEDED,
+			      size_t revocation_seed_len UNNEEDED)
+{ fprintf(stderr, "peer_set_secrets_from_db called!\n"); abort(); }
+/* Generated stub for restore_wallet_address */
+bool restore_wallet_address(struct lightningd_state *dstate UNNEEDED,
+			    const struct privkey *privkey UNNEEDED)
+{ fprintf(stderr, "restore_wallet_address called!\n"); abort(); }
+/* Generated stub for restore_wallet_utxo */
+bool restore_wallet_utxo(struct lightningd_state *dstate UNNEEDED,
+			 const struct txwatch_output *out UNNEEDED, u64 amount UNNEEDED,
+			 const struct ripemd160 *p2sh UNNEEDED)
+{ fprintf(stderr, "restore_wallet_utxo called!\n"); abort(); }
+/* Generated stub for siphash_seed */
+const struct siphash_seed *siphash_seed(void)
+{ fprintf(stderr, "siphash_seed called!\n"); abort(); }
+/* Generated stub for startup_phase */
+struct timeabs startup_phase(struct lightningd_state *dstate UNNEEDED, const char *name UNNEEDED,
+			     struct timeabs start UNNEEDED, size_t count UNNEEDED)
+{ fprintf(stderr, "startup_phase called!\n"); abort(); }
+/* Generated stub for stats_htlc_state */
+void stats_htlc_state(struct htlc *h UNNEEDED, enum htlc_state oldstate UNNEEDED)
+{ fprintf(stderr, "stats_htlc_state called!\n"); abort(); }
+/* Generated stub for wallet_utxo_p2sh */
+const struct ripemd160 *wallet_utxo_p2sh(const struct wallet_utxo *u UNNEEDED)
+{ fprintf(stderr, "wallet_utxo_p2sh called!\n"); abort(); }
+/* AUTOGENERATED MOCKS END */
+
+/* These aren't declared the way the mock generator expects. */
+struct log *new_log(const tal_t *ctx UNNEEDED,
+		    struct log_record *record UNNEEDED, const char *fmt UNNEEDED,
+		    ...)
+{ fprintf(stderr, "new_log called!\n"); abort(); }
+void peer_watch_anchor(struct peer *peer UNNEEDED, int depth UNNEEDED,
+		       enum state_input depthok UNNEEDED,
+		       enum state_input timeout UNNEEDED)
+{ fprintf(stderr, "peer_watch_anchor called!\n"); abort(); }
+enum state name_to_state(const char *name UNNEEDED)
+{ fprintf(stderr, "name_to_state called!\n"); abort(); }
+
+/* Every channel we make is normal. */
+const char *state_name(enum state s)
+{
+	assert(s == STATE_NORMAL);
+	return "STATE_NORMAL";
+}
+
+/* The database goes in the current directory. */
+char *node_file(const tal_t *ctx,
+		const struct lightningd_state *dstate UNNEEDED,
+		const char *name)
+{
+	return tal_strdup(ctx, name);
+}
+
+/* Logging and stats are no-ops for us, and we're gone before any timer. */
+void log_(struct log *log UNNEEDED, enum log_level level UNNEEDED,
+	  const char *fmt UNNEEDED, ...)
+{
+}
+void log_struct_(struct log *log UNNEEDED, int level UNNEEDED,
+		 const char *structname UNNEEDED,
+		 const char *fmt UNNEEDED, ...)
+{
+}
+void stats_latency(struct lightningd_state *dstate UNNEEDED,
+		   enum stats_latency which UNNEEDED, struct timeabs start UNNEEDED)
+{
+}
+struct oneshot *new_reltimer_(struct lightningd_state *dstate UNNEEDED,
+			      const tal_t *ctx UNNEEDED,
+			      struct timerel expire UNNEEDED,
+			      void (*cb)(void *) UNNEEDED, void *arg UNNEEDED)
+{
+	return NULL;
+}
+
+void fatal(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	verrx(1, fmt, ap);
+}
+
+/* Each channel is this big, and we paid for it. */
+#define BENCH_ANCHOR_SATOSHIS	10000000
+#define BENCH_FEE_RATE		5000
+/* Far enough off that nothing times out while we look. */
+#define BENCH_EXPIRY		400000
+#define BENCH_HTLC_MSAT		100000
+
+/* Keys no one will check: they just have to be valid, and differ. */
+enum bench_key {
+	KEY_ID = 1,
+	KEY_COMMIT,
+	KEY_FINAL,
+	KEY_THEIR_COMMIT,
+	KEY_THEIR_FINAL
+};
+
+static struct lightningd_state *dstate;
+
+/* Each peer's share of the HTLCs. */
+struct bench_peer {
+	struct peer *peer;
+	unsigned int n;
+	u64 archived, live;
+};
+
+/* What db_create_peer() saves, via peer_secrets_for_db(). */
+static struct privkey commit_privkey, final_privkey;
+static struct sha256 revocation_seed;
+
+void peer_secrets_for_db(const struct peer *peer UNNEEDED,
+			 const struct privkey **commit,
+			 const struct privkey **final,
+			 const struct sha256 **seed)
+{
+	*commit = &commit_privkey;
+	*final = &final_privkey;
+	*seed = &revocation_seed;
+}
+
+static void bench_privkey(struct privkey *privkey, enum bench_key key,
+			  unsigned int n)
+{
+	memset(privkey, 0, sizeof(*privkey));
+	privkey->secret[0] = key;
+	memcpy(privkey->secret + 1, &n, sizeof(n));
+}
+
+static void bench_pubkey(struct pubkey *pubkey, enum bench_key key,
+			 unsigned int n)
+{
+	struct privkey privkey;
+
+	bench_privkey(&privkey, key, n);
+	if (!pubkey_from_privkey(dstate->secpctx, &privkey, pubkey))
+		abort();
+}
+
+/* A normal channel, which has been through @commits commitments each way
+ * and had half its funds paid across already. */
+static struct peer *new_bench_peer(unsigned int n, u64 commits)
+{
+	struct peer *peer = talz(dstate, struct peer);
+	struct commit_info *ci;
+	struct sha256 seed;
+	struct sha256_double h;
+	struct privkey signer;
+	struct db_op *stmt;
+	u64 i;
+
+	peer->dstate = dstate;
+	peer->id = tal(peer, struct pubkey);
+	bench_pubkey(peer->id, KEY_ID, n);
+	peer->state = STATE_NORMAL;
+	peer->local.offer_anchor = CMD_OPEN_WITH_ANCHOR;
+	peer->local.commit_fee_rate = BENCH_FEE_RATE;
+	bench_privkey(&commit_privkey, KEY_COMMIT, n);
+	bench_privkey(&final_privkey, KEY_FINAL, n);
+	sha256(&revocation_seed, &n, sizeof(n));
+	if (!db_create_peer(peer))
+		errx(1, "Creating peer %u: %s", n, dstate->db->err);
+
+	peer->remote.offer_anchor = CMD_OPEN_WITHOUT_ANCHOR;
+	bench_pubkey(&peer->remote.commitkey, KEY_THEIR_COMMIT, n);
+	bench_pubkey(&peer->remote.finalkey, KEY_THEIR_FINAL, n);
+	if (!blocks_to_rel_locktime(6, &peer->remote.locktime))
+		abort();
+	peer->remote.mindepth = 3;
+	peer->remote.commit_fee_rate = BENCH_FEE_RATE;
+	sha256(&peer->remote.next_revocation_hash, &commits, sizeof(commits));
+	if (!db_set_visible_state(peer))
+		errx(1, "Visible state %u: %s", n, dstate->db->err);
+
+	sha256_double(&peer->anchor.txid, &n, sizeof(n));
+	peer->anchor.index = 0;
+	peer->anchor.satoshis = BENCH_ANCHOR_SATOSHIS;
+	peer->anchor.ok_depth = peer->anchor.min_depth = 3;
+	peer->anchor.ours = true;
+	peer->local.commit = talz(peer, struct commit_info);
+	peer->remote.commit = talz(peer, struct commit_info);
+
+	/* Their signature on our commitment. */
+	ci = peer->local.commit;
+	ci->sig = tal(ci, struct bitcoin_signature);
+	ci->sig->stype = SIGHASH_ALL;
+	bench_privkey(&signer, KEY_THEIR_COMMIT, n);
+	sha256_double(&h, &commits, sizeof(commits));
+	sign_hash(dstate->secpctx, &signer, &h, &ci->sig->sig);
+
+	/* They've revoked all but their latest. */
+	memset(&seed, n, sizeof(seed));
+	shachain_init(&peer->their_preimages);
+	for (i = 0; i + 1 < commits; i++) {
+		u64 index = 0xFFFFFFFFFFFFFFFFULL - i;
+		struct sha256 preimage;
+
+		shachain_from_seed(&seed, index, &preimage);
+		if (!shachain_add_hash(&peer->their_preimages, index,
+				       &preimage))
+			abort();
+	}
+
+	db_start_transaction(peer);
+	db_set_anchor(peer);
+	stmt = db_prepare(__func__, dstate,
+			  "UPDATE commit_info SET commit_num=? WHERE peer=?;");
+	db_bind_int(stmt, 1, commits);
+	db_bind_pubkey(dstate, stmt, 2, peer->id);
+	db_step(__func__, dstate, stmt);
+	for (i = 0; i < commits; i++) {
+		u64 txnum[2] = { n, i };
+		struct sha256_double txid;
+
+		sha256_double(&txid, txnum, sizeof(txnum));
+		db_add_commit_map(peer, &txid, i);
+	}
+	/* Archived HTLCs only show in htlc_totals, so that's where it went:
+	 * both sides have funds for HTLCs. */
+	stmt = db_prepare(__func__, dstate,
+			  "INSERT INTO htlc_totals VALUES (?, ?, 0, 0);");
+	db_bind_pubkey(dstate, stmt, 1, peer->id);
+	db_bind_int(stmt, 2, BENCH_ANCHOR_SATOSHIS * 1000ULL / 2);
+	db_step(__func__, dstate, stmt);
+	if (db_commit_transaction(peer))
+		errx(1, "Anchor %u: %s", n, dstate->db->err);
+
+	return peer;
+}
+
+/* Each HTLC is its own: its own preimage, and its own onion. */
+static void bench_htlc(struct peer *peer, unsigned int n, struct htlc *h,
+		       u64 id, enum htlc_state state, const tal_t *ctx)
+{
+	u64 seed[3] = { n, htlc_state_owner(state), id };
+	struct sha256 r;
+	u8 *routing;
+
+	memset(h, 0, sizeof(*h));
+	h->peer = peer;
+	h->id = id;
+	h->state = state;
+	h->msatoshi = BENCH_HTLC_MSAT;
+	if (!blocks_to_abs_locktime(BENCH_EXPIRY, &h->expiry))
+		abort();
+	sha256(&r, seed, sizeof(seed));
+	memcpy(&h->rval, &r, sizeof(h->rval));
+	sha256(&h->rhash, &h->rval, sizeof(h->rval));
+	routing = tal_arrz(ctx, u8, ONION_LEN);
+	memcpy(routing, &h->rhash, sizeof(h->rhash));
+	h->routing = routing;
+}
+
+/* Transactions this big, like a busy peer's. */
+#define HTLCS_PER_TXN 1000
+
+/* The archived ones are fulfilled and gone, then the live ones are still in
+ * the channel: alternately ours and theirs, so ours are numbered from 0,
+ * and our live ones from (archived + 1) / 2. */
+static void add_htlcs(const struct bench_peer *bp)
+{
+	struct peer *peer = bp->peer;
+	unsigned int n = bp->n;
+	u64 i, archived = bp->archived, live = bp->live, id[2] = { 0, 0 };
+	tal_t *ctx = NULL;
+	struct htlc h;
+
+	for (i = 0; i < archived + live; i++) {
+		enum side owner = (i < archived ? i : i - archived) % 2
+			? REMOTE : LOCAL;
+
+		if (i % HTLCS_PER_TXN == 0) {
+			ctx = tal(peer, char);
+			db_start_transaction(peer);
+		}
+		if (i < archived) {
+			bench_htlc(peer, n, &h, id[owner]++,
+				   owner == LOCAL ? SENT_ADD_COMMIT
+				   : RCVD_ADD_COMMIT, ctx);
+			db_new_htlc(peer, &h);
+			h.r = &h.rval;
+			db_htlc_fulfilled(peer, &h);
+			h.state = owner == LOCAL ? RCVD_REMOVE_ACK_REVOCATION
+				: SENT_REMOVE_ACK_REVOCATION;
+			db_update_htlc_state(peer, &h, owner == LOCAL
+					     ? SENT_ADD_COMMIT
+					     : RCVD_ADD_COMMIT);
+		} else {
+			bench_htlc(peer, n, &h, id[owner]++,
+				   owner == LOCAL ? SENT_ADD_ACK_REVOCATION
+				   : RCVD_ADD_ACK_REVOCATION, ctx);
+			db_new_htlc(peer, &h);
+		}
+		if (i % HTLCS_PER_TXN == HTLCS_PER_TXN - 1
+		    || i == archived + live - 1) {
+			if (db_commit_transaction(peer))
+				errx(1, "HTLCs %u: %s", n, dstate->db->err);
+			tal_free(ctx);
+		}
+	}
+}
+
+/* Pays in progress are for our live HTLCs, round-robin over peers; the
+ * rest are finished. */
+static void add_pays(const struct bench_peer *peers, u64 pays)
+{
+	size_t num_peers = tal_count(peers);
+	u64 i;
+
+	if (!db_exec(__func__, dstate, "BEGIN IMMEDIATE;"))
+		errx(1, "%s", dstate->db->err);
+	for (i = 0; i < pays; i++) {
+		const struct bench_peer *bp = &peers[i % num_peers];
+		u64 ours = i / num_peers;
+		struct pubkey *ids = tal_arr(dstate, struct pubkey, 1);
+		struct db_op *stmt;
+		struct htlc h;
+
+		ids[0] = *bp->peer->id;
+		if (ours < (bp->live + 1) / 2) {
+			bench_htlc(bp->peer, bp->n, &h,
+				   (bp->archived + 1) / 2 + ours,
+				   SENT_ADD_ACK_REVOCATION, ids);
+			stmt = db_prepare(__func__, dstate,
+					  "INSERT INTO pay VALUES"
+					  " (?, ?, ?, ?, ?, NULL, NULL);");
+			db_bind_pubkey(dstate, stmt, 4, bp->peer->id);
+			db_bind_int(stmt, 5, h.id);
+		} else {
+			u64 seed[2] = { i, pays };
+			struct sha256 r;
+
+			memset(&h, 0, sizeof(h));
+			h.msatoshi = BENCH_HTLC_MSAT;
+			sha256(&r, seed, sizeof(seed));
+			memcpy(&h.rval, &r, sizeof(h.rval));
+			sha256(&h.rhash, &h.rval, sizeof(h.rval));
+			stmt = db_prepare(__func__, dstate,
+					  "INSERT INTO pay VALUES"
+					  " (?, ?, ?, NULL, 0, ?, NULL);");
+			db_bind_blob(stmt, 4, &h.rval, sizeof(h.rval));
+		}
+		db_bind_blob(stmt, 1, &h.rhash, sizeof(h.rhash));
+		db_bind_int(stmt, 2, h.msatoshi);
+		db_bind_pubkeys(dstate, stmt, 3, ids);
+		if (!db_step(__func__, dstate, stmt))
+			errx(1, "Pay %"PRIu64": %s", i, dstate->db->err);
+		tal_free(ids);
+	}
+	if (!db_exec(__func__, dstate, "COMMIT;"))
+		errx(1, "%s", dstate->db->err);
+}
+
+/* Every other one paid, and the older half of those archived. */
+static void add_invoices(u64 invoices)
+{
+	u64 i, paid = 0;
+
+	if (!db_exec(__func__, dstate, "BEGIN IMMEDIATE;"))
+		errx(1, "%s", dstate->db->err);
+	for (i = 0; i < invoices; i++) {
+		char *label = tal_fmt(dstate, "bench%"PRIu64, i);
+		struct sha256 r;
+		struct db_op *stmt;
+
+		sha256(&r, &i, sizeof(i));
+		stmt = db_prepare(__func__, dstate,
+				  "INSERT INTO invoice VALUES (?, ?, ?, ?, 0);");
+		db_bind_blob(stmt, 1, &r, sizeof(r));
+		db_bind_int(stmt, 2, BENCH_HTLC_MSAT);
+		db_bind_blob(stmt, 3, label, strlen(label));
+		db_bind_int(stmt, 4, i % 2 ? ++paid : 0);
+		if (!db_step(__func__, dstate, stmt))
+			errx(1, "Invoice %"PRIu64": %s", i, dstate->db->err);
+		tal_free(label);
+	}
+	if (!db_exec(__func__, dstate, "COMMIT;"))
+		errx(1, "%s", dstate->db->err);
+	if (!db_sweep_invoices(dstate, 0, paid / 2))
+		errx(1, "Archiving invoices: %s", dstate->db->err);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int num_peers = 100, live = 1000, archived = 100000;
+	unsigned int invoices = 10000, pays = 1000, i;
+	struct bench_peer *peers;
+
+	opt_register_noarg("--help|-h", opt_usage_and_exit,
+			   "<lightning-dir>", "Print this message.");
+	opt_register_arg("--peers", opt_set_uintval, opt_show_uintval,
+			 &num_peers, "Peers with channels");
+	opt_register_arg("--live", opt_set_uintval, opt_show_uintval,
+			 &live, "HTLCs in those channels, in all");
+	opt_register_arg("--archived", opt_set_uintval, opt_show_uintval,
+			 &archived, "HTLCs they've finished, in all");
+	opt_register_arg("--invoices", opt_set_uintval, opt_show_uintval,
+			 &invoices, "Invoices (half of them paid)");
+	opt_register_arg("--pays", opt_set_uintval, opt_show_uintval,
+			 &pays, "Pay commands (for our live HTLCs first)");
+	opt_parse(&argc, argv, opt_log_stderr_exit);
+	if (argc != 2)
+		opt_usage_exit_fail("Need a lightning-dir");
+	if (num_peers == 0)
+		opt_usage_exit_fail("Need at least one peer");
+
+	if (mkdir(argv[1], 0750) != 0 && errno != EEXIST)
+		err(1, "Making %s", argv[1]);
+	if (chdir(argv[1]) != 0)
+		err(1, "Entering %s", argv[1]);
+	if (access(DB_FILE, F_OK) == 0)
+		errx(1, "%s/%s already exists", argv[1], DB_FILE);
+
+	dstate = talz(NULL, struct lightningd_state);
+	dstate->secpctx = secp256k1_context_create(SECP256K1_CONTEXT_SIGN);
+	/* If we crash, we start again anyway. */
+	dstate->config.db_synchronous = DB_SYNC_OFF;
+	db_init(dstate);
+
+	peers = tal_arr(dstate, struct bench_peer, num_peers);
+	for (i = 0; i < num_peers; i++) {
+		/* Spread the HTLCs evenly, the odd ones to the first peers. */
+		peers[i].n = i;
+		peers[i].archived = archived / num_peers
+			+ (i < archived % num_peers);
+		peers[i].live = live / num_peers + (i < live % num_peers);
+		/* At least a commitment for each HTLC. */
+		peers[i].peer = new_bench_peer(i, peers[i].archived
+					       + peers[i].live + 1);
+		add_htlcs(&peers[i]);
+	}
+	add_pays(peers, pays);
+	add_invoices(invoices);
+
+	printf("%s: %u peers, %u live and %u archived HTLCs,"
+	       " %u invoices, %u pays\n", argv[1], num_peers,
+	       live, archived, invoices, pays);
+
+	tal_free(dstate->db);
+	secp256k1_context_destroy(dstate->secpctx);
+	tal_free(dstate);
+	opt_free_table();
+	return 0;
+}
@@ -0,0 +1,111 @@
+#! /bin/sh -e
+
+# Startup benchmark: bench-startup generates a database with however many
+# peers, HTLCs, invoices and pays, then we start lightningd on it a few
+# times and print how long each startup phase took (from getinfo), up to
+# reconnect_peers.  Needs bitcoind, like test.sh.
+
+# Wherever we are, we want to be in daemon/test dir.
+cd `git rev-parse --show-toplevel`/daemon/test
+
+. scripts/vars.sh
+
+PEERS=100
+LIVE=1000
+ARCHIVED=100000
+INVOICES=10000
+PAYS=1000
+# The first finds the database cold (unless it was just generated).
+RUNS=3
+EXTRA_CONFIG=
+
+while [ $# != 0 ]; do
+    case x"$1" in
+	x--peers=*)
+	    PEERS=${1#--peers=}
+	    ;;
+	x--live=*)
+	    LIVE=${1#--live=}
+	    ;;
+	x--archived=*)
+	    ARCHIVED=${1#--archived=}
+	    ;;
+	x--invoices=*)
+	    INVOICES=${1#--invoices=}
+	    ;;
+	x--pays=*)
+	    PAYS=${1#--pays=}
+	    ;;
+	x--runs=*)
+	    RUNS=${1#--runs=}
+	    ;;
+	x--config=*)
+	    # eg. --config=db-wal
+	    EXTRA_CONFIG="$EXTRA_CONFIG ${1#--config=}"
+	    ;;
+	x"--keep")
+	    KEEP=1
+	    ;;
+	*)
+	    echo "Usage: bench-startup.sh [--peers=N] [--live=N] [--archived=N] [--invoices=N] [--pays=N] [--runs=N] [--config=OPTION]... [--keep]" >&2
+	    exit 1
+    esac
+    shift
+done
+
+scripts/setup.sh
+
+BASE=/tmp/lightning-bench-startup.$$
+
+lcli()
+{
+    ../lightning-cli --lightning-dir=$BASE "$@"
+}
+
+# Usage: <cmd to test>...  Polls quickly: we're timing things.
+wait_for()
+{
+    local i=0
+    while ! eval "$@"; do
+	sleep 0.1
+	i=$(($i + 1))
+	if [ $i = 6000 ]; then
+	    echo Timed out waiting for "$@" >&2
+	    exit 1
+	fi
+    done
+}
+
+finish()
+{
+    lcli stop >/dev/null 2>&1 || true
+    scripts/shutdown.sh 2>/dev/null || true
+    if [ -n "$KEEP" ]; then
+	echo Results in $BASE >&2
+    else
+	rm -rf $BASE
+    fi
+}
+trap finish EXIT
+
+./bench-startup --peers=$PEERS --live=$LIVE --archived=$ARCHIVED --invoices=$INVOICES --pays=$PAYS $BASE
+ls -l $BASE/lightning.sqlite3
+cat > $BASE/config <<EOF
+disable-irc
+log-level=unusual
+bitcoin-datadir=$DATADIR
+EOF
+for c in $EXTRA_CONFIG; do echo $c >> $BASE/config; done
+
+for r in `seq $RUNS`; do
+    ../lightningd --lightning-dir=$BASE > $BASE/output 2> $BASE/errors &
+    PID=$!
+    wait_for "lcli getlog 2>/dev/null | fgrep -q 'Startup took'"
+    echo "Run $r:" `lcli getlog | sed -n 's/.*\(Startup took [^"]*\)".*/\1/p'`
+    # Each phase: name, msec, and its count (peers, rows...).
+    lcli getinfo | tr -s '\012\011\", ' ' ' | grep -o 'phase : [^ ]* msec : [0-9]* count : [0-9]*' | while read x x NAME x x MSEC x x COUNT; do
+	printf "  %-24s %8s msec %10s\n" $NAME $MSEC $COUNT
+    done
+    lcli stop >/dev/null
+    while kill -0 $PID 2>/dev/null; do sleep 0.1; done
+done
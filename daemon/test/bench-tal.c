@@ -0,0 +1,198 @@
+/* Benchmark tal on the short-lived trees the daemon builds most: an
+ * unpacked packet, a JSON response and a parsed block, each built, touched
+ * and freed.  Plain malloc, then the daemon's own backend (which keeps
+ * free lists if built with TAL_PRODUCTION=1).
+ *
+ * Prints "<tree> <backend> <iterations> <nsec per tree> <allocator %>",
+ * where the allocator's share is whatever the tree costs beyond writing
+ * the same bytes into memory we already had. */
+#include "daemon/memory.c"
+#include <ccan/err/err.h>
+#include <ccan/opt/opt.h>
+#include <ccan/time/time.h>
+#include <inttypes.h>
+#include <stdio.h>
+
+/* AUTOGENERATED MOCKS START */
+/* Generated stub for command_fail */
+void command_fail(struct command *cmd UNNEEDED, const char *fmt UNNEEDED, ...)
+{ fprintf(stderr, "command_fail called!\n"); abort(); }
+/* Generated stub for command_success */
+void command_success(struct command *cmd UNNEEDED, struct json_result *response UNNEEDED)
+{ fprintf(stderr, "command_success called!\n"); abort(); }
+/* Generated stub for fatal */
+void fatal(const char *fmt UNNEEDED, ...)
+{ fprintf(stderr, "fatal called!\n"); abort(); }
+/* Generated stub for json_add_string */
+void json_add_string(struct json_result *result UNNEEDED, const char *fieldname UNNEEDED, const char *value UNNEEDED)
+{ fprintf(stderr, "json_add_string called!\n"); abort(); }
+/* Generated stub for json_add_u64 */
+void json_add_u64(struct json_result *result UNNEEDED, const char *fieldname UNNEEDED,
+		  uint64_t value UNNEEDED)
+{ fprintf(stderr, "json_add_u64 called!\n"); abort(); }
+/* Generated stub for json_array_end */
+void json_array_end(struct json_result *ptr UNNEEDED)
+{ fprintf(stderr, "json_array_end called!\n"); abort(); }
+/* Generated stub for json_array_start */
+void json_array_start(struct json_result *ptr UNNEEDED, const char *fieldname UNNEEDED)
+{ fprintf(stderr, "json_array_start called!\n"); abort(); }
+/* Generated stub for json_get_params */
+bool json_get_params(const char *buffer UNNEEDED, const jsmntok_t param[] UNNEEDED, ...)
+{ fprintf(stderr, "json_get_params called!\n"); abort(); }
+/* Generated stub for json_object_end */
+void json_object_end(struct json_result *ptr UNNEEDED)
+{ fprintf(stderr, "json_object_end called!\n"); abort(); }
+/* Generated stub for json_object_start */
+void json_object_start(struct json_result *ptr UNNEEDED, const char *fieldname UNNEEDED)
+{ fprintf(stderr, "json_object_start called!\n"); abort(); }
+/* Generated stub for json_tok_bool */
+bool json_tok_bool(const char *buffer UNNEEDED, const jsmntok_t *tok UNNEEDED, bool *b UNNEEDED)
+{ fprintf(stderr, "json_tok_bool called!\n"); abort(); }
+/* Generated stub for json_tok_number */
+bool json_tok_number(const char *buffer UNNEEDED, const jsmntok_t *tok UNNEEDED,
+		     unsigned int *num UNNEEDED)
+{ fprintf(stderr, "json_tok_number called!\n"); abort(); }
+/* Generated stub for new_json_result */
+struct json_result *new_json_result(const tal_t *ctx UNNEEDED)
+{ fprintf(stderr, "new_json_result called!\n"); abort(); }
+/* Generated stub for new_reltimer_ */
+struct oneshot *new_reltimer_(struct lightningd_state *dstate UNNEEDED,
+			      const tal_t *ctx UNNEEDED,
+			      struct timerel expire UNNEEDED,
+			      void (*cb)(void *) UNNEEDED, void *arg UNNEEDED)
+{ fprintf(stderr, "new_reltimer_ called!\n"); abort(); }
+/* AUTOGENERATED MOCKS END */
+
+/* Roughly what each tree's objects are.  Each hangs off the first, except
+ * a JSON response's string, which grows by doubling. */
+static const size_t packet_sizes[] = {
+	/* Pkt, UpdateAddHtlc, Sha256Hash, Locktime, BitcoinPubkey... */
+	48, 72, 56, 32, 40, 24, 1254
+};
+#define PACKET_ALLOCS (sizeof(packet_sizes) / sizeof(packet_sizes[0]))
+
+#define JSON_FIELDS 24
+#define JSON_BYTES 8192
+
+/* A header, then each tx's struct, inputs, outputs and scripts. */
+#define BLOCK_TXS 200
+static const size_t tx_sizes[] = { 64, 48, 40, 107, 25 };
+#define TX_ALLOCS (sizeof(tx_sizes) / sizeof(tx_sizes[0]))
+
+static char scratch[JSON_BYTES * 2];
+
+static void touch(void *p, size_t len)
+{
+	memset(p, 0x55, len);
+}
+
+static void packet_tree(bool alloc)
+{
+	char *top = NULL;
+	size_t i;
+
+	for (i = 0; i < PACKET_ALLOCS; i++) {
+		char *p = scratch;
+		if (alloc) {
+			p = tal_arr(top, char, packet_sizes[i]);
+			if (!top)
+				top = p;
+		}
+		touch(p, packet_sizes[i]);
+	}
+	tal_free(top);
+}
+
+static void json_tree(bool alloc)
+{
+	char *top = NULL, *s = scratch;
+	size_t len, i;
+
+	if (alloc)
+		top = tal(NULL, char);
+	for (i = 0; i < JSON_FIELDS; i++) {
+		char *p = alloc ? tal_arr(top, char, 32) : scratch;
+		touch(p, 32);
+	}
+	for (len = 64; len <= JSON_BYTES; len *= 2) {
+		if (alloc && s == scratch)
+			s = tal_arr(top, char, len);
+		else if (alloc)
+			tal_resize(&s, len);
+		touch(s + len / 2, len / 2);
+	}
+	tal_free(top);
+}
+
+static void block_tree(bool alloc)
+{
+	char *top = alloc ? tal_arr(NULL, char, 80) : scratch;
+	size_t i, j;
+
+	touch(top, 80);
+	for (i = 0; i < BLOCK_TXS; i++) {
+		for (j = 0; j < TX_ALLOCS; j++) {
+			char *p = alloc ? tal_arr(top, char, tx_sizes[j])
+				: scratch;
+			touch(p, tx_sizes[j]);
+		}
+	}
+	if (alloc)
+		tal_free(top);
+}
+
+static u64 time_tree(void (*tree)(bool), bool alloc, unsigned int iters)
+{
+	struct timeabs start = time_now();
+	unsigned int i;
+
+	for (i = 0; i < iters; i++)
+		tree(alloc);
+	return time_to_nsec(time_between(time_now(), start)) / iters;
+}
+
+static void bench(const char *name, const char *backend,
+		  void (*tree)(bool), unsigned int iters)
+{
+	u64 work, total;
+
+	/* Warm up: the free lists would otherwise start empty. */
+	tree(true);
+	work = time_tree(tree, false, iters);
+	total = time_tree(tree, true, iters);
+	printf("%s %s %u %"PRIu64" %"PRIu64"\n", name, backend, iters, total,
+	       total > work ? (total - work) * 100 / total : 0);
+}
+
+static void bench_all(const char *backend, unsigned int iters)
+{
+	bench("packet", backend, packet_tree, iters);
+	bench("json", backend, json_tree, iters);
+	bench("block", backend, block_tree, iters / 10 ? iters / 10 : 1);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int iters = 100000;
+
+	opt_register_noarg("--help|-h", opt_usage_and_exit, "",
+			   "Print this message.");
+	opt_register_arg("--iterations", opt_set_uintval, opt_show_uintval,
+			 &iters, "Trees to build of each kind");
+	opt_parse(&argc, argv, opt_log_stderr_exit);
+	if (argc != 1)
+		opt_usage_exit_fail("No arguments expected");
+	if (iters == 0)
+		opt_usage_exit_fail("Need at least one iteration");
+	opt_free_table();
+
+	/* Nothing tal allocated may outlive its backend. */
+	bench_all("malloc", iters);
+	memory_track();
+#ifdef TAL_FREELISTS
+	bench_all("freelists", iters);
+#else
+	bench_all("counted", iters);
+#endif
+	return 0;
+}
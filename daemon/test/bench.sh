@@ -0,0 +1,243 @@
+#! /bin/sh -e
+
+# Throughput benchmark: a chain of daemons on regtest (1 -> 2 -> ... -> N),
+# HTLCs added and fulfilled over the first channel, then payments from the
+# first node to the last.  Needs bitcoind, like test.sh.
+
+# Wherever we are, we want to be in daemon/test dir.
+cd `git rev-parse --show-toplevel`/daemon/test
+
+. scripts/vars.sh
+
+NODES=3
+# Each channel holds 0.01 bitcoin, so these must add up to less.
+HTLCS=200
+PAYMENTS=50
+HTLC_AMOUNT=1000000
+# HTLCs in flight at once (and payments at once).
+BATCH=10
+EXTRA_CONFIG=
+
+while [ $# != 0 ]; do
+    case x"$1" in
+	x--nodes=*)
+	    NODES=${1#--nodes=}
+	    ;;
+	x--htlcs=*)
+	    HTLCS=${1#--htlcs=}
+	    ;;
+	x--payments=*)
+	    PAYMENTS=${1#--payments=}
+	    ;;
+	x--batch=*)
+	    BATCH=${1#--batch=}
+	    ;;
+	x--msatoshi=*)
+	    HTLC_AMOUNT=${1#--msatoshi=}
+	    ;;
+	x--latency=*)
+	    # Each way, on every link, eg. --latency=20ms.
+	    EXTRA_CONFIG="$EXTRA_CONFIG dev-link-latency=${1#--latency=}"
+	    ;;
+	x--loss=*)
+	    # Percent of writes which drop the connection instead.
+	    EXTRA_CONFIG="$EXTRA_CONFIG dev-link-loss=${1#--loss=}"
+	    ;;
+	x--config=*)
+	    # eg. --config=db-group-commit, for every node.
+	    EXTRA_CONFIG="$EXTRA_CONFIG ${1#--config=}"
+	    ;;
+	x"--keep")
+	    KEEP=1
+	    ;;
+	*)
+	    echo "Usage: bench.sh [--nodes=N] [--htlcs=N] [--payments=N] [--batch=N] [--msatoshi=N] [--latency=TIME] [--loss=PERCENT] [--config=OPTION]... [--keep]" >&2
+	    exit 1
+    esac
+    shift
+done
+
+if [ $NODES -lt 2 ]; then
+    echo Need at least two nodes >&2
+    exit 1
+fi
+
+scripts/setup.sh
+
+BASE=/tmp/lightning-bench.$$
+CLK_TCK=`getconf CLK_TCK`
+
+lcli()
+{
+    N=$1
+    shift
+    ../lightning-cli --lightning-dir=$BASE/$N "$@"
+}
+
+# Usage: <cmd to test>...  Polls quickly: we're timing things.
+wait_for()
+{
+    local i=0
+    while ! eval "$@"; do
+	sleep 0.1
+	i=$(($i + 1))
+	if [ $i = 600 ]; then
+	    echo Timed out waiting for "$@" >&2
+	    exit 1
+	fi
+    done
+}
+
+# Value of $1$2, eg. `var ID 2`.
+var()
+{
+    eval echo \$$1$2
+}
+
+msec()
+{
+    echo $((`date +%s%N` / 1000000))
+}
+
+# User plus system time, in msec.
+cpu_msec()
+{
+    TICKS=`cut -d' ' -f14,15 /proc/$1/stat | tr ' ' +`
+    echo $((($TICKS) * 1000 / $CLK_TCK))
+}
+
+# What it's caused to be written to storage (mostly the database).
+write_bytes()
+{
+    sed -n 's/^write_bytes: //p' /proc/$1/io 2>/dev/null || echo 0
+}
+
+peer_is_normal()
+{
+    lcli $1 getpeers | tr -s '\012\011\" ' ' ' | fgrep -q "state : STATE_NORMAL"
+}
+
+# HTLCs $1 has with $2 (in state $3, if given).
+num_htlcs()
+{
+    lcli $1 gethtlcs $2 | tr -s '\012\011\" ' ' ' | grep -o "state : ${3:-[A-Z_]*}" | wc -l
+}
+
+finish()
+{
+    for i in `seq $NODES`; do
+	lcli $i stop >/dev/null 2>&1 || true
+    done
+    scripts/shutdown.sh 2>/dev/null || true
+    if [ -n "$KEEP" ]; then
+	echo Results in $BASE >&2
+    else
+	rm -rf $BASE
+    fi
+}
+trap finish EXIT
+
+for i in `seq $NODES`; do
+    mkdir -p $BASE/$i
+    cat > $BASE/$i/config <<EOF
+disable-irc
+log-level=unusual
+bitcoind-poll=1s
+deadline-blocks=5
+min-htlc-expiry=6
+bitcoin-datadir=$DATADIR
+locktime-blocks=6
+commit-time=10ms
+EOF
+    for c in $EXTRA_CONFIG; do echo $c >> $BASE/$i/config; done
+    ../lightningd --lightning-dir=$BASE/$i > $BASE/$i/output 2> $BASE/$i/errors &
+    eval PID$i=$!
+done
+
+for i in `seq $NODES`; do
+    wait_for "lcli $i getlog 2>/dev/null | fgrep -q Hello"
+    eval ID$i=`lcli $i getinfo | sed -n 's/.*"id" : "\([0-9a-f]*\)".*/\1/p'`
+    eval PORT$i=`lcli $i getlog | sed -n 's/.*on port \([0-9]*\).*/\1/p'`
+done
+
+# Each node funds the channel to the next.
+for i in `seq $(($NODES - 1))`; do
+    P2SHADDR=`lcli $i newaddr | sed -n 's/{ "address" : "\(.*\)" }/\1/p'`
+    TXID=`$CLI sendtoaddress $P2SHADDR 0.01`
+    TX=`$CLI getrawtransaction $TXID`
+    $CLI generate 1 >/dev/null
+    lcli $i connect localhost $(var PORT $(($i + 1))) $TX >/dev/null
+done
+sleep 1
+$CLI generate 3 >/dev/null
+for i in `seq $NODES`; do
+    wait_for peer_is_normal $i
+    lcli $i dev-routefail false >/dev/null
+done
+
+# Node 1 needs to know the routes beyond 2.
+for i in `seq 2 $(($NODES - 1))`; do
+    lcli 1 dev-add-route $(var ID $i) $(var ID $(($i + 1))) 546000 10 36 36 >/dev/null
+done
+
+EXPIRY=$(( `$CLI getblockcount` + 10))
+
+for i in `seq $NODES`; do
+    eval CPU_START$i=$(cpu_msec $(var PID $i))
+    eval WRITE_START$i=$(write_bytes $(var PID $i))
+done
+
+# HTLCs over the first channel, BATCH at a time.
+START=`msec`
+DONE=0
+while [ $DONE -lt $HTLCS ]; do
+    N=$BATCH
+    [ $(($DONE + $N)) -le $HTLCS ] || N=$(($HTLCS - $DONE))
+    IDS=
+    for j in `seq $(($DONE + 1)) $(($DONE + $N))`; do
+	SECRET=`printf %064x $j`
+	RHASH=`lcli 1 dev-rhash $SECRET | sed 's/.*"\([0-9a-f]*\)".*/\1/'`
+	HTLCID=`lcli 1 dev-newhtlc $ID2 $HTLC_AMOUNT $EXPIRY $RHASH | sed -n 's/.*"id" : \([0-9]*\).*/\1/p'`
+	IDS="$IDS $HTLCID/$SECRET"
+    done
+    wait_for [ \`num_htlcs 2 $ID1 RCVD_ADD_ACK_REVOCATION\` = $N ]
+    for h in $IDS; do
+	lcli 2 dev-fulfillhtlc $ID1 ${h%/*} ${h#*/} >/dev/null
+    done
+    wait_for [ \`num_htlcs 1 $ID2\` = 0 ]
+    DONE=$(($DONE + $N))
+done
+HTLC_MSEC=$((`msec` - $START))
+
+# Payments from 1 to N, BATCH at once, all down the same route.
+LAST=$(var ID $NODES)
+for j in `seq $PAYMENTS`; do
+    eval RHASH$j=`lcli $NODES invoice $HTLC_AMOUNT bench$j | sed 's/.*"\([0-9a-f]*\)".*/\1/'`
+done
+ROUTE=`lcli 1 getroute $LAST $HTLC_AMOUNT 1 | tr -d '\012'`
+ROUTE=`echo $ROUTE | sed 's/^{ "route" : \(.*\) }$/\1/'`
+
+START=`msec`
+for j in `seq $PAYMENTS`; do
+    lcli 1 sendpay "$ROUTE" $(var RHASH $j) >/dev/null &
+    [ $(($j % $BATCH)) != 0 ] || wait
+done
+wait
+PAY_MSEC=$((`msec` - $START))
+
+# Every hop of a payment is an HTLC too.
+TOTAL=$(($HTLCS + $PAYMENTS * ($NODES - 1)))
+CPU=0
+WRITES=0
+for i in `seq $NODES`; do
+    CPU=$(($CPU + $(cpu_msec $(var PID $i)) - $(var CPU_START $i)))
+    WRITES=$(($WRITES + $(write_bytes $(var PID $i)) - $(var WRITE_START $i)))
+done
+
+echo "HTLCs: $HTLCS in $HTLC_MSEC msec: $(($HTLCS * 1000 / ($HTLC_MSEC + 1)))/sec"
+echo "Payments over $(($NODES - 1)) hops: $PAYMENTS in $PAY_MSEC msec: $(($PAYMENTS * 1000 / ($PAY_MSEC + 1)))/sec"
+for i in `seq $NODES`; do
+    echo "Node $i commit_rtt:" `lcli $i getstats | tr -s '\012\011\" ' ' ' | sed -n 's/.* commit_rtt : { \([^}]*\)}.*/\1/p'`
+done
+echo "CPU per HTLC (all nodes): $(($CPU * 1000 / $TOTAL)) usec"
+echo "Storage writes per HTLC (all nodes): $(($WRITES / $TOTAL)) bytes"
@@ -0,0 +1,62 @@
+#ifndef LIGHTNING_DAEMON_TEST_BENCH_ALLOC_H
+#define LIGHTNING_DAEMON_TEST_BENCH_ALLOC_H
+/* Benchmarks #include this to count everything tal allocates: call
+ * bench_alloc_init() first, then read the counters. */
+#include "config.h"
+#include <ccan/err/err.h>
+#include <ccan/short_types/short_types.h>
+#include <ccan/tal/tal.h>
+#include <stdlib.h>
+
+/* Bytes allocated now, and the most at once. */
+static size_t allocated, peak;
+/* Calls to allocate or resize. */
+static u64 allocations;
+
+static void *count_alloc(size_t size)
+{
+	size_t *p = malloc(sizeof(size_t) * 2 + size);
+	if (!p)
+		return NULL;
+	*p = size;
+	allocated += size;
+	allocations++;
+	if (allocated > peak)
+		peak = allocated;
+	return p + 2;
+}
+
+static void *count_resize(void *ptr, size_t size)
+{
+	size_t *p = (size_t *)ptr - 2;
+
+	allocated -= *p;
+	p = realloc(p, sizeof(size_t) * 2 + size);
+	if (!p)
+		return NULL;
+	*p = size;
+	allocated += size;
+	allocations++;
+	if (allocated > peak)
+		peak = allocated;
+	return p + 2;
+}
+
+static void count_free(void *ptr)
+{
+	size_t *p = (size_t *)ptr - 2;
+
+	allocated -= *p;
+	free(p);
+}
+
+static void alloc_failed(const char *msg)
+{
+	errx(1, "%s", msg);
+}
+
+static inline void bench_alloc_init(void)
+{
+	tal_set_backend(count_alloc, count_resize, count_free, alloc_failed);
+}
+#endif /* LIGHTNING_DAEMON_TEST_BENCH_ALLOC_H */
@@ -0,0 +1,486 @@
+#include "daemon/routing.c"
+#include <assert.h>
+#include <stdio.h>
+
+/* AUTOGENERATED MOCKS START */
+/* Generated stub for command_fail */
+void command_fail(struct command *cmd UNNEEDED, const char *fmt UNNEEDED, ...)
+{ fprintf(stderr, "command_fail called!\n"); abort(); }
+/* Generated stub for command_success */
+void command_success(struct command *cmd UNNEEDED, struct json_result *response UNNEEDED)
+{ fprintf(stderr, "command_success called!\n"); abort(); }
+/* Generated stub for fatal */
+void fatal(const char *fmt UNNEEDED, ...)
+{ fprintf(stderr, "fatal called!\n"); abort(); }
+/* Generated stub for json_add_literal */
+void json_add_literal(struct json_result *result UNNEEDED, const char *fieldname UNNEEDED,
+		      const char *literal UNNEEDED, int len UNNEEDED)
+{ fprintf(stderr, "json_add_literal called!\n"); abort(); }
+/* Generated stub for json_add_num */
+void json_add_num(struct json_result *result UNNEEDED, const char *fieldname UNNEEDED,
+		  unsigned int value UNNEEDED)
+{ fprintf(stderr, "json_add_num called!\n"); abort(); }
+/* Generated stub for json_add_pubkey */
+void json_add_pubkey(struct json_result *response UNNEEDED,
+		     secp256k1_context *secpctx UNNEEDED,
+		     const char *fieldname UNNEEDED,
+		     const struct pubkey *key UNNEEDED)
+{ fprintf(stderr, "json_add_pubkey called!\n"); abort(); }
+/* Generated stub for json_add_u64 */
+void json_add_u64(struct json_result *result UNNEEDED, const char *fieldname UNNEEDED,
+		  uint64_t value UNNEEDED)
+{ fprintf(stderr, "json_add_u64 called!\n"); abort(); }
+/* Generated stub for json_array_end */
+void json_array_end(struct json_result *ptr UNNEEDED)
+{ fprintf(stderr, "json_array_end called!\n"); abort(); }
+/* Generated stub for json_array_start */
+void json_array_start(struct json_result *ptr UNNEEDED, const char *fieldname UNNEEDED)
+{ fprintf(stderr, "json_array_start called!\n"); abort(); }
+/* Generated stub for json_get_params */
+bool json_get_params(const char *buffer UNNEEDED, const jsmntok_t param[] UNNEEDED, ...)
+{ fprintf(stderr, "json_get_params called!\n"); abort(); }
+/* Generated stub for json_next */
+const jsmntok_t *json_next(const jsmntok_t *tok UNNEEDED)
+{ fprintf(stderr, "json_next called!\n"); abort(); }
+/* Generated stub for json_object_end */
+void json_object_end(struct json_result *ptr UNNEEDED)
+{ fprintf(stderr, "json_object_end called!\n"); abort(); }
+/* Generated stub for json_object_start */
+void json_object_start(struct json_result *ptr UNNEEDED, const char *fieldname UNNEEDED)
+{ fprintf(stderr, "json_object_start called!\n"); abort(); }
+/* Generated stub for json_tok_bool */
+bool json_tok_bool(const char *buffer UNNEEDED, const jsmntok_t *tok UNNEEDED, bool *b UNNEEDED)
+{ fprintf(stderr, "json_tok_bool called!\n"); abort(); }
+/* Generated stub for json_tok_number */
+bool json_tok_number(const char *buffer UNNEEDED, const jsmntok_t *tok UNNEEDED,
+		     unsigned int *num UNNEEDED)
+{ fprintf(stderr, "json_tok_number called!\n"); abort(); }
+/* Generated stub for json_tok_u64 */
+bool json_tok_u64(const char *buffer UNNEEDED, const jsmntok_t *tok UNNEEDED,
+		  uint64_t *num UNNEEDED)
+{ fprintf(stderr, "json_tok_u64 called!\n"); abort(); }
+/* Generated stub for log_suspend */
+void log_suspend(struct log_record *lr UNNEEDED)
+{ fprintf(stderr, "log_suspend called!\n"); abort(); }
+/* Generated stub for new_json_result */
+struct json_result *new_json_result(const tal_t *ctx UNNEEDED)
+{ fprintf(stderr, "new_json_result called!\n"); abort(); }
+/* Generated stub for null_response */
+struct json_result *null_response(const tal_t *ctx UNNEEDED)
+{ fprintf(stderr, "null_response called!\n"); abort(); }
+/* AUTOGENERATED MOCKS END */
+
+/* Logging is a no-op for us. */
+void log_(struct log *log UNNEEDED, enum log_level level UNNEEDED,
+	  const char *fmt UNNEEDED, ...)
+{
+}
+void log_add(struct log *log UNNEEDED, const char *fmt UNNEEDED, ...)
+{
+}
+void log_struct_(struct log *log UNNEEDED, int level UNNEEDED,
+		 const char *structname UNNEEDED,
+		 const char *fmt UNNEEDED, ...)
+{
+}
+
+/* So are stats. */
+void stats_latency(struct lightningd_state *dstate UNNEEDED,
+		   enum stats_latency which UNNEEDED, struct timeabs start UNNEEDED)
+{
+}
+
+const struct siphash_seed *siphash_seed(void)
+{
+	static struct siphash_seed seed;
+	return &seed;
+}
+
+static struct timeabs fake_time;
+struct timeabs controlled_time(void)
+{
+	return fake_time;
+}
+
+struct peer *find_peer(struct lightningd_state *dstate,
+		       const struct pubkey *id)
+{
+	struct peer *peer;
+
+	list_for_each(&dstate->peers, peer, list)
+		if (structeq(peer->id, id))
+			return peer;
+	return NULL;
+}
+
+static u64 sendable = UINT64_MAX;
+u64 peer_sendable_msat(const struct peer *peer)
+{
+	return sendable;
+}
+
+/* What it costs us, including first hop fee and per-hop risk constant. */
+static s64 route_cost(struct lightningd_state *dstate,
+		      const struct peer *first,
+		      struct node_connection *route, u64 msatoshi, s64 fee)
+{
+	const struct node_connection *c;
+	s64 amount = msatoshi + fee;
+
+	c = get_connection(dstate, &dstate->id, first->id);
+	return amount + connection_fee(c, amount) + tal_count(route) + 1;
+}
+
+/* Does route use connection from->to (or, if @node, node to)? */
+static bool route_uses_(struct lightningd_state *dstate,
+			const struct alt_route *r, u32 from, u32 to, bool node)
+{
+	u32 prev = get_node(dstate, &dstate->id)->index;
+	u32 next = get_node(dstate, r->peer->id)->index;
+	size_t i = 0;
+
+	for (;;) {
+		if (prev == from && next == to)
+			return true;
+		if (node && next == to && i < tal_count(r->route))
+			return true;
+		if (i == tal_count(r->route))
+			return false;
+		prev = next;
+		next = r->route[i++].dst;
+	}
+}
+
+static void check_disjoint(struct lightningd_state *dstate,
+			   const struct alt_route *alt,
+			   const struct alt_route *prev, size_t num,
+			   bool node)
+{
+	u32 from = get_node(dstate, &dstate->id)->index;
+	u32 to = get_node(dstate, alt->peer->id)->index;
+	size_t i, j = 0;
+
+	for (;;) {
+		for (i = 0; i < num; i++) {
+			assert(!route_uses_(dstate, &prev[i], from, to, false));
+			if (node && j < tal_count(alt->route))
+				assert(!route_uses_(dstate, &prev[i],
+						    to, to, true));
+		}
+		if (j == tal_count(alt->route))
+			break;
+		from = to;
+		to = alt->route[j++].dst;
+	}
+}
+
+static void make_pubkey(secp256k1_context *secpctx, struct pubkey *id,
+			unsigned int seed)
+{
+	unsigned char privkey[32];
+
+	memset(privkey, 0, sizeof(privkey));
+	privkey[28] = seed >> 24;
+	privkey[29] = seed >> 16;
+	privkey[30] = seed >> 8;
+	privkey[31] = seed + 1;
+	if (!secp256k1_ec_pubkey_create(secpctx, &id->pubkey, privkey))
+		abort();
+}
+
+#define NUM_NODES 60
+
+int main(void)
+{
+	struct lightningd_state *dstate = tal(NULL, struct lightningd_state);
+	struct pubkey ids[NUM_NODES];
+	struct node_connection *route;
+	const struct node_connection *c;
+	struct peer *first;
+	struct alt_route *alts, alt;
+	struct route_limits limits;
+	struct route_edge edge;
+	u32 from, to;
+	u64 hits, misses;
+	s64 fee;
+	size_t i, j, hop_limited = 0, fee_limited = 0;
+
+	dstate->secpctx = secp256k1_context_create(SECP256K1_CONTEXT_SIGN);
+	dstate->base_log = NULL;
+	dstate->rstate = new_routing_state(dstate);
+	for (i = 0; i < NUM_NODES; i++) {
+		make_pubkey(dstate->secpctx, &ids[i], i);
+		new_node(dstate, &ids[i]);
+	}
+	dstate->id = ids[0];
+
+	/* Every node is a peer, as far as we're concerned. */
+	list_head_init(&dstate->peers);
+	for (i = 1; i < NUM_NODES; i++) {
+		struct peer *p = talz(dstate, struct peer);
+
+		p->id = &ids[i];
+		list_add_tail(&dstate->peers, &p->list);
+	}
+
+	/* A long chain, so hop limit matters... */
+	for (i = 0; i + 1 < NUM_NODES; i++)
+		add_connection(dstate, &ids[i], &ids[i+1], 1, 1, 1, 1, 0);
+
+	/* ...and random shortcuts, some of them expensive. */
+	srandom(1);
+	for (i = 0; i < NUM_NODES * 3; i++) {
+		size_t a = random() % NUM_NODES, b = random() % NUM_NODES;
+		if (a != b)
+			add_connection(dstate, &ids[a], &ids[b],
+				       random() % 1000, random() % 10000,
+				       random() % 144, 0, 0);
+	}
+
+	for (i = 1; i < NUM_NODES; i++) {
+		for (j = 0; j < 3; j++) {
+			u64 msatoshi = 1000ULL << (j * 8);
+			struct node_connection *broute, *droute;
+			s64 bfee, dfee;
+			struct peer *bpeer, *dpeer;
+			s64 bcost, dcost;
+
+			dstate->config.route_engine = ROUTE_ENGINE_BFG;
+			bpeer = find_route(dstate, &ids[i], msatoshi, 0,
+					   &bfee, &broute);
+			if (bpeer)
+				bcost = route_cost(dstate, bpeer, broute,
+						   msatoshi, bfee);
+
+			dstate->config.route_engine = ROUTE_ENGINE_DIJKSTRA;
+			dpeer = find_route(dstate, &ids[i], msatoshi, 0,
+					   &dfee, &droute);
+			assert(!bpeer == !dpeer);
+			if (!dpeer)
+				continue;
+			dcost = route_cost(dstate, dpeer, droute,
+					   msatoshi, dfee);
+
+			/* BFG picks between path lengths on fees alone,
+			 * so it can't do better than us on fees + risk. */
+			assert(dcost <= bcost);
+			assert(tal_count(droute) < ROUTING_MAX_HOPS);
+			if (tal_count(droute))
+				assert(droute[tal_count(droute)-1].dst
+				       == get_node(dstate, &ids[i])->index);
+			else
+				assert(structeq(dpeer->id, &ids[i]));
+		}
+	}
+
+	/* Same destination and amount bucket: cache hit, fee for new amount. */
+	find_route(dstate, &ids[NUM_NODES-1], 1000, 0, &fee, &route);
+	hits = dstate->rstate->route_cache_hits;
+	misses = dstate->rstate->route_cache_misses;
+	first = find_route(dstate, &ids[NUM_NODES-1], 1001, 0, &fee, &route);
+	assert(dstate->rstate->route_cache_hits == hits + 1);
+	assert(fee == route_fee(route, 1001));
+
+	/* Touching a connection on the route forgets it. */
+	c = tal_count(route) ? &route[0] : get_connection(dstate, &ids[0],
+							  first->id);
+	add_connection(dstate, &node_by_index(dstate->rstate, c->src)->id,
+		       &node_by_index(dstate->rstate, c->dst)->id,
+		       c->base_fee + 1, c->proportional_fee,
+		       c->delay, c->min_blocks, c->capacity_msat);
+	find_route(dstate, &ids[NUM_NODES-1], 1001, 0, &fee, &route);
+	assert(dstate->rstate->route_cache_misses == misses + 1);
+
+	/* In bulk, only changing an existing connection forgets routes. */
+	c = get_connection(dstate, &ids[0], &ids[1]);
+	edge.src = ids[0];
+	edge.dst = ids[1];
+	edge.base_fee = c->base_fee;
+	edge.proportional_fee = c->proportional_fee;
+	edge.delay = c->delay;
+	edge.min_blocks = c->min_blocks;
+	edge.capacity_msat = c->capacity_msat;
+	assert(add_connections(dstate, &edge, 1) == 0);
+	assert(dstate->rstate->num_cached_routes);
+	edge.base_fee++;
+	assert(add_connections(dstate, &edge, 1) == 1);
+	assert(get_connection(dstate, &ids[0], &ids[1])->base_fee
+	       == edge.base_fee);
+	assert(dstate->rstate->num_cached_routes == 0);
+
+	/* Failures push us off a connection, until they're forgotten. */
+	alt.peer = find_route(dstate, &ids[NUM_NODES-1], 1000, 0,
+			      &alt.fee, &alt.route);
+	c = tal_count(alt.route) ? &alt.route[tal_count(alt.route)-1]
+		: get_connection(dstate, &ids[0], alt.peer->id);
+	from = c->src;
+	to = c->dst;
+	assert(tal_count(node_by_index(dstate->rstate, to)->in) > 1);
+	for (i = 0; i < 5; i++)
+		connection_failed(dstate,
+				  &node_by_index(dstate->rstate, from)->id,
+				  &node_by_index(dstate->rstate, to)->id);
+	alt.peer = find_route(dstate, &ids[NUM_NODES-1], 1000, 0,
+			      &alt.fee, &alt.route);
+	assert(!route_uses_(dstate, &alt, from, to, false));
+
+	fake_time = timeabs_add(fake_time,
+				time_from_sec(64 * ROUTE_PENALTY_HALFLIFE));
+	assert(!connection_penalty(dstate->rstate, c, fake_time));
+	connection_failed(dstate, &ids[0], &ids[1]);
+	assert(dstate->rstate->num_penalties == 1);
+
+	/* Alternatives don't share connections (or nodes, if asked). */
+	for (j = 0; j < 2; j++) {
+		alts = find_alt_routes(dstate, dstate, &ids[NUM_NODES/2], 1000,
+				       1, 5, j, NULL);
+		assert(tal_count(alts) > 1);
+		for (i = 1; i < tal_count(alts); i++)
+			check_disjoint(dstate, &alts[i], alts, i, j);
+		tal_free(alts);
+	}
+
+	/* Searches keep to limits, and still find routes within them. */
+	dstate->config.route_engine = ROUTE_ENGINE_DIJKSTRA;
+	for (i = 1; i < NUM_NODES; i++) {
+		struct pubkey *exclude;
+		u32 via;
+
+		route_limits_init(&limits);
+		alts = find_alt_routes(dstate, dstate, &ids[i], 1000, 0,
+				       1, false, &limits);
+		if (!tal_count(alts))
+			continue;
+		alt = alts[0];
+		tal_steal(dstate, alt.route);
+		tal_free(alts);
+		if (!tal_count(alt.route))
+			continue;
+
+		limits.max_hops = tal_count(alt.route);
+		alts = find_alt_routes(dstate, dstate, &ids[i], 1000, 0,
+				       5, false, &limits);
+		for (j = 0; j < tal_count(alts); j++)
+			assert(tal_count(alts[j].route) + 1 <= limits.max_hops);
+		hop_limited += tal_count(alts);
+		tal_free(alts);
+
+		route_limits_init(&limits);
+		limits.max_fee = alt.fee - 1;
+		alts = find_alt_routes(dstate, dstate, &ids[i], 1000, 0,
+				       5, false, &limits);
+		for (j = 0; j < tal_count(alts); j++)
+			assert(alts[j].fee <= limits.max_fee);
+		fee_limited += tal_count(alts);
+		tal_free(alts);
+
+		exclude = tal_arr(dstate, struct pubkey, 1);
+		exclude[0] = *alt.peer->id;
+		via = get_node(dstate, alt.peer->id)->index;
+		route_limits_init(&limits);
+		limits.exclude = exclude;
+		alts = find_alt_routes(dstate, dstate, &ids[i], 1000, 0,
+				       5, false, &limits);
+		for (j = 0; j < tal_count(alts); j++)
+			assert(!route_uses_(dstate, &alts[j], via, via, true));
+		tal_free(alts);
+		tal_free(exclude);
+		tal_free(alt.route);
+	}
+	assert(hop_limited && fee_limited);
+
+	/* One search finds routes to everyone find_route can reach. */
+	alts = find_routes_many(dstate, dstate, ids, NUM_NODES, 1000, 0);
+	assert(tal_count(alts) == NUM_NODES);
+	assert(!alts[0].peer);
+	for (i = 1; i < NUM_NODES; i++) {
+		assert(!alts[i].peer == !find_route(dstate, &ids[i], 1000, 0,
+						    &fee, &route));
+		if (!alts[i].peer)
+			continue;
+		assert(tal_count(alts[i].route) < ROUTING_MAX_HOPS);
+		assert(alts[i].fee == route_fee(alts[i].route, 1000));
+		if (tal_count(alts[i].route))
+			assert(alts[i].route[tal_count(alts[i].route)-1].dst
+			       == get_node(dstate, &ids[i])->index);
+		else
+			assert(structeq(alts[i].peer->id, &ids[i]));
+	}
+	tal_free(alts);
+
+	/* Too small a connection gets routed around, by both engines. */
+	for (j = 0; j < 2; j++) {
+		struct node_connection small;
+
+		dstate->config.route_engine = j ? ROUTE_ENGINE_BFG
+			: ROUTE_ENGINE_DIJKSTRA;
+		alt.peer = find_route(dstate, &ids[NUM_NODES-1], 100000, 0,
+				      &alt.fee, &alt.route);
+		assert(tal_count(alt.route));
+		small = alt.route[tal_count(alt.route)-1];
+		add_connection(dstate, &node_by_index(dstate->rstate,
+						      small.src)->id,
+			       &ids[NUM_NODES-1], small.base_fee,
+			       small.proportional_fee, small.delay,
+			       small.min_blocks, 99999);
+		alt.peer = find_route(dstate, &ids[NUM_NODES-1], 100000, 0,
+				      &alt.fee, &alt.route);
+		assert(alt.peer);
+		assert(!route_uses_(dstate, &alt, small.src, small.dst, false));
+	}
+
+	/* We can't send what we don't have. */
+	sendable = 1000;
+	assert(!find_route(dstate, &ids[NUM_NODES-1], 100000, 0,
+			   &fee, &route));
+	sendable = UINT64_MAX;
+
+	/* Can't route to ourselves. */
+	assert(!find_route(dstate, &ids[0], 1000, 0, &fee, &route));
+
+	/* But we can go out one channel and back in another. */
+	list_head_init(&dstate->peers);
+	for (i = 1; i < NUM_NODES; i++) {
+		struct peer *p;
+
+		if (!get_connection(dstate, &ids[0], &ids[i]))
+			continue;
+		p = talz(dstate, struct peer);
+		p->id = &ids[i];
+		list_add_tail(&dstate->peers, &p->list);
+		add_connection(dstate, &ids[i], &ids[0], 1, 1, 1, 1, 0);
+	}
+	from = get_node(dstate, list_top(&dstate->peers, struct peer,
+					 list)->id)->index;
+	to = get_node(dstate, list_tail(&dstate->peers, struct peer,
+					list)->id)->index;
+	assert(from != to);
+	first = find_circular_route(dstate,
+				    &node_by_index(dstate->rstate, from)->id,
+				    &node_by_index(dstate->rstate, to)->id,
+				    1000, 0, NULL, &fee, &route);
+	assert(first);
+	assert(get_node(dstate, first->id)->index == from);
+	assert(tal_count(route) >= 2);
+	assert(route[tal_count(route)-1].src == to);
+	assert(route[tal_count(route)-1].dst == 0);
+	for (i = 0; i + 1 < tal_count(route); i++)
+		assert(route[i].dst != 0);
+	assert(fee == route_fee(route, 1000));
+
+	route_limits_init(&limits);
+	limits.max_fee = fee - 1;
+	alt.peer = find_circular_route(dstate,
+				       &node_by_index(dstate->rstate, from)->id,
+				       &node_by_index(dstate->rstate, to)->id,
+				       1000, 0, &limits, &alt.fee, &alt.route);
+	assert(!alt.peer || alt.fee <= (s64)limits.max_fee);
+	assert(!find_circular_route(dstate,
+				    &node_by_index(dstate->rstate, from)->id,
+				    &node_by_index(dstate->rstate, from)->id,
+				    1000, 0, NULL, &fee, &route));
+
+	secp256k1_context_destroy(dstate->secpctx);
+	tal_free(dstate);
+	return 0;
+}
@@ -11,6 +11,12 @@ void db_new_htlc(struct peer *peer UNNEEDED, const struct htlc *htlc UNNEEDED)
 void db_update_htlc_state(struct peer *peer UNNEEDED, const struct htlc *htlc UNNEEDED,
 				 enum htlc_state oldstate UNNEEDED)
 { fprintf(stderr, "db_update_htlc_state called!\n"); abort(); }
+/* Generated stub for notify_htlc_state */
+void notify_htlc_state(const struct htlc *h UNNEEDED, enum htlc_state oldstate UNNEEDED)
+{ fprintf(stderr, "notify_htlc_state called!\n"); abort(); }
+/* Generated stub for stats_htlc_state */
+void stats_htlc_state(struct htlc *h UNNEEDED, enum htlc_state oldstate UNNEEDED)
+{ fprintf(stderr, "stats_htlc_state called!\n"); abort(); }
 /* Generated stub for log_ */
 void log_(struct log *log UNNEEDED, enum log_level level UNNEEDED, const char *fmt UNNEEDED, ...)
 	
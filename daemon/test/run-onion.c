@@ -0,0 +1,135 @@
+#include "daemon/onion.c"
+#include <assert.h>
+#include <stdio.h>
+
+/* AUTOGENERATED MOCKS START */
+/* Generated stub for log_elided */
+void log_elided(struct log *log UNNEEDED)
+{ fprintf(stderr, "log_elided called!\n"); abort(); }
+/* AUTOGENERATED MOCKS END */
+
+/* Bad onions get logged: we only care that they're refused. */
+void log_(struct log *log UNNEEDED, enum log_level level UNNEEDED,
+	  const char *fmt UNNEEDED, ...)
+{
+}
+
+/* Each node's key is its index, plus one.  The onion is unwrapped by
+ * whichever node we say it's at. */
+static u8 privkeys[ONION_MAX_HOPS][32];
+static size_t at_hop;
+
+void privkey_ecdh(struct lightningd_state *dstate, const struct pubkey *point,
+		  struct sha256 *secret)
+{
+	if (!secp256k1_ecdh(dstate->secpctx, secret->u.u8, &point->pubkey,
+			    privkeys[at_hop]))
+		abort();
+}
+
+static const u8 *unwrap(struct peer *peer, size_t hop, const u8 *onion,
+			RouteStep **step)
+{
+	const u8 *next;
+
+	at_hop = hop;
+	*step = onion_unwrap(peer, peer, onion, tal_count(onion), &next);
+	return next;
+}
+
+/* Every hop finds the next, and the amount to send it; the last finds
+ * the end. */
+static void check_route(struct peer *peer, const struct pubkey *ids,
+			size_t num_hops)
+{
+	secp256k1_context *secpctx = peer->dstate->secpctx;
+	u64 amounts[ONION_MAX_HOPS];
+	const u8 *onion;
+	size_t i;
+
+	for (i = 0; i < num_hops; i++)
+		amounts[i] = 1000 + (num_hops - i) * 10;
+	onion = onion_create(peer, secpctx, ids, amounts, num_hops);
+
+	for (i = 0; i < num_hops; i++) {
+		RouteStep *step;
+		const u8 *next;
+		struct pubkey id;
+
+		assert(tal_count(onion) == ONION_LEN);
+		next = unwrap(peer, i, onion, &step);
+		assert(step);
+		if (i + 1 < num_hops) {
+			assert(step->next_case == ROUTE_STEP__NEXT_BITCOIN);
+			assert(proto_to_pubkey(secpctx, step->bitcoin, &id));
+			assert(pubkey_eq(&id, &ids[i+1]));
+			assert(step->amount == amounts[i+1]);
+			assert(next);
+		} else {
+			assert(step->next_case == ROUTE_STEP__NEXT_END);
+			assert(!next);
+		}
+		onion = next;
+	}
+}
+
+/* Changing any bit past the ephemeral key breaks the hmac. */
+static void check_tampered(struct peer *peer, const struct pubkey *ids)
+{
+	secp256k1_context *secpctx = peer->dstate->secpctx;
+	u64 amounts[] = { 1020, 1010, 1000 };
+	const u8 *onion, *next;
+	RouteStep *step;
+	u8 *bad;
+	size_t i;
+
+	onion = onion_create(peer, secpctx, ids, amounts, 3);
+	bad = tal_dup_arr(peer, u8, onion, ONION_LEN, 0);
+	for (i = PUBKEY_DER_LEN; i < ONION_LEN; i += 7) {
+		bad[i] ^= 1;
+		assert(!unwrap(peer, 0, bad, &step));
+		assert(!step);
+		bad[i] ^= 1;
+	}
+
+	/* Nor can the next hop's onion be changed on its way. */
+	next = unwrap(peer, 0, onion, &step);
+	assert(step && next);
+	bad = tal_dup_arr(peer, u8, next, ONION_LEN, 0);
+	bad[ONION_LEN - 1] ^= 0x80;
+	assert(!unwrap(peer, 1, bad, &step));
+	assert(!step);
+	assert(unwrap(peer, 1, next, &step));
+	assert(step);
+
+	/* And it's only for the node it was made for. */
+	onion = onion_create(peer, secpctx, ids, amounts, 3);
+	assert(!unwrap(peer, 1, onion, &step));
+	assert(!step);
+}
+
+int main(void)
+{
+	struct lightningd_state *dstate = talz(NULL, struct lightningd_state);
+	struct peer *peer = talz(dstate, struct peer);
+	struct pubkey ids[ONION_MAX_HOPS];
+	size_t i;
+
+	dstate->secpctx = secp256k1_context_create(SECP256K1_CONTEXT_SIGN);
+	peer->dstate = dstate;
+	for (i = 0; i < ONION_MAX_HOPS; i++) {
+		privkeys[i][31] = i + 1;
+		if (!secp256k1_ec_pubkey_create(dstate->secpctx,
+						&ids[i].pubkey, privkeys[i]))
+			abort();
+	}
+
+	check_route(peer, ids, 1);
+	check_route(peer, ids, 5);
+	check_route(peer, ids, ONION_MAX_HOPS);
+	check_tampered(peer, ids);
+
+	secp256k1_context_destroy(dstate->secpctx);
+	tal_free(dstate);
+	return 0;
+}
@@ -116,6 +116,12 @@ htlc_exists()
     $1 gethtlcs $2 true | tr -s '\012\011\" ' ' ' | $FGREP "id : $3," >&2
 }
 
+# Peer $1 -> $2's unresolved htlc with rhash $3
+htlc_with_rhash()
+{
+    $1 gethtlcs $2 | tr -s '\012\011\" ' ' ' | sed -n "s/.*{ id : \([0-9]*\), [^{]*{ [^}]*}, rhash : $3 .*/\1/p"
+}
+
 lcli1()
 {
     if [ -n "$VERBOSE" ]; then
@@ -453,6 +459,32 @@ ID3=`$LCLI3 getlog | sed -n 's/.*"ID: \([0-9a-f]*\)".*/\1/p'`
 PORT2=`$LCLI2 getlog | sed -n 's/.*on port \([0-9]*\).*/\1/p'`
 PORT3=`$LCLI3 getlog | sed -n 's/.*on port \([0-9]*\).*/\1/p'`
 
+# Tenants each replicate to a file in their own directory, from seq 0.
+mkdir $DIR3/host
+cat > $DIR3/host/config <<EOF
+disable-irc
+bitcoin-datadir=$DATADIR
+db-replicate=replica
+tenant=t1
+tenant=t2
+EOF
+$PREFIX ../lightningd --lightning-dir=$DIR3/host > $DIR3/host/output 2> $DIR3/host/errors &
+for d in $DIR3/host $DIR3/host/t1 $DIR3/host/t2; do
+    if ! check "../lightning-cli --lightning-dir=$d getinfo >/dev/null 2>&1"; then
+	echo Failed to start $d >&2
+	exit 1
+    fi
+    # A wallet key: something to replicate.
+    ../lightning-cli --lightning-dir=$d newaddr
+    if ! check "[ -s $d/replica ]"; then
+	echo Nothing replicated to $d/replica >&2
+	exit 1
+    fi
+    # Length, then the first record's (little-endian) sequence number.
+    [ `od -An -tx1 -j4 -N8 $d/replica | tr -d ' '` = 0000000000000000 ]
+done
+../lightning-cli --lightning-dir=$DIR3/host stop
+
 # Make a payment into a P2SH for anchor.
 P2SHADDR=`$LCLI1 newaddr | sed -n 's/{ "address" : "\(.*\)" }/\1/p'`
 TXID=`$CLI sendtoaddress $P2SHADDR 0.01`
@@ -1040,7 +1072,7 @@ if [ ! -n "$MANUALCOMMIT" ]; then
 
     # Get route.
     ROUTE=`lcli1 getroute $ID3 $HTLC_AMOUNT 1`
-    ROUTE=`echo $ROUTE | sed 's/^{ "route" : \(.*\) }$/\1/'`
+    ROUTE=`echo $ROUTE | sed 's/^{ "route" : \(.*\), "handle" : [0-9]* }$/\1/'`
 
     # Try wrong hash.
     if lcli1 sendpay "$ROUTE" $RHASH4; then
@@ -1088,9 +1120,78 @@ if [ ! -n "$MANUALCOMMIT" ]; then
 
     [ "`lcli3 waitinvoice | tr -s '\012\011\" ' ' '`" = "{ label : RHASH5 , rhash : $RHASH5 , msatoshi : $HTLC_AMOUNT } " ]
 
+    # Every paid invoice so far, and where that leaves us.
+    PAIDINV=`lcli3 waitanyinvoice | tr -s '\012\011\" ' ' '`
+    echo "$PAIDINV" | $FGREP "{ label : RHASH5 , rhash : $RHASH5 , msatoshi : $HTLC_AMOUNT, pay_index : "
+    PAY_INDEX=`echo "$PAIDINV" | sed -n 's/.* \], pay_index : \([0-9]*\) }.*/\1/p'`
+
+    # Give node1 a direct channel to node3 too, for a second route.
+    P2SHADDR3=`$LCLI1 newaddr | sed -n 's/{ "address" : "\(.*\)" }/\1/p'`
+    TXID3=`$CLI sendtoaddress $P2SHADDR3 0.01`
+    TX3=`$CLI getrawtransaction $TXID3`
+    $CLI generate 1
+
+    $LCLI1 connect localhost $PORT3 $TX3
+    check_tx_spend lcli1
+    $CLI generate 3
+
+    check "[ \`lcli3 getpeers | grep -cw STATE_NORMAL\` = 2 ]"
+
+    # Pay two invoices (and one unknown hash) in one batch.
+    RHASH6=`lcli3 invoice $HTLC_AMOUNT RHASH6 | sed 's/.*"\([0-9a-f]*\)".*/\1/'`
+    RHASH7=`lcli3 invoice $HTLC_AMOUNT RHASH7 | sed 's/.*"\([0-9a-f]*\)".*/\1/'`
+    ROUTE3=`lcli1 getroute $ID3 $HTLC_AMOUNT 1`
+    ROUTE3=`echo $ROUTE3 | sed 's/^{ "route" : \(.*\), "handle" : [0-9]* }$/\1/'`
+    PAYS=`lcli1 sendpays "[ { \"route\" : $ROUTE3, \"rhash\" : \"$RHASH6\" }, { \"route\" : $ROUTE3, \"rhash\" : \"$RHASH4\" }, { \"route\" : $ROUTE3, \"rhash\" : \"$RHASH7\" } ]" | tr -s '\012\011\" ' ' '`
+    echo "$PAYS" | $FGREP "{ rhash : $RHASH6 , preimage : "
+    echo "$PAYS" | $FGREP "{ rhash : $RHASH4 , error : "
+    echo "$PAYS" | $FGREP "{ rhash : $RHASH7 , preimage : "
+
+    # Both turn up after the last index we saw, and nothing else.
+    PAIDINV=`lcli3 waitanyinvoice $PAY_INDEX | tr -s '\012\011\" ' ' '`
+    echo "$PAIDINV" | $FGREP "{ label : RHASH6 , rhash : $RHASH6 , msatoshi : $HTLC_AMOUNT, pay_index : "
+    echo "$PAIDINV" | $FGREP "{ label : RHASH7 , rhash : $RHASH7 , msatoshi : $HTLC_AMOUNT, pay_index : "
+    if echo "$PAIDINV" | $FGREP RHASH5; then
+	echo "waitanyinvoice repeated an old invoice" >&2
+	exit 1
+    fi
+    echo "$PAIDINV" | $FGREP " ], pay_index : $(($PAY_INDEX + 2)) }"
+
+    # Split a payment over both routes; node3 holds the parts.
+    lcli3 dev-routefail false
+    SECRET8=89f37a0fde1c7e5b7b1d4c2e0a6f9d3852b1c4e7a0d3f6925e8b1c4a7d0e3f62
+    RHASH8=`lcli1 dev-rhash $SECRET8 | sed 's/.*"\([0-9a-f]*\)".*/\1/'`
+    $LCLI1 sendmultipay $ID3 $HTLC_AMOUNT $RHASH8 1 2 >/dev/null 2>&1 &
+    check "lcli3 gethtlcs $ID1 | $FGREP -q $RHASH8"
+    check "lcli3 gethtlcs $ID2 | $FGREP -q $RHASH8"
+
+    # Node1 must remember every part across a restart.
+    $LCLI1 -- dev-restart $LIGHTNINGD1 >/dev/null 2>&1 || true
+    if ! check "$LCLI1 getlog 2>/dev/null | fgrep -q Hello"; then
+	echo "dev-restart failed!">&2
+	exit 1
+    fi
+    if ! check "! $LCLI1 getpeers | tr -s '\012\011\" ' ' ' | fgrep -q 'connected : false'"; then
+	echo "Failed to reconnect!">&2
+	exit 1
+    fi
+    lcli1 gethtlcs $ID3 | $FGREP $RHASH8
+    lcli1 gethtlcs $ID2 | $FGREP $RHASH8
+    lcli1 sendmultipay $ID3 $HTLC_AMOUNT $RHASH8 1 2 | $FGREP "still in progress"
+
+    # Once node3 takes both, the payment is done.
+    lcli3 dev-fulfillhtlc $ID1 `htlc_with_rhash lcli3 $ID1 $RHASH8` $SECRET8
+    lcli3 dev-fulfillhtlc $ID2 `htlc_with_rhash lcli3 $ID2 $RHASH8` $SECRET8
+    lcli3 dev-routefail true
+    check "lcli1 sendmultipay $ID3 $HTLC_AMOUNT $RHASH8 1 2 | $FGREP -q $SECRET8"
+
+    # Close it again, so node1 can't route to node3 without node2.
+    lcli3 close $ID1
+    check_peerstate lcli1 STATE_MUTUAL_CLOSING
+
     # Can't pay twice (try from node2)
     ROUTE2=`lcli2 getroute $ID3 $HTLC_AMOUNT 1`
-    ROUTE2=`echo $ROUTE2 | sed 's/^{ "route" : \(.*\) }$/\1/'`
+    ROUTE2=`echo $ROUTE2 | sed 's/^{ "route" : \(.*\), "handle" : [0-9]* }$/\1/'`
     if lcli2 sendpay "$ROUTE2" $RHASH5; then
 	echo "Paying twice worked?" >&2
 	exit 1
@@ -1098,6 +1199,10 @@ if [ ! -n "$MANUALCOMMIT" ]; then
 
     lcli3 close $ID2
 
+    # Both closes went out through bitcoind_sendrawtxs, and were answered.
+    check "[ \`lcli3 getlog debug | grep -c 'sendrawtx exit'\` -ge 2 ]"
+    check "[ \`$CLI getrawmempool | grep -c '\"'\` -ge 2 ]"
+
     # Re-send should be a noop (doesn't matter that node3 is down!)
     lcli1 sendpay "$ROUTE" $RHASH5
 
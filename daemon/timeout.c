@@ -1,5 +1,6 @@
 #include "controlled_time.h"
 #include "lightningd.h"
+#include "stats.h"
 #include "timeout.h"
 
 struct oneshot {
@@ -11,7 +12,7 @@ struct oneshot {
 
 static void remove_timer(struct oneshot *t)
 {
-	timer_del(&t->dstate->timers, &t->timer);
+	timer_del(&t->dstate->host->timers, &t->timer);
 }
 
 struct oneshot *new_abstimer_(struct lightningd_state *dstate,
@@ -25,28 +26,56 @@ struct oneshot *new_abstimer_(struct lightningd_state *dstate,
 	t->arg = arg;
 	t->dstate = dstate;
 	timer_init(&t->timer);
-	timer_add(&dstate->timers, &t->timer, expiry);
+	/* There's only one loop: the host's. */
+	timer_add(&dstate->host->timers, &t->timer, expiry);
 	tal_add_destructor(t, remove_timer);
 
 	return t;
 }
 
+/* Round up to a multiple of the slack: timers due in the same window all
+ * expire at once, so they share what they cause (like a db group commit,
+ * done by the zero timer which follows them). */
+static struct timeabs coalesce(const struct lightningd_state *dstate,
+			       struct timeabs expiry)
+{
+	u64 slack = time_to_nsec(dstate->config.timer_slack), ns, rem;
+
+	if (!slack)
+		return expiry;
+
+	ns = (u64)expiry.ts.tv_sec * 1000000000 + expiry.ts.tv_nsec;
+	rem = ns % slack;
+	if (!rem)
+		return expiry;
+	return timeabs_add(expiry, time_from_nsec(slack - rem));
+}
+
 struct oneshot *new_reltimer_(struct lightningd_state *dstate,
 			      const tal_t *ctx,
 			      struct timerel relexpiry,
 			      void (*cb)(void *), void *arg)
 {
-	return new_abstimer_(dstate, ctx,
-			     timeabs_add(controlled_time(), relexpiry),
-			     cb, arg);
+	struct timeabs expiry = timeabs_add(controlled_time(), relexpiry);
+
+	/* Zero means "once the loop's done everything else": never later. */
+	if (time_to_nsec(relexpiry))
+		expiry = coalesce(dstate, expiry);
+	return new_abstimer_(dstate, ctx, expiry, cb, arg);
 }
 
 void timer_expired(struct lightningd_state *dstate, struct timer *timer)
 {
 	struct oneshot *t = container_of(timer, struct oneshot, timer);
 	tal_t *tmpctx = tal(dstate, char);
+	/* t may be freed by the time we record it. */
+	void (*cb)(void *) = t->cb;
+	void *arg = t->arg;
+	struct timeabs start = time_now();
 
 	/* If it doesn't free itself, freeing tmpctx will do it */
 	tal_steal(tmpctx, t);
-	t->cb(t->arg);
+	cb(arg);
+	stats_callback(dstate, STATS_TIMER_CALLBACK, cb, arg,
+		       time_between(time_now(), start));
 }
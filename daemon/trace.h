@@ -0,0 +1,26 @@
+#ifndef LIGHTNING_DAEMON_TRACE_H
+#define LIGHTNING_DAEMON_TRACE_H
+/* Static tracepoints (provider "lightningd") for perf, bpftrace or
+ * systemtap.  Build with "make TRACEPOINTS=1" (needs sys/sdt.h) to
+ * compile them in: each is a single nop until something attaches.
+ * Otherwise they're nothing at all, and arguments aren't evaluated. */
+#include "config.h"
+
+#ifdef TRACEPOINTS
+#include <sys/sdt.h>
+
+#define trace0(name) DTRACE_PROBE(lightningd, name)
+#define trace1(name, a) DTRACE_PROBE1(lightningd, name, (a))
+#define trace2(name, a, b) DTRACE_PROBE2(lightningd, name, (a), (b))
+#define trace3(name, a, b, c) DTRACE_PROBE3(lightningd, name, (a), (b), (c))
+#define trace4(name, a, b, c, d)				\
+	DTRACE_PROBE4(lightningd, name, (a), (b), (c), (d))
+#else
+#define trace0(name) do { } while (0)
+#define trace1(name, a) do { } while (0)
+#define trace2(name, a, b) do { } while (0)
+#define trace3(name, a, b, c) do { } while (0)
+#define trace4(name, a, b, c, d) do { } while (0)
+#endif
+
+#endif /* LIGHTNING_DAEMON_TRACE_H */
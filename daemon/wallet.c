@@ -11,17 +11,68 @@
 #include "jsonrpc.h"
 #include "lightningd.h"
 #include "log.h"
+#include "pseudorand.h"
 #include "wallet.h"
+#include <ccan/crypto/siphash24/siphash24.h>
+#include <ccan/htable/htable_type.h>
 #include <ccan/structeq/structeq.h>
+#include <inttypes.h>
 #include <sodium/randombytes.h>
 
 struct wallet {
-	struct list_node list;
 	struct privkey privkey;
 	struct pubkey pubkey;
 	struct ripemd160 p2sh;
 };
 
+static const struct ripemd160 *wallet_keyof(const struct wallet *w)
+{
+	return &w->p2sh;
+}
+static size_t p2sh_hash(const struct ripemd160 *p2sh)
+{
+	return siphash24(siphash_seed(), p2sh, sizeof(*p2sh));
+}
+static bool wallet_eq(const struct wallet *w, const struct ripemd160 *p2sh)
+{
+	return structeq(&w->p2sh, p2sh);
+}
+HTABLE_DEFINE_TYPE(struct wallet, wallet_keyof, p2sh_hash, wallet_eq,
+		   wallet_map);
+
+static const struct txwatch_output *utxo_keyof(const struct wallet_utxo *u)
+{
+	return &u->out;
+}
+static bool utxo_eq(const struct wallet_utxo *u,
+		    const struct txwatch_output *out)
+{
+	return structeq(&u->out.txid, &out->txid)
+		&& u->out.index == out->index;
+}
+HTABLE_DEFINE_TYPE(struct wallet_utxo, utxo_keyof, txo_hash, utxo_eq,
+		   utxo_map);
+
+/* Our addresses by p2sh hash, and what's been paid to them. */
+struct wallet_state {
+	struct wallet_map addrs;
+	struct utxo_map utxos;
+};
+
+static void destroy_wallet_state(struct wallet_state *ws)
+{
+	wallet_map_clear(&ws->addrs);
+	utxo_map_clear(&ws->utxos);
+}
+
+void wallet_init(struct lightningd_state *dstate)
+{
+	dstate->wallet = tal(dstate, struct wallet_state);
+	wallet_map_init(&dstate->wallet->addrs);
+	utxo_map_init(&dstate->wallet->utxos);
+	tal_add_destructor(dstate->wallet, destroy_wallet_state);
+}
+
 bool restore_wallet_address(struct lightningd_state *dstate,
 			    const struct privkey *privkey)
 {
@@ -37,7 +88,7 @@ bool restore_wallet_address(struct lightningd_state *dstate,
 	sha256(&h, redeemscript, tal_count(redeemscript));
 	ripemd160(&w->p2sh, h.u.u8, sizeof(h));
 
-	list_add_tail(&dstate->wallet, &w->list);
+	wallet_map_add(&dstate->wallet->addrs, w);
 	tal_free(redeemscript);
 	return true;
 }
@@ -81,17 +132,102 @@ struct wallet *wallet_can_spend(struct lightningd_state *dstate,
 				const struct bitcoin_tx_output *output)
 {
 	struct ripemd160 h;
-	struct wallet *w;
 
 	if (!is_p2sh(output->script, output->script_length))
 		return NULL;
 
 	memcpy(&h, output->script + 2, 20);
-	list_for_each(&dstate->wallet, w, list) {
-		if (structeq(&h, &w->p2sh))
-			return w;
+	return wallet_map_get(&dstate->wallet->addrs, &h);
+}
+
+static struct wallet_utxo *add_utxo(struct lightningd_state *dstate,
+				    const struct txwatch_output *out,
+				    u64 amount, struct wallet *w)
+{
+	struct wallet_utxo *u = tal(dstate->wallet, struct wallet_utxo);
+
+	u->out = *out;
+	u->amount = amount;
+	u->w = w;
+	u->reserved = false;
+	utxo_map_add(&dstate->wallet->utxos, u);
+	return u;
+}
+
+void wallet_output_seen(struct lightningd_state *dstate,
+			const struct sha256_double *txid, unsigned int index,
+			u64 amount, const u8 *script, size_t script_len)
+{
+	struct txwatch_output out;
+	struct ripemd160 h;
+	struct wallet *w;
+
+	if (!is_p2sh(script, script_len))
+		return;
+
+	memcpy(&h, script + 2, 20);
+	w = wallet_map_get(&dstate->wallet->addrs, &h);
+	if (!w)
+		return;
+
+	out.txid = *txid;
+	out.index = index;
+	/* Seen again, eg. refetching a block. */
+	if (utxo_map_get(&dstate->wallet->utxos, &out))
+		return;
+
+	log_info(dstate->base_log, "Wallet received %"PRIu64" satoshi",
+		 amount);
+	db_add_wallet_utxo(dstate, add_utxo(dstate, &out, amount, w));
+}
+
+void wallet_output_spent(struct lightningd_state *dstate,
+			 const struct txwatch_output *out)
+{
+	struct wallet_utxo *u = utxo_map_get(&dstate->wallet->utxos, out);
+
+	if (!u)
+		return;
+
+	db_remove_wallet_utxo(dstate, u);
+	utxo_map_del(&dstate->wallet->utxos, u);
+	tal_free(u);
+}
+
+bool restore_wallet_utxo(struct lightningd_state *dstate,
+			 const struct txwatch_output *out, u64 amount,
+			 const struct ripemd160 *p2sh)
+{
+	struct wallet *w = wallet_map_get(&dstate->wallet->addrs, p2sh);
+
+	if (!w)
+		return false;
+	add_utxo(dstate, out, amount, w);
+	return true;
+}
+
+const struct ripemd160 *wallet_utxo_p2sh(const struct wallet_utxo *u)
+{
+	return &u->w->p2sh;
+}
+
+struct wallet_utxo *wallet_select_coin(struct lightningd_state *dstate,
+				       u64 limit)
+{
+	struct utxo_map_iter it;
+	struct wallet_utxo *u, *best = NULL;
+
+	for (u = utxo_map_first(&dstate->wallet->utxos, &it);
+	     u;
+	     u = utxo_map_next(&dstate->wallet->utxos, &it)) {
+		if (u->reserved || u->amount >= limit)
+			continue;
+		if (!best || u->amount > best->amount)
+			best = u;
 	}
-	return NULL;
+	if (best)
+		best->reserved = true;
+	return best;
 }
 	
 static void json_newaddr(struct command *cmd,
@@ -108,7 +244,7 @@ static void json_newaddr(struct command *cmd,
 	sha256(&h, redeemscript, tal_count(redeemscript));
 	ripemd160(&w->p2sh, h.u.u8, sizeof(h));
 
-	list_add_tail(&cmd->dstate->wallet, &w->list);
+	wallet_map_add(&cmd->dstate->wallet->addrs, w);
 	db_add_wallet_privkey(cmd->dstate, &w->privkey);
 	
 	json_object_start(response, NULL);
@@ -125,3 +261,36 @@ const struct json_command newaddr_command = {
 	"Get a new address to fund a channel",
 	"Returns {address} a p2sh address"
 };
+
+static void json_listfunds(struct command *cmd,
+			   const char *buffer, const jsmntok_t *params)
+{
+	struct json_result *response = new_json_result(cmd);
+	struct utxo_map_iter it;
+	struct wallet_utxo *u;
+	char txid[sizeof(struct sha256_double) * 2 + 1];
+
+	json_object_start(response, NULL);
+	json_array_start(response, "outputs");
+	for (u = utxo_map_first(&cmd->dstate->wallet->utxos, &it);
+	     u;
+	     u = utxo_map_next(&cmd->dstate->wallet->utxos, &it)) {
+		bitcoin_txid_to_hex(&u->out.txid, txid, sizeof(txid));
+		json_object_start(response, NULL);
+		json_add_string(response, "txid", txid);
+		json_add_num(response, "output", u->out.index);
+		json_add_u64(response, "value", u->amount);
+		json_add_bool(response, "reserved", u->reserved);
+		json_object_end(response);
+	}
+	json_array_end(response);
+	json_object_end(response);
+	command_success(cmd, response);
+}
+
+const struct json_command listfunds_command = {
+	"listfunds",
+	json_listfunds,
+	"Show the wallet's confirmed outputs",
+	"Returns {outputs}, each with {txid}, {output}, {value} and {reserved}"
+};
@@ -1,12 +1,26 @@
 #ifndef LIGHTNING_DAEMON_WALLET_H
 #define LIGHTNING_DAEMON_WALLET_H
 #include "config.h"
+#include "watch.h"
 
 struct wallet;
 struct lightningd_state;
 struct bitcoin_tx;
 struct bitcoin_tx_output;
 
+/* An output to one of our addresses, seen in a block.
+ * FIXME: We don't forget it if that block is reorganized out. */
+struct wallet_utxo {
+	struct txwatch_output out;
+	u64 amount;
+	struct wallet *w;
+	/* Handed to a tx we're building: held until it's spent (or we
+	 * restart). */
+	bool reserved;
+};
+
+void wallet_init(struct lightningd_state *dstate);
+
 bool restore_wallet_address(struct lightningd_state *dstate,
 			    const struct privkey *privkey);
 
@@ -18,4 +32,24 @@ void wallet_add_signed_input(struct lightningd_state *dstate,
 struct wallet *wallet_can_spend(struct lightningd_state *dstate,
 				const struct bitcoin_tx_output *output);
 
+/* As the topology sees blocks: an output, and something being spent. */
+void wallet_output_seen(struct lightningd_state *dstate,
+			const struct sha256_double *txid, unsigned int index,
+			u64 amount, const u8 *script, size_t script_len);
+void wallet_output_spent(struct lightningd_state *dstate,
+			 const struct txwatch_output *out);
+
+/* From the db: false if it's not to one of our addresses. */
+bool restore_wallet_utxo(struct lightningd_state *dstate,
+			 const struct txwatch_output *out, u64 amount,
+			 const struct ripemd160 *p2sh);
+
+/* The address it's paid to. */
+const struct ripemd160 *wallet_utxo_p2sh(const struct wallet_utxo *u);
+
+/* Our largest unreserved output worth less than @limit satoshis, which
+ * it reserves.  NULL if there isn't one. */
+struct wallet_utxo *wallet_select_coin(struct lightningd_state *dstate,
+				       u64 limit);
+
 #endif /* LIGHTNING_DAEMON_WALLET_H */
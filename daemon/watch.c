@@ -40,6 +40,55 @@
 #include <ccan/ptrint/ptrint.h>
 #include <ccan/structeq/structeq.h>
 
+void watch_filter_init(struct watch_filter *f)
+{
+	memset(f->count, 0, sizeof(f->count));
+}
+
+/* txids are already random: no need to hash them again. */
+static void filter_slots(const struct sha256_double *txid, unsigned int index,
+			 size_t slot[2])
+{
+	slot[0] = (txid->sha.u.u32[0] ^ (index * 0x9E3779B9U))
+		% WATCH_FILTER_SIZE;
+	slot[1] = (txid->sha.u.u32[1] + index) % WATCH_FILTER_SIZE;
+}
+
+static void filter_add(struct watch_filter *f,
+		       const struct sha256_double *txid, unsigned int index)
+{
+	size_t i, slot[2];
+
+	filter_slots(txid, index, slot);
+	for (i = 0; i < 2; i++) {
+		if (f->count[slot[i]] != 255)
+			f->count[slot[i]]++;
+	}
+}
+
+static void filter_del(struct watch_filter *f,
+		       const struct sha256_double *txid, unsigned int index)
+{
+	size_t i, slot[2];
+
+	filter_slots(txid, index, slot);
+	for (i = 0; i < 2; i++) {
+		assert(f->count[slot[i]]);
+		/* Saturated: we've forgotten how many, so leave it. */
+		if (f->count[slot[i]] != 255)
+			f->count[slot[i]]--;
+	}
+}
+
+static bool filter_maybe(const struct watch_filter *f,
+			 const struct sha256_double *txid, unsigned int index)
+{
+	size_t slot[2];
+
+	filter_slots(txid, index, slot);
+	return f->count[slot[0]] && f->count[slot[1]];
+}
+
 const struct txwatch_output *txowatch_keyof(const struct txowatch *w)
 {
 	return &w->out;
@@ -62,7 +111,9 @@ bool txowatch_eq(const struct txowatch *w, const struct txwatch_output *out)
 
 static void destroy_txowatch(struct txowatch *w)
 {
-	txowatch_hash_del(&w->peer->dstate->txowatches, w);
+	txowatch_hash_del(&w->peer->dstate->host->txowatches, w);
+	filter_del(&w->peer->dstate->host->txowatch_filter,
+		   &w->out.txid, w->out.index);
 }
 
 const struct sha256_double *txwatch_keyof(const struct txwatch *w)
@@ -80,14 +131,60 @@ bool txwatch_eq(const struct txwatch *w, const struct sha256_double *txid)
 	return structeq(&w->txid, txid);
 }
 
+const u32 *txwatch_trigger_keyof(const struct txwatch *w)
+{
+	return &w->trigger_height;
+}
+
+size_t height_hash(const u32 *height)
+{
+	return siphash24(siphash_seed(), height, sizeof(*height));
+}
+
+bool txwatch_trigger_eq(const struct txwatch *w, const u32 *height)
+{
+	return w->trigger_height == *height;
+}
+
+static void unschedule_txwatch(struct txwatch *w)
+{
+	if (w->trigger_height) {
+		txwatch_height_map_del(&w->dstate->host->txwatch_heights, w);
+		w->trigger_height = 0;
+	}
+}
+
+/* File it under the tip height where it reaches next_depth. */
+static void schedule_txwatch(struct txwatch *w)
+{
+	size_t depth = get_tx_depth(w->dstate, &w->txid);
+	u32 tip;
+
+	unschedule_txwatch(w);
+
+	/* Not in a block: we'll hear when it gets into one. */
+	if (depth == 0)
+		return;
+
+	tip = get_block_height(w->dstate);
+	w->trigger_height = tip - depth + w->next_depth;
+	if (w->trigger_height <= tip)
+		w->trigger_height = tip + 1;
+	txwatch_height_map_add(&w->dstate->host->txwatch_heights, w);
+}
+
 static void destroy_txwatch(struct txwatch *w)
 {
-	txwatch_hash_del(&w->dstate->txwatches, w);
+	txwatch_hash_del(&w->dstate->host->txwatches, w);
+	filter_del(&w->dstate->host->txwatch_filter, &w->txid, 0);
+	unschedule_txwatch(w);
+	list_del_init(&w->list);
 }
 
 struct txwatch *watch_txid_(const tal_t *ctx,
 			    struct peer *peer,
 			    const struct sha256_double *txid,
+			    unsigned int mindepth,
 			    enum watch_result (*cb)(struct peer *peer,
 						    unsigned int depth,
 						    const struct sha256_double *,
@@ -98,27 +195,50 @@ struct txwatch *watch_txid_(const tal_t *ctx,
 
 	w = tal(ctx, struct txwatch);
 	w->depth = 0;
+	w->next_depth = mindepth ? mindepth : 1;
+	w->trigger_height = 0;
+	list_node_init(&w->list);
 	w->txid = *txid;
 	w->dstate = peer->dstate;
 	w->peer = peer;
 	w->cb = cb;
 	w->cbdata = cb_arg;
 
-	txwatch_hash_add(&w->dstate->txwatches, w);
+	txwatch_hash_add(&w->dstate->host->txwatches, w);
+	filter_add(&w->dstate->host->txwatch_filter, &w->txid, 0);
 	tal_add_destructor(w, destroy_txwatch);
 
+	topology_new_watch(w->dstate);
+
+	/* Already in a block?  Tell them at the next one (or when it's deep
+	 * enough). */
+	schedule_txwatch(w);
+
 	return w;
 }
 
 bool watching_txid(struct lightningd_state *dstate,
 		   const struct sha256_double *txid)
 {
-	return txwatch_hash_get(&dstate->txwatches, txid) != NULL;
+	if (!filter_maybe(&dstate->host->txwatch_filter, txid, 0))
+		return false;
+	return txwatch_hash_get(&dstate->host->txwatches, txid) != NULL;
+}
+
+struct txowatch *find_txowatch(struct lightningd_state *dstate,
+			       const struct txwatch_output *out)
+{
+	struct lightningd_state *host = dstate->host;
+
+	if (!filter_maybe(&host->txowatch_filter, &out->txid, out->index))
+		return NULL;
+	return txowatch_hash_get(&host->txowatches, out);
 }
 	
 struct txwatch *watch_tx_(const tal_t *ctx,
 			  struct peer *peer,
 			  const struct bitcoin_tx *tx,
+			  unsigned int mindepth,
 			  enum watch_result (*cb)(struct peer *peer,
 						  unsigned int depth,
 						  const struct sha256_double *,
@@ -128,7 +248,7 @@ struct txwatch *watch_tx_(const tal_t *ctx,
 	struct sha256_double txid;
 
 	bitcoin_txid(tx, &txid);
-	return watch_txid(ctx, peer, &txid, cb, cb_arg);
+	return watch_txid_(ctx, peer, &txid, mindepth, cb, cb_arg);
 }
 
 struct txowatch *watch_txo_(const tal_t *ctx,
@@ -149,37 +269,14 @@ struct txowatch *watch_txo_(const tal_t *ctx,
 	w->cb = cb;
 	w->cbdata = cbdata;
 
-	txowatch_hash_add(&w->peer->dstate->txowatches, w);
+	txowatch_hash_add(&w->peer->dstate->host->txowatches, w);
+	filter_add(&w->peer->dstate->host->txowatch_filter,
+		   &w->out.txid, w->out.index);
 	tal_add_destructor(w, destroy_txowatch);
 
-	return w;
-}
+	topology_new_watch(w->peer->dstate);
 
-void txwatch_fire(struct lightningd_state *dstate,
-		  const struct sha256_double *txid,
-		  unsigned int depth)
-{
-	struct txwatch *txw = txwatch_hash_get(&dstate->txwatches, txid);
-
-	if (txw && depth != txw->depth) {
-		enum watch_result r;
-		log_debug(txw->peer->log,
-			  "Got depth change %u for %02x%02x%02x...\n",
-			  txw->depth,
-			  txw->txid.sha.u.u8[0],
-			  txw->txid.sha.u.u8[1],
-			  txw->txid.sha.u.u8[2]);
-		txw->depth = depth;
-		r = txw->cb(txw->peer, txw->depth, &txw->txid, txw->cbdata);
-		switch (r) {
-		case DELETE_WATCH:
-			tal_free(txw);
-			return;
-		case KEEP_WATCHING:
-			return;
-		}
-		fatal("txwatch callback %p returned %i\n", txw->cb, r);
-	}
+	return w;
 }
 
 void txowatch_fire(struct lightningd_state *dstate,
@@ -212,36 +309,117 @@ void txowatch_fire(struct lightningd_state *dstate,
 	fatal("txowatch callback %p returned %i\n", txow->cb, r);
 }
 
-void watch_topology_changed(struct lightningd_state *dstate)
+void txowatch_fire_all(struct lightningd_state *dstate,
+		       const struct txwatch_output *out,
+		       const struct bitcoin_tx *tx,
+		       size_t input_num)
 {
-	struct txwatch_hash_iter i;
-	struct txwatch *w;
-	bool needs_rerun;
+	struct txowatch_hash *txowatches = &dstate->host->txowatches;
+	struct txowatch_hash_iter it;
+	struct txowatch *w, **ws = tal_arr(dstate, struct txowatch *, 0);
+	size_t i, n = 0;
 
-again:
-	/* Iterating a htable during deletes is safe, but might skip entries. */
-	needs_rerun = false;
-	for (w = txwatch_hash_first(&dstate->txwatches, &i);
+	for (w = txowatch_hash_getfirst(txowatches, out, &it);
 	     w;
-	     w = txwatch_hash_next(&dstate->txwatches, &i)) {
-		size_t depth;
-
-		depth = get_tx_depth(dstate, &w->txid);
-		if (depth != w->depth) {
-			enum watch_result r;
-			w->depth = depth;
-			needs_rerun = true;
-			r = w->cb(w->peer, w->depth, &w->txid, w->cbdata);
-			switch (r) {
-			case DELETE_WATCH:
-				tal_free(w);
-				continue;
-			case KEEP_WATCHING:
-				continue;
-			}
-			fatal("txwatch callback %p returned %i\n", w->cb, r);
-		}
+	     w = txowatch_hash_getnext(txowatches, out, &it)) {
+		tal_resize(&ws, n + 1);
+		ws[n++] = w;
+	}
+
+	/* A callback can free any of them: only fire those still here. */
+	for (i = 0; i < n; i++) {
+		for (w = txowatch_hash_getfirst(txowatches, out, &it);
+		     w && w != ws[i];
+		     w = txowatch_hash_getnext(txowatches, out, &it));
+		if (w)
+			txowatch_fire(dstate, w, tx, input_num);
+	}
+	tal_free(ws);
+}
+
+static void txwatch_update(struct txwatch *w)
+{
+	size_t depth = get_tx_depth(w->dstate, &w->txid);
+	enum watch_result r;
+
+	/* Deeper, but not deep enough for them to care? */
+	if (depth == w->depth || (depth > w->depth && depth < w->next_depth)) {
+		schedule_txwatch(w);
+		return;
+	}
+
+	log_debug(w->peer->log,
+		  "Got depth change %u->%zu for %02x%02x%02x...\n",
+		  w->depth, depth,
+		  w->txid.sha.u.u8[0],
+		  w->txid.sha.u.u8[1],
+		  w->txid.sha.u.u8[2]);
+	w->depth = depth;
+	r = w->cb(w->peer, w->depth, &w->txid, w->cbdata);
+	switch (r) {
+	case DELETE_WATCH:
+		tal_free(w);
+		return;
+	case KEEP_WATCHING:
+		w->next_depth = depth + 1;
+		schedule_txwatch(w);
+		return;
+	}
+	if ((int)r < 0)
+		fatal("txwatch callback %p returned %i\n", w->cb, r);
+	w->next_depth = r;
+	schedule_txwatch(w);
+}
+
+static void add_todo(struct list_head *todo, struct txwatch *w)
+{
+	unschedule_txwatch(w);
+	list_del_init(&w->list);
+	list_add_tail(todo, &w->list);
+}
+
+static void add_todo_height(struct lightningd_state *dstate,
+			    struct list_head *todo, u32 height)
+{
+	struct txwatch_height_map *heights = &dstate->host->txwatch_heights;
+	struct txwatch *w;
+
+	while ((w = txwatch_height_map_get(heights, &height)) != NULL)
+		add_todo(todo, w);
+}
+
+/* We only look at watches whose tx came or went, or whose trigger height
+ * we passed: the rest don't cost us anything per block. */
+void watch_topology_changed(struct lightningd_state *dstate,
+			    u32 old_height,
+			    const struct sha256_double *txids)
+{
+	struct txwatch_hash *txwatches = &dstate->host->txwatches;
+	struct list_head todo;
+	struct txwatch *w;
+	u32 h, tip = get_block_height(dstate);
+	size_t i;
+
+	list_head_init(&todo);
+	for (i = 0; i < tal_count(txids); i++) {
+		struct txwatch_hash_iter it;
+
+		for (w = txwatch_hash_getfirst(txwatches, &txids[i], &it);
+		     w;
+		     w = txwatch_hash_getnext(txwatches, &txids[i], &it))
+			add_todo(&todo, w);
+	}
+
+	for (h = old_height + 1; h <= tip; h++)
+		add_todo_height(dstate, &todo, h);
+
+	/* Tip went backwards?  Those wanting every block are all here. */
+	if (tip < old_height)
+		add_todo_height(dstate, &todo, old_height + 1);
+
+	/* Callbacks can free other watches: they take themselves off. */
+	while ((w = list_pop(&todo, struct txwatch, list)) != NULL) {
+		list_node_init(&w->list);
+		txwatch_update(w);
 	}
-	if (needs_rerun)
-		goto again;
 }
@@ -16,11 +16,26 @@ enum watch_result {
 	KEEP_WATCHING = -2
 };
 
+/* A txwatch callback can also say it doesn't care until it reaches @depth
+ * (it still hears if the tx leaves the chain). */
+#define KEEP_WATCHING_UNTIL(depth) ((enum watch_result)(depth))
+
 struct txwatch_output {
 	struct sha256_double txid;
 	unsigned int index;
 };
 
+/* Counting Bloom filter in front of the hash tables: nearly every tx and
+ * input in a block is one we're not watching. */
+#define WATCH_FILTER_SIZE 4096
+
+struct watch_filter {
+	/* Once a count hits 255 it stays there. */
+	u8 count[WATCH_FILTER_SIZE];
+};
+
+void watch_filter_init(struct watch_filter *f);
+
 /* Watching an output */
 struct txowatch {
 	/* Peer who owns us. */
@@ -55,6 +70,13 @@ struct txwatch {
 	struct sha256_double txid;
 	unsigned int depth;
 
+	/* Don't call back (for increases) until it reaches this depth. */
+	unsigned int next_depth;
+	/* Tip height where that happens, or 0 if not in the chain. */
+	u32 trigger_height;
+	/* On the to-do list in watch_topology_changed. */
+	struct list_node list;
+
 	/* A new depth (0 if kicked out, otherwise 1 = tip, etc.) */
 	enum watch_result (*cb)(struct peer *peer, unsigned int depth,
 				const struct sha256_double *txid,
@@ -68,10 +90,22 @@ bool txwatch_eq(const struct txwatch *w, const struct sha256_double *txid);
 HTABLE_DEFINE_TYPE(struct txwatch, txwatch_keyof, txid_hash, txwatch_eq,
 		   txwatch_hash);
 
+/* Confirmed txwatches, by trigger_height. */
+const u32 *txwatch_trigger_keyof(const struct txwatch *w);
+size_t height_hash(const u32 *height);
+bool txwatch_trigger_eq(const struct txwatch *w, const u32 *height);
+HTABLE_DEFINE_TYPE(struct txwatch, txwatch_trigger_keyof, height_hash,
+		   txwatch_trigger_eq, txwatch_height_map);
 
+
+/* The callback hears of every depth change, unless it returns
+ * KEEP_WATCHING_UNTIL.  The _depth variants start as if it had already
+ * returned KEEP_WATCHING_UNTIL(@mindepth): if the tx leaves the chain before
+ * then, we don't call back at all. */
 struct txwatch *watch_txid_(const tal_t *ctx,
 			    struct peer *peer,
 			    const struct sha256_double *txid,
+			    unsigned int mindepth,
 			    enum watch_result (*cb)(struct peer *peer,
 						    unsigned int depth,
 						    const struct sha256_double*,
@@ -79,7 +113,10 @@ struct txwatch *watch_txid_(const tal_t *ctx,
 			    void *cbdata);
 
 #define watch_txid(ctx, peer, txid, cb, cbdata)				\
-	watch_txid_((ctx), (peer), (txid),				\
+	watch_txid_depth((ctx), (peer), (txid), 1, (cb), (cbdata))
+
+#define watch_txid_depth(ctx, p, txid, mindepth, cb, cbdata)		\
+	watch_txid_((ctx), (p), (txid), (mindepth),			\
 		    typesafe_cb_preargs(enum watch_result, void *,	\
 					(cb), (cbdata),			\
 					struct peer *,			\
@@ -90,6 +127,7 @@ struct txwatch *watch_txid_(const tal_t *ctx,
 struct txwatch *watch_tx_(const tal_t *ctx,
 			  struct peer *peer,
 			  const struct bitcoin_tx *tx,
+			  unsigned int mindepth,
 			  enum watch_result (*cb)(struct peer *peer,
 						  unsigned int depth,
 						  const struct sha256_double *,
@@ -97,7 +135,10 @@ struct txwatch *watch_tx_(const tal_t *ctx,
 			  void *cbdata);
 
 #define watch_tx(ctx, peer, tx, cb, cbdata)				\
-	watch_tx_((ctx), (peer), (tx),					\
+	watch_tx_depth((ctx), (peer), (tx), 1, (cb), (cbdata))
+
+#define watch_tx_depth(ctx, p, tx, mindepth, cb, cbdata)		\
+	watch_tx_((ctx), (p), (tx), (mindepth),				\
 		  typesafe_cb_preargs(enum watch_result, void *,	\
 				      (cb), (cbdata),			\
 				      struct peer *,			\
@@ -124,16 +165,24 @@ struct txowatch *watch_txo_(const tal_t *ctx,
 				      size_t),				\
 		  (cbdata))
 
-void txwatch_fire(struct lightningd_state *dstate,
-		  const struct sha256_double *txid,
-		  unsigned int depth);
-
 void txowatch_fire(struct lightningd_state *dstate,
 		   const struct txowatch *txow,
 		   const struct bitcoin_tx *tx, size_t input_num);
 
+/* Every watch on @out: tenants at both ends of a channel each have one. */
+void txowatch_fire_all(struct lightningd_state *dstate,
+		       const struct txwatch_output *out,
+		       const struct bitcoin_tx *tx, size_t input_num);
+
 bool watching_txid(struct lightningd_state *dstate,
 		   const struct sha256_double *txid);
 
-void watch_topology_changed(struct lightningd_state *dstate);
+/* NULL if we're not watching this output (else the first watch). */
+struct txowatch *find_txowatch(struct lightningd_state *dstate,
+			       const struct txwatch_output *out);
+
+/* The tip was at @old_height; @txids (tal array) entered or left the chain. */
+void watch_topology_changed(struct lightningd_state *dstate,
+			    u32 old_height,
+			    const struct sha256_double *txids);
 #endif /* LIGHTNING_DAEMON_WATCH_H */
@@ -51,6 +51,13 @@ struct ircstate {
 
 	/* Time to wait after getting disconnected before reconnecting. */
 	struct timerel reconnect_timeout;
+
+	/* Channel announcements waiting their turn (see irc_announce.c). */
+	struct list_head announce_queue;
+	bool announcing;
+
+	/* Announcements we've heard, and ones waiting to be checked. */
+	struct irc_ingest *ingest;
 };
 
 /* Callback to register for incoming messages */
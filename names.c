@@ -1,4 +1,5 @@
 #include "names.h"
+#include <ccan/array_size/array_size.h>
 #include <ccan/str/str.h>
 /* Indented for 'check-source' because it has to be included after names.h */
   #include "gen_state_names.h"
@@ -8,6 +9,11 @@ const char *state_name(enum state s)
 {
 	size_t i;
 
+	/* They're generated in enum order, so it's almost always here. */
+	if ((size_t)s < ARRAY_SIZE(enum_state_names) - 1
+	    && enum_state_names[s].v == s)
+		return enum_state_names[s].name;
+
 	for (i = 0; enum_state_names[i].name; i++)
 		if (enum_state_names[i].v == s)
 			return enum_state_names[i].name;
@@ -1,4 +1,6 @@
 #include "permute_tx.h"
+#include <ccan/asort/asort.h>
+#include <ccan/tal/tal.h>
 #include <stdbool.h>
 #include <string.h>
 
@@ -22,46 +24,34 @@ static bool input_better(const struct bitcoin_tx_input *a,
 	return a->sequence_number < b->sequence_number;
 }
 
-static size_t find_best_in(struct bitcoin_tx_input *inputs, size_t num)
+static int input_cmp(const size_t *a, const size_t *b,
+		     struct bitcoin_tx_input *inputs)
 {
-	size_t i, best = 0;
-
-	for (i = 1; i < num; i++) {
-		if (input_better(&inputs[i], &inputs[best]))
-			best = i;
-	}
-	return best;
-}
-
-static void swap_inputs(struct bitcoin_tx_input *inputs, size_t i1, size_t i2)
-{
-	struct bitcoin_tx_input tmpinput;
-
-	tmpinput = inputs[i1];
-	inputs[i1] = inputs[i2];
-	inputs[i2] = tmpinput;
+	if (input_better(&inputs[*a], &inputs[*b]))
+		return -1;
+	if (input_better(&inputs[*b], &inputs[*a]))
+		return 1;
+	/* Identical: keep the order they came in. */
+	return *a < *b ? -1 : *a > *b;
 }
 
-void permute_inputs(struct bitcoin_tx_input *inputs, size_t num_inputs)
+void permute_inputs(struct bitcoin_tx_input *inputs, size_t num_inputs,
+		    size_t *map)
 {
-	size_t i;
-
-	/* Now do a dumb sort (num_inputs is small). */
-	for (i = 0; i < num_inputs; i++) {
-		/* Swap best into first place. */
-		swap_inputs(inputs,
-			    i, i + find_best_in(inputs + i, num_inputs - i));
-	}
-}
-
-static void swap_outputs(struct bitcoin_tx_output *outputs,
-			size_t i1, size_t i2)
-{
-	struct bitcoin_tx_output tmpoutput;
-
-	tmpoutput = outputs[i1];
-	outputs[i1] = outputs[i2];
-	outputs[i2] = tmpoutput;
+	size_t i, *order = map ? map : tal_arr(NULL, size_t, num_inputs);
+	struct bitcoin_tx_input *sorted;
+
+	for (i = 0; i < num_inputs; i++)
+		order[i] = i;
+	asort(order, num_inputs, input_cmp, inputs);
+
+	sorted = tal_arr(NULL, struct bitcoin_tx_input, num_inputs);
+	for (i = 0; i < num_inputs; i++)
+		sorted[i] = inputs[order[i]];
+	memcpy(inputs, sorted, sizeof(*inputs) * num_inputs);
+	tal_free(sorted);
+	if (!map)
+		tal_free(order);
 }
 
 static bool output_better(const struct bitcoin_tx_output *a,
@@ -86,25 +76,31 @@ static bool output_better(const struct bitcoin_tx_output *a,
 	return a->script_length < b->script_length;
 }
 
-static size_t find_best_out(struct bitcoin_tx_output *outputs, size_t num)
+static int output_cmp(const size_t *a, const size_t *b,
+		      struct bitcoin_tx_output *outputs)
 {
-	size_t i, best = 0;
-
-	for (i = 1; i < num; i++) {
-		if (output_better(&outputs[i], &outputs[best]))
-			best = i;
-	}
-	return best;
+	if (output_better(&outputs[*a], &outputs[*b]))
+		return -1;
+	if (output_better(&outputs[*b], &outputs[*a]))
+		return 1;
+	return *a < *b ? -1 : *a > *b;
 }
 
-void permute_outputs(struct bitcoin_tx_output *outputs, size_t num_outputs)
+void permute_outputs(struct bitcoin_tx_output *outputs, size_t num_outputs,
+		     size_t *map)
 {
-	size_t i;
-
-	/* Now do a dumb sort (num_outputs is small). */
-	for (i = 0; i < num_outputs; i++) {
-		/* Swap best into first place. */
-		swap_outputs(outputs,
-			     i, i + find_best_out(outputs + i, num_outputs - i));
-	}
+	size_t i, *order = map ? map : tal_arr(NULL, size_t, num_outputs);
+	struct bitcoin_tx_output *sorted;
+
+	for (i = 0; i < num_outputs; i++)
+		order[i] = i;
+	asort(order, num_outputs, output_cmp, outputs);
+
+	sorted = tal_arr(NULL, struct bitcoin_tx_output, num_outputs);
+	for (i = 0; i < num_outputs; i++)
+		sorted[i] = outputs[order[i]];
+	memcpy(outputs, sorted, sizeof(*outputs) * num_outputs);
+	tal_free(sorted);
+	if (!map)
+		tal_free(order);
 }
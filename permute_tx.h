@@ -3,8 +3,11 @@
 #include "config.h"
 #include "bitcoin/tx.h"
 
-/* Permute the transaction into BIP69 order. */
-void permute_inputs(struct bitcoin_tx_input *inputs, size_t num_inputs);
+/* Permute the transaction into BIP69 order.  If map is non-NULL (num
+ * entries), map[i] is set to the old index of what's now at i. */
+void permute_inputs(struct bitcoin_tx_input *inputs, size_t num_inputs,
+		    size_t *map);
 
-void permute_outputs(struct bitcoin_tx_output *outputs, size_t num_outputs);
+void permute_outputs(struct bitcoin_tx_output *outputs, size_t num_outputs,
+		     size_t *map);
 #endif /* LIGHTNING_PERMUTE_TX_H */
@@ -4,12 +4,11 @@
 #include "protobuf_convert.h"
 #include <ccan/crypto/sha256/sha256.h>
 
-Signature *signature_to_proto(const tal_t *ctx,
-			      secp256k1_context *secpctx,
-			      const struct signature *sig)
+void signature_fill_proto(secp256k1_context *secpctx,
+			  Signature *pb, const struct signature *sig)
 {
 	u8 compact[64];
-	Signature *pb = tal(ctx, Signature);
+
 	signature__init(pb);
 
 	assert(sig_valid(secpctx, sig));
@@ -25,7 +24,15 @@ Signature *signature_to_proto(const tal_t *ctx,
 	memcpy(&pb->s2, compact + 40, 8);
 	memcpy(&pb->s3, compact + 48, 8);
 	memcpy(&pb->s4, compact + 56, 8);
-	
+}
+
+Signature *signature_to_proto(const tal_t *ctx,
+			      secp256k1_context *secpctx,
+			      const struct signature *sig)
+{
+	Signature *pb = tal(ctx, Signature);
+
+	signature_fill_proto(secpctx, pb, sig);
 	return pb;
 }
 
@@ -73,9 +80,8 @@ bool proto_to_pubkey(secp256k1_context *secpctx,
 	return pubkey_from_der(secpctx, pb->key.data, pb->key.len, key);
 }
 
-Sha256Hash *sha256_to_proto(const tal_t *ctx, const struct sha256 *hash)
+void sha256_fill_proto(Sha256Hash *h, const struct sha256 *hash)
 {
-	Sha256Hash *h = tal(ctx, Sha256Hash);
 	sha256_hash__init(h);
 
 	/* Kill me now... */
@@ -83,6 +89,13 @@ Sha256Hash *sha256_to_proto(const tal_t *ctx, const struct sha256 *hash)
 	memcpy(&h->b, hash->u.u8 + 8, 8);
 	memcpy(&h->c, hash->u.u8 + 16, 8);
 	memcpy(&h->d, hash->u.u8 + 24, 8);
+}
+
+Sha256Hash *sha256_to_proto(const tal_t *ctx, const struct sha256 *hash)
+{
+	Sha256Hash *h = tal(ctx, Sha256Hash);
+
+	sha256_fill_proto(h, hash);
 	return h;
 }
 
@@ -95,9 +108,8 @@ void proto_to_sha256(const Sha256Hash *pb, struct sha256 *hash)
 	memcpy(hash->u.u8 + 24, &pb->d, 8);
 }
 
-Rval *rval_to_proto(const tal_t *ctx, const struct rval *r)
+void rval_fill_proto(Rval *pb, const struct rval *r)
 {
-	Rval *pb = tal(ctx, Rval);
 	rval__init(pb);
 
 	/* Kill me now... */
@@ -105,6 +117,13 @@ Rval *rval_to_proto(const tal_t *ctx, const struct rval *r)
 	memcpy(&pb->b, r->r + 8, 8);
 	memcpy(&pb->c, r->r + 16, 8);
 	memcpy(&pb->d, r->r + 24, 8);
+}
+
+Rval *rval_to_proto(const tal_t *ctx, const struct rval *r)
+{
+	Rval *pb = tal(ctx, Rval);
+
+	rval_fill_proto(pb, r);
 	return pb;
 }
 
@@ -158,10 +177,8 @@ Locktime *rel_locktime_to_proto(const tal_t *ctx,
 	return l;
 }
 
-Locktime *abs_locktime_to_proto(const tal_t *ctx,
-				const struct abs_locktime *locktime)
+void abs_locktime_fill_proto(Locktime *l, const struct abs_locktime *locktime)
 {
-	Locktime *l = tal(ctx, Locktime);
 	locktime__init(l);
 
 	if (abs_locktime_is_seconds(locktime)) {
@@ -171,6 +188,14 @@ Locktime *abs_locktime_to_proto(const tal_t *ctx,
 		l->locktime_case = LOCKTIME__LOCKTIME_BLOCKS;
 		l->blocks = abs_locktime_to_blocks(locktime);
 	}
+}
+
+Locktime *abs_locktime_to_proto(const tal_t *ctx,
+				const struct abs_locktime *locktime)
+{
+	Locktime *l = tal(ctx, Locktime);
+
+	abs_locktime_fill_proto(l, locktime);
 	return l;
 }
 
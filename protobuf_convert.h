@@ -11,6 +11,9 @@ struct signature;
 Signature *signature_to_proto(const tal_t *ctx,
 			      secp256k1_context *secpctx,
 			      const struct signature *sig);
+/* The *_fill_proto variants fill in one the caller allocated. */
+void signature_fill_proto(secp256k1_context *secpctx,
+			  Signature *pb, const struct signature *sig);
 bool proto_to_signature(secp256k1_context *secpctx,
 			const Signature *pb,
 			struct signature *sig);
@@ -26,12 +29,14 @@ bool proto_to_pubkey(secp256k1_context *secpctx,
 /* Useful helper for allocating & populating a protobuf Sha256Hash */
 struct sha256;
 Sha256Hash *sha256_to_proto(const tal_t *ctx, const struct sha256 *hash);
+void sha256_fill_proto(Sha256Hash *h, const struct sha256 *hash);
 void proto_to_sha256(const Sha256Hash *pb, struct sha256 *hash);
 
 struct rval {
 	u8 r[32];
 };
 Rval *rval_to_proto(const tal_t *ctx, const struct rval *r);
+void rval_fill_proto(Rval *pb, const struct rval *r);
 void proto_to_rval(const Rval *pb, struct rval *r);
 
 struct rel_locktime;
@@ -42,6 +47,7 @@ Locktime *rel_locktime_to_proto(const tal_t *ctx,
 				const struct rel_locktime *locktime);
 Locktime *abs_locktime_to_proto(const tal_t *ctx,
 				const struct abs_locktime *locktime);
+void abs_locktime_fill_proto(Locktime *l, const struct abs_locktime *locktime);
 
 /* Get allocator so decoded protobuf will be tal off it. */
 struct ProtobufCAllocator *make_prototal(const tal_t *ctx);
@@ -105,19 +105,22 @@ enum state state(struct peer *peer,
 				peer_open_complete(peer, err->error->problem);
 				goto err_breakdown;
 			}
-			bitcoin_create_anchor(peer);
-			peer->anchor.ours = true;
-
-			/* This shouldn't happen! */
-			if (!setup_first_commit(peer)) {
-				err = pkt_err(peer,
-					      "Own anchor has insufficient funds");
-				peer_open_complete(peer, err->error->problem);
-				goto err_breakdown;
-			}
-			queue_pkt_anchor(peer);
-			return next_state(peer, STATE_OPEN_WAIT_FOR_COMMIT_SIG);
+			/* If it funds others too, we may need their opens. */
+			if (!bitcoin_create_anchor(peer))
+				return next_state(peer,
+						  STATE_OPEN_WAIT_FOR_ANCHOR_CREATE);
+			goto anchor_created;
+		} else if (input_is_pkt(input)) {
+			bitcoin_release_anchor(peer, INPUT_NONE);
+			peer_open_complete(peer, "unexpected packet");
+			goto unexpected_pkt;
+		}
+		break;
+	case STATE_OPEN_WAIT_FOR_ANCHOR_CREATE:
+		if (input_is(input, BITCOIN_ANCHOR_CREATED)) {
+			goto anchor_created;
 		} else if (input_is_pkt(input)) {
+			bitcoin_release_anchor(peer, INPUT_NONE);
 			peer_open_complete(peer, "unexpected packet");
 			goto unexpected_pkt;
 		}
@@ -179,6 +182,7 @@ enum state state(struct peer *peer,
 		break;
 	case STATE_OPEN_WAIT_FOR_COMMIT_SIG:
 		if (input_is(input, PKT_OPEN_COMMIT_SIG)) {
+			const struct bitcoin_tx *anchor;
 			const char *db_err;
 			err = accept_pkt_open_commit_sig(peer, pkt,
 							 &peer->local.commit->sig);
@@ -209,7 +213,10 @@ enum state state(struct peer *peer,
 				peer_open_complete(peer, db_err);
 				goto err_breakdown;
 			}
-			queue_tx_broadcast(broadcast, bitcoin_anchor(peer));
+			/* A shared anchor goes out once they've all signed. */
+			anchor = bitcoin_anchor(peer);
+			if (anchor)
+				queue_tx_broadcast(broadcast, anchor);
 			peer_watch_anchor(peer,
 					  peer->local.mindepth,
 					  BITCOIN_ANCHOR_DEPTHOK,
@@ -318,6 +325,19 @@ enum state state(struct peer *peer,
 	/* State machine should handle all possible states. */
 	return next_state(peer, STATE_ERR_INTERNAL);
 
+anchor_created:
+	peer->anchor.ours = true;
+
+	/* This shouldn't happen! */
+	if (!setup_first_commit(peer)) {
+		bitcoin_release_anchor(peer, INPUT_NONE);
+		err = pkt_err(peer, "Own anchor has insufficient funds");
+		peer_open_complete(peer, err->error->problem);
+		goto err_breakdown;
+	}
+	queue_pkt_anchor(peer);
+	return next_state(peer, STATE_OPEN_WAIT_FOR_COMMIT_SIG);
+
 unexpected_pkt:
 	peer_unexpected_pkt(peer, pkt, __func__);
 
@@ -114,10 +114,14 @@ void peer_watch_anchor(struct peer *peer,
 		       enum state_input depthok,
 		       enum state_input timeout);
 
-/* Start creation of the bitcoin anchor tx. */
-void bitcoin_create_anchor(struct peer *peer);
-
-/* Get the bitcoin anchor tx. */
+/* Start creation of the bitcoin anchor tx.  Returns false if it's shared
+ * with other channels which aren't ready yet: we'll get
+ * BITCOIN_ANCHOR_CREATED once they are. */
+bool bitcoin_create_anchor(struct peer *peer);
+
+/* Get the bitcoin anchor tx, once we have their signature, to broadcast.
+ * NULL if it's shared and other channels still need theirs (the last one
+ * broadcasts it for all of them). */
 const struct bitcoin_tx *bitcoin_anchor(struct peer *peer);
 
 /* We didn't end up broadcasting the anchor: release the utxos.
@@ -12,6 +12,8 @@ enum state {
 	 */
 	STATE_OPEN_WAIT_FOR_OPEN_NOANCHOR,
 	STATE_OPEN_WAIT_FOR_OPEN_WITHANCHOR,
+	/* Our anchor funds others: waiting for all their PKT_OPENs. */
+	STATE_OPEN_WAIT_FOR_ANCHOR_CREATE,
 	STATE_OPEN_WAIT_FOR_ANCHOR,
 	STATE_OPEN_WAIT_FOR_COMMIT_SIG,
 	STATE_OPEN_WAITING_OURANCHOR,
@@ -92,6 +94,8 @@ enum state_input {
 	/*
 	 * Bitcoin events
 	 */
+	/* Our (shared) anchor tx has been created. */
+	BITCOIN_ANCHOR_CREATED,
 	/* It reached the required depth. */
 	BITCOIN_ANCHOR_DEPTHOK,
 	/* It didn't reach the required depth in time. */
@@ -1,17 +1,149 @@
 #include "utils.h"
 #include <ccan/str/hex/hex.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 char *tal_hexstr(const tal_t *ctx, const void *data, size_t len)
 {
 	char *str = tal_arr(ctx, char, hex_str_size(len));
-	hex_encode(data, len, str, hex_str_size(len));
+	hex_encode_fast(data, len, str, hex_str_size(len));
 	return str;
 }
 
 u8 *tal_hexdata(const tal_t *ctx, const void *str, size_t len)
 {
 	u8 *data = tal_arr(ctx, u8, hex_data_size(len));
-	if (!hex_decode(str, len, data, hex_data_size(len)))
+	if (!hex_decode_fast(str, len, data, hex_data_size(len)))
 		return NULL;
 	return data;
 }
+
+static const char hexchars[] = "0123456789abcdef";
+
+/* Nibble value, or 0xFF if it isn't a hex char. */
+static const u8 hexval[256] = {
+#define X 0xFF
+#define ROW X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X
+	ROW, ROW, ROW,
+	0, 1, 2, 3, 4, 5, 6, 7, 8, 9, X, X, X, X, X, X,
+	X, 10, 11, 12, 13, 14, 15, X, X, X, X, X, X, X, X, X,
+	ROW,
+	X, 10, 11, 12, 13, 14, 15, X, X, X, X, X, X, X, X, X,
+	ROW, ROW, ROW, ROW, ROW, ROW, ROW, ROW, ROW
+#undef ROW
+#undef X
+};
+
+#ifdef __SSE2__
+/* 16 hex chars to nibble values; clears *ok if any aren't hex. */
+static __m128i sse2_hexvals(__m128i c, bool *ok)
+{
+	__m128i lower = _mm_or_si128(c, _mm_set1_epi8(0x20));
+	__m128i isdigit, isalpha;
+
+	/* Signed compares: chars >= 0x80 fail both. */
+	isdigit = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)),
+				_mm_cmpgt_epi8(_mm_set1_epi8('9' + 1), c));
+	isalpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+				_mm_cmpgt_epi8(_mm_set1_epi8('f' + 1), lower));
+	if (_mm_movemask_epi8(_mm_or_si128(isdigit, isalpha)) != 0xFFFF)
+		*ok = false;
+
+	return _mm_or_si128(
+		_mm_and_si128(isdigit, _mm_sub_epi8(c, _mm_set1_epi8('0'))),
+		_mm_and_si128(isalpha, _mm_sub_epi8(lower,
+						    _mm_set1_epi8('a' - 10))));
+}
+
+/* Pairs of nibbles (high first) in each 16-bit lane, to bytes. */
+static __m128i sse2_pairs(__m128i v)
+{
+	__m128i hi = _mm_and_si128(v, _mm_set1_epi16(0x00FF));
+	__m128i lo = _mm_srli_epi16(v, 8);
+
+	return _mm_or_si128(_mm_slli_epi16(hi, 4), lo);
+}
+
+static __m128i sse2_hexchars(__m128i n)
+{
+	__m128i letter = _mm_cmpgt_epi8(n, _mm_set1_epi8(9));
+
+	return _mm_add_epi8(_mm_add_epi8(n, _mm_set1_epi8('0')),
+			    _mm_and_si128(letter,
+					  _mm_set1_epi8('a' - '0' - 10)));
+}
+#endif
+
+bool hex_decode_fast(const char *str, size_t slen, void *buf, size_t bufsize)
+{
+	u8 *p = buf;
+
+	if (slen != bufsize * 2)
+		return false;
+
+#ifdef __SSE2__
+	while (bufsize >= 16) {
+		bool ok = true;
+		__m128i a, b;
+
+		a = sse2_hexvals(_mm_loadu_si128((const __m128i *)str), &ok);
+		b = sse2_hexvals(_mm_loadu_si128((const __m128i *)(str + 16)),
+				 &ok);
+		if (!ok)
+			return false;
+		_mm_storeu_si128((__m128i *)p,
+				 _mm_packus_epi16(sse2_pairs(a), sse2_pairs(b)));
+		str += 32;
+		p += 16;
+		bufsize -= 16;
+	}
+#endif
+
+	while (bufsize) {
+		u8 v1 = hexval[(unsigned char)str[0]];
+		u8 v2 = hexval[(unsigned char)str[1]];
+
+		if ((v1 | v2) == 0xFF)
+			return false;
+		*(p++) = (v1 << 4) | v2;
+		str += 2;
+		bufsize--;
+	}
+	return true;
+}
+
+bool hex_encode_fast(const void *buf, size_t bufsize, char *dest,
+		     size_t destsize)
+{
+	const u8 *p = buf;
+
+	if (destsize < hex_str_size(bufsize))
+		return false;
+
+#ifdef __SSE2__
+	while (bufsize >= 16) {
+		__m128i b = _mm_loadu_si128((const __m128i *)p);
+		__m128i mask = _mm_set1_epi8(0x0F);
+		__m128i hi = _mm_and_si128(_mm_srli_epi16(b, 4), mask);
+		__m128i lo = _mm_and_si128(b, mask);
+
+		_mm_storeu_si128((__m128i *)dest,
+				 sse2_hexchars(_mm_unpacklo_epi8(hi, lo)));
+		_mm_storeu_si128((__m128i *)(dest + 16),
+				 sse2_hexchars(_mm_unpackhi_epi8(hi, lo)));
+		p += 16;
+		dest += 32;
+		bufsize -= 16;
+	}
+#endif
+
+	while (bufsize) {
+		*(dest++) = hexchars[*p >> 4];
+		*(dest++) = hexchars[*p & 0xF];
+		p++;
+		bufsize--;
+	}
+	*dest = '\0';
+	return true;
+}
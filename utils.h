@@ -3,6 +3,7 @@
 #include "config.h"
 #include <ccan/short_types/short_types.h>
 #include <ccan/tal/tal.h>
+#include <stdbool.h>
 
 /* Allocate and fill in a hex-encoded string of this data. */
 char *tal_hexstr(const tal_t *ctx, const void *data, size_t len);
@@ -10,4 +11,10 @@ char *tal_hexstr(const tal_t *ctx, const void *data, size_t len);
 /* Allocate and fill a buffer with the data of this hex string. */
 u8 *tal_hexdata(const tal_t *ctx, const void *str, size_t len);
 
+/* Same as ccan/str/hex's hex_decode and hex_encode, but 16 bytes at a time
+ * where we can: raw blocks are megabytes of hex. */
+bool hex_decode_fast(const char *str, size_t slen, void *buf, size_t bufsize);
+bool hex_encode_fast(const void *buf, size_t bufsize, char *dest,
+		     size_t destsize);
+
 #endif /* LIGHTNING_UTILS_H */